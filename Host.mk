@@ -0,0 +1,162 @@
+#
+# Build the MIDI/synth pipeline and a MIDI file to WAV driver for the host, for profiling
+#
+
+include Config.mk
+
+HOSTBUILDDIR		?=	build-host
+HOSTMT32EMUBUILDDIR	=	$(HOSTBUILDDIR)/munt
+HOSTMT32EMULIB		=	$(HOSTMT32EMUBUILDDIR)/libmt32emu.a
+HOSTFLUIDSYNTHBUILDDIR	=	$(HOSTBUILDDIR)/fluidsynth
+HOSTFLUIDSYNTHLIB	=	$(HOSTFLUIDSYNTHBUILDDIR)/src/libfluidsynth.a
+HOSTTARGET		=	$(HOSTBUILDDIR)/mt32-pi-host
+HOSTMICROBENCH		=	$(HOSTBUILDDIR)/mt32-pi-microbench
+
+HOSTCC			?=	cc
+HOSTCXX			?=	c++
+HOSTOPTFLAGS		?=	-O2 -g -fno-omit-frame-pointer
+
+# Build with ASan/UBSan
+SANITIZE		?=	0
+ifeq ($(strip $(SANITIZE)),1)
+HOSTOPTFLAGS		+=	-fsanitize=address,undefined
+HOSTLDFLAGS		+=	-fsanitize=address,undefined
+endif
+
+SRCS			:=	host/src/circle.cpp \
+				host/src/ff.cpp \
+				host/src/main.cpp \
+				src/bootprofiler.cpp \
+				src/config.cpp \
+				src/fileindex.cpp \
+				src/filesystemlock.cpp \
+				src/lcd/ui.cpp \
+				src/midifile.cpp \
+				src/midiinput.cpp \
+				src/midimonitor.cpp \
+				src/midiparser.cpp \
+				src/renderbenchmark.cpp \
+				src/renderstats.cpp \
+				src/rommanager.cpp \
+				src/soundfontmanager.cpp \
+				src/synth/fxstage.cpp \
+				src/synth/fxunits.cpp \
+				src/synth/mt32synth.cpp \
+				src/synth/outputmeter.cpp \
+				src/synth/polyphaseresampler.cpp \
+				src/synth/soundfontcache.cpp \
+				src/synth/soundfontsynth.cpp \
+				src/tracer.cpp \
+				src/zoneallocator.cpp
+
+OBJS			:=	$(SRCS:%.cpp=$(HOSTBUILDDIR)/obj/%.o) \
+				$(HOSTBUILDDIR)/obj/inih/ini.o
+
+MICROBENCHSRCS		:=	host/src/circle.cpp \
+				host/src/microbench.cpp \
+				src/midimonitor.cpp \
+				src/midiparser.cpp \
+				src/zoneallocator.cpp
+
+MICROBENCHOBJS		:=	$(MICROBENCHSRCS:%.cpp=$(HOSTBUILDDIR)/obj/%.o)
+
+# The Circle and FatFs shims must be found before anything else
+HOSTINCLUDE		:=	-I host/include \
+				-I include \
+				-I . \
+				-I $(INIHHOME) \
+				-I $(HOSTMT32EMUBUILDDIR)/include \
+				-I $(HOSTFLUIDSYNTHBUILDDIR)/include \
+				-I $(FLUIDSYNTHHOME)/include
+
+HOSTCFLAGS		:=	$(HOSTOPTFLAGS) -Wall -Wextra -Wno-unused-parameter -MMD -MP -D MT32_PI_HOST
+HOSTCXXFLAGS		:=	$(HOSTCFLAGS) -std=c++17
+
+VERSION			:=	$(shell git describe --tags --dirty --always 2>/dev/null)
+ifneq ($(VERSION),)
+HOSTCXXFLAGS		+=	-D MT32_PI_VERSION=\"$(VERSION)\"
+endif
+
+.DEFAULT_GOAL=all
+.PHONY: all clean
+
+all: $(HOSTTARGET) $(HOSTMICROBENCH)
+
+#
+# mt32emu for the host
+#
+$(HOSTMT32EMUBUILDDIR)/.done:
+	@CC="$(HOSTCC)" CXX="$(HOSTCXX)" \
+	cmake -B $(HOSTMT32EMUBUILDDIR) \
+		 -DCMAKE_CXX_FLAGS_RELEASE="-O3 -g" \
+		 -DCMAKE_BUILD_TYPE=Release \
+		 -Dlibmt32emu_C_INTERFACE=FALSE \
+		 -Dlibmt32emu_SHARED=FALSE \
+		 $(MT32EMUHOME) \
+		 >/dev/null
+	@cmake --build $(HOSTMT32EMUBUILDDIR)
+	@touch $@
+
+#
+# FluidSynth for the host, with the same patch and features as the kernel's
+#
+$(HOSTFLUIDSYNTHBUILDDIR)/.done:
+	@CC="$(HOSTCC)" CXX="$(HOSTCXX)" \
+	cmake -B $(HOSTFLUIDSYNTHBUILDDIR) \
+		 -DCMAKE_C_FLAGS_RELEASE="-O3 -g -fopenmp-simd" \
+		 -DCMAKE_BUILD_TYPE=Release \
+		 -DBUILD_SHARED_LIBS=OFF \
+		 -Denable-aufile=OFF \
+		 -Denable-dbus=OFF \
+		 -Denable-dsound=OFF \
+		 -Denable-floats=ON \
+		 -Denable-ipv6=OFF \
+		 -Denable-jack=OFF \
+		 -Denable-ladspa=OFF \
+		 -Denable-libinstpatch=OFF \
+		 -Denable-libsndfile=OFF \
+		 -Denable-midishare=OFF \
+		 -Denable-network=OFF \
+		 -Denable-oboe=OFF \
+		 -Denable-openmp=OFF \
+		 -Denable-opensles=OFF \
+		 -Denable-oss=OFF \
+		 -Denable-pipewire=OFF \
+		 -Denable-pulseaudio=OFF \
+		 -Denable-readline=OFF \
+		 -Denable-sdl2=OFF \
+		 -Denable-threads=OFF \
+		 -Denable-waveout=OFF \
+		 -Denable-winmidi=OFF \
+		 $(FLUIDSYNTHHOME) \
+		 >/dev/null
+	@cmake --build $(HOSTFLUIDSYNTHBUILDDIR) --target libfluidsynth
+	@touch $@
+
+#
+# Driver
+#
+$(OBJS): $(HOSTMT32EMUBUILDDIR)/.done $(HOSTFLUIDSYNTHBUILDDIR)/.done
+
+$(HOSTBUILDDIR)/obj/%.o: %.cpp
+	@mkdir -p $(dir $@)
+	@echo "  HOSTCXX $<"
+	@$(HOSTCXX) $(HOSTCXXFLAGS) $(HOSTINCLUDE) -c -o $@ $<
+
+$(HOSTBUILDDIR)/obj/inih/ini.o: $(INIHHOME)/ini.c
+	@mkdir -p $(dir $@)
+	@echo "  HOSTCC  $<"
+	@$(HOSTCC) $(HOSTCFLAGS) -c -o $@ $<
+
+$(HOSTTARGET): $(OBJS)
+	@echo "  HOSTLD  $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $(OBJS) $(HOSTMT32EMULIB) $(HOSTFLUIDSYNTHLIB) -lm
+
+$(HOSTMICROBENCH): $(MICROBENCHOBJS)
+	@echo "  HOSTLD  $@"
+	@$(HOSTCXX) $(HOSTLDFLAGS) -o $@ $(MICROBENCHOBJS) -lpthread
+
+clean:
+	@$(RM) -r $(HOSTBUILDDIR)/obj $(HOSTTARGET) $(HOSTMICROBENCH)
+
+-include $(OBJS:.o=.d) $(MICROBENCHOBJS:.o=.d)
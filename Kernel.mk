@@ -4,12 +4,17 @@
 
 include Config.mk
 
-OBJS		:=	src/config.o \
+OBJS		:=	src/bootprofiler.o \
+			src/config.o \
 			src/control/control.o \
 			src/control/mister.o \
 			src/control/rotaryencoder.o \
 			src/control/simplebuttons.o \
 			src/control/simpleencoder.o \
+			src/cpuload.o \
+			src/deferredlog.o \
+			src/fileindex.o \
+			src/filesystemlock.o \
 			src/kernel.o \
 			src/lcd/drivers/hd44780.o \
 			src/lcd/drivers/hd44780fourbit.o \
@@ -18,19 +23,36 @@ OBJS		:=	src/config.o \
 			src/lcd/drivers/ssd1306.o \
 			src/lcd/ui.o \
 			src/main.o \
+			src/midicapture.o \
+			src/midifile.o \
+			src/midiinput.o \
 			src/midimonitor.o \
 			src/midiparser.o \
+			src/midirouter.o \
 			src/mt32pi.o \
 			src/net/applemidi.o \
 			src/net/ftpdaemon.o \
 			src/net/ftpworker.o \
+			src/net/httpdaemon.o \
+			src/net/pcmstreamer.o \
+			src/net/recoveryjournal.o \
 			src/net/udpmidi.o \
 			src/pisound.o \
 			src/power.o \
+			src/renderbenchmark.o \
+			src/renderstats.o \
 			src/rommanager.o \
 			src/soundfontmanager.o \
+			src/soundoutput.o \
+			src/storagescanner.o \
+			src/synth/fxstage.o \
+			src/synth/fxunits.o \
 			src/synth/mt32synth.o \
+			src/synth/outputmeter.o \
+			src/synth/polyphaseresampler.o \
+			src/synth/soundfontcache.o \
 			src/synth/soundfontsynth.o \
+			src/tracer.o \
 			src/zoneallocator.o
 
 EXTRACLEAN	+=	src/*.d src/*.o \
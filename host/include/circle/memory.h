@@ -0,0 +1,49 @@
+//
+// memory.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host build shim for Circle's memory system; the heap regions are carved out of the host's heap
+
+#ifndef _circle_memory_h
+#define _circle_memory_h
+
+#include <cstddef>
+
+#include <circle/alloc.h>
+#include <circle/sysconfig.h>
+
+class CMemorySystem
+{
+public:
+	static CMemorySystem* Get();
+
+	// Free space reported for each heap region
+	void SetHeapSize(size_t nSize) { m_nHeapSize = nSize; }
+
+	size_t GetHeapFreeSpace(int nHeap) const { return m_nHeapSize; }
+	void* HeapAllocate(size_t nSize, int nHeap) { return malloc(nSize); }
+	void HeapFree(void* pBlock) { free(pBlock); }
+
+private:
+	size_t m_nHeapSize = 256 * MEGABYTE;
+};
+
+#endif
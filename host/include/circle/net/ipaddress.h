@@ -0,0 +1,45 @@
+//
+// ipaddress.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host build shim for Circle's IP address class
+
+#ifndef _circle_net_ipaddress_h
+#define _circle_net_ipaddress_h
+
+#include <circle/types.h>
+#include <circle/util.h>
+
+class CIPAddress
+{
+public:
+	CIPAddress(u32 nAddress = 0) : m_nAddress(nAddress) {}
+
+	void Set(const u8* pAddress) { memcpy(&m_nAddress, pAddress, sizeof(m_nAddress)); }
+	u32 Get() const { return m_nAddress; }
+
+	bool operator==(const CIPAddress& Other) const { return m_nAddress == Other.m_nAddress; }
+
+private:
+	u32 m_nAddress;
+};
+
+#endif
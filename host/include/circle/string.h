@@ -0,0 +1,51 @@
+//
+// string.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host build shim for Circle's string class
+
+#ifndef _circle_string_h
+#define _circle_string_h
+
+#include <cstdarg>
+#include <string>
+
+class CString
+{
+public:
+	CString() = default;
+	CString(const char* pString) : m_String(pString ? pString : "") {}
+
+	operator const char*() const { return m_String.c_str(); }
+	const char* operator=(const char* pString) { m_String = pString ? pString : ""; return *this; }
+
+	size_t GetLength() const { return m_String.length(); }
+	void Append(const char* pString) { m_String += pString; }
+	int Compare(const char* pString) const { return m_String.compare(pString); }
+
+	void Format(const char* pFormat, ...);
+	void FormatV(const char* pFormat, va_list Args);
+
+private:
+	std::string m_String;
+};
+
+#endif
@@ -0,0 +1,42 @@
+//
+// synchronize.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host build shim for Circle's execution levels and memory barriers
+
+#ifndef _circle_synchronize_h
+#define _circle_synchronize_h
+
+#include <atomic>
+
+#define TASK_LEVEL	0
+#define IRQ_LEVEL	1
+#define FIQ_LEVEL	2
+
+// There are no interrupts on the host; critical sections only need to order memory accesses
+inline void EnterCritical(unsigned nTargetLevel = IRQ_LEVEL) { std::atomic_thread_fence(std::memory_order_acquire); }
+inline void LeaveCritical() { std::atomic_thread_fence(std::memory_order_release); }
+
+inline void DataMemBarrier() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline void DataSyncBarrier() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+inline void InstructionSyncBarrier() { std::atomic_signal_fence(std::memory_order_seq_cst); }
+
+#endif
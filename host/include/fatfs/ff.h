@@ -0,0 +1,133 @@
+//
+// ff.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host build shim for the subset of the FatFs API used by mt32-pi, backed by the host's file system.
+// A volume ("SD:", "USB:") is mapped to a host directory by mounting it with the directory set in
+// FATFS::pRootPath; paths without a volume prefix refer to the first mounted volume.
+
+#ifndef _fatfs_ff_h
+#define _fatfs_ff_h
+
+#include <cstdio>
+
+#include <circle/types.h>
+
+#define FF_USE_FASTSEEK		0
+
+typedef u8	BYTE;
+typedef u16	WORD;
+typedef u32	DWORD;
+typedef u64	QWORD;
+typedef unsigned int UINT;
+typedef char	TCHAR;
+typedef u64	FSIZE_t;
+
+typedef enum
+{
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_NO_PATH,
+	FR_INVALID_NAME,
+	FR_DENIED,
+	FR_EXIST,
+	FR_INVALID_OBJECT,
+	FR_WRITE_PROTECTED,
+	FR_INVALID_DRIVE,
+	FR_NOT_ENABLED,
+	FR_NO_FILESYSTEM,
+	FR_MKFS_ABORTED,
+	FR_TIMEOUT,
+	FR_LOCKED,
+	FR_NOT_ENOUGH_CORE,
+	FR_TOO_MANY_OPEN_FILES,
+	FR_INVALID_PARAMETER
+} FRESULT;
+
+// File access modes
+#define FA_READ			0x01
+#define FA_WRITE		0x02
+#define FA_OPEN_EXISTING	0x00
+#define FA_CREATE_NEW		0x04
+#define FA_CREATE_ALWAYS	0x08
+#define FA_OPEN_ALWAYS		0x10
+#define FA_OPEN_APPEND		0x30
+
+// File attributes
+#define AM_RDO			0x01
+#define AM_HID			0x02
+#define AM_SYS			0x04
+#define AM_DIR			0x10
+#define AM_ARC			0x20
+
+typedef struct
+{
+	const char* pRootPath;
+} FATFS;
+
+typedef struct
+{
+	FILE* pFile;
+	FSIZE_t fptr;
+	FSIZE_t objsize;
+} FIL;
+
+typedef struct
+{
+	void* pDir;
+	char DirPath[256];
+	char Pattern[64];
+} DIR;
+
+typedef struct
+{
+	FSIZE_t fsize;
+	WORD fdate;
+	WORD ftime;
+	BYTE fattrib;
+	TCHAR fname[256];
+} FILINFO;
+
+#define f_size(fp)	((fp)->objsize)
+#define f_tell(fp)	((fp)->fptr)
+#define f_eof(fp)	((int)((fp)->fptr == (fp)->objsize))
+
+FRESULT f_mount(FATFS* fs, const TCHAR* path, BYTE opt);
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode);
+FRESULT f_close(FIL* fp);
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw);
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs);
+FRESULT f_sync(FIL* fp);
+FRESULT f_opendir(DIR* dp, const TCHAR* path);
+FRESULT f_closedir(DIR* dp);
+FRESULT f_readdir(DIR* dp, FILINFO* fno);
+FRESULT f_findfirst(DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);
+FRESULT f_findnext(DIR* dp, FILINFO* fno);
+FRESULT f_stat(const TCHAR* path, FILINFO* fno);
+FRESULT f_unlink(const TCHAR* path);
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new);
+FRESULT f_mkdir(const TCHAR* path);
+
+#endif
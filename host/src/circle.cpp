@@ -0,0 +1,121 @@
+//
+// circle.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Implementations of the Circle shims used by the host build
+
+#include <circle/logger.h>
+#include <circle/machineinfo.h>
+#include <circle/memory.h>
+#include <circle/string.h>
+#include <circle/timer.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+static const auto StartTime = std::chrono::steady_clock::now();
+
+CTimer* CTimer::Get()
+{
+	static CTimer Timer;
+	return &Timer;
+}
+
+u64 CTimer::GetClockTicks64()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - StartTime).count();
+}
+
+void CTimer::SimpleMsDelay(unsigned nMilliSeconds)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(nMilliSeconds));
+}
+
+void CTimer::SimpleusDelay(unsigned nMicroSeconds)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(nMicroSeconds));
+}
+
+CLogger* CLogger::Get()
+{
+	static CLogger Logger;
+	return &Logger;
+}
+
+void CLogger::Write(const char* pSource, TLogSeverity Severity, const char* pMessage, ...)
+{
+	va_list Args;
+	va_start(Args, pMessage);
+	WriteV(pSource, Severity, pMessage, Args);
+	va_end(Args);
+}
+
+void CLogger::WriteV(const char* pSource, TLogSeverity Severity, const char* pMessage, va_list Args)
+{
+	static const char* const SeverityNames[] = { "!", "E", "W", "N", "D" };
+
+	if (Severity > m_Level)
+		return;
+
+	const double nSeconds = CTimer::GetClockTicks64() / 1000000.0;
+	fprintf(stderr, "%10.6f %s %s: ", nSeconds, SeverityNames[Severity], pSource);
+	vfprintf(stderr, pMessage, Args);
+	fputc('\n', stderr);
+}
+
+void CString::Format(const char* pFormat, ...)
+{
+	va_list Args;
+	va_start(Args, pFormat);
+	FormatV(pFormat, Args);
+	va_end(Args);
+}
+
+void CString::FormatV(const char* pFormat, va_list Args)
+{
+	va_list ArgsCopy;
+	va_copy(ArgsCopy, Args);
+	const int nLength = vsnprintf(nullptr, 0, pFormat, ArgsCopy);
+	va_end(ArgsCopy);
+
+	if (nLength < 0)
+	{
+		m_String.clear();
+		return;
+	}
+
+	m_String.resize(nLength + 1);
+	vsnprintf(&m_String[0], nLength + 1, pFormat, Args);
+	m_String.resize(nLength);
+}
+
+CMemorySystem* CMemorySystem::Get()
+{
+	static CMemorySystem MemorySystem;
+	return &MemorySystem;
+}
+
+CMachineInfo* CMachineInfo::Get()
+{
+	static CMachineInfo MachineInfo;
+	return &MachineInfo;
+}
@@ -0,0 +1,392 @@
+//
+// ff.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// FatFs shim for the host build
+
+#include <fatfs/ff.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utility.h"
+
+struct TVolume
+{
+	char Name[8];
+	const char* pRootPath;
+};
+
+static TVolume Volumes[4];
+
+static FRESULT ErrnoToResult(int nError)
+{
+	switch (nError)
+	{
+		case ENOENT:	return FR_NO_FILE;
+		case ENOTDIR:	return FR_NO_PATH;
+		case EACCES:
+		case EPERM:
+		case EISDIR:
+		case ENOTEMPTY:	return FR_DENIED;
+		case EEXIST:	return FR_EXIST;
+		case EROFS:	return FR_WRITE_PROTECTED;
+		case ENOMEM:	return FR_NOT_ENOUGH_CORE;
+		case EMFILE:
+		case ENFILE:	return FR_TOO_MANY_OPEN_FILES;
+		default:	return FR_DISK_ERR;
+	}
+}
+
+// Maps "SD:path" or "SD:/path" (or "path" on the first mounted volume) to a path on the host
+static FRESULT GetHostPath(const TCHAR* pPath, char* pOutPath, size_t nOutSize)
+{
+	const TVolume* pVolume = nullptr;
+	const char* pSeparator = strchr(pPath, ':');
+
+	if (pSeparator)
+	{
+		const size_t nNameLength = pSeparator - pPath;
+		for (const TVolume& Volume : Volumes)
+		{
+			if (Volume.pRootPath && strlen(Volume.Name) == nNameLength && !strncasecmp(Volume.Name, pPath, nNameLength))
+			{
+				pVolume = &Volume;
+				break;
+			}
+		}
+
+		pPath = pSeparator + 1;
+	}
+	else
+	{
+		for (const TVolume& Volume : Volumes)
+		{
+			if (Volume.pRootPath)
+			{
+				pVolume = &Volume;
+				break;
+			}
+		}
+	}
+
+	if (!pVolume)
+		return FR_INVALID_DRIVE;
+
+	while (*pPath == '/')
+		++pPath;
+
+	if (snprintf(pOutPath, nOutSize, "%s/%s", pVolume->pRootPath, pPath) >= static_cast<int>(nOutSize))
+		return FR_INVALID_NAME;
+
+	return FR_OK;
+}
+
+static void FillFileInfo(const char* pName, const struct stat& Stat, FILINFO* fno)
+{
+	struct tm Time;
+	localtime_r(&Stat.st_mtime, &Time);
+
+	fno->fsize = S_ISDIR(Stat.st_mode) ? 0 : Stat.st_size;
+	fno->fdate = ((Utility::Max(Time.tm_year - 80, 0)) << 9) | ((Time.tm_mon + 1) << 5) | Time.tm_mday;
+	fno->ftime = (Time.tm_hour << 11) | (Time.tm_min << 5) | (Time.tm_sec / 2);
+	fno->fattrib = S_ISDIR(Stat.st_mode) ? AM_DIR : AM_ARC;
+
+	if (pName[0] == '.')
+		fno->fattrib |= AM_HID;
+
+	strncpy(fno->fname, pName, sizeof(fno->fname) - 1);
+	fno->fname[sizeof(fno->fname) - 1] = '\0';
+}
+
+FRESULT f_mount(FATFS* fs, const TCHAR* path, BYTE opt)
+{
+	const char* pSeparator = strchr(path, ':');
+	const size_t nNameLength = pSeparator ? static_cast<size_t>(pSeparator - path) : strlen(path);
+
+	if (nNameLength == 0 || nNameLength >= sizeof(TVolume::Name))
+		return FR_INVALID_DRIVE;
+
+	TVolume* pFreeVolume = nullptr;
+	for (TVolume& Volume : Volumes)
+	{
+		if (Volume.pRootPath && strlen(Volume.Name) == nNameLength && !strncasecmp(Volume.Name, path, nNameLength))
+		{
+			// Remount or unmount
+			Volume.pRootPath = fs ? fs->pRootPath : nullptr;
+			return FR_OK;
+		}
+
+		if (!Volume.pRootPath && !pFreeVolume)
+			pFreeVolume = &Volume;
+	}
+
+	if (!fs)
+		return FR_OK;
+
+	if (!pFreeVolume)
+		return FR_INVALID_DRIVE;
+
+	struct stat Stat;
+	if (!fs->pRootPath || stat(fs->pRootPath, &Stat) != 0 || !S_ISDIR(Stat.st_mode))
+		return FR_NOT_READY;
+
+	memcpy(pFreeVolume->Name, path, nNameLength);
+	pFreeVolume->Name[nNameLength] = '\0';
+	pFreeVolume->pRootPath = fs->pRootPath;
+
+	return FR_OK;
+}
+
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode)
+{
+	char HostPath[512];
+	FRESULT Result = GetHostPath(path, HostPath, sizeof(HostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	struct stat Stat;
+	const bool bExists = stat(HostPath, &Stat) == 0;
+
+	if (bExists && S_ISDIR(Stat.st_mode))
+		return FR_DENIED;
+
+	const char* pMode;
+	if (!(mode & FA_WRITE))
+		pMode = "rb";
+	else if (mode & FA_CREATE_ALWAYS)
+		pMode = "w+b";
+	else if (mode & FA_CREATE_NEW)
+	{
+		if (bExists)
+			return FR_EXIST;
+		pMode = "w+b";
+	}
+	else if (mode & FA_OPEN_ALWAYS)
+		pMode = bExists ? "r+b" : "w+b";
+	else
+		pMode = "r+b";
+
+	fp->pFile = fopen(HostPath, pMode);
+	if (!fp->pFile)
+		return ErrnoToResult(errno);
+
+	fseeko(fp->pFile, 0, SEEK_END);
+	fp->objsize = ftello(fp->pFile);
+
+	// FA_OPEN_APPEND includes FA_OPEN_ALWAYS
+	if ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+		fp->fptr = fp->objsize;
+	else
+	{
+		fseeko(fp->pFile, 0, SEEK_SET);
+		fp->fptr = 0;
+	}
+
+	return FR_OK;
+}
+
+FRESULT f_close(FIL* fp)
+{
+	if (!fp->pFile)
+		return FR_INVALID_OBJECT;
+
+	const int nResult = fclose(fp->pFile);
+	fp->pFile = nullptr;
+
+	return nResult == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br)
+{
+	const size_t nRead = fread(buff, 1, btr, fp->pFile);
+	fp->fptr += nRead;
+	*br = nRead;
+
+	return ferror(fp->pFile) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw)
+{
+	const size_t nWritten = fwrite(buff, 1, btw, fp->pFile);
+	fp->fptr += nWritten;
+	fp->objsize = Utility::Max(fp->objsize, fp->fptr);
+	*bw = nWritten;
+
+	return ferror(fp->pFile) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs)
+{
+	if (fseeko(fp->pFile, ofs, SEEK_SET) != 0)
+		return FR_DISK_ERR;
+
+	fp->fptr = ofs;
+	return FR_OK;
+}
+
+FRESULT f_sync(FIL* fp)
+{
+	return fflush(fp->pFile) == 0 ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT f_opendir(DIR* dp, const TCHAR* path)
+{
+	FRESULT Result = GetHostPath(path, dp->DirPath, sizeof(dp->DirPath));
+	if (Result != FR_OK)
+		return Result;
+
+	// <dirent.h> can't be used alongside FatFs' DIR
+	std::error_code Error;
+	std::filesystem::directory_iterator Iterator(dp->DirPath, Error);
+	if (Error)
+		return Error.value() == ENOENT ? FR_NO_PATH : ErrnoToResult(Error.value());
+
+	dp->pDir = new std::filesystem::directory_iterator(std::move(Iterator));
+
+	strcpy(dp->Pattern, "*");
+	return FR_OK;
+}
+
+FRESULT f_closedir(DIR* dp)
+{
+	if (!dp->pDir)
+		return FR_INVALID_OBJECT;
+
+	delete static_cast<std::filesystem::directory_iterator*>(dp->pDir);
+	dp->pDir = nullptr;
+
+	return FR_OK;
+}
+
+FRESULT f_readdir(DIR* dp, FILINFO* fno)
+{
+	auto& Iterator = *static_cast<std::filesystem::directory_iterator*>(dp->pDir);
+	std::error_code Error;
+
+	for (; Iterator != std::filesystem::directory_iterator(); Iterator.increment(Error))
+	{
+		const std::string Name = Iterator->path().filename().string();
+
+		if (fnmatch(dp->Pattern, Name.c_str(), FNM_CASEFOLD) != 0)
+			continue;
+
+		struct stat Stat;
+		if (stat(Iterator->path().c_str(), &Stat) != 0)
+			continue;
+
+		FillFileInfo(Name.c_str(), Stat, fno);
+		Iterator.increment(Error);
+		return FR_OK;
+	}
+
+	// End of directory
+	fno->fname[0] = '\0';
+	return FR_OK;
+}
+
+FRESULT f_findfirst(DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern)
+{
+	FRESULT Result = f_opendir(dp, path);
+	if (Result != FR_OK)
+		return Result;
+
+	strncpy(dp->Pattern, pattern, sizeof(dp->Pattern) - 1);
+	dp->Pattern[sizeof(dp->Pattern) - 1] = '\0';
+
+	return f_readdir(dp, fno);
+}
+
+FRESULT f_findnext(DIR* dp, FILINFO* fno)
+{
+	return f_readdir(dp, fno);
+}
+
+FRESULT f_stat(const TCHAR* path, FILINFO* fno)
+{
+	char HostPath[512];
+	FRESULT Result = GetHostPath(path, HostPath, sizeof(HostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	struct stat Stat;
+	if (stat(HostPath, &Stat) != 0)
+		return ErrnoToResult(errno);
+
+	if (fno)
+	{
+		const char* pName = strrchr(HostPath, '/');
+		FillFileInfo(pName ? pName + 1 : HostPath, Stat, fno);
+	}
+
+	return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR* path)
+{
+	char HostPath[512];
+	FRESULT Result = GetHostPath(path, HostPath, sizeof(HostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	if (unlink(HostPath) != 0 && (errno != EISDIR || rmdir(HostPath) != 0))
+		return ErrnoToResult(errno);
+
+	return FR_OK;
+}
+
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new)
+{
+	char OldHostPath[512];
+	char NewHostPath[512];
+	FRESULT Result = GetHostPath(path_old, OldHostPath, sizeof(OldHostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	// As with FatFs, the new path is on the same volume as the old one; any volume prefix is ignored
+	const char* pOldSeparator = strchr(path_old, ':');
+	const char* pNewSeparator = strchr(path_new, ':');
+	const int nVolumeLength = pOldSeparator ? pOldSeparator - path_old + 1 : 0;
+
+	char NewPath[512];
+	snprintf(NewPath, sizeof(NewPath), "%.*s%s", nVolumeLength, path_old, pNewSeparator ? pNewSeparator + 1 : path_new);
+
+	Result = GetHostPath(NewPath, NewHostPath, sizeof(NewHostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	return rename(OldHostPath, NewHostPath) == 0 ? FR_OK : ErrnoToResult(errno);
+}
+
+FRESULT f_mkdir(const TCHAR* path)
+{
+	char HostPath[512];
+	FRESULT Result = GetHostPath(path, HostPath, sizeof(HostPath));
+	if (Result != FR_OK)
+		return Result;
+
+	return mkdir(HostPath, 0777) == 0 ? FR_OK : ErrnoToResult(errno);
+}
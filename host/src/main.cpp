@@ -0,0 +1,407 @@
+//
+// main.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Host driver: plays a Standard MIDI File through the same MIDI input, synth and output conversion code
+// as the kernel, and writes the result to a WAV file, so that the hot paths can be profiled on a desktop
+
+#include <circle/logger.h>
+#include <circle/memory.h>
+#include <circle/timer.h>
+#include <fatfs/ff.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <vector>
+
+#include "audioconvert.h"
+#include "config.h"
+#include "lcd/ui.h"
+#include "midifile.h"
+#include "midiinput.h"
+#include "renderbenchmark.h"
+#include "renderstats.h"
+#include "synth/mt32synth.h"
+#include "synth/soundfontsynth.h"
+#include "zoneallocator.h"
+
+LOGMODULE("host");
+
+constexpr unsigned int DefaultTailSeconds = 2;
+
+// 24-bit stereo PCM WAV file
+class CWAVWriter
+{
+public:
+	CWAVWriter() : m_pFile(nullptr), m_nDataSize(0) {}
+	~CWAVWriter() { Close(); }
+
+	bool Open(const char* pPath, unsigned int nSampleRate)
+	{
+		m_pFile = fopen(pPath, "wb");
+		if (!m_pFile)
+			return false;
+
+		m_nSampleRate = nSampleRate;
+		m_nDataSize = 0;
+		WriteHeader();
+		return true;
+	}
+
+	void Write(const u8* pData, size_t nSize)
+	{
+		if (!m_pFile)
+			return;
+
+		fwrite(pData, 1, nSize, m_pFile);
+		m_nDataSize += nSize;
+	}
+
+	void Close()
+	{
+		if (!m_pFile)
+			return;
+
+		// Rewrite the header now that the sizes are known
+		fseek(m_pFile, 0, SEEK_SET);
+		WriteHeader();
+		fclose(m_pFile);
+		m_pFile = nullptr;
+	}
+
+private:
+	static constexpr u16 Channels = 2;
+	static constexpr u16 BitsPerSample = 24;
+
+	void WriteHeader()
+	{
+		const u16 nBlockAlign = Channels * BitsPerSample / 8;
+		u8 Header[44];
+
+		memcpy(Header, "RIFF", 4);
+		PutLE(Header + 4, 36 + m_nDataSize, 4);
+		memcpy(Header + 8, "WAVEfmt ", 8);
+		PutLE(Header + 16, 16, 4);
+		PutLE(Header + 20, 1, 2);
+		PutLE(Header + 22, Channels, 2);
+		PutLE(Header + 24, m_nSampleRate, 4);
+		PutLE(Header + 28, m_nSampleRate * nBlockAlign, 4);
+		PutLE(Header + 32, nBlockAlign, 2);
+		PutLE(Header + 34, BitsPerSample, 2);
+		memcpy(Header + 36, "data", 4);
+		PutLE(Header + 40, m_nDataSize, 4);
+
+		fwrite(Header, 1, sizeof(Header), m_pFile);
+	}
+
+	static void PutLE(u8* pOut, u32 nValue, size_t nBytes)
+	{
+		for (size_t i = 0; i < nBytes; ++i)
+			pOut[i] = nValue >> (8 * i);
+	}
+
+	FILE* m_pFile;
+	unsigned int m_nSampleRate;
+	u32 m_nDataSize;
+};
+
+static void PrintUsage(const char* pProgramName)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input.mid> [output.wav]\n"
+		"       %s [options] -b <results.csv>\n"
+		"\n"
+		"Options:\n"
+		"  -b <file>       Run the benchmark suite in the SD card's benchmark directory, writing CSV\n"
+		"                  results to <file> (- for standard output)\n"
+		"  -d <directory>  Directory to use as the SD card (default: sdcard)\n"
+		"  -s <synth>      Synth to use: mt32 or soundfont (default: from config)\n"
+		"  -f <index>      SoundFont index (default: from config)\n"
+		"  -r <rate>       Sample rate (default: from config)\n"
+		"  -c <frames>     Frames rendered per block (default: chunk_size from config)\n"
+		"  -m <megabytes>  Size of the heap for the zone allocator (default: 256)\n"
+		"  -t <seconds>    Time to keep rendering after the last event (default: %d)\n"
+		"  -v              Log debug messages\n"
+		"\n"
+		"If no output file is given, audio is rendered and converted but discarded.\n",
+		pProgramName, pProgramName, DefaultTailSeconds);
+}
+
+static CSynthBase* CreateSynth(CConfig& Config, bool bMT32, CUserInterface& UI)
+{
+	CSynthBase* pSynth;
+
+	if (bMT32)
+	{
+		CMT32Synth* pMT32Synth = new CMT32Synth(Config.AudioSampleRate, Config.MT32EmuGain, Config.MT32EmuReverbGain, Config.MT32EmuResamplerQuality);
+		if (!pMT32Synth->Initialize())
+		{
+			LOGERR("mt32emu init failed; no ROMs present?");
+			delete pMT32Synth;
+			return nullptr;
+		}
+
+		if (Config.MT32EmuMIDIChannels == CMT32Synth::TMIDIChannels::Alternate)
+			pMT32Synth->SetMIDIChannels(Config.MT32EmuMIDIChannels);
+
+		pMT32Synth->SetReversedStereo(Config.MT32EmuReversedStereo);
+		pSynth = pMT32Synth;
+	}
+	else
+	{
+		CSoundFontSynth* pSoundFontSynth = new CSoundFontSynth(Config.AudioSampleRate);
+		if (!pSoundFontSynth->Initialize())
+		{
+			LOGERR("FluidSynth init failed; no SoundFonts present?");
+			delete pSoundFontSynth;
+			return nullptr;
+		}
+
+		pSynth = pSoundFontSynth;
+	}
+
+	pSynth->SetUserInterface(&UI);
+	return pSynth;
+}
+
+static bool ReadFile(const char* pPath, std::vector<u8>& OutData)
+{
+	FILE* pFile = fopen(pPath, "rb");
+	if (!pFile)
+		return false;
+
+	u8 Buffer[4096];
+	size_t nRead;
+	while ((nRead = fread(Buffer, 1, sizeof(Buffer), pFile)) > 0)
+		OutData.insert(OutData.end(), Buffer, Buffer + nRead);
+
+	fclose(pFile);
+	return true;
+}
+
+static bool RunBenchmark(CConfig& Config, const char* pResultsPath)
+{
+	CRenderBenchmark Benchmark(Config);
+	if (!Benchmark.Run("SD:/benchmark"))
+		return false;
+
+	const bool bStdout = !strcmp(pResultsPath, "-");
+	FILE* const pFile = bStdout ? stdout : fopen(pResultsPath, "w");
+	if (!pFile)
+	{
+		LOGERR("Couldn't open '%s' for writing", pResultsPath);
+		return false;
+	}
+
+	fputs(Benchmark.GetResults(), pFile);
+	if (!bStdout)
+		fclose(pFile);
+
+	return true;
+}
+
+// Hands complete messages to the synth the way the kernel's main task does
+static void DispatchMIDI(TMIDIMergeQueue& MergeQueue, CSynthBase* pSynth, float* pBuffer)
+{
+	TMIDIEvent Event;
+	while (MergeQueue.Dequeue(Event))
+	{
+		const unsigned int nTimestamp = CTimer::GetClockTicks();
+
+		// If the synth's queue is full, apply what's queued without advancing time
+		while (!(Event.pSysExData ? pSynth->QueueMIDISysExMessage(Event.pSysExData, Event.nMessage, nTimestamp) : pSynth->QueueMIDIShortMessage(Event.nMessage, nTimestamp)))
+			pSynth->Render(pBuffer, 0);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const char* pSDCardPath = "sdcard";
+	const char* pSynthName = nullptr;
+	const char* pBenchmarkPath = nullptr;
+	int nSoundFontIndex = -1;
+	int nSampleRate = 0;
+	int nChunkFrames = 0;
+	int nHeapMegabytes = 256;
+	unsigned int nTailSeconds = DefaultTailSeconds;
+
+	int nOption;
+	while ((nOption = getopt(argc, argv, "b:d:s:f:r:c:m:t:vh")) != -1)
+	{
+		switch (nOption)
+		{
+			case 'b': pBenchmarkPath = optarg; break;
+			case 'd': pSDCardPath = optarg; break;
+			case 's': pSynthName = optarg; break;
+			case 'f': nSoundFontIndex = atoi(optarg); break;
+			case 'r': nSampleRate = atoi(optarg); break;
+			case 'c': nChunkFrames = atoi(optarg); break;
+			case 'm': nHeapMegabytes = atoi(optarg); break;
+			case 't': nTailSeconds = atoi(optarg); break;
+			case 'v': CLogger::Get()->SetLevel(LogDebug); break;
+
+			default:
+				PrintUsage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (pBenchmarkPath ? optind != argc : (optind >= argc || argc - optind > 2))
+	{
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char* pInputPath = optind < argc ? argv[optind] : nullptr;
+	const char* pOutputPath = optind + 1 < argc ? argv[optind + 1] : nullptr;
+
+	FATFS SDFileSystem = { pSDCardPath };
+	if (f_mount(&SDFileSystem, "SD:", 1) != FR_OK)
+	{
+		LOGERR("Couldn't use '%s' as the SD card", pSDCardPath);
+		return EXIT_FAILURE;
+	}
+
+	CConfig Config;
+	if (!Config.Initialize("mt32-pi.cfg"))
+		LOGWARN("Unable to find or parse config file; using defaults");
+
+	// Everything runs on one thread; features that need another core are turned off
+	Config.FluidSynthMultiCore = false;
+	Config.FluidSynthFXOffload = false;
+
+	if (nSampleRate > 0)
+		Config.AudioSampleRate = nSampleRate;
+	if (nChunkFrames > 0)
+		Config.AudioChunkSize = nChunkFrames;
+	if (nSoundFontIndex >= 0)
+		Config.FluidSynthSoundFont = nSoundFontIndex;
+
+	bool bMT32 = Config.SystemDefaultSynth == CConfig::TSystemDefaultSynth::MT32;
+	if (pSynthName)
+	{
+		if (!strcasecmp(pSynthName, "mt32"))
+			bMT32 = true;
+		else if (!strcasecmp(pSynthName, "soundfont"))
+			bMT32 = false;
+		else
+		{
+			PrintUsage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	CMemorySystem::Get()->SetHeapSize(static_cast<size_t>(nHeapMegabytes) * MEGABYTE);
+	CZoneAllocator Allocator;
+	if (!Allocator.Initialize())
+		return EXIT_FAILURE;
+
+	if (pBenchmarkPath)
+		return RunBenchmark(Config, pBenchmarkPath) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	// The input file isn't on the SD card, so read it directly
+	std::vector<u8> MIDIData;
+	if (!ReadFile(pInputPath, MIDIData))
+	{
+		LOGERR("Couldn't open '%s'", pInputPath);
+		return EXIT_FAILURE;
+	}
+
+	CMIDIFile MIDIFile;
+	if (!MIDIFile.Parse(MIDIData.data(), MIDIData.size(), pInputPath))
+		return EXIT_FAILURE;
+
+	CUserInterface UI;
+	CSynthBase* const pSynth = CreateSynth(Config, bMT32, UI);
+	if (!pSynth)
+		return EXIT_FAILURE;
+
+	CWAVWriter WAVWriter;
+	if (pOutputPath && !WAVWriter.Open(pOutputPath, Config.AudioSampleRate))
+	{
+		LOGERR("Couldn't open '%s' for writing", pOutputPath);
+		return EXIT_FAILURE;
+	}
+
+	TMIDIMergeQueue MergeQueue;
+	CMIDIInputParser Parser("smf", MergeQueue);
+	CRenderStats SynthStats;
+	CRenderStats OutputStats;
+
+	const unsigned int nRate = Config.AudioSampleRate;
+	const size_t nChunkSize = Config.AudioChunkSize;
+	const bool bReversedStereo = Config.AudioReversedStereo;
+	const u64 nEndFrame = (MIDIFile.GetDurationMicros() + static_cast<u64>(nTailSeconds) * 1000000) * nRate / 1000000;
+
+	float* const pFloatBuffer = new float[nChunkSize * 2];
+	u8* const pPackedBuffer = new u8[nChunkSize * 2 * 3];
+
+	size_t nEvent = 0;
+	u64 nFrame = 0;
+	const u64 nStartTicks = CTimer::GetClockTicks64();
+
+	while (nFrame < nEndFrame)
+	{
+		// As on the kernel, events take effect at the start of the next block
+		const u64 nBlockMicros = (nFrame + nChunkSize) * 1000000 / nRate;
+		while (nEvent < MIDIFile.GetEventCount() && MIDIFile.GetEvent(nEvent).nMicros < nBlockMicros)
+		{
+			const CMIDIFile::TEvent& Event = MIDIFile.GetEvent(nEvent++);
+			Parser.ParseMIDIBytes(MIDIFile.GetEventData(Event), Event.nSize, CTimer::GetClockTicks());
+			DispatchMIDI(MergeQueue, pSynth, pFloatBuffer);
+		}
+
+		const unsigned int nRenderStartTicks = CTimer::GetClockTicks();
+		pSynth->Render(pFloatBuffer, nChunkSize);
+		const unsigned int nConvertStartTicks = CTimer::GetClockTicks();
+		AudioConvert::FloatToS24Packed(pFloatBuffer, pPackedBuffer, nChunkSize, bReversedStereo);
+		const unsigned int nEndTicks = CTimer::GetClockTicks();
+
+		SynthStats.AddBlock(nChunkSize, nConvertStartTicks - nRenderStartTicks, nRate);
+		SynthStats.AddActiveVoices(pSynth->GetActiveVoiceCount());
+		OutputStats.AddBlock(nChunkSize, nEndTicks - nConvertStartTicks, nRate);
+
+		WAVWriter.Write(pPackedBuffer, nChunkSize * 2 * 3);
+		nFrame += nChunkSize;
+	}
+
+	const u64 nElapsedMicros = CTimer::GetClockTicks64() - nStartTicks;
+	const u64 nAudioMicros = nFrame * 1000000 / nRate;
+	WAVWriter.Close();
+
+	if (Parser.TakeErrors())
+		LOGWARN("MIDI parser errors occurred");
+
+	LOGNOTE("Rendered %d.%03d s of audio in %d.%03d s (%.1fx realtime)",
+		static_cast<int>(nAudioMicros / 1000000), static_cast<int>(nAudioMicros / 1000 % 1000),
+		static_cast<int>(nElapsedMicros / 1000000), static_cast<int>(nElapsedMicros / 1000 % 1000),
+		nElapsedMicros ? static_cast<double>(nAudioMicros) / nElapsedMicros : 0.0);
+
+	SynthStats.Dump(bMT32 ? "mt32emu" : "FluidSynth");
+	OutputStats.Dump("Output conversion");
+
+	delete[] pPackedBuffer;
+	delete[] pFloatBuffer;
+	delete pSynth;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,499 @@
+//
+// microbench.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Micro-benchmarks for the runtime primitives on the MIDI and audio hot paths, so that alternative
+// implementations can be compared against each other and against earlier releases
+
+#include <circle/memory.h>
+#include <circle/timer.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <thread>
+
+#include "audioconvert.h"
+#include "midimonitor.h"
+#include "midiparser.h"
+#include "ringbuffer.h"
+#include "zoneallocator.h"
+
+using TClock = std::chrono::steady_clock;
+
+constexpr unsigned int DefaultMinMillis = 200;
+constexpr unsigned int Repetitions = 5;
+
+// Keeps the compiler from optimizing away work whose result isn't otherwise used
+template <class T>
+inline void KeepAlive(const T& Value)
+{
+	asm volatile("" : : "r,m"(Value) : "memory");
+}
+
+// A benchmark runs a number of iterations, each performing a fixed number of operations
+struct TBenchmark
+{
+	const char* pName;
+	size_t nOperations;
+	void (*pRun)(size_t nIterations);
+};
+
+//
+// Ring buffers
+//
+constexpr size_t RingBufferSize = 2048;
+constexpr size_t RingBufferBulkCount = 256;
+constexpr size_t RingBufferStreamCount = 1 << 18;
+
+template <class TRingBuffer>
+static void RingBufferSingle(size_t nIterations)
+{
+	static TRingBuffer RingBuffer;
+	u8 nItem = 0;
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		RingBuffer.Enqueue(static_cast<u8>(i));
+		RingBuffer.Dequeue(nItem);
+	}
+
+	KeepAlive(nItem);
+}
+
+template <class TRingBuffer>
+static void RingBufferBulk(size_t nIterations)
+{
+	static TRingBuffer RingBuffer;
+	u8 Items[RingBufferBulkCount] = { 0 };
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		RingBuffer.Enqueue(Items, RingBufferBulkCount);
+		RingBuffer.Dequeue(Items, RingBufferBulkCount);
+	}
+
+	KeepAlive(Items[0]);
+}
+
+// One thread produces while another consumes, as with MIDI received on one core and parsed on another
+template <class TRingBuffer>
+static void RingBufferContended(size_t nIterations)
+{
+	static TRingBuffer RingBuffer;
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		std::thread Producer([]()
+		{
+			u8 Items[16] = { 0 };
+			size_t nEnqueued = 0;
+			while (nEnqueued < RingBufferStreamCount)
+			{
+				const size_t nCount = RingBuffer.Enqueue(Items, Utility::Min(sizeof(Items), RingBufferStreamCount - nEnqueued));
+				if (!nCount)
+					std::this_thread::yield();
+				nEnqueued += nCount;
+			}
+		});
+
+		// Yield when stalled, in case both threads share a CPU
+		u8 Items[16];
+		size_t nDequeued = 0;
+		while (nDequeued < RingBufferStreamCount)
+		{
+			const size_t nCount = RingBuffer.Dequeue(Items, sizeof(Items));
+			if (!nCount)
+				std::this_thread::yield();
+			nDequeued += nCount;
+		}
+
+		Producer.join();
+		KeepAlive(Items[0]);
+	}
+}
+
+//
+// MIDI parser
+//
+class CCountingParser : public CMIDIParser
+{
+public:
+	CCountingParser() : m_nMessages(0), m_nSysExBytes(0) {}
+
+	size_t m_nMessages;
+	size_t m_nSysExBytes;
+
+protected:
+	virtual void OnShortMessage(u32 nMessage) override { m_nMessages += nMessage & 1; }
+	virtual void OnSysExData(const u8* pData, size_t nSize) override { m_nSysExBytes += nSize; }
+	virtual void OnSysExComplete() override { ++m_nMessages; }
+	virtual void OnSysExAborted() override {}
+};
+
+constexpr size_t MIDIStreamSize = 4096;
+
+// One status byte followed by complete note messages
+constexpr size_t RunningStatusStreamSize = 1 + (MIDIStreamSize - 1) / 2 * 2;
+
+// Note on/off pairs sharing one status byte, as sent by most sequencers
+static const u8* GetRunningStatusStream()
+{
+	static u8 Stream[MIDIStreamSize];
+	if (!Stream[0])
+	{
+		Stream[0] = 0x90;
+		for (size_t i = 1; i + 1 < RunningStatusStreamSize; i += 2)
+		{
+			Stream[i] = 36 + i % 48;
+			Stream[i + 1] = i / 2 % 2 ? 0 : 100;
+		}
+	}
+
+	return Stream;
+}
+
+// Roland DT1 messages of 256 bytes each, as sent by MT-32 games when uploading patches
+static const u8* GetSysExStream()
+{
+	static u8 Stream[MIDIStreamSize];
+	if (!Stream[0])
+	{
+		for (size_t i = 0; i < MIDIStreamSize; i += 256)
+		{
+			Stream[i] = 0xF0;
+			for (size_t j = 1; j < 255; ++j)
+				Stream[i + j] = j & 0x7F;
+			Stream[i + 255] = 0xF7;
+		}
+	}
+
+	return Stream;
+}
+
+static void ParseRunningStatus(size_t nIterations)
+{
+	const u8* const pStream = GetRunningStatusStream();
+	CCountingParser Parser;
+
+	for (size_t i = 0; i < nIterations; ++i)
+		Parser.ParseMIDIBytes(pStream, RunningStatusStreamSize);
+
+	KeepAlive(Parser.m_nMessages);
+}
+
+static void ParseSysEx(size_t nIterations)
+{
+	const u8* const pStream = GetSysExStream();
+	CCountingParser Parser;
+
+	// Delivered in USB-sized packets
+	for (size_t i = 0; i < nIterations; ++i)
+		for (size_t j = 0; j < MIDIStreamSize; j += 64)
+			Parser.ParseMIDIBytes(pStream + j, 64);
+
+	KeepAlive(Parser.m_nSysExBytes);
+}
+
+//
+// Zone allocator
+//
+constexpr size_t AllocatorTraceLength = 4096;
+constexpr size_t AllocatorLiveBlocks = 512;
+
+struct TAllocation
+{
+	size_t nSize;
+	TZoneTag Tag;
+};
+
+// Deterministic mix resembling FluidSynth: many small voice and event allocations, fewer large sample buffers
+static const TAllocation* GetAllocatorTrace()
+{
+	static TAllocation Trace[AllocatorTraceLength];
+	if (!Trace[0].nSize)
+	{
+		u32 nSeed = 1;
+		for (auto& Allocation : Trace)
+		{
+			nSeed = nSeed * 1664525 + 1013904223;
+			const u32 nKind = nSeed >> 24;
+
+			if (nKind < 192)
+				Allocation = { 32 + (nSeed >> 8) % 480, TZoneTag::FluidSynth };
+			else if (nKind < 248)
+				Allocation = { 1024 + (nSeed >> 8) % 16384, TZoneTag::FluidSynthSoundFont };
+			else
+				Allocation = { 65536 + (nSeed >> 8) % 524288, TZoneTag::FluidSynthSamples };
+		}
+	}
+
+	return Trace;
+}
+
+static void AllocatorTrace(size_t nIterations)
+{
+	const TAllocation* const pTrace = GetAllocatorTrace();
+	CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+	void* LiveBlocks[AllocatorLiveBlocks] = { nullptr };
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		// Each allocation replaces an earlier one, so the heap fragments as it would while playing
+		for (size_t j = 0; j < AllocatorTraceLength; ++j)
+		{
+			void*& pBlock = LiveBlocks[(j * 7) % AllocatorLiveBlocks];
+			pAllocator->Free(pBlock);
+			pBlock = pAllocator->Alloc(pTrace[j].nSize, pTrace[j].Tag);
+		}
+
+		// Unloading a SoundFont releases its allocations all at once
+		for (auto& pBlock : LiveBlocks)
+		{
+			pAllocator->Free(pBlock);
+			pBlock = nullptr;
+		}
+	}
+}
+
+static void AllocatorFreeTag(size_t nIterations)
+{
+	const TAllocation* const pTrace = GetAllocatorTrace();
+	CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		for (size_t j = 0; j < AllocatorTraceLength; ++j)
+			pAllocator->Alloc(pTrace[j].nSize, TZoneTag::FluidSynthSoundFont);
+
+		pAllocator->FreeTag(TZoneTag::FluidSynthSoundFont);
+	}
+}
+
+// As with a SoundFont loading on one core while another allocates sample data; each tag has its own arena
+static void AllocatorContended(size_t nIterations)
+{
+	auto Run = [](TZoneTag Tag)
+	{
+		const TAllocation* const pTrace = GetAllocatorTrace();
+		CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+		void* LiveBlocks[AllocatorLiveBlocks] = { nullptr };
+
+		for (size_t j = 0; j < AllocatorTraceLength; ++j)
+		{
+			void*& pBlock = LiveBlocks[(j * 7) % AllocatorLiveBlocks];
+			pAllocator->Free(pBlock);
+			pBlock = pAllocator->Alloc(pTrace[j].nSize, Tag);
+		}
+
+		for (auto& pBlock : LiveBlocks)
+			pAllocator->Free(pBlock);
+	};
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		std::thread Loader(Run, TZoneTag::FluidSynthSoundFont);
+		Run(TZoneTag::FluidSynthSamples);
+		Loader.join();
+	}
+}
+
+//
+// Audio conversion
+//
+constexpr size_t AudioFrames = 256;
+
+static float* GetAudioBuffer()
+{
+	static float Buffer[AudioFrames * 2];
+	if (!Buffer[1])
+	{
+		// Includes out of range samples so that saturation is exercised
+		for (size_t i = 0; i < AudioFrames * 2; ++i)
+			Buffer[i] = (static_cast<float>(i % 97) - 48.0f) / 40.0f;
+	}
+
+	return Buffer;
+}
+
+static void ConvertS24(size_t nIterations)
+{
+	static s32 OutBuffer[AudioFrames * 2];
+	const float* const pInBuffer = GetAudioBuffer();
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		AudioConvert::FloatToS24(pInBuffer, OutBuffer, AudioFrames, false);
+		KeepAlive(OutBuffer[0]);
+	}
+}
+
+static void ConvertS24Scalar(size_t nIterations)
+{
+	static s32 OutBuffer[AudioFrames * 2];
+	const float* const pInBuffer = GetAudioBuffer();
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		AudioConvert::FloatToS24Scalar(pInBuffer, OutBuffer, AudioFrames, false);
+		KeepAlive(OutBuffer[0]);
+	}
+}
+
+static void ConvertS24Packed(size_t nIterations)
+{
+	static u8 OutBuffer[AudioFrames * 2 * 3];
+	const float* const pInBuffer = GetAudioBuffer();
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		AudioConvert::FloatToS24Packed(pInBuffer, OutBuffer, AudioFrames, false);
+		KeepAlive(OutBuffer[0]);
+	}
+}
+
+static void ConvertS24PackedScalar(size_t nIterations)
+{
+	static u8 OutBuffer[AudioFrames * 2 * 3];
+	const float* const pInBuffer = GetAudioBuffer();
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		AudioConvert::FloatToS24PackedScalar(pInBuffer, OutBuffer, AudioFrames, false);
+		KeepAlive(OutBuffer[0]);
+	}
+}
+
+//
+// MIDI monitor
+//
+static void MonitorChannelLevels(size_t nIterations)
+{
+	static CMIDIMonitor Monitor;
+	float Levels[16], Peaks[16];
+
+	// Eight held notes on every channel
+	for (u8 nChannel = 0; nChannel < 16; ++nChannel)
+		for (u8 nNote = 60; nNote < 68; ++nNote)
+			Monitor.OnShortMessage(0x90 | nChannel | nNote << 8 | 100 << 16);
+
+	for (size_t i = 0; i < nIterations; ++i)
+	{
+		Monitor.GetChannelLevels(CTimer::GetClockTicks(), Levels, Peaks);
+		KeepAlive(Levels[0]);
+	}
+}
+
+static const TBenchmark Benchmarks[] =
+{
+	{ "ringbuffer/single",              1,                        RingBufferSingle<CRingBuffer<u8, RingBufferSize>>        },
+	{ "ringbuffer/bulk",                RingBufferBulkCount,      RingBufferBulk<CRingBuffer<u8, RingBufferSize>>          },
+	{ "ringbuffer/contended",           RingBufferStreamCount,    RingBufferContended<CRingBuffer<u8, RingBufferSize>>     },
+	{ "spscringbuffer/single",          1,                        RingBufferSingle<CSPSCRingBuffer<u8, RingBufferSize>>    },
+	{ "spscringbuffer/bulk",            RingBufferBulkCount,      RingBufferBulk<CSPSCRingBuffer<u8, RingBufferSize>>      },
+	{ "spscringbuffer/contended",       RingBufferStreamCount,    RingBufferContended<CSPSCRingBuffer<u8, RingBufferSize>> },
+	{ "midiparser/running_status",      RunningStatusStreamSize,  ParseRunningStatus                                       },
+	{ "midiparser/sysex",               MIDIStreamSize,           ParseSysEx                                               },
+	{ "zoneallocator/trace",            AllocatorTraceLength * 2, AllocatorTrace                                           },
+	{ "zoneallocator/freetag",          AllocatorTraceLength,     AllocatorFreeTag                                         },
+	{ "zoneallocator/contended",        AllocatorTraceLength * 4, AllocatorContended                                       },
+	{ "audioconvert/s24",               AudioFrames,              ConvertS24                                               },
+	{ "audioconvert/s24_scalar",        AudioFrames,              ConvertS24Scalar                                         },
+	{ "audioconvert/s24_packed",        AudioFrames,              ConvertS24Packed                                         },
+	{ "audioconvert/s24_packed_scalar", AudioFrames,              ConvertS24PackedScalar                                   },
+	{ "midimonitor/channel_levels",     1,                        MonitorChannelLevels                                     },
+};
+
+static double TimeIterations(const TBenchmark& Benchmark, size_t nIterations)
+{
+	const auto StartTime = TClock::now();
+	Benchmark.pRun(nIterations);
+	return std::chrono::duration<double, std::nano>(TClock::now() - StartTime).count();
+}
+
+// Best of several repetitions, each long enough to swamp timer resolution; returns nanoseconds per operation
+static double RunBenchmark(const TBenchmark& Benchmark, unsigned int nMinMillis)
+{
+	const double nMinNanos = nMinMillis * 1e6;
+	size_t nIterations = 1;
+	double nNanos;
+
+	while ((nNanos = TimeIterations(Benchmark, nIterations)) < nMinNanos)
+		nIterations = nNanos > 0 ? Utility::Max(static_cast<size_t>(nIterations * 1.2 * nMinNanos / nNanos), nIterations * 2) : nIterations * 2;
+
+	double nBest = nNanos;
+	for (unsigned int i = 1; i < Repetitions; ++i)
+		nBest = Utility::Min(nBest, TimeIterations(Benchmark, nIterations));
+
+	return nBest / (static_cast<double>(nIterations) * Benchmark.nOperations);
+}
+
+static void PrintUsage(const char* pProgramName)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"\n"
+		"Options:\n"
+		"  -f <filter>     Only run benchmarks whose names contain <filter>\n"
+		"  -t <ms>         Minimum time per repetition (default: %d)\n"
+		"\n"
+		"Results are written to standard output as CSV.\n",
+		pProgramName, DefaultMinMillis);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* pFilter = nullptr;
+	unsigned int nMinMillis = DefaultMinMillis;
+
+	int nOption;
+	while ((nOption = getopt(argc, argv, "f:t:h")) != -1)
+	{
+		switch (nOption)
+		{
+			case 'f': pFilter = optarg; break;
+			case 't': nMinMillis = atoi(optarg); break;
+
+			default:
+				PrintUsage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	CMemorySystem::Get()->SetHeapSize(128 * MEGABYTE);
+	CZoneAllocator Allocator;
+	if (!Allocator.Initialize())
+		return EXIT_FAILURE;
+
+	printf("benchmark,ns_per_op,mops_per_s\n");
+	for (const TBenchmark& Benchmark : Benchmarks)
+	{
+		if (pFilter && !strstr(Benchmark.pName, pFilter))
+			continue;
+
+		const double nNanos = RunBenchmark(Benchmark, nMinMillis);
+		printf("%s,%.3f,%.3f\n", Benchmark.pName, nNanos, 1e3 / nNanos);
+		fflush(stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
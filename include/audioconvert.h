@@ -0,0 +1,146 @@
+//
+// audioconvert.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _audioconvert_h
+#define _audioconvert_h
+
+#include <circle/types.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIOCONVERT_NEON
+#endif
+
+#include "utility.h"
+
+// Conversion of interleaved stereo float samples to signed 24-bit integers, with saturation
+namespace AudioConvert
+{
+	constexpr float Sample24BitMax = (1 << (24 - 1)) - 1;
+
+	inline s32 FloatToS24(float nSample)
+	{
+		return Utility::Clamp(nSample, -1.0f, 1.0f) * Sample24BitMax;
+	}
+
+	// Scalar fallback: 24-bit samples in 32-bit containers
+	inline void FloatToS24Scalar(const float* pInBuffer, s32* pOutBuffer, size_t nFrames, bool bReversedStereo)
+	{
+		const size_t nLeft = bReversedStereo ? 1 : 0;
+		const size_t nRight = nLeft ^ 1;
+
+		for (size_t i = 0; i < nFrames * 2; i += 2)
+		{
+			pOutBuffer[i] = FloatToS24(pInBuffer[i + nLeft]);
+			pOutBuffer[i + 1] = FloatToS24(pInBuffer[i + nRight]);
+		}
+	}
+
+	// Scalar fallback: packed little-endian 24-bit samples
+	inline void FloatToS24PackedScalar(const float* pInBuffer, u8* pOutBuffer, size_t nFrames, bool bReversedStereo)
+	{
+		const size_t nLeft = bReversedStereo ? 1 : 0;
+		const size_t nRight = nLeft ^ 1;
+
+		for (size_t i = 0; i < nFrames * 2; i += 2)
+		{
+			const s32 nLeftSample = FloatToS24(pInBuffer[i + nLeft]);
+			const s32 nRightSample = FloatToS24(pInBuffer[i + nRight]);
+
+			*pOutBuffer++ = nLeftSample;
+			*pOutBuffer++ = nLeftSample >> 8;
+			*pOutBuffer++ = nLeftSample >> 16;
+			*pOutBuffer++ = nRightSample;
+			*pOutBuffer++ = nRightSample >> 8;
+			*pOutBuffer++ = nRightSample >> 16;
+		}
+	}
+
+#ifdef AUDIOCONVERT_NEON
+	// Converts 4 samples; clamping before the multiply keeps the result within 24 bits
+	inline int32x4_t FloatToS24NEON(float32x4_t Samples, bool bReversedStereo)
+	{
+		if (bReversedStereo)
+			Samples = vrev64q_f32(Samples);
+
+		Samples = vminq_f32(vmaxq_f32(Samples, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+		return vcvtq_s32_f32(vmulq_n_f32(Samples, Sample24BitMax));
+	}
+#endif
+
+	// 24-bit samples in 32-bit containers (I2S)
+	inline void FloatToS24(const float* pInBuffer, s32* pOutBuffer, size_t nFrames, bool bReversedStereo)
+	{
+#ifdef AUDIOCONVERT_NEON
+		// 4 frames per iteration
+		const size_t nVectorFrames = nFrames & ~3;
+		for (size_t i = 0; i < nVectorFrames * 2; i += 8)
+		{
+			vst1q_s32(pOutBuffer + i, FloatToS24NEON(vld1q_f32(pInBuffer + i), bReversedStereo));
+			vst1q_s32(pOutBuffer + i + 4, FloatToS24NEON(vld1q_f32(pInBuffer + i + 4), bReversedStereo));
+		}
+
+		pInBuffer += nVectorFrames * 2;
+		pOutBuffer += nVectorFrames * 2;
+		nFrames -= nVectorFrames;
+#endif
+		FloatToS24Scalar(pInBuffer, pOutBuffer, nFrames, bReversedStereo);
+	}
+
+	// Packed little-endian 24-bit samples (PWM/HDMI)
+	inline void FloatToS24Packed(const float* pInBuffer, u8* pOutBuffer, size_t nFrames, bool bReversedStereo)
+	{
+#ifdef AUDIOCONVERT_NEON
+		// Byte indices into 8 little-endian 32-bit samples, dropping the most significant byte of each
+		static const u8 PackIndices[24] =
+		{
+			0, 1, 2, 4, 5, 6, 8, 9,
+			10, 12, 13, 14, 16, 17, 18, 20,
+			21, 22, 24, 25, 26, 28, 29, 30,
+		};
+
+		const uint8x8_t Indices0 = vld1_u8(PackIndices);
+		const uint8x8_t Indices1 = vld1_u8(PackIndices + 8);
+		const uint8x8_t Indices2 = vld1_u8(PackIndices + 16);
+
+		// 4 frames (24 bytes) per iteration
+		const size_t nVectorFrames = nFrames & ~3;
+		for (size_t i = 0; i < nVectorFrames * 2; i += 8)
+		{
+			const uint8x16_t Low = vreinterpretq_u8_s32(FloatToS24NEON(vld1q_f32(pInBuffer + i), bReversedStereo));
+			const uint8x16_t High = vreinterpretq_u8_s32(FloatToS24NEON(vld1q_f32(pInBuffer + i + 4), bReversedStereo));
+			const uint8x8x4_t Table = { { vget_low_u8(Low), vget_high_u8(Low), vget_low_u8(High), vget_high_u8(High) } };
+
+			vst1_u8(pOutBuffer, vtbl4_u8(Table, Indices0));
+			vst1_u8(pOutBuffer + 8, vtbl4_u8(Table, Indices1));
+			vst1_u8(pOutBuffer + 16, vtbl4_u8(Table, Indices2));
+			pOutBuffer += 24;
+		}
+
+		pInBuffer += nVectorFrames * 2;
+		nFrames -= nVectorFrames;
+#endif
+		FloatToS24PackedScalar(pInBuffer, pOutBuffer, nFrames, bReversedStereo);
+	}
+}
+
+#endif
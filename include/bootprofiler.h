@@ -0,0 +1,75 @@
+//
+// bootprofiler.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _bootprofiler_h
+#define _bootprofiler_h
+
+#include <circle/sysconfig.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+// Records when each boot step starts and how long it takes; steps may be nested, and may run on any core.
+// Recording stops once the report has been written, so steps that are repeated later (e.g. rescans) cost nothing.
+class CBootProfiler
+{
+public:
+	// Times a boot step for as long as it is in scope
+	class CStep
+	{
+	public:
+		CStep(const char* pName) : m_nIndex(CBootProfiler::Begin(pName)) {}
+		~CStep() { CBootProfiler::End(m_nIndex); }
+
+	private:
+		size_t m_nIndex;
+	};
+
+	static size_t Begin(const char* pName);
+	static void End(size_t nIndex);
+
+	// Stops recording, then writes the report to the log and to a file
+	static bool Report(const char* pFileName);
+
+private:
+	static constexpr size_t MaxSteps = 48;
+	static constexpr size_t InvalidIndex = static_cast<size_t>(-1);
+
+	struct TStep
+	{
+		const char* pName;
+		unsigned int nStartTime;
+		unsigned int nEndTime;
+		u8 nCore;
+		u8 nDepth;
+	};
+
+	static TStep s_Steps[MaxSteps];
+	static std::atomic<size_t> s_nSteps;
+	static std::atomic<bool> s_bFinished;
+
+	// Nesting depth of the steps in progress on each core
+	static u8 s_nDepth[CORES];
+};
+
+#endif
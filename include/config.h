@@ -25,9 +25,11 @@
 
 #include <circle/net/ipaddress.h>
 #include <circle/types.h>
+#include <circle/util.h>
 
 #include "control/rotaryencoder.h"
 #include "lcd/drivers/ssd1306.h"
+#include "midirouter.h"
 #include "synth/mt32romset.h"
 #include "synth/mt32synth.h"
 #include "utility.h"
@@ -53,8 +55,13 @@ public:
 
 	using TMT32EmuResamplerQuality = CMT32Synth::TResamplerQuality;
 	using TMT32EmuMIDIChannels     = CMT32Synth::TMIDIChannels;
+	using TMT32EmuAnalogOutputMode = CMT32Synth::TAnalogOutputMode;
+	using TMT32EmuRendererType     = CMT32Synth::TRendererType;
 	using TMT32EmuROMSet           = TMT32ROMSet;
 
+	using TMIDIRouteInput          = CMIDIRouter::TInput;
+	using TMIDIRouteOutput         = CMIDIRouter::TOutput;
+
 	using TLCDRotation             = CSSD1306::TLCDRotation;
 	using TLCDMirror               = CSSD1306::TLCDMirror;
 
@@ -76,9 +83,23 @@ public:
 	CONFIG_ENUM(TLCDType, ENUM_LCDTYPE);
 	CONFIG_ENUM(TNetworkMode, ENUM_NETWORKMODE);
 
+	// Options that can be changed without restarting, grouped by how they are applied
+	struct TLiveChanges
+	{
+		bool bMT32EmuGain;
+		bool bMT32EmuMIDIChannels;
+		bool bFluidSynthGain;
+		bool bFluidSynthEffects;
+		bool bFluidSynthPolyphony;
+	};
+
 	CConfig();
 	bool Initialize(const char* pPath);
 
+	// Re-reads the file; changed options that can be applied at runtime are copied into this config and flagged in OutChanges.
+	// Returns the number of other changed options, which keep their current values until a restart, or -1 on error.
+	int Reload(const char* pPath, TLiveChanges& OutChanges);
+
 	static CConfig* Get() { return s_pThis; }
 
 	// Expand all config variables from definition file
@@ -93,8 +114,12 @@ public:
 	static bool ParseOption(const char *pString, CIPAddress* pOut);
 	static bool ParseOption(const char* pString, TSystemDefaultSynth* pOut);
 	static bool ParseOption(const char* pString, TAudioOutputDevice* pOut);
+	static bool ParseOption(const char* pString, TMIDIRouteInput* pOut);
+	static bool ParseOption(const char* pString, TMIDIRouteOutput* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuResamplerQuality* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuMIDIChannels* pOut);
+	static bool ParseOption(const char* pString, TMT32EmuAnalogOutputMode* pOut);
+	static bool ParseOption(const char* pString, TMT32EmuRendererType* pOut);
 	static bool ParseOption(const char* pString, TMT32EmuROMSet* pOut);
 	static bool ParseOption(const char* pString, TLCDType* pOut);
 	static bool ParseOption(const char* pString, TControlScheme* pOut);
@@ -104,6 +129,16 @@ public:
 	static bool ParseOption(const char* pString, TNetworkMode* pOut);
 
 private:
+	// Parses into a separate instance without replacing the global one
+	struct TTemporary {};
+	explicit CConfig(TTemporary);
+
+	void SetDefaults();
+
+	template <class T>
+	static bool IsEqual(const T& A, const T& B) { return A == B; }
+	static bool IsEqual(const CString& A, const CString& B) { return !strcmp(A, B); }
+
 	static int INIHandler(void* pUser, const char* pSection, const char* pName, const char* pValue);
 
 	static CConfig* s_pThis;
@@ -23,6 +23,7 @@
 #ifndef _control_h
 #define _control_h
 
+#include <circle/gpiomanager.h>
 #include <circle/gpiopin.h>
 #include <circle/types.h>
 #include <circle/usertimer.h>
@@ -32,21 +33,29 @@
 #include "optional.h"
 #include "utility.h"
 
+// Controls are entirely interrupt-driven: edges on any control pin decode the encoder and wake the button debouncer,
+// which samples the buttons on a timer until they have been released and stopped bouncing. Events are posted to the
+// event queue from interrupt context, so nothing runs while the controls are untouched.
 class CControl
 {
 public:
-	CControl(TEventQueue& pEventQueue);
+	CControl(TEventQueue& pEventQueue, u8 nButtonMask);
 	virtual ~CControl() = default;
 
 	bool Initialize();
-	virtual void Update();
 	u8 GetButtonState() const { return m_nButtonState; }
 
 protected:
-	// Called from interrupt context
-	virtual void ReadGPIOPins() = 0;
+	// Called from interrupt context; returns the raw button state (1 == released), and posts any encoder movement
+	virtual u8 ReadGPIOPins() = 0;
 
-	void DebounceButtonState(u8 nState, u8 nMask);
+	// Called once the debounce timer is ready; subclasses connect each of their pins with ConnectGPIOPin()
+	virtual void ConnectGPIOPins() = 0;
+	void ConnectGPIOPin(CGPIOPin& Pin);
+
+	void DebounceButtonState(u8 nState);
+	void PostButtonEvents();
+	void UpdateRepeat();
 
 	// Must be power of two
 	static constexpr size_t ButtonStateHistoryLength = 16;
@@ -59,8 +68,10 @@ protected:
 
 	TEventQueue* m_pEventQueue;
 	CUserTimer m_Timer;
+	u8 m_nButtonMask;
 
-	// Debouncing
+	// Debouncing; the timer only runs while a button is pressed or bouncing
+	volatile bool m_bDebouncing;
 	u8 m_ButtonStateHistory[ButtonStateHistoryLength];
 	size_t m_nButtonStateHistoryIndex;
 
@@ -85,16 +96,18 @@ protected:
 		);
 	}
 
-	static void InterruptHandler(CUserTimer* pUserTimer, void* pParam);
+	static void GPIOInterruptHandler(void* pParam);
+	static void TimerInterruptHandler(CUserTimer* pUserTimer, void* pParam);
 };
 
 class CControlSimpleButtons : public CControl
 {
 public:
-	CControlSimpleButtons(TEventQueue& pEventQueue);
+	CControlSimpleButtons(TEventQueue& pEventQueue, CGPIOManager* pGPIOManager);
 
 protected:
-	virtual void ReadGPIOPins() override;
+	virtual u8 ReadGPIOPins() override;
+	virtual void ConnectGPIOPins() override;
 
 	CGPIOPin m_GPIOButton1;
 	CGPIOPin m_GPIOButton2;
@@ -105,16 +118,17 @@ protected:
 class CControlSimpleEncoder : public CControl
 {
 public:
-	CControlSimpleEncoder(TEventQueue& pEventQueue, CRotaryEncoder::TEncoderType EncoderType, bool bEncoderReversed);
-
-	virtual void Update() override;
+	CControlSimpleEncoder(TEventQueue& pEventQueue, CGPIOManager* pGPIOManager, CRotaryEncoder::TEncoderType EncoderType, bool bEncoderReversed);
 
 protected:
-	virtual void ReadGPIOPins() override;
+	virtual u8 ReadGPIOPins() override;
+	virtual void ConnectGPIOPins() override;
 
 	CGPIOPin m_GPIOEncoderButton;
 	CGPIOPin m_GPIOButton1;
 	CGPIOPin m_GPIOButton2;
+	CGPIOPin m_GPIOEncoderCLK;
+	CGPIOPin m_GPIOEncoderDAT;
 
 	CRotaryEncoder m_Encoder;
 };
@@ -35,9 +35,11 @@ class CMisterControl
 public:
 	CMisterControl(CI2CMaster* pI2CMaster, TEventQueue& EventQueue);
 
-	void Update(const TMisterStatus& SystemStatus);
+	// Pushes changes to the system status straight away; changes made on the MiSTer side are polled for less often
+	void Update(const TMisterStatus& SystemStatus, unsigned int nTicks);
 
 private:
+	void PollMister(const TMisterStatus& SystemStatus);
 	bool WriteConfigToMister(const TMisterStatus& NewStatus);
 	void ResetState();
 	void ApplyConfig(const TMisterStatus& NewStatus, const TMisterStatus& SystemStatus);
@@ -48,6 +50,8 @@ private:
 	TEventQueue* m_pEventQueue;
 
 	bool bMisterActive;
+	bool m_bPollPending;
+	unsigned int m_nLastPollTime;
 	TMisterStatus m_LastSystemStatus;
 	TMisterStatus m_LastMisterStatus;
 };
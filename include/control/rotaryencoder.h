@@ -23,11 +23,11 @@
 #ifndef _rotaryencoder_h
 #define _rotaryencoder_h
 
-#include <circle/gpiopin.h>
 #include <circle/types.h>
 
 #include "utility.h"
 
+// Quadrature decoder state machine; fed with the pin levels each time either pin changes
 class CRotaryEncoder
 {
 public:
@@ -38,26 +38,21 @@ public:
 
 	CONFIG_ENUM(TEncoderType, ENUM_ENCODERTYPE);
 
-	CRotaryEncoder(TEncoderType Type, bool bReversed, unsigned GPIOPinCLK, unsigned GPIOPinDAT);
+	CRotaryEncoder(TEncoderType Type, bool bReversed);
 
-	s8 Read();
-	void ReadGPIOPins();
-	void ReadGPIOPins(bool bCLKValue, bool bDATValue);
+	// Returns the movement (with acceleration applied) if a detent was reached, otherwise 0
+	s8 Decode(bool bCLKValue, bool bDATValue);
 
 private:
-	CGPIOPin m_CLKPin;
-	CGPIOPin m_DATPin;
-
 	TEncoderType m_Type;
 	bool m_bReversed;
 
-	s8 m_nDelta;
 	u8 m_nState;
 
 	// Bitmask of which valid 4-bit transition codes we have seen in each direction (CW and CCW)
 	u16 nPreviousTransitions[2];
 
-	unsigned int m_nLastReadTime;
+	unsigned int m_nLastDetentTime;
 };
 
 #endif
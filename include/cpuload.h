@@ -0,0 +1,78 @@
+//
+// cpuload.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _cpuload_h
+#define _cpuload_h
+
+#include <circle/multicore.h>
+#include <circle/sysconfig.h>
+#include <circle/timer.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+#include "utility.h"
+
+// Per-core load accounting. Cores that sleep between jobs count the time they spend in WaitForEvent(); cores that poll
+// count the time they spend doing useful work instead. Each core only ever writes its own counters.
+class CCPULoad
+{
+public:
+	// No measurement for a core that hasn't reported any time yet
+	static constexpr u8 Unknown = 0xFF;
+
+	// Sleep until an event, counting the time as idle
+	static void WaitForEvent()
+	{
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+		Utility::WaitForEvent();
+		AddTime(s_Counters[CMultiCoreSupport::ThisCore()].nIdleTicks, CTimer::GetClockTicks() - nStartTicks);
+	}
+
+	// For polling cores: count time spent working
+	static void AddBusyTime(unsigned int nTicks) { AddTime(s_Counters[CMultiCoreSupport::ThisCore()].nBusyTicks, nTicks); }
+
+	// Load of each core in percent since the previous call, or Unknown; must only be called from one core
+	static void Sample(u8 (&OutLoads)[CORES]);
+
+private:
+	struct TCounters
+	{
+		std::atomic<unsigned int> nIdleTicks;
+		std::atomic<unsigned int> nBusyTicks;
+	};
+
+	// Single writer, so no need for an atomic read-modify-write
+	static void AddTime(std::atomic<unsigned int>& nCounter, unsigned int nTicks)
+	{
+		nCounter.store(nCounter.load(std::memory_order_relaxed) + nTicks, std::memory_order_relaxed);
+	}
+
+	static TCounters s_Counters[CORES];
+
+	// Sampler state
+	static unsigned int s_nLastSampleTicks;
+	static unsigned int s_nLastIdleTicks[CORES];
+	static unsigned int s_nLastBusyTicks[CORES];
+};
+
+#endif
@@ -0,0 +1,87 @@
+//
+// deferredlog.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _deferredlog_h
+#define _deferredlog_h
+
+#include <circle/logger.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+// Messages that may be raised from interrupt context or hot paths
+enum class TDeferredLogMessage : u8
+{
+	MIDIRxOverrun,
+	MIDIEventQueueOverflow,
+	NetworkMIDIOverrun,
+	SysExOverflow,
+	UnexpectedMIDIStatus,
+	UARTBreakError,
+	UARTOverrunError,
+	UARTFramingError,
+	UARTUnknownError,
+	UARTTxError,
+	SoundDataDropped,
+
+	Count
+};
+
+// Raising a message only counts it and records its argument, so it's safe from any core and from interrupt context,
+// and costs the same however often it happens. Messages are formatted later by Flush() on a single core; repeats are
+// folded into one line, and each message is reported at most once per rate limit period.
+class CDeferredLog
+{
+public:
+	using TLCDHandler = void(TLogSeverity Severity, const char* pText, void* pParam);
+
+	CDeferredLog();
+
+	void Raise(TDeferredLogMessage Message, int nArg = 0)
+	{
+		TSlot& Slot = m_Slots[static_cast<size_t>(Message)];
+		Slot.nArg.store(nArg, std::memory_order_relaxed);
+		Slot.nCount.fetch_add(1, std::memory_order_release);
+	}
+
+	// Single consumer only; returns true if anything was reported
+	bool Flush(unsigned int nTicks, TLCDHandler* pLCDHandler, void* pParam);
+
+private:
+	static constexpr size_t MessageCount = static_cast<size_t>(TDeferredLogMessage::Count);
+	static constexpr unsigned int RateLimitMillis = 1000;
+
+	struct TSlot
+	{
+		std::atomic<unsigned int> nCount;
+		std::atomic<int> nArg;
+
+		// Consumer only
+		unsigned int nLastReportTime;
+		bool bReported;
+	};
+
+	TSlot m_Slots[MessageCount];
+};
+
+#endif
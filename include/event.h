@@ -23,11 +23,14 @@
 #ifndef _event_h
 #define _event_h
 
+#include <circle/spinlock.h>
+#include <circle/types.h>
+
 #include "control/button.h"
 #include "lcd/images.h"
-#include "ringbuffer.h"
 #include "synth/mt32romset.h"
 #include "synth/synth.h"
+#include "utility.h"
 
 struct TButtonEvent
 {
@@ -94,6 +97,119 @@ struct TEvent
 };
 
 constexpr size_t EventQueueSize = 32;
-using TEventQueue               = CRingBuffer<TEvent, EventQueueSize>;
+
+// Event queue with priority lanes. All Sound Off and synth/ROM set/SoundFont switches are never dropped, and are
+// dequeued before anything else; only the most recent request of each kind is kept. Encoder deltas are accumulated
+// into a single event instead of taking up a slot each. Other events are queued in order, and dropped when full.
+class CEventQueue
+{
+public:
+	// Largest number of events returned by a single call to Dequeue(): a full ordered lane (EventQueueSize - 1), one
+	// event from each of the 4 priority lanes, and one encoder event
+	static constexpr size_t MaxDequeueCount = EventQueueSize + 4;
+
+	CEventQueue()
+		: m_Lock(IRQ_LEVEL),
+		  m_PriorityEvents{},
+		  m_nPendingPriorityEvents(0),
+		  m_nEncoderDelta(0),
+		  m_nInPtr(0),
+		  m_nOutPtr(0),
+		  m_Events{}
+	{
+	}
+
+	// Returns false if the event was dropped because the queue was full
+	bool Enqueue(const TEvent& Event)
+	{
+		bool bSuccess = true;
+		m_Lock.Acquire();
+
+		const int nPriorityLane = GetPriorityLane(Event.Type);
+		if (nPriorityLane >= 0)
+		{
+			m_PriorityEvents[nPriorityLane] = Event;
+			m_nPendingPriorityEvents |= 1 << nPriorityLane;
+		}
+		else if (Event.Type == TEventType::Encoder)
+			m_nEncoderDelta += Event.Encoder.nDelta;
+		else if (((m_nInPtr + 1) & BufferMask) != m_nOutPtr)
+		{
+			m_Events[m_nInPtr] = Event;
+			m_nInPtr = (m_nInPtr + 1) & BufferMask;
+		}
+		else
+			bSuccess = false;
+
+		m_Lock.Release();
+
+		// Wake the main core in case it is sleeping
+		Utility::SendEvent();
+		return bSuccess;
+	}
+
+	size_t Dequeue(TEvent* pOutBuffer, size_t nMaxCount)
+	{
+		size_t nDequeued = 0;
+		m_Lock.Acquire();
+
+		for (size_t nLane = 0; nLane < PriorityLaneCount && nDequeued < nMaxCount; ++nLane)
+		{
+			if (m_nPendingPriorityEvents & (1 << nLane))
+			{
+				pOutBuffer[nDequeued++] = m_PriorityEvents[nLane];
+				m_nPendingPriorityEvents &= ~(1 << nLane);
+			}
+		}
+
+		if (m_nEncoderDelta && nDequeued < nMaxCount)
+		{
+			TEvent& Event = pOutBuffer[nDequeued++];
+			Event.Type = TEventType::Encoder;
+			Event.Encoder.nDelta = Utility::Clamp(m_nEncoderDelta, -128, 127);
+			m_nEncoderDelta -= Event.Encoder.nDelta;
+		}
+
+		while (m_nInPtr != m_nOutPtr && nDequeued < nMaxCount)
+		{
+			pOutBuffer[nDequeued++] = m_Events[m_nOutPtr];
+			m_nOutPtr = (m_nOutPtr + 1) & BufferMask;
+		}
+
+		m_Lock.Release();
+		return nDequeued;
+	}
+
+private:
+	static_assert(Utility::IsPowerOfTwo(EventQueueSize), "Event queue size must be a power of 2");
+
+	static constexpr size_t PriorityLaneCount = 4;
+	static constexpr size_t BufferMask = EventQueueSize - 1;
+
+	// Lanes are dequeued in this order
+	static constexpr int GetPriorityLane(TEventType Type)
+	{
+		switch (Type)
+		{
+			case TEventType::AllSoundOff:		return 0;
+			case TEventType::SwitchSynth:		return 1;
+			case TEventType::SwitchMT32ROMSet:	return 2;
+			case TEventType::SwitchSoundFont:	return 3;
+			default:				return -1;
+		}
+	}
+
+	CSpinLock m_Lock;
+
+	TEvent m_PriorityEvents[PriorityLaneCount];
+	u8 m_nPendingPriorityEvents;
+	int m_nEncoderDelta;
+
+	size_t m_nInPtr;
+	size_t m_nOutPtr;
+	TEvent m_Events[EventQueueSize];
+};
+
+using TEventQueue = CEventQueue;
 
 #endif
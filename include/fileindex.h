@@ -0,0 +1,93 @@
+//
+// fileindex.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _fileindex_h
+#define _fileindex_h
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+// Persistent cache of per-file scan results, keyed by file name, size and FAT timestamp.
+// Results are looked up from the previously-saved index and re-added for every file seen during a scan;
+// the index is only rewritten if any file was new, changed or missing.
+class CFileIndex
+{
+public:
+	CFileIndex(u32 nMagic);
+	~CFileIndex();
+
+	// Returns false if the index is missing or corrupt, in which case every lookup misses
+	bool Load(const char* pPath);
+	bool Save(const char* pPath);
+
+	// Returns the cached data for an unchanged file, or nullptr
+	const u8* Find(const FILINFO& FileInfo, size_t& nOutSize);
+	void Add(const FILINFO& FileInfo, const void* pData, size_t nSize);
+
+	// If the scan stopped early, files that weren't seen don't count as removed
+	bool IsChanged(bool bCompleteScan = true) const { return m_bChanged || (bCompleteScan && m_nHits != m_nLoadedEntries); }
+
+private:
+	struct TEntryHeader
+	{
+		u32 nFileSize;
+		u16 nFileDate;
+		u16 nFileTime;
+		u16 nFileNameLength;
+		u16 nDataSize;
+	}
+	PACKED;
+
+	struct THeader
+	{
+		u32 nMagic;
+		u32 nVersion;
+		u32 nEntries;
+		u32 nDataSize;
+		u32 nChecksum;
+	}
+	PACKED;
+
+	static constexpr u32 Version = 1;
+	static constexpr size_t MaxIndexSize = 1024 * 1024;
+
+	static u32 Checksum(const u8* pData, size_t nSize);
+
+	u32 m_nMagic;
+
+	// Previously-saved index
+	u8* m_pLoadedData;
+	size_t m_nLoadedSize;
+	size_t m_nLoadedEntries;
+	size_t m_nFindOffset;
+	size_t m_nHits;
+
+	// Index being built by the current scan
+	u8* m_pData;
+	size_t m_nSize;
+	size_t m_nCapacity;
+	size_t m_nEntries;
+	bool m_bChanged;
+};
+
+#endif
@@ -0,0 +1,57 @@
+//
+// filesystemlock.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _filesystemlock_h
+#define _filesystemlock_h
+
+#include <circle/types.h>
+
+#include <atomic>
+
+// FatFs isn't built to be reentrant, but is used from the main core's tasks and from the secondary cores (e.g.
+// SoundFont loading on core 3). Every burst of FatFs calls must hold this lock. It's recursive per owner, where the owner
+// is the current task on core 0, or the core itself on any other core. Waiting tasks on core 0 yield to the scheduler,
+// so the lock may be held across a Yield(). Never take it from interrupt context.
+class CFileSystemLock
+{
+public:
+	static void Acquire();
+	static void Release();
+
+private:
+	static uintptr GetOwner();
+
+	static std::atomic<uintptr> s_nOwner;
+	static unsigned int s_nDepth;
+};
+
+class CFileSystemLockGuard
+{
+public:
+	CFileSystemLockGuard() { CFileSystemLock::Acquire(); }
+	~CFileSystemLockGuard() { CFileSystemLock::Release(); }
+
+	CFileSystemLockGuard(const CFileSystemLockGuard&) = delete;
+	CFileSystemLockGuard& operator=(const CFileSystemLockGuard&) = delete;
+};
+
+#endif
@@ -0,0 +1,115 @@
+//
+// latencycontroller.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _latencycontroller_h
+#define _latencycontroller_h
+
+#include <circle/types.h>
+
+#include "utility.h"
+
+// Chooses how many frames to keep queued for the sound device, based on how long
+// each block takes to render compared to how long it takes to play back
+class CLatencyController
+{
+public:
+	CLatencyController(unsigned int nSampleRate, size_t nMinFrames, size_t nMaxFrames, size_t nStepFrames)
+		: m_nSampleRate(nSampleRate),
+		  m_nMinFrames(nMinFrames),
+		  m_nMaxFrames(Utility::Max(nMinFrames, nMaxFrames)),
+		  m_nStepFrames(nStepFrames),
+		  m_nTargetFrames(nMinFrames),
+		  m_nWindowFrames(0),
+		  m_nWindowPeakLoad(0)
+	{
+	}
+
+	size_t GetTargetFrames() const { return m_nTargetFrames; }
+
+	// Latency of the target queue level in microseconds
+	unsigned int GetTargetMicros() const { return static_cast<u64>(m_nTargetFrames) * 1000000 / m_nSampleRate; }
+
+	// Call after each block; returns true if the target queue level was changed
+	bool Update(size_t nFrames, unsigned int nRenderTicks, bool bUnderrun)
+	{
+		if (bUnderrun)
+			return Grow();
+
+		if (nFrames == 0)
+			return false;
+
+		// Render time as a percentage of the block's playback time
+		const unsigned int nLoad = static_cast<u64>(nRenderTicks) * m_nSampleRate * 100 / (static_cast<u64>(nFrames) * 1000000);
+		if (nLoad >= GrowLoadPercent)
+			return Grow();
+
+		m_nWindowPeakLoad = Utility::Max(m_nWindowPeakLoad, nLoad);
+		m_nWindowFrames += nFrames;
+
+		// Only shrink after a sustained period of slack
+		if (m_nWindowFrames < static_cast<size_t>(m_nSampleRate) * ShrinkWindowMillis / 1000)
+			return false;
+
+		const bool bShrink = m_nWindowPeakLoad < ShrinkLoadPercent && m_nTargetFrames > m_nMinFrames;
+		ResetWindow();
+
+		if (!bShrink)
+			return false;
+
+		m_nTargetFrames = Utility::Max(m_nTargetFrames - m_nStepFrames, m_nMinFrames);
+		return true;
+	}
+
+private:
+	static constexpr unsigned int GrowLoadPercent = 80;
+	static constexpr unsigned int ShrinkLoadPercent = 40;
+	static constexpr unsigned int ShrinkWindowMillis = 2000;
+
+	bool Grow()
+	{
+		ResetWindow();
+
+		if (m_nTargetFrames >= m_nMaxFrames)
+			return false;
+
+		m_nTargetFrames = Utility::Min(m_nTargetFrames + m_nStepFrames, m_nMaxFrames);
+		return true;
+	}
+
+	void ResetWindow()
+	{
+		m_nWindowFrames = 0;
+		m_nWindowPeakLoad = 0;
+	}
+
+	unsigned int m_nSampleRate;
+	size_t m_nMinFrames;
+	size_t m_nMaxFrames;
+	size_t m_nStepFrames;
+	size_t m_nTargetFrames;
+
+	// Frames rendered and highest load seen since the last adjustment
+	size_t m_nWindowFrames;
+	unsigned int m_nWindowPeakLoad;
+};
+
+#endif
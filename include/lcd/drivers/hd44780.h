@@ -57,12 +57,18 @@ protected:
 		Narrow
 	};
 
+	static constexpr u8 MaxColumns = 20;
+	static constexpr u8 MaxRows = 4;
+	static constexpr u8 UnknownAddress = 0xFF;
+
 	virtual void WriteNybble(u8 nNybble, TWriteMode Mode) = 0;
 	void WriteByte(u8 nByte, TWriteMode Mode);
 
 	void WriteCommand(u8 nByte);
 	void WriteData(u8 nByte);
 	void WriteData(const u8* pBytes, size_t nSize);
+	void WriteCell(u8 nX, u8 nY, u8 nChar);
+	void ResetShadowBuffer();
 
 	void SetCustomChar(u8 nIndex, const u8 nCharData[8]);
 	void SetBarChars(TBarCharSet CharSet);
@@ -70,6 +76,14 @@ protected:
 
 	u8 m_RowOffsets[4];
 
+	// Characters currently on the display, and the display's DDRAM address counter, so that only changed cells are written
+	u8 m_ShadowBuffer[MaxRows][MaxColumns];
+	u8 m_nDDRAMAddress;
+
+	// Custom character (CGRAM) contents, so that unchanged characters aren't rewritten
+	u8 m_CustomChars[8][8];
+	u8 m_nValidCustomChars;
+
 	TBarCharSet m_BarCharSet;
 };
 
@@ -96,12 +110,22 @@ public:
 	CHD44780I2C(CI2CMaster* pI2CMaster, u8 nAddress = 0x27, u8 nColumns = 20, u8 nRows = 2);
 
 	virtual void SetBacklightState(bool bEnabled) override;
+	virtual bool UpdateTransfers(size_t nMaxBytes) override;
 
 protected:
+	// Enough for a few complete redraws of a 20x4 display
+	static constexpr size_t TransferQueueSize = 1024;
+
 	virtual void WriteNybble(u8 nNybble, TWriteMode Mode) override;
+	void SendNybble(u8 nByte);
 
 	CI2CMaster* m_pI2CMaster;
 	u8 m_nAddress;
+
+	// I/O expander states (with ENABLE high) for nybbles queued while asynchronous transfers are enabled
+	u8 m_TransferQueue[TransferQueueSize];
+	size_t m_nTransferQueueHead;
+	size_t m_nTransferQueueCount;
 };
 
 #endif
@@ -63,19 +63,41 @@ public:
 	virtual void Flip() override;
 
 	virtual void SetBacklightState(bool bEnabled) override;
+	virtual bool UpdateTransfers(size_t nMaxBytes) override;
 
 protected:
 	struct TFrameBufferUpdatePacket
 	{
 		u8 DataControlByte;
-		u8 FrameBuffer[128 * 64 / 8];
+		u8 FrameBuffer[132 * 64 / 8];
 	}
 	PACKED;
 
+	// Rectangle of changed pixel data, in pages (8 rows) and columns
+	struct TWindow
+	{
+		u8 nFirstPage;
+		u8 nLastPage;
+		u8 nFirstColumn;
+		u8 nLastColumn;
+	};
+
+	static constexpr size_t MaxWindows = 64 / 8;
+
+	// Bytes of bus traffic needed to start sending a new window of pixel data, besides the pixel data itself
+	static constexpr size_t WindowOverheadBytes = 12;
+
 	void WriteCommand(u8 nCommand) const;
-	virtual void WriteFrameBuffer(bool bForceFullUpdate = false) const;
+	void WriteCommands(const u8* pCommands, size_t nCount) const;
+	bool GetDirtyColumns(u8 nPage, u8& nOutFirstColumn, u8& nOutLastColumn) const;
+	void WriteFrameBuffer(bool bForceFullUpdate = false);
 	void SwapFrameBuffers();
 
+	// Controller-specific parts of sending a frame
+	virtual size_t GetPageSize() const { return m_nWidth; }
+	virtual void QueueWindows(bool bForceFullUpdate);
+	virtual void WriteWindowAddress(const TWindow& Window) const;
+
 	CI2CMaster* m_pI2CMaster;
 	u8 m_nAddress;
 	TLCDRotation m_Rotation;
@@ -84,6 +106,13 @@ protected:
 	// Double framebuffers
 	TFrameBufferUpdatePacket m_FrameBuffers[2];
 	u8 m_nCurrentFrameBuffer;
+
+	// Windows of the last flipped frame still to be sent, and how much of the current window has been sent
+	TWindow m_Windows[MaxWindows];
+	size_t m_nWindows;
+	size_t m_nTransferWindow;
+	size_t m_nTransferOffset;
+	u8 m_nTransferFrameBuffer;
 };
 
 class CSH1106 : public CSSD1306
@@ -92,8 +121,9 @@ public:
 	CSH1106(CI2CMaster* pI2CMaster, u8 nAddress = 0x3C, u8 nWidth = 128, u8 nHeight = 32, TLCDRotation Rotation = TLCDRotation::Normal);
 
 private:
-	void WriteData(const u8* pData, size_t nSize) const;
-	virtual void WriteFrameBuffer(bool bForceFullUpdate = false) const override;
+	virtual size_t GetPageSize() const override { return 128; }
+	virtual void QueueWindows(bool bForceFullUpdate) override;
+	virtual void WriteWindowAddress(const TWindow& Window) const override;
 };
 
 #endif
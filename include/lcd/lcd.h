@@ -38,6 +38,7 @@ public:
 
 	CLCD(u8 nWidth, u8 nHeight)
 		: m_bBacklightEnabled(true),
+		  m_bAsyncTransfers(false),
 		  m_nWidth(nWidth),
 		  m_nHeight(nHeight)
 	{
@@ -65,8 +66,27 @@ public:
 	bool GetBacklightState() const { return m_bBacklightEnabled; }
 	virtual void SetBacklightState(bool bEnabled) {};
 
+	// While enabled, drivers that support it queue display updates instead of sending them straight away. The queued
+	// data is sent a part at a time by UpdateTransfers(), so that other devices on the same bus can be serviced in between.
+	void SetAsyncTransfers(bool bEnabled)
+	{
+		if (!bEnabled)
+			FinishTransfers();
+		m_bAsyncTransfers = bEnabled;
+	}
+
+	// Sends roughly up to nMaxBytes of queued data (always making some progress); returns true if more remains
+	virtual bool UpdateTransfers(size_t nMaxBytes) { return false; }
+
+	void FinishTransfers()
+	{
+		while (UpdateTransfers(static_cast<size_t>(-1)))
+			;
+	}
+
 protected:
 	bool m_bBacklightEnabled;
+	bool m_bAsyncTransfers;
 	u8 m_nWidth;
 	u8 m_nHeight;
 };
@@ -23,6 +23,7 @@
 #ifndef _ui_h
 #define _ui_h
 
+#include <circle/sysconfig.h>
 #include <circle/types.h>
 
 #include "lcd/barchars.h"
@@ -39,6 +40,20 @@ public:
 		Yamaha,
 	};
 
+	// Diagnostics shown on the performance page; percentages unless noted
+	struct TPerformanceStats
+	{
+		u8 CoreLoads[CORES];
+		u8 nRenderLoad;
+		unsigned int nUnderruns;
+		unsigned int nVoices;
+		unsigned int nMaxVoices;
+		u8 nMIDIBufferPeak;
+		unsigned int nFreeMemoryKB;
+		unsigned int nTemperature;
+		unsigned int nClockMHz;
+	};
+
 	CUserInterface();
 
 	void Update(CLCD& LCD, CSynthBase& Synth, unsigned int nTicks);
@@ -53,6 +68,11 @@ public:
 
 	bool IsScrolling() const { return m_bIsScrolling; }
 
+	// Replaces the synth's display until hidden again; system messages are still shown over it
+	void SetPerformancePageVisible(bool bVisible) { m_bPerformancePageVisible = bVisible; }
+	bool IsPerformancePageVisible() const { return m_bPerformancePageVisible; }
+	void SetPerformanceStats(const TPerformanceStats& Stats) { m_PerformanceStats = Stats; }
+
 	static u8 CenterMessageOffset(CLCD& LCD, const char* pMessage);
 	static void DrawChannelLevels(CLCD& LCD, u8 nBarHeight, float* pChannelLevels, float* pPeakLevels, u8 nChannels, bool bDrawBarBases);
 
@@ -73,6 +93,7 @@ private:
 	bool DrawSystemState(CLCD& LCD) const;
 	void DrawSysExText(CLCD& LCD, u8 nFirstRow) const;
 	void DrawSysExBitmap(CLCD& LCD, u8 nFirstRow, u8 nRows) const;
+	void DrawPerformancePage(CLCD& LCD, unsigned int nTicks) const;
 
 	static void DrawChannelLevelsCharacter(CLCD& LCD, u8 nRows, u8 nBarOffsetX, u8 nBarYOffset, u8 nBarSpacing, const float* pChannelLevels, u8 nChannels, bool bDrawBarBases);
 	static void DrawChannelLevelsGraphical(CLCD& LCD, u8 nBarOffsetX, u8 nBarYOffset, u8 nBarWidth, u8 nBarHeight, u8 nBarSpacing, const float* pChannelLevels, const float* pPeakLevels, u8 nChannels, bool bDrawBarBases);
@@ -84,6 +105,7 @@ private:
 	static constexpr unsigned SystemMessageDisplayTimeMillis = 3000;
 	static constexpr unsigned SystemMessageSpinnerTimeMillis = 32;
 	static constexpr unsigned SC55DisplayTimeMillis = 3000;
+	static constexpr unsigned PerformancePageFlipTimeMillis = 2000;
 
 	// UI state
 	TState m_State;
@@ -96,6 +118,10 @@ private:
 	TSysExDisplayMessage m_SysExDisplayMessageType;
 	char m_SysExTextBuffer[SyxExTextBufferSize];
 	u8 m_SysExPixelBuffer[SysExPixelBufferSize];
+
+	// Performance page
+	volatile bool m_bPerformancePageVisible;
+	TPerformanceStats m_PerformanceStats;
 };
 
 #endif
@@ -0,0 +1,119 @@
+//
+// midicapture.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midicapture_h
+#define _midicapture_h
+
+#include <circle/sched/task.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include <atomic>
+
+#include "midieventqueue.h"
+
+// Records the merged MIDI stream to Standard MIDI Files (format 0).
+// The main task only timestamps and queues messages; a low-priority task encodes them and writes them out in
+// large batches, so storage is never touched while MIDI is being dispatched. If storage falls behind, messages
+// are dropped and counted rather than stalling the caller.
+class CMIDICapture : protected CTask
+{
+public:
+	CMIDICapture();
+
+	// Main task; files are numbered sequentially within pDirectory (e.g. "SD:captures")
+	bool Start(const char* pDirectory);
+	void Stop();
+	bool IsCapturing() const { return m_bCapturing; }
+
+	// Main task
+	void CaptureShortMessage(u32 nMessage, unsigned int nTimestamp)
+	{
+		if (m_bCapturing && !m_Queue.EnqueueShortMessage(nMessage, nTimestamp))
+			m_nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void CaptureSysExMessage(const u8* pData, size_t nSize, unsigned int nTimestamp)
+	{
+		if (m_bCapturing && (nSize > MaxSysExSize || !m_Queue.EnqueueSysExMessage(pData, nSize, nTimestamp)))
+			m_nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	unsigned int GetDroppedMessages() const { return m_nDroppedMessages.load(std::memory_order_relaxed); }
+
+	virtual void Run() override;
+
+private:
+	enum class TState
+	{
+		Idle,
+		Opening,
+		Recording,
+		Closing,
+	};
+
+	static constexpr size_t QueueSize = 4096;
+	static constexpr size_t SysExBufferSize = 32768;
+	static constexpr size_t MaxSysExSize = SysExBufferSize / 2;
+
+	// Largest encoded event: delta-time, status, length and data
+	static constexpr size_t MaxEventSize = 4 + 1 + 4 + MaxSysExSize;
+	static constexpr size_t EndOfTrackSize = 4;
+	static constexpr size_t WriteBufferSize = 65536;
+	static constexpr size_t BatchSize = WriteBufferSize - MaxEventSize - EndOfTrackSize;
+
+	bool OpenFile();
+	void CloseFile();
+	void DiscardEvents();
+	void EncodeEvents();
+	bool WriteBatch();
+
+	void WriteByte(u8 nByte) { m_WriteBuffer[m_nBuffered++] = nByte; }
+	void WriteVariableLength(u32 nValue);
+	void WriteDeltaTime(unsigned int nTimestamp);
+	void WriteBytes(const u8* pData, size_t nSize);
+
+	// Start/stop requests are made by the main task; the capture task completes them
+	volatile bool m_bCapturing;
+	std::atomic<TState> m_State;
+	const char* m_pDirectory;
+	unsigned int m_nStartTimestamp;
+	std::atomic<unsigned int> m_nDroppedMessages;
+
+	CMIDIEventQueue<QueueSize, SysExBufferSize> m_Queue;
+
+	// Capture task only
+	FIL m_File;
+	bool m_bFileOpen;
+	char m_FileName[64];
+	u32 m_nTrackLength;
+	unsigned int m_nLastTimestamp;
+	u64 m_nElapsedMicros;
+	u64 m_nLastTick;
+	unsigned int m_nReportedDroppedMessages;
+	unsigned int m_nLastWriteTime;
+
+	size_t m_nBuffered;
+	u8 m_WriteBuffer[WriteBufferSize];
+};
+
+#endif
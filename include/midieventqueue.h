@@ -0,0 +1,173 @@
+//
+// midieventqueue.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midieventqueue_h
+#define _midieventqueue_h
+
+#include <circle/types.h>
+#include <circle/util.h>
+
+#include <atomic>
+
+#include "utility.h"
+
+struct TMIDIEvent
+{
+	// CTimer clock ticks at time of arrival, or when it is due if scheduled ahead (e.g. by the RTP-MIDI jitter buffer)
+	unsigned int nTimestamp;
+
+	// Packed short message, or size of SysEx message
+	u32 nMessage;
+
+	// SysEx data, or nullptr for short messages
+	const u8* pSysExData;
+};
+
+// Lock-free single-producer/single-consumer queue of pre-parsed MIDI messages.
+// SysEx data is copied into an internal buffer and passed by reference; it remains valid until the next call to Dequeue().
+template <size_t N, size_t nSysExBufferSize>
+class CMIDIEventQueue
+{
+public:
+	CMIDIEventQueue()
+		: m_nInPtr(0),
+		  m_nOutPtr(0),
+		  m_nSysExInPtr(0),
+		  m_nSysExOutPtr(0),
+		  m_nSysExReleasePtr(0),
+		  m_Slots{},
+		  m_SysExBuffer{}
+	{
+	}
+
+	// Producer only
+	bool EnqueueShortMessage(u32 nMessage, unsigned int nTimestamp)
+	{
+		const size_t nInPtr = m_nInPtr.load(std::memory_order_relaxed);
+		const size_t nNextInPtr = (nInPtr + 1) & BufferMask;
+
+		if (nNextInPtr == m_nOutPtr.load(std::memory_order_acquire))
+			return false;
+
+		TSlot& Slot = m_Slots[nInPtr];
+		Slot.Event = { nTimestamp, nMessage, nullptr };
+		Slot.nSysExEnd = m_nSysExInPtr;
+
+		m_nInPtr.store(nNextInPtr, std::memory_order_release);
+		return true;
+	}
+
+	// Producer only
+	bool EnqueueSysExMessage(const u8* pData, size_t nSize, unsigned int nTimestamp)
+	{
+		const size_t nInPtr = m_nInPtr.load(std::memory_order_relaxed);
+		const size_t nNextInPtr = (nInPtr + 1) & BufferMask;
+
+		if (nNextInPtr == m_nOutPtr.load(std::memory_order_acquire))
+			return false;
+
+		// SysEx data must be contiguous; skip to the start of the buffer if it won't fit at the end
+		size_t nSysExInPtr = m_nSysExInPtr;
+		const size_t nOffset = nSysExInPtr & SysExBufferMask;
+		const size_t nPadding = nOffset + nSize > nSysExBufferSize ? nSysExBufferSize - nOffset : 0;
+		const size_t nUsed = nSysExInPtr - m_nSysExOutPtr.load(std::memory_order_acquire);
+
+		if (nUsed + nPadding + nSize > nSysExBufferSize)
+			return false;
+
+		nSysExInPtr += nPadding;
+		u8* const pSysExData = &m_SysExBuffer[nSysExInPtr & SysExBufferMask];
+		memcpy(pSysExData, pData, nSize);
+		nSysExInPtr += nSize;
+
+		TSlot& Slot = m_Slots[nInPtr];
+		Slot.Event = { nTimestamp, static_cast<u32>(nSize), pSysExData };
+		Slot.nSysExEnd = nSysExInPtr;
+
+		m_nSysExInPtr = nSysExInPtr;
+		m_nInPtr.store(nNextInPtr, std::memory_order_release);
+		return true;
+	}
+
+	// Either side
+	bool IsEmpty() const
+	{
+		return m_nOutPtr.load(std::memory_order_acquire) == m_nInPtr.load(std::memory_order_acquire);
+	}
+
+	// Consumer only
+	bool Peek(TMIDIEvent& OutEvent) const
+	{
+		const size_t nOutPtr = m_nOutPtr.load(std::memory_order_relaxed);
+		if (nOutPtr == m_nInPtr.load(std::memory_order_acquire))
+			return false;
+
+		OutEvent = m_Slots[nOutPtr].Event;
+		return true;
+	}
+
+	// Consumer only
+	bool Dequeue(TMIDIEvent& OutEvent)
+	{
+		// Release SysEx data belonging to the previously-dequeued event
+		m_nSysExOutPtr.store(m_nSysExReleasePtr, std::memory_order_release);
+
+		const size_t nOutPtr = m_nOutPtr.load(std::memory_order_relaxed);
+		if (nOutPtr == m_nInPtr.load(std::memory_order_acquire))
+			return false;
+
+		const TSlot& Slot = m_Slots[nOutPtr];
+		OutEvent = Slot.Event;
+		m_nSysExReleasePtr = Slot.nSysExEnd;
+
+		m_nOutPtr.store((nOutPtr + 1) & BufferMask, std::memory_order_release);
+		return true;
+	}
+
+private:
+	static_assert(Utility::IsPowerOfTwo(N), "Event queue size must be a power of 2");
+	static_assert(Utility::IsPowerOfTwo(nSysExBufferSize), "SysEx buffer size must be a power of 2");
+
+	struct TSlot
+	{
+		TMIDIEvent Event;
+
+		// Position in the SysEx buffer once this event has been consumed
+		size_t nSysExEnd;
+	};
+
+	static constexpr size_t BufferMask = N - 1;
+	static constexpr size_t SysExBufferMask = nSysExBufferSize - 1;
+
+	std::atomic<size_t> m_nInPtr;
+	std::atomic<size_t> m_nOutPtr;
+
+	// Free-running byte counters; only the producer writes m_nSysExInPtr, only the consumer writes the others
+	size_t m_nSysExInPtr;
+	std::atomic<size_t> m_nSysExOutPtr;
+	size_t m_nSysExReleasePtr;
+
+	TSlot m_Slots[N];
+	u8 m_SysExBuffer[nSysExBufferSize];
+};
+
+#endif
@@ -0,0 +1,67 @@
+//
+// midifile.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _midifile_h
+#define _midifile_h
+
+#include <circle/types.h>
+
+#include <vector>
+
+// Standard MIDI File (format 0 or 1) reader for offline rendering; all tracks are merged into a single
+// list of raw MIDI messages, timed in microseconds from the start of the file
+class CMIDIFile
+{
+public:
+	struct TEvent
+	{
+		u64 nMicros;
+		size_t nOffset;
+		size_t nSize;
+	};
+
+	bool Load(const char* pPath);
+	bool Parse(const u8* pData, size_t nSize, const char* pName);
+
+	size_t GetEventCount() const { return m_Events.size(); }
+	const TEvent& GetEvent(size_t nIndex) const { return m_Events[nIndex]; }
+	const u8* GetEventData(const TEvent& Event) const { return m_Data.data() + Event.nOffset; }
+	u64 GetDurationMicros() const { return m_Events.empty() ? 0 : m_Events.back().nMicros; }
+
+private:
+	struct TTrackEvent
+	{
+		u64 nTick;
+		size_t nOffset;
+		size_t nSize;
+
+		// Microseconds per quarter note, or 0 if this isn't a tempo change
+		u32 nTempo;
+	};
+
+	bool ParseTrack(const u8* pData, size_t nSize, std::vector<TTrackEvent>& OutEvents);
+
+	std::vector<TEvent> m_Events;
+	std::vector<u8> m_Data;
+};
+
+#endif
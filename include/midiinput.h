@@ -0,0 +1,95 @@
+//
+// midiinput.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _midiinput_h
+#define _midiinput_h
+
+#include <circle/types.h>
+
+#include "midieventqueue.h"
+#include "midiparser.h"
+
+// Complete messages from all MIDI inputs, waiting to be dispatched by the main task
+using TMIDIMergeQueue = CMIDIEventQueue<1024, 16384>;
+
+// Parser state for a single MIDI input, so that running status and SysEx from different inputs can't interleave.
+// All inputs must be parsed from tasks on the same core; the merge queue has a single consumer.
+class CMIDIInputParser : public CMIDIParser
+{
+public:
+	enum TError : u8
+	{
+		UnexpectedStatus = 1 << 0,
+		SysExOverflow    = 1 << 1,
+		QueueOverflow    = 1 << 2,
+	};
+
+	CMIDIInputParser(const char* pName, TMIDIMergeQueue& MergeQueue);
+	~CMIDIInputParser();
+
+	void ParseMIDIBytes(const u8* pData, size_t nSize, unsigned int nTimestamp, bool bIgnoreNoteOns = false);
+	void ParseMIDIPacket(const u8* pData, size_t nSize, unsigned int nTimestamp, bool bIgnoreNoteOns = false);
+
+	const char* GetName() const { return m_pName; }
+
+	// Channel messages are tagged with this bank before being merged
+	void SetChannelBank(u8 nBank) { m_nChannelBank = nBank; }
+
+	// Totals since boot, for monitoring
+	unsigned int GetReceivedBytes() const { return m_nReceivedBytes; }
+	unsigned int GetReceivedMessages() const { return m_nReceivedMessages; }
+
+	// Returns the errors that have occurred since the last call
+	u8 TakeErrors();
+
+protected:
+	virtual void OnShortMessage(u32 nMessage) override;
+	virtual void OnSysExData(const u8* pData, size_t nSize) override;
+	virtual void OnSysExComplete() override;
+	virtual void OnSysExAborted() override;
+	virtual void OnUnexpectedStatus() override;
+	virtual void OnSysExOverflow() override;
+
+private:
+	// SysEx is collected in a buffer that grows on demand up to this size
+	static constexpr size_t SysExInitialBufferSize = 1024;
+	static constexpr size_t SysExMaxSize = 8192;
+
+	void ResetSysEx();
+
+	const char* m_pName;
+	TMIDIMergeQueue& m_MergeQueue;
+	u8 m_nChannelBank;
+
+	unsigned int m_nTimestamp;
+	u8 m_nErrors;
+	unsigned int m_nReceivedBytes;
+	unsigned int m_nReceivedMessages;
+
+	u8* m_pSysExBuffer;
+	size_t m_nSysExBufferSize;
+	size_t m_nSysExLength;
+	bool m_bSysExOverflow;
+};
+
+#endif
@@ -25,6 +25,8 @@
 
 #include <circle/types.h>
 
+#include <atomic>
+
 #include "utility.h"
 
 class CMIDIMonitor
@@ -34,12 +36,16 @@ public:
 
 	void OnShortMessage(u32 nMessage);
 	void GetChannelLevels(unsigned int nTicks, float* pOutLevels, float* pOutPeaks, u16 nPercussionBitMask = (1 << 9));
+
+	// Applies peak hold and falloff to levels from another source (e.g. measured from the audio output)
+	void UpdatePeakLevels(unsigned int nTicks, const float* pLevels, float* pOutPeaks);
 	void AllNotesOff();
 	void ResetControllers(bool bIsResetAllControllers);
 
 private:
 	static constexpr u8 ChannelCount = 16;
-	static constexpr u8 NoteCount = 127;
+	static constexpr u8 NoteCount = 128;
+	static constexpr u8 NoteMaskWords = NoteCount / 32;
 
 	static constexpr float AttackTimeMillis = 20.0f;
 	static constexpr float DecayTimeMillis = 100.0f;
@@ -49,7 +55,7 @@ private:
 	static constexpr float PeakHoldTimeMillis = 2000.0f;
 	static constexpr float PeakFalloffTimeMillis = 1000.0f;
 
-	enum class TEnvelopePhase
+	enum class TEnvelopePhase : u8
 	{
 		Idle,
 		NoteOn,
@@ -58,15 +64,18 @@ private:
 
 	struct TNoteState
 	{
-		TEnvelopePhase EnvelopePhase;
 		unsigned int nNoteOnTime;
 		unsigned int nNoteOffTime;
 		u8 nVelocity;
+		TEnvelopePhase EnvelopePhase;
 		bool bDamperFlag;
 	};
 
 	struct TChannelState
 	{
+		// Bitmask of notes whose envelopes haven't finished; set by incoming MIDI and cleared by GetChannelLevels()
+		std::atomic<u32> ActiveNotes[NoteMaskWords];
+
 		u8 nVolume;
 		u8 nExpression;
 		u8 nPan;
@@ -75,8 +84,27 @@ private:
 	};
 
 	void ProcessCC(u8 nChannel, u8 nCC, u8 nValue, unsigned int nTicks);
-	inline float ComputeEnvelope(TNoteState& NoteState) const;
-	inline float ComputePercussionEnvelope(TNoteState& NoteState) const;
+	void ReleaseNote(TChannelState& ChannelState, u8 nNote, unsigned int nTicks);
+	inline float ComputeEnvelope(TNoteState& NoteState, unsigned int nTicks) const;
+	inline float ComputePercussionEnvelope(TNoteState& NoteState, unsigned int nTicks) const;
+
+	static void SetActive(TChannelState& ChannelState, u8 nNote) { ChannelState.ActiveNotes[nNote / 32].fetch_or(1u << (nNote % 32), std::memory_order_relaxed); }
+	static void ClearActive(TChannelState& ChannelState, u8 nNote) { ChannelState.ActiveNotes[nNote / 32].fetch_and(~(1u << (nNote % 32)), std::memory_order_relaxed); }
+
+	// Calls Function(nNote) for each note with an unfinished envelope
+	template <class F>
+	static void ForEachActiveNote(TChannelState& ChannelState, F Function)
+	{
+		for (u8 nWord = 0; nWord < NoteMaskWords; ++nWord)
+		{
+			u32 nMask = ChannelState.ActiveNotes[nWord].load(std::memory_order_relaxed);
+			while (nMask)
+			{
+				Function(nWord * 32 + __builtin_ctz(nMask));
+				nMask &= nMask - 1;
+			}
+		}
+	}
 
 	TChannelState m_State[ChannelCount];
 	float m_PeakLevels[ChannelCount];
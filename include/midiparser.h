@@ -31,10 +31,25 @@ public:
 	CMIDIParser();
 
 	void ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNoteOns = false);
+	void ParseMIDIPacket(const u8* pData, size_t nSize, bool bIgnoreNoteOns = false);
+
+	// Length of a channel or System Common message, or 0 if not known from its status byte
+	static size_t GetShortMessageLength(u8 nStatus);
+
+	// Channel messages from an input with more than 16 channels (e.g. several USB-MIDI cables) carry
+	// their channel bank in the top byte; bank 1 addresses channels 17-32
+	static constexpr u8 MaxChannelBanks = 2;
+	static u8 GetChannelBank(u32 nMessage) { return nMessage >> 24; }
+	static u32 StripChannelBank(u32 nMessage) { return nMessage & 0xFFFFFF; }
 
 protected:
 	virtual void OnShortMessage(u32 nMessage) = 0;
-	virtual void OnSysExMessage(const u8* pData, size_t nSize) = 0;
+
+	// SysEx is passed on in fragments as it arrives, so the parser doesn't limit its size;
+	// the first fragment begins with 0xF0 and the last one ends with 0xF7
+	virtual void OnSysExData(const u8* pData, size_t nSize) = 0;
+	virtual void OnSysExComplete() = 0;
+	virtual void OnSysExAborted() = 0;
 
 	virtual void OnUnexpectedStatus();
 	virtual void OnSysExOverflow();
@@ -47,16 +62,13 @@ private:
 		SysExByte
 	};
 
-	// Matches mt32emu's SysEx buffer size
-	static constexpr size_t SysExBufferSize = 1000;
-
 	void ParseStatusByte(u8 nByte);
 	bool CheckCompleteShortMessage(bool bIgnoreNoteOns = false);
 	u32 PrepareShortMessage() const;
 	void ResetState(bool bClearStatusByte);
 
 	TState m_State;
-	u8 m_MessageBuffer[SysExBufferSize];
+	u8 m_MessageBuffer[3];
 	size_t m_nMessageLength;
 };
 
@@ -0,0 +1,147 @@
+//
+// midirouter.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _midirouter_h
+#define _midirouter_h
+
+#include <circle/serial.h>
+#include <circle/types.h>
+#include <circle/usb/usbserial.h>
+
+#include <atomic>
+
+#include "midiparser.h"
+#include "ringbuffer.h"
+#include "utility.h"
+
+// Forwards MIDI data from inputs to outputs ('MIDI thru') according to a routing matrix.
+// Each input is reassembled into whole messages so that inputs sharing an output are merged at
+// message boundaries; SysEx is held until it is complete, while System Real-Time passes straight
+// through. Data is forwarded from the context it was received in, which must be the same for every
+// call with a given input; outputs that can't be written from interrupt context are queued and sent
+// by Update().
+class CMIDIRouter
+{
+public:
+	#define ENUM_MIDIROUTEINPUT(ENUM) \
+		ENUM(GPIO, gpio)              \
+		ENUM(USB, usb)                \
+		ENUM(USBSerial, usb_serial)   \
+		ENUM(Pisound, pisound)        \
+		ENUM(AppleMIDI, applemidi)    \
+		ENUM(UDP, udp)                \
+		ENUM(Synth, synth)
+
+	#define ENUM_MIDIROUTEOUTPUT(ENUM) \
+		ENUM(GPIO, gpio)               \
+		ENUM(USBSerial, usb_serial)
+
+	CONFIG_ENUM(TInput, ENUM_MIDIROUTEINPUT);
+	CONFIG_ENUM(TOutput, ENUM_MIDIROUTEOUTPUT);
+
+	CMIDIRouter(CSerialDevice* pSerialDevice);
+
+	// Comma-separated list of <input>:<output>
+	void AddRoutes(const char* pRoutes);
+	void AddRoute(TInput Input, TOutput Output);
+	bool HasRoutes(TInput Input) const { return m_RouteMasks[static_cast<size_t>(Input)] != 0; }
+
+	// Returns false if any data was dropped
+	bool Forward(TInput Input, const u8* pData, size_t nSize, unsigned int nTimestamp);
+
+	// Call from the main task; sends queued data to USB outputs
+	void Update(CUSBSerialDevice* pUSBSerialDevice);
+
+	void DumpStats() const;
+	void ResetStats();
+
+private:
+	static constexpr size_t InputCount = 0 ENUM_MIDIROUTEINPUT(CONFIG_ENUM_COUNT);
+	static constexpr size_t OutputCount = 0 ENUM_MIDIROUTEOUTPUT(CONFIG_ENUM_COUNT);
+	static constexpr size_t QueueSize = 512;
+
+	// The same limit as the synth's input parsers
+	static constexpr size_t MaxSysExSize = 8192;
+
+	struct TQueuedData
+	{
+		unsigned int nTimestamp;
+		u8 nInput;
+		u8 nSize;
+		u8 Data[26];
+	};
+
+	// Parser state and SysEx buffer for one input
+	class CInputMerger : public CMIDIParser
+	{
+	public:
+		CInputMerger();
+
+		void Initialize(CMIDIRouter* pRouter, size_t nInput);
+		bool Forward(const u8* pData, size_t nSize, unsigned int nTimestamp);
+
+	protected:
+		virtual void OnShortMessage(u32 nMessage) override;
+		virtual void OnSysExData(const u8* pData, size_t nSize) override;
+		virtual void OnSysExComplete() override;
+		virtual void OnSysExAborted() override;
+
+		// The synth's own input parsers already report malformed data
+		virtual void OnUnexpectedStatus() override {}
+
+	private:
+		CMIDIRouter* m_pRouter;
+		size_t m_nInput;
+		unsigned int m_nTimestamp;
+		bool m_bSuccess;
+
+		u8 m_SysExBuffer[MaxSysExSize];
+		size_t m_nSysExSize;
+		bool m_bSysExOverflow;
+	};
+
+	struct TRouteStats
+	{
+		std::atomic<unsigned int> nForwardedBytes;
+		std::atomic<unsigned int> nDroppedBytes;
+		std::atomic<unsigned int> nPeakLatencyMicros;
+	};
+
+	static bool IsQueuedOutput(TOutput Output) { return Output == TOutput::USBSerial; }
+	bool ForwardMessage(size_t nInput, const u8* pData, size_t nSize, unsigned int nTimestamp);
+	void DropMessage(size_t nInput, size_t nSize, unsigned int nTimestamp);
+	void UpdateStats(size_t nInput, TOutput Output, size_t nForwarded, size_t nDropped, unsigned int nTimestamp);
+
+	CSerialDevice* m_pSerialDevice;
+
+	u8 m_RouteMasks[InputCount];
+	TRouteStats m_Stats[InputCount][OutputCount];
+	CInputMerger m_InputMergers[InputCount];
+
+	// Written from interrupts, network tasks and the main task, so it must be locked; producers also hold
+	// m_USBSerialQueueLock so that the chunks of one message are queued contiguously or not at all
+	CSpinLock m_USBSerialQueueLock;
+	CRingBuffer<TQueuedData, QueueSize> m_USBSerialQueue;
+};
+
+#endif
@@ -43,30 +43,40 @@
 #include <circle/usb/usbmassdevice.h>
 #include <circle/usb/usbmidi.h>
 #include <circle/usb/usbserial.h>
+#include <circle/usertimer.h>
 #include <fatfs/ff.h>
 #include <wlan/bcm4343.h>
 #include <wlan/hostap/wpa_supplicant/wpasupplicant.h>
 
+#include <atomic>
+
 #include "config.h"
 #include "control/control.h"
 #include "control/mister.h"
+#include "deferredlog.h"
 #include "event.h"
 #include "lcd/ui.h"
-#include "midiparser.h"
+#include "midicapture.h"
+#include "midiinput.h"
+#include "midirouter.h"
 #include "net/applemidi.h"
 #include "net/ftpdaemon.h"
+#include "net/httpdaemon.h"
+#include "net/pcmstreamer.h"
 #include "net/udpmidi.h"
 #include "pisound.h"
 #include "power.h"
+#include "renderstats.h"
 #include "ringbuffer.h"
+#include "soundoutput.h"
+#include "storagescanner.h"
 #include "synth/mt32romset.h"
 #include "synth/mt32synth.h"
 #include "synth/soundfontsynth.h"
 #include "synth/synth.h"
+#include "zoneallocator.h"
 
-//#define MONITOR_TEMPERATURE
-
-class CMT32Pi : CMultiCoreSupport, CPower, CMIDIParser, CAppleMIDIHandler, CUDPMIDIHandler
+class CMT32Pi : CMultiCoreSupport, CPower, CAppleMIDIHandler, CUDPMIDIHandler, CFTPHandler, CHTTPHandler
 {
 public:
 	CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSystem* pInterrupt, CGPIOManager* pGPIOManager, CSerialDevice* pSerialDevice, CUSBHCIDevice* pUSBHCI);
@@ -87,6 +97,40 @@ private:
 	};
 
 	static constexpr size_t MIDIRxBufferSize = 2048;
+	static constexpr size_t USBMIDIPacketBufferSize = 512;
+
+	// USB-MIDI cables beyond the first share the second parser
+	static constexpr size_t USBMIDIPorts = CMIDIParser::MaxChannelBanks;
+
+	// 1.3s of data at 31250 baud; dequeued by the main task in small batches
+	static constexpr size_t SerialMIDIRxBufferSize = 4096;
+	static constexpr size_t SerialMIDIBatchSize = 64;
+	static constexpr size_t FileChangeQueueSize = 16;
+
+	// Raw data handed off by a network MIDI task, each entry stored like a SysEx message
+	using TNetworkMIDIQueue = CMIDIEventQueue<256, 8192>;
+
+	// A byte of serial MIDI data, with the time of the UART poll that read it
+	struct TSerialMIDIByte
+	{
+		unsigned int nTimestamp;
+		u8 nData;
+	};
+
+	// A USB-MIDI event packet without its Code Index Number
+	struct TUSBMIDIPacket
+	{
+		u8 nCable;
+		u8 nLength;
+		u8 Data[3];
+	};
+
+	// A file created, replaced or removed over FTP
+	struct TFileChange
+	{
+		bool bRemoved;
+		char Path[256];
+	};
 
 	// CPower
 	virtual void OnEnterPowerSavingMode() override;
@@ -94,38 +138,78 @@ private:
 	virtual void OnThrottleDetected() override;
 	virtual void OnUnderVoltageDetected() override;
 
-	// CMIDIParser
-	virtual void OnShortMessage(u32 nMessage) override;
-	virtual void OnSysExMessage(const u8* pData, size_t nSize) override;
-	virtual void OnUnexpectedStatus() override;
-	virtual void OnSysExOverflow() override;
+	// Complete messages from the MIDI merge queue
+	void OnShortMessage(u32 nMessage);
+	void OnSysExMessage(const u8* pData, size_t nSize);
 
 	// CAppleMIDIHandler
-	virtual void OnAppleMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIBytes(pData, nSize); };
-	virtual void OnAppleMIDIConnect(const CIPAddress* pIPAddress, const char* pName) override;
-	virtual void OnAppleMIDIDisconnect(const CIPAddress* pIPAddress, const char* pName) override;
+	virtual void OnAppleMIDIDataReceived(unsigned int nSession, const u8* pData, size_t nSize, unsigned int nTimestamp) override;
+	virtual void OnAppleMIDIConnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName) override;
+	virtual void OnAppleMIDIDisconnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName) override;
 
 	// CUDPMIDIHandler
-	virtual void OnUDPMIDIDataReceived(const u8* pData, size_t nSize) override { ParseMIDIBytes(pData, nSize); };
+	virtual void OnUDPMIDIDataReceived(const u8* pData, size_t nSize) override;
+
+	// CFTPHandler
+	virtual void OnFTPFileChanged(const char* pPath, bool bRemoved) override;
+
+	// CHTTPHandler
+	virtual void OnHTTPMetricsRequest(CMetricsWriter& Writer) override;
 
 	// Initialization
+	bool InitUSB();
 	bool InitNetwork();
 	bool InitMT32Synth();
 	bool InitSoundFontSynth();
+	CMT32Synth* CreateMT32Synth();
+	CSoundFontSynth* CreateSoundFontSynth();
+	void ConfigureSynths();
+	void RunBenchmark();
+	void ParallelBootTask();
+	void CompleteParallelBoot();
 
 	// Tasks for specific CPU cores
 	void MainTask();
 	void UITask();
 	void AudioTask();
+	bool HasRenderWorker() const;
+	void RenderWorkerTask();
+	void BackgroundTask();
+	void LayerRenderTask();
+
+	void RenderLayered(float* pOutBuffer, size_t nFrames);
+	void RenderSynth(CSynthBase* pSynth, float* pOutBuffer, size_t nFrames);
+	void ReportRenderStats();
+	void ResetRenderStats();
+	void UpdatePerformanceStats();
+	void ReportMemoryStats();
+	bool WriteMemoryStats(const CZoneAllocator::TStats& Stats);
+	bool IsAudioIdle(const float* pBuffer, size_t nFrames) const;
+	unsigned int ParkAudioTask();
+	CSynthBase* GetLayeredSynth(u8 nChannel) const;
+	CSynthBase* GetStandbySynth(const CSynthBase* pCurrentSynth) const;
+	static bool IsMIDIStateMessage(u32 nMessage);
+	CSynthBase* TakeFadeOutSynth(const CSynthBase* pCurrentSynth);
+	void FadeOutSynth(CSynthBase* pSynth, float* pOutBuffer, float* pFadeBuffer, size_t nFrames);
 
 	void UpdateUSB(bool bStartup = false);
+	bool UpdateStorageScan();
 	void UpdateNetwork();
-	void UpdateMIDI();
+	void InitPCMStreamer();
+	void ProcessFileChanges();
+	bool UpdateMIDI();
 	void PurgeMIDIBuffers();
-	size_t ReceiveSerialMIDI(u8* pOutData, size_t nSize);
+	size_t ProcessUSBMIDIPackets(unsigned int nTimestamp, bool bIgnoreNoteOns = false);
+	size_t ProcessNetworkMIDI(TNetworkMIDIQueue& Queue, CMIDIInputParser& Parser, bool bIgnoreNoteOns = false);
+	void DispatchMIDIMessages();
+	void ReportMIDIInputErrors(CMIDIInputParser& Parser);
+	void PollSerialMIDI();
+	size_t ProcessSerialMIDI(bool bIgnoreNoteOns = false);
+	void ReportSerialMIDIErrors();
 	bool ParseCustomSysEx(const u8* pData, size_t nSize);
+	void OnMIDIEventQueueOverflow();
 
-	void ProcessEventQueue();
+	bool ProcessEventQueue();
 	void ProcessButtonEvent(const TButtonEvent& Event);
 
 	// Actions that can be triggered via events
@@ -135,6 +219,10 @@ private:
 	void SwitchSoundFont(size_t nIndex);
 	void DeferSwitchSoundFont(size_t nIndex);
 	void SetMasterVolume(s32 nVolume);
+	void SetPerformancePageVisible(bool bVisible);
+	void StartMIDICapture();
+	void ReloadConfig();
+	void StopMIDICapture();
 
 	const char* GetNetworkDeviceShortName() const;
 	void LEDOn();
@@ -163,17 +251,26 @@ private:
 	CAppleMIDIParticipant* m_pAppleMIDIParticipant;
 	CUDPMIDIReceiver* m_pUDPMIDIReceiver;
 	CFTPDaemon* m_pFTPDaemon;
+	CHTTPDaemon* m_pHTTPDaemon;
+
+	// Created by the main task once the network is up, then picked up by the audio task
+	std::atomic<CPCMStreamer*> m_pPCMStreamer;
 
 	CBcmRandomNumberGenerator m_Random;
 
 	CLCD* m_pLCD;
 	unsigned m_nLCDUpdateTime;
 	CUserInterface m_UserInterface;
-#ifdef MONITOR_TEMPERATURE
-	unsigned m_nTempUpdateTime;
-#endif
+	unsigned m_nPerformanceStatsTime;
+
+	// Errors raised from interrupt context or hot paths; reported by the UI task, or the main task if it isn't running
+	CDeferredLog m_DeferredLog;
 
 	CControl* m_pControl;
+	bool m_bVolumeDownHeld;
+	bool m_bVolumeUpHeld;
+	// Master volume before the first of the two buttons went down, restored when both are pressed together
+	u8 m_nVolumeBeforeCombo;
 
 	// MiSTer control interface
 	CMisterControl m_MisterControl;
@@ -186,23 +283,46 @@ private:
 
 	// Serial GPIO MIDI
 	bool m_bSerialMIDIAvailable;
-	bool m_bSerialMIDIEnabled;
+	volatile bool m_bSerialMIDIEnabled;
+
+	// The UART is polled from a timer interrupt about once per byte time, so that latency doesn't depend on the main loop
+	CUserTimer m_SerialMIDITimer;
+	bool m_bSerialMIDITimerRunning;
+	unsigned int m_nSerialMIDIPollMicros;
+	CSPSCRingBuffer<TSerialMIDIByte, SerialMIDIRxBufferSize> m_SerialMIDIRxBuffer;
+	std::atomic<int> m_nSerialMIDIError;
+	std::atomic<bool> m_bSerialMIDIThruError;
 
 	// USB devices
 	CUSBMIDIDevice* m_pUSBMIDIDevice;
 	CUSBSerialDevice* m_pUSBSerialDevice;
 	CUSBBulkOnlyMassStorageDevice* volatile m_pUSBMassStorageDevice;
 
+	// Mounts and scans a USB disk in the background after it has been attached; created on first use
+	CStorageScanner* m_pStorageScanner;
+
+	// Arrival time of the MIDI message currently being dispatched
+	unsigned int m_nMIDITimestamp;
+
 	bool m_bActiveSenseFlag;
 	unsigned m_nActiveSenseTime;
 
 	volatile bool m_bRunning;
 	volatile bool m_bUITaskDone;
+	volatile bool m_bAudioTaskDone;
 	bool m_bLEDOn;
 	unsigned m_nLEDOnTime;
 
 	// Audio output
 	CSoundBaseDevice* m_pSound;
+	CSoundOutputRing m_SoundOutputRing;
+	unsigned int m_nAudioChunkFrames;
+
+	// Audio performance statistics
+	CRenderStats m_MT32RenderStats;
+	CRenderStats m_SoundFontRenderStats;
+	CRenderStats m_OutputStats;
+	unsigned int m_nReportedUnderruns;
 
 	// Extra devices
 	CPisound* m_pPisound;
@@ -213,8 +333,51 @@ private:
 	CMT32Synth* m_pMT32Synth;
 	CSoundFontSynth* m_pSoundFontSynth;
 
+	// Layered mode; the SoundFont synth is rendered on core 3 into the layer buffer
+	bool m_bLayeredSynths;
+	u16 m_nLayeredMT32ChannelMask;
+	float* m_pLayerBuffer;
+	size_t m_nLayerRenderFrames;
+	std::atomic<unsigned int> m_nLayerRenderRequest;
+	std::atomic<unsigned int> m_nLayerRenderDone;
+
+	// Channel state is mirrored to the inactive synth; after a switch, the audio core fades out the previous synth
+	bool m_bMirrorMIDIState;
+	std::atomic<CSynthBase*> m_pFadeOutSynth;
+
+	// Parallel boot; core 3 initializes the non-default synth, which the main task adopts once it's ready
+	bool m_bParallelBoot;
+	CMT32Synth* m_pPendingMT32Synth;
+	CSoundFontSynth* m_pPendingSoundFontSynth;
+	std::atomic<bool> m_bPendingSynthReady;
+	std::atomic<bool> m_bBootComplete;
+
 	// MIDI receive buffer
-	CRingBuffer<u8, MIDIRxBufferSize> m_MIDIRxBuffer;
+	CSPSCRingBuffer<u8, MIDIRxBufferSize> m_MIDIRxBuffer;
+	CSPSCRingBuffer<TUSBMIDIPacket, USBMIDIPacketBufferSize> m_USBMIDIPacketBuffer;
+
+	// Network MIDI data, queued by the network tasks for the main task
+	TNetworkMIDIQueue m_AppleMIDIQueues[CAppleMIDIParticipant::MaxSessions];
+	TNetworkMIDIQueue m_UDPMIDIQueue;
+
+	// Files changed over FTP, queued by the FTP worker tasks for the main task
+	CSPSCRingBuffer<TFileChange, FileChangeQueueSize> m_FileChangeQueue;
+	std::atomic<bool> m_bNetworkMIDIOverflow;
+
+	// Recording of the merged stream; created on first use
+	CMIDICapture* m_pMIDICapture;
+
+	// One parser per MIDI input, merged into a single stream of complete messages
+	TMIDIMergeQueue m_MIDIMergeQueue;
+	CMIDIInputParser m_SerialMIDIParser;
+	CMIDIInputParser m_USBSerialMIDIParser;
+	CMIDIInputParser m_USBMIDIParsers[USBMIDIPorts];
+	CMIDIInputParser m_RxBufferMIDIParser;
+	CMIDIInputParser m_AppleMIDIParsers[CAppleMIDIParticipant::MaxSessions];
+	CMIDIInputParser m_UDPMIDIParser;
+
+	// MIDI thru
+	CMIDIRouter m_MIDIRouter;
 
 	// Event handling
 	TEventQueue m_EventQueue;
@@ -222,7 +385,10 @@ private:
 	static void EventHandler(const TEvent& Event);
 	static void USBMIDIDeviceRemovedHandler(CDevice* pDevice, void* pContext);
 	static void USBMIDIPacketHandler(unsigned nCable, u8* pPacket, unsigned nLength);
-	static void IRQMIDIReceiveHandler(const u8* pData, size_t nSize);
+	static void PisoundMIDIReceiveHandler(const u8* pData, size_t nSize);
+	static void SerialMIDITimerHandler(CUserTimer* pTimer, void* pParam);
+	static void OnMIDIRxOverrun();
+	static void DeferredLogLCDHandler(TLogSeverity Severity, const char* pText, void* pParam);
 
 	static void PanicHandler();
 
@@ -28,35 +28,105 @@
 #include <circle/net/socket.h>
 #include <circle/sched/task.h>
 
+#include "net/recoveryjournal.h"
+
 class CAppleMIDIHandler
 {
 public:
-	virtual void OnAppleMIDIDataReceived(const u8* pData, size_t nSize) = 0;
-	virtual void OnAppleMIDIConnect(const CIPAddress* pIPAddress, const char* pName) = 0;
-	virtual void OnAppleMIDIDisconnect(const CIPAddress* pIPAddress, const char* pName) = 0;
+	// nSession identifies the session the data belongs to, from 0 to CAppleMIDIParticipant::MaxSessions - 1
+	// nTimestamp is the intended time of the MIDI data in CTimer ticks, derived from the RTP timestamp when possible
+	virtual void OnAppleMIDIDataReceived(unsigned int nSession, const u8* pData, size_t nSize, unsigned int nTimestamp) = 0;
+	virtual void OnAppleMIDIConnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName) = 0;
+	virtual void OnAppleMIDIDisconnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName) = 0;
 };
 
 class CAppleMIDIParticipant : protected CTask
 {
 public:
-	CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom, CAppleMIDIHandler* pHandler);
+	// Number of initiators that can be connected at once
+	static constexpr size_t MaxSessions = 4;
+
+	struct TJitterStats
+	{
+		unsigned int nPackets;
+		unsigned int nLatePackets;
+		unsigned int nLostPackets;
+
+		// RFC 3550 interarrival jitter estimate and highest transit time seen, in microseconds
+		unsigned int nJitterMicros;
+		unsigned int nPeakTransitMicros;
+	};
+
+	// A non-zero jitter buffer delay schedules MIDI data at its sender timestamp plus the delay
+	CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom, CAppleMIDIHandler* pHandler, unsigned int nJitterBufferMillis = 0);
 	virtual ~CAppleMIDIParticipant() override;
 
 	bool Initialize();
 
+	TJitterStats GetJitterStats() const;
+	void ResetJitterStats();
+
 	virtual void Run() override;
 
 private:
-	void ControlInvitationState();
-	void MIDIInvitationState();
-	void ConnectedState();
-	void Reset();
+	static constexpr size_t MaxSessionNameLength = 64;
+
+	// Session state machine
+	enum class TState
+	{
+		ControlInvitation,
+		MIDIInvitation,
+		Connected
+	};
+
+	struct TSession
+	{
+		TState State;
+
+		// Connected peer
+		CIPAddress InitiatorIPAddress;
+		u16 nInitiatorControlPort;
+		u16 nInitiatorMIDIPort;
+		char Name[MaxSessionNameLength];
+
+		u32 nInitiatorToken;
+		u32 nInitiatorSSRC;
+		u32 nSSRC;
+
+		u64 nOffsetEstimate;
+		u64 nLastSyncTime;
+
+		u16 nSequence;
+		bool bSequenceValid;
+		u16 nLastFeedbackSequence;
+		u64 nLastFeedbackTime;
+
+		// Previous transit time for the jitter estimate
+		s32 nLastTransit;
+		bool bHaveLastTransit;
+
+		// Receiver state for rebuilding lost MIDI data
+		CRecoveryJournal RecoveryJournal;
+	};
+
+	void ControlPacketReceived();
+	void MIDIPacketReceived();
+	void MIDIDataReceived(TSession& Session, unsigned int nSession);
+	void UpdateSession(TSession& Session, unsigned int nSession);
+	void ResetSession(TSession& Session);
+
+	TSession* FindControlSession(const CIPAddress& IPAddress, u16 nPort);
+	TSession* FindMIDISession(const CIPAddress& IPAddress, u16 nPort);
+	TSession* FindFreeSession();
+	unsigned int GetSessionIndex(const TSession& Session) const { return &Session - m_Sessions; }
+
+	unsigned int RTPTimestampToTicks(TSession& Session, u32 nRTPTimestamp);
 
 	bool SendPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort, const void* pData, size_t nSize);
-	bool SendAcceptInvitationPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort);
+	bool SendAcceptInvitationPacket(TSession& Session, CSocket* pSocket, u16 nPort);
 	bool SendRejectInvitationPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort, u32 nInitiatorToken);
-	bool SendSyncPacket(u64 nTimestamp1, u64 nTimestamp2);
-	bool SendFeedbackPacket();
+	bool SendSyncPacket(TSession& Session, u64 nTimestamp1, u64 nTimestamp2);
+	bool SendFeedbackPacket(TSession& Session);
 
 	CBcmRandomNumberGenerator* m_pRandom;
 
@@ -70,11 +140,6 @@ private:
 	u16 m_nForeignControlPort;
 	u16 m_nForeignMIDIPort;
 
-	// Connected peer
-	CIPAddress m_InitiatorIPAddress;
-	u16 m_nInitiatorControlPort;
-	u16 m_nInitiatorMIDIPort;
-
 	// Socket receive buffers
 	u8 m_ControlBuffer[FRAME_BUFFER_SIZE];
 	u8 m_MIDIBuffer[FRAME_BUFFER_SIZE];
@@ -85,27 +150,13 @@ private:
 	// Callback handler
 	CAppleMIDIHandler* m_pHandler;
 
-	// Participant state machine
-	enum class TState
-	{
-		ControlInvitation,
-		MIDIInvitation,
-		Connected
-	};
-
-	TState m_State;
-
-	u32 m_nInitiatorToken = 0;
-	u32 m_nInitiatorSSRC = 0;
-	u32 m_nSSRC = 0;
-	u32 m_nLastMIDISequenceNumber = 0;
-
-	u64 m_nOffsetEstimate = 0;
-	u64 m_nLastSyncTime = 0;
+	// Fixed session table; a session is free while waiting for a control invitation
+	TSession m_Sessions[MaxSessions];
 
-	u16 m_nSequence = 0;
-	u16 m_nLastFeedbackSequence = 0;
-	u64 m_nLastFeedbackTime = 0;
+	// Jitter buffer
+	unsigned int m_nJitterBufferMicros;
+	u32 m_nScaledJitter;
+	TJitterStats m_JitterStats;
 };
 
 #endif
@@ -26,10 +26,17 @@
 #include <circle/net/socket.h>
 #include <circle/sched/task.h>
 
+class CFTPHandler
+{
+public:
+	// Called from an FTP worker task after a file has been stored, deleted or renamed; pPath is a FatFs path
+	virtual void OnFTPFileChanged(const char* pPath, bool bRemoved) = 0;
+};
+
 class CFTPDaemon : protected CTask
 {
 public:
-	CFTPDaemon(const char* pUser, const char* pPassword);
+	CFTPDaemon(const char* pUser, const char* pPassword, CFTPHandler* pHandler = nullptr);
 	virtual ~CFTPDaemon() override;
 
 	bool Initialize();
@@ -42,6 +49,9 @@ private:
 
 	const char* m_pUser;
 	const char* m_pPassword;
+
+	// Callback handler
+	CFTPHandler* m_pHandler;
 };
 
 #endif
@@ -28,6 +28,8 @@
 #include <circle/sched/task.h>
 #include <circle/string.h>
 
+#include "net/ftpdaemon.h"
+
 // TODO: These may be incomplete/inaccurate
 enum TFTPStatus
 {
@@ -79,7 +81,7 @@ struct TDirectoryListEntry;
 class CFTPWorker : protected CTask
 {
 public:
-	CFTPWorker(CSocket* pControlSocket, const char* pExpectedUser, const char* pExpectedPassword);
+	CFTPWorker(CSocket* pControlSocket, const char* pExpectedUser, const char* pExpectedPassword, CFTPHandler* pHandler);
 	virtual ~CFTPWorker() override;
 
 	virtual void Run() override;
@@ -118,12 +120,17 @@ private:
 	bool Bye(const char* pArgs);
 	bool NoOp(const char* pArgs);
 
+	void LogTransferRate(const char* pVerb, size_t nBytes, unsigned int nStartTicks);
+
 	CString m_LogName;
 
 	// Authentication
 	const char* m_pExpectedUser;
 	const char* m_pExpectedPassword;
 
+	// Notified of file changes
+	CFTPHandler* m_pHandler;
+
 	// TCP sockets
 	CSocket* m_pControlSocket;
 	CSocket* m_pDataSocket;
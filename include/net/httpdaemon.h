@@ -0,0 +1,90 @@
+//
+// httpdaemon.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _httpdaemon_h
+#define _httpdaemon_h
+
+#include <circle/net/socket.h>
+#include <circle/sched/task.h>
+#include <circle/types.h>
+
+// Appends metrics in the Prometheus text exposition format to a fixed-size buffer
+class CMetricsWriter
+{
+public:
+	CMetricsWriter(char* pBuffer, size_t nSize);
+
+	// Starts a new metric; pType is "counter" or "gauge"
+	void Metric(const char* pName, const char* pType, const char* pHelp);
+
+	// Adds a sample to the current metric; pLabels is a comma-separated list of name="value" pairs, without braces
+	void Sample(const char* pName, u64 nValue, const char* pLabels = nullptr);
+
+	size_t GetLength() const { return m_nLength; }
+	bool IsTruncated() const { return m_bTruncated; }
+
+private:
+	void Append(const char* pFormat, ...);
+
+	char* m_pBuffer;
+	size_t m_nSize;
+	size_t m_nLength;
+	bool m_bTruncated;
+};
+
+class CHTTPHandler
+{
+public:
+	// Called from the HTTP daemon's task for each request to /metrics
+	virtual void OnHTTPMetricsRequest(CMetricsWriter& Writer) = 0;
+};
+
+// Minimal read-only HTTP server; serves one request per connection, one connection at a time
+class CHTTPDaemon : protected CTask
+{
+public:
+	CHTTPDaemon(CHTTPHandler* pHandler);
+	virtual ~CHTTPDaemon() override;
+
+	bool Initialize();
+
+	virtual void Run() override;
+
+private:
+	static constexpr size_t RequestBufferSize = 1024;
+	static constexpr size_t ResponseBufferSize = 16384;
+
+	void HandleConnection(CSocket* pConnection);
+	bool ReceiveRequest(CSocket* pConnection);
+	bool SendResponse(CSocket* pConnection, const char* pStatus, const char* pContentType, const char* pBody, size_t nBodyLength);
+
+	// TCP sockets
+	CSocket* m_pListenSocket;
+
+	// Callback handler
+	CHTTPHandler* m_pHandler;
+
+	char m_RequestBuffer[RequestBufferSize];
+	char m_ResponseBuffer[ResponseBufferSize];
+};
+
+#endif
@@ -0,0 +1,110 @@
+//
+// pcmstreamer.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _pcmstreamer_h
+#define _pcmstreamer_h
+
+#include <circle/bcmrandom.h>
+#include <circle/macros.h>
+#include <circle/net/ipaddress.h>
+#include <circle/net/socket.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+#include "ringbuffer.h"
+
+// Streams the final mix to a UDP host as RTP with a 16-bit linear stereo payload (L16, RFC 3551).
+// The audio core copies each block into a lock-free ring and never waits; the main task sends whole packets from it.
+// Audio is dropped rather than queued when the ring is full, or when the main task has fallen too far behind.
+class CPCMStreamer
+{
+public:
+	CPCMStreamer(const CIPAddress& Address, u16 nPort, unsigned int nSampleRate, CBcmRandomNumberGenerator* pRandom);
+	~CPCMStreamer();
+
+	bool Initialize();
+
+	// Audio core: queues interleaved stereo float samples
+	void Write(const float* pBuffer, size_t nFrames);
+
+	// Main task: sends queued packets
+	void Update();
+
+	unsigned int GetDroppedFrames() const { return m_nDroppedFrames.load(std::memory_order_relaxed); }
+
+	static constexpr u8 PayloadType = 96;
+
+private:
+	// 5.8 ms at 44.1 kHz; fits a standard Ethernet MTU
+	static constexpr size_t PacketFrames = 256;
+	static constexpr size_t RingFrames = 4096;
+	static constexpr size_t MaxBacklogFrames = PacketFrames * 8;
+	static constexpr size_t MaxPacketsPerUpdate = 2;
+
+	struct TFrame
+	{
+		// Big-endian
+		u16 nLeft;
+		u16 nRight;
+	};
+
+	struct TRTPHeader
+	{
+		u8 nFlags;
+		u8 nPayloadType;
+		u16 nSequence;
+		u32 nTimestamp;
+		u32 nSSRC;
+	}
+	PACKED;
+
+	// Both parts are naturally aligned, so there is no padding between them
+	struct TPacket
+	{
+		TRTPHeader Header;
+		TFrame Frames[PacketFrames];
+	};
+
+	static_assert(sizeof(TRTPHeader) == 12, "RTP header must be packed");
+
+	void DropFrames(size_t nFrames);
+	bool SendPacket();
+
+	CIPAddress m_Address;
+	u16 m_nPort;
+	unsigned int m_nSampleRate;
+	CBcmRandomNumberGenerator* m_pRandom;
+	CSocket* m_pSocket;
+
+	CSPSCRingBuffer<TFrame, RingFrames> m_Ring;
+	std::atomic<unsigned int> m_nDroppedFrames;
+
+	// RTP state; main task only
+	u16 m_nSequence;
+	u32 m_nTimestamp;
+	u32 m_nSSRC;
+
+	TPacket m_Packet;
+};
+
+#endif
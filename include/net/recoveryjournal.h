@@ -0,0 +1,66 @@
+//
+// recoveryjournal.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _recoveryjournal_h
+#define _recoveryjournal_h
+
+#include <circle/types.h>
+
+class CAppleMIDIHandler;
+
+// Receiver side of the RTP-MIDI recovery journal (RFC 6295).
+// Tracks the state built up by received channel messages, so that note, controller, program and pitch wheel state lost
+// with a dropped packet can be rebuilt from the journal carried by the next one.
+class CRecoveryJournal
+{
+public:
+	CRecoveryJournal();
+
+	void Reset();
+
+	// Update the tracked state with a channel message that was passed on to the handler
+	void OnChannelMessage(u8 nStatus, const u8* pData);
+
+	// Send the handler whatever commands are needed to bring the tracked state in line with a journal; false if malformed
+	bool Recover(const u8* pJournal, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession);
+
+private:
+	static constexpr u8 UnknownValue = 0xFF;
+
+	struct TChannelState
+	{
+		u32 ActiveNotes[128 / 32];
+		u8 Controllers[128];
+		u8 nProgram;
+		u8 nPitchBendLSB;
+		u8 nPitchBendMSB;
+	};
+
+	bool RecoverChannel(u8 nChannel, u8 nChapters, const u8* pBuffer, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession);
+	void Send(u8 nStatus, u8 nData1, u8 nData2, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession);
+
+	bool IsNoteActive(const TChannelState& State, u8 nNote) const { return State.ActiveNotes[nNote / 32] & (1u << (nNote % 32)); }
+
+	TChannelState m_Channels[16];
+};
+
+#endif
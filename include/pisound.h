@@ -28,6 +28,8 @@
 #include <circle/spimaster.h>
 #include <circle/types.h>
 
+#include <atomic>
+
 class CPisound
 {
 public:
@@ -39,6 +41,16 @@ public:
 	bool Initialize();
 	void RegisterMIDIReceiveHandler(TMIDIReceiveHandler pHandler) { m_pReceiveHandler = pHandler; }
 
+	// Reads any pending MIDI data and passes it to the receive handler; call regularly from the main task
+	void Update();
+
+	u64 GetReceivedBytes() const { return m_nReceivedBytes; }
+	u64 GetTransfers() const { return m_nTransfers; }
+
+	// Bytes received during the last full second, and the highest rate seen
+	unsigned int GetByteRate() const { return m_nByteRate; }
+	unsigned int GetPeakByteRate() const { return m_nPeakByteRate; }
+
 private:
 	u16 Transfer16(u16 nValue) const;
 	size_t ReadBytes(u8* pOutBuffer, size_t nSize) const;
@@ -49,6 +61,10 @@ private:
 	static constexpr size_t MaxIDStringLength = 25;
 	static constexpr size_t MaxVersionStringLength = 6;
 
+	// Each 16-bit SPI word carries a flag byte and at most one MIDI byte
+	static constexpr size_t MinBurstWords = 2;
+	static constexpr size_t MaxBurstWords = 32;
+
 	CSPIMaster* m_pSPIMaster;
 	unsigned m_nSamplerate;
 
@@ -62,6 +78,17 @@ private:
 
 	TMIDIReceiveHandler m_pReceiveHandler;
 
+	// Set by the data available interrupt, cleared by Update()
+	std::atomic<bool> m_bDataPending;
+	size_t m_nBurstWords;
+
+	u64 m_nReceivedBytes;
+	u64 m_nTransfers;
+	unsigned int m_nRateWindowStart;
+	unsigned int m_nRateWindowBytes;
+	unsigned int m_nByteRate;
+	unsigned int m_nPeakByteRate;
+
 	char m_SerialNumber[MaxSerialNumberStringLength];
 	char m_ID[MaxIDStringLength];
 	char m_FirmwareVersion[MaxVersionStringLength];
@@ -26,6 +26,8 @@
 #include <circle/bcmpropertytags.h>
 #include <circle/types.h>
 
+#include <atomic>
+
 class CPower
 {
 public:
@@ -34,6 +36,15 @@ public:
 	void Update();
 	void Awaken();
 	void SetPowerSaveTimeout(u16 nSeconds) { m_nPowerSaveTimeout = nSeconds; }
+	void SetClockGovernor(bool bEnabled);
+
+	// Render time as a percentage of the block's playback time; may be called from the audio core
+	void ReportRenderLoad(unsigned int nLoadPercent);
+
+	// Last sampled values; may be read from any core without querying the firmware
+	unsigned int GetCurrentTemperature() const { return m_nTemperature; }
+	unsigned int GetCurrentClockRate() const { return m_nClockRate; }
+	u32 GetThrottledStatus() const { return m_LastThrottledStatus; }
 
 protected:
 	virtual void OnEnterPowerSavingMode();
@@ -50,6 +61,10 @@ private:
 	};
 
 	void UpdateThrottledStatus();
+	void UpdateTemperature(unsigned int nTicks);
+	void UpdateClockGovernor(unsigned int nTicks);
+	unsigned int GetClockRate(u32 nTagId);
+	void SetClockRate(unsigned int nRate);
 
 	u16 m_nPowerSaveTimeout;
 	unsigned int m_nLastActivityTime;
@@ -57,6 +72,19 @@ private:
 
 	CBcmPropertyTags m_Tags;
 	u32 m_LastThrottledStatus;
+
+	// Sampled once per period for the clock governor and diagnostics
+	volatile unsigned int m_nTemperature;
+	unsigned int m_nLastTemperatureTime;
+
+	// ARM clock governor
+	bool m_bClockGovernor;
+	unsigned int m_nMinClockRate;
+	unsigned int m_nMaxClockRate;
+	volatile unsigned int m_nClockRate;
+	unsigned int m_nLastGovernorTime;
+	unsigned int m_nLastChangeTime;
+	std::atomic<unsigned int> m_nPeakRenderLoad;
 };
 
 #endif
@@ -0,0 +1,76 @@
+//
+// renderbenchmark.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _renderbenchmark_h
+#define _renderbenchmark_h
+
+#include <circle/string.h>
+#include <circle/types.h>
+
+#include "config.h"
+#include "lcd/ui.h"
+#include "midifile.h"
+#include "synth/mt32synth.h"
+#include "synth/synthbase.h"
+
+// Renders a corpus of Standard MIDI Files through each synth at a range of settings as fast as possible,
+// producing CSV results that can be compared across boards and releases.
+// MIDI files in <directory>/mt32 are rendered by mt32emu at each resampler quality, and MIDI files in
+// <directory>/gm are rendered by FluidSynth at each polyphony level.
+class CRenderBenchmark
+{
+public:
+	CRenderBenchmark(CConfig& Config);
+	~CRenderBenchmark();
+
+	// Returns false if no files were rendered
+	bool Run(const char* pDirectory);
+
+	const char* GetResults() const { return m_Results; }
+	bool SaveResults(const char* pPath) const;
+
+private:
+	struct TResult
+	{
+		unsigned int nAudioMillis;
+		unsigned int nElapsedMillis;
+		unsigned int nBlocks;
+		unsigned int nMeanBlockMicros;
+		unsigned int nWorstBlockMicros;
+		unsigned int nOverruns;
+		unsigned int nPeakVoices;
+	};
+
+	static constexpr unsigned int TailSeconds = 2;
+
+	unsigned int RunSynth(bool bMT32, CMT32Synth::TResamplerQuality ResamplerQuality, int nPolyphony, const char* pDirectory);
+	CSynthBase* CreateSynth(bool bMT32, CMT32Synth::TResamplerQuality ResamplerQuality);
+	void RenderFile(CSynthBase& Synth, const CMIDIFile& MIDIFile, TResult& OutResult);
+	void AddResult(const char* pSynthName, const char* pSetting, const char* pFileName, const TResult& Result);
+
+	CConfig& m_Config;
+	CUserInterface m_UI;
+	float* m_pBuffer;
+	CString m_Results;
+};
+
+#endif
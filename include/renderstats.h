@@ -0,0 +1,75 @@
+//
+// renderstats.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _renderstats_h
+#define _renderstats_h
+
+#include <circle/types.h>
+
+#include <atomic>
+
+// Render timing statistics for one producer of audio blocks; updated by a single core, read by any other
+class CRenderStats
+{
+public:
+	// Render time as a percentage of the block's playback time: <25%, <50%, <75%, <90%, <100%, overrun
+	static constexpr size_t HistogramSize = 6;
+	static constexpr unsigned int HistogramBounds[HistogramSize - 1] = { 25, 50, 75, 90, 100 };
+
+	CRenderStats();
+
+	void AddBlock(size_t nFrames, unsigned int nRenderTicks, unsigned int nSampleRate);
+	void AddUnderrun() { m_nUnderruns = m_nUnderruns + 1; }
+	void AddActiveVoices(unsigned int nVoices);
+
+	// Takes effect at the next call to AddBlock() on the updating core
+	void Reset() { m_bResetPending.store(true, std::memory_order_relaxed); }
+
+	unsigned int GetBlocks() const { return m_nBlocks; }
+	unsigned int GetHistogramCount(size_t nBucket) const { return m_Histogram[nBucket]; }
+	unsigned int GetOverruns() const { return m_Histogram[HistogramSize - 1]; }
+	unsigned int GetUnderruns() const { return m_nUnderruns; }
+	unsigned int GetPeakLoad() const { return m_nPeakLoad; }
+	unsigned int GetPeakVoices() const { return m_nPeakVoices; }
+
+	// Most recent block
+	unsigned int GetLoad() const { return m_nLoad; }
+	unsigned int GetVoices() const { return m_nVoices; }
+
+	void Dump(const char* pName) const;
+
+private:
+	void Clear();
+
+	std::atomic<bool> m_bResetPending;
+
+	volatile unsigned int m_nBlocks;
+	volatile unsigned int m_Histogram[HistogramSize];
+	volatile unsigned int m_nUnderruns;
+	volatile unsigned int m_nLoad;
+	volatile unsigned int m_nVoices;
+	volatile unsigned int m_nPeakLoad;
+	volatile unsigned int m_nPeakTicks;
+	volatile unsigned int m_nPeakVoices;
+};
+
+#endif
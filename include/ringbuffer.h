@@ -25,6 +25,10 @@
 
 #include <circle/spinlock.h>
 #include <circle/types.h>
+#include <circle/util.h>
+
+#include <atomic>
+#include <type_traits>
 
 #include "utility.h"
 
@@ -97,6 +101,9 @@ public:
 		return nDequeued;
 	}
 
+	// Space left for producers; only another producer can make it shrink
+	size_t GetFreeCount() const { return (m_nOutPtr - m_nInPtr - 1) & BufferMask; }
+
 private:
 	static_assert(Utility::IsPowerOfTwo(N), "Ring buffer size must be a power of 2");
 
@@ -120,4 +127,99 @@ private:
 	T m_Data[N];
 };
 
+// Lock-free single-producer/single-consumer variant; the producer may run in IRQ context.
+// Bulk transfers are copied in at most two spans to handle wraparound.
+template <class T, size_t N>
+class CSPSCRingBuffer
+{
+public:
+	CSPSCRingBuffer()
+		: m_nInPtr(0),
+		  m_nOutPtr(0),
+		  m_nHighWaterMark(0),
+		  m_Data{}
+	{
+	}
+
+	// Producer only
+	bool Enqueue(const T& Item)
+	{
+		return Enqueue(&Item, 1) == 1;
+	}
+
+	// Producer only; enqueues as many items as will fit
+	size_t Enqueue(const T* pItems, size_t nCount)
+	{
+		const size_t nInPtr = m_nInPtr.load(std::memory_order_relaxed);
+		const size_t nOutPtr = m_nOutPtr.load(std::memory_order_acquire);
+		const size_t nUsed = (nInPtr - nOutPtr) & BufferMask;
+
+		nCount = Utility::Min(nCount, BufferMask - nUsed);
+		if (nCount == 0)
+			return 0;
+
+		const size_t nFirstSpan = Utility::Min(nCount, N - nInPtr);
+		memcpy(m_Data + nInPtr, pItems, nFirstSpan * sizeof(T));
+		if (nCount > nFirstSpan)
+			memcpy(m_Data, pItems + nFirstSpan, (nCount - nFirstSpan) * sizeof(T));
+
+		m_nInPtr.store((nInPtr + nCount) & BufferMask, std::memory_order_release);
+
+		if (nUsed + nCount > m_nHighWaterMark.load(std::memory_order_relaxed))
+			m_nHighWaterMark.store(nUsed + nCount, std::memory_order_relaxed);
+
+		return nCount;
+	}
+
+	// Consumer only
+	bool Dequeue(T& OutItem)
+	{
+		return Dequeue(&OutItem, 1) == 1;
+	}
+
+	// Consumer only
+	size_t Dequeue(T* pOutBuffer, size_t nMaxCount)
+	{
+		const size_t nOutPtr = m_nOutPtr.load(std::memory_order_relaxed);
+		const size_t nInPtr = m_nInPtr.load(std::memory_order_acquire);
+		const size_t nCount = Utility::Min(nMaxCount, (nInPtr - nOutPtr) & BufferMask);
+
+		if (nCount == 0)
+			return 0;
+
+		const size_t nFirstSpan = Utility::Min(nCount, N - nOutPtr);
+		memcpy(pOutBuffer, m_Data + nOutPtr, nFirstSpan * sizeof(T));
+		if (nCount > nFirstSpan)
+			memcpy(pOutBuffer + nFirstSpan, m_Data, (nCount - nFirstSpan) * sizeof(T));
+
+		m_nOutPtr.store((nOutPtr + nCount) & BufferMask, std::memory_order_release);
+		return nCount;
+	}
+
+	// Either side; a lower bound on what the consumer can dequeue, and an upper bound on what the producer has left
+	size_t GetCount() const
+	{
+		return (m_nInPtr.load(std::memory_order_acquire) - m_nOutPtr.load(std::memory_order_acquire)) & BufferMask;
+	}
+
+	// Highest fill level seen by the producer, in items
+	size_t GetHighWaterMark() const { return m_nHighWaterMark.load(std::memory_order_relaxed); }
+
+	// May race with the producer, in which case a new peak may be lost
+	void ResetHighWaterMark() { m_nHighWaterMark.store(0, std::memory_order_relaxed); }
+
+	static constexpr size_t GetCapacity() { return BufferMask; }
+
+private:
+	static_assert(Utility::IsPowerOfTwo(N), "Ring buffer size must be a power of 2");
+	static_assert(std::is_trivially_copyable<T>::value, "Ring buffer items must be trivially copyable");
+
+	static constexpr size_t BufferMask = N - 1;
+
+	std::atomic<size_t> m_nInPtr;
+	std::atomic<size_t> m_nOutPtr;
+	std::atomic<size_t> m_nHighWaterMark;
+	T m_Data[N];
+};
+
 #endif
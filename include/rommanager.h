@@ -34,11 +34,15 @@ public:
 	~CROMManager();
 
 	bool ScanROMs();
+
+	// Check a single file after it has been created; ROMs are kept in memory, so removals need no action
+	bool AddROM(const char* pPath);
 	bool HaveROMSet(TMT32ROMSet ROMSet) const;
 	bool GetROMSet(TMT32ROMSet ROMSet, TMT32ROMSet& pOutROMSet, const MT32Emu::ROMImage*& pOutControl, const MT32Emu::ROMImage*& pOutPCM) const;
 
 private:
-	bool CheckROM(const char* pPath);
+	// Stores the ROM if it's valid and needed; pOutSHA1Digest receives its digest if it's a known ROM
+	bool CheckROM(const char* pPath, const MT32Emu::File::SHA1Digest* pCachedSHA1Digest = nullptr, char* pOutSHA1Digest = nullptr);
 	bool StoreROM(const MT32Emu::ROMImage& ROMImage);
 
 	// Control ROMs
@@ -24,40 +24,94 @@
 #define _soundfontmanager_h
 
 #include <circle/string.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
 
+#include "fileindex.h"
 #include "synth/fxprofile.h"
 
 class CSoundFontManager
 {
 public:
 	CSoundFontManager();
-	~CSoundFontManager() = default;
+	~CSoundFontManager();
 
 	bool ScanSoundFonts();
 	size_t GetSoundFontCount() const { return m_nSoundFonts; }
+
+	// Incremental scan, checking one directory entry per call to ContinueScan() until it returns false.
+	// The list is incomplete and unsorted until FinishScan(), which returns the same result as ScanSoundFonts().
+	void BeginScan();
+	bool ContinueScan();
+	bool FinishScan();
+	void CancelScan();
+
+	// Exchanges SoundFont lists (but not scan state) with another manager
+	void Swap(CSoundFontManager& Other);
+
+	// Returned strings remain valid until the list is next modified
 	const char* GetSoundFontPath(size_t nIndex) const;
 	const char* GetSoundFontName(size_t nIndex) const;
 	TFXProfile GetSoundFontFXProfile(size_t nIndex) const;
 	const char* GetFirstValidSoundFontPath() const;
 
-	static constexpr size_t MaxSoundFonts = 512;
+	// Warns if a SoundFont is unlikely to fit in the heap; returns false if it can't fit even once the current SoundFont is unloaded
+	bool CheckSoundFontFits(size_t nIndex) const;
+
+	// Binary search of the list, which is sorted by path
+	bool FindSoundFont(const char* pPath, size_t& nOutIndex) const;
+
+	// Incremental updates after a single file has been created, replaced or removed; the list is kept sorted.
+	// Both return true if an entry was inserted or removed, with its position in nOutIndex.
+	bool AddSoundFont(const char* pPath, size_t& nOutIndex);
+	bool RemoveSoundFont(const char* pPath, size_t& nOutIndex);
+
+	// Never refers to a SoundFont
+	static constexpr size_t InvalidIndex = static_cast<size_t>(-1);
 
 private:
-	struct TSoundFontListEntry
+	// Offsets of a SoundFont's path and name in the string arena; the name offset equals the path offset if it has no name
+	struct TSoundFontRecord
 	{
-		CString Name;
-		CString Path;
+		u32 nPathOffset;
+		u32 nNameOffset;
 	};
 
 	static constexpr size_t MaxSoundFontNameLength = 256;
+	static constexpr size_t InitialRecordCapacity = 64;
+	static constexpr size_t InitialStringsCapacity = 8 * 1024;
+
+	bool CheckCachedSoundFont(CFileIndex& Index, const char* pFullPath, const FILINFO& FileInfo, char* pOutName);
+	bool CheckSoundFont(const char* pFullPath, const char* pFileName, char* pOutName);
 
-	void CheckSoundFont(const char* pFullPath, const char* pFileName);
+	const char* GetString(u32 nOffset) const { return m_pStrings + nOffset; }
+	size_t GetLowerBound(const char* pPath) const;
+	bool InsertSoundFont(size_t nIndex, const char* pPath, const char* pName);
+	bool SetStrings(TSoundFontRecord& Record, const char* pPath, const char* pName);
+	bool AddString(const char* pString, u32& nOutOffset);
+	void ReleaseStrings(const TSoundFontRecord& Record);
+	void CompactStrings();
+	void EndScanDirectory(bool bSaveIndex);
 
+	TSoundFontRecord* m_pRecords;
 	size_t m_nSoundFonts;
-	TSoundFontListEntry m_SoundFontList[MaxSoundFonts];
+	size_t m_nRecordCapacity;
+
+	// Paths and names, null-terminated and packed together; space used by removed entries is reclaimed by compaction
+	char* m_pStrings;
+	size_t m_nStringsSize;
+	size_t m_nStringsCapacity;
+	size_t m_nReleasedStringsSize;
+
+	// Incremental scan state; m_pScanIndex is only set while a directory is open
+	size_t m_nScanDisk;
+	DIR m_ScanDirectory;
+	FILINFO m_ScanFileInfo;
+	CString m_ScanDirectoryPath;
+	CString m_ScanIndexPath;
+	CFileIndex* m_pScanIndex;
 
 	static int INIHandler(void* pUser, const char* pSection, const char* pName, const char* pValue);
-	inline static bool SoundFontListComparator(const TSoundFontListEntry& lhs, const TSoundFontListEntry& rhs);
 };
 
 #endif
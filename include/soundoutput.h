@@ -0,0 +1,106 @@
+//
+// soundoutput.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _soundoutput_h
+#define _soundoutput_h
+
+#include <circle/interrupt.h>
+#include <circle/sound/hdmisoundbasedevice.h>
+#include <circle/sound/i2ssoundbasedevice.h>
+#include <circle/sound/pwmsoundbasedevice.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+// Lock-free single-producer/single-consumer ring of 24-bit samples in 32-bit words, in place of Circle's sound queue.
+// The audio task converts its float mix straight into the ring, and the device's DMA interrupt copies it out in the hardware's format.
+class CSoundOutputRing
+{
+public:
+	CSoundOutputRing();
+	~CSoundOutputRing();
+
+	bool Allocate(size_t nFrames);
+	size_t GetSizeFrames() const { return m_nSizeFrames; }
+
+	// Either side; frames written but not yet read
+	size_t GetFramesAvail() const;
+
+	// Producer only; returns the number of frames written
+	size_t Write(const float* pSamples, size_t nFrames, bool bReversedStereo);
+
+	// Consumer only; returns the number of samples read
+	size_t Read(s32* pBuffer, size_t nSamples);
+
+private:
+	s32* m_pBuffer;
+	size_t m_nBufferMask;
+	size_t m_nSizeFrames;
+
+	// Indices of samples; always a whole number of frames apart
+	std::atomic<size_t> m_nInPtr;
+	std::atomic<size_t> m_nOutPtr;
+};
+
+// Each device fills its DMA buffer from the ring, padding with silence if the audio task falls behind
+class CPWMSoundOutput : public CPWMSoundBaseDevice
+{
+public:
+	CPWMSoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize);
+
+protected:
+	virtual unsigned GetChunk(u32* pBuffer, unsigned nChunkSize) override;
+
+private:
+	CSoundOutputRing& m_Ring;
+	u32 m_nRangeMin;
+	u32 m_nRange;
+};
+
+class CHDMISoundOutput : public CHDMISoundBaseDevice
+{
+public:
+	CHDMISoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize);
+
+protected:
+	virtual unsigned GetChunk(u32* pBuffer, unsigned nChunkSize) override;
+
+private:
+	CSoundOutputRing& m_Ring;
+
+	// Position within the IEC958 block, which carries on across chunks
+	unsigned int m_nFrame;
+};
+
+class CI2SSoundOutput : public CI2SSoundBaseDevice
+{
+public:
+	CI2SSoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize, bool bSlave, CI2CMaster* pI2CMaster);
+
+protected:
+	virtual unsigned GetChunk(u32* pBuffer, unsigned nChunkSize) override;
+
+private:
+	CSoundOutputRing& m_Ring;
+};
+
+#endif
@@ -0,0 +1,74 @@
+//
+// storagescanner.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _storagescanner_h
+#define _storagescanner_h
+
+#include <circle/sched/task.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "rommanager.h"
+#include "soundfontmanager.h"
+
+// Mounts a hot-plugged disk and rescans it for MT-32 ROMs and SoundFonts without holding up the main task.
+// Runs as a task on the main core, checking one file at a time and yielding in between so that MIDI keeps being
+// processed. The new SoundFont list is built separately and handed over in one step once the scan is complete.
+class CStorageScanner : protected CTask
+{
+public:
+	CStorageScanner(FATFS* pFileSystem, const char* pDrive);
+
+	// Main task; a new request abandons a scan in progress. ROMs are also rescanned if pROMManager is given.
+	void Mount(CROMManager* pROMManager);
+	void Unmount(bool bRescan);
+
+	// Main task; while busy, the main task should yield rather than sleep
+	bool IsBusy() const { return m_State != TState::Idle && m_State != TState::Complete; }
+	bool IsComplete() const { return m_State == TState::Complete; }
+
+	// Main task; the list is only complete until the next request, and may be swapped with the caller's own list
+	CSoundFontManager& GetSoundFontList() { return m_SoundFontList; }
+	void Acknowledge() { m_State = TState::Idle; }
+
+	virtual void Run() override;
+
+private:
+	enum class TState
+	{
+		Idle,
+		Mounting,
+		ScanningROMs,
+		ScanningSoundFonts,
+		Complete,
+	};
+
+	FATFS* m_pFileSystem;
+	const char* m_pDrive;
+
+	// Both tasks run on the same core, so state only changes while the other task is yielding
+	TState m_State;
+	CROMManager* m_pROMManager;
+	CSoundFontManager m_SoundFontList;
+};
+
+#endif
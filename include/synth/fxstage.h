@@ -0,0 +1,104 @@
+//
+// fxstage.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _fxstage_h
+#define _fxstage_h
+
+#include <circle/spinlock.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+#include "synth/fxunits.h"
+
+struct TFXParameters
+{
+	bool bReverbActive;
+	float nReverbRoomSize;
+	float nReverbDamping;
+	float nReverbWidth;
+	float nReverbLevel;
+
+	bool bChorusActive;
+	int nChorusVoices;
+	float nChorusLevel;
+	float nChorusSpeed;
+	float nChorusDepth;
+	int nChorusType;
+};
+
+// Runs a reverb and chorus on another core. The audio core submits the reverb/chorus send buses and receives the wet
+// return, which lags the dry signal by a fixed number of frames. If the FX core falls behind, the wet return drops out
+// rather than holding up the audio core.
+class CFXStage
+{
+public:
+	CFXStage();
+
+	bool Initialize(unsigned int nSampleRate);
+	void SetParameters(const TFXParameters& Parameters);
+
+	// Discards the effect tails and both rings; the wet return is silent until the FX core has flushed them.
+	// Must not be called concurrently with Process().
+	void Reset() { m_nFlushRequest.store(m_nFlushRequest.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+	// Audio core: queues nFrames of sends and mixes nFrames of wet return into the interleaved stereo output
+	void Process(const float* pReverbSend, const float* pChorusSend, float* pOutBuffer, size_t nFrames);
+
+	// FX core: called repeatedly; processes whatever sends are available, returning true if there were any
+	bool Run();
+
+	// Latency of the wet signal relative to the dry signal
+	static constexpr size_t LatencyFrames = 256;
+
+private:
+	static constexpr size_t BlockFrames = 64;
+	static constexpr size_t RingFrames = 1024;
+	static constexpr size_t RingMask = RingFrames - 1;
+
+	// The audio core waits at most half a latency period for the FX core in each call to Process()
+	unsigned int m_nWaitTimeoutMicros;
+
+	CReverbUnit m_Reverb;
+	CChorusUnit m_Chorus;
+
+	CSpinLock m_ParameterLock;
+	TFXParameters m_Parameters;
+	TFXParameters m_PendingParameters;
+	std::atomic<bool> m_bParametersPending;
+
+	// Flushes requested by Reset() and completed by the FX core
+	std::atomic<unsigned int> m_nFlushRequest;
+	std::atomic<unsigned int> m_nFlushDone;
+
+	// Sends (reverb, chorus pairs) from the audio core; free-running frame counters
+	float m_SendRing[RingFrames * 2];
+	std::atomic<size_t> m_nSendWritten;
+	std::atomic<size_t> m_nSendRead;
+
+	// Interleaved stereo wet return to the audio core
+	float m_ReturnRing[RingFrames * 2];
+	std::atomic<size_t> m_nReturnWritten;
+	std::atomic<size_t> m_nReturnRead;
+};
+
+#endif
@@ -0,0 +1,102 @@
+//
+// fxunits.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _fxunits_h
+#define _fxunits_h
+
+#include <circle/types.h>
+
+// Freeverb-style stereo reverb taking FluidSynth's reverb parameters; mixes the reverb of a mono send into stereo outputs
+class CReverbUnit
+{
+public:
+	CReverbUnit();
+	~CReverbUnit();
+
+	void Initialize(unsigned int nSampleRate);
+	void SetParameters(float nRoomSize, float nDamping, float nWidth, float nLevel);
+	void Reset();
+	void ProcessMix(const float* pIn, float* pLeftOut, float* pRightOut, size_t nFrames);
+
+private:
+	static constexpr size_t CombCount = 8;
+	static constexpr size_t AllpassCount = 4;
+
+	struct TDelayLine
+	{
+		float* pBuffer;
+		size_t nSize;
+		size_t nIndex;
+	};
+
+	// Left and right delay lines share one allocation
+	float* m_pBuffer;
+	size_t m_nBufferSize;
+	TDelayLine m_Combs[2][CombCount];
+	float m_CombFilterStores[2][CombCount];
+	TDelayLine m_Allpasses[2][AllpassCount];
+
+	float m_nFeedback;
+	float m_nDamping1;
+	float m_nDamping2;
+	float m_nWet1;
+	float m_nWet2;
+};
+
+// Multi-voice modulated delay chorus taking FluidSynth's chorus parameters; voices alternate between the left and right outputs
+class CChorusUnit
+{
+public:
+	CChorusUnit();
+	~CChorusUnit();
+
+	void Initialize(unsigned int nSampleRate);
+	void SetParameters(int nVoices, float nLevel, float nSpeed, float nDepth, int nType);
+	void Reset();
+	void ProcessMix(const float* pIn, float* pLeftOut, float* pRightOut, size_t nFrames);
+
+private:
+	// FluidSynth's limits for synth.chorus.nr and synth.chorus.depth
+	static constexpr int MaxVoices = 99;
+	static constexpr float MaxDepthMillis = 256.0f;
+	static constexpr float MinDelayMillis = 1.0f;
+
+	unsigned int m_nSampleRate;
+
+	// Power-of-two sized delay line
+	float* m_pBuffer;
+	size_t m_nBufferMask;
+	size_t m_nWriteIndex;
+
+	int m_nVoices;
+	float m_nLeftGain;
+	float m_nRightGain;
+	float m_nMinDelay;
+	float m_nDepth;
+	bool m_bTriangle;
+
+	// LFO phase of the first voice in cycles; the other voices are spread evenly across the cycle
+	float m_nPhase;
+	float m_nPhaseIncrement;
+};
+
+#endif
@@ -27,6 +27,8 @@
 
 #include <mt32emu/mt32emu.h>
 
+#include <atomic>
+
 #include "rommanager.h"
 #include "synth/mt32romset.h"
 #include "synth/synthbase.h"
@@ -40,14 +42,27 @@ public:
 		ENUM(Fastest, fastest)          \
 		ENUM(Fast, fast)                \
 		ENUM(Good, good)                \
-		ENUM(Best, best)
+		ENUM(Best, best)                \
+		ENUM(Auto, auto)
 
 	#define ENUM_MIDICHANNELS(ENUM) \
 		ENUM(Standard, standard)    \
 		ENUM(Alternate, alternate)
 
+	#define ENUM_ANALOGOUTPUTMODE(ENUM)  \
+		ENUM(DigitalOnly, digital_only) \
+		ENUM(Coarse, coarse)            \
+		ENUM(Accurate, accurate)        \
+		ENUM(Oversampled, oversampled)
+
+	#define ENUM_RENDERERTYPE(ENUM) \
+		ENUM(Int16, int16)          \
+		ENUM(Float, float)
+
 	CONFIG_ENUM(TResamplerQuality, ENUM_RESAMPLERQUALITY);
 	CONFIG_ENUM(TMIDIChannels, ENUM_MIDICHANNELS);
+	CONFIG_ENUM(TAnalogOutputMode, ENUM_ANALOGOUTPUTMODE);
+	CONFIG_ENUM(TRendererType, ENUM_RENDERERTYPE);
 
 	CMT32Synth(unsigned nSampleRate, float nGain, float nReverbGain, TResamplerQuality ResamplerQuality);
 	virtual ~CMT32Synth();
@@ -56,18 +71,37 @@ public:
 	virtual bool Initialize() override;
 	virtual void HandleMIDIShortMessage(u32 nMessage) override;
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) override;
-	virtual bool IsActive() override { return m_pSynth->isActive(); }
+	virtual bool IsActive() override;
+	virtual unsigned int GetActiveVoiceCount() const override;
+	virtual unsigned int GetMaxVoiceCount() const override;
 	virtual void AllSoundOff() override;
+	virtual void ProcessStandbyMIDIEvents() override;
 	virtual void SetMasterVolume(u8 nVolume) override;
 	virtual size_t Render(s16* pBuffer, size_t nFrames) override;
 	virtual size_t Render(float* pBuffer, size_t nFrames) override;
 	virtual void ReportStatus() const override;
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) override;
 
+	void SetGain(float nGain, float nReverbGain);
 	void SetMIDIChannels(TMIDIChannels Channels);
-	void SetReversedStereo(bool bEnabled) { m_pSynth->setReversedStereoEnabled(bEnabled); }
+	void SetReversedStereo(bool bEnabled);
 	bool SwitchROMSet(TMT32ROMSet ROMSet);
 	bool NextROMSet();
+
+	// Background ROM set switching; the loader is called repeatedly from an otherwise idle core
+	void SetBackgroundLoading(bool bEnabled) { m_bBackgroundLoading = bEnabled; }
+	void RunBackgroundLoader();
+	bool UpdateROMSetSwitch();
+
+	// Additional instances are rendered on the render worker core when enabled, otherwise on the audio core
+	size_t GetExtraInstanceCount() const { return m_nExtraInstances; }
+	void SetRenderWorkerEnabled(bool bEnabled) { m_bRenderWorkerEnabled = bEnabled && m_nExtraInstances; }
+	bool IsRenderWorkerEnabled() const { return m_bRenderWorkerEnabled; }
+	bool RenderWorker();
+
+	// Steps the resampler quality down if it was chosen automatically
+	void OnThrottleDetected();
+
 	TMT32ROMSet GetROMSet() const;
 	const char* GetControlROMName() const;
 	CROMManager& GetROMManager() { return m_ROMManager; }
@@ -80,7 +114,70 @@ private:
 	// N characters plus null terminator
 	static constexpr size_t LCDTextBufferSize = 20 + 1;
 
+	// mt32emu's upper limit on the number of partials
+	static constexpr size_t MaxPartials = 256;
+
+	// Additional MT-32/CM-32L modules on other MIDI channels
+	static constexpr size_t MaxExtraInstances = 3;
+	static constexpr size_t ExtraInstanceChunkSize = 256;
+
+	// Previously-active instances kept open; one for each ROM set other than the current one
+	static constexpr size_t MaxWarmInstances = 2;
+
+	// Resampler calibration renders this many frames per quality level
+	static constexpr size_t CalibrationChunkFrames = 256;
+	static constexpr size_t CalibrationChunks = 64;
+
+	// An opened mt32emu instance and the ROMs it was opened with
+	struct TSynthInstance
+	{
+		MT32Emu::Synth* pSynth;
+		MT32Emu::SampleRateConverter* pSampleRateConverter;
+		TMT32ROMSet ROMSet;
+		const MT32Emu::ROMImage* pControlROMImage;
+		const MT32Emu::ROMImage* pPCMROMImage;
+	};
+
+	enum class TSwitchState
+	{
+		Idle,
+		Requested,
+		Succeeded,
+		Failed,
+	};
+
+	struct TWarmInstance
+	{
+		TSynthInstance Instance;
+		unsigned int nLastUsed;
+	};
+
+	// An additional instance; incoming MIDI channels are shifted down by the offset before it sees them
+	struct TExtraInstance
+	{
+		TSynthInstance Instance;
+		u8 nChannelOffset;
+	};
+
+	bool CreateSynthInstance(TSynthInstance& Instance);
+	void CreateExtraInstances(const char* pDefinitions);
+	static void RenderSynthInstance(MT32Emu::Synth& Synth, MT32Emu::SampleRateConverter* pConverter, float* pOutBuffer, size_t nFrames);
+	static MT32Emu::Bit32u GetSynthTimestamp(MT32Emu::Synth& Synth, const MT32Emu::SampleRateConverter* pConverter, size_t nOffset);
+	unsigned int GetActivePartialCount(const MT32Emu::Synth& Synth);
+	void UpdateActivePartialCount();
+	void UpdateMaxPartialCount();
+	void PlayExtraMIDIEvent(const TMIDIEvent& Event, size_t nOffset);
+	void RenderExtraInstances(float* pOutBuffer, size_t nFrames);
+	void MixExtraInstances(float* pOutBuffer, size_t nFrames);
+	MT32Emu::SampleRateConverter* CreateSampleRateConverter(MT32Emu::Synth& Synth, TResamplerQuality Quality) const;
+	TResamplerQuality CalibrateResampler(MT32Emu::Synth& Synth) const;
+	static void DeleteSynthInstance(TSynthInstance& Instance);
+	void SwapSynthInstance(TSynthInstance& Instance);
+	void ActivateSynthInstance(TSynthInstance& Instance);
+	void DeleteWarmInstances();
+
 	void GetPartLevels(unsigned int nTicks, float PartLevels[9], float PartPeaks[9]);
+	void ScheduleMIDIEvents(size_t nFrames);
 
 	// MT32Emu::ReportHandler
 	virtual bool onMIDIQueueOverflow() override;
@@ -97,6 +194,7 @@ private:
 	float m_nReverbGain;
 
 	TResamplerQuality m_ResamplerQuality;
+	bool m_bAutoResamplerQuality;
 	MT32Emu::SampleRateConverter* m_pSampleRateConverter;
 
 	CROMManager m_ROMManager;
@@ -104,6 +202,32 @@ private:
 	const MT32Emu::ROMImage* m_pControlROMImage;
 	const MT32Emu::ROMImage* m_pPCMROMImage;
 
+	// Previously-active instances kept open for fast switching back
+	TWarmInstance m_WarmInstances[MaxWarmInstances];
+
+	// Pending background ROM set switch
+	bool m_bBackgroundLoading;
+	std::atomic<TSwitchState> m_SwitchState;
+	TSynthInstance m_PendingInstance;
+
+	TExtraInstance m_ExtraInstances[MaxExtraInstances];
+	size_t m_nExtraInstances;
+
+	// Renders the additional instances on another core while the audio core renders the main one
+	bool m_bRenderWorkerEnabled;
+	size_t m_nRenderWorkerFrames;
+	std::atomic<unsigned int> m_nRenderWorkerRequest;
+	std::atomic<unsigned int> m_nRenderWorkerDone;
+	float m_ExtraBuffer[ExtraInstanceChunkSize * 2];
+	float m_ExtraMixBuffer[ExtraInstanceChunkSize * 2];
+
+	// Active partials across all instances, counted by the audio core after each block for the UI and metrics
+	std::atomic<unsigned int> m_nActivePartials;
+
+	// Partials available across all instances; updated whenever an instance is created or swapped
+	std::atomic<unsigned int> m_nMaxPartials;
+	MT32Emu::PartialState m_PartialStates[MaxPartials];
+
 	// LCD state
 	char m_LCDTextBuffer[LCDTextBufferSize];
 };
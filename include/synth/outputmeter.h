@@ -0,0 +1,67 @@
+//
+// outputmeter.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _outputmeter_h
+#define _outputmeter_h
+
+#include <circle/types.h>
+
+#include <atomic>
+
+// Measures the peak and RMS level of each MIDI channel from the rendered audio. The audio core updates the levels after
+// each block and other cores read a consistent snapshot of them without locking.
+class COutputMeter
+{
+public:
+	static constexpr size_t MaxChannels = 16;
+
+	COutputMeter(unsigned int nSampleRate, size_t nChannels);
+
+	// Audio core: ppBuffers holds planar left and right buffers for each channel
+	void Process(const float* const* ppBuffers, size_t nFrames);
+
+	// Any core: levels are scaled from 0.0 (silence) to 1.0 (full scale) in decibels
+	void GetLevels(float* pOutRMSLevels, float* pOutPeakLevels) const;
+
+private:
+	static constexpr float RMSTimeMillis = 100.0f;
+	static constexpr float PeakFalloffTimeMillis = 300.0f;
+	static constexpr float MeterRangeDecibels = 48.0f;
+
+	static void MeasureBuffer(const float* pBuffer, size_t nFrames, float& nOutPeak, float& nOutSumOfSquares);
+	static float ToMeterScale(float nLevel);
+
+	unsigned int m_nSampleRate;
+	size_t m_nChannels;
+
+	// Audio core state
+	float m_MeanSquares[MaxChannels];
+	float m_Peaks[MaxChannels];
+
+	// Snapshot; odd sequence numbers mean an update is in progress
+	std::atomic<unsigned int> m_nSequence;
+	std::atomic<float> m_RMSSnapshot[MaxChannels];
+	std::atomic<float> m_PeakSnapshot[MaxChannels];
+};
+
+#endif
@@ -0,0 +1,97 @@
+//
+// polyphaseresampler.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _polyphaseresampler_h
+#define _polyphaseresampler_h
+
+#include <circle/types.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define POLYPHASERESAMPLER_NEON
+#endif
+
+// Rational-ratio windowed-sinc resampler for interleaved stereo float audio.
+// Input is pulled from a render function on demand, so any number of output frames can be produced per call.
+class CPolyphaseResampler
+{
+public:
+	CPolyphaseResampler();
+	~CPolyphaseResampler();
+
+	bool Initialize(unsigned int nInputRate, unsigned int nOutputRate);
+
+	// RenderInput(float* pBuffer, size_t nFrames) must write nFrames of interleaved stereo audio at the input rate
+	template <class TRenderFunction>
+	void Process(float* pOutBuffer, size_t nFrames, TRenderFunction RenderInput)
+	{
+		while (nFrames)
+		{
+			const size_t nChunkFrames = nFrames < MaxChunkFrames ? nFrames : MaxChunkFrames;
+
+			// Fetch enough input to produce this chunk
+			const size_t nLastIndex = m_nCurrentIndex + (m_nPhase + (nChunkFrames - 1) * m_nDecimation) / m_nInterpolation;
+			if (nLastIndex >= m_nFilledFrames)
+			{
+				const size_t nInputFrames = nLastIndex + 1 - m_nFilledFrames;
+				RenderInput(m_pInputBuffer, nInputFrames);
+
+				for (size_t i = 0; i < nInputFrames; ++i)
+				{
+					m_pLeft[m_nFilledFrames + i] = m_pInputBuffer[i * 2];
+					m_pRight[m_nFilledFrames + i] = m_pInputBuffer[i * 2 + 1];
+				}
+
+				m_nFilledFrames += nInputFrames;
+			}
+
+			FilterChunk(pOutBuffer, nChunkFrames);
+
+			pOutBuffer += nChunkFrames * 2;
+			nFrames -= nChunkFrames;
+		}
+	}
+
+private:
+	static constexpr size_t TapsPerPhase = 32;
+	static constexpr size_t MaxPhases = 512;
+	static constexpr size_t MaxChunkFrames = 256;
+
+	void FilterChunk(float* pOutBuffer, size_t nFrames);
+
+	// Upsampling/downsampling factors of the rational ratio
+	unsigned int m_nInterpolation;
+	unsigned int m_nDecimation;
+
+	// Coefficients per phase, stored in reverse order so that they can be applied to ascending input
+	float* m_pCoefficients;
+
+	// Planar input history; index m_nCurrentIndex is the newest input frame contributing to the next output frame
+	float* m_pLeft;
+	float* m_pRight;
+	float* m_pInputBuffer;
+	size_t m_nCurrentIndex;
+	size_t m_nFilledFrames;
+	size_t m_nPhase;
+};
+
+#endif
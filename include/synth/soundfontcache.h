@@ -0,0 +1,115 @@
+//
+// soundfontcache.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef _soundfontcache_h
+#define _soundfontcache_h
+
+#include <circle/macros.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include <atomic>
+
+#include "zoneallocator.h"
+
+// Copy of everything in a SoundFont except its sample data (the INFO list and the preset, instrument and sample headers),
+// so that FluidSynth's parser doesn't have to go to the card for them each time it opens the file.
+// It can be saved next to the SoundFont, keyed by the SoundFont's size and FAT timestamp, and read back with one contiguous read.
+class CSoundFontCache
+{
+public:
+	CSoundFontCache();
+	~CSoundFontCache();
+
+	// Reads the saved cache if it's still valid, otherwise copies the SoundFont's structure from the file itself
+	bool Load(const char* pSoundFontPath, TZoneTag Tag, bool bUseCacheFile);
+	bool Save() const;
+	void Clear();
+
+	// True if Save() would write a new cache file
+	bool NeedsSaving() const { return IsValid() && !m_bFromCacheFile; }
+
+	// Safe to call from any core while the cache isn't being loaded or cleared
+	bool IsValid() const { return m_bValid.load(std::memory_order_acquire); }
+	bool Matches(const char* pPath) const;
+
+	// Returns cached bytes from nOffset up to the end of their region, or nullptr if nOffset isn't cached
+	const u8* Find(FSIZE_t nOffset, size_t& nOutSize) const;
+
+private:
+	struct THeader
+	{
+		u32 nMagic;
+		u32 nVersion;
+		u32 nFileSize;
+		u16 nFileDate;
+		u16 nFileTime;
+		u32 nRegions;
+		u32 nDataSize;
+		u32 nChecksum;
+	}
+	PACKED;
+
+	// A range of the SoundFont held in the cache
+	struct TRegion
+	{
+		u32 nOffset;
+		u32 nSize;
+	}
+	PACKED;
+
+	static constexpr u32 Magic = 'S' | 'F' << 8 | 'C' << 16 | 'X' << 24;
+	static constexpr u32 Version = 1;
+	static constexpr size_t MaxRegions = 4;
+	static constexpr size_t MaxCacheSize = 16 * 1024 * 1024;
+	static constexpr size_t MaxPathLength = 255;
+
+	// Larger transfers are split, so that the file system lock is never held for long
+	static constexpr size_t MaxTransferSize = 256 * 1024;
+
+	bool LoadCacheFile(TZoneTag Tag);
+	bool LoadSoundFont(TZoneTag Tag);
+	bool Allocate(size_t nRegions, size_t nDataSize, TZoneTag Tag);
+	void GetCacheFilePath(char* pOutPath) const;
+
+	static bool FindRegions(FIL& File, TRegion* pOutRegions, size_t& nOutRegions);
+	static bool ReadFile(FIL& File, void* pData, size_t nSize);
+	static bool WriteFile(FIL& File, const void* pData, size_t nSize);
+	static u32 Checksum(const u8* pData, size_t nSize);
+
+	std::atomic<bool> m_bValid;
+	bool m_bFromCacheFile;
+
+	char m_Path[MaxPathLength + 1];
+	u32 m_nFileSize;
+	u16 m_nFileDate;
+	u16 m_nFileTime;
+
+	// Region table followed by the cached bytes, in the same layout as the cache file
+	u8* m_pData;
+	TRegion* m_pRegions;
+	size_t m_nRegions;
+	size_t m_nDataSize;
+};
+
+#endif
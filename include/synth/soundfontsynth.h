@@ -23,17 +23,34 @@
 #ifndef _soundfontsynth_h
 #define _soundfontsynth_h
 
+#include <circle/string.h>
 #include <circle/types.h>
 
 #include <fluidsynth.h>
 
+#include <atomic>
+
+#include "midiparser.h"
 #include "soundfontmanager.h"
 #include "synth/fxprofile.h"
+#include "synth/fxstage.h"
+#include "synth/outputmeter.h"
+#include "synth/polyphaseresampler.h"
 #include "synth/synthbase.h"
+#include "zoneallocator.h"
 
 class CSoundFontSynth : public CSynthBase
 {
 public:
+	struct TSampleCacheStats
+	{
+		unsigned int nResidentPresets;
+		size_t nSampleSize;
+		unsigned int nHits;
+		unsigned int nMisses;
+		unsigned int nEvictions;
+	};
+
 	CSoundFontSynth(unsigned nSampleRate);
 	virtual ~CSoundFontSynth() override;
 
@@ -42,6 +59,8 @@ public:
 	virtual void HandleMIDIShortMessage(u32 nMessage) override;
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) override;
 	virtual bool IsActive() override;
+	virtual unsigned int GetActiveVoiceCount() const override { return m_nActiveVoices; }
+	virtual unsigned int GetMaxVoiceCount() const override { return m_nPolyphonyLimit; }
 	virtual void AllSoundOff() override;
 	virtual void SetMasterVolume(u8 nVolume) override;
 	virtual size_t Render(s16* pOutBuffer, size_t nFrames) override;
@@ -50,28 +69,258 @@ public:
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) override;
 
 	bool SwitchSoundFont(size_t nIndex);
+	bool DidSwitchBlock() const { return m_bSwitchBlocked; }
 	size_t GetSoundFontIndex() const { return m_nCurrentSoundFontIndex; }
 	CSoundFontManager& GetSoundFontManager() { return m_SoundFontManager; }
 
+	// Update the SoundFont list after a file has changed on disk, keeping the current index pointing at the same SoundFont
+	bool IsSwitchingSoundFont() const { return m_SwitchState.load(std::memory_order_acquire) != TSwitchState::Idle; }
+	void OnSoundFontFileChanged(const char* pPath, bool bRemoved);
+
+	// Exchange the SoundFont list for a newly-scanned one in a single step, with the same index handling
+	void ReplaceSoundFontList(CSoundFontManager& NewList);
+
+	// Background SoundFont loading; the loader is called repeatedly from an otherwise idle core
+	void SetBackgroundLoading(bool bEnabled) { m_bBackgroundLoading = bEnabled; }
+
+	// Re-applies the configured gain and polyphony, plus the default effects settings if bEffects is set;
+	// the current SoundFont's effects profile still takes precedence over the defaults
+	void ApplyConfigChanges(bool bEffects);
+	void RunBackgroundLoader();
+	bool UpdateSoundFontSwitch();
+
+	// Called repeatedly from the render worker core
+	bool IsRenderWorkerEnabled() const { return m_bRenderWorkerEnabled || m_pFXStage; }
+	bool RenderWorker();
+
+	// Called when the firmware reports that the CPU clock has been (or is about to be) reduced
+	void OnThrottleDetected() { m_bThrottleDetected.store(true, std::memory_order_relaxed); }
+	int GetPolyphonyLimit() const { return m_nPolyphonyLimit; }
+
+	// Called repeatedly from core 0; loads the samples of a preset requested by the audio core
+	void LoadRequestedPreset();
+
+	// Returns false if samples aren't being loaded on demand
+	bool GetSampleCacheStats(TSampleCacheStats& OutStats) const;
+	void ResetSampleCacheStats();
+
 private:
+	enum class TSwitchState
+	{
+		Idle,
+		Requested,
+		Succeeded,
+		Failed,
+	};
+
+	enum class TPresetLoadState
+	{
+		Idle,
+		Requested,
+		Loaded,
+		Failed,
+	};
+
+	struct TPreset
+	{
+		fluid_synth_t* pSynth;
+		int nSoundFontID;
+		int nBank;
+		int nProgram;
+
+		bool operator==(const TPreset& Other) const
+		{
+			return pSynth == Other.pSynth && nSoundFontID == Other.nSoundFontID && nBank == Other.nBank && nProgram == Other.nProgram;
+		}
+	};
+
+	// A preset pinned in memory by the sample cache
+	struct TCachedPreset : TPreset
+	{
+		unsigned int nLastUsed;
+	};
+
+	// A program change held back until its preset's samples have been loaded; the bank is the one selected when it was received
+	struct TPendingProgram
+	{
+		bool bPending;
+		int nBank;
+		int nProgram;
+	};
+
+	// A previously used SoundFont kept loaded so that switching back to it is instant
+	struct TWarmSoundFont
+	{
+		CString Path;
+		fluid_synth_t* pSynth;
+		fluid_synth_t* pWorkerSynth;
+		u32 nTag;
+		size_t nSize;
+		unsigned int nLastUsed;
+	};
+
+	bool FinishSoundFontSwitch(size_t nIndex, bool bSuccess);
 	bool Reinitialize(const char* pSoundFontPath, const TFXProfile* pFXProfile);
+	bool CreateSynths(const TFXProfile* pFXProfile, float nInitialGain, fluid_synth_t*& pOutSynth, fluid_synth_t*& pOutWorkerSynth) const;
+	fluid_synth_t* CreateSynth(const TFXProfile* pFXProfile, float nInitialGain) const;
+	void ApplyFXProfile(fluid_synth_t* pSynth, const TFXProfile* pFXProfile) const;
+	bool LoadSoundFont(const char* pSoundFontPath, fluid_synth_t* pSynth, fluid_synth_t* pWorkerSynth) const;
+	void SwapSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, float nInitialGain, const TFXProfile* pFXProfile);
+	void UpdateFXStage(const TFXProfile* pFXProfile);
+	static void DeleteSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth);
+	static void FreeSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, u32 nTag);
+	u32 GetFreeSoundFontTag() const;
+	bool ActivateWarmSoundFont(const char* pSoundFontPath, const TFXProfile* pFXProfile);
+	void KeepSoundFontWarm(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, u32 nTag, const char* pSoundFontPath);
+	void EvictWarmSoundFont(size_t nIndex);
+	void EvictUnlistedWarmSoundFonts();
 	void ResetMIDIMonitor();
+	fluid_synth_t* GetChannelSynth(u8 nChannel) const;
+	void RenderOutputFrames(float* pOutBuffer, size_t nFrames);
+	void RenderOutputFrames(s16* pOutBuffer, size_t nFrames);
+	void RenderFrames(float* pOutBuffer, size_t nFrames);
+	void RenderFrames(s16* pOutBuffer, size_t nFrames);
+	void RenderFXStageFrames(float* pOutBuffer, size_t nFrames);
+	void RenderMeteredFrames(float* pOutBuffer, size_t nFrames);
+	void RenderChannelFrames(float* pOutBuffer, size_t nFrames, float** ppFXBuffers);
+	void MixFXSends(size_t nFrames);
+	void StartRenderWorker(size_t nFrames);
+	void WaitForRenderWorker() const;
+	void UpdateRenderStats(size_t nFrames, unsigned int nRenderTicks);
+	void UpdatePolyphonyGovernor(size_t nFrames, unsigned int nRenderTicks, int nActiveVoices);
+	void SetPolyphonyLimit(int nPolyphony);
 #ifndef NDEBUG
 	void DumpFXSettings() const;
 #endif
+	void SelectProgram(fluid_synth_t* pSynth, u8 nChannel, u8 nProgram);
+	bool ApplyPendingProgram(u8 nChannel, TPreset& OutPreset);
+	void UpdatePresetLoad();
+	bool ResolvePreset(fluid_synth_t* pSynth, int nBank, int nProgram, TPreset& OutPreset) const;
+	bool IsPresetResident(const TPreset& Preset) const;
+	size_t FindCachedPreset(const TPreset& Preset) const;
+	void AddCachedPreset(const TPreset& Preset);
+	bool IsPresetSelected(const TPreset& Preset) const;
+	bool IsPresetPending(const TPreset& Preset) const;
+	void EvictCachedPresets();
+	void RemoveCachedPreset(size_t nIndex);
 	bool ParseGMSysEx(const u8* pData, size_t nSize);
 	bool ParseRolandSysEx(const u8* pData, size_t nSize);
 	bool ParseYamahaSysEx(const u8* pData, size_t nSize);
+	bool DeferSysEx(const u8* pData, size_t nSize, size_t nKeySize);
+	void ApplyPendingSysEx();
+	void ForwardSysEx(const u8* pData, size_t nSize);
+
+	// CSynthBase
+	virtual bool CanHandleMIDIEvent(const TMIDIEvent& Event) const override;
+	virtual void OnMIDIEventsProcessed() override;
 
 	fluid_settings_t* m_pSettings;
 	fluid_synth_t* m_pSynth;
 
+	// Upsamples from FluidSynth's internal rate when it differs from the output rate
+	static constexpr size_t ResamplerChunkSize = 256;
+	CPolyphaseResampler* m_pResampler;
+	float m_ResamplerBuffer[ResamplerChunkSize * 2];
+
+	// Second synth rendering odd MIDI channels on another core
+	static constexpr size_t RenderWorkerChunkSize = 256;
+	bool m_bRenderWorkerEnabled;
+	fluid_synth_t* m_pWorkerSynth;
+	size_t m_nRenderWorkerFrames;
+	std::atomic<unsigned int> m_nRenderWorkerRequest;
+	std::atomic<unsigned int> m_nRenderWorkerDone;
+	float m_RenderWorkerBuffer[RenderWorkerChunkSize * 2];
+
+	// Each MIDI channel (audio group) rendered into its own planar left/right buffers, for the FX stage and output meter
+	static constexpr size_t ChannelChunkSize = 256;
+	static constexpr size_t MaxChannelBufferCount = 16 * CMIDIParser::MaxChannelBanks * 2;
+	size_t m_nChannelBufferCount;
+	float* m_pChannelBuffers;
+	float* m_ChannelBufferPointers[MaxChannelBufferCount];
+
+	// Reverb and chorus on another core; mono reverb and chorus sends derived from the channel buffers
+	CFXStage* m_pFXStage;
+	float m_FXSendBuffers[2][ChannelChunkSize];
+
+	// Channel levels measured from the channel buffers, with reverb left/right and chorus left/right returns from FluidSynth
+	static constexpr size_t MeterBufferCount = COutputMeter::MaxChannels * 2;
+	COutputMeter* m_pOutputMeter;
+	float m_MeterFXBuffers[4][ChannelChunkSize];
+
 	u8 m_nVolume;
 	float m_nInitialGain;
+	volatile int m_nActiveVoices;
+
+	// Lowers polyphony when rendering threatens to miss the block deadline
+	static constexpr unsigned int GovernorHighLoadPercent = 85;
+	static constexpr unsigned int GovernorLowLoadPercent = 60;
+	bool m_bPolyphonyGovernor;
+	int m_nMinPolyphony;
+	int m_nMaxPolyphony;
+	volatile int m_nPolyphonyLimit;
+	unsigned int m_nRenderLoad;
+	size_t m_nGovernorHoldFrames;
+	size_t m_nGovernorSlackFrames;
+	std::atomic<bool> m_bThrottleDetected;
+
+	// Samples are loaded on demand while the memory they take up is within the budget
+	static constexpr size_t MaxCachedPresets = 128;
+	size_t m_nSampleCacheBudget;
+	TCachedPreset m_CachedPresets[MaxCachedPresets];
+	size_t m_nCachedPresets;
+	unsigned int m_nPresetUseCounter;
+	TSampleCacheStats m_SampleCacheStats;
+
+	// Samples are loaded on core 0, never on the audio core; while a load is in progress, only core 0 touches the cached presets
+	static constexpr size_t MaxMIDIChannels = 16 * CMIDIParser::MaxChannelBanks;
+	TPendingProgram m_PendingPrograms[MaxMIDIChannels];
+	std::atomic<TPresetLoadState> m_PresetLoadState;
+	TPreset m_RequestedPreset;
+
+	// Previous SoundFonts stay loaded while the memory they use is within the budget
+	static constexpr size_t MaxWarmSoundFonts = TZoneTag::FluidSynthSoundFontLast - TZoneTag::FluidSynthSoundFont - 1;
+	size_t m_nWarmSoundFontBudget;
+	TWarmSoundFont m_WarmSoundFonts[MaxWarmSoundFonts];
+	size_t m_nWarmSoundFonts;
+	unsigned int m_nSoundFontUseCounter;
+
+	// Zone tag of the current SoundFont's allocations
+	u32 m_nSoundFontTag;
+
+	// Set by Reinitialize() when the current SoundFont had to be unloaded to make room for the new one
+	bool m_bCurrentSoundFontUnloaded;
+
+	// Save each SoundFont's structure to a cache file next to it
+	bool m_bSaveSoundFontCache;
+
+	// GS/XG parameter changes received since the last block boundary; only the last write to each address is kept
+	static constexpr size_t MaxPendingSysEx = 64;
+	static constexpr size_t MaxPendingSysExSize = 32;
+	struct TPendingSysEx
+	{
+		u8 Data[MaxPendingSysExSize];
+		size_t nSize;
+		size_t nKeySize;
+	};
+	TPendingSysEx m_PendingSysEx[MaxPendingSysEx];
+	size_t m_nPendingSysEx;
+
+	// 32 parts when the second USB-MIDI port has its own channel bank
+	u8 m_nMIDIChannels;
 
 	u16 m_nPercussionMask;
 	size_t m_nCurrentSoundFontIndex;
 
+	// Whether the last SwitchSoundFont() loaded the SoundFont in place, holding up the caller while it did so
+	bool m_bSwitchBlocked;
+
+	// Pending background SoundFont switch
+	bool m_bBackgroundLoading;
+	std::atomic<TSwitchState> m_SwitchState;
+	size_t m_nPendingSoundFontIndex;
+	CString m_PendingSoundFontPath;
+	TFXProfile m_PendingFXProfile;
+
 	CSoundFontManager m_SoundFontManager;
 
 	static void FluidSynthLogCallback(int nLevel, const char* pMessage, void* pUser);
@@ -24,10 +24,12 @@
 #define _synthbase_h
 
 #include <circle/spinlock.h>
+#include <circle/timer.h>
 #include <circle/types.h>
 
 #include "lcd/lcd.h"
 #include "lcd/ui.h"
+#include "midieventqueue.h"
 #include "midimonitor.h"
 
 class CSynthBase
@@ -36,7 +38,8 @@ public:
 	CSynthBase(unsigned int nSampleRate)
 		: m_Lock(TASK_LEVEL),
 		  m_nSampleRate(nSampleRate),
-		  m_pUI(nullptr)
+		  m_pUI(nullptr),
+		  m_bSampleAccurateMIDI(false)
 	{
 	}
 
@@ -46,6 +49,8 @@ public:
 	virtual void HandleMIDIShortMessage(u32 nMessage) { m_MIDIMonitor.OnShortMessage(nMessage); };
 	virtual void HandleMIDISysExMessage(const u8* pData, size_t nSize) = 0;
 	virtual bool IsActive() = 0;
+	virtual unsigned int GetActiveVoiceCount() const = 0;
+	virtual unsigned int GetMaxVoiceCount() const = 0;
 	virtual void AllSoundOff() { m_MIDIMonitor.AllNotesOff(); };
 	virtual void SetMasterVolume(u8 nVolume) = 0;
 	virtual size_t Render(s16* pOutBuffer, size_t nFrames) = 0;
@@ -53,11 +58,149 @@ public:
 	virtual void ReportStatus() const = 0;
 	virtual void UpdateLCD(CLCD& LCD, unsigned int nTicks) = 0;
 	void SetUserInterface(CUserInterface* pUI) { m_pUI = pUI; }
+	void SetSampleAccurateMIDI(bool bEnabled) { m_bSampleAccurateMIDI = bEnabled; }
+
+	// Lock-free; called by the core receiving MIDI, consumed by the audio core at the next block boundary.
+	// The audio core is woken in case it is parked waiting for MIDI.
+	bool QueueMIDIShortMessage(u32 nMessage, unsigned int nTimestamp)
+	{
+		const bool bResult = GetMIDIEventQueue(nTimestamp).EnqueueShortMessage(nMessage, nTimestamp);
+		Utility::SendEvent();
+		return bResult;
+	}
+
+	bool QueueMIDISysExMessage(const u8* pData, size_t nSize, unsigned int nTimestamp)
+	{
+		const bool bResult = GetMIDIEventQueue(nTimestamp).EnqueueSysExMessage(pData, nSize, nTimestamp);
+		Utility::SendEvent();
+		return bResult;
+	}
+
+	bool HasQueuedMIDIEvents() const { return !m_MIDIEventQueue.IsEmpty() || !m_ScheduledMIDIEventQueue.IsEmpty(); }
+
+	// Applies queued MIDI events without rendering, so that an inactive synth keeps track of channel state
+	virtual void ProcessStandbyMIDIEvents()
+	{
+		m_Lock.Acquire();
+		ProcessMIDIEventQueue();
+		m_Lock.Release();
+	}
 
 	CSpinLock m_Lock;
 	unsigned int m_nSampleRate;
 	CMIDIMonitor m_MIDIMonitor;
 	CUserInterface* m_pUI;
+
+protected:
+	// Must be called with m_Lock held
+	void ProcessMIDIEventQueue()
+	{
+		TMIDIEvent Event;
+		TMIDIEventQueue* pQueue;
+		while ((pQueue = PeekMIDIEvent(Event)) && CanHandleMIDIEvent(Event))
+		{
+			pQueue->Dequeue(Event);
+			HandleMIDIEvent(Event);
+		}
+
+		OnMIDIEventsProcessed();
+	}
+
+	// Called with m_Lock held; an event that can't be handled yet stays at the head of the queue until a later block
+	virtual bool CanHandleMIDIEvent(const TMIDIEvent&) const { return true; }
+
+	// Called with m_Lock held once the events due before a block (or sub-block) have been handled
+	virtual void OnMIDIEventsProcessed() {}
+
+	void HandleMIDIEvent(const TMIDIEvent& Event)
+	{
+		if (Event.pSysExData)
+			HandleMIDISysExMessage(Event.pSysExData, Event.nMessage);
+		else
+			HandleMIDIShortMessage(Event.nMessage);
+	}
+
+	// Time at which the block of nFrames about to be rendered is considered to have started
+	unsigned int GetBlockStartTicks(size_t nFrames) const
+	{
+		return CTimer::GetClockTicks() - static_cast<unsigned int>(nFrames * 1000000ULL / m_nSampleRate);
+	}
+
+	// Frame offset into the current block at which an event should take effect.
+	// Events are delayed by one block so that the relative timing between them is preserved.
+	size_t GetEventFrameOffset(unsigned int nTimestamp, unsigned int nBlockStartTicks) const
+	{
+		const s32 nDelta = static_cast<s32>(nTimestamp - nBlockStartTicks);
+		return nDelta > 0 ? static_cast<size_t>(static_cast<u64>(nDelta) * m_nSampleRate / 1000000) : 0;
+	}
+
+	// Renders nFrames in sub-blocks split at the frame offsets of queued events; must be called with m_Lock held
+	template <class TRenderFunction>
+	void RenderSampleAccurate(size_t nFrames, TRenderFunction RenderFrames)
+	{
+		// Events stay queued until there is a block to place them in
+		if (nFrames == 0)
+			return;
+
+		const unsigned int nBlockStartTicks = GetBlockStartTicks(nFrames);
+		size_t nRendered = 0;
+		TMIDIEvent Event;
+		TMIDIEventQueue* pQueue;
+
+		while (nRendered < nFrames)
+		{
+			size_t nEnd = nFrames;
+
+			if ((pQueue = PeekMIDIEvent(Event)) && CanHandleMIDIEvent(Event))
+			{
+				const size_t nOffset = GetEventFrameOffset(Event.nTimestamp, nBlockStartTicks);
+				if (nOffset <= nRendered)
+				{
+					pQueue->Dequeue(Event);
+					HandleMIDIEvent(Event);
+					continue;
+				}
+
+				nEnd = Utility::Min(nOffset, nFrames);
+			}
+
+			OnMIDIEventsProcessed();
+			RenderFrames(nRendered, nEnd - nRendered);
+			nRendered = nEnd;
+		}
+	}
+
+	static constexpr size_t MIDIEventQueueSize = 1024;
+	static constexpr size_t MIDIEventQueueSysExBufferSize = 16384;
+
+	using TMIDIEventQueue = CMIDIEventQueue<MIDIEventQueueSize, MIDIEventQueueSysExBufferSize>;
+
+	// Events timestamped ahead of their arrival (e.g. by the RTP-MIDI jitter buffer) go into their own queue, so that they
+	// can't hold up events received after them that are due sooner
+	TMIDIEventQueue& GetMIDIEventQueue(unsigned int nTimestamp)
+	{
+		return static_cast<s32>(nTimestamp - CTimer::GetClockTicks()) > 0 ? m_ScheduledMIDIEventQueue : m_MIDIEventQueue;
+	}
+
+	// Consumer only; peeks whichever queue has the earliest event at its head, and returns it for dequeuing
+	TMIDIEventQueue* PeekMIDIEvent(TMIDIEvent& OutEvent)
+	{
+		TMIDIEvent ScheduledEvent;
+		const bool bHaveEvent = m_MIDIEventQueue.Peek(OutEvent);
+
+		if (!m_ScheduledMIDIEventQueue.Peek(ScheduledEvent))
+			return bHaveEvent ? &m_MIDIEventQueue : nullptr;
+
+		if (bHaveEvent && static_cast<s32>(OutEvent.nTimestamp - ScheduledEvent.nTimestamp) <= 0)
+			return &m_MIDIEventQueue;
+
+		OutEvent = ScheduledEvent;
+		return &m_ScheduledMIDIEventQueue;
+	}
+
+	TMIDIEventQueue m_MIDIEventQueue;
+	TMIDIEventQueue m_ScheduledMIDIEventQueue;
+	bool m_bSampleAccurateMIDI;
 };
 
 #endif
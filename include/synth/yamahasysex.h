@@ -32,7 +32,9 @@ enum TYamahaModelID : u8
 
 enum TYamahaAddress : u32
 {
-	XGSystemOn = 0x00007E,
+	XGDrumSetupReset    = 0x00007D,
+	XGSystemOn          = 0x00007E,
+	XGAllParameterReset = 0x00007F,
 
 	DisplayLetter = 0x060000,
 	DisplayBitmap = 0x070000,
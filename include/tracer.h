@@ -0,0 +1,180 @@
+//
+// tracer.h
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef _tracer_h
+#define _tracer_h
+
+#include <circle/macros.h>
+#include <circle/multicore.h>
+#include <circle/sysconfig.h>
+#include <circle/types.h>
+
+#include <atomic>
+
+#ifdef MT32_PI_HOST
+#include <chrono>
+#endif
+
+// Name and type of each trace event; 'X' events have a duration, 'i' events are instantaneous
+#define ENUM_TRACEEVENT(ENUM)                           \
+	ENUM(AudioBlock,        "audio_block",         'X') \
+	ENUM(AudioUnderrun,     "audio_underrun",      'i') \
+	ENUM(MIDIUpdate,        "midi_update",         'X') \
+	ENUM(SynthRender,       "synth_render",        'X') \
+	ENUM(SynthShortMessage, "synth_short_message", 'i') \
+	ENUM(SynthSysExMessage, "synth_sysex_message", 'i') \
+	ENUM(SoundFontSwitch,   "soundfont_switch",    'X') \
+	ENUM(AppleMIDIReceive,  "applemidi_receive",   'i') \
+	ENUM(UDPMIDIReceive,    "udpmidi_receive",     'i')
+
+#define TRACE_EVENT_VALUE(VALUE, NAME, PHASE) VALUE,
+
+enum class TTraceEvent : u16
+{
+	ENUM_TRACEEVENT(TRACE_EVENT_VALUE)
+};
+
+// Fixed-size ring buffers of binary trace events, one per core, timestamped with the ARM generic timer's counter,
+// which is as cheap to read as the PMU cycle counter but runs at a fixed rate and is shared by all cores.
+// Recording an event costs a few stores; when tracing is disabled, only a flag is tested.
+// Recording freezes when an audio underrun occurs, so that the events leading up to it are kept until they have been saved.
+class CTracer
+{
+public:
+	// Records an event with a duration for as long as it is in scope
+	class CScope
+	{
+	public:
+		CScope(TTraceEvent Event, u32 nArg = 0)
+			: m_Event(Event),
+			  m_nArg(nArg),
+			  m_nStartTime(IsEnabled() ? GetTimestamp() : 0),
+			  m_bCancelled(false)
+		{
+		}
+
+		~CScope()
+		{
+			if (unlikely(IsEnabled()) && !m_bCancelled)
+				Write(m_Event, m_nStartTime, GetTimestamp() - m_nStartTime, m_nArg);
+		}
+
+		void SetArg(u32 nArg) { m_nArg = nArg; }
+
+		// For scopes that turned out to have nothing worth recording
+		void Cancel() { m_bCancelled = true; }
+
+	private:
+		TTraceEvent m_Event;
+		u32 m_nArg;
+		u32 m_nStartTime;
+		bool m_bCancelled;
+	};
+
+	static void Initialize(bool bEnabled) { s_bEnabled = bEnabled; }
+	static bool IsEnabled() { return s_bEnabled; }
+
+	static void Event(TTraceEvent Event, u32 nArg = 0)
+	{
+		if (unlikely(IsEnabled()))
+			Write(Event, GetTimestamp(), 0, nArg);
+	}
+
+	// Stops recording until the trace has been saved; call Resume() to record again
+	static void Freeze();
+
+	// Saves the trace so far without waiting for an underrun, then resumes recording
+	static void RequestDump();
+	static void Resume();
+
+	static bool IsDumpPending() { return s_bDumpPending.load(std::memory_order_acquire); }
+
+	// Writes the frozen trace to a file
+	static bool Dump(const char* pPath);
+
+	static u32 GetTimestamp()
+	{
+#ifdef MT32_PI_HOST
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#elif AARCH == 64
+		u64 nCount;
+		asm volatile ("mrs %0, cntpct_el0" : "=r" (nCount));
+		return nCount;
+#else
+		u32 nCountLow, nCountHigh;
+		asm volatile ("mrrc p15, 0, %0, %1, c14" : "=r" (nCountLow), "=r" (nCountHigh));
+		return nCountLow;
+#endif
+	}
+
+	static unsigned int GetTimestampRate()
+	{
+#ifdef MT32_PI_HOST
+		return 1000000000;
+#elif AARCH == 64
+		u64 nFrequency;
+		asm volatile ("mrs %0, cntfrq_el0" : "=r" (nFrequency));
+		return nFrequency;
+#else
+		u32 nFrequency;
+		asm volatile ("mrc p15, 0, %0, c14, c0, 0" : "=r" (nFrequency));
+		return nFrequency;
+#endif
+	}
+
+private:
+	static constexpr size_t RecordsPerCore = 4096;
+	static constexpr size_t RecordMask = RecordsPerCore - 1;
+
+	struct TRecord
+	{
+		u32 nStartTime;
+		u32 nDuration;
+		u32 nArg;
+		u16 nEvent;
+		u16 nReserved;
+	};
+
+	struct TCoreBuffer
+	{
+		// Incremented only by the owning core
+		u32 nWriteIndex;
+		TRecord Records[RecordsPerCore];
+	};
+
+	static void Write(TTraceEvent Event, u32 nStartTime, u32 nDuration, u32 nArg)
+	{
+		if (s_bFrozen.load(std::memory_order_relaxed))
+			return;
+
+		TCoreBuffer& Buffer = s_Buffers[CMultiCoreSupport::ThisCore()];
+		Buffer.Records[Buffer.nWriteIndex++ & RecordMask] = { nStartTime, nDuration, nArg, static_cast<u16>(Event), 0 };
+	}
+
+	static bool s_bEnabled;
+	static std::atomic<bool> s_bFrozen;
+	static std::atomic<bool> s_bDumpPending;
+	static std::atomic<bool> s_bResumeAfterDump;
+	static TCoreBuffer s_Buffers[CORES];
+};
+
+#endif
@@ -24,6 +24,7 @@
 #define _utility_h
 
 #include <circle/string.h>
+#include <circle/synchronize.h>
 #include <circle/util.h>
 
 // Macro to extract the string representation of an enum
@@ -38,6 +39,9 @@
 // Macro to declare an array of string representations for an enum
 #define CONFIG_ENUM_STRINGS(NAME, DATA) static const char* NAME##Strings[] = { DATA(CONFIG_ENUM_STRING) }
 
+// Macro to count the values of an enum
+#define CONFIG_ENUM_COUNT(VALUE, STRING) + 1
+
 namespace Utility
 {
 	// Templated function for clamping a value between a minimum and a maximum
@@ -71,6 +75,54 @@ namespace Utility
 	template <class T, size_t N>
 	constexpr size_t ArraySize(const T(&)[N]) { return N; }
 
+#ifdef MT32_PI_HOST
+	// Host build: there are no other cores to wait for, and the generic timer isn't accessible
+	inline void WaitForEvent() {}
+	inline void SendEvent() { DataSyncBarrier(); }
+	inline void EnableEventStream(unsigned int nMicros) {}
+#else
+	// Park the calling core until another core calls SendEvent() (may also return spuriously)
+	inline void WaitForEvent() { asm volatile ("wfe"); }
+
+	// Wake any cores parked in WaitForEvent(), making prior writes visible to them first
+	inline void SendEvent()
+	{
+		DataSyncBarrier();
+		asm volatile ("sev");
+	}
+
+	// Make WaitForEvent() on the calling core also return at least every nMicros microseconds, using the generic
+	// timer's event stream, so that a core can sleep until a deadline without an interrupt to wake it
+	inline void EnableEventStream(unsigned int nMicros)
+	{
+#if AARCH == 64
+		u64 nFrequency, nControl;
+		asm volatile ("mrs %0, cntfrq_el0" : "=r" (nFrequency));
+		asm volatile ("mrs %0, cntkctl_el1" : "=r" (nControl));
+#else
+		u32 nFrequency, nControl;
+		asm volatile ("mrc p15, 0, %0, c14, c0, 0" : "=r" (nFrequency));
+		asm volatile ("mrc p15, 0, %0, c14, c1, 0" : "=r" (nControl));
+#endif
+
+		// An event is generated each time the selected counter bit changes from 0 to 1, i.e. every 2^(bit + 1) ticks
+		const u64 nPeriodTicks = static_cast<u64>(nFrequency) * nMicros / 1000000;
+		unsigned int nBit = 0;
+		while (nBit < 15 && (2ULL << (nBit + 1)) <= nPeriodTicks)
+			++nBit;
+
+		// EVNTI (bits 7:4), EVNTDIR (bit 3) and EVNTEN (bit 2)
+		nControl = (nControl & ~0xFCULL) | (nBit << 4) | (1 << 2);
+
+#if AARCH == 64
+		asm volatile ("msr cntkctl_el1, %0" : : "r" (nControl));
+#else
+		asm volatile ("mcr p15, 0, %0, c14, c1, 0" : : "r" (nControl));
+#endif
+		InstructionSyncBarrier();
+	}
+#endif
+
 	// Returns whether some value is a power of 2
 	template <class T>
 	constexpr bool IsPowerOfTwo(const T& nValue)
@@ -108,6 +160,26 @@ namespace Utility
 		return 128 - nSum;
 	}
 
+	// If pPath names a file directly inside pDirectory at the root of pVolume (e.g. "SD:soundfonts/a.sf2" or
+	// "SD:/soundfonts/a.sf2"), returns a pointer to the file name within pPath, otherwise nullptr
+	inline const char* GetFileNameInDirectory(const char* pPath, const char* pVolume, const char* pDirectory)
+	{
+		const size_t nVolumeLength = strlen(pVolume);
+		if (strncasecmp(pPath, pVolume, nVolumeLength) != 0 || pPath[nVolumeLength] != ':')
+			return nullptr;
+
+		pPath += nVolumeLength + 1;
+		if (*pPath == '/')
+			++pPath;
+
+		const size_t nDirectoryLength = strlen(pDirectory);
+		if (strncasecmp(pPath, pDirectory, nDirectoryLength) != 0 || pPath[nDirectoryLength] != '/')
+			return nullptr;
+
+		pPath += nDirectoryLength + 1;
+		return *pPath && !strchr(pPath, '/') ? pPath : nullptr;
+	}
+
 	// Comparators for sorting
 	namespace Comparator
 	{
@@ -176,6 +248,44 @@ namespace Utility
 		}
 	}
 
+	namespace
+	{
+		// Heapsort sift-down function (private)
+		template<class T, class TCompare>
+		void SiftDown(T* Items, TCompare Compare, size_t nRoot, size_t nCount)
+		{
+			while (true)
+			{
+				size_t nChild = nRoot * 2 + 1;
+				if (nChild >= nCount)
+					return;
+
+				if (nChild + 1 < nCount && Compare(Items[nChild], Items[nChild + 1]))
+					++nChild;
+
+				if (!Compare(Items[nRoot], Items[nChild]))
+					return;
+
+				Swap(Items[nRoot], Items[nChild]);
+				nRoot = nChild;
+			}
+		}
+	}
+
+	// Sorts an array in-place using the Heapsort algorithm; unlike QSort(), the worst case is O(n log n)
+	template<class T, class TCompare>
+	void HeapSort(T* Items, size_t nCount, TCompare Compare)
+	{
+		for (size_t i = nCount / 2; i-- > 0;)
+			SiftDown(Items, Compare, i, nCount);
+
+		for (size_t nEnd = nCount; nEnd-- > 1;)
+		{
+			Swap(Items[0], Items[nEnd]);
+			SiftDown(Items, Compare, 0, nEnd);
+		}
+	}
+
 	// Sorts an array in-place using the Tony Hoare Quicksort algorithm
 	template <class T>
 	void QSort(T* Items, Comparator::TComparator<T> Comparator, size_t nLow, size_t nHigh)
@@ -23,6 +23,7 @@
 #ifndef _zoneallocator_h
 #define _zoneallocator_h
 
+#include <circle/spinlock.h>
 #include <circle/types.h>
 
 // Block allocation tags
@@ -30,22 +31,63 @@ enum TZoneTag : u32
 {
 	Free = 0,
 	Uncategorized = 1,
-	FluidSynth
+	FluidSynth,
+	FluidSynthSamples,
+
+	// Allocations made while loading a SoundFont; each SoundFont that may be loaded at once has its own tag
+	FluidSynthSoundFont,
+	FluidSynthSoundFontLast = FluidSynthSoundFont + 3
 };
 
 class CZoneAllocator
 {
 public:
+	static constexpr size_t TagCount = TZoneTag::FluidSynthSoundFontLast + 1;
+
+	// Running totals for blocks with a given tag; sizes include block headers
+	struct TTagStats
+	{
+		size_t nUsedSize;
+		size_t nPeakSize;
+		size_t nAllocCount;
+	};
+
+	// Heap usage counts chunks taken by the arenas, including space not yet allocated within them
+	struct TStats
+	{
+		size_t nHeapSize;
+		size_t nUsedSize;
+		size_t nPeakSize;
+		size_t nFreeSize;
+		size_t nFreeBlocks;
+		size_t nLargestFreeBlock;
+
+		// Percentage of free space outside of the largest free block
+		unsigned int nFragmentation;
+
+		TTagStats Tags[TagCount];
+	};
+
 	CZoneAllocator();
 	~CZoneAllocator();
 
-	// Allocator interface
+	// Allocator interface (safe to call from any core); each tag has its own arena and lock, so cores allocating with different tags don't contend
 	bool Initialize();
 	void* Alloc(size_t nSize, TZoneTag Tag);
 	void* Realloc(void* pPtr, size_t nSize, TZoneTag Tag);
 	void Free(void* pPtr);
-	size_t GetAllocCount() const { return m_nAllocCount; }
+	size_t GetAllocCount() const;
+	size_t GetUsedSize() const { return m_nUsedSize; }
+	size_t GetHeapSize() const { return m_nHeapSize; }
+	size_t GetTagUsedSize(u32 nTag) const { return m_Arenas[nTag].Stats.nUsedSize; }
 
+	// Statistics (safe to call from any core)
+	void GetStats(TStats& OutStats);
+	void ResetPeaks();
+	void DumpStats();
+	static const char* GetTagName(u32 nTag);
+
+	// Releases every block with the given tag at once by returning its arena's chunks to the heap
 	void FreeTag(u32 nTag);
 	void Clear();
 	void Dump() const;
@@ -66,21 +108,95 @@ private:
 #endif
 	};
 
+	// Free blocks are also linked into a list for their size class, stored after the block header
+	struct TFreeLinks
+	{
+		TBlock* pNextFree;
+		TBlock* pPreviousFree;
+	};
+
+	// A region of the heap owned by an arena; the sentinel terminates the chunk's list of blocks so that they are never joined across chunks
+	struct alignas(16) TChunk
+	{
+		TBlock Sentinel;
+		TChunk* pNext;
+		TChunk* pPrevious;
+	};
+
 	// Constants
-	static constexpr u32 BlockMagic         = 0xDA1EDEAD;
-	static constexpr size_t MinFragmentSize = 16;
+	static constexpr u32 BlockMagic      = 0xDA1EDEAD;
+	static constexpr size_t MinBlockSize = (sizeof(TBlock) + sizeof(TFreeLinks) + sizeof(BlockMagic) + 0xF) & ~0xF;
+
+	// Size classes; small blocks have a class per 16 bytes, larger blocks a class per power of 2
+	static constexpr size_t SmallBinCount   = 64;
+	static constexpr size_t SmallBinMaxSize = SmallBinCount * 16;
+	static constexpr size_t BinCount        = 128;
+
+	// Free lists for a set of blocks; the heap arena holds chunks, and each tag's arena holds the blocks allocated within its chunks
+	struct TArena
+	{
+		TArena()
+			: Lock(TASK_LEVEL),
+			  pFreeLists{},
+			  nBinMask{},
+			  nFreeBlocks(0),
+			  pChunks(nullptr),
+			  Stats{}
+		{
+		}
+
+		CSpinLock Lock;
+
+		// Heads of the free list for each size class, and a bit per non-empty list
+		TBlock* pFreeLists[BinCount];
+		u64 nBinMask[BinCount / 64];
+		size_t nFreeBlocks;
+
+		TChunk* pChunks;
+		TTagStats Stats;
+	};
 
 	inline u32& GetEndMagic(TBlock* pBlock) const
 	{
 		return *reinterpret_cast<u32*>(reinterpret_cast<u8*>(pBlock) + pBlock->nSize - sizeof(BlockMagic));
 	}
 
+	static inline TFreeLinks& GetFreeLinks(TBlock* pBlock) { return *reinterpret_cast<TFreeLinks*>(pBlock + 1); }
+	static size_t GetBlockSize(size_t nSize);
+	static size_t GetBin(size_t nBlockSize);
+
+	static inline TBlock* GetChunkBlock(TChunk* pChunk) { return reinterpret_cast<TBlock*>(pChunk) - 1; }
+	inline TArena& GetArena(u32 nTag) { return m_Arenas[nTag < TagCount ? nTag : TZoneTag::Uncategorized]; }
+	void AddUsage(TArena& Arena, size_t nBlockSize);
+	void RemoveUsage(TArena& Arena, size_t nBlockSize);
+	static size_t GetLargestFreeBlock(const TArena& Arena);
+
+	void* UnlockedAlloc(TArena& Arena, size_t nSize, TZoneTag Tag);
+	void* UnlockedRealloc(TArena& Arena, void* pPtr, size_t nSize, TZoneTag Tag);
+	void UnlockedFree(TArena& Arena, void* pPtr);
+
+	TBlock* AddChunk(TArena& Arena, size_t nBlockSize, TZoneTag Tag);
+	void ReleaseChunk(TArena& Arena, TChunk* pChunk);
+	static void ResetArena(TArena& Arena);
+
+	static TBlock* FindFreeBlock(const TArena& Arena, size_t nBlockSize);
+	static void InsertFreeBlock(TArena& Arena, TBlock* pBlock);
+	static void RemoveFreeBlock(TArena& Arena, TBlock* pBlock);
+	static void SplitBlock(TArena& Arena, TBlock* pBlock, size_t nBlockSize);
+	static TBlock* FreeBlock(TArena& Arena, TBlock* pBlock);
+	void DumpBlocks(const TBlock* pSentinel, const char* pIndent) const;
+
 	void* m_pHeap;
 	size_t m_nHeapSize;
 	TBlock m_MainBlock;
-	TBlock* m_pCurrentBlock;
 
-	size_t m_nAllocCount;
+	// Chunks are carved from the heap under its lock; blocks are allocated from a tag's chunks under that arena's lock
+	TArena m_Heap;
+	TArena m_Arenas[TagCount];
+
+	// Bytes in chunks taken from the heap, including headers
+	size_t m_nUsedSize;
+	size_t m_nPeakSize;
 
 	static CZoneAllocator* s_pThis;
 };
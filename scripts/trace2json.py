@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+
+# trace2json.py
+#
+# mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+# Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+#
+# This file is part of mt32-pi.
+#
+# mt32-pi is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+
+# Converts a trace.bin saved by mt32-pi into the Trace Event JSON format, which
+# can be viewed as a timeline with Perfetto (https://ui.perfetto.dev) or
+# chrome://tracing.
+
+import argparse
+import json
+import struct
+import sys
+
+HEADER_FORMAT = "<4sHHIIII"
+RECORD_FORMAT = "<IIIHH"
+TRACE_VERSION = 1
+
+
+def read_trace(data):
+    magic, version, cores, records_per_core, record_size, timestamp_hz, event_types = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != b"MTTR" or version != TRACE_VERSION or record_size != struct.calcsize(RECORD_FORMAT):
+        raise ValueError("not a supported mt32-pi trace file")
+
+    offset = struct.calcsize(HEADER_FORMAT)
+    events = []
+    for _ in range(event_types):
+        phase, length = struct.unpack_from("<BB", data, offset)
+        offset += 2
+        events.append((data[offset:offset + length].decode("ascii"), chr(phase)))
+        offset += length
+
+    records = []
+    for core in range(cores):
+        (write_index,) = struct.unpack_from("<I", data, offset)
+        offset += 4
+
+        # Oldest first
+        count = min(write_index, records_per_core)
+        first = write_index - count
+        for i in range(first, write_index):
+            start, duration, arg, event, _ = struct.unpack_from(RECORD_FORMAT, data, offset + (i % records_per_core) * record_size)
+            records.append((core, start, duration, arg, event))
+
+        offset += records_per_core * record_size
+
+    return timestamp_hz, events, records
+
+
+def to_json(timestamp_hz, events, records):
+    if not records:
+        return {"traceEvents": []}
+
+    # The 32-bit timestamps wrap; assume every record is within half a wrap of the latest one
+    latest = max((start + duration) & 0xFFFFFFFF for _, start, duration, _, _ in records)
+    def unwrap(timestamp):
+        return latest - ((latest - timestamp) & 0xFFFFFFFF)
+
+    starts = [unwrap(start) for _, start, _, _, _ in records]
+    origin = min(starts)
+    to_micros = 1e6 / timestamp_hz
+
+    trace_events = []
+    for core in sorted({record[0] for record in records}):
+        trace_events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": core, "args": {"name": f"Core {core}"}})
+
+    for (core, _, duration, arg, event), start in zip(records, starts):
+        name, phase = events[event] if event < len(events) else (f"event_{event}", "i")
+        trace_event = {"name": name, "ph": phase, "ts": (start - origin) * to_micros, "pid": 0, "tid": core, "args": {"arg": arg}}
+        if phase == "X":
+            trace_event["dur"] = duration * to_micros
+        else:
+            trace_event["s"] = "t"
+        trace_events.append(trace_event)
+
+    return {"traceEvents": trace_events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert an mt32-pi trace to Trace Event JSON.")
+    parser.add_argument("input", help="trace.bin from the SD card")
+    parser.add_argument("output", nargs="?", help="JSON output (default: standard output)")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as file:
+        try:
+            trace = read_trace(file.read())
+        except (ValueError, struct.error) as error:
+            sys.exit(f"{args.input}: {error}")
+
+    output = open(args.output, "w") if args.output else sys.stdout
+    json.dump(to_json(*trace), output)
+    if args.output:
+        output.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+//
+// bootprofiler.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/multicore.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+#include <cstdio>
+
+#include "bootprofiler.h"
+#include "filesystemlock.h"
+#include "utility.h"
+
+LOGMODULE("bootprofiler");
+
+CBootProfiler::TStep CBootProfiler::s_Steps[MaxSteps];
+std::atomic<size_t> CBootProfiler::s_nSteps(0);
+std::atomic<bool> CBootProfiler::s_bFinished(false);
+u8 CBootProfiler::s_nDepth[CORES];
+
+size_t CBootProfiler::Begin(const char* pName)
+{
+	if (s_bFinished.load(std::memory_order_relaxed))
+		return InvalidIndex;
+
+	const size_t nIndex = s_nSteps.fetch_add(1, std::memory_order_relaxed);
+	if (nIndex >= MaxSteps)
+		return InvalidIndex;
+
+	const unsigned int nCore = CMultiCoreSupport::ThisCore();
+
+	TStep& Step = s_Steps[nIndex];
+	Step.pName = pName;
+	Step.nStartTime = CTimer::GetClockTicks();
+	Step.nEndTime = Step.nStartTime;
+	Step.nCore = nCore;
+	Step.nDepth = s_nDepth[nCore]++;
+
+	return nIndex;
+}
+
+void CBootProfiler::End(size_t nIndex)
+{
+	if (nIndex == InvalidIndex)
+		return;
+
+	TStep& Step = s_Steps[nIndex];
+	Step.nEndTime = CTimer::GetClockTicks();
+	--s_nDepth[Step.nCore];
+}
+
+bool CBootProfiler::Report(const char* pFileName)
+{
+	if (s_bFinished.exchange(true, std::memory_order_acquire))
+		return false;
+
+	// Timestamps are relative to power-on, so the first step's start time includes the firmware's boot time
+	const unsigned int nEndTime = CTimer::GetClockTicks();
+	const size_t nSteps = Utility::Min(s_nSteps.load(std::memory_order_acquire), MaxSteps);
+
+	LOGNOTE("Boot took %dms:", nEndTime / 1000);
+
+	// One line per step: name, core, start and duration in microseconds
+	static char Buffer[MaxSteps * 64 + 64];
+	size_t nLength = snprintf(Buffer, sizeof(Buffer), "total=%u\n", nEndTime);
+
+	for (size_t i = 0; i < nSteps; ++i)
+	{
+		const TStep& Step = s_Steps[i];
+		const unsigned int nDuration = Step.nEndTime - Step.nStartTime;
+
+		char Indent[16];
+		const size_t nIndent = Utility::Min(static_cast<size_t>(Step.nDepth) * 2, sizeof(Indent) - 1);
+		memset(Indent, ' ', nIndent);
+		Indent[nIndent] = '\0';
+
+		LOGNOTE("%6dms %6dms core %d  %s%s", Step.nStartTime / 1000, nDuration / 1000, Step.nCore, Indent, Step.pName);
+
+		if (nLength < sizeof(Buffer))
+			nLength += snprintf(Buffer + nLength, sizeof(Buffer) - nLength, "%s=%u,%u,%u\n", Step.pName, Step.nCore, Step.nStartTime, nDuration);
+	}
+	nLength = Utility::Min(nLength, sizeof(Buffer) - 1);
+
+	if (s_nSteps.load(std::memory_order_relaxed) > MaxSteps)
+		LOGWARN("Too many boot steps; only the first %d were recorded", MaxSteps);
+
+	CFileSystemLockGuard Lock;
+
+	FIL File;
+	if (f_open(&File, pFileName, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGWARN("Couldn't create %s", pFileName);
+		return false;
+	}
+
+	UINT nWritten;
+	bool bResult = f_write(&File, Buffer, nLength, &nWritten) == FR_OK && nWritten == nLength;
+	if (f_close(&File) != FR_OK)
+		bResult = false;
+
+	if (!bResult)
+		LOGWARN("Couldn't write %s", pFileName);
+
+	return bResult;
+}
@@ -28,6 +28,7 @@
 #include <ini.h>
 
 #include "config.h"
+#include "filesystemlock.h"
 #include "utility.h"
 
 LOGMODULE("config");
@@ -59,8 +60,12 @@ template <class T, const char* pEnumStrings[], size_t N> static bool ParseEnum(c
 // Enum string tables
 CONFIG_ENUM_STRINGS(TSystemDefaultSynth, ENUM_SYSTEMDEFAULTSYNTH);
 CONFIG_ENUM_STRINGS(TAudioOutputDevice, ENUM_AUDIOOUTPUTDEVICE);
+CONFIG_ENUM_STRINGS(TMIDIRouteInput, ENUM_MIDIROUTEINPUT);
+CONFIG_ENUM_STRINGS(TMIDIRouteOutput, ENUM_MIDIROUTEOUTPUT);
 CONFIG_ENUM_STRINGS(TMT32EmuResamplerQuality, ENUM_RESAMPLERQUALITY);
 CONFIG_ENUM_STRINGS(TMT32EmuMIDIChannels, ENUM_MIDICHANNELS);
+CONFIG_ENUM_STRINGS(TMT32EmuAnalogOutputMode, ENUM_ANALOGOUTPUTMODE);
+CONFIG_ENUM_STRINGS(TMT32EmuRendererType, ENUM_RENDERERTYPE);
 CONFIG_ENUM_STRINGS(TMT32EmuROMSet, ENUM_MT32ROMSET);
 CONFIG_ENUM_STRINGS(TLCDType, ENUM_LCDTYPE);
 CONFIG_ENUM_STRINGS(TControlScheme, ENUM_CONTROLSCHEME);
@@ -71,17 +76,47 @@ CONFIG_ENUM_STRINGS(TNetworkMode, ENUM_NETWORKMODE);
 
 CConfig* CConfig::s_pThis = nullptr;
 
+// Options that can be applied at runtime, and the change flag that tells the synths to apply them
+#define ENUM_LIVEOPTIONS(ENUM)                                     \
+	ENUM(MT32EmuGain,                     bMT32EmuGain)         \
+	ENUM(MT32EmuReverbGain,               bMT32EmuGain)         \
+	ENUM(MT32EmuMIDIChannels,             bMT32EmuMIDIChannels) \
+	ENUM(FluidSynthDefaultGain,           bFluidSynthGain)      \
+	ENUM(FluidSynthPolyphony,             bFluidSynthPolyphony) \
+	ENUM(FluidSynthMinPolyphony,          bFluidSynthPolyphony) \
+	ENUM(FluidSynthDefaultReverbActive,   bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultReverbDamping,  bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultReverbLevel,    bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultReverbRoomSize, bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultReverbWidth,    bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultChorusActive,   bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultChorusDepth,    bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultChorusLevel,    bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultChorusVoices,   bFluidSynthEffects)   \
+	ENUM(FluidSynthDefaultChorusSpeed,    bFluidSynthEffects)
+
 CConfig::CConfig()
+{
+	SetDefaults();
+	s_pThis = this;
+}
+
+CConfig::CConfig(TTemporary)
+{
+	SetDefaults();
+}
+
+void CConfig::SetDefaults()
 {
 	// Expand assignment of all default values from definition file
 	#define CFG(_1, _2, MEMBER_NAME, DEFAULT, _3...) MEMBER_NAME = DEFAULT;
 	#include "config.def"
-
-	s_pThis = this;
 }
 
 bool CConfig::Initialize(const char* pPath)
 {
+	CFileSystemLockGuard Lock;
+
 	FIL File;
 	if (f_open(&File, pPath, FA_READ) != FR_OK)
 	{
@@ -113,6 +148,42 @@ bool CConfig::Initialize(const char* pPath)
 
 }
 
+int CConfig::Reload(const char* pPath, TLiveChanges& OutChanges)
+{
+	CConfig NewConfig{TTemporary()};
+	if (!NewConfig.Initialize(pPath))
+		return -1;
+
+	OutChanges = TLiveChanges{};
+
+	// Take the new values of options that can be applied at runtime
+	#define LIVE_OPTION(MEMBER_NAME, CHANGE_FLAG)         \
+		if (!IsEqual(MEMBER_NAME, NewConfig.MEMBER_NAME)) \
+		{                                                 \
+			MEMBER_NAME = NewConfig.MEMBER_NAME;          \
+			OutChanges.CHANGE_FLAG = true;                \
+		}
+
+	ENUM_LIVEOPTIONS(LIVE_OPTION)
+
+	// Anything still different needs a restart
+	const char* pSection = "";
+	int nRestartOptions = 0;
+
+	#define BEGIN_SECTION(SECTION) pSection = #SECTION;
+
+	#define CFG(INI_NAME, _1, MEMBER_NAME, ...)                                \
+		if (!IsEqual(MEMBER_NAME, NewConfig.MEMBER_NAME))                      \
+		{                                                                      \
+			LOGNOTE("[%s] %s changed; restart to apply", pSection, #INI_NAME); \
+			++nRestartOptions;                                                 \
+		}
+
+	#include "config.def"
+
+	return nRestartOptions;
+}
+
 int CConfig::INIHandler(void* pUser, const char* pSection, const char* pName, const char* pValue)
 {
 	CConfig* const pConfig = static_cast<CConfig*>(pUser);
@@ -203,8 +274,12 @@ bool CConfig::ParseOption(const char* pString, CIPAddress* pOut)
 // Define template function wrappers for parsing enums
 CONFIG_ENUM_PARSER(TSystemDefaultSynth);
 CONFIG_ENUM_PARSER(TAudioOutputDevice);
+CONFIG_ENUM_PARSER(TMIDIRouteInput);
+CONFIG_ENUM_PARSER(TMIDIRouteOutput);
 CONFIG_ENUM_PARSER(TMT32EmuResamplerQuality);
 CONFIG_ENUM_PARSER(TMT32EmuMIDIChannels);
+CONFIG_ENUM_PARSER(TMT32EmuAnalogOutputMode);
+CONFIG_ENUM_PARSER(TMT32EmuRendererType);
 CONFIG_ENUM_PARSER(TMT32EmuROMSet);
 CONFIG_ENUM_PARSER(TLCDType);
 CONFIG_ENUM_PARSER(TControlScheme);
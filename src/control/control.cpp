@@ -21,16 +21,21 @@
 //
 
 #include <circle/interrupt.h>
+#include <circle/synchronize.h>
 #include <circle/timer.h>
+#include <circle/util.h>
 
 #include "control/control.h"
 
+// Button sampling rate while debouncing
 constexpr u16 PollRateMicros = 1000;
 
-CControl::CControl(TEventQueue& pEventQueue)
+CControl::CControl(TEventQueue& pEventQueue, u8 nButtonMask)
 	: m_pEventQueue(&pEventQueue),
-	  m_Timer(CInterruptSystem::Get(), InterruptHandler, this),
+	  m_Timer(CInterruptSystem::Get(), TimerInterruptHandler, this),
+	  m_nButtonMask(nButtonMask),
 
+	  m_bDebouncing(false),
 	  m_ButtonStateHistory{0},
 	  m_nButtonStateHistoryIndex(0),
 	  m_nButtonState(0),
@@ -39,6 +44,8 @@ CControl::CControl(TEventQueue& pEventQueue)
 	  m_PressedTime(0),
 	  m_RepeatTime(0)
 {
+	// All released
+	memset(m_ButtonStateHistory, 0xFF, sizeof(m_ButtonStateHistory));
 }
 
 bool CControl::Initialize()
@@ -46,86 +53,121 @@ bool CControl::Initialize()
 	if (!m_Timer.Initialize())
 		return false;
 
-	m_Timer.Start(PollRateMicros);
+	ConnectGPIOPins();
+
+	// Pick up any button already held down
+	EnterCritical(IRQ_LEVEL);
+	GPIOInterruptHandler(this);
+	LeaveCritical();
 
 	return true;
 }
 
-void CControl::Update()
+void CControl::ConnectGPIOPin(CGPIOPin& Pin)
 {
-	TEvent Event;
+	Pin.ConnectInterrupt(GPIOInterruptHandler, this);
+	Pin.EnableInterrupt(TGPIOInterrupt::GPIOInterruptOnRisingEdge);
+	Pin.EnableInterrupt2(TGPIOInterrupt::GPIOInterruptOnFallingEdge);
+}
 
-	if (m_nButtonState != m_nLastButtonState)
-	{
-		Event.Type = TEventType::Button;
+void CControl::DebounceButtonState(u8 nState)
+{
+	// Use ring buffer for debouncing
+	m_ButtonStateHistory[m_nButtonStateHistoryIndex++] = nState;
+	m_nButtonStateHistoryIndex &= ButtonStateHistoryMask;
 
-		for (u8 i = 0; i < TButton::Max; ++i)
-		{
-			const bool bCurrentState = m_nButtonState & (1 << i);
-			const bool bLastState    = m_nLastButtonState & (1 << i);
+	u8 nDebouncedButtonState = 0xFF;
+	for (size_t i = 0; i < ButtonStateHistoryLength; ++i)
+		nDebouncedButtonState &= m_ButtonStateHistory[i];
 
-			if (bCurrentState != bLastState)
-			{
-				if (bCurrentState)
-				{
-					m_RepeatButton = i;
-					m_PressedTime = CTimer::GetClockTicks();
-					m_RepeatTime = 0;
-				}
-				else if (m_RepeatButton && m_RepeatButton.Value() == i)
-					m_RepeatButton.Reset();
-
-				Event.Button.Button   = static_cast<TButton>(i);
-				Event.Button.bPressed = bCurrentState;
-				Event.Button.bRepeat = false;
-				m_pEventQueue->Enqueue(Event);
-			}
-		}
+	// Invert so that 1 == "pressed"; mask off button bits
+	m_nButtonState = (~nDebouncedButtonState) & m_nButtonMask;
+}
 
-		m_nLastButtonState = m_nButtonState;
-	}
+void CControl::PostButtonEvents()
+{
+	if (m_nButtonState == m_nLastButtonState)
+		return;
+
+	TEvent Event;
+	Event.Type = TEventType::Button;
 
-	// Handle repeat
-	if (m_RepeatButton)
+	for (u8 i = 0; i < TButton::Max; ++i)
 	{
-		const u32 nTicks = CTimer::GetClockTicks();
-		const u32 nPressedDuration = nTicks - m_PressedTime;
+		const bool bCurrentState = m_nButtonState & (1 << i);
+		const bool bLastState    = m_nLastButtonState & (1 << i);
 
-		if (nPressedDuration > RepeatDelayMicros)
+		if (bCurrentState != bLastState)
 		{
-			if (m_RepeatTime == 0)
-				m_RepeatTime = nTicks;
-			else if (nTicks - m_RepeatTime > RepeatPeriod(nPressedDuration - RepeatDelayMicros))
+			if (bCurrentState)
 			{
-				Event.Button.Button   = static_cast<TButton>(m_RepeatButton.Value());
-				Event.Button.bPressed = true;
-				Event.Button.bRepeat = true;
-				m_pEventQueue->Enqueue(Event);
-				m_RepeatTime = nTicks;
+				m_RepeatButton = i;
+				m_PressedTime = CTimer::GetClockTicks();
+				m_RepeatTime = 0;
 			}
+			else if (m_RepeatButton && m_RepeatButton.Value() == i)
+				m_RepeatButton.Reset();
+
+			Event.Button.Button   = static_cast<TButton>(i);
+			Event.Button.bPressed = bCurrentState;
+			Event.Button.bRepeat = false;
+			m_pEventQueue->Enqueue(Event);
 		}
 	}
+
+	m_nLastButtonState = m_nButtonState;
 }
 
-void CControl::DebounceButtonState(u8 nState, u8 nMask)
+void CControl::UpdateRepeat()
 {
-	// Use ring buffer for debouncing
-	m_ButtonStateHistory[m_nButtonStateHistoryIndex++] = nState;
-	m_nButtonStateHistoryIndex &= ButtonStateHistoryMask;
+	if (!m_RepeatButton)
+		return;
 
-	u8 nDebouncedButtonState = 0xFF;
-	for (size_t i = 0; i < ButtonStateHistoryLength; ++i)
-		nDebouncedButtonState &= m_ButtonStateHistory[i];
+	const u32 nTicks = CTimer::GetClockTicks();
+	const u32 nPressedDuration = nTicks - m_PressedTime;
 
-	// Invert so that 1 == "pressed"; mask off button bits
-	m_nButtonState = (~nDebouncedButtonState) & nMask;
+	if (nPressedDuration <= RepeatDelayMicros)
+		return;
+
+	// Repeats that haven't been handled yet are dropped by the event queue when full; only presses and releases matter
+	if (m_RepeatTime == 0)
+		m_RepeatTime = nTicks;
+	else if (nTicks - m_RepeatTime > RepeatPeriod(nPressedDuration - RepeatDelayMicros))
+	{
+		TEvent Event;
+		Event.Type = TEventType::Button;
+		Event.Button.Button   = static_cast<TButton>(m_RepeatButton.Value());
+		Event.Button.bPressed = true;
+		Event.Button.bRepeat = true;
+		m_pEventQueue->Enqueue(Event);
+		m_RepeatTime = nTicks;
+	}
+}
+
+void CControl::GPIOInterruptHandler(void* pParam)
+{
+	CControl* const pThis = static_cast<CControl*>(pParam);
+
+	// The encoder is decoded on every edge; a button edge starts the debouncer
+	const u8 nState = pThis->ReadGPIOPins();
+	if (!pThis->m_bDebouncing && (~nState & pThis->m_nButtonMask))
+	{
+		pThis->m_bDebouncing = true;
+		pThis->m_Timer.Start(PollRateMicros);
+	}
 }
 
-void CControl::InterruptHandler(CUserTimer* pUserTimer, void* pParam)
+void CControl::TimerInterruptHandler(CUserTimer* pUserTimer, void* pParam)
 {
 	CControl* const pThis = static_cast<CControl*>(pParam);
 
-	// Re-arm timer
-	pUserTimer->Start(PollRateMicros);
-	pThis->ReadGPIOPins();
+	pThis->DebounceButtonState(pThis->ReadGPIOPins());
+	pThis->PostButtonEvents();
+	pThis->UpdateRepeat();
+
+	// Stop once every button has been released for the whole debounce window
+	if (pThis->m_nButtonState)
+		pUserTimer->Start(PollRateMicros);
+	else
+		pThis->m_bDebouncing = false;
 }
@@ -23,25 +23,56 @@
 #include <circle/logger.h>
 
 #include "control/mister.h"
+#include "utility.h"
 
 LOGMODULE("mistercontrol");
 
 constexpr u8 MisterI2CAddress = 0x45;
 
+// How often to read the MiSTer's status, depending on whether it's been found yet
+constexpr unsigned int ActivePollPeriodMillis = 200;
+constexpr unsigned int InactivePollPeriodMillis = 1000;
+
 CMisterControl::CMisterControl(CI2CMaster* pI2CMaster, TEventQueue& EventQueue)
 	: m_pI2CMaster(pI2CMaster),
 	  m_pEventQueue(&EventQueue),
 
 	  bMisterActive(false),
+	  m_bPollPending(true),
+	  m_nLastPollTime(0),
 	  m_LastSystemStatus{TMisterSynth::Unknown, 0xFF, 0xFF},
 	  m_LastMisterStatus{TMisterSynth::Unknown, 0xFF, 0xFF}
 {
 }
 
-void CMisterControl::Update(const TMisterStatus& SystemStatus)
+void CMisterControl::Update(const TMisterStatus& SystemStatus, unsigned int nTicks)
 {
 	assert(m_pI2CMaster != nullptr);
 
+	// If the state has been changed by user controls/SysEx, we just need to update the MiSTer status
+	if (bMisterActive && SystemStatus != m_LastSystemStatus)
+	{
+		// Write config back to MiSTer
+		if (!WriteConfigToMister(SystemStatus))
+		{
+			ResetState();
+			return;
+		}
+
+		m_LastSystemStatus = SystemStatus;
+	}
+
+	const unsigned int nPollPeriodMillis = bMisterActive ? ActivePollPeriodMillis : InactivePollPeriodMillis;
+	if (m_bPollPending || (nTicks - m_nLastPollTime) >= Utility::MillisToTicks(nPollPeriodMillis))
+	{
+		PollMister(SystemStatus);
+		m_bPollPending = false;
+		m_nLastPollTime = nTicks;
+	}
+}
+
+void CMisterControl::PollMister(const TMisterStatus& SystemStatus)
+{
 	// Read current status from MiSTer
 	TMisterStatus MisterStatus;
 	if (m_pI2CMaster->Read(MisterI2CAddress, &MisterStatus, sizeof(MisterStatus)) < 0)
@@ -63,19 +94,7 @@ void CMisterControl::Update(const TMisterStatus& SystemStatus)
 
 	if (bMisterActive)
 	{
-		// If the state has been changed by user controls/SysEx, we just need to update the MiSTer status
-		if (SystemStatus != m_LastSystemStatus)
-		{
-			// Write config back to MiSTer
-			if (!WriteConfigToMister(SystemStatus))
-			{
-				ResetState();
-				return;
-			}
-
-			m_LastSystemStatus = SystemStatus;
-		}
-		else if (MisterStatus != m_LastMisterStatus)
+		if (MisterStatus != m_LastMisterStatus)
 		{
 			// The state has been changed by MiSTer; apply it
 			ApplyConfig(MisterStatus, SystemStatus);
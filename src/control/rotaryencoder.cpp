@@ -66,55 +66,25 @@ constexpr u8 AccelThresholdMillis = 32;
 // Compile-time quadratic acceleration curve lookup table
 constexpr auto RotaryAccelLookupTable = QuadraticLookupTable<u8, 5, 16, AccelThresholdMillis>();
 
-CRotaryEncoder::CRotaryEncoder(TEncoderType Type, bool bReversed, unsigned GPIOPinCLK, unsigned GPIOPinDAT)
-	: m_CLKPin(GPIOPinCLK, GPIOModeInputPullUp),
-	  m_DATPin(GPIOPinDAT, GPIOModeInputPullUp),
-
-	  m_Type(Type),
+CRotaryEncoder::CRotaryEncoder(TEncoderType Type, bool bReversed)
+	: m_Type(Type),
 	  m_bReversed(bReversed),
 
-	  m_nDelta(0),
 	  m_nState(0),
 	  nPreviousTransitions{ 0 },
 
-	  m_nLastReadTime(0)
-{
-}
-
-s8 CRotaryEncoder::Read()
-{
-	s8 nResult = m_nDelta;
-
-	// Apply acceleration curve
-	if (nResult != 0)
-	{
-		const unsigned int nTicks = CTimer::GetClockTicks();
-		const unsigned int nDeltaMillis = Utility::TicksToMillis(nTicks - m_nLastReadTime);
-
-		if (nDeltaMillis < AccelThresholdMillis)
-			nResult *= RotaryAccelLookupTable[nDeltaMillis];
-
-		m_nLastReadTime = nTicks;
-
-		m_nDelta = 0;
-	}
-
-	return m_bReversed ? -nResult : nResult;
-}
-
-void CRotaryEncoder::ReadGPIOPins()
+	  m_nLastDetentTime(0)
 {
-	ReadGPIOPins(m_CLKPin.Read(), m_DATPin.Read());
 }
 
-void CRotaryEncoder::ReadGPIOPins(bool bCLKValue, bool bDATValue)
+s8 CRotaryEncoder::Decode(bool bCLKValue, bool bDATValue)
 {
 	m_nState = ((m_nState << 2) | (bDATValue << 1) | bCLKValue) & 0x0F;
 
 	// Check if we have seen a valid CW or CCW state transition
 	u8 nRotaryBits = (nTransitions >> (m_nState << 1)) & 3;
 	if (likely(!nRotaryBits))
-		return;
+		return 0;
 
 	// Have we seen the /previous/ transition in this direction?
 	// If not, any previously-recorded transitions are not in a contiguous step-wise
@@ -133,10 +103,21 @@ void CRotaryEncoder::ReadGPIOPins(bool bCLKValue, bool bDATValue)
 	{
 		// Not enough transitions yet; remember where we are for next time
 		nPreviousTransitions[nRotaryBits-1] = nTransition;
-		return;
+		return 0;
 	}
 
-	// This is a valid movement between detents; clear transition state and accumulate movement
+	// This is a valid movement between detents; clear transition state
 	nPreviousTransitions[0] = nPreviousTransitions[1] = 0;
-	m_nDelta += (nRotaryBits & 0x01) ? 1 : -1;
+	s8 nResult = (nRotaryBits & 0x01) ? 1 : -1;
+
+	// Apply acceleration curve based on the time since the previous detent
+	const unsigned int nTicks = CTimer::GetClockTicks();
+	const unsigned int nDeltaMillis = Utility::TicksToMillis(nTicks - m_nLastDetentTime);
+
+	if (nDeltaMillis < AccelThresholdMillis)
+		nResult *= RotaryAccelLookupTable[nDeltaMillis];
+
+	m_nLastDetentTime = nTicks;
+
+	return m_bReversed ? -nResult : nResult;
 }
@@ -33,17 +33,25 @@ constexpr u8 ButtonMask = 1 << static_cast<u8>(TButton::Button1) |
 			  1 << static_cast<u8>(TButton::Button3) |
 			  1 << static_cast<u8>(TButton::Button4);
 
-CControlSimpleButtons::CControlSimpleButtons(TEventQueue& pEventQueue)
-	: CControl(pEventQueue),
+CControlSimpleButtons::CControlSimpleButtons(TEventQueue& pEventQueue, CGPIOManager* pGPIOManager)
+	: CControl(pEventQueue, ButtonMask),
 
-	  m_GPIOButton1(GPIOPinButton1, TGPIOMode::GPIOModeInputPullUp),
-	  m_GPIOButton2(GPIOPinButton2, TGPIOMode::GPIOModeInputPullUp),
-	  m_GPIOButton3(GPIOPinButton3, TGPIOMode::GPIOModeInputPullUp),
-	  m_GPIOButton4(GPIOPinButton4, TGPIOMode::GPIOModeInputPullUp)
+	  m_GPIOButton1(GPIOPinButton1, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOButton2(GPIOPinButton2, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOButton3(GPIOPinButton3, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOButton4(GPIOPinButton4, TGPIOMode::GPIOModeInputPullUp, pGPIOManager)
 {
 }
 
-void CControlSimpleButtons::ReadGPIOPins()
+void CControlSimpleButtons::ConnectGPIOPins()
+{
+	ConnectGPIOPin(m_GPIOButton1);
+	ConnectGPIOPin(m_GPIOButton2);
+	ConnectGPIOPin(m_GPIOButton3);
+	ConnectGPIOPin(m_GPIOButton4);
+}
+
+u8 CControlSimpleButtons::ReadGPIOPins()
 {
 	// Read current button state from GPIO pins
 	const u32 nGPIOState  = CGPIOPin::ReadAll();
@@ -52,5 +60,5 @@ void CControlSimpleButtons::ReadGPIOPins()
 				(((nGPIOState >> GPIOPinButton3) & 1) << static_cast<u8>(TButton::Button3)) |
 				(((nGPIOState >> GPIOPinButton4) & 1) << static_cast<u8>(TButton::Button4));
 
-	DebounceButtonState(nButtonState, ButtonMask);
+	return nButtonState;
 }
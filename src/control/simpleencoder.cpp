@@ -34,32 +34,29 @@ constexpr u8 ButtonMask = 1 << static_cast<u8>(TButton::Button1) |
 			  1 << static_cast<u8>(TButton::Button2) |
 			  1 << static_cast<u8>(TButton::EncoderButton);
 
-CControlSimpleEncoder::CControlSimpleEncoder(TEventQueue& pEventQueue, CRotaryEncoder::TEncoderType EncoderType, bool bEncoderReversed)
-	: CControl(pEventQueue),
+CControlSimpleEncoder::CControlSimpleEncoder(TEventQueue& pEventQueue, CGPIOManager* pGPIOManager, CRotaryEncoder::TEncoderType EncoderType, bool bEncoderReversed)
+	: CControl(pEventQueue, ButtonMask),
 
-	  m_GPIOEncoderButton(GPIOPinEncoderButton, TGPIOMode::GPIOModeInputPullUp),
-	  m_GPIOButton1(GPIOPinButton1, TGPIOMode::GPIOModeInputPullUp),
-	  m_GPIOButton2(GPIOPinButton2, TGPIOMode::GPIOModeInputPullUp),
+	  m_GPIOEncoderButton(GPIOPinEncoderButton, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOButton1(GPIOPinButton1, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOButton2(GPIOPinButton2, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOEncoderCLK(GPIOPinEncoderCLK, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
+	  m_GPIOEncoderDAT(GPIOPinEncoderDAT, TGPIOMode::GPIOModeInputPullUp, pGPIOManager),
 
-	  m_Encoder(EncoderType, bEncoderReversed, GPIOPinEncoderCLK, GPIOPinEncoderDAT)
+	  m_Encoder(EncoderType, bEncoderReversed)
 {
 }
 
-void CControlSimpleEncoder::Update()
+void CControlSimpleEncoder::ConnectGPIOPins()
 {
-	CControl::Update();
-
-	const s8 nEncoderDelta = m_Encoder.Read();
-	if (nEncoderDelta != 0)
-	{
-		TEvent Event;
-		Event.Type = TEventType::Encoder;
-		Event.Encoder.nDelta = nEncoderDelta;
-		m_pEventQueue->Enqueue(Event);
-	}
+	ConnectGPIOPin(m_GPIOEncoderButton);
+	ConnectGPIOPin(m_GPIOButton1);
+	ConnectGPIOPin(m_GPIOButton2);
+	ConnectGPIOPin(m_GPIOEncoderCLK);
+	ConnectGPIOPin(m_GPIOEncoderDAT);
 }
 
-void CControlSimpleEncoder::ReadGPIOPins()
+u8 CControlSimpleEncoder::ReadGPIOPins()
 {
 	// Read current button state from GPIO pins
 	const u32 nGPIOState  = CGPIOPin::ReadAll();
@@ -67,8 +64,15 @@ void CControlSimpleEncoder::ReadGPIOPins()
 				(((nGPIOState >> GPIOPinButton2) & 1) << static_cast<u8>(TButton::Button2)) |
 				(((nGPIOState >> GPIOPinEncoderButton) & 1) << static_cast<u8>(TButton::EncoderButton));
 
-	DebounceButtonState(nButtonState, ButtonMask);
+	// Update rotary encoder state; the event queue accumulates movement into a single event
+	const s8 nEncoderDelta = m_Encoder.Decode((nGPIOState >> GPIOPinEncoderCLK) & 1, (nGPIOState >> GPIOPinEncoderDAT) & 1);
+	if (nEncoderDelta != 0)
+	{
+		TEvent Event;
+		Event.Type = TEventType::Encoder;
+		Event.Encoder.nDelta = nEncoderDelta;
+		m_pEventQueue->Enqueue(Event);
+	}
 
-	// Update rotary encoder state
-	m_Encoder.ReadGPIOPins((nGPIOState >> GPIOPinEncoderCLK) & 1, (nGPIOState >> GPIOPinEncoderDAT) & 1);
+	return nButtonState;
 }
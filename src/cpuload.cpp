@@ -0,0 +1,56 @@
+//
+// cpuload.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "cpuload.h"
+
+CCPULoad::TCounters CCPULoad::s_Counters[CORES];
+unsigned int CCPULoad::s_nLastSampleTicks = 0;
+unsigned int CCPULoad::s_nLastIdleTicks[CORES];
+unsigned int CCPULoad::s_nLastBusyTicks[CORES];
+
+void CCPULoad::Sample(u8 (&OutLoads)[CORES])
+{
+	const unsigned int nTicks = CTimer::GetClockTicks();
+	const unsigned int nElapsedTicks = nTicks - s_nLastSampleTicks;
+	if (nElapsedTicks == 0)
+		return;
+
+	s_nLastSampleTicks = nTicks;
+
+	for (unsigned int i = 0; i < CORES; ++i)
+	{
+		const unsigned int nIdleTicks = s_Counters[i].nIdleTicks.load(std::memory_order_relaxed);
+		const unsigned int nBusyTicks = s_Counters[i].nBusyTicks.load(std::memory_order_relaxed);
+		const unsigned int nIdleDelta = nIdleTicks - s_nLastIdleTicks[i];
+		const unsigned int nBusyDelta = nBusyTicks - s_nLastBusyTicks[i];
+		s_nLastIdleTicks[i] = nIdleTicks;
+		s_nLastBusyTicks[i] = nBusyTicks;
+
+		// A sleeping core may report a little more than the elapsed time if it woke up just after we sampled the clock
+		if (nBusyTicks)
+			OutLoads[i] = static_cast<u64>(Utility::Min(nBusyDelta, nElapsedTicks)) * 100 / nElapsedTicks;
+		else if (nIdleTicks)
+			OutLoads[i] = 100 - static_cast<u64>(Utility::Min(nIdleDelta, nElapsedTicks)) * 100 / nElapsedTicks;
+		else
+			OutLoads[i] = Unknown;
+	}
+}
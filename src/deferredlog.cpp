@@ -0,0 +1,107 @@
+//
+// deferredlog.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/util.h>
+
+#include <cstdio>
+
+#include "deferredlog.h"
+#include "utility.h"
+
+// All messages are raised by CMT32Pi, so they're logged under its name
+LOGMODULE("mt32pi");
+
+struct TDeferredLogMessageInfo
+{
+	// Log line, formatted with the message's most recent argument, or nullptr
+	TLogSeverity Severity;
+	const char* pLogFormat;
+
+	// LCD text, or nullptr
+	TLogSeverity LCDSeverity;
+	const char* pLCDText;
+};
+
+// Indexed by TDeferredLogMessage
+static const TDeferredLogMessageInfo MessageInfo[] =
+{
+	{ LogWarning,	"MIDI overrun error!",			LogError,	"MIDI overrun error!" },
+	{ LogWarning,	"MIDI queue overflow!",			LogError,	"MIDI queue overflow!" },
+	{ LogWarning,	"Network MIDI overrun!",		LogError,	"Network MIDI overrun!" },
+	{ LogWarning,	nullptr,				LogError,	"SysEx overflow!" },
+	{ LogWarning,	nullptr,				LogWarning,	"Unexp. MIDI status!" },
+	{ LogWarning,	"UART break error!",			LogWarning,	"UART break error!" },
+	{ LogWarning,	"UART overrun error!",			LogWarning,	"UART overrun error!" },
+	{ LogWarning,	"UART framing error!",			LogWarning,	"UART framing error!" },
+	{ LogWarning,	"Unknown UART error!",			LogWarning,	"Unknown UART error!" },
+	{ LogError,	"Couldn't send all received bytes to MIDI thru", LogError, "UART TX error!" },
+	{ LogError,	"Sound data dropped (%d frames)",	LogError,	nullptr },
+};
+
+static_assert(Utility::ArraySize(MessageInfo) == static_cast<size_t>(TDeferredLogMessage::Count), "Deferred log message table is incomplete");
+
+CDeferredLog::CDeferredLog()
+	: m_Slots{}
+{
+}
+
+bool CDeferredLog::Flush(unsigned int nTicks, TLCDHandler* pLCDHandler, void* pParam)
+{
+	bool bReported = false;
+
+	for (size_t i = 0; i < MessageCount; ++i)
+	{
+		TSlot& Slot = m_Slots[i];
+		if (!Slot.nCount.load(std::memory_order_relaxed))
+			continue;
+
+		// Keep counting until the rate limit period has passed
+		if (Slot.bReported && (nTicks - Slot.nLastReportTime) < Utility::MillisToTicks(RateLimitMillis))
+			continue;
+
+		const unsigned int nCount = Slot.nCount.exchange(0, std::memory_order_acquire);
+		const int nArg = Slot.nArg.load(std::memory_order_relaxed);
+		const TDeferredLogMessageInfo& Info = MessageInfo[i];
+
+		if (Info.pLogFormat)
+		{
+			char Buffer[128];
+			snprintf(Buffer, sizeof(Buffer), Info.pLogFormat, nArg);
+
+			if (nCount > 1)
+				CLogger::Get()->Write(From, Info.Severity, "%s (%u times)", Buffer, nCount);
+			else
+				CLogger::Get()->Write(From, Info.Severity, "%s", Buffer);
+		}
+
+		if (Info.pLCDText && pLCDHandler)
+			pLCDHandler(Info.LCDSeverity, Info.pLCDText, pParam);
+
+		Slot.nLastReportTime = nTicks;
+		Slot.bReported = true;
+		bReported = true;
+	}
+
+	return bReported;
+}
@@ -0,0 +1,238 @@
+//
+// fileindex.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/util.h>
+
+#include "fileindex.h"
+#include "filesystemlock.h"
+
+LOGMODULE("fileindex");
+
+CFileIndex::CFileIndex(u32 nMagic)
+	: m_nMagic(nMagic),
+
+	  m_pLoadedData(nullptr),
+	  m_nLoadedSize(0),
+	  m_nLoadedEntries(0),
+	  m_nFindOffset(0),
+	  m_nHits(0),
+
+	  m_pData(nullptr),
+	  m_nSize(0),
+	  m_nCapacity(0),
+	  m_nEntries(0),
+	  m_bChanged(false)
+{
+}
+
+CFileIndex::~CFileIndex()
+{
+	delete[] m_pLoadedData;
+	delete[] m_pData;
+}
+
+bool CFileIndex::Load(const char* pPath)
+{
+	CFileSystemLock::Acquire();
+
+	FIL File;
+	if (f_open(&File, pPath, FA_READ) != FR_OK)
+	{
+		CFileSystemLock::Release();
+		return false;
+	}
+
+	THeader Header;
+	UINT nRead;
+	const FSIZE_t nFileSize = f_size(&File);
+	bool bValid = f_read(&File, &Header, sizeof(Header), &nRead) == FR_OK && nRead == sizeof(Header) &&
+		      Header.nMagic == m_nMagic && Header.nVersion == Version &&
+		      Header.nDataSize <= MaxIndexSize && Header.nDataSize == nFileSize - sizeof(Header);
+
+	u8* pData = bValid ? new u8[Header.nDataSize] : nullptr;
+	if (pData)
+		bValid = f_read(&File, pData, Header.nDataSize, &nRead) == FR_OK && nRead == Header.nDataSize &&
+			 Checksum(pData, Header.nDataSize) == Header.nChecksum;
+	else
+		bValid = false;
+
+	f_close(&File);
+	CFileSystemLock::Release();
+
+	// Ensure all entries fit within the data
+	size_t nOffset = 0;
+	for (size_t i = 0; bValid && i < Header.nEntries; ++i)
+	{
+		if (nOffset + sizeof(TEntryHeader) > Header.nDataSize)
+		{
+			bValid = false;
+			break;
+		}
+
+		const TEntryHeader* pEntry = reinterpret_cast<const TEntryHeader*>(pData + nOffset);
+		nOffset += sizeof(TEntryHeader) + pEntry->nFileNameLength + 1 + pEntry->nDataSize;
+		bValid = nOffset <= Header.nDataSize && pData[nOffset - pEntry->nDataSize - 1] == '\0';
+	}
+
+	if (!bValid || nOffset != Header.nDataSize)
+	{
+		LOGWARN("Ignoring invalid index %s", pPath);
+		delete[] pData;
+		return false;
+	}
+
+	delete[] m_pLoadedData;
+	m_pLoadedData = pData;
+	m_nLoadedSize = Header.nDataSize;
+	m_nLoadedEntries = Header.nEntries;
+	m_nFindOffset = 0;
+	m_nHits = 0;
+
+	return true;
+}
+
+bool CFileIndex::Save(const char* pPath)
+{
+	CFileSystemLockGuard Lock;
+
+	FIL File;
+	if (f_open(&File, pPath, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGWARN("Couldn't create index %s", pPath);
+		return false;
+	}
+
+	THeader Header;
+	Header.nMagic = m_nMagic;
+	Header.nVersion = Version;
+	Header.nEntries = m_nEntries;
+	Header.nDataSize = m_nSize;
+	Header.nChecksum = Checksum(m_pData, m_nSize);
+
+	UINT nWritten;
+	bool bResult = f_write(&File, &Header, sizeof(Header), &nWritten) == FR_OK && nWritten == sizeof(Header);
+	if (bResult && m_nSize)
+		bResult = f_write(&File, m_pData, m_nSize, &nWritten) == FR_OK && nWritten == m_nSize;
+
+	if (f_close(&File) != FR_OK)
+		bResult = false;
+
+	// Don't leave a truncated index behind
+	if (!bResult)
+	{
+		LOGWARN("Couldn't write index %s", pPath);
+		f_unlink(pPath);
+	}
+
+	return bResult;
+}
+
+const u8* CFileIndex::Find(const FILINFO& FileInfo, size_t& nOutSize)
+{
+	// Files are usually enumerated in the same order as when the index was saved, so resume from the last match
+	size_t nOffset = m_nFindOffset;
+	for (size_t i = 0; i < m_nLoadedEntries; ++i)
+	{
+		if (nOffset >= m_nLoadedSize)
+			nOffset = 0;
+
+		const TEntryHeader& Entry = *reinterpret_cast<const TEntryHeader*>(m_pLoadedData + nOffset);
+		const char* pFileName = reinterpret_cast<const char*>(&Entry + 1);
+		const u8* pData = reinterpret_cast<const u8*>(pFileName + Entry.nFileNameLength + 1);
+		nOffset += sizeof(TEntryHeader) + Entry.nFileNameLength + 1 + Entry.nDataSize;
+
+		if (strcmp(pFileName, FileInfo.fname) != 0)
+			continue;
+
+		m_nFindOffset = nOffset;
+
+		// Changed since the index was saved
+		if (Entry.nFileSize != FileInfo.fsize || Entry.nFileDate != FileInfo.fdate || Entry.nFileTime != FileInfo.ftime)
+			break;
+
+		++m_nHits;
+		nOutSize = Entry.nDataSize;
+		return pData;
+	}
+
+	m_bChanged = true;
+	return nullptr;
+}
+
+void CFileIndex::Add(const FILINFO& FileInfo, const void* pData, size_t nSize)
+{
+	const size_t nFileNameLength = strlen(FileInfo.fname);
+	const size_t nEntrySize = sizeof(TEntryHeader) + nFileNameLength + 1 + nSize;
+
+	if (m_nSize + nEntrySize > MaxIndexSize || nSize > 0xFFFF || FileInfo.fsize > 0xFFFFFFFF)
+	{
+		// Not cached; it will be checked again next time
+		m_bChanged = true;
+		return;
+	}
+
+	if (m_nSize + nEntrySize > m_nCapacity)
+	{
+		const size_t nCapacity = m_nCapacity ? m_nCapacity * 2 : 4096;
+		u8* pNewData = new u8[nCapacity];
+		if (!pNewData)
+		{
+			m_bChanged = true;
+			return;
+		}
+
+		memcpy(pNewData, m_pData, m_nSize);
+		delete[] m_pData;
+		m_pData = pNewData;
+		m_nCapacity = nCapacity;
+	}
+
+	TEntryHeader Entry;
+	Entry.nFileSize = FileInfo.fsize;
+	Entry.nFileDate = FileInfo.fdate;
+	Entry.nFileTime = FileInfo.ftime;
+	Entry.nFileNameLength = nFileNameLength;
+	Entry.nDataSize = nSize;
+
+	u8* pEntry = m_pData + m_nSize;
+	memcpy(pEntry, &Entry, sizeof(Entry));
+	memcpy(pEntry + sizeof(Entry), FileInfo.fname, nFileNameLength + 1);
+	memcpy(pEntry + sizeof(Entry) + nFileNameLength + 1, pData, nSize);
+
+	m_nSize += nEntrySize;
+	++m_nEntries;
+}
+
+u32 CFileIndex::Checksum(const u8* pData, size_t nSize)
+{
+	// FNV-1a
+	u32 nHash = 2166136261u;
+	for (size_t i = 0; i < nSize; ++i)
+	{
+		nHash ^= pData[i];
+		nHash *= 16777619u;
+	}
+
+	return nHash;
+}
@@ -0,0 +1,77 @@
+//
+// filesystemlock.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/multicore.h>
+
+#ifndef MT32_PI_HOST
+#include <circle/sched/scheduler.h>
+#endif
+
+#include "filesystemlock.h"
+
+std::atomic<uintptr> CFileSystemLock::s_nOwner{0};
+unsigned int CFileSystemLock::s_nDepth = 0;
+
+void CFileSystemLock::Acquire()
+{
+	const uintptr nOwner = GetOwner();
+
+	if (s_nOwner.load(std::memory_order_relaxed) == nOwner)
+	{
+		++s_nDepth;
+		return;
+	}
+
+	uintptr nExpected = 0;
+	while (!s_nOwner.compare_exchange_weak(nExpected, nOwner, std::memory_order_acquire, std::memory_order_relaxed))
+	{
+		nExpected = 0;
+
+#ifndef MT32_PI_HOST
+		// Let the other tasks on this core run (possibly the owner)
+		if (CMultiCoreSupport::ThisCore() == 0)
+			CScheduler::Get()->Yield();
+#endif
+	}
+
+	s_nDepth = 1;
+}
+
+void CFileSystemLock::Release()
+{
+	if (--s_nDepth == 0)
+		s_nOwner.store(0, std::memory_order_release);
+}
+
+uintptr CFileSystemLock::GetOwner()
+{
+	const unsigned int nCore = CMultiCoreSupport::ThisCore();
+
+#ifndef MT32_PI_HOST
+	// Tasks share core 0, so each one is an owner in its own right
+	if (nCore == 0)
+		return reinterpret_cast<uintptr>(CScheduler::Get()->GetCurrentTask());
+#endif
+
+	// Never a valid task pointer
+	return nCore + 1;
+}
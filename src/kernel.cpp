@@ -20,6 +20,7 @@
 // mt32-pi. If not, see <http://www.gnu.org/licenses/>.
 //
 
+#include "bootprofiler.h"
 #include "config.h"
 #include "kernel.h"
 
@@ -50,6 +51,8 @@ CKernel::CKernel(void)
 
 bool CKernel::Initialize(void)
 {
+	CBootProfiler::CStep Step("kernel");
+
 	if (!CStdlibApp::Initialize())
 		return false;
 
@@ -76,18 +79,25 @@ bool CKernel::Initialize(void)
 	if (!m_Timer.Initialize())
 		return false;
 
-	if (!m_EMMC.Initialize())
-		return false;
-
-	if (f_mount(&m_SDFileSystem, "SD:", 1) != FR_OK)
 	{
-		m_Logger.Write(GetKernelName(), LogError, "Failed to mount SD card");
-		return false;
+		CBootProfiler::CStep SDStep("sd_card");
+
+		if (!m_EMMC.Initialize())
+			return false;
+
+		if (f_mount(&m_SDFileSystem, "SD:", 1) != FR_OK)
+		{
+			m_Logger.Write(GetKernelName(), LogError, "Failed to mount SD card");
+			return false;
+		}
 	}
 
 	// Load configuration file
-	if (!m_Config.Initialize("mt32-pi.cfg"))
-		m_Logger.Write(GetKernelName(), LogWarning, "Unable to find or parse config file; using defaults");
+	{
+		CBootProfiler::CStep ConfigStep("config");
+		if (!m_Config.Initialize("mt32-pi.cfg"))
+			m_Logger.Write(GetKernelName(), LogWarning, "Unable to find or parse config file; using defaults");
+	}
 
 	// Init serial port for MIDI with preferred baud rate if not used for logging
 	if (bSerialMIDIAvailable && !m_Serial.Initialize(m_Config.MIDIGPIOBaudRate))
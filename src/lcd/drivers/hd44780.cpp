@@ -22,6 +22,7 @@
 
 #include <circle/logger.h>
 #include <circle/timer.h>
+#include <circle/util.h>
 
 #include "lcd/barchars.h"
 #include "lcd/drivers/hd44780.h"
@@ -29,6 +30,10 @@
 CHD44780Base::CHD44780Base(u8 nColumns, u8 nRows)
 	: CLCD(nColumns, nRows),
 	  m_RowOffsets{ 0, 0x40, nColumns, u8(0x40 + nColumns) },
+	  m_ShadowBuffer{},
+	  m_nDDRAMAddress(UnknownAddress),
+	  m_CustomChars{},
+	  m_nValidCustomChars(0),
 	  m_BarCharSet(TBarCharSet::None)
 {
 }
@@ -57,13 +62,45 @@ void CHD44780Base::WriteData(const u8* pBytes, size_t nSize)
 		WriteData(pBytes[i]);
 }
 
+void CHD44780Base::WriteCell(u8 nX, u8 nY, u8 nChar)
+{
+	assert(nX < MaxColumns && nY < MaxRows);
+	if (m_ShadowBuffer[nY][nX] == nChar)
+		return;
+
+	// The address counter advances after each write, so runs of changed cells need only one cursor move
+	const u8 nAddress = m_RowOffsets[nY] + nX;
+	if (nAddress != m_nDDRAMAddress)
+		WriteCommand(0x80 | nAddress);
+
+	WriteData(nChar);
+	m_ShadowBuffer[nY][nX] = nChar;
+	m_nDDRAMAddress = nAddress + 1;
+}
+
+void CHD44780Base::ResetShadowBuffer()
+{
+	// The display is blank and the address counter is at the start of DDRAM after a clear command
+	memset(m_ShadowBuffer, ' ', sizeof(m_ShadowBuffer));
+	m_nDDRAMAddress = 0;
+}
+
 void CHD44780Base::SetCustomChar(u8 nIndex, const u8 nCharData[8])
 {
 	assert(nIndex < 8);
+	if ((m_nValidCustomChars & (1 << nIndex)) && memcmp(m_CustomChars[nIndex], nCharData, sizeof(m_CustomChars[nIndex])) == 0)
+		return;
+
 	WriteCommand(0x40 | (nIndex << 3));
 
 	for (u8 i = 0; i < 8; ++i)
 		WriteData(nCharData[i]);
+
+	memcpy(m_CustomChars[nIndex], nCharData, sizeof(m_CustomChars[nIndex]));
+	m_nValidCustomChars |= 1 << nIndex;
+
+	// The address counter now points into CGRAM
+	m_nDDRAMAddress = UnknownAddress;
 }
 
 void CHD44780Base::SetBarChars(TBarCharSet CharSet)
@@ -113,6 +150,7 @@ bool CHD44780Base::Initialize()
 	// Clear display
 	WriteCommand(0b0001);
 	CTimer::SimpleMsDelay(50);
+	ResetShadowBuffer();
 
 	// Home cursor
 	WriteCommand(0b0010);
@@ -135,23 +173,26 @@ bool CHD44780Base::Initialize()
 
 void CHD44780Base::Print(const char* pText, u8 nCursorX, u8 nCursorY, bool bClearLine, bool bImmediate)
 {
+	if (nCursorY >= m_nHeight)
+		return;
+
+	u8 nX = 0;
+
 	if (bClearLine)
 	{
-		WriteCommand(0x80 | m_RowOffsets[nCursorY]);
-		for (u8 nChar = 0; nChar < nCursorX; ++nChar)
-			WriteData(' ');
+		while (nX < nCursorX)
+			WriteCell(nX++, nCursorY, ' ');
 	}
 	else
-		WriteCommand(0x80 | m_RowOffsets[nCursorY] + nCursorX);
+		nX = nCursorX;
 
-	const char* p = pText;
-	while (*p && (p - pText) < (m_nWidth - nCursorX))
-		WriteData(*p++);
+	while (*pText && nX < m_nWidth)
+		WriteCell(nX++, nCursorY, *pText++);
 
 	if (bClearLine)
 	{
-		while ((p++ - pText) < (m_nWidth - nCursorX))
-			WriteData(' ');
+		while (nX < m_nWidth)
+			WriteCell(nX++, nCursorY, ' ');
 	}
 }
 
@@ -160,6 +201,13 @@ void CHD44780Base::Clear(bool bImmediate)
 	if (!bImmediate)
 		return;
 
+	// The delay must follow the command itself, so it can't be queued
+	const bool bAsyncTransfers = m_bAsyncTransfers;
+	SetAsyncTransfers(false);
+
 	WriteCommand(0b0001);
 	CTimer::SimpleMsDelay(50);
+	ResetShadowBuffer();
+
+	m_bAsyncTransfers = bAsyncTransfers;
 }
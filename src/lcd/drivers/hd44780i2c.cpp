@@ -31,7 +31,10 @@ constexpr u8 LCDBacklightBit = (1 << 3);
 CHD44780I2C::CHD44780I2C(CI2CMaster* pI2CMaster, u8 nAddress, u8 nColumns, u8 nRows)
 	: CHD44780Base(nColumns, nRows),
 	  m_pI2CMaster(pI2CMaster),
-	  m_nAddress(nAddress)
+	  m_nAddress(nAddress),
+	  m_TransferQueue{0},
+	  m_nTransferQueueHead(0),
+	  m_nTransferQueueCount(0)
 {
 }
 
@@ -54,6 +57,22 @@ void CHD44780I2C::WriteNybble(u8 nNybble, TWriteMode Mode)
 	if (Mode == TWriteMode::Data)
 		nByte |= LCDDataBit;
 
+	if (!m_bAsyncTransfers)
+	{
+		SendNybble(nByte);
+		return;
+	}
+
+	// Make room by sending the oldest nybbles
+	if (m_nTransferQueueCount == TransferQueueSize)
+		UpdateTransfers(TransferQueueSize / 4);
+
+	m_TransferQueue[(m_nTransferQueueHead + m_nTransferQueueCount) % TransferQueueSize] = nByte;
+	++m_nTransferQueueCount;
+}
+
+void CHD44780I2C::SendNybble(u8 nByte)
+{
 	m_pI2CMaster->Write(m_nAddress, &nByte, 1);
 	CTimer::SimpleusDelay(5);
 
@@ -62,3 +81,18 @@ void CHD44780I2C::WriteNybble(u8 nNybble, TWriteMode Mode)
 	m_pI2CMaster->Write(m_nAddress, &nByte, 1);
 	CTimer::SimpleusDelay(100);
 }
+
+bool CHD44780I2C::UpdateTransfers(size_t nMaxBytes)
+{
+	// Two bus writes per nybble; always send at least one
+	size_t nSentBytes = 0;
+	while (m_nTransferQueueCount && (nSentBytes == 0 || nSentBytes + 2 <= nMaxBytes))
+	{
+		SendNybble(m_TransferQueue[m_nTransferQueueHead]);
+		m_nTransferQueueHead = (m_nTransferQueueHead + 1) % TransferQueueSize;
+		--m_nTransferQueueCount;
+		nSentBytes += 2;
+	}
+
+	return m_nTransferQueueCount > 0;
+}
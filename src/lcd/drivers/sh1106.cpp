@@ -35,34 +35,30 @@ CSH1106::CSH1106(CI2CMaster *pI2CMaster, u8 nAddress, u8 nWidth, u8 nHeight, TLC
 {
 }
 
-void CSH1106::WriteFrameBuffer(bool bForceFullUpdate) const
+void CSH1106::QueueWindows(bool bForceFullUpdate)
 {
-	// Reset start line
-	WriteCommand(SetStartLine | 0x00);
+	const u8 nPages = m_nHeight / 8;
 
-	const size_t nPages = m_nHeight / 8;
-	constexpr size_t nPageSize = 128;
-
-	// Copy framebuffer one page at a time
+	// SH1106 only supports page addressing, so each page's changed columns are sent separately
 	for (u8 nPage = 0; nPage < nPages; ++nPage)
 	{
-		const size_t nOffset = nPage * nPageSize;
-		const bool bNeedsUpdate = bForceFullUpdate || memcmp(&m_FrameBuffers[0].FrameBuffer[nOffset], &m_FrameBuffers[1].FrameBuffer[nOffset], nPageSize) != 0;
-
-		if (bNeedsUpdate)
-		{
-			WriteCommand(SetPageAddress | nPage);
-
-			// SH1106 displays have a 132x64 pixel memory, but most modules have a visible width of 128 centred on this buffer
-			WriteCommand(SetColumnAddressLow | 0x02);
-			WriteCommand(SetColumnAddressHigh | 0x00);
-
-			// Prefix this page's pixel data with a data control byte
-			u8 Buffer[nPageSize + 1] = { 0x40 };
-			memcpy(Buffer + 1, &m_FrameBuffers[m_nCurrentFrameBuffer].FrameBuffer[nOffset], nPageSize);
+		u8 nFirstColumn = 0, nLastColumn = GetPageSize() - 1;
+		if (bForceFullUpdate || GetDirtyColumns(nPage, nFirstColumn, nLastColumn))
+			m_Windows[m_nWindows++] = { nPage, nPage, nFirstColumn, nLastColumn };
+	}
+}
 
-			m_pI2CMaster->Write(m_nAddress, Buffer, sizeof(Buffer));
+void CSH1106::WriteWindowAddress(const TWindow& Window) const
+{
+	// SH1106 displays have a 132x64 pixel memory, but most modules have a visible width of 128 centred on this buffer
+	const u8 nColumnAddress = Window.nFirstColumn + 2;
+	const u8 Commands[] =
+	{
+		SetStartLine | 0x00,
+		static_cast<u8>(SetPageAddress | Window.nFirstPage),
+		static_cast<u8>(SetColumnAddressLow | (nColumnAddress & 0x0F)),
+		static_cast<u8>(SetColumnAddressHigh | (nColumnAddress >> 4)),
+	};
 
-		}
-	}
+	WriteCommands(Commands, sizeof(Commands));
 }
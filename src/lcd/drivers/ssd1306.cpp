@@ -157,7 +157,13 @@ CSSD1306::CSSD1306(CI2CMaster* pI2CMaster, u8 nAddress, u8 nWidth, u8 nHeight, T
 	  m_Mirror(Mirror),
 
 	  m_FrameBuffers{{0x40, {0}}, {0x40, {0}}},
-	  m_nCurrentFrameBuffer(0)
+	  m_nCurrentFrameBuffer(0),
+
+	  m_Windows{},
+	  m_nWindows(0),
+	  m_nTransferWindow(0),
+	  m_nTransferOffset(0),
+	  m_nTransferFrameBuffer(0)
 {
 }
 
@@ -220,18 +226,144 @@ void CSSD1306::WriteCommand(u8 nCommand) const
 	m_pI2CMaster->Write(m_nAddress, Buffer, sizeof(Buffer));
 }
 
-void CSSD1306::WriteFrameBuffer(bool bForceFullUpdate) const
+void CSSD1306::WriteCommands(const u8* pCommands, size_t nCount) const
+{
+	// A control byte with the continuation bit clear is followed by a stream of commands
+	u8 Buffer[16] = { 0x00 };
+	assert(nCount < sizeof(Buffer));
+
+	memcpy(Buffer + 1, pCommands, nCount);
+	m_pI2CMaster->Write(m_nAddress, Buffer, nCount + 1);
+}
+
+void CSSD1306::WriteWindowAddress(const TWindow& Window) const
+{
+	// In horizontal addressing mode, the controller wraps to the next page at the end of the column range
+	const u8 Commands[] =
+	{
+		SetStartLine | 0x00,
+		SetColumnAddress,	Window.nFirstColumn,	Window.nLastColumn,
+		SetPageAddress,		Window.nFirstPage,	Window.nLastPage,
+	};
+
+	WriteCommands(Commands, sizeof(Commands));
+}
+
+bool CSSD1306::GetDirtyColumns(u8 nPage, u8& nOutFirstColumn, u8& nOutLastColumn) const
+{
+	const size_t nPageSize = GetPageSize();
+	const u8* pCurrent  = m_FrameBuffers[m_nCurrentFrameBuffer].FrameBuffer + nPage * nPageSize;
+	const u8* pPrevious = m_FrameBuffers[m_nCurrentFrameBuffer ^ 1].FrameBuffer + nPage * nPageSize;
+
+	size_t nFirst = 0;
+	while (nFirst < nPageSize && pCurrent[nFirst] == pPrevious[nFirst])
+		++nFirst;
+
+	if (nFirst == nPageSize)
+		return false;
+
+	size_t nLast = nPageSize - 1;
+	while (pCurrent[nLast] == pPrevious[nLast])
+		--nLast;
+
+	nOutFirstColumn = nFirst;
+	nOutLastColumn = nLast;
+	return true;
+}
+
+void CSSD1306::QueueWindows(bool bForceFullUpdate)
+{
+	const u8 nPages = m_nHeight / 8;
+
+	for (u8 nPage = 0; nPage < nPages; ++nPage)
+	{
+		u8 nFirstColumn = 0, nLastColumn = m_nWidth - 1;
+		if (!bForceFullUpdate && !GetDirtyColumns(nPage, nFirstColumn, nLastColumn))
+			continue;
+
+		// Extend the previous window if it ends on the page above and resending unchanged columns costs less than a new window
+		if (m_nWindows && m_Windows[m_nWindows - 1].nLastPage == nPage - 1)
+		{
+			TWindow& Window = m_Windows[m_nWindows - 1];
+			const u8 nMergedFirstColumn = Utility::Min(Window.nFirstColumn, nFirstColumn);
+			const u8 nMergedLastColumn = Utility::Max(Window.nLastColumn, nLastColumn);
+			const size_t nWindowPages = Window.nLastPage - Window.nFirstPage + 1;
+			const size_t nMergedSize = (nMergedLastColumn - nMergedFirstColumn + 1) * (nWindowPages + 1);
+			const size_t nSeparateSize = (Window.nLastColumn - Window.nFirstColumn + 1) * nWindowPages + (nLastColumn - nFirstColumn + 1) + WindowOverheadBytes;
+
+			if (nMergedSize <= nSeparateSize)
+			{
+				Window.nLastPage = nPage;
+				Window.nFirstColumn = nMergedFirstColumn;
+				Window.nLastColumn = nMergedLastColumn;
+				continue;
+			}
+		}
+
+		m_Windows[m_nWindows++] = { nPage, nPage, nFirstColumn, nLastColumn };
+	}
+}
+
+void CSSD1306::WriteFrameBuffer(bool bForceFullUpdate)
+{
+	// The previous frame must have reached the display before the new one can be compared against it
+	FinishTransfers();
+
+	m_nWindows = 0;
+	m_nTransferWindow = 0;
+	m_nTransferOffset = 0;
+	m_nTransferFrameBuffer = m_nCurrentFrameBuffer;
+	QueueWindows(bForceFullUpdate);
+
+	if (!m_bAsyncTransfers || bForceFullUpdate)
+		FinishTransfers();
+
+	// The previous framebuffer must match what's on the display for the next comparison
+	if (bForceFullUpdate)
+		memcpy(m_FrameBuffers[m_nCurrentFrameBuffer ^ 1].FrameBuffer, m_FrameBuffers[m_nCurrentFrameBuffer].FrameBuffer, sizeof(TFrameBufferUpdatePacket::FrameBuffer));
+}
+
+bool CSSD1306::UpdateTransfers(size_t nMaxBytes)
 {
-	// Reset start line
-	WriteCommand(SetStartLine | 0x00);
+	const u8* pFrameBuffer = m_FrameBuffers[m_nTransferFrameBuffer].FrameBuffer;
+	const size_t nPageSize = GetPageSize();
+	size_t nSentBytes = 0;
 
-	// Compare two framebuffers
-	const size_t nFrameBufferSize = m_nWidth * m_nHeight / 8;
-	const bool bNeedsUpdate = bForceFullUpdate || memcmp(m_FrameBuffers[0].FrameBuffer, m_FrameBuffers[1].FrameBuffer, nFrameBufferSize) != 0;
+	while (m_nTransferWindow < m_nWindows && nSentBytes < nMaxBytes)
+	{
+		const TWindow& Window = m_Windows[m_nTransferWindow];
+		const size_t nColumns = Window.nLastColumn - Window.nFirstColumn + 1;
+		const size_t nWindowSize = nColumns * (Window.nLastPage - Window.nFirstPage + 1);
+
+		if (m_nTransferOffset == 0)
+		{
+			WriteWindowAddress(Window);
+			nSentBytes += WindowOverheadBytes;
+		}
+
+		// The controller keeps its address between transfers, so a window can be sent a page at a time; always send at least one page
+		u8 Buffer[sizeof(TFrameBufferUpdatePacket)] = { 0x40 };
+		size_t nSize = 1;
+
+		do
+		{
+			const u8 nPage = Window.nFirstPage + m_nTransferOffset / nColumns;
+			memcpy(Buffer + nSize, pFrameBuffer + nPage * nPageSize + Window.nFirstColumn, nColumns);
+			nSize += nColumns;
+			m_nTransferOffset += nColumns;
+		} while (m_nTransferOffset < nWindowSize && nSentBytes + nSize + nColumns <= nMaxBytes);
+
+		m_pI2CMaster->Write(m_nAddress, Buffer, nSize);
+		nSentBytes += nSize;
+
+		if (m_nTransferOffset == nWindowSize)
+		{
+			++m_nTransferWindow;
+			m_nTransferOffset = 0;
+		}
+	}
 
-	// Copy entire framebuffer
-	if (bNeedsUpdate)
-		m_pI2CMaster->Write(m_nAddress, &m_FrameBuffers[m_nCurrentFrameBuffer], sizeof(TFrameBufferUpdatePacket::DataControlByte) + nFrameBufferSize);
+	return m_nTransferWindow < m_nWindows;
 }
 
 void CSSD1306::SwapFrameBuffers()
@@ -441,5 +573,6 @@ void CSSD1306::SetBacklightState(bool bEnabled)
 	m_bBacklightEnabled = bEnabled;
 
 	// Power on/off display
+	FinishTransfers();
 	WriteCommand(bEnabled ? SetDisplayOn : SetDisplayOff);
 }
@@ -25,6 +25,7 @@
 
 #include <cstdio>
 
+#include "cpuload.h"
 #include "lcd/ui.h"
 #include "synth/synthbase.h"
 #include "utility.h"
@@ -44,7 +45,9 @@ CUserInterface::CUserInterface()
 	  m_SystemMessageTextBuffer{'\0'},
 	  m_SysExDisplayMessageType(TSysExDisplayMessage::Roland),
 	  m_SysExTextBuffer{'\0'},
-	  m_SysExPixelBuffer{0}
+	  m_SysExPixelBuffer{0},
+	  m_bPerformancePageVisible(false),
+	  m_PerformanceStats{}
 {
 }
 
@@ -135,9 +138,14 @@ void CUserInterface::Update(CLCD& LCD, CSynthBase& Synth, unsigned int nTicks)
 
 	LCD.Clear(false);
 
-	// Draw synth UI if no drawable system state
+	// Draw performance page or synth UI if no drawable system state
 	if (!DrawSystemState(LCD))
-		Synth.UpdateLCD(LCD, nTicks);
+	{
+		if (m_bPerformancePageVisible)
+			DrawPerformancePage(LCD, nTicks);
+		else
+			Synth.UpdateLCD(LCD, nTicks);
+	}
 
 	LCD.Flip();
 }
@@ -451,3 +459,33 @@ void CUserInterface::DrawSysExBitmap(CLCD& LCD, u8 nFirstRow, u8 nRows) const
 		}
 	}
 }
+
+void CUserInterface::DrawPerformancePage(CLCD& LCD, unsigned int nTicks) const
+{
+	const TPerformanceStats& Stats = m_PerformanceStats;
+	char Lines[4][20 + 1];
+
+	// Load per core; two digits is enough to tell a busy core from one about to run out of time
+	int nOffset = snprintf(Lines[0], sizeof(Lines[0]), "CPU");
+	for (u8 i = 0; i < CORES && nOffset < static_cast<int>(sizeof(Lines[0])); ++i)
+	{
+		const u8 nLoad = Stats.CoreLoads[i];
+		if (nLoad == CCPULoad::Unknown)
+			nOffset += snprintf(Lines[0] + nOffset, sizeof(Lines[0]) - nOffset, " --");
+		else
+			nOffset += snprintf(Lines[0] + nOffset, sizeof(Lines[0]) - nOffset, " %2d", Utility::Min(nLoad, static_cast<u8>(99)));
+	}
+
+	const u8 nHeadroom = Stats.nRenderLoad < 100 ? 100 - Stats.nRenderLoad : 0;
+	snprintf(Lines[1], sizeof(Lines[1]), "Room %d%% Xrun %d", nHeadroom, Stats.nUnderruns);
+	snprintf(Lines[2], sizeof(Lines[2]), "Vc %d/%d MIDI %d%%", Stats.nVoices, Stats.nMaxVoices, Stats.nMIDIBufferPeak);
+	snprintf(Lines[3], sizeof(Lines[3]), "Mem %dM %dC %dMHz", Stats.nFreeMemoryKB / 1024, Stats.nTemperature, Stats.nClockMHz);
+
+	// Flip between the two halves on smaller displays
+	const u8 nHeight = LCD.GetType() == CLCD::TType::Graphical ? LCD.Height() / 16 : LCD.Height();
+	const u8 nRows = nHeight >= 4 ? 4 : Utility::Min(nHeight, static_cast<u8>(2));
+	const u8 nFirstLine = nRows == 4 ? 0 : nTicks / Utility::MillisToTicks(PerformancePageFlipTimeMillis) % 2 * 2;
+
+	for (u8 nRow = 0; nRow < nRows; ++nRow)
+		LCD.Print(Lines[nFirstLine + nRow], 0, nRow, true, false);
+}
@@ -0,0 +1,379 @@
+//
+// midicapture.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include <cstdio>
+
+#include "filesystemlock.h"
+#include "midicapture.h"
+#include "midiparser.h"
+#include "utility.h"
+
+LOGMODULE("midicapture");
+
+constexpr unsigned int PollPeriodMillis  = 100;
+constexpr unsigned int FlushPeriodMillis = 2000;
+constexpr unsigned int MaxFileNumber     = 9999;
+
+// 120 BPM (the default tempo) at 5000 ticks per quarter note gives 100 microseconds per tick
+constexpr u16 TicksPerQuarterNote = 5000;
+constexpr u32 MicrosPerQuarterNote = 500000;
+constexpr u32 MicrosPerTick = MicrosPerQuarterNote / TicksPerQuarterNote;
+
+constexpr u32 MaxVariableLength = 0x0FFFFFFF;
+
+// Header chunk, then the start of the track chunk
+constexpr size_t TrackLengthOffset = 18;
+constexpr size_t HeaderSize = 22;
+const u8 FileHeader[HeaderSize] =
+{
+	'M', 'T', 'h', 'd', 0x00, 0x00, 0x00, 0x06,
+	0x00, 0x00, 0x00, 0x01, TicksPerQuarterNote >> 8, TicksPerQuarterNote & 0xFF,
+	'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00,
+};
+
+const u8 TempoEvent[] = { 0x00, 0xFF, 0x51, 0x03, MicrosPerQuarterNote >> 16, (MicrosPerQuarterNote >> 8) & 0xFF, MicrosPerQuarterNote & 0xFF };
+const u8 EndOfTrackEvent[] = { 0x00, 0xFF, 0x2F, 0x00 };
+
+CMIDICapture::CMIDICapture()
+	: CTask(TASK_STACK_SIZE),
+	  m_bCapturing(false),
+	  m_State(TState::Idle),
+	  m_pDirectory(nullptr),
+	  m_nStartTimestamp(0),
+	  m_nDroppedMessages(0),
+
+	  m_File{},
+	  m_bFileOpen(false),
+	  m_FileName{'\0'},
+	  m_nTrackLength(0),
+	  m_nLastTimestamp(0),
+	  m_nElapsedMicros(0),
+	  m_nLastTick(0),
+	  m_nReportedDroppedMessages(0),
+	  m_nLastWriteTime(0),
+
+	  m_nBuffered(0),
+	  m_WriteBuffer{0}
+{
+	static_assert(sizeof(EndOfTrackEvent) == EndOfTrackSize, "End of track size mismatch");
+}
+
+bool CMIDICapture::Start(const char* pDirectory)
+{
+	if (m_State.load() != TState::Idle)
+	{
+		LOGWARN("A capture is already in progress");
+		return false;
+	}
+
+	m_pDirectory = pDirectory;
+	m_nStartTimestamp = CTimer::GetClockTicks();
+	m_bCapturing = true;
+	m_State.store(TState::Opening);
+
+	return true;
+}
+
+void CMIDICapture::Stop()
+{
+	m_bCapturing = false;
+
+	// The capture task drains the queue and closes the file
+	TState Expected = TState::Opening;
+	if (!m_State.compare_exchange_strong(Expected, TState::Closing))
+	{
+		Expected = TState::Recording;
+		m_State.compare_exchange_strong(Expected, TState::Closing);
+	}
+}
+
+void CMIDICapture::Run()
+{
+	CScheduler* const pScheduler = CScheduler::Get();
+
+	while (true)
+	{
+		pScheduler->MsSleep(PollPeriodMillis);
+
+		switch (m_State.load())
+		{
+			case TState::Idle:
+				break;
+
+			case TState::Opening:
+			{
+				if (!OpenFile())
+				{
+					m_bCapturing = false;
+					DiscardEvents();
+					m_State.store(TState::Idle);
+					break;
+				}
+
+				// Stop() may have been called while the file was being opened
+				TState Expected = TState::Opening;
+				m_State.compare_exchange_strong(Expected, TState::Recording);
+				break;
+			}
+
+			case TState::Recording:
+			{
+				EncodeEvents();
+
+				const bool bFlushDue = m_nBuffered && CTimer::GetClockTicks() - m_nLastWriteTime >= FlushPeriodMillis * 1000;
+				if ((m_nBuffered >= BatchSize || bFlushDue) && !WriteBatch())
+				{
+					LOGERR("Couldn't write %s; capture stopped", m_FileName);
+					m_bCapturing = false;
+					CFileSystemLock::Acquire();
+					f_close(&m_File);
+					CFileSystemLock::Release();
+					m_bFileOpen = false;
+					DiscardEvents();
+					m_State.store(TState::Idle);
+				}
+				break;
+			}
+
+			case TState::Closing:
+				CloseFile();
+				m_State.store(TState::Idle);
+				break;
+		}
+	}
+}
+
+bool CMIDICapture::OpenFile()
+{
+	CFileSystemLockGuard Lock;
+
+	const FRESULT Result = f_mkdir(m_pDirectory);
+	if (Result != FR_OK && Result != FR_EXIST)
+	{
+		LOGERR("Couldn't create %s", m_pDirectory);
+		return false;
+	}
+
+	unsigned int nFileNumber = 1;
+	while (true)
+	{
+		if (nFileNumber > MaxFileNumber)
+		{
+			LOGERR("No more capture files can be created in %s", m_pDirectory);
+			return false;
+		}
+
+		snprintf(m_FileName, sizeof(m_FileName), "%s/cap%04d.mid", m_pDirectory, nFileNumber++);
+		if (f_stat(m_FileName, nullptr) == FR_NO_FILE)
+			break;
+	}
+
+	UINT nWritten;
+	if (f_open(&m_File, m_FileName, FA_WRITE | FA_CREATE_NEW) != FR_OK)
+	{
+		LOGERR("Couldn't create %s", m_FileName);
+		return false;
+	}
+
+	if (f_write(&m_File, FileHeader, sizeof(FileHeader), &nWritten) != FR_OK || nWritten != sizeof(FileHeader))
+	{
+		LOGERR("Couldn't write %s", m_FileName);
+		f_close(&m_File);
+		return false;
+	}
+
+	m_nTrackLength = 0;
+	m_nLastTimestamp = m_nStartTimestamp;
+	m_nElapsedMicros = 0;
+	m_nLastTick = 0;
+	m_nReportedDroppedMessages = m_nDroppedMessages.load(std::memory_order_relaxed);
+
+	// Written straight away so that the file is valid from the start
+	m_nBuffered = 0;
+	WriteBytes(TempoEvent, sizeof(TempoEvent));
+	if (!WriteBatch())
+	{
+		LOGERR("Couldn't write %s", m_FileName);
+		f_close(&m_File);
+		return false;
+	}
+
+	m_bFileOpen = true;
+	LOGNOTE("Capturing MIDI to %s", m_FileName);
+	return true;
+}
+
+void CMIDICapture::CloseFile()
+{
+	// Stopped before the file was opened
+	if (!m_bFileOpen)
+	{
+		DiscardEvents();
+		return;
+	}
+
+	// Write out everything captured before Stop() was called
+	bool bResult = true;
+	do
+	{
+		EncodeEvents();
+		bResult = WriteBatch();
+	} while (bResult && !m_Queue.IsEmpty());
+
+	CFileSystemLock::Acquire();
+	if (f_close(&m_File) != FR_OK)
+		bResult = false;
+	CFileSystemLock::Release();
+	m_bFileOpen = false;
+
+	if (bResult)
+		LOGNOTE("Saved %s (%d bytes of MIDI data)", m_FileName, m_nTrackLength);
+	else
+	{
+		LOGERR("Couldn't write %s", m_FileName);
+		DiscardEvents();
+	}
+}
+
+void CMIDICapture::DiscardEvents()
+{
+	TMIDIEvent Event;
+	while (m_Queue.Dequeue(Event))
+		;
+
+	m_nBuffered = 0;
+}
+
+void CMIDICapture::EncodeEvents()
+{
+	TMIDIEvent Event;
+
+	while (m_nBuffered < BatchSize && m_Queue.Dequeue(Event))
+	{
+		if (Event.pSysExData)
+		{
+			// Stored as F0, the length of the remaining bytes, then the remaining bytes including F7
+			if (Event.nMessage < 2 || Event.pSysExData[0] != 0xF0)
+				continue;
+
+			WriteDeltaTime(Event.nTimestamp);
+			WriteByte(0xF0);
+			WriteVariableLength(Event.nMessage - 1);
+			WriteBytes(Event.pSysExData + 1, Event.nMessage - 1);
+			continue;
+		}
+
+		// System common and real-time messages can't be stored in a MIDI file
+		const u8 nStatus = Event.nMessage & 0xFF;
+		if (nStatus < 0x80 || nStatus >= 0xF0)
+			continue;
+
+		WriteDeltaTime(Event.nTimestamp);
+		const size_t nLength = CMIDIParser::GetShortMessageLength(nStatus);
+		for (size_t i = 0; i < nLength; ++i)
+			WriteByte((Event.nMessage >> (i * 8)) & 0xFF);
+	}
+}
+
+bool CMIDICapture::WriteBatch()
+{
+	const size_t nEventBytes = m_nBuffered;
+
+	// Terminate the track after every batch so that the file stays valid if power is lost;
+	// the next batch overwrites the end of track event
+	WriteBytes(EndOfTrackEvent, sizeof(EndOfTrackEvent));
+
+	CFileSystemLock::Acquire();
+
+	UINT nWritten;
+	bool bResult = f_write(&m_File, m_WriteBuffer, m_nBuffered, &nWritten) == FR_OK && nWritten == m_nBuffered;
+	m_nBuffered = 0;
+
+	if (bResult)
+	{
+		m_nTrackLength += nEventBytes;
+
+		const u32 nChunkLength = m_nTrackLength + EndOfTrackSize;
+		const u8 ChunkLength[] = { static_cast<u8>(nChunkLength >> 24), static_cast<u8>(nChunkLength >> 16), static_cast<u8>(nChunkLength >> 8), static_cast<u8>(nChunkLength) };
+
+		bResult = f_lseek(&m_File, TrackLengthOffset) == FR_OK &&
+			  f_write(&m_File, ChunkLength, sizeof(ChunkLength), &nWritten) == FR_OK && nWritten == sizeof(ChunkLength) &&
+			  f_sync(&m_File) == FR_OK &&
+			  f_lseek(&m_File, HeaderSize + m_nTrackLength) == FR_OK;
+	}
+
+	CFileSystemLock::Release();
+
+	m_nLastWriteTime = CTimer::GetClockTicks();
+
+	const unsigned int nDroppedMessages = m_nDroppedMessages.load(std::memory_order_relaxed);
+	if (nDroppedMessages != m_nReportedDroppedMessages)
+	{
+		LOGWARN("%d MIDI messages could not be captured", nDroppedMessages - m_nReportedDroppedMessages);
+		m_nReportedDroppedMessages = nDroppedMessages;
+	}
+
+	return bResult;
+}
+
+void CMIDICapture::WriteVariableLength(u32 nValue)
+{
+	nValue = Utility::Min(nValue, MaxVariableLength);
+
+	u8 Bytes[4];
+	size_t nBytes = 0;
+	do
+	{
+		Bytes[nBytes++] = nValue & 0x7F;
+		nValue >>= 7;
+	} while (nValue);
+
+	while (nBytes > 1)
+		WriteByte(Bytes[--nBytes] | 0x80);
+	WriteByte(Bytes[0]);
+}
+
+void CMIDICapture::WriteDeltaTime(unsigned int nTimestamp)
+{
+	// Messages merged from different inputs may be slightly out of order; never go back in time
+	const int nDelta = static_cast<int>(nTimestamp - m_nLastTimestamp);
+	if (nDelta > 0)
+	{
+		m_nElapsedMicros += nDelta;
+		m_nLastTimestamp = nTimestamp;
+	}
+
+	const u64 nTick = m_nElapsedMicros / MicrosPerTick;
+	WriteVariableLength(Utility::Min(nTick - m_nLastTick, static_cast<u64>(MaxVariableLength)));
+	m_nLastTick = nTick;
+}
+
+void CMIDICapture::WriteBytes(const u8* pData, size_t nSize)
+{
+	memcpy(m_WriteBuffer + m_nBuffered, pData, nSize);
+	m_nBuffered += nSize;
+}
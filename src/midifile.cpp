@@ -0,0 +1,249 @@
+//
+// midifile.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+#include <algorithm>
+
+#include "filesystemlock.h"
+#include "midifile.h"
+#include "midiparser.h"
+
+LOGMODULE("midifile");
+
+constexpr u32 DefaultTempo = 500000;
+
+static u32 ReadBE(const u8* pData, size_t nBytes)
+{
+	u32 nValue = 0;
+	for (size_t i = 0; i < nBytes; ++i)
+		nValue = (nValue << 8) | pData[i];
+	return nValue;
+}
+
+static bool ReadVLQ(const u8*& pData, const u8* pEnd, u32& nOutValue)
+{
+	nOutValue = 0;
+
+	for (size_t i = 0; i < 4 && pData < pEnd; ++i)
+	{
+		const u8 nByte = *pData++;
+		nOutValue = (nOutValue << 7) | (nByte & 0x7F);
+		if (!(nByte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+bool CMIDIFile::Load(const char* pPath)
+{
+	std::vector<u8> Data;
+	UINT nRead;
+	FRESULT Result;
+
+	{
+		CFileSystemLockGuard Lock;
+
+		FIL File;
+		if (f_open(&File, pPath, FA_READ) != FR_OK)
+		{
+			LOGERR("Couldn't open '%s'", pPath);
+			return false;
+		}
+
+		Data.resize(f_size(&File));
+		Result = f_read(&File, Data.data(), Data.size(), &nRead);
+		f_close(&File);
+	}
+
+	if (Result != FR_OK || nRead != Data.size())
+	{
+		LOGERR("Couldn't read '%s'", pPath);
+		return false;
+	}
+
+	return Parse(Data.data(), Data.size(), pPath);
+}
+
+bool CMIDIFile::Parse(const u8* pData, size_t nSize, const char* pName)
+{
+	if (nSize < 14 || memcmp(pData, "MThd", 4) != 0 || ReadBE(pData + 4, 4) < 6)
+	{
+		LOGERR("'%s' is not a Standard MIDI File", pName);
+		return false;
+	}
+
+	const u16 nFormat = ReadBE(pData + 8, 2);
+	const u16 nTracks = ReadBE(pData + 10, 2);
+	const u16 nDivision = ReadBE(pData + 12, 2);
+
+	if (nFormat > 1)
+	{
+		LOGERR("MIDI file format %d is not supported", nFormat);
+		return false;
+	}
+
+	m_Events.clear();
+	m_Data.clear();
+
+	// Read each track
+	std::vector<TTrackEvent> TrackEvents;
+	size_t nPosition = 8 + ReadBE(pData + 4, 4);
+	for (u16 nTrack = 0; nTrack < nTracks && nPosition + 8 <= nSize; ++nTrack)
+	{
+		const size_t nChunkSize = ReadBE(pData + nPosition + 4, 4);
+		const size_t nChunkStart = nPosition + 8;
+
+		if (nChunkStart + nChunkSize > nSize)
+		{
+			LOGWARN("Track %d is truncated", nTrack);
+			break;
+		}
+
+		if (memcmp(pData + nPosition, "MTrk", 4) == 0 && !ParseTrack(pData + nChunkStart, nChunkSize, TrackEvents))
+			LOGWARN("Track %d is malformed; ignoring the rest of it", nTrack);
+
+		nPosition = nChunkStart + nChunkSize;
+	}
+
+	// Merge the tracks; events at the same tick stay in track order, so tempo changes on the first track come first
+	std::stable_sort(TrackEvents.begin(), TrackEvents.end(), [](const TTrackEvent& EventA, const TTrackEvent& EventB)
+	{
+		return EventA.nTick < EventB.nTick;
+	});
+
+	// Convert ticks to microseconds
+	const bool bSMPTE = nDivision & 0x8000;
+	const u64 nTicksPerSecond = bSMPTE ? static_cast<u64>(-static_cast<s8>(nDivision >> 8)) * (nDivision & 0xFF) : 0;
+	const u64 nTicksPerQuarterNote = bSMPTE ? 0 : nDivision;
+
+	if (!nTicksPerSecond && !nTicksPerQuarterNote)
+	{
+		LOGERR("Invalid time division");
+		return false;
+	}
+
+	u32 nTempo = DefaultTempo;
+	u64 nTempoTick = 0;
+	u64 nTempoMicros = 0;
+
+	for (const TTrackEvent& TrackEvent : TrackEvents)
+	{
+		const u64 nTicks = TrackEvent.nTick - nTempoTick;
+		const u64 nMicros = nTempoMicros + (bSMPTE ? nTicks * 1000000 / nTicksPerSecond : nTicks * nTempo / nTicksPerQuarterNote);
+
+		if (TrackEvent.nTempo)
+		{
+			nTempo = TrackEvent.nTempo;
+			nTempoTick = TrackEvent.nTick;
+			nTempoMicros = nMicros;
+			continue;
+		}
+
+		m_Events.push_back({ nMicros, TrackEvent.nOffset, TrackEvent.nSize });
+	}
+
+	LOGNOTE("Loaded '%s': format %d, %d tracks, %d events, %d seconds", pName, nFormat, nTracks, static_cast<int>(m_Events.size()), static_cast<int>(GetDurationMicros() / 1000000));
+	return true;
+}
+
+bool CMIDIFile::ParseTrack(const u8* pData, size_t nSize, std::vector<TTrackEvent>& OutEvents)
+{
+	const u8* const pEnd = pData + nSize;
+	u64 nTick = 0;
+	u8 nRunningStatus = 0;
+
+	while (pData < pEnd)
+	{
+		u32 nDelta;
+		if (!ReadVLQ(pData, pEnd, nDelta) || pData >= pEnd)
+			return false;
+
+		nTick += nDelta;
+
+		u8 nStatus = *pData;
+		if (nStatus & 0x80)
+			++pData;
+		else if (nRunningStatus)
+			nStatus = nRunningStatus;
+		else
+			return false;
+
+		// Meta event
+		if (nStatus == 0xFF)
+		{
+			u32 nLength;
+			if (pData >= pEnd)
+				return false;
+
+			const u8 nType = *pData++;
+			if (!ReadVLQ(pData, pEnd, nLength) || nLength > static_cast<size_t>(pEnd - pData))
+				return false;
+
+			if (nType == 0x51 && nLength == 3)
+				OutEvents.push_back({ nTick, 0, 0, ReadBE(pData, 3) });
+			else if (nType == 0x2F)
+				return true;
+
+			pData += nLength;
+			continue;
+		}
+
+		// SysEx (F0 <length> <data...>) or escaped raw bytes (F7 <length> <bytes...>)
+		if (nStatus == 0xF0 || nStatus == 0xF7)
+		{
+			u32 nLength;
+			if (!ReadVLQ(pData, pEnd, nLength) || nLength > static_cast<size_t>(pEnd - pData))
+				return false;
+
+			const size_t nOffset = m_Data.size();
+			if (nStatus == 0xF0)
+				m_Data.push_back(0xF0);
+			m_Data.insert(m_Data.end(), pData, pData + nLength);
+			OutEvents.push_back({ nTick, nOffset, m_Data.size() - nOffset, 0 });
+
+			// System Common messages cancel running status
+			nRunningStatus = 0;
+			pData += nLength;
+			continue;
+		}
+
+		const size_t nLength = CMIDIParser::GetShortMessageLength(nStatus);
+		if (!nLength || nLength - 1 > static_cast<size_t>(pEnd - pData))
+			return false;
+
+		if (nStatus < 0xF0)
+			nRunningStatus = nStatus;
+
+		const size_t nOffset = m_Data.size();
+		m_Data.push_back(nStatus);
+		m_Data.insert(m_Data.end(), pData, pData + nLength - 1);
+		OutEvents.push_back({ nTick, nOffset, nLength, 0 });
+
+		pData += nLength - 1;
+	}
+
+	return true;
+}
@@ -0,0 +1,151 @@
+//
+// midiinput.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/util.h>
+
+#include "midiinput.h"
+#include "utility.h"
+
+CMIDIInputParser::CMIDIInputParser(const char* pName, TMIDIMergeQueue& MergeQueue)
+	: CMIDIParser(),
+	  m_pName(pName),
+	  m_MergeQueue(MergeQueue),
+	  m_nChannelBank(0),
+	  m_nTimestamp(0),
+	  m_nErrors(0),
+	  m_nReceivedBytes(0),
+	  m_nReceivedMessages(0),
+
+	  m_pSysExBuffer(nullptr),
+	  m_nSysExBufferSize(0),
+	  m_nSysExLength(0),
+	  m_bSysExOverflow(false)
+{
+}
+
+CMIDIInputParser::~CMIDIInputParser()
+{
+	if (m_pSysExBuffer)
+		delete[] m_pSysExBuffer;
+}
+
+void CMIDIInputParser::ParseMIDIBytes(const u8* pData, size_t nSize, unsigned int nTimestamp, bool bIgnoreNoteOns)
+{
+	m_nTimestamp = nTimestamp;
+	m_nReceivedBytes += nSize;
+	CMIDIParser::ParseMIDIBytes(pData, nSize, bIgnoreNoteOns);
+}
+
+void CMIDIInputParser::ParseMIDIPacket(const u8* pData, size_t nSize, unsigned int nTimestamp, bool bIgnoreNoteOns)
+{
+	m_nTimestamp = nTimestamp;
+	m_nReceivedBytes += nSize;
+	CMIDIParser::ParseMIDIPacket(pData, nSize, bIgnoreNoteOns);
+}
+
+u8 CMIDIInputParser::TakeErrors()
+{
+	const u8 nErrors = m_nErrors;
+	m_nErrors = 0;
+	return nErrors;
+}
+
+void CMIDIInputParser::OnShortMessage(u32 nMessage)
+{
+	++m_nReceivedMessages;
+
+	// System messages are the same on every bank
+	if (m_nChannelBank && (nMessage & 0xFF) < 0xF0)
+		nMessage |= static_cast<u32>(m_nChannelBank) << 24;
+
+	if (!m_MergeQueue.EnqueueShortMessage(nMessage, m_nTimestamp))
+		m_nErrors |= QueueOverflow;
+}
+
+void CMIDIInputParser::OnSysExData(const u8* pData, size_t nSize)
+{
+	if (m_bSysExOverflow)
+		return;
+
+	const size_t nLength = m_nSysExLength + nSize;
+	if (nLength > SysExMaxSize)
+	{
+		OnSysExOverflow();
+		m_bSysExOverflow = true;
+		return;
+	}
+
+	// Grow the buffer, keeping what we have so far
+	if (nLength > m_nSysExBufferSize)
+	{
+		size_t nBufferSize = Utility::Max(m_nSysExBufferSize, SysExInitialBufferSize);
+		while (nBufferSize < nLength)
+			nBufferSize *= 2;
+
+		u8* pBuffer = new u8[nBufferSize];
+		if (m_pSysExBuffer)
+		{
+			memcpy(pBuffer, m_pSysExBuffer, m_nSysExLength);
+			delete[] m_pSysExBuffer;
+		}
+
+		m_pSysExBuffer = pBuffer;
+		m_nSysExBufferSize = nBufferSize;
+	}
+
+	memcpy(m_pSysExBuffer + m_nSysExLength, pData, nSize);
+	m_nSysExLength = nLength;
+}
+
+void CMIDIInputParser::OnSysExComplete()
+{
+	++m_nReceivedMessages;
+
+	if (!m_bSysExOverflow && !m_MergeQueue.EnqueueSysExMessage(m_pSysExBuffer, m_nSysExLength, m_nTimestamp))
+		m_nErrors |= QueueOverflow;
+
+	ResetSysEx();
+}
+
+void CMIDIInputParser::OnSysExAborted()
+{
+	ResetSysEx();
+}
+
+void CMIDIInputParser::OnUnexpectedStatus()
+{
+	CMIDIParser::OnUnexpectedStatus();
+	m_nErrors |= UnexpectedStatus;
+}
+
+void CMIDIInputParser::ResetSysEx()
+{
+	m_nSysExLength = 0;
+	m_bSysExOverflow = false;
+}
+
+void CMIDIInputParser::OnSysExOverflow()
+{
+	CMIDIParser::OnSysExOverflow();
+	m_nErrors |= SysExOverflow;
+}
@@ -30,12 +30,15 @@ CMIDIMonitor::CMIDIMonitor()
 {
 	for (auto& Channel : m_State)
 	{
+		for (auto& nMask : Channel.ActiveNotes)
+			nMask.store(0, std::memory_order_relaxed);
+
 		for (auto& Note : Channel.Notes)
 		{
-			Note.EnvelopePhase = TEnvelopePhase::Idle;
 			Note.nNoteOnTime = 0;
 			Note.nNoteOffTime = 0;
 			Note.nVelocity = 0;
+			Note.EnvelopePhase = TEnvelopePhase::Idle;
 			Note.bDamperFlag = false;
 		}
 	}
@@ -49,9 +52,10 @@ void CMIDIMonitor::OnShortMessage(u32 nMessage)
 	const u8 nChannel = nMessage & 0x0F;
 	const u8 nData1   = (nMessage >> 8) & 0xFF;
 	const u8 nData2   = (nMessage >> 16) & 0xFF;
+	const u8 nNote    = nData1 & 0x7F;
 
 	TChannelState& ChannelState = m_State[nChannel];
-	TNoteState& NoteState = ChannelState.Notes[nData1];
+	TNoteState& NoteState = ChannelState.Notes[nNote];
 	const unsigned int nTicks = CTimer::GetClockTicks();
 
 	switch (nStatus)
@@ -59,11 +63,7 @@ void CMIDIMonitor::OnShortMessage(u32 nMessage)
 		// Note off
 		case 0x80:
 			if (!NoteState.bDamperFlag)
-			{
-				NoteState.EnvelopePhase = TEnvelopePhase::NoteOff;
-				NoteState.nNoteOffTime = nTicks;
-			}
-
+				ReleaseNote(ChannelState, nNote, nTicks);
 			break;
 
 		// Note on
@@ -74,12 +74,10 @@ void CMIDIMonitor::OnShortMessage(u32 nMessage)
 				NoteState.nNoteOnTime = nTicks;
 				NoteState.nVelocity = nData2;
 				NoteState.bDamperFlag = ChannelState.nDamper;
+				SetActive(ChannelState, nNote);
 			}
 			else if (!NoteState.bDamperFlag)
-			{
-				NoteState.EnvelopePhase = TEnvelopePhase::NoteOff;
-				NoteState.nNoteOffTime = nTicks;
-			}
+				ReleaseNote(ChannelState, nNote, nTicks);
 			break;
 
 		// Control change
@@ -101,19 +99,41 @@ void CMIDIMonitor::GetChannelLevels(unsigned int nTicks, float* pOutLevels, floa
 {
 	for (size_t nChannel = 0; nChannel < ChannelCount; ++nChannel)
 	{
+		TChannelState& ChannelState = m_State[nChannel];
+		const unsigned int nNoteTicks = CTimer::GetClockTicks();
 		const bool bIsPercussionChannel = nPercussionBitMask & (1 << nChannel);
 		float nChannelVolume = 0.0f;
 
-		for (size_t nNote = 0; nNote < NoteCount; ++nNote)
+		// Only notes with unfinished envelopes can contribute
+		ForEachActiveNote(ChannelState, [&](u8 nNote)
 		{
-			TNoteState& NoteState = m_State[nChannel].Notes[nNote];
-			const float nEnvelope = bIsPercussionChannel ? ComputePercussionEnvelope(NoteState) : ComputeEnvelope(NoteState);
-			const float nNoteVolume = nEnvelope * (NoteState.nVelocity / 127.0f) * (m_State[nChannel].nVolume / 127.0f) * (m_State[nChannel].nExpression / 127.0f);
-			nChannelVolume = Utility::Max(nChannelVolume, nNoteVolume);
-		}
+			TNoteState& NoteState = ChannelState.Notes[nNote];
+			const float nEnvelope = bIsPercussionChannel ? ComputePercussionEnvelope(NoteState, nNoteTicks) : ComputeEnvelope(NoteState, nNoteTicks);
+
+			if (NoteState.EnvelopePhase == TEnvelopePhase::Idle)
+			{
+				ClearActive(ChannelState, nNote);
+
+				// Don't lose a note that was started again while we were clearing it
+				if (NoteState.EnvelopePhase != TEnvelopePhase::Idle)
+					SetActive(ChannelState, nNote);
+			}
+			else
+				nChannelVolume = Utility::Max(nChannelVolume, nEnvelope * NoteState.nVelocity);
+		});
+
+		nChannelVolume *= ChannelState.nVolume * ChannelState.nExpression / (127.0f * 127.0f * 127.0f);
+		pOutLevels[nChannel] = Utility::Clamp(nChannelVolume, 0.0f, 1.0f);
+	}
 
-		nChannelVolume = Utility::Clamp(nChannelVolume, 0.0f, 1.0f);
+	UpdatePeakLevels(nTicks, pOutLevels, pOutPeaks);
+}
 
+void CMIDIMonitor::UpdatePeakLevels(unsigned int nTicks, const float* pLevels, float* pOutPeaks)
+{
+	for (size_t nChannel = 0; nChannel < ChannelCount; ++nChannel)
+	{
+		const float nChannelVolume = pLevels[nChannel];
 		float nPeakLevel = m_PeakLevels[nChannel];
 		const float nPeakUpdatedMillis = Utility::TicksToMillis(nTicks - m_PeakTimes[nChannel]);
 
@@ -131,7 +151,6 @@ void CMIDIMonitor::GetChannelLevels(unsigned int nTicks, float* pOutLevels, floa
 			m_PeakTimes[nChannel] = nTicks;
 		}
 
-		pOutLevels[nChannel] = nChannelVolume;
 		pOutPeaks[nChannel] = nPeakLevel;
 	}
 }
@@ -142,8 +161,9 @@ void CMIDIMonitor::AllNotesOff()
 
 	for (auto& Channel : m_State)
 	{
-		for (auto& Note : Channel.Notes)
+		ForEachActiveNote(Channel, [&](u8 nNote)
 		{
+			TNoteState& Note = Channel.Notes[nNote];
 			if (Note.EnvelopePhase == TEnvelopePhase::NoteOn)
 			{
 				Note.EnvelopePhase = TEnvelopePhase::NoteOff;
@@ -151,7 +171,7 @@ void CMIDIMonitor::AllNotesOff()
 			}
 
 			Note.bDamperFlag = false;
-		}
+		});
 	}
 }
 
@@ -200,15 +220,16 @@ void CMIDIMonitor::ProcessCC(u8 nChannel, u8 nCC, u8 nValue, unsigned int nTicks
 			// Damper released; trigger note-off for flagged notes
 			if (!nValue)
 			{
-				for (auto& Note : ChannelState.Notes)
+				ForEachActiveNote(ChannelState, [&](u8 nNote)
 				{
+					TNoteState& Note = ChannelState.Notes[nNote];
 					if (Note.bDamperFlag)
 					{
 						Note.EnvelopePhase = TEnvelopePhase::NoteOff;
 						Note.nNoteOffTime = nTicks;
 						Note.bDamperFlag = false;
 					}
-				}
+				});
 			}
 			break;
 
@@ -233,14 +254,21 @@ void CMIDIMonitor::ProcessCC(u8 nChannel, u8 nCC, u8 nValue, unsigned int nTicks
 	}
 }
 
-float CMIDIMonitor::ComputeEnvelope(TNoteState& NoteState) const
+void CMIDIMonitor::ReleaseNote(TChannelState& ChannelState, u8 nNote, unsigned int nTicks)
+{
+	TNoteState& NoteState = ChannelState.Notes[nNote];
+	NoteState.EnvelopePhase = TEnvelopePhase::NoteOff;
+	NoteState.nNoteOffTime = nTicks;
+	SetActive(ChannelState, nNote);
+}
+
+float CMIDIMonitor::ComputeEnvelope(TNoteState& NoteState, unsigned int nTicks) const
 {
 	switch (NoteState.EnvelopePhase)
 	{
 		// Note is on
 		case TEnvelopePhase::NoteOn:
 		{
-			const unsigned int nTicks = CTimer::GetClockTicks();
 			const float nNoteOnDurationMillis = Utility::TicksToMillis(nTicks - NoteState.nNoteOnTime);
 
 			// Attack phase
@@ -276,7 +304,6 @@ float CMIDIMonitor::ComputeEnvelope(TNoteState& NoteState) const
 			else
 				nVolume = SustainLevel;
 
-			const unsigned int nTicks = CTimer::GetClockTicks();
 			const float nNoteOffDurationMillis = Utility::TicksToMillis(nTicks - NoteState.nNoteOffTime);
 
 			// Envelope is complete
@@ -295,12 +322,11 @@ float CMIDIMonitor::ComputeEnvelope(TNoteState& NoteState) const
 	}
 }
 
-float CMIDIMonitor::ComputePercussionEnvelope(TNoteState& NoteState) const
+float CMIDIMonitor::ComputePercussionEnvelope(TNoteState& NoteState, unsigned int nTicks) const
 {
 	if (NoteState.EnvelopePhase == TEnvelopePhase::Idle)
 		return 0.0f;
 
-	const unsigned int nTicks = CTimer::GetClockTicks();
 	const float nNoteOnDurationMillis = Utility::TicksToMillis(nTicks - NoteState.nNoteOnTime);
 
 	// Envelope is complete
@@ -35,6 +35,9 @@ CMIDIParser::CMIDIParser()
 
 void CMIDIParser::ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNoteOns)
 {
+	// Start of the SysEx bytes in pData that haven't been passed on yet
+	size_t nSysExStart = 0;
+
 	// Process MIDI messages
 	// See: https://www.midi.org/specifications/item/table-1-summary-of-midi-message
 	for (size_t i = 0; i < nSize; ++i)
@@ -45,6 +48,14 @@ void CMIDIParser::ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNote
 		// Can appear anywhere in the stream, even in between status/data bytes
 		if (nByte >= 0xF8)
 		{
+			// Split the SysEx around it
+			if (m_State == TState::SysExByte)
+			{
+				if (i > nSysExStart)
+					OnSysExData(pData + nSysExStart, i - nSysExStart);
+				nSysExStart = i + 1;
+			}
+
 			// Ignore undefined System Real-Time
 			if (nByte != 0xF9 && nByte != 0xFD)
 				OnShortMessage(nByte);
@@ -80,32 +91,75 @@ void CMIDIParser::ParseMIDIBytes(const u8* pData, size_t nSize, bool bIgnoreNote
 				if (nByte & 0x80 && nByte != 0xF7)
 				{
 					OnUnexpectedStatus();
+					OnSysExAborted();
 					ResetState(true);
 					ParseStatusByte(nByte);
 					break;
 				}
 
-				// Buffer overflow
-				if (m_nMessageLength == sizeof(m_MessageBuffer))
-				{
-					OnSysExOverflow();
-					ResetState(true);
-					ParseStatusByte(nByte);
-					break;
-				}
-
-				m_MessageBuffer[m_nMessageLength++] = nByte;
-
 				// End of SysEx
 				if (nByte == 0xF7)
 				{
-					OnSysExMessage(m_MessageBuffer, m_nMessageLength);
+					OnSysExData(pData + nSysExStart, i + 1 - nSysExStart);
+					OnSysExComplete();
 					ResetState(true);
 				}
 
-				break;
+				continue;
 		}
+
+		// Start of SysEx
+		if (m_State == TState::SysExByte)
+			nSysExStart = i;
 	}
+
+	// Pass on the rest of an incomplete SysEx
+	if (m_State == TState::SysExByte && nSize > nSysExStart)
+		OnSysExData(pData + nSysExStart, nSize - nSysExStart);
+}
+
+void CMIDIParser::ParseMIDIPacket(const u8* pData, size_t nSize, bool bIgnoreNoteOns)
+{
+	// A USB-MIDI event packet holds either one complete message, or part of a SysEx message;
+	// complete messages can be dispatched directly unless we're in the middle of a SysEx
+	if (nSize && m_State != TState::SysExByte)
+	{
+		const u8 nStatus = pData[0];
+		const size_t nLength = GetShortMessageLength(nStatus);
+
+		if (nLength && nLength == nSize)
+		{
+			const bool bIsNoteOn = (nStatus & 0xF0) == 0x90;
+
+			if (!(bIsNoteOn && bIgnoreNoteOns))
+			{
+				u32 nMessage = 0;
+				for (size_t i = 0; i < nLength; ++i)
+					nMessage |= pData[i] << 8 * i;
+
+				OnShortMessage(nMessage);
+			}
+
+			return;
+		}
+	}
+
+	// SysEx packets, System Real-Time and anything malformed go through the byte parser
+	ParseMIDIBytes(pData, nSize, bIgnoreNoteOns);
+}
+
+size_t CMIDIParser::GetShortMessageLength(u8 nStatus)
+{
+	if (nStatus >= 0x80 && nStatus <= 0xEF)
+		return (nStatus >= 0xC0 && nStatus <= 0xDF) ? 2 : 3;
+
+	if (nStatus == 0xF1 || nStatus == 0xF3)
+		return 2;
+
+	if (nStatus == 0xF2)
+		return 3;
+
+	return 0;
 }
 
 void CMIDIParser::OnUnexpectedStatus()
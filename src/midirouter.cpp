@@ -0,0 +1,276 @@
+//
+// midirouter.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include <cstring>
+
+#include "config.h"
+#include "midirouter.h"
+
+LOGMODULE("midirouter");
+
+CONFIG_ENUM_STRINGS(TInput, ENUM_MIDIROUTEINPUT);
+CONFIG_ENUM_STRINGS(TOutput, ENUM_MIDIROUTEOUTPUT);
+
+CMIDIRouter::CMIDIRouter(CSerialDevice* pSerialDevice)
+	: m_pSerialDevice(pSerialDevice),
+	  m_RouteMasks{0},
+	  m_Stats{},
+	  m_USBSerialQueueLock(IRQ_LEVEL)
+{
+	for (size_t nInput = 0; nInput < InputCount; ++nInput)
+		m_InputMergers[nInput].Initialize(this, nInput);
+}
+
+void CMIDIRouter::AddRoutes(const char* pRoutes)
+{
+	char Buffer[256];
+	strncpy(Buffer, pRoutes, sizeof(Buffer) - 1);
+	Buffer[sizeof(Buffer) - 1] = '\0';
+
+	char* pSavePtr;
+	for (char* pEntry = strtok_r(Buffer, " ,", &pSavePtr); pEntry; pEntry = strtok_r(nullptr, " ,", &pSavePtr))
+	{
+		char* pFieldSavePtr;
+		const char* pInput = strtok_r(pEntry, ":", &pFieldSavePtr);
+		const char* pOutput = strtok_r(nullptr, ":", &pFieldSavePtr);
+
+		TInput Input;
+		TOutput Output;
+
+		if (!pOutput || !CConfig::ParseOption(pInput, &Input) || !CConfig::ParseOption(pOutput, &Output))
+		{
+			LOGWARN("Invalid MIDI route \"%s\"", pInput);
+			continue;
+		}
+
+		AddRoute(Input, Output);
+	}
+}
+
+void CMIDIRouter::AddRoute(TInput Input, TOutput Output)
+{
+	const size_t nInput = static_cast<size_t>(Input);
+	const size_t nOutput = static_cast<size_t>(Output);
+
+	if (m_RouteMasks[nInput] & (1 << nOutput))
+		return;
+
+	m_RouteMasks[nInput] |= 1 << nOutput;
+	LOGNOTE("MIDI route: %s -> %s", TInputStrings[nInput], TOutputStrings[nOutput]);
+}
+
+bool CMIDIRouter::Forward(TInput Input, const u8* pData, size_t nSize, unsigned int nTimestamp)
+{
+	const size_t nInput = static_cast<size_t>(Input);
+
+	if (!m_RouteMasks[nInput] || !nSize)
+		return true;
+
+	return m_InputMergers[nInput].Forward(pData, nSize, nTimestamp);
+}
+
+// Called by the input merger with a complete message
+bool CMIDIRouter::ForwardMessage(size_t nInput, const u8* pData, size_t nSize, unsigned int nTimestamp)
+{
+	const u8 nMask = m_RouteMasks[nInput];
+	bool bSuccess = true;
+
+	// The UART's transmit buffer can be written from any context, and takes the whole message in one go
+	if (nMask & (1 << static_cast<size_t>(TOutput::GPIO)))
+	{
+		const int nResult = m_pSerialDevice->Write(pData, nSize);
+		const size_t nSent = nResult > 0 ? static_cast<size_t>(nResult) : 0;
+		UpdateStats(nInput, TOutput::GPIO, nSent, nSize - nSent, nTimestamp);
+		bSuccess &= nSent == nSize;
+	}
+
+	// USB transfers have to be made from the main task
+	if (nMask & (1 << static_cast<size_t>(TOutput::USBSerial)))
+	{
+		TQueuedData Data;
+		Data.nTimestamp = nTimestamp;
+		Data.nInput = nInput;
+
+		const size_t nChunks = (nSize + sizeof(Data.Data) - 1) / sizeof(Data.Data);
+
+		m_USBSerialQueueLock.Acquire();
+
+		if (m_USBSerialQueue.GetFreeCount() >= nChunks)
+		{
+			for (size_t nOffset = 0; nOffset < nSize; nOffset += Data.nSize)
+			{
+				Data.nSize = Utility::Min(nSize - nOffset, sizeof(Data.Data));
+				memcpy(Data.Data, pData + nOffset, Data.nSize);
+				m_USBSerialQueue.Enqueue(Data);
+			}
+		}
+		else
+		{
+			UpdateStats(nInput, TOutput::USBSerial, 0, nSize, nTimestamp);
+			bSuccess = false;
+		}
+
+		m_USBSerialQueueLock.Release();
+	}
+
+	return bSuccess;
+}
+
+// Called by the input merger with a message that can't be forwarded
+void CMIDIRouter::DropMessage(size_t nInput, size_t nSize, unsigned int nTimestamp)
+{
+	for (size_t nOutput = 0; nOutput < OutputCount; ++nOutput)
+	{
+		if (m_RouteMasks[nInput] & (1 << nOutput))
+			UpdateStats(nInput, static_cast<TOutput>(nOutput), 0, nSize, nTimestamp);
+	}
+}
+
+void CMIDIRouter::Update(CUSBSerialDevice* pUSBSerialDevice)
+{
+	TQueuedData Data;
+
+	while (m_USBSerialQueue.Dequeue(Data))
+	{
+		const int nResult = pUSBSerialDevice ? pUSBSerialDevice->Write(Data.Data, Data.nSize) : 0;
+		const size_t nSent = nResult > 0 ? static_cast<size_t>(nResult) : 0;
+		UpdateStats(Data.nInput, TOutput::USBSerial, nSent, Data.nSize - nSent, Data.nTimestamp);
+	}
+}
+
+void CMIDIRouter::DumpStats() const
+{
+	for (size_t nInput = 0; nInput < InputCount; ++nInput)
+	{
+		for (size_t nOutput = 0; nOutput < OutputCount; ++nOutput)
+		{
+			if (!(m_RouteMasks[nInput] & (1 << nOutput)))
+				continue;
+
+			const TRouteStats& Stats = m_Stats[nInput][nOutput];
+			LOGNOTE("MIDI route %s -> %s: %d bytes, %d dropped, peak latency %dus",
+				TInputStrings[nInput],
+				TOutputStrings[nOutput],
+				Stats.nForwardedBytes.load(std::memory_order_relaxed),
+				Stats.nDroppedBytes.load(std::memory_order_relaxed),
+				Stats.nPeakLatencyMicros.load(std::memory_order_relaxed)
+			);
+		}
+	}
+}
+
+void CMIDIRouter::ResetStats()
+{
+	for (auto& InputStats : m_Stats)
+	{
+		for (TRouteStats& Stats : InputStats)
+		{
+			Stats.nForwardedBytes.store(0, std::memory_order_relaxed);
+			Stats.nDroppedBytes.store(0, std::memory_order_relaxed);
+			Stats.nPeakLatencyMicros.store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+void CMIDIRouter::UpdateStats(size_t nInput, TOutput Output, size_t nForwarded, size_t nDropped, unsigned int nTimestamp)
+{
+	TRouteStats& Stats = m_Stats[nInput][static_cast<size_t>(Output)];
+	Stats.nForwardedBytes.fetch_add(nForwarded, std::memory_order_relaxed);
+	Stats.nDroppedBytes.fetch_add(nDropped, std::memory_order_relaxed);
+
+	// CTimer clock ticks are microseconds
+	const unsigned int nLatency = CTimer::GetClockTicks() - nTimestamp;
+	if (nLatency > Stats.nPeakLatencyMicros.load(std::memory_order_relaxed))
+		Stats.nPeakLatencyMicros.store(nLatency, std::memory_order_relaxed);
+}
+
+CMIDIRouter::CInputMerger::CInputMerger()
+	: CMIDIParser(),
+	  m_pRouter(nullptr),
+	  m_nInput(0),
+	  m_nTimestamp(0),
+	  m_bSuccess(true),
+
+	  m_SysExBuffer{},
+	  m_nSysExSize(0),
+	  m_bSysExOverflow(false)
+{
+}
+
+void CMIDIRouter::CInputMerger::Initialize(CMIDIRouter* pRouter, size_t nInput)
+{
+	m_pRouter = pRouter;
+	m_nInput = nInput;
+}
+
+bool CMIDIRouter::CInputMerger::Forward(const u8* pData, size_t nSize, unsigned int nTimestamp)
+{
+	m_nTimestamp = nTimestamp;
+	m_bSuccess = true;
+	ParseMIDIBytes(pData, nSize);
+
+	return m_bSuccess;
+}
+
+void CMIDIRouter::CInputMerger::OnShortMessage(u32 nMessage)
+{
+	// Always sent with its status byte, as running status can't carry across a merge
+	const u8 Bytes[] = { static_cast<u8>(nMessage), static_cast<u8>(nMessage >> 8), static_cast<u8>(nMessage >> 16) };
+	const size_t nLength = Utility::Max(CMIDIParser::GetShortMessageLength(Bytes[0]), static_cast<size_t>(1));
+	m_bSuccess &= m_pRouter->ForwardMessage(m_nInput, Bytes, nLength, m_nTimestamp);
+}
+
+void CMIDIRouter::CInputMerger::OnSysExData(const u8* pData, size_t nSize)
+{
+	if (m_nSysExSize + nSize > MaxSysExSize)
+		m_bSysExOverflow = true;
+	else if (!m_bSysExOverflow)
+		memcpy(m_SysExBuffer + m_nSysExSize, pData, nSize);
+
+	m_nSysExSize += nSize;
+}
+
+void CMIDIRouter::CInputMerger::OnSysExComplete()
+{
+	if (m_bSysExOverflow)
+	{
+		m_pRouter->DropMessage(m_nInput, m_nSysExSize, m_nTimestamp);
+		m_bSuccess = false;
+	}
+	else
+		m_bSuccess &= m_pRouter->ForwardMessage(m_nInput, m_SysExBuffer, m_nSysExSize, m_nTimestamp);
+
+	m_nSysExSize = 0;
+	m_bSysExOverflow = false;
+}
+
+void CMIDIRouter::CInputMerger::OnSysExAborted()
+{
+	m_pRouter->DropMessage(m_nInput, m_nSysExSize, m_nTimestamp);
+	m_nSysExSize = 0;
+	m_bSysExOverflow = false;
+}
@@ -22,30 +22,47 @@
 
 #include <circle/memory.h>
 #include <circle/serial.h>
-#include <circle/sound/hdmisoundbasedevice.h>
-#include <circle/sound/i2ssoundbasedevice.h>
-#include <circle/sound/pwmsoundbasedevice.h>
 
 #include <cstdarg>
+#include <cstdio>
 
+#include "audioconvert.h"
+#include "bootprofiler.h"
+#include "cpuload.h"
+#include "filesystemlock.h"
+#include "latencycontroller.h"
 #include "lcd/drivers/hd44780.h"
 #include "lcd/drivers/ssd1306.h"
 #include "lcd/ui.h"
 #include "mt32pi.h"
+#include "renderbenchmark.h"
+#include "tracer.h"
 
 #define MT32_PI_NAME "mt32-pi"
 LOGMODULE(MT32_PI_NAME);
 const char MT32PiFullName[] = MT32_PI_NAME " " MT32_PI_VERSION;
 
+const char ConfigFile[]       = "SD:mt32-pi.cfg";
 const char WLANFirmwarePath[] = "SD:firmware/";
 const char WLANConfigFile[]   = "SD:wpa_supplicant.conf";
+const char MemoryStatsFile[]  = "SD:memstats.txt";
+const char BootProfileFile[]  = "SD:boottime.txt";
+const char BenchmarkPath[]    = "SD:/benchmark";
+const char BenchmarkFile[]    = "SD:benchmark.csv";
+const char TraceFile[]        = "SD:trace.bin";
+const char SDCapturePath[]    = "SD:captures";
+const char USBCapturePath[]   = "USB:captures";
 
 constexpr u32 LCDUpdatePeriodMillis                = 16;
+constexpr u32 PerformanceStatsPeriodMillis         = 500;
+constexpr size_t LCDTransferChunkBytes             = 128;
 constexpr u32 MisterUpdatePeriodMillis             = 50;
+constexpr unsigned int UIWakeupPeriodMicros        = 100;
+constexpr unsigned int MainWakeupPeriodMicros      = 100;
+constexpr unsigned int PowerSaveWakeupPeriodMicros = 5000;
 constexpr u32 LEDTimeoutMillis                     = 50;
 constexpr u32 ActiveSenseTimeoutMillis             = 330;
 
-constexpr float Sample24BitMax = (1 << 24 - 1) - 1;
 
 enum class TCustomSysExCommand : u8
 {
@@ -54,13 +71,21 @@ enum class TCustomSysExCommand : u8
 	SwitchSoundFont       = 0x02,
 	SwitchSynth           = 0x03,
 	SetMT32ReversedStereo = 0x04,
+	RenderStats           = 0x05,
+	MemoryStats           = 0x06,
+	Trace                 = 0x07,
+	PerformancePage       = 0x08,
+	MIDICapture           = 0x09,
+	ReloadConfig          = 0x0A,
 };
 
 CMT32Pi* CMT32Pi::s_pThis = nullptr;
 
+// Keep the AppleMIDI parser initializers in the constructor in step with the session count
+static_assert(CAppleMIDIParticipant::MaxSessions == 4, "One AppleMIDI parser must be initialized per session");
+
 CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSystem* pInterrupt, CGPIOManager* pGPIOManager, CSerialDevice* pSerialDevice, CUSBHCIDevice* pUSBHCI)
 	: CMultiCoreSupport(CMemorySystem::Get()),
-	  CMIDIParser(),
 
 	  m_pConfig(CConfig::Get()),
 
@@ -84,14 +109,17 @@ CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSyste
 	  m_pAppleMIDIParticipant(nullptr),
 	  m_pUDPMIDIReceiver(nullptr),
 	  m_pFTPDaemon(nullptr),
+	  m_pHTTPDaemon(nullptr),
+	  m_pPCMStreamer(nullptr),
 
 	  m_pLCD(nullptr),
 	  m_nLCDUpdateTime(0),
-#ifdef MONITOR_TEMPERATURE
-	  m_nTempUpdateTime(0),
-#endif
+	  m_nPerformanceStatsTime(0),
 
 	  m_pControl(nullptr),
+	  m_bVolumeDownHeld(false),
+	  m_bVolumeUpHeld(false),
+	  m_nVolumeBeforeCombo(0),
 	  m_MisterControl(pI2CMaster, m_EventQueue),
 	  m_nMisterUpdateTime(0),
 
@@ -101,25 +129,74 @@ CMT32Pi::CMT32Pi(CI2CMaster* pI2CMaster, CSPIMaster* pSPIMaster, CInterruptSyste
 
 	  m_bSerialMIDIAvailable(false),
 	  m_bSerialMIDIEnabled(false),
+	  m_SerialMIDITimer(pInterrupt, SerialMIDITimerHandler, this),
+	  m_bSerialMIDITimerRunning(false),
+	  m_nSerialMIDIPollMicros(0),
+	  m_nSerialMIDIError(0),
+	  m_bSerialMIDIThruError(false),
 	  m_pUSBMIDIDevice(nullptr),
 	  m_pUSBSerialDevice(nullptr),
 	  m_pUSBMassStorageDevice(nullptr),
+	  m_pStorageScanner(nullptr),
+
+	  m_nMIDITimestamp(0),
 
 	  m_bActiveSenseFlag(false),
 	  m_nActiveSenseTime(0),
 
 	  m_bRunning(true),
 	  m_bUITaskDone(false),
+	  m_bAudioTaskDone(false),
 	  m_bLEDOn(false),
 	  m_nLEDOnTime(0),
 
 	  m_pSound(nullptr),
+	  m_nAudioChunkFrames(0),
+	  m_nReportedUnderruns(0),
 	  m_pPisound(nullptr),
 
 	  m_nMasterVolume(100),
 	  m_pCurrentSynth(nullptr),
 	  m_pMT32Synth(nullptr),
-	  m_pSoundFontSynth(nullptr)
+	  m_pSoundFontSynth(nullptr),
+
+	  m_bLayeredSynths(false),
+	  m_nLayeredMT32ChannelMask(0),
+	  m_pLayerBuffer(nullptr),
+	  m_nLayerRenderFrames(0),
+	  m_nLayerRenderRequest(0),
+	  m_nLayerRenderDone(0),
+
+	  m_bMirrorMIDIState(false),
+	  m_pFadeOutSynth(nullptr),
+
+	  m_bParallelBoot(false),
+	  m_pPendingMT32Synth(nullptr),
+	  m_pPendingSoundFontSynth(nullptr),
+	  m_bPendingSynthReady(false),
+	  m_bBootComplete(false),
+
+	  m_bNetworkMIDIOverflow(false),
+	  m_pMIDICapture(nullptr),
+
+	  m_SerialMIDIParser("serial", m_MIDIMergeQueue),
+	  m_USBSerialMIDIParser("USB serial", m_MIDIMergeQueue),
+	  m_USBMIDIParsers
+	  {
+		  { "USB", m_MIDIMergeQueue },
+		  { "USB port 2", m_MIDIMergeQueue },
+	  },
+	  m_RxBufferMIDIParser("Pisound", m_MIDIMergeQueue),
+	  m_AppleMIDIParsers
+	  {
+		  { "AppleMIDI 1", m_MIDIMergeQueue },
+		  { "AppleMIDI 2", m_MIDIMergeQueue },
+		  { "AppleMIDI 3", m_MIDIMergeQueue },
+		  { "AppleMIDI 4", m_MIDIMergeQueue },
+	  },
+	  m_UDPMIDIParser("UDP", m_MIDIMergeQueue),
+
+	  m_MIDIRouter(pSerialDevice)
 {
 	s_pThis = this;
 }
@@ -130,9 +207,14 @@ CMT32Pi::~CMT32Pi()
 
 bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 {
+	CBootProfiler::CStep Step("mt32pi");
+
 	m_bSerialMIDIAvailable = bSerialMIDIAvailable;
 	m_bSerialMIDIEnabled = bSerialMIDIAvailable;
 
+	CTracer::Initialize(m_pConfig->SystemTrace);
+
+	size_t nStep = CBootProfiler::Begin("lcd");
 	switch (m_pConfig->LCDType)
 	{
 		case CConfig::TLCDType::HD44780FourBit:
@@ -177,32 +259,40 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 			m_pLCD = nullptr;
 		}
 	}
+	CBootProfiler::End(nStep);
 
-#if !defined(__aarch64__) || !defined(LEAVE_QEMU_ON_HALT)
-	// The USB driver is not supported under 64-bit QEMU, so
-	// the initialization must be skipped in this case, or an
-	// exit happens here under 64-bit QEMU.
-	LCDLog(TLCDLogType::Startup, "Init USB");
-	if (m_pConfig->SystemUSB && m_pUSBHCI->Initialize())
+	// Nothing else is running yet, so the benchmark has the CPU to itself
+	if (m_pConfig->SystemBenchmark)
+		RunBenchmark();
+
+	// The second USB-MIDI port addresses parts 17-32 of the SoundFont synth
+	if (m_pConfig->MIDIUSBPorts >= 2)
+		m_USBMIDIParsers[1].SetChannelBank(1);
+
+	// With parallel boot, USB and networking are brought up by the main task once audio has started
+	if (!m_pConfig->SystemParallelBoot)
 	{
-		m_bUSBAvailable = true;
+		LCDLog(TLCDLogType::Startup, "Init USB");
+		if (InitUSB())
+		{
+			// Perform an initial Plug and Play update to initialize devices early
+			UpdateUSB(true);
+		}
 
-		// Perform an initial Plug and Play update to initialize devices early
-		UpdateUSB(true);
+		LCDLog(TLCDLogType::Startup, "Init Network");
+		InitNetwork();
 	}
-#endif
-
-	LCDLog(TLCDLogType::Startup, "Init Network");
-	InitNetwork();
 
 	// Check for Blokas Pisound, but only when not using 4-bit HD44780 (GPIO pin conflict)
 	if (m_pConfig->LCDType != CConfig::TLCDType::HD44780FourBit)
 	{
+		CBootProfiler::CStep PisoundStep("pisound");
+
 		m_pPisound = new CPisound(m_pSPIMaster, m_pGPIOManager, m_pConfig->AudioSampleRate);
 		if (m_pPisound->Initialize())
 		{
 			LOGWARN("Blokas Pisound detected");
-			m_pPisound->RegisterMIDIReceiveHandler(IRQMIDIReceiveHandler);
+			m_pPisound->RegisterMIDIReceiveHandler(PisoundMIDIReceiveHandler);
 			m_bSerialMIDIEnabled = false;
 		}
 		else
@@ -212,15 +302,32 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 		}
 	}
 
+	m_MIDIRouter.AddRoutes(m_pConfig->MIDIThruRoutes);
+	if (m_pConfig->MIDIGPIOThru)
+		m_MIDIRouter.AddRoute(CMIDIRouter::TInput::GPIO, CMIDIRouter::TOutput::GPIO);
+
+	// Poll the UART once per byte time (10 bits per byte); fall back to polling from the main loop
+	if (m_bSerialMIDIAvailable)
+	{
+		m_nSerialMIDIPollMicros = Utility::Max(10 * 1000000 / Utility::Max(m_pConfig->MIDIGPIOBaudRate, 1), 50);
+		if (m_SerialMIDITimer.Initialize())
+		{
+			m_bSerialMIDITimerRunning = true;
+			m_SerialMIDITimer.Start(m_nSerialMIDIPollMicros);
+		}
+		else
+			LOGWARN("Couldn't start serial MIDI timer; polling from main loop");
+	}
+
 	// Queue size of just one chunk
+	nStep = CBootProfiler::Begin("audio");
 	unsigned int nQueueSize = m_pConfig->AudioChunkSize;
-	TSoundFormat Format = TSoundFormat::SoundFormatSigned24;
 
 	switch (m_pConfig->AudioOutputDevice)
 	{
 		case CConfig::TAudioOutputDevice::PWM:
 			LCDLog(TLCDLogType::Startup, "Init audio (PWM)");
-			m_pSound = new CPWMSoundBaseDevice(m_pInterrupt, m_pConfig->AudioSampleRate, m_pConfig->AudioChunkSize);
+			m_pSound = new CPWMSoundOutput(m_SoundOutputRing, m_pInterrupt, m_pConfig->AudioSampleRate, m_pConfig->AudioChunkSize);
 			break;
 
 		case CConfig::TAudioOutputDevice::HDMI:
@@ -231,7 +338,7 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 			const unsigned int nChunkSize = Utility::RoundToNearestMultiple(m_pConfig->AudioChunkSize, IEC958_SUBFRAMES_PER_BLOCK);
 			nQueueSize = nChunkSize;
 
-			m_pSound = new CHDMISoundBaseDevice(m_pInterrupt, m_pConfig->AudioSampleRate, nChunkSize);
+			m_pSound = new CHDMISoundOutput(m_SoundOutputRing, m_pInterrupt, m_pConfig->AudioSampleRate, nChunkSize);
 			break;
 		}
 
@@ -245,22 +352,26 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 			// Don't probe if using Pisound
 			CI2CMaster* const pI2CMaster = bSlave ? nullptr : m_pI2CMaster;
 
-			m_pSound = new CI2SSoundBaseDevice(m_pInterrupt, m_pConfig->AudioSampleRate, m_pConfig->AudioChunkSize, bSlave, pI2CMaster);
-			Format = TSoundFormat::SoundFormatSigned24_32;
-
+			m_pSound = new CI2SSoundOutput(m_SoundOutputRing, m_pInterrupt, m_pConfig->AudioSampleRate, m_pConfig->AudioChunkSize, bSlave, pI2CMaster);
 			break;
 		}
 	}
 
-	m_pSound->SetWriteFormat(Format);
-	if (!m_pSound->AllocateQueueFrames(nQueueSize))
+	// Adaptive latency varies how much of a larger queue is kept filled, in steps of one chunk
+	m_nAudioChunkFrames = nQueueSize;
+	if (m_pConfig->AudioAdaptiveLatency)
+		nQueueSize = Utility::Max(Utility::RoundToNearestMultiple(static_cast<unsigned int>(m_pConfig->AudioMaxChunkSize), nQueueSize), nQueueSize);
+
+	if (!m_SoundOutputRing.Allocate(nQueueSize))
 		LOGPANIC("Failed to allocate sound queue");
+	CBootProfiler::End(nStep);
 
 	LCDLog(TLCDLogType::Startup, "Init controls");
+	nStep = CBootProfiler::Begin("controls");
 	if (m_pConfig->ControlScheme == CConfig::TControlScheme::SimpleButtons)
-		m_pControl = new CControlSimpleButtons(m_EventQueue);
+		m_pControl = new CControlSimpleButtons(m_EventQueue, m_pGPIOManager);
 	else if (m_pConfig->ControlScheme == CConfig::TControlScheme::SimpleEncoder)
-		m_pControl = new CControlSimpleEncoder(m_EventQueue, m_pConfig->ControlEncoderType, m_pConfig->ControlEncoderReversed);
+		m_pControl = new CControlSimpleEncoder(m_EventQueue, m_pGPIOManager, m_pConfig->ControlEncoderType, m_pConfig->ControlEncoderReversed);
 
 	if (m_pControl && !m_pControl->Initialize())
 	{
@@ -268,19 +379,58 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 		delete m_pControl;
 		m_pControl = nullptr;
 	}
+	CBootProfiler::End(nStep);
 
-	LCDLog(TLCDLogType::Startup, "Init mt32emu");
-	InitMT32Synth();
-
-	LCDLog(TLCDLogType::Startup, "Init FluidSynth");
-	InitSoundFontSynth();
+	// The default synth is initialized first
+	const bool bMT32Default = m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::MT32;
+	if (bMT32Default)
+	{
+		LCDLog(TLCDLogType::Startup, "Init mt32emu");
+		InitMT32Synth();
+	}
+	else
+	{
+		LCDLog(TLCDLogType::Startup, "Init FluidSynth");
+		InitSoundFontSynth();
+	}
 
 	// Set initial synthesizer
-	if (m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::MT32)
+	if (bMT32Default)
 		m_pCurrentSynth = m_pMT32Synth;
-	else if (m_pConfig->SystemDefaultSynth == CConfig::TSystemDefaultSynth::SoundFont)
+	else
 		m_pCurrentSynth = m_pSoundFontSynth;
 
+	// Core 3 can initialize the other synth while the default synth plays, unless it's needed for rendering from the start
+	if (m_pConfig->SystemParallelBoot)
+	{
+		m_bParallelBoot = m_pCurrentSynth && !m_pConfig->SystemLayeredSynths && !HasRenderWorker();
+		if (!m_bParallelBoot)
+		{
+			LOGWARN("Parallel boot not possible; initializing sequentially");
+
+			LCDLog(TLCDLogType::Startup, "Init USB");
+			if (InitUSB())
+				UpdateUSB(true);
+
+			LCDLog(TLCDLogType::Startup, "Init Network");
+			InitNetwork();
+		}
+	}
+
+	if (!m_bParallelBoot)
+	{
+		if (bMT32Default)
+		{
+			LCDLog(TLCDLogType::Startup, "Init FluidSynth");
+			InitSoundFontSynth();
+		}
+		else
+		{
+			LCDLog(TLCDLogType::Startup, "Init mt32emu");
+			InitMT32Synth();
+		}
+	}
+
 	if (!m_pCurrentSynth)
 	{
 		LOGERR("Preferred synth failed to initialize successfully");
@@ -297,6 +447,12 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 		}
 	}
 
+	if (!m_bParallelBoot)
+	{
+		ConfigureSynths();
+		m_bBootComplete.store(true, std::memory_order_release);
+	}
+
 	if (m_pPisound)
 		LOGNOTE("Using Pisound MIDI interface");
 	else if (m_bSerialMIDIEnabled)
@@ -304,6 +460,10 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 
 	CCPUThrottle::Get()->DumpStatus();
 	SetPowerSaveTimeout(m_pConfig->SystemPowerSaveTimeout);
+	SetClockGovernor(m_pConfig->SystemClockGovernor);
+
+	if (m_pConfig->MIDICapture)
+		StartMIDICapture();
 
 	// Clear LCD
 	if (m_pLCD)
@@ -313,23 +473,90 @@ bool CMT32Pi::Initialize(bool bSerialMIDIAvailable)
 	m_pSound->Start();
 
 	// Start other cores
+	CBootProfiler::CStep CoresStep("cores");
 	if (!CMultiCoreSupport::Initialize())
 		return false;
 
 	return true;
 }
 
+void CMT32Pi::ConfigureSynths()
+{
+	if (m_pConfig->SystemLayeredSynths)
+	{
+		if (m_pMT32Synth && m_pSoundFontSynth)
+		{
+			// Channels used by the MT-32 parts are routed to mt32emu; everything else goes to FluidSynth
+			m_bLayeredSynths = true;
+			m_nLayeredMT32ChannelMask = m_pConfig->MT32EmuMIDIChannels == CMT32Synth::TMIDIChannels::Alternate ? 0x02FF : 0x03FE;
+			LOGNOTE("Layered synth mode enabled");
+		}
+		else
+			LOGWARN("Layered synth mode requires both synths; disabled");
+	}
+
+	if (m_pConfig->SystemMirrorMIDIState && !m_bLayeredSynths && m_pMT32Synth && m_pSoundFontSynth)
+	{
+		m_bMirrorMIDIState = true;
+		LOGNOTE("MIDI state mirroring enabled");
+	}
+
+	// Core 3 renders any additional MT-32 instances unless it is busy with layered mode
+	if (m_pMT32Synth)
+		m_pMT32Synth->SetRenderWorkerEnabled(!m_bLayeredSynths);
+
+	// Core 3 is free to load SoundFonts and ROM sets in the background unless it is rendering
+	const bool bBackgroundLoading = !m_bLayeredSynths && !HasRenderWorker();
+	if (bBackgroundLoading)
+	{
+		if (m_pMT32Synth)
+			m_pMT32Synth->SetBackgroundLoading(true);
+
+		if (m_pSoundFontSynth)
+			m_pSoundFontSynth->SetBackgroundLoading(true);
+	}
+}
+
+void CMT32Pi::RunBenchmark()
+{
+	LCDLog(TLCDLogType::Startup, "Benchmarking");
+
+	CRenderBenchmark Benchmark(*m_pConfig);
+	if (Benchmark.Run(BenchmarkPath) && !Benchmark.SaveResults(BenchmarkFile))
+		LOGERR("Couldn't save benchmark results");
+}
+
+bool CMT32Pi::InitUSB()
+{
+#if !defined(__aarch64__) || !defined(LEAVE_QEMU_ON_HALT)
+	// The USB driver is not supported under 64-bit QEMU, so
+	// the initialization must be skipped in this case, or an
+	// exit happens here under 64-bit QEMU.
+	CBootProfiler::CStep Step("usb");
+	if (m_pConfig->SystemUSB && m_pUSBHCI->Initialize())
+		m_bUSBAvailable = true;
+#endif
+
+	return m_bUSBAvailable;
+}
+
 bool CMT32Pi::InitNetwork()
 {
 	assert(m_pNet == nullptr);
 
+	CBootProfiler::CStep Step("network");
 	TNetDeviceType NetDeviceType = NetDeviceTypeUnknown;
 
 	if (m_pConfig->NetworkMode == CConfig::TNetworkMode::WiFi)
 	{
 		LOGNOTE("Initializing Wi-Fi");
 
-		if (m_WLAN.Initialize() && m_WPASupplicant.Initialize())
+		// The firmware and supplicant configuration are read from the SD card, which core 3 may be using
+		CFileSystemLock::Acquire();
+		const bool bWLANReady = m_WLAN.Initialize() && m_WPASupplicant.Initialize();
+		CFileSystemLock::Release();
+
+		if (bWLANReady)
 			NetDeviceType = NetDeviceTypeWLAN;
 		else
 			LOGERR("Failed to initialize Wi-Fi");
@@ -371,43 +598,112 @@ bool CMT32Pi::InitMT32Synth()
 {
 	assert(m_pMT32Synth == nullptr);
 
-	m_pMT32Synth = new CMT32Synth(m_pConfig->AudioSampleRate, m_pConfig->MT32EmuGain, m_pConfig->MT32EmuReverbGain, m_pConfig->MT32EmuResamplerQuality);
-	if (!m_pMT32Synth->Initialize())
+	m_pMT32Synth = CreateMT32Synth();
+	return m_pMT32Synth != nullptr;
+}
+
+bool CMT32Pi::InitSoundFontSynth()
+{
+	assert(m_pSoundFontSynth == nullptr);
+
+	m_pSoundFontSynth = CreateSoundFontSynth();
+	return m_pSoundFontSynth != nullptr;
+}
+
+CMT32Synth* CMT32Pi::CreateMT32Synth()
+{
+	CBootProfiler::CStep Step("mt32emu");
+
+	CMT32Synth* pMT32Synth = new CMT32Synth(m_pConfig->AudioSampleRate, m_pConfig->MT32EmuGain, m_pConfig->MT32EmuReverbGain, m_pConfig->MT32EmuResamplerQuality);
+	if (!pMT32Synth->Initialize())
 	{
 		LOGWARN("mt32emu init failed; no ROMs present?");
-		delete m_pMT32Synth;
-		m_pMT32Synth = nullptr;
-		return false;
+		delete pMT32Synth;
+		return nullptr;
 	}
 
 	// Set initial MT-32 channel assignment from config
 	if (m_pConfig->MT32EmuMIDIChannels == CMT32Synth::TMIDIChannels::Alternate)
-		m_pMT32Synth->SetMIDIChannels(m_pConfig->MT32EmuMIDIChannels);
+		pMT32Synth->SetMIDIChannels(m_pConfig->MT32EmuMIDIChannels);
 
 	// Set MT-32 reversed stereo option from config
-	m_pMT32Synth->SetReversedStereo(m_pConfig->MT32EmuReversedStereo);
+	pMT32Synth->SetReversedStereo(m_pConfig->MT32EmuReversedStereo);
 
-	m_pMT32Synth->SetUserInterface(&m_UserInterface);
+	pMT32Synth->SetSampleAccurateMIDI(m_pConfig->MIDISampleAccurate);
+	pMT32Synth->SetUserInterface(&m_UserInterface);
 
-	return true;
+	return pMT32Synth;
 }
 
-bool CMT32Pi::InitSoundFontSynth()
+CSoundFontSynth* CMT32Pi::CreateSoundFontSynth()
 {
-	assert(m_pSoundFontSynth == nullptr);
+	CBootProfiler::CStep Step("fluidsynth");
 
-	m_pSoundFontSynth = new CSoundFontSynth(m_pConfig->AudioSampleRate);
-	if (!m_pSoundFontSynth->Initialize())
+	CSoundFontSynth* pSoundFontSynth = new CSoundFontSynth(m_pConfig->AudioSampleRate);
+	if (!pSoundFontSynth->Initialize())
 	{
 		LOGWARN("FluidSynth init failed; no SoundFonts present?");
-		delete m_pSoundFontSynth;
-		m_pSoundFontSynth = nullptr;
-		return false;
+		delete pSoundFontSynth;
+		return nullptr;
 	}
 
-	m_pSoundFontSynth->SetUserInterface(&m_UserInterface);
+	pSoundFontSynth->SetSampleAccurateMIDI(m_pConfig->MIDISampleAccurate);
+	pSoundFontSynth->SetUserInterface(&m_UserInterface);
 
-	return true;
+	return pSoundFontSynth;
+}
+
+void CMT32Pi::ParallelBootTask()
+{
+	LOGNOTE("Boot task on Core 3 starting up");
+
+	// ROM and SoundFont scans, index writes and SoundFont loading all take the file system lock, as the main task is
+	// mounting USB disks and loading the Wi-Fi firmware at the same time
+
+	// The synth is handed over to the main task, which is the only one allowed to publish it
+	if (m_pMT32Synth)
+	{
+		LOGNOTE("Initializing FluidSynth in the background");
+		m_pPendingSoundFontSynth = CreateSoundFontSynth();
+	}
+	else
+	{
+		LOGNOTE("Initializing mt32emu in the background");
+		m_pPendingMT32Synth = CreateMT32Synth();
+	}
+
+	m_bPendingSynthReady.store(true, std::memory_order_release);
+
+	// Wait for the main task to finish configuring the synths before choosing a role for this core
+	while (m_bRunning && !m_bBootComplete.load(std::memory_order_acquire))
+		;
+}
+
+void CMT32Pi::CompleteParallelBoot()
+{
+	if (m_pPendingMT32Synth)
+	{
+		m_pMT32Synth = m_pPendingMT32Synth;
+		m_pPendingMT32Synth = nullptr;
+
+		// Storage may have been attached after core 3 scanned for ROMs
+		if (m_pUSBMassStorageDevice)
+			m_pMT32Synth->GetROMManager().ScanROMs();
+	}
+	else if (m_pPendingSoundFontSynth)
+	{
+		m_pSoundFontSynth = m_pPendingSoundFontSynth;
+		m_pPendingSoundFontSynth = nullptr;
+
+		if (m_pUSBMassStorageDevice)
+			m_pSoundFontSynth->GetSoundFontManager().ScanSoundFonts();
+	}
+
+	ConfigureSynths();
+	m_bBootComplete.store(true, std::memory_order_release);
+
+	LOGNOTE("Parallel boot complete");
+	CBootProfiler::Report(BootProfileFile);
 }
 
 void CMT32Pi::MainTask()
@@ -418,20 +714,50 @@ void CMT32Pi::MainTask()
 
 	Awaken();
 
+	// During a parallel boot, USB and networking are brought up one step per pass of the main loop so that MIDI received by
+	// the default synth keeps being dispatched in between; storage is shared with core 3 through the file system lock
+	enum class TInitStep
+	{
+		USB,
+		Network,
+		Done
+	};
+
+	TInitStep InitStep = m_bParallelBoot ? TInitStep::USB : TInitStep::Done;
+	if (!m_bParallelBoot)
+		CBootProfiler::Report(BootProfileFile);
+
+	// Interrupts wake this core from WaitForEvent(); the event stream also wakes it to pick up other cores' work
+	Utility::EnableEventStream(MainWakeupPeriodMicros);
+
 	while (m_bRunning)
 	{
 		// Process MIDI data
-		UpdateMIDI();
+		bool bBusy = UpdateMIDI();
 
 		// Process network packets
 		UpdateNetwork();
 
-		// Update controls
-		if (m_pControl)
-			m_pControl->Update();
-
 		// Process events
-		ProcessEventQueue();
+		bBusy |= ProcessEventQueue();
+
+		// Continue a parallel boot; UpdateUSB() below picks up any disk attached once USB is up
+		if (InitStep == TInitStep::USB)
+		{
+			InitUSB();
+			InitStep = TInitStep::Network;
+			bBusy = true;
+		}
+		else if (InitStep == TInitStep::Network)
+		{
+			InitNetwork();
+			InitStep = TInitStep::Done;
+			bBusy = true;
+		}
+
+		// Report errors raised since the last pass if the UI task isn't doing so
+		if (m_bUITaskDone)
+			m_DeferredLog.Flush(CTimer::GetClockTicks(), DeferredLogLCDHandler, this);
 
 		const unsigned int nTicks = m_pTimer->GetTicks();
 
@@ -445,25 +771,21 @@ void CMT32Pi::MainTask()
 		// Check for active sensing timeout
 		if (m_bActiveSenseFlag && (nTicks > m_nActiveSenseTime) && (nTicks - m_nActiveSenseTime) >= MSEC2HZ(ActiveSenseTimeoutMillis))
 		{
-			m_pCurrentSynth->AllSoundOff();
+			if (m_bLayeredSynths)
+			{
+				m_pMT32Synth->AllSoundOff();
+				m_pSoundFontSynth->AllSoundOff();
+			}
+			else
+				m_pCurrentSynth->AllSoundOff();
 			m_bActiveSenseFlag = false;
 			LOGNOTE("Active sense timeout - turning notes off");
 		}
 
 		// Update power management
-		if (m_pCurrentSynth->IsActive())
+		if (m_pCurrentSynth->IsActive() || (m_bLayeredSynths && (m_pMT32Synth->IsActive() || m_pSoundFontSynth->IsActive())))
 			Awaken();
 
-#ifdef MONITOR_TEMPERATURE
-		if (nTicks - m_nTempUpdateTime >= MSEC2HZ(5000))
-		{
-			const unsigned int nTemp = CCPUThrottle::Get()->GetTemperature();
-			LOGDBG("Temperature: %dC", nTemp);
-			LCDLog(TLCDLogType::Notice, "Temp: %dC", nTemp);
-			m_nTempUpdateTime = nTicks;
-		}
-#endif
-
 		CPower::Update();
 
 		// Check for deferred SoundFont switch
@@ -482,14 +804,49 @@ void CMT32Pi::MainTask()
 			}
 		}
 
+		// Adopt the synth initialized by core 3
+		if (!m_bBootComplete.load(std::memory_order_relaxed) && m_bPendingSynthReady.load(std::memory_order_acquire))
+			CompleteParallelBoot();
+
+		// Pick up files uploaded or removed over FTP
+		ProcessFileChanges();
+
+		// Check for completed background SoundFont switch
+		if (m_pSoundFontSynth && m_pSoundFontSynth->UpdateSoundFontSwitch() && m_pCurrentSynth == m_pSoundFontSynth)
+			m_pSoundFontSynth->ReportStatus();
+
+		// Load samples for program changes that the audio core is holding back
+		if (m_pSoundFontSynth)
+			m_pSoundFontSynth->LoadRequestedPreset();
+
+		// Log new audio underruns
+		const unsigned int nUnderruns = m_OutputStats.GetUnderruns();
+		if (nUnderruns > m_nReportedUnderruns)
+			LOGWARN("Audio underrun detected (%d total)", nUnderruns);
+		m_nReportedUnderruns = nUnderruns;
+
+		// Check for completed background ROM set switch
+		if (m_pMT32Synth && m_pMT32Synth->UpdateROMSetSwitch() && m_pCurrentSynth == m_pMT32Synth)
+			m_pMT32Synth->ReportStatus();
+
+		// Save the trace once recording has stopped
+		if (CTracer::IsDumpPending())
+			CTracer::Dump(TraceFile);
+
 		// Check for USB PnP events
 		UpdateUSB();
 
+		// Keep the main loop running while the scan task has work to do
+		bBusy |= UpdateStorageScan();
+
+		// Sleep until an interrupt (MIDI, network, USB, timer), an event from another core, or the next event stream tick
+		if (!bBusy)
+			CCPULoad::WaitForEvent();
+
 		// Allow other tasks to run
 		pScheduler->Yield();
 	}
 
-
 	// Stop audio
 	m_pSound->Cancel();
 
@@ -514,10 +871,27 @@ void CMT32Pi::UITask()
 	// Display current MT-32 ROM version/SoundFont
 	m_pCurrentSynth->ReportStatus();
 
+	// Display updates are sent in parts between the other jobs on this core, so that MiSTer polling isn't held up
+	if (m_pLCD)
+		m_pLCD->SetAsyncTransfers(true);
+
+	// Nothing interrupts this core, so sleep in short periods between jobs rather than spinning
+	Utility::EnableEventStream(UIWakeupPeriodMicros);
+
 	while (m_bRunning)
 	{
 		const unsigned int nTicks = CTimer::GetClockTicks();
 
+		// Report errors raised since the last pass
+		m_DeferredLog.Flush(nTicks, DeferredLogLCDHandler, this);
+
+		// Sample the performance counters less often than the display is updated so that the page is readable
+		if (m_pLCD && (nTicks - m_nPerformanceStatsTime) >= Utility::MillisToTicks(PerformanceStatsPeriodMillis))
+		{
+			UpdatePerformanceStats();
+			m_nPerformanceStatsTime = nTicks;
+		}
+
 		// Update LCD
 		if (m_pLCD && (nTicks - m_nLCDUpdateTime) >= Utility::MillisToTicks(LCDUpdatePeriodMillis))
 		{
@@ -525,7 +899,7 @@ void CMT32Pi::UITask()
 			m_nLCDUpdateTime = nTicks;
 		}
 
-		// Poll MiSTer interface
+		// Update MiSTer interface; status changes are written straight away, but the MiSTer's status is read less often
 		if (bMisterEnabled && (nTicks - m_nMisterUpdateTime) >= Utility::MillisToTicks(MisterUpdatePeriodMillis))
 		{
 			TMisterStatus Status{TMisterSynth::Unknown, 0xFF, 0xFF};
@@ -541,14 +915,29 @@ void CMT32Pi::UITask()
 			if (m_pSoundFontSynth)
 				Status.SoundFontIndex = m_pSoundFontSynth->GetSoundFontIndex();
 
-			m_MisterControl.Update(Status);
+			m_MisterControl.Update(Status, nTicks);
 			m_nMisterUpdateTime = nTicks;
 		}
+
+		// Send the next part of the previous frame
+		if (m_pLCD && m_pLCD->UpdateTransfers(LCDTransferChunkBytes))
+			continue;
+
+		// Sleep until the next job is due, or another core sends an event (e.g. to stop this task)
+		const unsigned int nLCDDeadline = m_nLCDUpdateTime + Utility::MillisToTicks(LCDUpdatePeriodMillis);
+		const unsigned int nMisterDeadline = m_nMisterUpdateTime + Utility::MillisToTicks(MisterUpdatePeriodMillis);
+		const auto IsDue = [](unsigned int nDeadline) { return static_cast<int>(CTimer::GetClockTicks() - nDeadline) >= 0; };
+
+		while (m_bRunning && !(m_pLCD && IsDue(nLCDDeadline)) && !(bMisterEnabled && IsDue(nMisterDeadline)))
+			CCPULoad::WaitForEvent();
 	}
 
 	// Clear screen
 	if (m_pLCD)
+	{
+		m_pLCD->SetAsyncTransfers(false);
 		m_pLCD->Clear();
+	}
 
 	m_bUITaskDone = true;
 }
@@ -559,143 +948,551 @@ void CMT32Pi::AudioTask()
 
 	constexpr u8 nChannels = 2;
 
-	// Circle's "fast path" for I2S 24-bit really expects 32-bit samples
-	const bool bI2S = m_pConfig->AudioOutputDevice == CConfig::TAudioOutputDevice::I2S;
 	const bool bReversedStereo = m_pConfig->AudioReversedStereo;
-	const u8 nBytesPerSample = bI2S ? sizeof(s32) : (sizeof(s8) * 3);
-	const u8 nBytesPerFrame = 2 * nBytesPerSample;
+	const size_t nQueueSizeFrames = m_SoundOutputRing.GetSizeFrames();
 
-	const size_t nQueueSizeFrames = m_pSound->GetQueueSizeFrames();
+	alignas(16) float FloatBuffer[nQueueSizeFrames * nChannels];
+	alignas(16) float LayerBuffer[m_bLayeredSynths ? nQueueSizeFrames * nChannels : 1];
+	alignas(16) float FadeBuffer[m_pConfig->SystemSwitchCrossfade ? nQueueSizeFrames * nChannels : 1];
+	m_pLayerBuffer = LayerBuffer;
 
-	// Extra byte so that we can write to the 24-bit buffer with overlapping 32-bit writes (efficiency)
-	float FloatBuffer[nQueueSizeFrames * nChannels];
-	s8 IntBuffer[nQueueSizeFrames * nBytesPerFrame + bI2S ? 0 : 1];
+	const bool bIdlePark = m_pConfig->AudioIdlePark;
+	unsigned int nTotalParkedMillis = 0;
+
+	const bool bAdaptiveLatency = m_pConfig->AudioAdaptiveLatency;
+	const bool bClockGovernor = m_pConfig->SystemClockGovernor;
+	CLatencyController LatencyController(m_pConfig->AudioSampleRate, m_nAudioChunkFrames, nQueueSizeFrames, m_nAudioChunkFrames);
 
 	while (m_bRunning)
 	{
-		const size_t nFrames = nQueueSizeFrames - m_pSound->GetQueueFramesAvail();
-		const size_t nWriteBytes = nFrames * nBytesPerFrame;
+		// Top the queue up to the target level
+		const size_t nQueuedFrames = m_SoundOutputRing.GetFramesAvail();
+		const size_t nTargetFrames = bAdaptiveLatency ? LatencyController.GetTargetFrames() : nQueueSizeFrames;
+		const size_t nFrames = nQueuedFrames < nTargetFrames ? nTargetFrames - nQueuedFrames : 0;
+
+		CTracer::CScope TraceScope(TTraceEvent::AudioBlock, nFrames);
+		const unsigned int nRenderStartTicks = CTimer::GetClockTicks();
 
-		m_pCurrentSynth->Render(FloatBuffer, nFrames);
+		CSynthBase* const pCurrentSynth = m_pCurrentSynth;
+		CSynthBase* const pFadeOutSynth = nFrames ? TakeFadeOutSynth(pCurrentSynth) : nullptr;
 
-		if (bReversedStereo)
+		if (m_bLayeredSynths)
+			RenderLayered(FloatBuffer, nFrames);
+		else
+			RenderSynth(pCurrentSynth, FloatBuffer, nFrames);
+
+		if (pFadeOutSynth)
+			FadeOutSynth(pFadeOutSynth, FloatBuffer, FadeBuffer, nFrames);
+
+		if (m_bMirrorMIDIState)
+			GetStandbySynth(pCurrentSynth)->ProcessStandbyMIDIEvents();
+
+		// Copy the final mix for network streaming; never waits for the network
+		if (CPCMStreamer* const pPCMStreamer = m_pPCMStreamer.load(std::memory_order_acquire))
+			pPCMStreamer->Write(FloatBuffer, nFrames);
+
+		const unsigned int nConvertStartTicks = CTimer::GetClockTicks();
+
+		// Convert to signed 24-bit integers (with optional channel swap) straight into the ring read by the device's DMA interrupt
+		const size_t nFramesWritten = m_SoundOutputRing.Write(FloatBuffer, nFrames, bReversedStereo);
+		if (nFramesWritten != nFrames)
+			m_DeferredLog.Raise(TDeferredLogMessage::SoundDataDropped, static_cast<int>(nFrames - nFramesWritten));
+
+		const unsigned int nEndTicks = CTimer::GetClockTicks();
+		const unsigned int nRenderTicks = nEndTicks - nRenderStartTicks;
+		m_OutputStats.AddBlock(nFrames, nEndTicks - nConvertStartTicks, m_pConfig->AudioSampleRate);
+
+		// The device ran out of data if we took longer than the queued frames plus the chunk being played take to play back
+		const unsigned int nSlackTicks = static_cast<u64>(nQueuedFrames + m_nAudioChunkFrames) * 1000000 / m_pConfig->AudioSampleRate;
+		const bool bUnderrun = nFrames && nRenderTicks > nSlackTicks;
+		if (bUnderrun)
 		{
-			// Convert to signed 24-bit integers with channel swap
-			for (size_t i = 0; i < nFrames * nChannels; i += nChannels)
-			{
-				s32* const pLeftSample = reinterpret_cast<s32*>(IntBuffer + i * nBytesPerSample);
-				s32* const pRightSample = reinterpret_cast<s32*>(IntBuffer + (i + 1) * nBytesPerSample);
-				*pLeftSample = FloatBuffer[i + 1] * Sample24BitMax;
-				*pRightSample = FloatBuffer[i] * Sample24BitMax;
-			}
+			m_OutputStats.AddUnderrun();
+			CTracer::Event(TTraceEvent::AudioUnderrun, nRenderTicks);
+			CTracer::Freeze();
 		}
-		else
+
+		// This core polls the sound device, so only time spent rendering counts towards its load
+		if (nFrames)
+			CCPULoad::AddBusyTime(nRenderTicks);
+
+		// Render time as a percentage of the block's playback time for the clock governor
+		if (bClockGovernor && nFrames)
+			ReportRenderLoad(bUnderrun ? 100 : static_cast<u64>(nRenderTicks) * m_pConfig->AudioSampleRate * 100 / (static_cast<u64>(nFrames) * 1000000));
+
+		if (bAdaptiveLatency && LatencyController.Update(nFrames, nRenderTicks, bUnderrun))
 		{
-			// Convert to signed 24-bit integers
-			for (size_t i = 0; i < nFrames * nChannels; ++i)
-			{
-				s32* const pSample = reinterpret_cast<s32*>(IntBuffer + i * nBytesPerSample);
-				*pSample = FloatBuffer[i] * Sample24BitMax;
-			}
+			const unsigned int nMicros = LatencyController.GetTargetMicros();
+			LOGDBG("Audio latency now %d frames (%d.%02d ms)", static_cast<unsigned int>(LatencyController.GetTargetFrames()), nMicros / 1000, (nMicros % 1000) / 10);
 		}
 
-		const int nResult = m_pSound->Write(IntBuffer, nWriteBytes);
-		if (nResult != static_cast<int>(nWriteBytes))
-			LOGERR("Sound data dropped");
+		// Stop rendering once everything has decayed to silence
+		if (bIdlePark && nFrames && IsAudioIdle(FloatBuffer, nFrames))
+		{
+			const unsigned int nParkedMillis = ParkAudioTask();
+			nTotalParkedMillis += nParkedMillis;
+			LOGDBG("Audio core idle for %d ms (%d s total)", nParkedMillis, nTotalParkedMillis / 1000);
+		}
 	}
+
+	m_bAudioTaskDone = true;
 }
 
-void CMT32Pi::Run(unsigned nCore)
+bool CMT32Pi::IsAudioIdle(const float* pBuffer, size_t nFrames) const
 {
-	// Assign tasks to different CPU cores
-	switch (nCore)
+	if (m_bLayeredSynths ? (m_pMT32Synth->IsActive() || m_pSoundFontSynth->IsActive()) : m_pCurrentSynth->IsActive())
+		return false;
+
+	// Effect tails may outlast the voices; wait until they are below the resolution of the output
+	constexpr float nSilenceThreshold = 1.0f / AudioConvert::Sample24BitMax;
+	for (size_t i = 0; i < nFrames * 2; ++i)
 	{
-		case 0:
-			return MainTask();
+		if (pBuffer[i] >= nSilenceThreshold || pBuffer[i] <= -nSilenceThreshold)
+			return false;
+	}
 
-		case 1:
-			return UITask();
+	return true;
+}
 
-		case 2:
-			return AudioTask();
+unsigned int CMT32Pi::ParkAudioTask()
+{
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
 
-		default:
+	// The sound device plays silence once the queue runs dry; sleep until there is MIDI data to render
+	while (m_bRunning)
+	{
+		if (m_bLayeredSynths ? (m_pMT32Synth->HasQueuedMIDIEvents() || m_pSoundFontSynth->HasQueuedMIDIEvents()) : m_pCurrentSynth->HasQueuedMIDIEvents())
 			break;
+
+		Utility::WaitForEvent();
 	}
-}
 
-void CMT32Pi::OnEnterPowerSavingMode()
-{
-	CPower::OnEnterPowerSavingMode();
-	m_pSound->Cancel();
-	m_UserInterface.EnterPowerSavingMode();
+	return Utility::TicksToMillis(CTimer::GetClockTicks() - nStartTicks);
 }
 
-void CMT32Pi::OnExitPowerSavingMode()
+bool CMT32Pi::HasRenderWorker() const
 {
-	CPower::OnExitPowerSavingMode();
-	m_pSound->Start();
-	m_UserInterface.ExitPowerSavingMode();
+	return (m_pMT32Synth && m_pMT32Synth->IsRenderWorkerEnabled()) || (m_pSoundFontSynth && m_pSoundFontSynth->IsRenderWorkerEnabled());
 }
 
-void CMT32Pi::OnThrottleDetected()
+void CMT32Pi::RenderWorkerTask()
 {
-	CPower::OnThrottleDetected();
-	LCDLog(TLCDLogType::Warning, "CPU throttl! Chk PSU");
-}
+	LOGNOTE("Render worker task on Core 3 starting up");
 
-void CMT32Pi::OnUnderVoltageDetected()
-{
-	CPower::OnUnderVoltageDetected();
-	LCDLog(TLCDLogType::Warning, "Low voltage! Chk PSU");
-}
+	const bool bMT32RenderWorker = m_pMT32Synth && m_pMT32Synth->IsRenderWorkerEnabled();
+	const bool bSoundFontRenderWorker = m_pSoundFontSynth && m_pSoundFontSynth->IsRenderWorkerEnabled();
 
-void CMT32Pi::OnShortMessage(u32 nMessage)
-{
-	// Active sensing
-	if (nMessage == 0xFE)
+	// Keep servicing the audio task until it has finished, otherwise it could wait on us forever
+	while (!m_bAudioTaskDone)
 	{
-		m_bActiveSenseFlag = true;
-		return;
-	}
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+		bool bWorked = false;
 
-	// Flash LED for channel messages
-	if ((nMessage & 0xFF) < 0xF0)
-		LEDOn();
+		if (bMT32RenderWorker)
+			bWorked |= m_pMT32Synth->RenderWorker();
 
-	m_pCurrentSynth->HandleMIDIShortMessage(nMessage);
+		if (bSoundFontRenderWorker)
+			bWorked |= m_pSoundFontSynth->RenderWorker();
 
-	// Wake from power saving mode if necessary
-	Awaken();
+		if (bWorked)
+			CCPULoad::AddBusyTime(CTimer::GetClockTicks() - nStartTicks);
+	}
 }
 
-void CMT32Pi::OnSysExMessage(const u8* pData, size_t nSize)
+void CMT32Pi::BackgroundTask()
 {
-	// Flash LED
-	LEDOn();
+	// Nothing for this core to do; bail out
+	if (!m_pMT32Synth && !m_pSoundFontSynth)
+		return;
 
-	// If we don't consume the SysEx message, forward it to the synthesizer
-	if (!ParseCustomSysEx(pData, nSize))
-		m_pCurrentSynth->HandleMIDISysExMessage(pData, nSize);
+	LOGNOTE("Background task on Core 3 starting up");
 
-	// Wake from power saving mode if necessary
-	Awaken();
-}
+	while (m_bRunning)
+	{
+		if (m_pMT32Synth)
+			m_pMT32Synth->RunBackgroundLoader();
+
+		if (m_pSoundFontSynth)
+			m_pSoundFontSynth->RunBackgroundLoader();
+	}
+}
+
+void CMT32Pi::LayerRenderTask()
+{
+	LOGNOTE("Layer render task on Core 3 starting up");
+
+	while (!m_bAudioTaskDone)
+	{
+		const unsigned int nRequest = m_nLayerRenderRequest.load(std::memory_order_acquire);
+		if (nRequest == m_nLayerRenderDone.load(std::memory_order_relaxed))
+			continue;
+
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+		RenderSynth(m_pSoundFontSynth, m_pLayerBuffer, m_nLayerRenderFrames);
+		m_nLayerRenderDone.store(nRequest, std::memory_order_release);
+		CCPULoad::AddBusyTime(CTimer::GetClockTicks() - nStartTicks);
+	}
+}
+
+void CMT32Pi::RenderLayered(float* pOutBuffer, size_t nFrames)
+{
+	// Render the SoundFont synth on core 3 while we render the MT-32 synth
+	const unsigned int nRequest = m_nLayerRenderRequest.load(std::memory_order_relaxed) + 1;
+	m_nLayerRenderFrames = nFrames;
+	m_nLayerRenderRequest.store(nRequest, std::memory_order_release);
+
+	RenderSynth(m_pMT32Synth, pOutBuffer, nFrames);
+
+	while (m_nLayerRenderDone.load(std::memory_order_acquire) != nRequest)
+		;
+
+	// Mix
+	for (size_t i = 0; i < nFrames * 2; ++i)
+		pOutBuffer[i] += m_pLayerBuffer[i];
+}
+
+CSynthBase* CMT32Pi::TakeFadeOutSynth(const CSynthBase* pCurrentSynth)
+{
+	CSynthBase* pFadeOutSynth = m_pFadeOutSynth.load(std::memory_order_acquire);
+
+	// The switch may not be visible to this core yet; pick it up on the next block
+	if (!pFadeOutSynth || pFadeOutSynth == pCurrentSynth)
+		return nullptr;
+
+	// Another switch may have replaced it in the meantime
+	if (!m_pFadeOutSynth.compare_exchange_strong(pFadeOutSynth, nullptr, std::memory_order_acquire))
+		return nullptr;
+
+	return pFadeOutSynth;
+}
+
+void CMT32Pi::FadeOutSynth(CSynthBase* pSynth, float* pOutBuffer, float* pFadeBuffer, size_t nFrames)
+{
+	RenderSynth(pSynth, pFadeBuffer, nFrames);
+
+	// Linear crossfade from the previous synth to the current one
+	const float nStep = 1.0f / nFrames;
+	for (size_t i = 0; i < nFrames; ++i)
+	{
+		const float nGain = i * nStep;
+		pOutBuffer[i * 2] = pOutBuffer[i * 2] * nGain + pFadeBuffer[i * 2] * (1.0f - nGain);
+		pOutBuffer[i * 2 + 1] = pOutBuffer[i * 2 + 1] * nGain + pFadeBuffer[i * 2 + 1] * (1.0f - nGain);
+	}
+
+	pSynth->AllSoundOff();
+}
+
+void CMT32Pi::RenderSynth(CSynthBase* pSynth, float* pOutBuffer, size_t nFrames)
+{
+	CRenderStats& Stats = pSynth == m_pMT32Synth ? m_MT32RenderStats : m_SoundFontRenderStats;
 
-void CMT32Pi::OnUnexpectedStatus()
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+	pSynth->Render(pOutBuffer, nFrames);
+	Stats.AddBlock(nFrames, CTimer::GetClockTicks() - nStartTicks, pSynth->m_nSampleRate);
+	Stats.AddActiveVoices(pSynth->GetActiveVoiceCount());
+}
+
+void CMT32Pi::ReportRenderStats()
+{
+	if (m_pMT32Synth)
+		m_MT32RenderStats.Dump("MT-32 render");
+	if (m_pSoundFontSynth)
+		m_SoundFontRenderStats.Dump("SoundFont render");
+	m_OutputStats.Dump("Output conversion");
+	m_MIDIRouter.DumpStats();
+	LOGNOTE("MIDI RX buffer: peak %d/%d bytes", static_cast<unsigned int>(m_MIDIRxBuffer.GetHighWaterMark()), static_cast<unsigned int>(m_MIDIRxBuffer.GetCapacity()));
+
+	if (m_pAppleMIDIParticipant)
+	{
+		const CAppleMIDIParticipant::TJitterStats JitterStats = m_pAppleMIDIParticipant->GetJitterStats();
+		LOGNOTE("RTP-MIDI: %d packets, %d late, %d lost, jitter %dus, peak transit %dus", JitterStats.nPackets, JitterStats.nLatePackets, JitterStats.nLostPackets, JitterStats.nJitterMicros, JitterStats.nPeakTransitMicros);
+	}
+
+	CSoundFontSynth::TSampleCacheStats SampleCacheStats;
+	if (m_pSoundFontSynth && m_pSoundFontSynth->GetSampleCacheStats(SampleCacheStats))
+		LOGNOTE("SoundFont sample cache: %d presets resident in %d KB, %d hits, %d misses, %d evictions", SampleCacheStats.nResidentPresets, SampleCacheStats.nSampleSize / KILOBYTE, SampleCacheStats.nHits, SampleCacheStats.nMisses, SampleCacheStats.nEvictions);
+
+	// Summarize the current synth on the LCD
+	const CRenderStats& Stats = m_pCurrentSynth == m_pMT32Synth ? m_MT32RenderStats : m_SoundFontRenderStats;
+	LCDLog(TLCDLogType::Notice, "Pk%d%% V%d X%d", Stats.GetPeakLoad(), Stats.GetPeakVoices(), m_OutputStats.GetUnderruns());
+}
+
+void CMT32Pi::ResetRenderStats()
 {
-	CMIDIParser::OnUnexpectedStatus();
-	if (m_pConfig->SystemVerbose)
-		LCDLog(TLCDLogType::Warning, "Unexp. MIDI status!");
+	m_MT32RenderStats.Reset();
+	m_SoundFontRenderStats.Reset();
+	m_OutputStats.Reset();
+	m_MIDIRxBuffer.ResetHighWaterMark();
+	m_MIDIRouter.ResetStats();
+
+	if (m_pAppleMIDIParticipant)
+		m_pAppleMIDIParticipant->ResetJitterStats();
+
+	if (m_pSoundFontSynth)
+		m_pSoundFontSynth->ResetSampleCacheStats();
 }
 
-void CMT32Pi::OnSysExOverflow()
+void CMT32Pi::UpdatePerformanceStats()
 {
-	CMIDIParser::OnSysExOverflow();
-	LCDLog(TLCDLogType::Error, "SysEx overflow!");
+	// Everything here is already kept up to date by the other cores or the clock governor; nothing is measured here
+	CUserInterface::TPerformanceStats Stats{};
+	CCPULoad::Sample(Stats.CoreLoads);
+
+	const CRenderStats& RenderStats = m_pCurrentSynth == m_pMT32Synth ? m_MT32RenderStats : m_SoundFontRenderStats;
+	Stats.nRenderLoad = Utility::Min(RenderStats.GetLoad(), 100u);
+	Stats.nUnderruns = m_OutputStats.GetUnderruns();
+	Stats.nVoices = RenderStats.GetVoices();
+	Stats.nMaxVoices = m_pCurrentSynth->GetMaxVoiceCount();
+	Stats.nMIDIBufferPeak = m_MIDIRxBuffer.GetHighWaterMark() * 100 / m_MIDIRxBuffer.GetCapacity();
+
+	const CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+	Stats.nFreeMemoryKB = (pAllocator->GetHeapSize() - pAllocator->GetUsedSize()) / KILOBYTE;
+	Stats.nTemperature = GetCurrentTemperature();
+	Stats.nClockMHz = GetCurrentClockRate() / 1000000;
+
+	m_UserInterface.SetPerformanceStats(Stats);
 }
 
-void CMT32Pi::OnAppleMIDIConnect(const CIPAddress* pIPAddress, const char* pName)
+void CMT32Pi::ReportMemoryStats()
+{
+	CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+	pAllocator->DumpStats();
+
+	CZoneAllocator::TStats Stats;
+	pAllocator->GetStats(Stats);
+	WriteMemoryStats(Stats);
+
+	LCDLog(TLCDLogType::Notice, "Mem %d%% Frag %d%%", static_cast<unsigned int>(static_cast<u64>(Stats.nUsedSize) * 100 / Stats.nHeapSize), Stats.nFragmentation);
+}
+
+// Written to the SD card so that it can be fetched over FTP
+bool CMT32Pi::WriteMemoryStats(const CZoneAllocator::TStats& Stats)
+{
+	char Buffer[1024];
+	size_t nLength = snprintf(Buffer, sizeof(Buffer),
+		"heap_size=%u\nused=%u\npeak=%u\nfree=%u\nfree_blocks=%u\nlargest_free_block=%u\nfragmentation=%u\n",
+		static_cast<unsigned int>(Stats.nHeapSize), static_cast<unsigned int>(Stats.nUsedSize), static_cast<unsigned int>(Stats.nPeakSize),
+		static_cast<unsigned int>(Stats.nFreeSize), static_cast<unsigned int>(Stats.nFreeBlocks), static_cast<unsigned int>(Stats.nLargestFreeBlock),
+		Stats.nFragmentation);
+
+	for (size_t i = TZoneTag::Uncategorized; i < CZoneAllocator::TagCount && nLength < sizeof(Buffer); ++i)
+	{
+		const CZoneAllocator::TTagStats& TagStats = Stats.Tags[i];
+		nLength += snprintf(Buffer + nLength, sizeof(Buffer) - nLength, "%s: used=%u peak=%u blocks=%u\n", CZoneAllocator::GetTagName(i),
+			static_cast<unsigned int>(TagStats.nUsedSize), static_cast<unsigned int>(TagStats.nPeakSize), static_cast<unsigned int>(TagStats.nAllocCount));
+	}
+	nLength = Utility::Min(nLength, sizeof(Buffer) - 1);
+
+	CFileSystemLockGuard Lock;
+
+	FIL File;
+	if (f_open(&File, MemoryStatsFile, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGWARN("Couldn't create %s", MemoryStatsFile);
+		return false;
+	}
+
+	UINT nWritten;
+	bool bResult = f_write(&File, Buffer, nLength, &nWritten) == FR_OK && nWritten == nLength;
+	if (f_close(&File) != FR_OK)
+		bResult = false;
+
+	if (!bResult)
+		LOGWARN("Couldn't write %s", MemoryStatsFile);
+
+	return bResult;
+}
+
+CSynthBase* CMT32Pi::GetLayeredSynth(u8 nChannel) const
+{
+	return (m_nLayeredMT32ChannelMask & (1 << nChannel)) ? static_cast<CSynthBase*>(m_pMT32Synth) : m_pSoundFontSynth;
+}
+
+CSynthBase* CMT32Pi::GetStandbySynth(const CSynthBase* pCurrentSynth) const
+{
+	return pCurrentSynth == m_pMT32Synth ? static_cast<CSynthBase*>(m_pSoundFontSynth) : m_pMT32Synth;
+}
+
+bool CMT32Pi::IsMIDIStateMessage(u32 nMessage)
+{
+	const u8 nStatus = nMessage & 0xFF;
+
+	// System reset, or control change, program change and pitch bend
+	if (nStatus == 0xFF)
+		return true;
+
+	const u8 nType = nStatus & 0xF0;
+	return nType == 0xB0 || nType == 0xC0 || nType == 0xE0;
+}
+
+void CMT32Pi::Run(unsigned nCore)
+{
+	// Assign tasks to different CPU cores
+	switch (nCore)
+	{
+		case 0:
+			return MainTask();
+
+		case 1:
+			return UITask();
+
+		case 2:
+			return AudioTask();
+
+		case 3:
+			if (m_bParallelBoot)
+				ParallelBootTask();
+
+			if (m_bLayeredSynths)
+				return LayerRenderTask();
+			else if (HasRenderWorker())
+				return RenderWorkerTask();
+			return BackgroundTask();
+
+		default:
+			break;
+	}
+}
+
+void CMT32Pi::OnEnterPowerSavingMode()
+{
+	CPower::OnEnterPowerSavingMode();
+	m_pSound->Cancel();
+	m_UserInterface.EnterPowerSavingMode();
+
+	// Power saving mode is entered and left from the main task; poll less often while there's nothing to do
+	Utility::EnableEventStream(PowerSaveWakeupPeriodMicros);
+}
+
+void CMT32Pi::OnExitPowerSavingMode()
+{
+	CPower::OnExitPowerSavingMode();
+	m_pSound->Start();
+	m_UserInterface.ExitPowerSavingMode();
+
+	Utility::EnableEventStream(MainWakeupPeriodMicros);
+}
+
+void CMT32Pi::OnThrottleDetected()
+{
+	CPower::OnThrottleDetected();
+	LCDLog(TLCDLogType::Warning, "CPU throttl! Chk PSU");
+
+	if (m_pMT32Synth)
+		m_pMT32Synth->OnThrottleDetected();
+
+	if (m_pSoundFontSynth)
+		m_pSoundFontSynth->OnThrottleDetected();
+}
+
+void CMT32Pi::OnUnderVoltageDetected()
+{
+	CPower::OnUnderVoltageDetected();
+	LCDLog(TLCDLogType::Warning, "Low voltage! Chk PSU");
+
+	// Undervoltage causes the firmware to throttle the CPU
+	if (m_pMT32Synth)
+		m_pMT32Synth->OnThrottleDetected();
+
+	if (m_pSoundFontSynth)
+		m_pSoundFontSynth->OnThrottleDetected();
+}
+
+void CMT32Pi::OnShortMessage(u32 nMessage)
+{
+	// Active sensing
+	if (nMessage == 0xFE)
+	{
+		m_bActiveSenseFlag = true;
+		return;
+	}
+
+	// Flash LED for channel messages
+	if ((nMessage & 0xFF) < 0xF0)
+		LEDOn();
+
+	// Channels beyond the first 16 only exist on the SoundFont synth
+	if (CMIDIParser::GetChannelBank(nMessage))
+	{
+		const bool bSoundFontSynthListening = m_pSoundFontSynth && (m_bLayeredSynths || m_pCurrentSynth == m_pSoundFontSynth ||
+		                                                            (m_bMirrorMIDIState && IsMIDIStateMessage(nMessage)));
+		if (bSoundFontSynthListening && !m_pSoundFontSynth->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp))
+			OnMIDIEventQueueOverflow();
+	}
+	else if (m_bLayeredSynths)
+	{
+		const u8 nStatus = nMessage & 0xFF;
+		bool bQueued;
+
+		// Route channel messages by channel; system messages go to both synths
+		if (nStatus < 0xF0)
+			bQueued = GetLayeredSynth(nStatus & 0x0F)->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp);
+		else
+		{
+			const bool bMT32Queued = m_pMT32Synth->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp);
+			const bool bSoundFontQueued = m_pSoundFontSynth->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp);
+			bQueued = bMT32Queued && bSoundFontQueued;
+		}
+
+		if (!bQueued)
+			OnMIDIEventQueueOverflow();
+	}
+	else
+	{
+		if (!m_pCurrentSynth->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp))
+			OnMIDIEventQueueOverflow();
+
+		// Notes aren't mirrored, so the standby synth stays silent
+		if (m_bMirrorMIDIState && IsMIDIStateMessage(nMessage) && !GetStandbySynth(m_pCurrentSynth)->QueueMIDIShortMessage(nMessage, m_nMIDITimestamp))
+			OnMIDIEventQueueOverflow();
+	}
+
+	// Wake from power saving mode if necessary
+	Awaken();
+}
+
+void CMT32Pi::OnSysExMessage(const u8* pData, size_t nSize)
+{
+	// Flash LED
+	LEDOn();
+
+	// If we don't consume the SysEx message, forward it to the synthesizer(s)
+	if (!ParseCustomSysEx(pData, nSize))
+	{
+		bool bQueued;
+
+		// Each synth ignores SysEx messages meant for the other
+		if (m_bLayeredSynths)
+		{
+			const bool bMT32Queued = m_pMT32Synth->QueueMIDISysExMessage(pData, nSize, m_nMIDITimestamp);
+			const bool bSoundFontQueued = m_pSoundFontSynth->QueueMIDISysExMessage(pData, nSize, m_nMIDITimestamp);
+			bQueued = bMT32Queued && bSoundFontQueued;
+		}
+		else
+		{
+			bQueued = m_pCurrentSynth->QueueMIDISysExMessage(pData, nSize, m_nMIDITimestamp);
+			if (m_bMirrorMIDIState)
+				bQueued &= GetStandbySynth(m_pCurrentSynth)->QueueMIDISysExMessage(pData, nSize, m_nMIDITimestamp);
+		}
+
+		if (!bQueued)
+			OnMIDIEventQueueOverflow();
+	}
+
+	// Wake from power saving mode if necessary
+	Awaken();
+}
+
+void CMT32Pi::OnAppleMIDIDataReceived(unsigned int nSession, const u8* pData, size_t nSize, unsigned int nTimestamp)
+{
+	// Called from the AppleMIDI task; parsing is left to the main task
+	CTracer::Event(TTraceEvent::AppleMIDIReceive, nSize);
+	m_MIDIRouter.Forward(CMIDIRouter::TInput::AppleMIDI, pData, nSize, nTimestamp);
+	if (!m_AppleMIDIQueues[nSession].EnqueueSysExMessage(pData, nSize, nTimestamp))
+		m_bNetworkMIDIOverflow.store(true, std::memory_order_relaxed);
+}
+
+void CMT32Pi::OnAppleMIDIConnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName)
 {
 	if (!m_pLCD)
 		return;
@@ -703,7 +1500,7 @@ void CMT32Pi::OnAppleMIDIConnect(const CIPAddress* pIPAddress, const char* pName
 	LCDLog(TLCDLogType::Notice, "%s connected!", pName);
 }
 
-void CMT32Pi::OnAppleMIDIDisconnect(const CIPAddress* pIPAddress, const char* pName)
+void CMT32Pi::OnAppleMIDIDisconnect(unsigned int nSession, const CIPAddress* pIPAddress, const char* pName)
 {
 	if (!m_pLCD)
 		return;
@@ -711,6 +1508,196 @@ void CMT32Pi::OnAppleMIDIDisconnect(const CIPAddress* pIPAddress, const char* pN
 	LCDLog(TLCDLogType::Notice, "%s disconnected!", pName);
 }
 
+void CMT32Pi::OnUDPMIDIDataReceived(const u8* pData, size_t nSize)
+{
+	// Called from the UDP MIDI task; parsing is left to the main task
+	CTracer::Event(TTraceEvent::UDPMIDIReceive, nSize);
+	const unsigned int nTimestamp = CTimer::GetClockTicks();
+	m_MIDIRouter.Forward(CMIDIRouter::TInput::UDP, pData, nSize, nTimestamp);
+	if (!m_UDPMIDIQueue.EnqueueSysExMessage(pData, nSize, nTimestamp))
+		m_bNetworkMIDIOverflow.store(true, std::memory_order_relaxed);
+}
+
+void CMT32Pi::OnFTPFileChanged(const char* pPath, bool bRemoved)
+{
+	// Called from an FTP worker task; the synths are updated by the main task
+	TFileChange Change;
+	Change.bRemoved = bRemoved;
+	strncpy(Change.Path, pPath, sizeof(Change.Path) - 1);
+	Change.Path[sizeof(Change.Path) - 1] = '\0';
+
+	if (!m_FileChangeQueue.Enqueue(Change))
+		LOGWARN("File change queue full; %s will be picked up after a reboot", pPath);
+}
+
+void CMT32Pi::OnHTTPMetricsRequest(CMetricsWriter& Writer)
+{
+	// Called from the HTTP daemon's task on this core; only reads counters that are maintained anyway
+	char Labels[64];
+
+	Writer.Metric("mt32pi_uptime_seconds", "counter", "Time since boot");
+	Writer.Sample("mt32pi_uptime_seconds", m_pTimer->GetUptime());
+
+	struct TNamedRenderStats
+	{
+		const char* pName;
+		const CRenderStats& Stats;
+	};
+
+	const TNamedRenderStats RenderStats[] =
+	{
+		{ "mt32", m_MT32RenderStats },
+		{ "soundfont", m_SoundFontRenderStats },
+		{ "output", m_OutputStats },
+	};
+
+	Writer.Metric("mt32pi_render_blocks_total", "counter", "Audio blocks by render time as a percentage of playback time (lt = upper bound)");
+	for (const TNamedRenderStats& Named : RenderStats)
+	{
+		for (size_t i = 0; i < CRenderStats::HistogramSize; ++i)
+		{
+			if (i < CRenderStats::HistogramSize - 1)
+				snprintf(Labels, sizeof(Labels), "stage=\"%s\",lt=\"%d\"", Named.pName, CRenderStats::HistogramBounds[i]);
+			else
+				snprintf(Labels, sizeof(Labels), "stage=\"%s\",lt=\"+Inf\"", Named.pName);
+			Writer.Sample("mt32pi_render_blocks_total", Named.Stats.GetHistogramCount(i), Labels);
+		}
+	}
+
+	Writer.Metric("mt32pi_render_load_percent", "gauge", "Render time of the latest audio block as a percentage of its playback time");
+	for (const TNamedRenderStats& Named : RenderStats)
+	{
+		snprintf(Labels, sizeof(Labels), "stage=\"%s\"", Named.pName);
+		Writer.Sample("mt32pi_render_load_percent", Named.Stats.GetLoad(), Labels);
+	}
+
+	Writer.Metric("mt32pi_render_peak_load_percent", "gauge", "Highest render load since the statistics were reset");
+	for (const TNamedRenderStats& Named : RenderStats)
+	{
+		snprintf(Labels, sizeof(Labels), "stage=\"%s\"", Named.pName);
+		Writer.Sample("mt32pi_render_peak_load_percent", Named.Stats.GetPeakLoad(), Labels);
+	}
+
+	Writer.Metric("mt32pi_audio_underruns_total", "counter", "Audio blocks that weren't ready in time");
+	Writer.Sample("mt32pi_audio_underruns_total", m_OutputStats.GetUnderruns());
+
+	Writer.Metric("mt32pi_voices", "gauge", "Active voices (partials for the MT-32)");
+	Writer.Metric("mt32pi_voices_peak", "gauge", "Highest number of active voices since the statistics were reset");
+	Writer.Metric("mt32pi_voices_max", "gauge", "Voice limit");
+
+	// In the same order as the synths' render stats above
+	CSynthBase* const Synths[] = { m_pMT32Synth, m_pSoundFontSynth };
+	for (size_t i = 0; i < Utility::ArraySize(Synths); ++i)
+	{
+		if (!Synths[i])
+			continue;
+
+		snprintf(Labels, sizeof(Labels), "synth=\"%s\"", RenderStats[i].pName);
+		Writer.Sample("mt32pi_voices", RenderStats[i].Stats.GetVoices(), Labels);
+		Writer.Sample("mt32pi_voices_peak", RenderStats[i].Stats.GetPeakVoices(), Labels);
+		Writer.Sample("mt32pi_voices_max", Synths[i]->GetMaxVoiceCount(), Labels);
+	}
+
+	// Prometheus derives rates from the totals
+	const CMIDIInputParser* const Parsers[] =
+	{
+		&m_SerialMIDIParser,
+		&m_USBSerialMIDIParser,
+		&m_USBMIDIParsers[0],
+		&m_USBMIDIParsers[1],
+		&m_RxBufferMIDIParser,
+		&m_AppleMIDIParsers[0],
+		&m_AppleMIDIParsers[1],
+		&m_AppleMIDIParsers[2],
+		&m_AppleMIDIParsers[3],
+		&m_UDPMIDIParser,
+	};
+	static_assert(Utility::ArraySize(m_AppleMIDIParsers) == 4, "Every AppleMIDI session must be listed");
+	static_assert(Utility::ArraySize(m_USBMIDIParsers) == 2, "Every USB-MIDI port must be listed");
+
+	Writer.Metric("mt32pi_midi_received_bytes_total", "counter", "MIDI bytes received per input");
+	for (const CMIDIInputParser* pParser : Parsers)
+	{
+		snprintf(Labels, sizeof(Labels), "source=\"%s\"", pParser->GetName());
+		Writer.Sample("mt32pi_midi_received_bytes_total", pParser->GetReceivedBytes(), Labels);
+	}
+
+	Writer.Metric("mt32pi_midi_received_messages_total", "counter", "Complete MIDI messages received per input");
+	for (const CMIDIInputParser* pParser : Parsers)
+	{
+		snprintf(Labels, sizeof(Labels), "source=\"%s\"", pParser->GetName());
+		Writer.Sample("mt32pi_midi_received_messages_total", pParser->GetReceivedMessages(), Labels);
+	}
+
+	Writer.Metric("mt32pi_midi_rx_buffer_peak_bytes", "gauge", "Highest fill level of the MIDI receive buffer since the statistics were reset");
+	Writer.Sample("mt32pi_midi_rx_buffer_peak_bytes", m_MIDIRxBuffer.GetHighWaterMark());
+
+	if (m_pPisound)
+	{
+		Writer.Metric("mt32pi_pisound_spi_transfers_total", "counter", "SPI transactions made to read Pisound MIDI input");
+		Writer.Sample("mt32pi_pisound_spi_transfers_total", m_pPisound->GetTransfers());
+		Writer.Metric("mt32pi_pisound_received_bytes_total", "counter", "MIDI bytes read from the Pisound");
+		Writer.Sample("mt32pi_pisound_received_bytes_total", m_pPisound->GetReceivedBytes());
+		Writer.Metric("mt32pi_pisound_byte_rate", "gauge", "Pisound MIDI bytes received per second");
+		Writer.Sample("mt32pi_pisound_byte_rate", m_pPisound->GetByteRate(), "period=\"last\"");
+		Writer.Sample("mt32pi_pisound_byte_rate", m_pPisound->GetPeakByteRate(), "period=\"peak\"");
+	}
+
+	if (m_pAppleMIDIParticipant)
+	{
+		const CAppleMIDIParticipant::TJitterStats JitterStats = m_pAppleMIDIParticipant->GetJitterStats();
+
+		Writer.Metric("mt32pi_rtpmidi_packets_total", "counter", "RTP-MIDI packets received");
+		Writer.Sample("mt32pi_rtpmidi_packets_total", JitterStats.nPackets);
+		Writer.Metric("mt32pi_rtpmidi_late_packets_total", "counter", "RTP-MIDI packets that arrived after their playback time");
+		Writer.Sample("mt32pi_rtpmidi_late_packets_total", JitterStats.nLatePackets);
+		Writer.Metric("mt32pi_rtpmidi_lost_packets_total", "counter", "RTP-MIDI packets missing from the sequence");
+		Writer.Sample("mt32pi_rtpmidi_lost_packets_total", JitterStats.nLostPackets);
+		Writer.Metric("mt32pi_rtpmidi_jitter_microseconds", "gauge", "RTP-MIDI interarrival jitter estimate");
+		Writer.Sample("mt32pi_rtpmidi_jitter_microseconds", JitterStats.nJitterMicros);
+		Writer.Metric("mt32pi_rtpmidi_peak_transit_microseconds", "gauge", "Highest RTP-MIDI transit time since the statistics were reset");
+		Writer.Sample("mt32pi_rtpmidi_peak_transit_microseconds", JitterStats.nPeakTransitMicros);
+	}
+
+	if (const CPCMStreamer* const pPCMStreamer = m_pPCMStreamer.load(std::memory_order_relaxed))
+	{
+		Writer.Metric("mt32pi_pcm_stream_dropped_frames_total", "counter", "Audio frames left out of the network stream");
+		Writer.Sample("mt32pi_pcm_stream_dropped_frames_total", pPCMStreamer->GetDroppedFrames());
+	}
+
+	if (m_pMIDICapture)
+	{
+		Writer.Metric("mt32pi_midi_capture_dropped_messages_total", "counter", "MIDI messages left out of capture files");
+		Writer.Sample("mt32pi_midi_capture_dropped_messages_total", m_pMIDICapture->GetDroppedMessages());
+	}
+
+	CZoneAllocator::TStats MemoryStats;
+	CZoneAllocator::Get()->GetStats(MemoryStats);
+
+	Writer.Metric("mt32pi_heap_bytes", "gauge", "Heap memory");
+	Writer.Sample("mt32pi_heap_bytes", MemoryStats.nHeapSize, "state=\"total\"");
+	Writer.Sample("mt32pi_heap_bytes", MemoryStats.nUsedSize, "state=\"used\"");
+	Writer.Sample("mt32pi_heap_bytes", MemoryStats.nPeakSize, "state=\"peak\"");
+	Writer.Sample("mt32pi_heap_bytes", MemoryStats.nFreeSize, "state=\"free\"");
+	Writer.Sample("mt32pi_heap_bytes", MemoryStats.nLargestFreeBlock, "state=\"largest_free_block\"");
+	Writer.Metric("mt32pi_heap_fragmentation_percent", "gauge", "Free memory not in the largest free block");
+	Writer.Sample("mt32pi_heap_fragmentation_percent", MemoryStats.nFragmentation);
+
+	Writer.Metric("mt32pi_heap_tag_bytes", "gauge", "Heap memory in use per allocation tag");
+	for (size_t i = TZoneTag::Uncategorized; i < CZoneAllocator::TagCount; ++i)
+	{
+		snprintf(Labels, sizeof(Labels), "tag=\"%s\"", CZoneAllocator::GetTagName(i));
+		Writer.Sample("mt32pi_heap_tag_bytes", MemoryStats.Tags[i].nUsedSize, Labels);
+	}
+
+	Writer.Metric("mt32pi_temperature_celsius", "gauge", "SoC temperature");
+	Writer.Sample("mt32pi_temperature_celsius", GetCurrentTemperature());
+	Writer.Metric("mt32pi_arm_clock_hz", "gauge", "ARM clock rate");
+	Writer.Sample("mt32pi_arm_clock_hz", GetCurrentClockRate());
+	Writer.Metric("mt32pi_throttled_status", "gauge", "Firmware throttling flags (see the vcgencmd get_throttled documentation)");
+	Writer.Sample("mt32pi_throttled_status", GetThrottledStatus());
+}
+
 bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 {
 	if (nSize < 4)
@@ -727,6 +1714,14 @@ bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 	{
 		LOGNOTE("Reboot command received");
 		m_bRunning = false;
+		Utility::SendEvent();
+		return true;
+	}
+
+	// Reload configuration file (F0 7D 0A F7)
+	if (nSize == 4 && Command == TCustomSysExCommand::ReloadConfig)
+	{
+		ReloadConfig();
 		return true;
 	}
 
@@ -760,8 +1755,53 @@ bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 		// Swap MT-32 stereo channels (F0 7D 04 xx F7)
 		case TCustomSysExCommand::SetMT32ReversedStereo:
 		{
-			if (m_pMT32Synth)
-				m_pMT32Synth->SetReversedStereo(nParameter);
+			if (m_pMT32Synth)
+				m_pMT32Synth->SetReversedStereo(nParameter);
+			return true;
+		}
+
+		// Report (xx = 0) or reset (xx = 1) render statistics (F0 7D 05 xx F7)
+		case TCustomSysExCommand::RenderStats:
+		{
+			if (nParameter)
+				ResetRenderStats();
+			else
+				ReportRenderStats();
+			return true;
+		}
+
+		// Report (xx = 0) memory statistics or reset their peak values (xx = 1) (F0 7D 06 xx F7)
+		case TCustomSysExCommand::MemoryStats:
+		{
+			if (nParameter)
+				CZoneAllocator::Get()->ResetPeaks();
+			else
+				ReportMemoryStats();
+			return true;
+		}
+
+		// Save the trace now (xx = 0) or resume recording after a dropout (xx = 1) (F0 7D 07 xx F7)
+		case TCustomSysExCommand::Trace:
+		{
+			if (nParameter)
+				CTracer::Resume();
+			else
+				CTracer::RequestDump();
+			return true;
+		}
+
+		// Hide (xx = 0) or show (xx = 1) the performance page (F0 7D 08 xx F7)
+		case TCustomSysExCommand::PerformancePage:
+			SetPerformancePageVisible(nParameter);
+			return true;
+
+		// Stop (xx = 0) or start (xx = 1) capturing MIDI to a file (F0 7D 09 xx F7)
+		case TCustomSysExCommand::MIDICapture:
+		{
+			if (nParameter)
+				StartMIDICapture();
+			else
+				StopMIDICapture();
 			return true;
 		}
 
@@ -770,6 +1810,11 @@ bool CMT32Pi::ParseCustomSysEx(const u8* pData, size_t nSize)
 	}
 }
 
+void CMT32Pi::OnMIDIEventQueueOverflow()
+{
+	m_DeferredLog.Raise(TDeferredLogMessage::MIDIEventQueueOverflow);
+}
+
 void CMT32Pi::UpdateUSB(bool bStartup)
 {
 	if (!m_bUSBAvailable || !m_pUSBHCI->UpdatePlugAndPlay())
@@ -784,27 +1829,21 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 		// USB disk was attached
 		LOGNOTE("USB mass storage device attached");
 
-		if (f_mount(&m_USBFileSystem, "USB:", 1) != FR_OK)
-			LOGERR("Failed to mount USB mass storage device");
+		// During startup, the synths scan the disk when they are initialized
+		if (bStartup)
+		{
+			CFileSystemLockGuard Lock;
+			if (f_mount(&m_USBFileSystem, "USB:", 1) != FR_OK)
+				LOGERR("Failed to mount USB mass storage device");
+		}
 		else
 		{
-			if (!bStartup)
-			{
-				LCDLog(TLCDLogType::Spinner, "MT-32 ROM rescan");
-				if (m_pMT32Synth)
-					m_pMT32Synth->GetROMManager().ScanROMs();
-				else
-					InitMT32Synth();
-
-				LCDLog(TLCDLogType::Spinner, "SoundFont rescan");
-				if (m_pSoundFontSynth)
-					m_pSoundFontSynth->GetSoundFontManager().ScanSoundFonts();
-				else
-					InitSoundFontSynth();
+			if (!m_pStorageScanner)
+				m_pStorageScanner = new CStorageScanner(&m_USBFileSystem, "USB:");
 
-				if (m_pSoundFontSynth)
-					LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
-			}
+			// A synth still being initialized by core 3 is rescanned when the main task adopts it
+			LCDLog(TLCDLogType::Spinner, "USB disk scan");
+			m_pStorageScanner->Mount(m_pMT32Synth ? &m_pMT32Synth->GetROMManager() : nullptr);
 		}
 	}
 	else if (m_pUSBMassStorageDevice && !pUSBMassStorageDevice)
@@ -812,15 +1851,13 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 		// USB disk was removed
 		LOGNOTE("USB mass storage device removed");
 
-		f_unmount("USB:");
-
 		// Only need to rescan SoundFonts on storage removal; MT-32 ROMs are kept in memory
+		if (!m_pStorageScanner)
+			m_pStorageScanner = new CStorageScanner(&m_USBFileSystem, "USB:");
+
 		if (m_pSoundFontSynth)
-		{
 			LCDLog(TLCDLogType::Spinner, "SoundFont rescan");
-			m_pSoundFontSynth->GetSoundFontManager().ScanSoundFonts();
-			LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
-		}
+		m_pStorageScanner->Unmount(m_pSoundFontSynth != nullptr);
 	}
 	m_pUSBMassStorageDevice = pUSBMassStorageDevice;
 
@@ -841,6 +1878,43 @@ void CMT32Pi::UpdateUSB(bool bStartup)
 	}
 }
 
+// Returns true while the scan task is busy
+bool CMT32Pi::UpdateStorageScan()
+{
+	if (!m_pStorageScanner)
+		return false;
+
+	if (m_pStorageScanner->IsBusy())
+		return true;
+
+	if (!m_pStorageScanner->IsComplete())
+		return false;
+
+	// A pending or in-progress SoundFont switch holds an index into the list; wait until it's done
+	if (m_bDeferredSoundFontSwitchFlag || (m_pSoundFontSynth && m_pSoundFontSynth->IsSwitchingSoundFont()))
+		return false;
+
+	// Also wait for a synth still being initialized by core 3
+	if (!m_bBootComplete.load(std::memory_order_acquire))
+		return false;
+
+	m_pStorageScanner->Acknowledge();
+
+	// The disk may have brought the first usable ROMs or SoundFonts
+	if (!m_pMT32Synth && m_pUSBMassStorageDevice)
+		InitMT32Synth();
+
+	if (m_pSoundFontSynth)
+	{
+		m_pSoundFontSynth->ReplaceSoundFontList(m_pStorageScanner->GetSoundFontList());
+		LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
+	}
+	else if (m_pUSBMassStorageDevice && InitSoundFontSynth())
+		LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
+
+	return false;
+}
+
 void CMT32Pi::UpdateNetwork()
 {
 	if (!m_pNet)
@@ -864,7 +1938,14 @@ void CMT32Pi::UpdateNetwork()
 
 		if (m_pConfig->NetworkRTPMIDI && !m_pAppleMIDIParticipant)
 		{
-			m_pAppleMIDIParticipant = new CAppleMIDIParticipant(&m_Random, this);
+			int nJitterBufferMillis = Utility::Clamp(m_pConfig->NetworkRTPMIDIJitterBuffer, 0, 100);
+			if (nJitterBufferMillis && !m_pConfig->MIDISampleAccurate)
+			{
+				LOGWARN("RTP-MIDI jitter buffer requires sample-accurate MIDI; disabled");
+				nJitterBufferMillis = 0;
+			}
+
+			m_pAppleMIDIParticipant = new CAppleMIDIParticipant(&m_Random, this, nJitterBufferMillis);
 			if (!m_pAppleMIDIParticipant->Initialize())
 			{
 				LOGERR("Failed to init AppleMIDI receiver");
@@ -890,7 +1971,7 @@ void CMT32Pi::UpdateNetwork()
 
 		if (m_pConfig->NetworkFTPServer && !m_pFTPDaemon)
 		{
-			m_pFTPDaemon = new CFTPDaemon(m_pConfig->NetworkFTPUsername, m_pConfig->NetworkFTPPassword);
+			m_pFTPDaemon = new CFTPDaemon(m_pConfig->NetworkFTPUsername, m_pConfig->NetworkFTPPassword, this);
 			if (!m_pFTPDaemon->Initialize())
 			{
 				LOGERR("Failed to init FTP daemon");
@@ -900,6 +1981,22 @@ void CMT32Pi::UpdateNetwork()
 			else
 				LOGNOTE("FTP daemon initialized");
 		}
+
+		if (m_pConfig->NetworkHTTPServer && !m_pHTTPDaemon)
+		{
+			m_pHTTPDaemon = new CHTTPDaemon(this);
+			if (!m_pHTTPDaemon->Initialize())
+			{
+				LOGERR("Failed to init HTTP daemon");
+				delete m_pHTTPDaemon;
+				m_pHTTPDaemon = nullptr;
+			}
+			else
+				LOGNOTE("HTTP daemon initialized");
+		}
+
+		if (m_pConfig->NetworkPCMStream && !m_pPCMStreamer.load(std::memory_order_relaxed))
+			InitPCMStreamer();
 	}
 	else if (m_bNetworkReady && !bNetIsRunning)
 	{
@@ -908,32 +2005,146 @@ void CMT32Pi::UpdateNetwork()
 		LCDLog(TLCDLogType::Notice, "%s disconnected!", GetNetworkDeviceShortName());
 
 	}
+
+	// Send queued audio
+	if (CPCMStreamer* const pPCMStreamer = m_pPCMStreamer.load(std::memory_order_relaxed))
+		pPCMStreamer->Update();
 }
 
-void CMT32Pi::UpdateMIDI()
+void CMT32Pi::InitPCMStreamer()
+{
+	const int nPort = m_pConfig->NetworkPCMStreamPort;
+	if (m_pConfig->NetworkPCMStreamAddress.IsNull() || nPort <= 0 || nPort > 65535)
+	{
+		LOGERR("Invalid audio stream destination");
+		return;
+	}
+
+	CPCMStreamer* const pPCMStreamer = new CPCMStreamer(m_pConfig->NetworkPCMStreamAddress, nPort, m_pConfig->AudioSampleRate, &m_Random);
+	if (!pPCMStreamer->Initialize())
+	{
+		LOGERR("Failed to init audio streaming");
+		delete pPCMStreamer;
+		return;
+	}
+
+	// The audio task starts copying blocks from here on
+	m_pPCMStreamer.store(pPCMStreamer, std::memory_order_release);
+	LOGNOTE("Audio streaming initialized");
+}
+
+static bool IsConfigFile(const char* pPath)
+{
+	// Uploads to the root of the SD card may or may not have a slash after the volume name
+	const size_t nVolumeLength = strlen("SD:");
+	if (strncasecmp(pPath, ConfigFile, nVolumeLength))
+		return false;
+
+	pPath += nVolumeLength;
+	if (*pPath == '/')
+		++pPath;
+
+	return !strcasecmp(pPath, ConfigFile + nVolumeLength);
+}
+
+void CMT32Pi::ProcessFileChanges()
+{
+	// A pending or in-progress SoundFont switch holds an index into the list; wait until it's done
+	if (m_bDeferredSoundFontSwitchFlag || (m_pSoundFontSynth && m_pSoundFontSynth->IsSwitchingSoundFont()))
+		return;
+
+	// Also wait for a synth still being initialized by core 3
+	if (!m_bBootComplete.load(std::memory_order_acquire))
+		return;
+
+	TFileChange Change;
+	while (m_FileChangeQueue.Dequeue(Change))
+	{
+		if (!Change.bRemoved && IsConfigFile(Change.Path))
+		{
+			ReloadConfig();
+			continue;
+		}
+
+		// ROMs are kept in memory once loaded, so only new files matter
+		if (!Change.bRemoved)
+		{
+			if (m_pMT32Synth)
+				m_pMT32Synth->GetROMManager().AddROM(Change.Path);
+			else
+				InitMT32Synth();
+		}
+
+		if (m_pSoundFontSynth)
+		{
+			const size_t nOldCount = m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount();
+			m_pSoundFontSynth->OnSoundFontFileChanged(Change.Path, Change.bRemoved);
+
+			const size_t nNewCount = m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount();
+			if (nNewCount != nOldCount)
+				LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", nNewCount);
+		}
+		else if (!Change.bRemoved && InitSoundFontSynth())
+			LCDLog(TLCDLogType::Notice, "%d SoundFonts avail", m_pSoundFontSynth->GetSoundFontManager().GetSoundFontCount());
+	}
+}
+
+bool CMT32Pi::UpdateMIDI()
 {
-	size_t nBytes;
 	u8 Buffer[MIDIRxBufferSize];
 
+	CTracer::CScope TraceScope(TTraceEvent::MIDIUpdate);
+	const unsigned int nTimestamp = CTimer::GetClockTicks();
+
+	// Send MIDI thru data that couldn't be sent from interrupt context
+	m_MIDIRouter.Update(m_pUSBSerialDevice);
+
+	// Pisound MIDI data is read over SPI here, rather than in its interrupt handler
+	if (m_pPisound)
+		m_pPisound->Update();
+
+	// USB-MIDI packets already contain complete messages
+	size_t nReceived = ProcessUSBMIDIPackets(nTimestamp);
+
 	// Read MIDI messages from serial device or ring buffer
 	if (m_bSerialMIDIEnabled)
-		nBytes = ReceiveSerialMIDI(Buffer, sizeof(Buffer));
+	{
+		// Serial MIDI data is parsed using its arrival timestamps
+		nReceived += ProcessSerialMIDI();
+	}
 	else if (m_pUSBSerialDevice)
 	{
 		const int nResult = m_pUSBSerialDevice->Read(Buffer, sizeof(Buffer));
-		nBytes = nResult > 0 ? static_cast<size_t>(nResult) : 0;
+		if (nResult > 0)
+		{
+			m_MIDIRouter.Forward(CMIDIRouter::TInput::USBSerial, Buffer, nResult, nTimestamp);
+			m_USBSerialMIDIParser.ParseMIDIBytes(Buffer, nResult, nTimestamp);
+			nReceived += nResult;
+		}
 	}
 	else
-		nBytes = m_MIDIRxBuffer.Dequeue(Buffer, sizeof(Buffer));
+	{
+		const size_t nBytes = m_MIDIRxBuffer.Dequeue(Buffer, sizeof(Buffer));
+		m_RxBufferMIDIParser.ParseMIDIBytes(Buffer, nBytes, nTimestamp);
+		nReceived += nBytes;
+	}
 
-	if (nBytes == 0)
-		return;
+	// Reset the Active Sense timer
+	if (nReceived)
+		m_nActiveSenseTime = m_pTimer->GetTicks();
 
-	// Process MIDI messages
-	ParseMIDIBytes(Buffer, nBytes);
+	for (size_t i = 0; i < CAppleMIDIParticipant::MaxSessions; ++i)
+		nReceived += ProcessNetworkMIDI(m_AppleMIDIQueues[i], m_AppleMIDIParsers[i]);
+	nReceived += ProcessNetworkMIDI(m_UDPMIDIQueue, m_UDPMIDIParser);
 
-	// Reset the Active Sense timer
-	s_pThis->m_nActiveSenseTime = s_pThis->m_pTimer->GetTicks();
+	DispatchMIDIMessages();
+
+	// Only record updates that did something
+	TraceScope.SetArg(nReceived);
+	if (!nReceived)
+		TraceScope.Cancel();
+
+	return nReceived > 0;
 }
 
 void CMT32Pi::PurgeMIDIBuffers()
@@ -942,75 +2153,228 @@ void CMT32Pi::PurgeMIDIBuffers()
 	u8 Buffer[MIDIRxBufferSize];
 
 	// Process MIDI messages from all devices/ring buffers, but ignore note-ons
-	while (m_bSerialMIDIEnabled && (nBytes = ReceiveSerialMIDI(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+	const unsigned int nTimestamp = CTimer::GetClockTicks();
+
+	while (m_bSerialMIDIEnabled && ProcessSerialMIDI(true) > 0)
+		;
 
 	while (m_pUSBSerialDevice && (nBytes = m_pUSBSerialDevice->Read(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+		m_USBSerialMIDIParser.ParseMIDIBytes(Buffer, nBytes, nTimestamp, true);
+
+	if (m_pPisound)
+		m_pPisound->Update();
 
 	while ((nBytes = m_MIDIRxBuffer.Dequeue(Buffer, sizeof(Buffer))) > 0)
-		ParseMIDIBytes(Buffer, nBytes, true);
+		m_RxBufferMIDIParser.ParseMIDIBytes(Buffer, nBytes, nTimestamp, true);
+
+	while (ProcessUSBMIDIPackets(nTimestamp, true) > 0)
+		;
+
+	for (size_t i = 0; i < CAppleMIDIParticipant::MaxSessions; ++i)
+		ProcessNetworkMIDI(m_AppleMIDIQueues[i], m_AppleMIDIParsers[i], true);
+	ProcessNetworkMIDI(m_UDPMIDIQueue, m_UDPMIDIParser, true);
+
+	DispatchMIDIMessages();
+}
+
+size_t CMT32Pi::ProcessUSBMIDIPackets(unsigned int nTimestamp, bool bIgnoreNoteOns)
+{
+	TUSBMIDIPacket Packets[USBMIDIPacketBufferSize];
+	const size_t nPackets = m_USBMIDIPacketBuffer.Dequeue(Packets, Utility::ArraySize(Packets));
+
+	// Each cable is a separate stream
+	for (size_t i = 0; i < nPackets; ++i)
+	{
+		CMIDIInputParser& Parser = m_USBMIDIParsers[Utility::Min(static_cast<size_t>(Packets[i].nCable), USBMIDIPorts - 1)];
+		Parser.ParseMIDIPacket(Packets[i].Data, Packets[i].nLength, nTimestamp, bIgnoreNoteOns);
+	}
+
+	return nPackets;
+}
+
+size_t CMT32Pi::ProcessNetworkMIDI(TNetworkMIDIQueue& Queue, CMIDIInputParser& Parser, bool bIgnoreNoteOns)
+{
+	TMIDIEvent Event;
+	size_t nBytes = 0;
+
+	if (m_bNetworkMIDIOverflow.exchange(false, std::memory_order_relaxed))
+		m_DeferredLog.Raise(TDeferredLogMessage::NetworkMIDIOverrun);
+
+	while (Queue.Dequeue(Event))
+	{
+		Parser.ParseMIDIBytes(Event.pSysExData, Event.nMessage, Event.nTimestamp, bIgnoreNoteOns);
+		nBytes += Event.nMessage;
+	}
+
+	return nBytes;
+}
+
+void CMT32Pi::DispatchMIDIMessages()
+{
+	TMIDIEvent Event;
+	const bool bForward = m_MIDIRouter.HasRoutes(CMIDIRouter::TInput::Synth);
+
+	while (m_MIDIMergeQueue.Dequeue(Event))
+	{
+		m_nMIDITimestamp = Event.nTimestamp;
+
+		if (m_pMIDICapture)
+		{
+			if (Event.pSysExData)
+				m_pMIDICapture->CaptureSysExMessage(Event.pSysExData, Event.nMessage, Event.nTimestamp);
+			else
+				m_pMIDICapture->CaptureShortMessage(Event.nMessage, Event.nTimestamp);
+		}
+
+		// Forward the merged stream
+		if (bForward && Event.pSysExData)
+			m_MIDIRouter.Forward(CMIDIRouter::TInput::Synth, Event.pSysExData, Event.nMessage, Event.nTimestamp);
+		else if (bForward)
+		{
+			const u8 Bytes[] = { static_cast<u8>(Event.nMessage), static_cast<u8>(Event.nMessage >> 8), static_cast<u8>(Event.nMessage >> 16) };
+			const size_t nLength = Utility::Max(CMIDIParser::GetShortMessageLength(Bytes[0]), static_cast<size_t>(1));
+			m_MIDIRouter.Forward(CMIDIRouter::TInput::Synth, Bytes, nLength, Event.nTimestamp);
+		}
+
+		if (Event.pSysExData)
+			OnSysExMessage(Event.pSysExData, Event.nMessage);
+		else
+			OnShortMessage(Event.nMessage);
+	}
+
+	ReportMIDIInputErrors(m_SerialMIDIParser);
+	ReportMIDIInputErrors(m_USBSerialMIDIParser);
+	for (CMIDIInputParser& Parser : m_USBMIDIParsers)
+		ReportMIDIInputErrors(Parser);
+	ReportMIDIInputErrors(m_RxBufferMIDIParser);
+	for (CMIDIInputParser& Parser : m_AppleMIDIParsers)
+		ReportMIDIInputErrors(Parser);
+	ReportMIDIInputErrors(m_UDPMIDIParser);
 }
 
-size_t CMT32Pi::ReceiveSerialMIDI(u8* pOutData, size_t nSize)
+void CMT32Pi::ReportMIDIInputErrors(CMIDIInputParser& Parser)
 {
-	// Read serial MIDI data
-	int nResult = m_pSerial->Read(pOutData, nSize);
+	const u8 nErrors = Parser.TakeErrors();
+	if (!nErrors)
+		return;
+
+	if (nErrors & CMIDIInputParser::QueueOverflow)
+	{
+		LOGWARN("%s MIDI input overflowed the merge queue", Parser.GetName());
+		OnMIDIEventQueueOverflow();
+	}
+	else if (nErrors & CMIDIInputParser::SysExOverflow)
+		m_DeferredLog.Raise(TDeferredLogMessage::SysExOverflow);
+	else if ((nErrors & CMIDIInputParser::UnexpectedStatus) && m_pConfig->SystemVerbose)
+		m_DeferredLog.Raise(TDeferredLogMessage::UnexpectedMIDIStatus);
+}
 
-	// No data
-	if (nResult == 0)
-		return 0;
+void CMT32Pi::PollSerialMIDI()
+{
+	// Called from interrupt context when the poll timer is running
+	const unsigned int nTimestamp = CTimer::GetClockTicks();
+	u8 Buffer[16];
+	TSerialMIDIByte Bytes[sizeof(Buffer)];
+	int nResult;
 
-	// Error
-	if (nResult < 0)
+	while ((nResult = m_pSerial->Read(Buffer, sizeof(Buffer))) != 0)
 	{
-		if (m_pConfig->SystemVerbose)
+		// Error; reported by the main task
+		if (nResult < 0)
 		{
-			const char* pErrorString;
-			switch (nResult)
-			{
-				case -SERIAL_ERROR_BREAK:
-					pErrorString = "UART break error!";
-					break;
+			m_nSerialMIDIError.store(nResult, std::memory_order_relaxed);
+			break;
+		}
 
-				case -SERIAL_ERROR_OVERRUN:
-					pErrorString = "UART overrun error!";
-					break;
+		if (!m_MIDIRouter.Forward(CMIDIRouter::TInput::GPIO, Buffer, nResult, nTimestamp))
+			m_bSerialMIDIThruError.store(true, std::memory_order_relaxed);
 
-				case -SERIAL_ERROR_FRAMING:
-					pErrorString = "UART framing error!";
-					break;
+		for (int i = 0; i < nResult; ++i)
+			Bytes[i] = { nTimestamp, Buffer[i] };
 
-				default:
-					pErrorString = "Unknown UART error!";
-					break;
-			}
+		if (m_SerialMIDIRxBuffer.Enqueue(Bytes, nResult) != static_cast<size_t>(nResult))
+		{
+			m_nSerialMIDIError.store(-SERIAL_ERROR_OVERRUN, std::memory_order_relaxed);
+			break;
+		}
+	}
+}
+
+size_t CMT32Pi::ProcessSerialMIDI(bool bIgnoreNoteOns)
+{
+	TSerialMIDIByte Batch[SerialMIDIBatchSize];
+	u8 Data[SerialMIDIBatchSize];
+	size_t nBytes = 0;
+
+	if (!m_bSerialMIDITimerRunning)
+		PollSerialMIDI();
+
+	ReportSerialMIDIErrors();
+
+	// Only what was queued on entry, so that a busy UART can't hold up the main loop
+	size_t nRemaining = m_SerialMIDIRxBuffer.GetCount();
+	while (nRemaining)
+	{
+		const size_t nCount = m_SerialMIDIRxBuffer.Dequeue(Batch, Utility::Min(nRemaining, SerialMIDIBatchSize));
+		if (!nCount)
+			break;
+
+		// Parse each run of bytes read by the same poll with its timestamp
+		size_t nRunStart = 0;
+		for (size_t i = 0; i < nCount; ++i)
+		{
+			Data[i] = Batch[i].nData;
 
-			LOGWARN(pErrorString);
-			LCDLog(TLCDLogType::Warning, pErrorString);
+			if (i + 1 == nCount || Batch[i + 1].nTimestamp != Batch[nRunStart].nTimestamp)
+			{
+				m_SerialMIDIParser.ParseMIDIBytes(Data + nRunStart, i + 1 - nRunStart, Batch[nRunStart].nTimestamp, bIgnoreNoteOns);
+				nRunStart = i + 1;
+			}
 		}
 
-		return 0;
+		nBytes += nCount;
+		nRemaining -= nCount;
 	}
 
-	// Replay received MIDI data out via the serial port ('software thru')
-	if (m_pConfig->MIDIGPIOThru)
+	return nBytes;
+}
+
+void CMT32Pi::ReportSerialMIDIErrors()
+{
+	const int nError = m_nSerialMIDIError.exchange(0, std::memory_order_relaxed);
+	if (nError && m_pConfig->SystemVerbose)
 	{
-		int nSendResult = m_pSerial->Write(pOutData, nResult);
-		if (nSendResult != nResult)
+		TDeferredLogMessage Message;
+		switch (nError)
 		{
-			LOGERR("received %d bytes, but only sent %d bytes", nResult, nSendResult);
-			LCDLog(TLCDLogType::Error, "UART TX error!");
+			case -SERIAL_ERROR_BREAK:
+				Message = TDeferredLogMessage::UARTBreakError;
+				break;
+
+			case -SERIAL_ERROR_OVERRUN:
+				Message = TDeferredLogMessage::UARTOverrunError;
+				break;
+
+			case -SERIAL_ERROR_FRAMING:
+				Message = TDeferredLogMessage::UARTFramingError;
+				break;
+
+			default:
+				Message = TDeferredLogMessage::UARTUnknownError;
+				break;
 		}
+
+		m_DeferredLog.Raise(Message);
 	}
 
-	return static_cast<size_t>(nResult);
+	if (m_bSerialMIDIThruError.exchange(false, std::memory_order_relaxed))
+		m_DeferredLog.Raise(TDeferredLogMessage::UARTTxError);
 }
 
-void CMT32Pi::ProcessEventQueue()
+bool CMT32Pi::ProcessEventQueue()
 {
-	TEvent Buffer[EventQueueSize];
-	const size_t nEvents = m_EventQueue.Dequeue(Buffer, sizeof(Buffer));
+	TEvent Buffer[TEventQueue::MaxDequeueCount];
+	const size_t nEvents = m_EventQueue.Dequeue(Buffer, Utility::ArraySize(Buffer));
 
 	// We got some events, wake up
 	if (nEvents > 0)
@@ -1054,13 +2418,40 @@ void CMT32Pi::ProcessEventQueue()
 				break;
 		}
 	}
+
+	return nEvents > 0;
 }
 
 void CMT32Pi::ProcessButtonEvent(const TButtonEvent& Event)
 {
+	// Pressing volume down and volume up together reloads the configuration file
+	if (Event.Button == TButton::Button3 || Event.Button == TButton::Button4)
+	{
+		bool& bHeld = Event.Button == TButton::Button3 ? m_bVolumeDownHeld : m_bVolumeUpHeld;
+		if (!Event.bRepeat)
+		{
+			if (Event.bPressed && !m_bVolumeDownHeld && !m_bVolumeUpHeld)
+				m_nVolumeBeforeCombo = m_nMasterVolume;
+			bHeld = Event.bPressed;
+		}
+
+		if (m_bVolumeDownHeld && m_bVolumeUpHeld)
+		{
+			if (!Event.bRepeat)
+			{
+				// Undo the step taken by whichever button went down first
+				SetMasterVolume(m_nVolumeBeforeCombo);
+				ReloadConfig();
+			}
+			return;
+		}
+	}
+
 	if (Event.Button == TButton::EncoderButton)
 	{
-		LCDLog(TLCDLogType::Notice, "Enc. button %s", Event.bPressed ? "PRESSED" : "RELEASED");
+		// Toggle the performance page
+		if (Event.bPressed && !Event.bRepeat)
+			SetPerformancePageVisible(!m_UserInterface.IsPerformancePageVisible());
 		return;
 	}
 
@@ -1115,6 +2506,70 @@ void CMT32Pi::ProcessButtonEvent(const TButtonEvent& Event)
 	}
 }
 
+void CMT32Pi::SetPerformancePageVisible(bool bVisible)
+{
+	if (!m_pLCD)
+	{
+		LOGWARN("No LCD for the performance page");
+		return;
+	}
+
+	m_UserInterface.SetPerformancePageVisible(bVisible);
+}
+
+void CMT32Pi::ReloadConfig()
+{
+	CConfig::TLiveChanges Changes;
+	const int nRestartOptions = m_pConfig->Reload(ConfigFile, Changes);
+	if (nRestartOptions < 0)
+	{
+		LCDLog(TLCDLogType::Error, "Config reload failed");
+		return;
+	}
+
+	LOGNOTE("Configuration reloaded");
+
+	if (m_pMT32Synth)
+	{
+		if (Changes.bMT32EmuGain)
+			m_pMT32Synth->SetGain(m_pConfig->MT32EmuGain, m_pConfig->MT32EmuReverbGain);
+
+		if (Changes.bMT32EmuMIDIChannels)
+		{
+			m_pMT32Synth->SetMIDIChannels(m_pConfig->MT32EmuMIDIChannels);
+			if (m_bLayeredSynths)
+				m_nLayeredMT32ChannelMask = m_pConfig->MT32EmuMIDIChannels == CMT32Synth::TMIDIChannels::Alternate ? 0x02FF : 0x03FE;
+		}
+	}
+
+	if (m_pSoundFontSynth && (Changes.bFluidSynthGain || Changes.bFluidSynthPolyphony || Changes.bFluidSynthEffects))
+		m_pSoundFontSynth->ApplyConfigChanges(Changes.bFluidSynthEffects);
+
+	if (nRestartOptions)
+		LCDLog(TLCDLogType::Warning, "%d need restart", nRestartOptions);
+	else
+		LCDLog(TLCDLogType::Notice, "Config reloaded");
+}
+
+void CMT32Pi::StartMIDICapture()
+{
+	if (!m_pMIDICapture)
+		m_pMIDICapture = new CMIDICapture();
+
+	// Prefer a USB disk if one is attached
+	if (m_pMIDICapture->Start(m_pUSBMassStorageDevice ? USBCapturePath : SDCapturePath))
+		LCDLog(TLCDLogType::Notice, "MIDI capture on");
+}
+
+void CMT32Pi::StopMIDICapture()
+{
+	if (!m_pMIDICapture || !m_pMIDICapture->IsCapturing())
+		return;
+
+	m_pMIDICapture->Stop();
+	LCDLog(TLCDLogType::Notice, "MIDI capture off");
+}
+
 void CMT32Pi::SwitchSynth(TSynth NewSynth)
 {
 	CSynthBase* pNewSynth = nullptr;
@@ -1126,7 +2581,10 @@ void CMT32Pi::SwitchSynth(TSynth NewSynth)
 
 	if (pNewSynth == nullptr)
 	{
-		LCDLog(TLCDLogType::Warning, "Synth unavailable!");
+		if (!m_bBootComplete.load(std::memory_order_acquire))
+			LCDLog(TLCDLogType::Warning, "Synth starting up!");
+		else
+			LCDLog(TLCDLogType::Warning, "Synth unavailable!");
 		return;
 	}
 
@@ -1136,7 +2594,18 @@ void CMT32Pi::SwitchSynth(TSynth NewSynth)
 		return;
 	}
 
-	m_pCurrentSynth->AllSoundOff();
+	// In layered mode both synths keep playing; only the synth shown on the display changes
+	if (!m_bLayeredSynths)
+	{
+		if (m_pConfig->SystemSwitchCrossfade)
+		{
+			// The audio core fades out the previous synth over its next block; it must see this before the new current synth
+			m_pFadeOutSynth.store(m_pCurrentSynth, std::memory_order_release);
+			DataMemBarrier();
+		}
+		else
+			m_pCurrentSynth->AllSoundOff();
+	}
 	m_pCurrentSynth = pNewSynth;
 	const char* pMode = NewSynth == TSynth::MT32 ? "MT-32 mode" : "SoundFont mode";
 	LOGNOTE("Switching to %s", pMode);
@@ -1172,8 +2641,9 @@ void CMT32Pi::SwitchSoundFont(size_t nIndex)
 	LOGNOTE("Switching to SoundFont %d", nIndex);
 	if (m_pSoundFontSynth->SwitchSoundFont(nIndex))
 	{
-		// Handle any MIDI data that has been queued up while busy
-		PurgeMIDIBuffers();
+		// Handle any MIDI data that has been queued up while the SoundFont was loading; warm switches are instant
+		if (m_pSoundFontSynth->DidSwitchBlock())
+			PurgeMIDIBuffers();
 
 		if (m_pCurrentSynth == m_pSoundFontSynth)
 			m_pSoundFontSynth->ReportStatus();
@@ -1275,20 +2745,49 @@ void CMT32Pi::USBMIDIDeviceRemovedHandler(CDevice* pDevice, void* pContext)
 // The following handlers are called from interrupt context, enqueue into ring buffer for main thread
 void CMT32Pi::USBMIDIPacketHandler(unsigned nCable, u8* pPacket, unsigned nLength)
 {
-	IRQMIDIReceiveHandler(pPacket, nLength);
+	assert(s_pThis != nullptr);
+
+	// Keep packet boundaries so that complete messages can skip the byte parser
+	TUSBMIDIPacket Packet = { static_cast<u8>(nCable), static_cast<u8>(Utility::Min(nLength, 3u)), { 0 } };
+	memcpy(Packet.Data, pPacket, Packet.nLength);
+
+	s_pThis->m_MIDIRouter.Forward(CMIDIRouter::TInput::USB, Packet.Data, Packet.nLength, CTimer::GetClockTicks());
+
+	if (!s_pThis->m_USBMIDIPacketBuffer.Enqueue(Packet))
+		OnMIDIRxOverrun();
+}
+
+void CMT32Pi::OnMIDIRxOverrun()
+{
+	s_pThis->m_DeferredLog.Raise(TDeferredLogMessage::MIDIRxOverrun);
+}
+
+void CMT32Pi::DeferredLogLCDHandler(TLogSeverity Severity, const char* pText, void* pParam)
+{
+	CMT32Pi* const pThis = static_cast<CMT32Pi*>(pParam);
+	pThis->LCDLog(Severity == LogError ? TLCDLogType::Error : Severity == LogWarning ? TLCDLogType::Warning : TLCDLogType::Notice, pText);
 }
 
-void CMT32Pi::IRQMIDIReceiveHandler(const u8* pData, size_t nSize)
+// Called by CPisound::Update() from the main task
+void CMT32Pi::PisoundMIDIReceiveHandler(const u8* pData, size_t nSize)
 {
 	assert(s_pThis != nullptr);
 
+	s_pThis->m_MIDIRouter.Forward(CMIDIRouter::TInput::Pisound, pData, nSize, CTimer::GetClockTicks());
+
 	// Enqueue data into ring buffer
 	if (s_pThis->m_MIDIRxBuffer.Enqueue(pData, nSize) != nSize)
-	{
-		static const char* pErrorString = "MIDI overrun error!";
-		LOGWARN(pErrorString);
-		s_pThis->LCDLog(TLCDLogType::Error, pErrorString);
-	}
+		OnMIDIRxOverrun();
+}
+
+void CMT32Pi::SerialMIDITimerHandler(CUserTimer* pTimer, void* pParam)
+{
+	CMT32Pi* pThis = static_cast<CMT32Pi*>(pParam);
+
+	if (pThis->m_bSerialMIDIEnabled)
+		pThis->PollSerialMIDI();
+
+	pTimer->Start(pThis->m_nSerialMIDIPollMicros);
 }
 
 void CMT32Pi::PanicHandler()
@@ -1298,6 +2797,7 @@ void CMT32Pi::PanicHandler()
 
 	// Kill UI task
 	s_pThis->m_bRunning = false;
+	Utility::SendEvent();
 	while (!s_pThis->m_bUITaskDone)
 		;
 
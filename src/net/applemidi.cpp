@@ -30,6 +30,7 @@
 
 #include "net/applemidi.h"
 #include "net/byteorder.h"
+#include "net/recoveryjournal.h"
 
 // #define APPLEMIDI_DEBUG
 
@@ -56,6 +57,9 @@ constexpr unsigned int SyncTimeout = 60 * 10000;
 // Receiver feedback packet frequency (1 second in 100 microsecond units)
 constexpr unsigned int ReceiverFeedbackPeriod = 1 * 10000;
 
+// RTP timestamps older than this are considered implausible (1 second in 100 microsecond units)
+constexpr s32 MaxRTPTimestampAge = 1 * 10000;
+
 constexpr u16 CommandWord(const char Command[2]) { return Command[0] << 8 | Command[1]; }
 
 enum TAppleMIDICommand : u16
@@ -207,7 +211,7 @@ bool ParseSyncPacket(const u8* pBuffer, size_t nSize, TAppleMIDISync* pOutPacket
 	return true;
 }
 
-u8 ParseMIDIDeltaTime(const u8* pBuffer)
+u8 ParseMIDIDeltaTime(const u8* pBuffer, u32& nOutDeltaTime)
 {
 	u8 nLength = 0;
 	u32 nDeltaTime = 0;
@@ -222,10 +226,11 @@ u8 ParseMIDIDeltaTime(const u8* pBuffer)
 			break;
 	}
 
+	nOutDeltaTime = nDeltaTime;
 	return nLength;
 }
 
-size_t ParseSysExCommand(const u8* pBuffer, size_t nSize, CAppleMIDIHandler* pHandler)
+size_t ParseSysExCommand(const u8* pBuffer, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession)
 {
 	size_t nBytesParsed = 1;
 	const u8 nHead = pBuffer[0];
@@ -281,12 +286,12 @@ size_t ParseSysExCommand(const u8* pBuffer, size_t nSize, CAppleMIDIHandler* pHa
 	}
 #endif
 
-	pHandler->OnAppleMIDIDataReceived(pBuffer, nReceiveLength);
+	pHandler->OnAppleMIDIDataReceived(nSession, pBuffer, nReceiveLength, nTimestamp);
 
 	return nBytesParsed;
 }
 
-size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAppleMIDIHandler* pHandler)
+size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession, CRecoveryJournal* pJournal)
 {
 	size_t nBytesParsed = 0;
 	u8 nByte = pBuffer[0];
@@ -297,7 +302,7 @@ size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAp
 	{
 		// Ignore undefined System Real-Time
 		if (nByte != 0xF9 && nByte != 0xFD)
-			pHandler->OnAppleMIDIDataReceived(&nByte, 1);
+			pHandler->OnAppleMIDIDataReceived(nSession, &nByte, 1, nTimestamp);
 
 		return 1;
 	}
@@ -327,6 +332,7 @@ size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAp
 	if (nByte < 0xF0)
 	{
 		// How many data bytes?
+		size_t nDataBytes = 0;
 		switch (nByte & 0xF0)
 		{
 			case 0x80:				// Note off
@@ -334,17 +340,23 @@ size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAp
 			case 0xA0:				// Polyphonic key pressure/aftertouch
 			case 0xB0:				// Control change
 			case 0xE0:				// Pitch bend
-				nBytesParsed += 2;
+				nDataBytes = 2;
 				break;
 
 			case 0xC0:				// Program change
 			case 0xD0:				// Channel pressure/aftertouch
-				nBytesParsed += 1;
+				nDataBytes = 1;
 				break;
 		}
 
+		// Truncated command
+		nBytesParsed += nDataBytes;
+		if (nBytesParsed > nSize)
+			return 0;
+
 		// Handle command
-		pHandler->OnAppleMIDIDataReceived(pBuffer, nBytesParsed);
+		pHandler->OnAppleMIDIDataReceived(nSession, pBuffer, nBytesParsed, nTimestamp);
+		pJournal->OnChannelMessage(nByte, pBuffer + nBytesParsed - nDataBytes);
 		return nBytesParsed;
 	}
 
@@ -353,7 +365,7 @@ size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAp
 	{
 		case 0xF0:					// Start of System Exclusive
 		case 0xF7:					// End of Exclusive
-			return ParseSysExCommand(pBuffer, nSize, pHandler);
+			return ParseSysExCommand(pBuffer, nSize, nTimestamp, pHandler, nSession);
 
 		case 0xF1:					// MIDI Time Code Quarter Frame
 		case 0xF3:					// Song Select
@@ -365,11 +377,12 @@ size_t ParseMIDICommand(const u8* pBuffer, size_t nSize, u8& nRunningStatus, CAp
 			break;
 	}
 
-	pHandler->OnAppleMIDIDataReceived(pBuffer, nBytesParsed);
+	pHandler->OnAppleMIDIDataReceived(nSession, pBuffer, nBytesParsed, nTimestamp);
 	return nBytesParsed;
 }
 
-bool ParseMIDICommandSection(const u8* pBuffer, size_t nSize, CAppleMIDIHandler* pHandler)
+// If bRecover is set, state lost with missing packets is rebuilt from the recovery journal before the commands are handled
+bool ParseMIDICommandSection(const u8* pBuffer, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession, CRecoveryJournal* pJournal, bool bRecover)
 {
 	// Must have at least a header byte and a single status byte
 	if (nSize < 2)
@@ -400,20 +413,36 @@ bool ParseMIDICommandSection(const u8* pBuffer, size_t nSize, CAppleMIDIHandler*
 		return false;
 	}
 
+	// If J flag is set, the recovery journal follows the command list
+	if (bRecover && nMIDIHeader & (1 << 6))
+	{
+		if (!pJournal->Recover(pMIDICommands + nMIDICommandLength, nBytesRemaining - nMIDICommandLength, nTimestamp, pHandler, nSession))
+			LOGERR("Invalid recovery journal");
+	}
+
 	// Begin decoding the command list
 	while (nMIDICommandLength)
 	{
 		// If Z flag is set, first list entry is a delta time
 		if (nMIDICommandsProcessed || nMIDIHeader & (1 << 5))
 		{
-			const u8 nBytesParsed = ParseMIDIDeltaTime(pMIDICommands);
+			// Delta times are relative to the previous command (or the packet timestamp for the first), in 100 microsecond units
+			u32 nDeltaTime;
+			const u8 nBytesParsed = ParseMIDIDeltaTime(pMIDICommands, nDeltaTime);
 			nMIDICommandLength -= nBytesParsed;
 			pMIDICommands += nBytesParsed;
+			nTimestamp += nDeltaTime * 100;
 		}
 
 		if (nMIDICommandLength)
 		{
-			const size_t nBytesParsed = ParseMIDICommand(pMIDICommands, nMIDICommandLength, nRunningStatus, pHandler);
+			const size_t nBytesParsed = ParseMIDICommand(pMIDICommands, nMIDICommandLength, nRunningStatus, nTimestamp, pHandler, nSession, pJournal);
+			if (nBytesParsed == 0 || nBytesParsed > nMIDICommandLength)
+			{
+				LOGERR("Invalid MIDI command");
+				return false;
+			}
+
 			nMIDICommandLength -= nBytesParsed;
 			pMIDICommands += nBytesParsed;
 			++nMIDICommandsProcessed;
@@ -423,10 +452,8 @@ bool ParseMIDICommandSection(const u8* pBuffer, size_t nSize, CAppleMIDIHandler*
 	return true;
 }
 
-bool ParseMIDIPacket(const u8* pBuffer, size_t nSize, TRTPMIDI* pOutPacket, CAppleMIDIHandler* pHandler)
+bool ParseMIDIPacket(const u8* pBuffer, size_t nSize, TRTPMIDI* pOutPacket)
 {
-	assert(pHandler != nullptr);
-
 	const TRTPMIDI* const pInPacket = reinterpret_cast<const TRTPMIDI*>(pBuffer);
 	const u16 nRTPFlags = ntohs(pInPacket->nFlags);
 
@@ -451,13 +478,10 @@ bool ParseMIDIPacket(const u8* pBuffer, size_t nSize, TRTPMIDI* pOutPacket, CApp
 	pOutPacket->nTimestamp = ntohl(pInPacket->nTimestamp);
 	pOutPacket->nSSRC = ntohl(pInPacket->nSSRC);
 
-	// RTP-MIDI variable-length header
-	const u8* const pMIDICommandSection = pBuffer + sizeof(TRTPMIDI);
-	size_t nRemaining = nSize - sizeof(TRTPMIDI);
-	return ParseMIDICommandSection(pMIDICommandSection, nRemaining, pHandler);
+	return true;
 }
 
-CAppleMIDIParticipant::CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom, CAppleMIDIHandler* pHandler)
+CAppleMIDIParticipant::CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom, CAppleMIDIHandler* pHandler, unsigned int nJitterBufferMillis)
 	: CTask(TASK_STACK_SIZE, true),
 
 	  m_pRandom(pRandom),
@@ -467,8 +491,6 @@ CAppleMIDIParticipant::CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom,
 
 	  m_nForeignControlPort(0),
 	  m_nForeignMIDIPort(0),
-	  m_nInitiatorControlPort(0),
-	  m_nInitiatorMIDIPort(0),
 	  m_ControlBuffer{0},
 	  m_MIDIBuffer{0},
 
@@ -477,20 +499,12 @@ CAppleMIDIParticipant::CAppleMIDIParticipant(CBcmRandomNumberGenerator* pRandom,
 
 	  m_pHandler(pHandler),
 
-	  m_State(TState::ControlInvitation),
-
-	  m_nInitiatorToken(0),
-	  m_nInitiatorSSRC(0),
-	  m_nSSRC(0),
-	  m_nLastMIDISequenceNumber(0),
-
-	  m_nOffsetEstimate(0),
-	  m_nLastSyncTime(0),
-
-	  m_nSequence(0),
-	  m_nLastFeedbackSequence(0),
-	  m_nLastFeedbackTime(0)
+	  m_nJitterBufferMicros(nJitterBufferMillis * 1000),
+	  m_nScaledJitter(0),
+	  m_JitterStats{}
 {
+	for (TSession& Session : m_Sessions)
+		ResetSession(Session);
 }
 
 CAppleMIDIParticipant::~CAppleMIDIParticipant()
@@ -533,6 +547,19 @@ bool CAppleMIDIParticipant::Initialize()
 	return true;
 }
 
+CAppleMIDIParticipant::TJitterStats CAppleMIDIParticipant::GetJitterStats() const
+{
+	TJitterStats Stats = m_JitterStats;
+	Stats.nJitterMicros = (m_nScaledJitter >> 4) * 100;
+	return Stats;
+}
+
+void CAppleMIDIParticipant::ResetJitterStats()
+{
+	m_JitterStats = TJitterStats{};
+	m_nScaledJitter = 0;
+}
+
 void CAppleMIDIParticipant::Run()
 {
 	assert(m_pControlSocket != nullptr);
@@ -548,223 +575,342 @@ void CAppleMIDIParticipant::Run()
 		if ((m_nMIDIResult = m_pMIDISocket->ReceiveFrom(m_MIDIBuffer, sizeof(m_MIDIBuffer), MSG_DONTWAIT, &m_ForeignMIDIIPAddress, &m_nForeignMIDIPort)) < 0)
 			LOGERR("MIDI socket receive error: %d", m_nMIDIResult);
 
-		switch (m_State)
-		{
-		case TState::ControlInvitation:
-			ControlInvitationState();
-			break;
+		if (m_nControlResult > 0)
+			ControlPacketReceived();
 
-		case TState::MIDIInvitation:
-			MIDIInvitationState();
-			break;
+		if (m_nMIDIResult > 0)
+			MIDIPacketReceived();
 
-		case TState::Connected:
-			ConnectedState();
-			break;
-		}
+		for (size_t i = 0; i < MaxSessions; ++i)
+			UpdateSession(m_Sessions[i], i);
 
 		// Allow other tasks to run
 		pScheduler->Yield();
 	}
 }
 
-void CAppleMIDIParticipant::ControlInvitationState()
+void CAppleMIDIParticipant::ControlPacketReceived()
 {
 	TAppleMIDISession SessionPacket;
 
-	if (m_nControlResult == 0)
-		return;
-
-	if (!ParseInvitationPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
+	if (ParseInvitationPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
 	{
-		LOGERR("Unexpected packet");
-		return;
-	}
-
 #ifdef APPLEMIDI_DEBUG
-	LOGNOTE("<-- Control invitation");
+		LOGNOTE("<-- Control invitation");
 #endif
 
-	// Store initiator details
-	m_InitiatorIPAddress.Set(m_ForeignControlIPAddress);
-	m_nInitiatorControlPort = m_nForeignControlPort;
-	m_nInitiatorToken = SessionPacket.nInitiatorToken;
-	m_nInitiatorSSRC = SessionPacket.nSSRC;
+		TSession* pSession = FindControlSession(m_ForeignControlIPAddress, m_nForeignControlPort);
 
-	// Generate random SSRC and accept
-	m_nSSRC = m_pRandom->GetNumber();
-	if (!SendAcceptInvitationPacket(m_pControlSocket, &m_InitiatorIPAddress, m_nInitiatorControlPort))
-	{
-		LOGERR("Couldn't accept control invitation");
-		return;
+		// Already connected; the initiator must end the session before inviting us again
+		if (pSession && pSession->State == TState::Connected)
+		{
+			LOGERR("Unexpected packet");
+			return;
+		}
+
+		// A repeated invitation (our acceptance may have been lost) reuses the pending session
+		if (!pSession && (pSession = FindFreeSession()) == nullptr)
+		{
+			LOGWARN("No free sessions; rejecting invitation from %s", SessionPacket.Name);
+			SendRejectInvitationPacket(m_pControlSocket, &m_ForeignControlIPAddress, m_nForeignControlPort, SessionPacket.nInitiatorToken);
+			return;
+		}
+
+		// Store initiator details
+		TSession& Session = *pSession;
+		Session.InitiatorIPAddress.Set(m_ForeignControlIPAddress);
+		Session.nInitiatorControlPort = m_nForeignControlPort;
+		Session.nInitiatorToken = SessionPacket.nInitiatorToken;
+		Session.nInitiatorSSRC = SessionPacket.nSSRC;
+		strncpy(Session.Name, SessionPacket.Name, sizeof(Session.Name) - 1);
+		Session.Name[sizeof(Session.Name) - 1] = '\0';
+
+		// Generate random SSRC and accept
+		Session.nSSRC = m_pRandom->GetNumber();
+		if (!SendAcceptInvitationPacket(Session, m_pControlSocket, Session.nInitiatorControlPort))
+		{
+			LOGERR("Couldn't accept control invitation");
+			ResetSession(Session);
+			return;
+		}
+
+		Session.nLastSyncTime = GetSyncClock();
+		Session.State = TState::MIDIInvitation;
 	}
+	else if (ParseEndSessionPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
+	{
+#ifdef APPLEMIDI_DEBUG
+		LOGNOTE("<-- End session");
+#endif
+
+		TSession* const pSession = FindControlSession(m_ForeignControlIPAddress, m_nForeignControlPort);
+		if (!pSession || SessionPacket.nSSRC != pSession->nInitiatorSSRC)
+			return;
+
+		LOGNOTE("Initiator %s ended session", pSession->Name);
+		if (pSession->State == TState::Connected)
+			m_pHandler->OnAppleMIDIDisconnect(GetSessionIndex(*pSession), &pSession->InitiatorIPAddress, pSession->Name);
 
-	m_nLastSyncTime = GetSyncClock();
-	m_State = TState::MIDIInvitation;
+		ResetSession(*pSession);
+	}
 }
 
-void CAppleMIDIParticipant::MIDIInvitationState()
+void CAppleMIDIParticipant::MIDIPacketReceived()
 {
 	TAppleMIDISession SessionPacket;
 
-	if (m_nControlResult > 0)
+	if (ParseInvitationPacket(m_MIDIBuffer, m_nMIDIResult, &SessionPacket))
 	{
-		if (ParseInvitationPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
-		{
-			// Unexpected peer; reject invitation
-			if (m_ForeignControlIPAddress != m_InitiatorIPAddress || m_nForeignControlPort != m_nInitiatorControlPort)
-				SendRejectInvitationPacket(m_pControlSocket, &m_ForeignControlIPAddress, m_nForeignControlPort, SessionPacket.nInitiatorToken);
-			else
-				LOGERR("Unexpected packet");
-		}
-	}
+#ifdef APPLEMIDI_DEBUG
+		LOGNOTE("<-- MIDI invitation");
+#endif
 
-	if (m_nMIDIResult > 0)
-	{
-		if (!ParseInvitationPacket(m_MIDIBuffer, m_nMIDIResult, &SessionPacket))
+		// Must follow a control invitation from the same peer
+		TSession* pSession = nullptr;
+		for (TSession& Session : m_Sessions)
 		{
-			LOGERR("Unexpected packet");
-			return;
+			if (Session.State == TState::MIDIInvitation &&
+				Session.InitiatorIPAddress == m_ForeignMIDIIPAddress &&
+				Session.nInitiatorToken == SessionPacket.nInitiatorToken)
+			{
+				pSession = &Session;
+				break;
+			}
 		}
 
 		// Unexpected peer; reject invitation
-		if (m_ForeignMIDIIPAddress != m_InitiatorIPAddress)
+		if (!pSession)
 		{
 			SendRejectInvitationPacket(m_pMIDISocket, &m_ForeignMIDIIPAddress, m_nForeignMIDIPort, SessionPacket.nInitiatorToken);
 			return;
 		}
 
-#ifdef APPLEMIDI_DEBUG
-		LOGNOTE("<-- MIDI invitation");
-#endif
+		TSession& Session = *pSession;
+		Session.nInitiatorMIDIPort = m_nForeignMIDIPort;
 
-		m_nInitiatorMIDIPort = m_nForeignMIDIPort;
-
-		if (SendAcceptInvitationPacket(m_pMIDISocket, &m_InitiatorIPAddress, m_nInitiatorMIDIPort))
+		if (SendAcceptInvitationPacket(Session, m_pMIDISocket, Session.nInitiatorMIDIPort))
 		{
+			const unsigned int nSession = GetSessionIndex(Session);
 			CString IPAddressString;
-			m_InitiatorIPAddress.Format(&IPAddressString);
-			LOGNOTE("Connection to %s (%s) established", SessionPacket.Name, static_cast<const char*>(IPAddressString));
-			m_nLastSyncTime = GetSyncClock();
-			m_State = TState::Connected;
-			m_pHandler->OnAppleMIDIConnect(&m_InitiatorIPAddress, SessionPacket.Name);
+			Session.InitiatorIPAddress.Format(&IPAddressString);
+			LOGNOTE("Connection %d to %s (%s) established", nSession, Session.Name, static_cast<const char*>(IPAddressString));
+			Session.nLastSyncTime = GetSyncClock();
+			Session.State = TState::Connected;
+			m_pHandler->OnAppleMIDIConnect(nSession, &Session.InitiatorIPAddress, Session.Name);
 		}
 		else
 		{
 			LOGERR("Couldn't accept MIDI invitation");
-			Reset();
+			ResetSession(Session);
 		}
+
+		return;
 	}
 
-	// Timeout
-	else if ((GetSyncClock() - m_nLastSyncTime) > InvitationTimeout)
+	TSession* const pSession = FindMIDISession(m_ForeignMIDIIPAddress, m_nForeignMIDIPort);
+	if (!pSession)
 	{
-		LOGERR("MIDI port invitation timed out");
-		Reset();
+		LOGERR("Unexpected packet");
+		return;
 	}
+
+	MIDIDataReceived(*pSession, GetSessionIndex(*pSession));
 }
 
-void CAppleMIDIParticipant::ConnectedState()
+void CAppleMIDIParticipant::MIDIDataReceived(TSession& Session, unsigned int nSession)
 {
-	TAppleMIDISession SessionPacket;
 	TRTPMIDI MIDIPacket;
 	TAppleMIDISync SyncPacket;
 
-	if (m_nControlResult > 0)
+	if (ParseMIDIPacket(m_MIDIBuffer, m_nMIDIResult, &MIDIPacket))
 	{
-		if (ParseEndSessionPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
+		// Sequence numbers wrap; anything behind the last one received is a duplicate or arrived too late to be useful
+		const s16 nSequenceDelta = static_cast<s16>(MIDIPacket.nSequence - Session.nSequence);
+		if (Session.bSequenceValid && nSequenceDelta <= 0)
 		{
 #ifdef APPLEMIDI_DEBUG
-			LOGNOTE("<-- End session");
+			LOGNOTE("Dropped out-of-order packet %d", MIDIPacket.nSequence);
 #endif
+			return;
+		}
+
+		// Packets were lost; their state will be rebuilt from the recovery journal
+		const bool bRecover = Session.bSequenceValid && nSequenceDelta > 1;
+		if (bRecover)
+			m_JitterStats.nLostPackets += nSequenceDelta - 1;
 
-			if (m_ForeignControlIPAddress == m_InitiatorIPAddress &&
-				m_nForeignControlPort == m_nInitiatorControlPort &&
-				SessionPacket.nSSRC == m_nInitiatorSSRC)
+		// RTP-MIDI variable-length header
+		const unsigned int nTimestamp = RTPTimestampToTicks(Session, MIDIPacket.nTimestamp);
+		if (ParseMIDICommandSection(m_MIDIBuffer + sizeof(TRTPMIDI), m_nMIDIResult - sizeof(TRTPMIDI), nTimestamp, m_pHandler, nSession, &Session.RecoveryJournal, bRecover))
+		{
+			Session.nSequence = MIDIPacket.nSequence;
+			Session.bSequenceValid = true;
+		}
+	}
+	else if (ParseSyncPacket(m_MIDIBuffer, m_nMIDIResult, &SyncPacket))
+	{
+#ifdef APPLEMIDI_DEBUG
+		LOGNOTE("<-- Sync %d", SyncPacket.nCount);
+#endif
+
+		if (SyncPacket.nSSRC == Session.nInitiatorSSRC && (SyncPacket.nCount == 0 || SyncPacket.nCount == 2))
+		{
+			if (SyncPacket.nCount == 0)
+				SendSyncPacket(Session, SyncPacket.Timestamps[0], GetSyncClock());
+			else if (SyncPacket.nCount == 2)
 			{
-				LOGNOTE("Initiator ended session");
-				m_pHandler->OnAppleMIDIDisconnect(&m_InitiatorIPAddress, SessionPacket.Name);
-				Reset();
-				return;
+				Session.nOffsetEstimate = ((SyncPacket.Timestamps[2] + SyncPacket.Timestamps[0]) / 2) - SyncPacket.Timestamps[1];
+#ifdef APPLEMIDI_DEBUG
+				LOGNOTE("Offset estimate: %llu", Session.nOffsetEstimate);
+#endif
 			}
+
+			Session.nLastSyncTime = GetSyncClock();
 		}
-		else if (ParseInvitationPacket(m_ControlBuffer, m_nControlResult, &SessionPacket))
+		else
 		{
-			// Unexpected peer; reject invitation
-			if (m_ForeignControlIPAddress != m_InitiatorIPAddress || m_nForeignControlPort != m_nInitiatorControlPort)
-				SendRejectInvitationPacket(m_pControlSocket, &m_ForeignControlIPAddress, m_nForeignControlPort, SessionPacket.nInitiatorToken);
-			else
-				LOGERR("Unexpected packet");
+			LOGERR("Unexpected sync packet");
 		}
 	}
+}
+
+void CAppleMIDIParticipant::UpdateSession(TSession& Session, unsigned int nSession)
+{
+	const u64 nTicks = GetSyncClock();
 
-	if (m_nMIDIResult > 0)
+	switch (Session.State)
 	{
-		if (m_ForeignMIDIIPAddress != m_InitiatorIPAddress || m_nForeignMIDIPort != m_nInitiatorMIDIPort)
-			LOGERR("Unexpected packet");
-		else if (ParseMIDIPacket(m_MIDIBuffer, m_nMIDIResult, &MIDIPacket, m_pHandler))
-			m_nSequence = MIDIPacket.nSequence;
-		else if (ParseSyncPacket(m_MIDIBuffer, m_nMIDIResult, &SyncPacket))
-		{
-#ifdef APPLEMIDI_DEBUG
-			LOGNOTE("<-- Sync %d", SyncPacket.nCount);
-#endif
+		case TState::ControlInvitation:
+			break;
 
-			if (SyncPacket.nSSRC == m_nInitiatorSSRC && (SyncPacket.nCount == 0 || SyncPacket.nCount == 2))
+		case TState::MIDIInvitation:
+			if ((nTicks - Session.nLastSyncTime) > InvitationTimeout)
 			{
-				if (SyncPacket.nCount == 0)
-					SendSyncPacket(SyncPacket.Timestamps[0], GetSyncClock());
-				else if (SyncPacket.nCount == 2)
+				LOGERR("MIDI port invitation timed out");
+				ResetSession(Session);
+			}
+			break;
+
+		case TState::Connected:
+			if ((nTicks - Session.nLastFeedbackTime) > ReceiverFeedbackPeriod)
+			{
+				if (Session.nSequence != Session.nLastFeedbackSequence)
 				{
-					m_nOffsetEstimate = ((SyncPacket.Timestamps[2] + SyncPacket.Timestamps[0]) / 2) - SyncPacket.Timestamps[1];
-#ifdef APPLEMIDI_DEBUG
-					LOGNOTE("Offset estimate: %llu", m_nOffsetEstimate);
-#endif
+					SendFeedbackPacket(Session);
+					Session.nLastFeedbackSequence = Session.nSequence;
 				}
-
-				m_nLastSyncTime = GetSyncClock();
+				Session.nLastFeedbackTime = nTicks;
 			}
-			else
+
+			if ((nTicks - Session.nLastSyncTime) > SyncTimeout)
 			{
-				LOGERR("Unexpected sync packet");
+				LOGERR("Initiator %s timed out", Session.Name);
+				m_pHandler->OnAppleMIDIDisconnect(nSession, &Session.InitiatorIPAddress, Session.Name);
+				ResetSession(Session);
 			}
-		}
+			break;
 	}
+}
 
-	const u64 nTicks = GetSyncClock();
+void CAppleMIDIParticipant::ResetSession(TSession& Session)
+{
+	Session.State = TState::ControlInvitation;
+
+	Session.nInitiatorControlPort = 0;
+	Session.nInitiatorMIDIPort = 0;
+	Session.Name[0] = '\0';
 
-	if ((nTicks - m_nLastFeedbackTime) > ReceiverFeedbackPeriod)
+	Session.nInitiatorToken = 0;
+	Session.nInitiatorSSRC = 0;
+	Session.nSSRC = 0;
+
+	Session.nOffsetEstimate = 0;
+	Session.nLastSyncTime = 0;
+
+	Session.nSequence = 0;
+	Session.bSequenceValid = false;
+	Session.nLastFeedbackSequence = 0;
+	Session.nLastFeedbackTime = 0;
+
+	// Transit times from the previous session's clock offset are meaningless
+	Session.nLastTransit = 0;
+	Session.bHaveLastTransit = false;
+
+	Session.RecoveryJournal.Reset();
+}
+
+CAppleMIDIParticipant::TSession* CAppleMIDIParticipant::FindControlSession(const CIPAddress& IPAddress, u16 nPort)
+{
+	for (TSession& Session : m_Sessions)
 	{
-		if (m_nSequence != m_nLastFeedbackSequence)
-		{
-			SendFeedbackPacket();
-			m_nLastFeedbackSequence = m_nSequence;
-		}
-		m_nLastFeedbackTime = nTicks;
+		if (Session.State != TState::ControlInvitation && Session.InitiatorIPAddress == IPAddress && Session.nInitiatorControlPort == nPort)
+			return &Session;
 	}
 
-	if ((nTicks - m_nLastSyncTime) > SyncTimeout)
+	return nullptr;
+}
+
+CAppleMIDIParticipant::TSession* CAppleMIDIParticipant::FindMIDISession(const CIPAddress& IPAddress, u16 nPort)
+{
+	for (TSession& Session : m_Sessions)
+	{
+		if (Session.State == TState::Connected && Session.InitiatorIPAddress == IPAddress && Session.nInitiatorMIDIPort == nPort)
+			return &Session;
+	}
+
+	return nullptr;
+}
+
+CAppleMIDIParticipant::TSession* CAppleMIDIParticipant::FindFreeSession()
+{
+	for (TSession& Session : m_Sessions)
 	{
-		LOGERR("Initiator timed out");
-		Reset();
+		if (Session.State == TState::ControlInvitation)
+			return &Session;
 	}
+
+	return nullptr;
 }
 
-void CAppleMIDIParticipant::Reset()
+// Convert an RTP timestamp (initiator's clock in 100 microsecond units) to CTimer ticks
+unsigned int CAppleMIDIParticipant::RTPTimestampToTicks(TSession& Session, u32 nRTPTimestamp)
 {
-	m_State = TState::ControlInvitation;
+	const unsigned int nTicks = CTimer::GetClockTicks();
+
+	// Fall back on time of arrival until the clocks have been synchronized, or if the result is implausible
+	if (Session.nOffsetEstimate == 0)
+		return nTicks;
+
+	const u32 nLocalTimestamp = nRTPTimestamp - static_cast<u32>(Session.nOffsetEstimate);
+	const s32 nAge = static_cast<s32>(static_cast<u32>(GetSyncClock()) - nLocalTimestamp);
+	if (nAge < 0 || nAge > MaxRTPTimestampAge)
+		return nTicks;
 
-	m_nInitiatorToken = 0;
-	m_nInitiatorSSRC = 0;
-	m_nSSRC = 0;
-	m_nLastMIDISequenceNumber = 0;
+	// Running estimate of transit time variation (RFC 3550 section 6.4.1), scaled by 16
+	if (Session.bHaveLastTransit)
+	{
+		const s32 nDelta = nAge - Session.nLastTransit;
+		m_nScaledJitter += static_cast<u32>(nDelta < 0 ? -nDelta : nDelta) - ((m_nScaledJitter + 8) >> 4);
+	}
+	Session.nLastTransit = nAge;
+	Session.bHaveLastTransit = true;
 
-	m_nOffsetEstimate = 0;
-	m_nLastSyncTime = 0;
+	const unsigned int nAgeMicros = nAge * 100;
+	++m_JitterStats.nPackets;
+	if (nAgeMicros > m_JitterStats.nPeakTransitMicros)
+		m_JitterStats.nPeakTransitMicros = nAgeMicros;
+
+	if (m_nJitterBufferMicros == 0)
+		return nTicks - nAgeMicros;
+
+	// Arrived after its playback time; play immediately
+	if (nAgeMicros > m_nJitterBufferMicros)
+	{
+		++m_JitterStats.nLatePackets;
+		return nTicks;
+	}
 
-	m_nSequence = 0;
-	m_nLastFeedbackSequence = 0;
-	m_nLastFeedbackTime = 0;
+	return nTicks - nAgeMicros + m_nJitterBufferMicros;
 }
 
 bool CAppleMIDIParticipant::SendPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort, const void* pData, size_t nSize)
@@ -790,15 +936,15 @@ bool CAppleMIDIParticipant::SendPacket(CSocket* pSocket, CIPAddress* pIPAddress,
 	return true;
 }
 
-bool CAppleMIDIParticipant::SendAcceptInvitationPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort)
+bool CAppleMIDIParticipant::SendAcceptInvitationPacket(TSession& Session, CSocket* pSocket, u16 nPort)
 {
 	TAppleMIDISession AcceptPacket =
 	{
 		htons(AppleMIDISignature),
 		htons(InvitationAccepted),
 		htonl(AppleMIDIVersion),
-		htonl(m_nInitiatorToken),
-		htonl(m_nSSRC),
+		htonl(Session.nInitiatorToken),
+		htonl(Session.nSSRC),
 		{'\0'}
 	};
 
@@ -810,7 +956,7 @@ bool CAppleMIDIParticipant::SendAcceptInvitationPacket(CSocket* pSocket, CIPAddr
 #endif
 
 	const size_t nSendSize = NamelessSessionPacketSize + strlen(AcceptPacket.Name) + 1;
-	return SendPacket(pSocket, pIPAddress, nPort, &AcceptPacket, nSendSize);
+	return SendPacket(pSocket, &Session.InitiatorIPAddress, nPort, &AcceptPacket, nSendSize);
 }
 
 bool CAppleMIDIParticipant::SendRejectInvitationPacket(CSocket* pSocket, CIPAddress* pIPAddress, u16 nPort, u32 nInitiatorToken)
@@ -821,7 +967,7 @@ bool CAppleMIDIParticipant::SendRejectInvitationPacket(CSocket* pSocket, CIPAddr
 		htons(InvitationRejected),
 		htonl(AppleMIDIVersion),
 		htonl(nInitiatorToken),
-		htonl(m_nSSRC),
+		0,
 		{'\0'}
 	};
 
@@ -833,13 +979,13 @@ bool CAppleMIDIParticipant::SendRejectInvitationPacket(CSocket* pSocket, CIPAddr
 	return SendPacket(pSocket, pIPAddress, nPort, &RejectPacket, NamelessSessionPacketSize);
 }
 
-bool CAppleMIDIParticipant::SendSyncPacket(u64 nTimestamp1, u64 nTimestamp2)
+bool CAppleMIDIParticipant::SendSyncPacket(TSession& Session, u64 nTimestamp1, u64 nTimestamp2)
 {
 	const TAppleMIDISync SyncPacket =
 	{
 		htons(AppleMIDISignature),
 		htons(Sync),
-		htonl(m_nSSRC),
+		htonl(Session.nSSRC),
 		1,
 		{0},
 		{
@@ -853,22 +999,22 @@ bool CAppleMIDIParticipant::SendSyncPacket(u64 nTimestamp1, u64 nTimestamp2)
 	LOGNOTE("--> Sync 1");
 #endif
 
-	return SendPacket(m_pMIDISocket, &m_InitiatorIPAddress, m_nInitiatorMIDIPort, &SyncPacket, sizeof(SyncPacket));
+	return SendPacket(m_pMIDISocket, &Session.InitiatorIPAddress, Session.nInitiatorMIDIPort, &SyncPacket, sizeof(SyncPacket));
 }
 
-bool CAppleMIDIParticipant::SendFeedbackPacket()
+bool CAppleMIDIParticipant::SendFeedbackPacket(TSession& Session)
 {
 	const TAppleMIDIReceiverFeedback FeedbackPacket =
 	{
 		htons(AppleMIDISignature),
 		htons(ReceiverFeedback),
-		htonl(m_nSSRC),
-		htonl(m_nSequence << 16)
+		htonl(Session.nSSRC),
+		htonl(Session.nSequence << 16)
 	};
 
 #ifdef APPLEMIDI_DEBUG
 	LOGNOTE("--> Feedback");
 #endif
 
-	return SendPacket(m_pControlSocket, &m_InitiatorIPAddress, m_nInitiatorControlPort, &FeedbackPacket, sizeof(FeedbackPacket));
+	return SendPacket(m_pControlSocket, &Session.InitiatorIPAddress, Session.nInitiatorControlPort, &FeedbackPacket, sizeof(FeedbackPacket));
 }
@@ -34,11 +34,12 @@ LOGMODULE("ftpd");
 constexpr u16 ListenPort = 21;
 constexpr u8 MaxConnections = 1;
 
-CFTPDaemon::CFTPDaemon(const char* pUser, const char* pPassword)
+CFTPDaemon::CFTPDaemon(const char* pUser, const char* pPassword, CFTPHandler* pHandler)
 	: CTask(TASK_STACK_SIZE, true),
 	  m_pListenSocket(nullptr),
 	  m_pUser(pUser),
-	  m_pPassword(pPassword)
+	  m_pPassword(pPassword),
+	  m_pHandler(pHandler)
 {
 }
 
@@ -106,6 +107,6 @@ void CFTPDaemon::Run()
 		}
 
 		// Spawn new worker
-		new CFTPWorker(pConnection, m_pUser, m_pPassword);
+		new CFTPWorker(pConnection, m_pUser, m_pPassword, m_pHandler);
 	}
 }
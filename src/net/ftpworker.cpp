@@ -31,6 +31,7 @@
 
 #include <cstdio>
 
+#include "filesystemlock.h"
 #include "net/ftpworker.h"
 #include "utility.h"
 
@@ -42,6 +43,9 @@ constexpr size_t TextBufferSize = 512;
 constexpr unsigned int SocketTimeout = 20;
 constexpr unsigned int NumRetries = 3;
 
+// Size of the file read/write buffer for RETR/STOR; large enough for multi-cluster FatFs transfers
+constexpr size_t TransferBufferSize = 64 * 1024;
+
 #ifndef MT32_PI_VERSION
 #define MT32_PI_VERSION "(version unknown)"
 #endif
@@ -113,6 +117,12 @@ bool ValidateVolumeName(const char* pVolumeName)
 	return false;
 }
 
+void CloseFile(FIL& File)
+{
+	CFileSystemLockGuard Lock;
+	f_close(&File);
+}
+
 // Comparator for sorting directory listings
 inline bool DirectoryCaseInsensitiveAscending(const TDirectoryListEntry& EntryA, const TDirectoryListEntry& EntryB)
 {
@@ -124,11 +134,12 @@ inline bool DirectoryCaseInsensitiveAscending(const TDirectoryListEntry& EntryA,
 }
 
 
-CFTPWorker::CFTPWorker(CSocket* pControlSocket, const char* pExpectedUser, const char* pExpectedPassword)
+CFTPWorker::CFTPWorker(CSocket* pControlSocket, const char* pExpectedUser, const char* pExpectedPassword, CFTPHandler* pHandler)
 	: CTask(TASK_STACK_SIZE),
 	  m_LogName(),
 	  m_pExpectedUser(pExpectedUser),
 	  m_pExpectedPassword(pExpectedPassword),
+	  m_pHandler(pHandler),
 	  m_pControlSocket(pControlSocket),
 	  m_pDataSocket(nullptr),
 	  m_nDataSocketPort(0),
@@ -351,6 +362,8 @@ const TDirectoryListEntry* CFTPWorker::BuildDirectoryList(size_t& nOutEntries) c
 	TDirectoryListEntry* pEntries = nullptr;
 	nOutEntries = 0;
 
+	CFileSystemLockGuard Lock;
+
 	// Volume list
 	if (m_CurrentPath.GetLength() == 0)
 	{
@@ -615,34 +628,74 @@ bool CFTPWorker::Retrieve(const char* pArgs)
 	FIL File;
 	CString Path = RealPath(pArgs);
 
-	if (f_open(&File, Path, FA_READ) != FR_OK)
+	// The file system is only locked for each call, as transfers can take a while
+	CFileSystemLock::Acquire();
+	const FRESULT OpenResult = f_open(&File, Path, FA_READ);
+	CFileSystemLock::Release();
+
+	if (OpenResult != FR_OK)
 	{
 		SendStatus(TFTPStatus::FileActionNotTaken, "Could not open file for reading.");
 		return false;
 	}
 
+	u8* const pTransferBuffer = new u8[TransferBufferSize];
+	if (pTransferBuffer == nullptr)
+	{
+		CloseFile(File);
+		SendStatus(TFTPStatus::ActionAborted, "File action aborted, local error.");
+		return false;
+	}
+
 	if (!SendStatus(TFTPStatus::FileStatusOk, "Command OK."))
+	{
+		delete[] pTransferBuffer;
+		CloseFile(File);
 		return false;
+	}
 
 	CSocket* pDataSocket = OpenDataConnection();
 	if (pDataSocket == nullptr)
+	{
+		delete[] pTransferBuffer;
+		CloseFile(File);
 		return false;
+	}
 
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
 	size_t nSize = f_size(&File);
 	size_t nSent = 0;
+	bool bSuccess = true;
 
-	while (nSent < nSize)
+	while (bSuccess && nSent < nSize)
 	{
+		// Large reads let FatFs transfer whole clusters straight into our buffer rather than a sector at a time
 		UINT nBytesRead;
 #ifdef FTPDAEMON_DEBUG
-		LOGDBG("Sending data");
+		LOGDBG("Reading data");
 #endif
-		if (f_read(&File, m_DataBuffer, sizeof(m_DataBuffer), &nBytesRead) != FR_OK || pDataSocket->Send(m_DataBuffer, nBytesRead, 0) < 0)
+		CFileSystemLock::Acquire();
+		const FRESULT ReadResult = f_read(&File, pTransferBuffer, TransferBufferSize, &nBytesRead);
+		CFileSystemLock::Release();
+
+		if (ReadResult != FR_OK || nBytesRead == 0)
 		{
-			delete pDataSocket;
-			f_close(&File);
-			SendStatus(TFTPStatus::ActionAborted, "File action aborted, local error.");
-			return false;
+			bSuccess = false;
+			break;
+		}
+
+		// Hand the chunk to the TCP stack one frame at a time; it is transmitted while we read the next chunk
+		for (size_t nOffset = 0; nOffset < nBytesRead; nOffset += FRAME_BUFFER_SIZE)
+		{
+			const size_t nChunkSize = Utility::Min(static_cast<size_t>(nBytesRead) - nOffset, static_cast<size_t>(FRAME_BUFFER_SIZE));
+#ifdef FTPDAEMON_DEBUG
+			LOGDBG("Sending data");
+#endif
+			if (pDataSocket->Send(pTransferBuffer + nOffset, nChunkSize, 0) < 0)
+			{
+				bSuccess = false;
+				break;
+			}
 		}
 
 		nSent += nBytesRead;
@@ -650,7 +703,16 @@ bool CFTPWorker::Retrieve(const char* pArgs)
 	}
 
 	delete pDataSocket;
-	f_close(&File);
+	delete[] pTransferBuffer;
+	CloseFile(File);
+
+	if (!bSuccess)
+	{
+		SendStatus(TFTPStatus::ActionAborted, "File action aborted, local error.");
+		return false;
+	}
+
+	LogTransferRate("Sent", nSent, nStartTicks);
 	SendStatus(TFTPStatus::TransferComplete, "Transfer complete.");
 
 	return false;
@@ -664,73 +726,133 @@ bool CFTPWorker::Store(const char* pArgs)
 	FIL File;
 	CString Path = RealPath(pArgs);
 
-	if (f_open(&File, Path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+	CFileSystemLock::Acquire();
+	const FRESULT OpenResult = f_open(&File, Path, FA_CREATE_ALWAYS | FA_WRITE);
+	if (OpenResult == FR_OK)
+		f_sync(&File);
+	CFileSystemLock::Release();
+
+	if (OpenResult != FR_OK)
 	{
 		SendStatus(TFTPStatus::FileActionNotTaken, "Could not open file for writing.");
 		return false;
 	}
 
-	f_sync(&File);
+	u8* const pTransferBuffer = new u8[TransferBufferSize];
+	if (pTransferBuffer == nullptr)
+	{
+		CloseFile(File);
+		SendStatus(TFTPStatus::ActionAborted, "File action aborted, local error.");
+		return false;
+	}
 
 	if (!SendStatus(TFTPStatus::FileStatusOk, "Command OK."))
+	{
+		delete[] pTransferBuffer;
+		CloseFile(File);
 		return false;
+	}
 
 	CSocket* pDataSocket = OpenDataConnection();
 	if (pDataSocket == nullptr)
+	{
+		delete[] pTransferBuffer;
+		CloseFile(File);
 		return false;
+	}
 
 	bool bSuccess = true;
+	bool bDone = false;
+	size_t nBuffered = 0;
+	size_t nReceived = 0;
 
 	CTimer* const pTimer = CTimer::Get();
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
 	unsigned int nTimeout = pTimer->GetTicks();
 
-	while (true)
+	while (!bDone)
 	{
+		// Receive needs room for a full frame
+		if (TransferBufferSize - nBuffered >= FRAME_BUFFER_SIZE)
+		{
 #ifdef FTPDAEMON_DEBUG
-		LOGDBG("Waiting to receive");
+			LOGDBG("Waiting to receive");
 #endif
-		int nReceiveResult = pDataSocket->Receive(m_DataBuffer, sizeof(m_DataBuffer), MSG_DONTWAIT);
-		FRESULT nWriteResult;
-		UINT nWritten;
+			const int nReceiveResult = pDataSocket->Receive(pTransferBuffer + nBuffered, TransferBufferSize - nBuffered, MSG_DONTWAIT);
 
-		if (nReceiveResult == 0)
-		{
-			if (pTimer->GetTicks() - nTimeout >= SocketTimeout * HZ)
+			if (nReceiveResult == 0)
 			{
-				LOGERR("Socket timed out");
-				bSuccess = false;
-				break;
+				if (pTimer->GetTicks() - nTimeout >= SocketTimeout * HZ)
+				{
+					LOGERR("Socket timed out");
+					bSuccess = false;
+					break;
+				}
+
+				// Nothing pending; a good time to write out what we have rather than wait for the buffer to fill
+				if (nBuffered == 0)
+				{
+					CScheduler::Get()->Yield();
+					continue;
+				}
 			}
-			CScheduler::Get()->Yield();
-			continue;
-		}
 
-		// All done
-		if (nReceiveResult < 0)
-		{
-			LOGNOTE("Receive done, no more data");
-			break;
+			// All done
+			else if (nReceiveResult < 0)
+			{
+				LOGNOTE("Receive done, no more data");
+				bDone = true;
+			}
+
+			else
+			{
+				nBuffered += nReceiveResult;
+				nReceived += nReceiveResult;
+				nTimeout = pTimer->GetTicks();
+
+				// Keep draining the socket until the buffer is full
+				if (TransferBufferSize - nBuffered >= FRAME_BUFFER_SIZE)
+					continue;
+			}
 		}
 
-#ifdef FTPDAEMON_DEBUG
-		//LOGDBG("Received %d bytes", nReceiveResult);
-#endif
+		if (nBuffered == 0)
+			continue;
 
-		if ((nWriteResult = f_write(&File, m_DataBuffer, nReceiveResult, &nWritten)) != FR_OK)
+		// Multi-cluster writes go straight from our buffer to the card
+		FRESULT nWriteResult;
+		UINT nWritten;
+		CFileSystemLock::Acquire();
+		nWriteResult = f_write(&File, pTransferBuffer, nBuffered, &nWritten);
+		CFileSystemLock::Release();
+
+		if (nWriteResult != FR_OK || nWritten != nBuffered)
 		{
 			LOGERR("Write FAILED, return code %d", nWriteResult);
 			bSuccess = false;
 			break;
 		}
 
-		f_sync(&File);
+		nBuffered = 0;
 		CScheduler::Get()->Yield();
+	}
 
-		nTimeout = pTimer->GetTicks();
+	// Flush the file system once, rather than after every packet
+	CFileSystemLock::Acquire();
+	const bool bSynced = !bSuccess || f_sync(&File) == FR_OK;
+	CFileSystemLock::Release();
+
+	if (!bSynced)
+	{
+		LOGERR("Sync FAILED");
+		bSuccess = false;
 	}
 
 	if (bSuccess)
+	{
+		LogTransferRate("Received", nReceived, nStartTicks);
 		SendStatus(TFTPStatus::TransferComplete, "Transfer complete.");
+	}
 	else
 		SendStatus(TFTPStatus::ActionAborted, "File action aborted, local error.");
 
@@ -738,11 +860,22 @@ bool CFTPWorker::Store(const char* pArgs)
 	LOGDBG("Closing socket/file");
 #endif
 	delete pDataSocket;
-	f_close(&File);
+	delete[] pTransferBuffer;
+	CloseFile(File);
+
+	if (bSuccess && m_pHandler)
+		m_pHandler->OnFTPFileChanged(Path, false);
 
 	return true;
 }
 
+void CFTPWorker::LogTransferRate(const char* pVerb, size_t nBytes, unsigned int nStartTicks)
+{
+	const unsigned int nMillis = Utility::Max((CTimer::GetClockTicks() - nStartTicks) / 1000, 1u);
+	const unsigned int nKBPerSecond = static_cast<u64>(nBytes) * 1000 / 1024 / nMillis;
+	LOGNOTE("%s %d bytes in %d ms (%d KB/s)", pVerb, static_cast<unsigned int>(nBytes), nMillis, nKBPerSecond);
+}
+
 bool CFTPWorker::Delete(const char* pArgs)
 {
 	if (!CheckLoggedIn())
@@ -750,10 +883,18 @@ bool CFTPWorker::Delete(const char* pArgs)
 
 	CString Path = RealPath(pArgs);
 
-	if (f_unlink(Path) != FR_OK)
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_unlink(Path);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK)
 		SendStatus(TFTPStatus::FileActionNotTaken, "File was not deleted.");
 	else
+	{
 		SendStatus(TFTPStatus::FileActionOk, "File deleted.");
+		if (m_pHandler)
+			m_pHandler->OnFTPFileChanged(Path, true);
+	}
 
 	return true;
 }
@@ -765,7 +906,11 @@ bool CFTPWorker::MakeDirectory(const char* pArgs)
 
 	CString Path = RealPath(pArgs);
 
-	if (f_mkdir(Path) != FR_OK)
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_mkdir(Path);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK)
 		SendStatus(TFTPStatus::FileActionNotTaken, "Directory creation failed.");
 	else
 	{
@@ -801,6 +946,7 @@ bool CFTPWorker::ChangeWorkingDirectory(const char* pArgs)
 			FTPPathToFatFsPath(pArgs, Buffer, sizeof(Buffer));
 
 			// f_stat() will fail if we're trying to CWD to the root of a volume, so use f_opendir()
+			CFileSystemLockGuard Lock;
 			if (f_opendir(&Dir, Buffer) == FR_OK)
 			{
 				f_closedir(&Dir);
@@ -825,6 +971,7 @@ bool CFTPWorker::ChangeWorkingDirectory(const char* pArgs)
 			CString NewPath;
 			NewPath.Format("%s/%s", static_cast<const char*>(m_CurrentPath), pArgs);
 
+			CFileSystemLockGuard Lock;
 			if (f_stat(NewPath, nullptr) == FR_OK)
 			{
 				m_CurrentPath = NewPath;
@@ -868,11 +1015,15 @@ bool CFTPWorker::ChangeToParentDirectory(const char* pArgs)
 			m_CurrentPath = Buffer;
 			bSuccess = true;
 		}
-		else if (f_opendir(&Dir, Buffer) == FR_OK)
+		else
 		{
-			f_closedir(&Dir);
-			m_CurrentPath = Buffer;
-			bSuccess = true;
+			CFileSystemLockGuard Lock;
+			if (f_opendir(&Dir, Buffer) == FR_OK)
+			{
+				f_closedir(&Dir);
+				m_CurrentPath = Buffer;
+				bSuccess = true;
+			}
 		}
 	}
 
@@ -1028,10 +1179,21 @@ bool CFTPWorker::RenameTo(const char* pArgs)
 	CString SourcePath = RealPath(m_RenameFrom);
 	CString DestPath = RealPath(pArgs);
 
-	if (f_rename(SourcePath, DestPath) != FR_OK)
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_rename(SourcePath, DestPath);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK)
 		SendStatus(TFTPStatus::FileNameNotAllowed, "File name not allowed.");
 	else
+	{
 		SendStatus(TFTPStatus::FileActionOk, "File renamed.");
+		if (m_pHandler)
+		{
+			m_pHandler->OnFTPFileChanged(SourcePath, true);
+			m_pHandler->OnFTPFileChanged(DestPath, false);
+		}
+	}
 
 	m_RenameFrom = "";
 
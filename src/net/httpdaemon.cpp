@@ -0,0 +1,247 @@
+//
+// httpdaemon.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/net/in.h>
+#include <circle/net/netsubsystem.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include <cstdarg>
+#include <cstdio>
+
+#include "net/httpdaemon.h"
+#include "utility.h"
+
+LOGMODULE("httpd");
+
+constexpr u16 ListenPort = 80;
+constexpr unsigned int RequestTimeoutMillis = 2000;
+constexpr unsigned int ReceivePollMillis = 10;
+
+const char MetricsPath[] = "/metrics";
+const char MetricsContentType[] = "text/plain; version=0.0.4";
+
+CMetricsWriter::CMetricsWriter(char* pBuffer, size_t nSize)
+	: m_pBuffer(pBuffer),
+	  m_nSize(nSize),
+	  m_nLength(0),
+	  m_bTruncated(false)
+{
+}
+
+void CMetricsWriter::Metric(const char* pName, const char* pType, const char* pHelp)
+{
+	Append("# HELP %s %s\n# TYPE %s %s\n", pName, pHelp, pName, pType);
+}
+
+void CMetricsWriter::Sample(const char* pName, u64 nValue, const char* pLabels)
+{
+	if (pLabels)
+		Append("%s{%s} %llu\n", pName, pLabels, static_cast<unsigned long long>(nValue));
+	else
+		Append("%s %llu\n", pName, static_cast<unsigned long long>(nValue));
+}
+
+void CMetricsWriter::Append(const char* pFormat, ...)
+{
+	if (m_bTruncated)
+		return;
+
+	va_list Args;
+	va_start(Args, pFormat);
+	const int nLength = vsnprintf(m_pBuffer + m_nLength, m_nSize - m_nLength, pFormat, Args);
+	va_end(Args);
+
+	// Only ever send whole lines
+	if (nLength < 0 || static_cast<size_t>(nLength) >= m_nSize - m_nLength)
+	{
+		m_pBuffer[m_nLength] = '\0';
+		m_bTruncated = true;
+		return;
+	}
+
+	m_nLength += nLength;
+}
+
+CHTTPDaemon::CHTTPDaemon(CHTTPHandler* pHandler)
+	: CTask(TASK_STACK_SIZE, true),
+	  m_pListenSocket(nullptr),
+	  m_pHandler(pHandler),
+	  m_RequestBuffer{'\0'},
+	  m_ResponseBuffer{'\0'}
+{
+}
+
+CHTTPDaemon::~CHTTPDaemon()
+{
+	if (m_pListenSocket)
+		delete m_pListenSocket;
+}
+
+bool CHTTPDaemon::Initialize()
+{
+	CNetSubSystem* const pNet = CNetSubSystem::Get();
+
+	if ((m_pListenSocket = new CSocket(pNet, IPPROTO_TCP)) == nullptr)
+		return false;
+
+	if (m_pListenSocket->Bind(ListenPort) != 0)
+	{
+		LOGERR("Couldn't bind to port %d", ListenPort);
+		return false;
+	}
+
+	if (m_pListenSocket->Listen() != 0)
+	{
+		LOGERR("Failed to listen on socket");
+		return false;
+	}
+
+	// We started as a suspended task; run now that initialization is successful
+	Start();
+
+	return true;
+}
+
+void CHTTPDaemon::Run()
+{
+	assert(m_pListenSocket != nullptr);
+
+	LOGNOTE("Listener task spawned");
+
+	while (true)
+	{
+		CIPAddress ClientIPAddress;
+		u16 nClientPort;
+
+		CSocket* pConnection = m_pListenSocket->Accept(&ClientIPAddress, &nClientPort);
+		if (pConnection == nullptr)
+		{
+			LOGERR("Unable to accept connection");
+			continue;
+		}
+
+		// Requests are small and answered straight away, so there's no need for a task per connection
+		HandleConnection(pConnection);
+		delete pConnection;
+	}
+}
+
+void CHTTPDaemon::HandleConnection(CSocket* pConnection)
+{
+	if (!ReceiveRequest(pConnection))
+		return;
+
+	// Only the request line matters: "GET /metrics HTTP/1.1"
+	char* pMethod = m_RequestBuffer;
+	char* pPath = strchr(pMethod, ' ');
+	if (!pPath)
+	{
+		SendResponse(pConnection, "400 Bad Request", "text/plain", "", 0);
+		return;
+	}
+
+	*pPath++ = '\0';
+	if (char* pEnd = strpbrk(pPath, " ?\r\n"))
+		*pEnd = '\0';
+
+	if (strcmp(pMethod, "GET") != 0)
+	{
+		SendResponse(pConnection, "405 Method Not Allowed", "text/plain", "", 0);
+		return;
+	}
+
+	if (strcmp(pPath, MetricsPath) != 0)
+	{
+		SendResponse(pConnection, "404 Not Found", "text/plain", "", 0);
+		return;
+	}
+
+	CMetricsWriter Writer(m_ResponseBuffer, sizeof(m_ResponseBuffer));
+	m_pHandler->OnHTTPMetricsRequest(Writer);
+
+	if (Writer.IsTruncated())
+		LOGWARN("Metrics truncated to %d bytes", static_cast<unsigned int>(Writer.GetLength()));
+
+	SendResponse(pConnection, "200 OK", MetricsContentType, m_ResponseBuffer, Writer.GetLength());
+}
+
+bool CHTTPDaemon::ReceiveRequest(CSocket* pConnection)
+{
+	CScheduler* const pScheduler = CScheduler::Get();
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+	size_t nReceived = 0;
+
+	// Poll rather than block, so that a client that never finishes its request can't hold up the listener
+	while (nReceived < sizeof(m_RequestBuffer) - 1)
+	{
+		const int nResult = pConnection->Receive(m_RequestBuffer + nReceived, sizeof(m_RequestBuffer) - 1 - nReceived, MSG_DONTWAIT);
+		if (nResult < 0)
+			return false;
+
+		nReceived += nResult;
+		m_RequestBuffer[nReceived] = '\0';
+
+		// The request line is all we need
+		if (strchr(m_RequestBuffer, '\n'))
+			return true;
+
+		if (CTimer::GetClockTicks() - nStartTicks >= RequestTimeoutMillis * 1000)
+		{
+			LOGWARN("Request timed out");
+			return false;
+		}
+
+		if (nResult == 0)
+			pScheduler->MsSleep(ReceivePollMillis);
+	}
+
+	SendResponse(pConnection, "414 URI Too Long", "text/plain", "", 0);
+	return false;
+}
+
+bool CHTTPDaemon::SendResponse(CSocket* pConnection, const char* pStatus, const char* pContentType, const char* pBody, size_t nBodyLength)
+{
+	char Header[256];
+	const int nHeaderLength = snprintf(Header, sizeof(Header),
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		pStatus, pContentType, static_cast<unsigned int>(nBodyLength));
+
+	if (pConnection->Send(Header, nHeaderLength, 0) < 0)
+		return false;
+
+	// Hand the body to the TCP stack one frame at a time
+	for (size_t nOffset = 0; nOffset < nBodyLength; nOffset += FRAME_BUFFER_SIZE)
+	{
+		const size_t nChunkSize = Utility::Min(nBodyLength - nOffset, static_cast<size_t>(FRAME_BUFFER_SIZE));
+		if (pConnection->Send(pBody + nOffset, nChunkSize, 0) < 0)
+			return false;
+	}
+
+	return true;
+}
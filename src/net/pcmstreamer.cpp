@@ -0,0 +1,170 @@
+//
+// pcmstreamer.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/net/in.h>
+#include <circle/net/netsubsystem.h>
+#include <circle/string.h>
+
+#include "net/byteorder.h"
+#include "net/pcmstreamer.h"
+#include "utility.h"
+
+LOGMODULE("pcmstream");
+
+// RTP version 2, no padding, extension or CSRCs
+constexpr u8 RTPVersionFlags = 2 << 6;
+
+constexpr float Sample16BitMax = (1 << (16 - 1)) - 1;
+
+static u16 FloatToBigEndianS16(float nSample)
+{
+	return htons(static_cast<u16>(static_cast<s16>(Utility::Clamp(nSample, -1.0f, 1.0f) * Sample16BitMax)));
+}
+
+CPCMStreamer::CPCMStreamer(const CIPAddress& Address, u16 nPort, unsigned int nSampleRate, CBcmRandomNumberGenerator* pRandom)
+	: m_Address(Address),
+	  m_nPort(nPort),
+	  m_nSampleRate(nSampleRate),
+	  m_pRandom(pRandom),
+	  m_pSocket(nullptr),
+	  m_nDroppedFrames(0),
+	  m_nSequence(0),
+	  m_nTimestamp(0),
+	  m_nSSRC(0),
+	  m_Packet{}
+{
+}
+
+CPCMStreamer::~CPCMStreamer()
+{
+	if (m_pSocket)
+		delete m_pSocket;
+}
+
+bool CPCMStreamer::Initialize()
+{
+	assert(m_pSocket == nullptr);
+
+	CNetSubSystem* const pNet = CNetSubSystem::Get();
+
+	if ((m_pSocket = new CSocket(pNet, IPPROTO_UDP)) == nullptr)
+		return false;
+
+	if (m_pSocket->Connect(m_Address, m_nPort) != 0)
+	{
+		LOGERR("Couldn't connect to port %d", m_nPort);
+		return false;
+	}
+
+	// Random initial values, as recommended by RFC 3550
+	m_nSequence = m_pRandom->GetNumber();
+	m_nTimestamp = m_pRandom->GetNumber();
+	m_nSSRC = m_pRandom->GetNumber();
+
+	CString IPAddressString;
+	m_Address.Format(&IPAddressString);
+	LOGNOTE("Streaming %d Hz L16 stereo to %s:%d (RTP payload type %d)", m_nSampleRate, static_cast<const char*>(IPAddressString), m_nPort, PayloadType);
+
+	return true;
+}
+
+void CPCMStreamer::Write(const float* pBuffer, size_t nFrames)
+{
+	// Drop the whole block rather than leave a gap in the middle of it
+	if (m_Ring.GetCapacity() - m_Ring.GetCount() < nFrames)
+	{
+		m_nDroppedFrames.fetch_add(nFrames, std::memory_order_relaxed);
+		return;
+	}
+
+	TFrame Frames[PacketFrames];
+
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, PacketFrames);
+
+		for (size_t i = 0; i < nChunkFrames; ++i)
+		{
+			Frames[i].nLeft = FloatToBigEndianS16(pBuffer[i * 2]);
+			Frames[i].nRight = FloatToBigEndianS16(pBuffer[i * 2 + 1]);
+		}
+
+		m_Ring.Enqueue(Frames, nChunkFrames);
+		pBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CPCMStreamer::Update()
+{
+	if (!m_pSocket)
+		return;
+
+	// Stay close to real time; if we fell behind (e.g. during file I/O), skip audio rather than send a burst
+	const size_t nQueuedFrames = m_Ring.GetCount();
+	if (nQueuedFrames > MaxBacklogFrames)
+		DropFrames(nQueuedFrames - PacketFrames);
+
+	// Spread sending over several main loop iterations so that other network traffic isn't held up
+	for (size_t i = 0; i < MaxPacketsPerUpdate && m_Ring.GetCount() >= PacketFrames; ++i)
+	{
+		if (!SendPacket())
+			break;
+	}
+}
+
+void CPCMStreamer::DropFrames(size_t nFrames)
+{
+	size_t nDropped = 0;
+	while (nDropped < nFrames)
+		nDropped += m_Ring.Dequeue(m_Packet.Frames, Utility::Min(nFrames - nDropped, PacketFrames));
+
+	// Keep the timestamps continuous with the audio so that the receiver sees the gap
+	m_nTimestamp += nDropped;
+	m_nDroppedFrames.fetch_add(nDropped, std::memory_order_relaxed);
+}
+
+bool CPCMStreamer::SendPacket()
+{
+	const size_t nFrames = m_Ring.Dequeue(m_Packet.Frames, PacketFrames);
+
+	m_Packet.Header.nFlags = RTPVersionFlags;
+	m_Packet.Header.nPayloadType = PayloadType;
+	m_Packet.Header.nSequence = htons(m_nSequence);
+	m_Packet.Header.nTimestamp = htonl(m_nTimestamp);
+	m_Packet.Header.nSSRC = htonl(m_nSSRC);
+
+	++m_nSequence;
+	m_nTimestamp += nFrames;
+
+	// Never block; under congestion the packet is simply lost
+	const size_t nSize = sizeof(m_Packet.Header) + nFrames * sizeof(TFrame);
+	const int nResult = m_pSocket->Send(&m_Packet, nSize, MSG_DONTWAIT);
+	if (nResult < 0)
+	{
+		m_nDroppedFrames.fetch_add(nFrames, std::memory_order_relaxed);
+		return false;
+	}
+
+	return true;
+}
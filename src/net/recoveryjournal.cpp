@@ -0,0 +1,302 @@
+//
+// recoveryjournal.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/util.h>
+
+#include "net/applemidi.h"
+#include "net/recoveryjournal.h"
+
+// #define RECOVERYJOURNAL_DEBUG
+
+LOGMODULE("recoveryjournal");
+
+// Recovery journal header flags
+constexpr u8 JournalSystemFlag  = 1 << 6;
+constexpr u8 JournalChannelFlag = 1 << 5;
+
+// Channel journal chapter flags
+constexpr u8 ChapterP = 1 << 7;
+constexpr u8 ChapterC = 1 << 6;
+constexpr u8 ChapterM = 1 << 5;
+constexpr u8 ChapterW = 1 << 4;
+constexpr u8 ChapterN = 1 << 3;
+
+constexpr size_t JournalHeaderSize = 3;
+constexpr size_t SystemJournalHeaderSize = 2;
+constexpr size_t ChannelJournalHeaderSize = 3;
+
+// 10-bit length fields used by the system journal, channel journals and chapter M
+constexpr size_t GetLength10(const u8* pBuffer) { return (pBuffer[0] & 0x03) << 8 | pBuffer[1]; }
+
+CRecoveryJournal::CRecoveryJournal()
+	: m_Channels{}
+{
+	Reset();
+}
+
+void CRecoveryJournal::Reset()
+{
+	for (TChannelState& State : m_Channels)
+	{
+		memset(State.ActiveNotes, 0, sizeof(State.ActiveNotes));
+		memset(State.Controllers, UnknownValue, sizeof(State.Controllers));
+		State.nProgram = UnknownValue;
+		State.nPitchBendLSB = UnknownValue;
+		State.nPitchBendMSB = UnknownValue;
+	}
+}
+
+void CRecoveryJournal::OnChannelMessage(u8 nStatus, const u8* pData)
+{
+	TChannelState& State = m_Channels[nStatus & 0x0F];
+	const u8 nNote = pData[0] & 0x7F;
+
+	switch (nStatus & 0xF0)
+	{
+		case 0x90:
+			if (pData[1])
+			{
+				State.ActiveNotes[nNote / 32] |= 1u << (nNote % 32);
+				break;
+			}
+			// Fall through; note on with zero velocity is a note off
+
+		case 0x80:
+			State.ActiveNotes[nNote / 32] &= ~(1u << (nNote % 32));
+			break;
+
+		case 0xB0:
+			State.Controllers[nNote] = pData[1] & 0x7F;
+
+			// All Sound Off/All Notes Off
+			if (nNote == 0x78 || nNote == 0x7B)
+				memset(State.ActiveNotes, 0, sizeof(State.ActiveNotes));
+			break;
+
+		case 0xC0:
+			State.nProgram = pData[0] & 0x7F;
+			break;
+
+		case 0xE0:
+			State.nPitchBendLSB = pData[0] & 0x7F;
+			State.nPitchBendMSB = pData[1] & 0x7F;
+			break;
+	}
+}
+
+bool CRecoveryJournal::Recover(const u8* pJournal, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession)
+{
+	if (nSize < JournalHeaderSize)
+		return false;
+
+	const u8 nFlags = pJournal[0];
+	const u8 nTotalChannels = (nFlags & 0x0F) + 1;
+	pJournal += JournalHeaderSize;
+	nSize -= JournalHeaderSize;
+
+	// System journal; nothing we can usefully recover, so skip it
+	if (nFlags & JournalSystemFlag)
+	{
+		if (nSize < SystemJournalHeaderSize)
+			return false;
+
+		const size_t nLength = GetLength10(pJournal);
+		if (nLength < SystemJournalHeaderSize || nLength > nSize)
+			return false;
+
+		pJournal += nLength;
+		nSize -= nLength;
+	}
+
+	if (!(nFlags & JournalChannelFlag))
+		return true;
+
+	for (u8 i = 0; i < nTotalChannels; ++i)
+	{
+		if (nSize < ChannelJournalHeaderSize)
+			return false;
+
+		const u8 nChannel = (pJournal[0] >> 3) & 0x0F;
+		const size_t nLength = GetLength10(pJournal);
+		const u8 nChapters = pJournal[2];
+
+		if (nLength < ChannelJournalHeaderSize || nLength > nSize)
+			return false;
+
+		if (!RecoverChannel(nChannel, nChapters, pJournal + ChannelJournalHeaderSize, nLength - ChannelJournalHeaderSize, nTimestamp, pHandler, nSession))
+			return false;
+
+		pJournal += nLength;
+		nSize -= nLength;
+	}
+
+	return true;
+}
+
+bool CRecoveryJournal::RecoverChannel(u8 nChannel, u8 nChapters, const u8* pBuffer, size_t nSize, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession)
+{
+	TChannelState& State = m_Channels[nChannel];
+
+	// Chapter P: program change, with the bank in effect when it was sent
+	if (nChapters & ChapterP)
+	{
+		if (nSize < 3)
+			return false;
+
+		const u8 nProgram = pBuffer[0] & 0x7F;
+		const bool bBankValid = pBuffer[1] & 0x80;
+		const u8 nBankMSB = pBuffer[1] & 0x7F;
+		const u8 nBankLSB = pBuffer[2] & 0x7F;
+
+		if (bBankValid && (State.Controllers[0x00] != nBankMSB || State.Controllers[0x20] != nBankLSB))
+		{
+			Send(0xB0 | nChannel, 0x00, nBankMSB, nTimestamp, pHandler, nSession);
+			Send(0xB0 | nChannel, 0x20, nBankLSB, nTimestamp, pHandler, nSession);
+			State.nProgram = UnknownValue;
+		}
+
+		if (State.nProgram != nProgram)
+			Send(0xC0 | nChannel, nProgram, 0, nTimestamp, pHandler, nSession);
+
+		pBuffer += 3;
+		nSize -= 3;
+	}
+
+	// Chapter C: control change
+	if (nChapters & ChapterC)
+	{
+		if (nSize < 1)
+			return false;
+
+		const size_t nLogs = (pBuffer[0] & 0x7F) + 1;
+		++pBuffer;
+		--nSize;
+
+		if (nSize < nLogs * 2)
+			return false;
+
+		for (size_t i = 0; i < nLogs; ++i, pBuffer += 2)
+		{
+			const u8 nController = pBuffer[0] & 0x7F;
+			const u8 nValue = pBuffer[1] & 0x7F;
+
+			// Only the value tool can be recovered without the history of the controller; skip toggle/count logs
+			if (pBuffer[1] & 0x80)
+				continue;
+
+			if (State.Controllers[nController] != nValue)
+				Send(0xB0 | nChannel, nController, nValue, nTimestamp, pHandler, nSession);
+		}
+
+		nSize -= nLogs * 2;
+	}
+
+	// Chapter M: RPN/NRPN; skip it
+	if (nChapters & ChapterM)
+	{
+		if (nSize < 2)
+			return false;
+
+		const size_t nLength = GetLength10(pBuffer);
+		if (nLength < 2 || nLength > nSize)
+			return false;
+
+		pBuffer += nLength;
+		nSize -= nLength;
+	}
+
+	// Chapter W: pitch wheel
+	if (nChapters & ChapterW)
+	{
+		if (nSize < 2)
+			return false;
+
+		const u8 nLSB = pBuffer[0] & 0x7F;
+		const u8 nMSB = pBuffer[1] & 0x7F;
+
+		if (State.nPitchBendLSB != nLSB || State.nPitchBendMSB != nMSB)
+			Send(0xE0 | nChannel, nLSB, nMSB, nTimestamp, pHandler, nSession);
+
+		pBuffer += 2;
+		nSize -= 2;
+	}
+
+	// Chapter N: note on/off; the remaining chapters (E, T and A) are not recovered
+	if (nChapters & ChapterN)
+	{
+		if (nSize < 2)
+			return false;
+
+		size_t nLogs = pBuffer[0] & 0x7F;
+		const u8 nLow = pBuffer[1] >> 4;
+		const u8 nHigh = pBuffer[1] & 0x0F;
+		pBuffer += 2;
+		nSize -= 2;
+
+		// A length of 127 with this otherwise-invalid range codes 128 note logs and no offbits
+		if (nLogs == 127 && nLow == 15 && nHigh == 0)
+			nLogs = 128;
+
+		const size_t nOffBitOctets = nLow <= nHigh ? nHigh - nLow + 1 : 0;
+		if (nSize < nLogs * 2 + nOffBitOctets)
+			return false;
+
+		for (size_t i = 0; i < nLogs; ++i, pBuffer += 2)
+		{
+			const u8 nNote = pBuffer[0] & 0x7F;
+			const bool bStillPlaying = pBuffer[1] & 0x80;
+			const u8 nVelocity = pBuffer[1] & 0x7F;
+
+			// The sender recommends playing a lost note on only while it is still timely to do so
+			if (bStillPlaying && nVelocity && !IsNoteActive(State, nNote))
+				Send(0x90 | nChannel, nNote, nVelocity, nTimestamp, pHandler, nSession);
+		}
+
+		// Offbits: a set bit means the note was turned off since the checkpoint; release it if we missed the note off
+		for (size_t i = 0; i < nOffBitOctets; ++i)
+		{
+			for (u8 nBit = 0; nBit < 8; ++nBit)
+			{
+				const u8 nNote = (nLow + i) * 8 + nBit;
+				if ((pBuffer[i] & (0x80 >> nBit)) && IsNoteActive(State, nNote))
+					Send(0x80 | nChannel, nNote, 0x40, nTimestamp, pHandler, nSession);
+			}
+		}
+	}
+
+	return true;
+}
+
+void CRecoveryJournal::Send(u8 nStatus, u8 nData1, u8 nData2, unsigned int nTimestamp, CAppleMIDIHandler* pHandler, unsigned int nSession)
+{
+	const u8 Message[] = { nStatus, nData1, nData2 };
+	const u8 nType = nStatus & 0xF0;
+	const size_t nSize = (nType == 0xC0 || nType == 0xD0) ? 2 : 3;
+
+#ifdef RECOVERYJOURNAL_DEBUG
+	LOGNOTE("Recovered %02x %02x %02x", nStatus, nData1, nData2);
+#endif
+
+	pHandler->OnAppleMIDIDataReceived(nSession, Message, nSize, nTimestamp);
+	OnChannelMessage(nStatus, Message + 1);
+}
@@ -75,13 +75,18 @@ void CUDPMIDIReceiver::Run()
 
 	while (true)
 	{
-		// Blocking call
-		const int nMIDIResult = m_pMIDISocket->Receive(m_MIDIBuffer, sizeof(m_MIDIBuffer), 0);
+		// Blocking call, then drain any further datagrams that arrived in the same burst
+		int nFlags = 0;
+		int nMIDIResult;
 
-		if (nMIDIResult < 0)
-			LOGERR("MIDI socket receive error: %d", nMIDIResult);
-		else if (nMIDIResult > 0)
+		while ((nMIDIResult = m_pMIDISocket->Receive(m_MIDIBuffer, sizeof(m_MIDIBuffer), nFlags)) > 0)
+		{
 			m_pHandler->OnUDPMIDIDataReceived(m_MIDIBuffer, nMIDIResult);
+			nFlags = MSG_DONTWAIT;
+		}
+
+		if (nMIDIResult < 0 && nFlags == 0)
+			LOGERR("MIDI socket receive error: %d", nMIDIResult);
 
 		// Allow other tasks to run
 		pScheduler->Yield();
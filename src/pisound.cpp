@@ -27,13 +27,15 @@
 #include <cstdio>
 
 #include "pisound.h"
+#include "utility.h"
 
 LOGMODULE("pisound");
 
 constexpr u8 SPIChipSelect        = 0;
 constexpr u8 SPIDelayMicroseconds = 10;
 constexpr u32 SPIClockSpeed       = 150000;
-constexpr u8 SPITransferSize      = 4;
+
+constexpr unsigned int ByteRateWindowMillis = 1000;
 
 constexpr u8 GPIOButton = 17;
 
@@ -62,6 +64,17 @@ CPisound::CPisound(CSPIMaster* pSPIMaster, CGPIOManager* pGPIOManager, unsigned
 
 	  m_pReceiveHandler(nullptr),
 
+	  // Drain anything that arrived before the interrupt was connected
+	  m_bDataPending(true),
+	  m_nBurstWords(MinBurstWords),
+
+	  m_nReceivedBytes(0),
+	  m_nTransfers(0),
+	  m_nRateWindowStart(0),
+	  m_nRateWindowBytes(0),
+	  m_nByteRate(0),
+	  m_nPeakByteRate(0),
+
 	  m_SerialNumber{0},
 	  m_ID{0},
 	  m_FirmwareVersion{0},
@@ -131,9 +144,65 @@ bool CPisound::Initialize()
 	LOGNOTE("Firmware version: %s", m_FirmwareVersion);
 	LOGNOTE("Hardware version: %s", m_HardwareVersion);
 
+	m_nRateWindowStart = CTimer::GetClockTicks();
+
 	return true;
 }
 
+void CPisound::Update()
+{
+	assert(m_pReceiveHandler != nullptr);
+
+	const unsigned int nTicks = CTimer::GetClockTicks();
+	const unsigned int nWindowTicks = nTicks - m_nRateWindowStart;
+	if (nWindowTicks >= Utility::MillisToTicks(ByteRateWindowMillis))
+	{
+		m_nByteRate = static_cast<u64>(m_nRateWindowBytes) * Utility::MillisToTicks(1000u) / nWindowTicks;
+		m_nPeakByteRate = Utility::Max(m_nPeakByteRate, m_nByteRate);
+		m_nRateWindowStart = nTicks;
+		m_nRateWindowBytes = 0;
+	}
+
+	if (!m_bDataPending.exchange(false, std::memory_order_acquire))
+		return;
+
+	do
+	{
+		const size_t nTransferSize = m_nBurstWords * 2;
+		size_t nMIDIBytes = 0;
+		u8 MIDIBuffer[MaxBurstWords];
+
+		u8 RxBuffer[MaxBurstWords * 2];
+		memset(RxBuffer, 0, nTransferSize);
+
+		// Read as many words as are likely to be pending in a single transaction
+		if (m_pSPIMaster->Read(SPIChipSelect, RxBuffer, nTransferSize) < 0)
+			break;
+
+		// Extract MIDI bytes from SPI packet
+		for (size_t i = 0; i < nTransferSize; i += 2)
+		{
+			if (RxBuffer[i])
+				MIDIBuffer[nMIDIBytes++] = RxBuffer[i + 1];
+		}
+
+		++m_nTransfers;
+		m_nReceivedBytes += nMIDIBytes;
+		m_nRateWindowBytes += nMIDIBytes;
+
+		// Pass MIDI bytes on to handler
+		if (nMIDIBytes)
+			m_pReceiveHandler(MIDIBuffer, nMIDIBytes);
+
+		// Lengthen bursts while every word carries data; shorten them again once the Pisound's buffer runs dry,
+		// as empty words cost as much bus time as full ones
+		if (nMIDIBytes == m_nBurstWords)
+			m_nBurstWords = Utility::Min(m_nBurstWords * 2, MaxBurstWords);
+		else if (nMIDIBytes < m_nBurstWords / 2)
+			m_nBurstWords = Utility::Max(m_nBurstWords / 2, MinBurstWords);
+	} while (m_DataAvailable.Read() == HIGH);
+}
+
 u16 CPisound::Transfer16(u16 nTxValue) const
 {
 	u8 RxBuffer[2];
@@ -238,26 +307,9 @@ void CPisound::SetOSRPins(unsigned bRatio1, unsigned bRatio2, unsigned bRatio3)
 void CPisound::DataAvailableInterruptHandler(void* pUserData)
 {
 	CPisound* pThis = static_cast<CPisound*>(pUserData);
-	assert(pThis && pThis->m_pReceiveHandler);
-
-	do
-	{
-		size_t nMIDIBytes = 0;
-		u8 MIDIBuffer[SPITransferSize / 2];
+	assert(pThis);
 
-		u8 RxBuffer[SPITransferSize];
-		memset(RxBuffer, 0, sizeof(RxBuffer));
-
-		// Extract MIDI bytes from SPI packet
-		pThis->m_pSPIMaster->Read(SPIChipSelect, RxBuffer, sizeof(RxBuffer));
-		for (size_t i = 0; i < sizeof(RxBuffer); i += 2)
-		{
-			if (RxBuffer[i])
-				MIDIBuffer[nMIDIBytes++] = RxBuffer[i + 1];
-		}
-
-		// Pass MIDI bytes on to handler
-		if (nMIDIBytes)
-			pThis->m_pReceiveHandler(MIDIBuffer, nMIDIBytes);
-	} while (pThis->m_DataAvailable.Read() == HIGH);
+	// SPI transfers at this clock speed take far too long for interrupt context; leave them to Update()
+	pThis->m_bDataPending.store(true, std::memory_order_release);
+	Utility::SendEvent();
 }
@@ -26,6 +26,7 @@
 #include <circle/timer.h>
 
 #include "power.h"
+#include "utility.h"
 
 LOGMODULE("power");
 
@@ -33,14 +34,69 @@ LOGMODULE("power");
 constexpr u32 UnderVoltageOccurredBit = 1 << 16;
 constexpr u32 ThrottlingOccurredBit   = 1 << 18;
 
+// Temperature sampling period
+constexpr unsigned int TemperaturePeriodMillis = 1000;
+
+// Clock governor parameters
+constexpr unsigned int GovernorPeriodMillis   = 100;
+constexpr unsigned int LowerHoldMillis        = 1000;
+constexpr unsigned int ClockStepHz            = 100000000;
+constexpr unsigned int RaiseLoadPercent       = 60;
+constexpr unsigned int TargetLoadPercent      = 50;
+constexpr unsigned int LowerLoadPercent       = 30;
+
+// Degrees below the firmware's temperature limit at which the clock stops rising/is stepped down
+constexpr unsigned int ThermalHoldCelsius     = 8;
+constexpr unsigned int ThermalBackoffCelsius  = 4;
+
 CPower::CPower()
 	: m_nPowerSaveTimeout(300),
 	  m_nLastActivityTime(0),
 	  m_State(TState::Normal),
-	  m_LastThrottledStatus(0)
+	  m_LastThrottledStatus(0),
+	  m_nTemperature(0),
+	  m_nLastTemperatureTime(0),
+
+	  m_bClockGovernor(false),
+	  m_nMinClockRate(0),
+	  m_nMaxClockRate(0),
+	  m_nClockRate(0),
+	  m_nLastGovernorTime(0),
+	  m_nLastChangeTime(0),
+	  m_nPeakRenderLoad(0)
 {
 }
 
+void CPower::SetClockGovernor(bool bEnabled)
+{
+	m_bClockGovernor = false;
+
+	if (!bEnabled)
+		return;
+
+	m_nMinClockRate = GetClockRate(PROPTAG_GET_MIN_CLOCK_RATE);
+	m_nMaxClockRate = GetClockRate(PROPTAG_GET_MAX_CLOCK_RATE);
+	m_nClockRate = GetClockRate(PROPTAG_GET_CLOCK_RATE);
+
+	if (!m_nMinClockRate || !m_nClockRate || m_nMinClockRate >= m_nMaxClockRate)
+	{
+		LOGWARN("ARM clock rate is fixed; clock governor disabled");
+		return;
+	}
+
+	m_nLastChangeTime = CTimer::Get()->GetTicks();
+	m_bClockGovernor = true;
+	LOGNOTE("Clock governor enabled (%d-%d MHz)", m_nMinClockRate / 1000000, m_nMaxClockRate / 1000000);
+}
+
+void CPower::ReportRenderLoad(unsigned int nLoadPercent)
+{
+	// Keep the highest load seen since the governor last looked
+	unsigned int nPeakLoad = m_nPeakRenderLoad.load(std::memory_order_relaxed);
+	while (nLoadPercent > nPeakLoad && !m_nPeakRenderLoad.compare_exchange_weak(nPeakLoad, nLoadPercent, std::memory_order_relaxed))
+		;
+}
+
 void CPower::Update()
 {
 	unsigned int nTicks = CTimer::Get()->GetTicks();
@@ -53,6 +109,9 @@ void CPower::Update()
 		OnEnterPowerSavingMode();
 	}
 
+	UpdateTemperature(nTicks);
+	UpdateClockGovernor(nTicks);
+
 	// Check for undervoltage and throttling
 	UpdateThrottledStatus();
 }
@@ -67,6 +126,11 @@ void CPower::Awaken()
 	CCPUThrottle::Get()->SetSpeed(TCPUSpeed::CPUSpeedMaximum);
 	m_State = TState::Normal;
 
+	// Start from the maximum clock rate and let the governor lower it again
+	m_nClockRate = m_nMaxClockRate;
+	m_nLastChangeTime = m_nLastActivityTime;
+	m_nPeakRenderLoad.store(0, std::memory_order_relaxed);
+
 	OnExitPowerSavingMode();
 }
 
@@ -111,3 +175,83 @@ void CPower::UpdateThrottledStatus()
 
 	m_LastThrottledStatus = ThrottledStatus.nValue;
 }
+
+void CPower::UpdateTemperature(unsigned int nTicks)
+{
+	if (m_nLastTemperatureTime && (nTicks - m_nLastTemperatureTime) < MSEC2HZ(TemperaturePeriodMillis))
+		return;
+
+	m_nLastTemperatureTime = nTicks;
+
+	CCPUThrottle* const pCPUThrottle = CCPUThrottle::Get();
+	m_nTemperature = pCPUThrottle->GetTemperature();
+
+	// The governor sets the clock itself; otherwise it only changes when entering/leaving power saving mode
+	if (!m_bClockGovernor)
+		m_nClockRate = pCPUThrottle->GetClockRate();
+}
+
+void CPower::UpdateClockGovernor(unsigned int nTicks)
+{
+	if (!m_bClockGovernor || m_State != TState::Normal || (nTicks - m_nLastGovernorTime) < MSEC2HZ(GovernorPeriodMillis))
+		return;
+
+	m_nLastGovernorTime = nTicks;
+	const unsigned int nLoad = m_nPeakRenderLoad.exchange(0, std::memory_order_relaxed);
+
+	// The firmware throttles hard at its temperature limit; stop raising the clock, then back off before it gets there
+	const unsigned int nTemperature = m_nTemperature;
+	const unsigned int nMaxTemperature = CCPUThrottle::Get()->GetMaxTemperature();
+
+	unsigned int nCeiling = m_nMaxClockRate;
+	if (nTemperature + ThermalBackoffCelsius >= nMaxTemperature)
+		nCeiling = Utility::Max(m_nClockRate - ClockStepHz, m_nMinClockRate);
+	else if (nTemperature + ThermalHoldCelsius >= nMaxTemperature)
+		nCeiling = m_nClockRate;
+
+	unsigned int nRate = m_nClockRate;
+	if (nLoad >= RaiseLoadPercent)
+	{
+		// Raise straight to the rate at which the heaviest block would have hit the target load, rounded up to a whole step
+		nRate = static_cast<u64>(m_nClockRate) * nLoad / TargetLoadPercent;
+		nRate = (nRate + ClockStepHz - 1) / ClockStepHz * ClockStepHz;
+	}
+	else if (nLoad < LowerLoadPercent && (nTicks - m_nLastChangeTime) >= MSEC2HZ(LowerHoldMillis))
+	{
+		// Only lower one step at a time after a sustained period of slack
+		nRate = Utility::Max(m_nClockRate - ClockStepHz, m_nMinClockRate);
+	}
+
+	nRate = Utility::Clamp(nRate, m_nMinClockRate, nCeiling);
+	if (nRate != m_nClockRate)
+	{
+		SetClockRate(nRate);
+		m_nLastChangeTime = nTicks;
+	}
+}
+
+unsigned int CPower::GetClockRate(u32 nTagId)
+{
+	TPropertyTagClockRate ClockRate;
+	ClockRate.nClockId = CLOCK_ID_ARM;
+
+	if (!m_Tags.GetTag(nTagId, &ClockRate, sizeof(ClockRate), sizeof(ClockRate.nClockId)))
+		return 0;
+
+	return ClockRate.nRate;
+}
+
+void CPower::SetClockRate(unsigned int nRate)
+{
+	TPropertyTagSetClockRate ClockRate;
+	ClockRate.nClockId = CLOCK_ID_ARM;
+	ClockRate.nRate = nRate;
+	ClockRate.nSkipSettingTurbo = 0;
+
+	if (!m_Tags.GetTag(PROPTAG_SET_CLOCK_RATE, &ClockRate, sizeof(ClockRate), 3 * sizeof(u32)))
+		return;
+
+	// The firmware reports the rate it actually chose
+	m_nClockRate = ClockRate.nRate ? ClockRate.nRate : nRate;
+	LOGDBG("ARM clock now %d MHz", m_nClockRate / 1000000);
+}
@@ -0,0 +1,296 @@
+//
+// renderbenchmark.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/machineinfo.h>
+#include <circle/timer.h>
+#include <fatfs/ff.h>
+
+#include "filesystemlock.h"
+#include "midiinput.h"
+#include "renderbenchmark.h"
+#include "synth/soundfontsynth.h"
+#include "utility.h"
+
+#ifndef MT32_PI_VERSION
+#define MT32_PI_VERSION "<unknown>"
+#endif
+
+LOGMODULE("benchmark");
+
+const char MT32Directory[] = "mt32";
+const char GMDirectory[] = "gm";
+
+// Resampler qualities and polyphony levels to test; automatic resampler quality is not a fixed setting
+const CMT32Synth::TResamplerQuality ResamplerQualities[] =
+{
+	CMT32Synth::TResamplerQuality::None,
+	CMT32Synth::TResamplerQuality::Fastest,
+	CMT32Synth::TResamplerQuality::Fast,
+	CMT32Synth::TResamplerQuality::Good,
+	CMT32Synth::TResamplerQuality::Best,
+};
+
+const int PolyphonyLevels[] = { 32, 64, 128, 256 };
+
+CONFIG_ENUM_STRINGS(TResamplerQuality, ENUM_RESAMPLERQUALITY);
+
+const char ResultsHeader[] = "board,version,synth,setting,file,sample_rate,chunk_frames,audio_ms,render_ms,realtime_factor,blocks,mean_block_us,worst_block_us,block_budget_us,overruns,peak_voices\n";
+
+CRenderBenchmark::CRenderBenchmark(CConfig& Config)
+	: m_Config(Config),
+	  m_pBuffer(new float[Config.AudioChunkSize * 2]),
+	  m_Results(ResultsHeader)
+{
+}
+
+CRenderBenchmark::~CRenderBenchmark()
+{
+	delete[] m_pBuffer;
+}
+
+bool CRenderBenchmark::Run(const char* pDirectory)
+{
+	// Benchmark a single instance of each synth on one core, with fixed polyphony
+	const CString ExtraInstances(static_cast<const char*>(m_Config.MT32EmuExtraInstances));
+	const int nPolyphony = m_Config.FluidSynthPolyphony;
+	const bool bPolyphonyGovernor = m_Config.FluidSynthPolyphonyGovernor;
+	const bool bMultiCore = m_Config.FluidSynthMultiCore;
+	const bool bFXOffload = m_Config.FluidSynthFXOffload;
+
+	m_Config.MT32EmuExtraInstances = "";
+	m_Config.FluidSynthPolyphonyGovernor = false;
+	m_Config.FluidSynthMultiCore = false;
+	m_Config.FluidSynthFXOffload = false;
+
+	LOGNOTE("Rendering %d frames per block at %d Hz", m_Config.AudioChunkSize, m_Config.AudioSampleRate);
+
+	unsigned int nRuns = 0;
+	for (const auto ResamplerQuality : ResamplerQualities)
+		nRuns += RunSynth(true, ResamplerQuality, 0, pDirectory);
+
+	for (const int nLevel : PolyphonyLevels)
+		nRuns += RunSynth(false, CMT32Synth::TResamplerQuality::None, nLevel, pDirectory);
+
+	m_Config.MT32EmuExtraInstances = ExtraInstances;
+	m_Config.FluidSynthPolyphony = nPolyphony;
+	m_Config.FluidSynthPolyphonyGovernor = bPolyphonyGovernor;
+	m_Config.FluidSynthMultiCore = bMultiCore;
+	m_Config.FluidSynthFXOffload = bFXOffload;
+
+	if (!nRuns)
+	{
+		LOGWARN("No MIDI files found in %s/%s or %s/%s", pDirectory, MT32Directory, pDirectory, GMDirectory);
+		return false;
+	}
+
+	LOGNOTE("Benchmark complete: %d runs", nRuns);
+	return true;
+}
+
+bool CRenderBenchmark::SaveResults(const char* pPath) const
+{
+	CFileSystemLockGuard Lock;
+
+	FIL File;
+	if (f_open(&File, pPath, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	UINT nWritten;
+	bool bResult = f_write(&File, static_cast<const char*>(m_Results), m_Results.GetLength(), &nWritten) == FR_OK && nWritten == m_Results.GetLength();
+
+	if (f_close(&File) != FR_OK)
+		bResult = false;
+
+	if (bResult)
+		LOGNOTE("Benchmark results saved to %s", pPath);
+
+	return bResult;
+}
+
+unsigned int CRenderBenchmark::RunSynth(bool bMT32, CMT32Synth::TResamplerQuality ResamplerQuality, int nPolyphony, const char* pDirectory)
+{
+	CString DirectoryPath;
+	DirectoryPath.Format("%s/%s", pDirectory, bMT32 ? MT32Directory : GMDirectory);
+
+	// The directory is only locked while it's being read, as rendering each file takes a while
+	DIR Dir;
+	FILINFO FileInfo;
+	CFileSystemLock::Acquire();
+	FRESULT Result = f_findfirst(&Dir, &FileInfo, DirectoryPath, "*.mid");
+	CFileSystemLock::Release();
+	if (Result != FR_OK || !*FileInfo.fname)
+	{
+		CFileSystemLock::Acquire();
+		f_closedir(&Dir);
+		CFileSystemLock::Release();
+		return 0;
+	}
+
+	const char* const pSynthName = bMT32 ? "mt32emu" : "fluidsynth";
+	CString Setting;
+	if (bMT32)
+		Setting = TResamplerQualityStrings[static_cast<size_t>(ResamplerQuality)];
+	else
+	{
+		m_Config.FluidSynthPolyphony = nPolyphony;
+		Setting.Format("%d", nPolyphony);
+	}
+
+	CSynthBase* const pSynth = CreateSynth(bMT32, ResamplerQuality);
+	if (!pSynth)
+	{
+		CFileSystemLock::Acquire();
+		f_closedir(&Dir);
+		CFileSystemLock::Release();
+		return 0;
+	}
+
+	unsigned int nRuns = 0;
+	while (Result == FR_OK && *FileInfo.fname)
+	{
+		if (!(FileInfo.fattrib & (AM_DIR | AM_HID | AM_SYS)))
+		{
+			CString FilePath;
+			FilePath.Format("%s/%s", static_cast<const char*>(DirectoryPath), FileInfo.fname);
+
+			CMIDIFile MIDIFile;
+			if (MIDIFile.Load(FilePath))
+			{
+				TResult Result;
+				RenderFile(*pSynth, MIDIFile, Result);
+				AddResult(pSynthName, Setting, FileInfo.fname, Result);
+				++nRuns;
+			}
+		}
+
+		CFileSystemLock::Acquire();
+		Result = f_findnext(&Dir, &FileInfo);
+		CFileSystemLock::Release();
+	}
+
+	CFileSystemLock::Acquire();
+	f_closedir(&Dir);
+	CFileSystemLock::Release();
+	delete pSynth;
+
+	return nRuns;
+}
+
+CSynthBase* CRenderBenchmark::CreateSynth(bool bMT32, CMT32Synth::TResamplerQuality ResamplerQuality)
+{
+	CSynthBase* pSynth;
+
+	if (bMT32)
+		pSynth = new CMT32Synth(m_Config.AudioSampleRate, m_Config.MT32EmuGain, m_Config.MT32EmuReverbGain, ResamplerQuality);
+	else
+		pSynth = new CSoundFontSynth(m_Config.AudioSampleRate);
+
+	if (!pSynth->Initialize())
+	{
+		LOGERR("%s init failed; skipping", bMT32 ? "mt32emu" : "FluidSynth");
+		delete pSynth;
+		return nullptr;
+	}
+
+	pSynth->SetUserInterface(&m_UI);
+	return pSynth;
+}
+
+void CRenderBenchmark::RenderFile(CSynthBase& Synth, const CMIDIFile& MIDIFile, TResult& OutResult)
+{
+	const unsigned int nSampleRate = m_Config.AudioSampleRate;
+	const size_t nChunkSize = m_Config.AudioChunkSize;
+	const unsigned int nBudgetMicros = static_cast<u64>(nChunkSize) * 1000000 / nSampleRate;
+	const u64 nEndFrame = (MIDIFile.GetDurationMicros() + static_cast<u64>(TailSeconds) * 1000000) * nSampleRate / 1000000;
+
+	// Start each file from silence with default controllers
+	Synth.AllSoundOff();
+	for (u8 nChannel = 0; nChannel < 16; ++nChannel)
+		Synth.QueueMIDIShortMessage(0xB0 | nChannel | 121 << 8, CTimer::GetClockTicks());
+	Synth.Render(m_pBuffer, 0);
+
+	TMIDIMergeQueue MergeQueue;
+	CMIDIInputParser Parser("benchmark", MergeQueue);
+
+	memset(&OutResult, 0, sizeof(OutResult));
+	size_t nEvent = 0;
+	u64 nFrame = 0;
+	u64 nTotalTicks = 0;
+	const u64 nStartTicks = CTimer::GetClockTicks64();
+
+	while (nFrame < nEndFrame)
+	{
+		// As on the audio core, events take effect at the start of the next block
+		const u64 nBlockEndMicros = (nFrame + nChunkSize) * 1000000 / nSampleRate;
+		while (nEvent < MIDIFile.GetEventCount() && MIDIFile.GetEvent(nEvent).nMicros < nBlockEndMicros)
+		{
+			const CMIDIFile::TEvent& Event = MIDIFile.GetEvent(nEvent++);
+			Parser.ParseMIDIBytes(MIDIFile.GetEventData(Event), Event.nSize, CTimer::GetClockTicks());
+
+			TMIDIEvent MIDIEvent;
+			while (MergeQueue.Dequeue(MIDIEvent))
+			{
+				// If the synth's queue is full, apply what's queued without advancing time
+				while (!(MIDIEvent.pSysExData ? Synth.QueueMIDISysExMessage(MIDIEvent.pSysExData, MIDIEvent.nMessage, MIDIEvent.nTimestamp) : Synth.QueueMIDIShortMessage(MIDIEvent.nMessage, MIDIEvent.nTimestamp)))
+					Synth.Render(m_pBuffer, 0);
+			}
+		}
+
+		const unsigned int nBlockStartTicks = CTimer::GetClockTicks();
+		Synth.Render(m_pBuffer, nChunkSize);
+		const unsigned int nBlockTicks = CTimer::GetClockTicks() - nBlockStartTicks;
+
+		nTotalTicks += nBlockTicks;
+		++OutResult.nBlocks;
+		OutResult.nWorstBlockMicros = Utility::Max(OutResult.nWorstBlockMicros, nBlockTicks);
+		OutResult.nPeakVoices = Utility::Max(OutResult.nPeakVoices, Synth.GetActiveVoiceCount());
+		if (nBlockTicks > nBudgetMicros)
+			++OutResult.nOverruns;
+
+		nFrame += nChunkSize;
+	}
+
+	OutResult.nElapsedMillis = (CTimer::GetClockTicks64() - nStartTicks) / 1000;
+	OutResult.nAudioMillis = nFrame * 1000 / nSampleRate;
+	OutResult.nMeanBlockMicros = OutResult.nBlocks ? nTotalTicks / OutResult.nBlocks : 0;
+}
+
+void CRenderBenchmark::AddResult(const char* pSynthName, const char* pSetting, const char* pFileName, const TResult& Result)
+{
+	// Realtime factor with two decimal places
+	const unsigned int nBudgetMicros = static_cast<u64>(m_Config.AudioChunkSize) * 1000000 / m_Config.AudioSampleRate;
+	const unsigned int nFactor = static_cast<u64>(Result.nAudioMillis) * 100 / Utility::Max(Result.nElapsedMillis, 1u);
+
+	LOGNOTE("%s (%s) %s: %d.%02dx realtime, worst block %d/%d us, %d overruns, %d voices", pSynthName, pSetting, pFileName,
+		nFactor / 100, nFactor % 100, Result.nWorstBlockMicros, nBudgetMicros, Result.nOverruns, Result.nPeakVoices);
+
+	// File names are quoted as they may contain commas
+	CString Line;
+	Line.Format("%s,%s,%s,%s,\"%s\",%d,%d,%u,%u,%u.%02u,%u,%u,%u,%u,%u,%u\n",
+		CMachineInfo::Get()->GetMachineName(), MT32_PI_VERSION, pSynthName, pSetting, pFileName,
+		m_Config.AudioSampleRate, m_Config.AudioChunkSize,
+		Result.nAudioMillis, Result.nElapsedMillis, nFactor / 100, nFactor % 100,
+		Result.nBlocks, Result.nMeanBlockMicros, Result.nWorstBlockMicros, nBudgetMicros,
+		Result.nOverruns, Result.nPeakVoices);
+	m_Results.Append(Line);
+}
@@ -0,0 +1,87 @@
+//
+// renderstats.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+
+#include "renderstats.h"
+
+LOGMODULE("renderstats");
+
+constexpr unsigned int CRenderStats::HistogramBounds[];
+
+CRenderStats::CRenderStats()
+	: m_bResetPending(false)
+{
+	Clear();
+}
+
+void CRenderStats::AddBlock(size_t nFrames, unsigned int nRenderTicks, unsigned int nSampleRate)
+{
+	if (m_bResetPending.exchange(false, std::memory_order_relaxed))
+		Clear();
+
+	if (nFrames == 0)
+		return;
+
+	const unsigned int nLoad = static_cast<u64>(nRenderTicks) * nSampleRate * 100 / (static_cast<u64>(nFrames) * 1000000);
+
+	size_t nBucket = 0;
+	while (nBucket < HistogramSize - 1 && nLoad >= HistogramBounds[nBucket])
+		++nBucket;
+
+	m_Histogram[nBucket] = m_Histogram[nBucket] + 1;
+	m_nBlocks = m_nBlocks + 1;
+	m_nLoad = nLoad;
+
+	if (nLoad > m_nPeakLoad)
+	{
+		m_nPeakLoad = nLoad;
+		m_nPeakTicks = nRenderTicks;
+	}
+}
+
+void CRenderStats::AddActiveVoices(unsigned int nVoices)
+{
+	m_nVoices = nVoices;
+
+	if (nVoices > m_nPeakVoices)
+		m_nPeakVoices = nVoices;
+}
+
+void CRenderStats::Dump(const char* pName) const
+{
+	LOGNOTE("%s: %d blocks, peak load %d%% (%d us), peak voices %d, underruns %d", pName, m_nBlocks, m_nPeakLoad, m_nPeakTicks, m_nPeakVoices, m_nUnderruns);
+	LOGNOTE("%s: load <25%%: %d, <50%%: %d, <75%%: %d, <90%%: %d, <100%%: %d, overrun: %d", pName, m_Histogram[0], m_Histogram[1], m_Histogram[2], m_Histogram[3], m_Histogram[4], m_Histogram[5]);
+}
+
+void CRenderStats::Clear()
+{
+	m_nBlocks = 0;
+	for (size_t i = 0; i < HistogramSize; ++i)
+		m_Histogram[i] = 0;
+	m_nUnderruns = 0;
+	m_nLoad = 0;
+	m_nVoices = 0;
+	m_nPeakLoad = 0;
+	m_nPeakTicks = 0;
+	m_nPeakVoices = 0;
+}
@@ -21,48 +21,55 @@
 //
 
 #include <circle/logger.h>
+#include <circle/util.h>
 #include <fatfs/ff.h>
 
+#include "bootprofiler.h"
+#include "fileindex.h"
+#include "filesystemlock.h"
 #include "rommanager.h"
+#include "utility.h"
 
 LOGMODULE("rommanager");
 const char* const Disks[] = { "SD", "USB" };
 const char ROMDirectory[] = "roms";
 
-// Custom File class for mt32emu
+const char ROMIndexFileName[] = "roms.idx";
+constexpr u32 ROMIndexMagic = 'R' | 'O' << 8 | 'I' << 16 | 'X' << 24;
+
+// Length of a SHA1 digest as a hex string, without null terminator
+constexpr size_t SHA1DigestLength = sizeof(MT32Emu::File::SHA1Digest) - 1;
+
+// Custom File class for mt32emu; contents are only read when first needed
 class CROMFile : public MT32Emu::AbstractFile
 {
 public:
-	CROMFile() : m_File{}, m_pData(nullptr) {}
+	CROMFile() : m_nSize(0), m_pData(nullptr) {}
+
+	// A previously-identified file won't be read by mt32emu to calculate its digest
+	CROMFile(const MT32Emu::File::SHA1Digest& SHA1Digest) : MT32Emu::AbstractFile(SHA1Digest), m_nSize(0), m_pData(nullptr) {}
 
 	virtual ~CROMFile() override { close(); }
 
-	virtual size_t getSize() override { return f_size(&m_File); }
+	virtual size_t getSize() override { return m_nSize; }
 
-	virtual const MT32Emu::Bit8u* getData() override { return m_pData; }
+	virtual const MT32Emu::Bit8u* getData() override { return Load() ? m_pData : nullptr; }
 
 	virtual bool open(const char* pFileName)
 	{
-		FRESULT Result = f_open(&m_File, pFileName, FA_READ);
-		if (Result != FR_OK)
-			return false;
+		CFileSystemLockGuard Lock;
 
-		FSIZE_t nSize = f_size(&m_File);
-		if (nSize > MaxROMFileSize)
+		FILINFO FileInfo;
+		if (f_stat(pFileName, &FileInfo) != FR_OK || FileInfo.fsize > MaxROMFileSize)
 			return false;
 
-		if (!(m_pData = new MT32Emu::Bit8u[nSize]))
-			return false;
-
-		UINT nRead;
-		Result = f_read(&m_File, m_pData, nSize, &nRead);
-
-		return Result == FR_OK;
+		m_Path = pFileName;
+		m_nSize = FileInfo.fsize;
+		return true;
 	}
 
 	virtual void close() override
 	{
-		f_close(&m_File);
 		if (m_pData)
 		{
 			delete[] m_pData;
@@ -70,11 +77,39 @@ public:
 		}
 	}
 
+	bool Load()
+	{
+		if (m_pData)
+			return true;
+
+		CFileSystemLockGuard Lock;
+
+		FIL File;
+		if (f_open(&File, m_Path, FA_READ) != FR_OK)
+			return false;
+
+		if (!(m_pData = new MT32Emu::Bit8u[m_nSize]))
+		{
+			f_close(&File);
+			return false;
+		}
+
+		UINT nRead;
+		const bool bResult = f_read(&File, m_pData, m_nSize, &nRead) == FR_OK && nRead == m_nSize;
+		f_close(&File);
+
+		if (!bResult)
+			close();
+
+		return bResult;
+	}
+
 private:
 	// The largest ROM is the CM-32L PCM ROM at 1MB; files larger than this cannot be valid
 	static constexpr size_t MaxROMFileSize = 1 * MEGABYTE;
 
-	FIL m_File;
+	CString m_Path;
+	size_t m_nSize;
 	MT32Emu::Bit8u* m_pData;
 };
 
@@ -104,10 +139,14 @@ CROMManager::~CROMManager()
 
 bool CROMManager::ScanROMs()
 {
+	CBootProfiler::CStep Step("rom_scan");
+	CFileSystemLockGuard Lock;
+
 	DIR Dir;
 	FILINFO FileInfo;
 	FRESULT Result;
 	CString DirectoryPath;
+	CString IndexPath;
 
 	// Already have all ROMs
 	if (HaveROMSet(TMT32ROMSet::All))
@@ -118,6 +157,14 @@ bool CROMManager::ScanROMs()
 	{
 		DirectoryPath.Format("%s:/%s", pDisk, ROMDirectory);
 		Result = f_findfirst(&Dir, &FileInfo, DirectoryPath, "*");
+		if (Result != FR_OK || !*FileInfo.fname)
+			continue;
+
+		// Files that were identified by a previous scan needn't be read or hashed
+		CFileIndex Index(ROMIndexMagic);
+		IndexPath.Format("%s:%s", pDisk, ROMIndexFileName);
+		Index.Load(IndexPath);
+		bool bCompleteScan = true;
 
 		// Loop over each file in the directory
 		while (Result == FR_OK && *FileInfo.fname)
@@ -130,21 +177,61 @@ bool CROMManager::ScanROMs()
 				ROMPath.Append("/");
 				ROMPath.Append(FileInfo.fname);
 
-				// Try to open file
-				CheckROM(ROMPath);
+				// Cached data is the SHA1 digest of a known ROM, or empty for any other file
+				MT32Emu::File::SHA1Digest SHA1Digest = { 0 };
+				size_t nCachedSize;
+				const u8* pCached = Index.Find(FileInfo, nCachedSize);
+
+				if (!pCached)
+					CheckROM(ROMPath, nullptr, SHA1Digest);
+				else if (nCachedSize == SHA1DigestLength)
+				{
+					memcpy(SHA1Digest, pCached, SHA1DigestLength);
+					CheckROM(ROMPath, &SHA1Digest);
+				}
+
+				Index.Add(FileInfo, SHA1Digest, strlen(SHA1Digest));
 
 				// Stop if we have all ROMs
 				if (HaveROMSet(TMT32ROMSet::All))
-					return true;
+				{
+					bCompleteScan = false;
+					break;
+				}
 			}
 
 			Result = f_findnext(&Dir, &FileInfo);
 		}
+
+		f_closedir(&Dir);
+
+		if (Index.IsChanged(bCompleteScan))
+			Index.Save(IndexPath);
+
+		if (!bCompleteScan)
+			return true;
 	}
 
 	return HaveROMSet(TMT32ROMSet::Any);
 }
 
+bool CROMManager::AddROM(const char* pPath)
+{
+	for (auto pDisk : Disks)
+	{
+		if (!Utility::GetFileNameInDirectory(pPath, pDisk, ROMDirectory))
+			continue;
+
+		if (!CheckROM(pPath))
+			return false;
+
+		LOGNOTE("ROM added: %s", pPath);
+		return true;
+	}
+
+	return false;
+}
+
 bool CROMManager::HaveROMSet(TMT32ROMSet ROMSet) const
 {
 	switch (ROMSet)
@@ -221,13 +308,25 @@ bool CROMManager::GetROMSet(TMT32ROMSet ROMSet, TMT32ROMSet& pOutROMSet, const M
 			return false;
 	}
 
+	// ROM images are only read once they're needed by a synth
+	const MT32Emu::ROMImage* const ROMs[] = { pOutControl, pOutPCM };
+	for (const MT32Emu::ROMImage* pROM : ROMs)
+	{
+		if (!static_cast<CROMFile*>(pROM->getFile())->Load())
+		{
+			LOGERR("Couldn't read ROM '%s'", pROM->getROMInfo()->shortName);
+			return false;
+		}
+	}
+
 	return true;
 }
 
-bool CROMManager::CheckROM(const char* pPath)
+bool CROMManager::CheckROM(const char* pPath, const MT32Emu::File::SHA1Digest* pCachedSHA1Digest, char* pOutSHA1Digest)
 {
-	CROMFile* pFile = new CROMFile();
-	if (!pFile->open(pPath))
+	// With a cached digest, mt32emu can identify the ROM from its size and digest alone
+	CROMFile* pFile = pCachedSHA1Digest ? new CROMFile(*pCachedSHA1Digest) : new CROMFile();
+	if (!pFile->open(pPath) || (!pCachedSHA1Digest && !pFile->Load()))
 	{
 		LOGERR("Couldn't open '%s' for reading", pPath);
 		delete pFile;
@@ -236,6 +335,13 @@ bool CROMManager::CheckROM(const char* pPath)
 
 	// Check ROM and store if valid
 	const MT32Emu::ROMImage* pROM = MT32Emu::ROMImage::makeROMImage(pFile);
+	const MT32Emu::ROMInfo* pROMInfo = pROM->getROMInfo();
+	if (pOutSHA1Digest && pROMInfo)
+		strcpy(pOutSHA1Digest, pROMInfo->sha1Digest);
+
+	// Release the contents read for hashing until the ROM is used
+	pFile->close();
+
 	if (!StoreROM(*pROM))
 	{
 		MT32Emu::ROMImage::freeROMImage(pROM);
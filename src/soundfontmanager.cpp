@@ -21,18 +21,24 @@
 //
 
 #include <circle/logger.h>
+#include <circle/string.h>
 #include <circle/util.h>
 #include <fatfs/ff.h>
 
 #include <ini.h>
 
+#include "bootprofiler.h"
 #include "config.h"
+#include "fileindex.h"
+#include "filesystemlock.h"
 #include "soundfontmanager.h"
 #include "utility.h"
+#include "zoneallocator.h"
 
 LOGMODULE("soundfontmanager");
 const char* const Disks[] = { "SD", "USB" };
 const char SoundFontDirectory[] = "soundfonts";
+const char SoundFontIndexFileName[] = "soundfonts.idx";
 
 // Four-character codes used throughout SoundFont RIFF structure
 constexpr u32 FourCC(const char pFourCC[4])
@@ -45,6 +51,7 @@ constexpr u32 FourCCINFO = FourCC("INFO");
 constexpr u32 FourCCLIST = FourCC("LIST");
 constexpr u32 FourCCRIFF = FourCC("RIFF");
 constexpr u32 FourCCSFBK = FourCC("sfbk");
+constexpr u32 FourCCSFIX = FourCC("SFIX");
 
 struct TSoundFontChunk
 {
@@ -54,54 +61,112 @@ struct TSoundFontChunk
 PACKED;
 
 CSoundFontManager::CSoundFontManager()
-	: m_nSoundFonts(0)
+	: m_pRecords(nullptr),
+	  m_nSoundFonts(0),
+	  m_nRecordCapacity(0),
+	  m_pStrings(nullptr),
+	  m_nStringsSize(0),
+	  m_nStringsCapacity(0),
+	  m_nReleasedStringsSize(0),
+
+	  m_nScanDisk(0),
+	  m_ScanDirectory{},
+	  m_ScanFileInfo{},
+	  m_pScanIndex(nullptr)
 {
 }
 
+CSoundFontManager::~CSoundFontManager()
+{
+	CancelScan();
+	delete[] m_pRecords;
+	delete[] m_pStrings;
+}
+
 bool CSoundFontManager::ScanSoundFonts()
 {
-	// Clear existing SoundFont list entries
-	for (size_t i = 0; i < m_nSoundFonts; ++i)
-		m_SoundFontList[i] = TSoundFontListEntry();
+	CBootProfiler::CStep Step("soundfont_scan");
+
+	BeginScan();
+	while (ContinueScan())
+		;
 
+	return FinishScan();
+}
+
+void CSoundFontManager::BeginScan()
+{
+	CancelScan();
+
+	// Clear existing SoundFont list entries; the buffers are reused
 	m_nSoundFonts = 0;
+	m_nStringsSize = 0;
+	m_nReleasedStringsSize = 0;
+	m_nScanDisk = 0;
+}
 
-	DIR Dir;
-	FILINFO FileInfo;
-	FRESULT Result;
-	CString DirectoryPath;
+bool CSoundFontManager::ContinueScan()
+{
+	// Each step is short, so other tasks get the file system in between
+	CFileSystemLockGuard Lock;
 
-	// Loop over each disk
-	for (auto pDisk : Disks)
+	// Open the next disk's directory
+	while (!m_pScanIndex)
 	{
-		DirectoryPath.Format("%s:%s", pDisk, SoundFontDirectory);
-		Result = f_findfirst(&Dir, &FileInfo, DirectoryPath, "*");
+		if (m_nScanDisk == Utility::ArraySize(Disks))
+			return false;
+
+		const char* const pDisk = Disks[m_nScanDisk++];
+		m_ScanDirectoryPath.Format("%s:%s", pDisk, SoundFontDirectory);
+		const FRESULT Result = f_findfirst(&m_ScanDirectory, &m_ScanFileInfo, m_ScanDirectoryPath, "*");
+		if (Result != FR_OK)
+			continue;
 
-		// Loop over each file in the directory
-		while (Result == FR_OK && *FileInfo.fname && m_nSoundFonts < MaxSoundFonts)
+		if (!*m_ScanFileInfo.fname)
 		{
-			// Ensure not directory, hidden, or system file
-			if (!(FileInfo.fattrib & (AM_DIR | AM_HID | AM_SYS)))
-			{
-				// Assemble path
-				CString SoundFontPath;
-				SoundFontPath.Format("%s/%s", static_cast<const char*>(DirectoryPath), FileInfo.fname);
+			f_closedir(&m_ScanDirectory);
+			continue;
+		}
 
-				CheckSoundFont(SoundFontPath, FileInfo.fname);
-			}
+		// Files that haven't changed since the last scan needn't be opened
+		m_pScanIndex = new CFileIndex(FourCCSFIX);
+		m_ScanIndexPath.Format("%s:%s", pDisk, SoundFontIndexFileName);
+		m_pScanIndex->Load(m_ScanIndexPath);
+	}
 
-			Result = f_findnext(&Dir, &FileInfo);
-		}
+	// Ensure not directory, hidden, or system file
+	bool bOutOfMemory = false;
+	if (!(m_ScanFileInfo.fattrib & (AM_DIR | AM_HID | AM_SYS)))
+	{
+		// Assemble path
+		CString SoundFontPath;
+		SoundFontPath.Format("%s/%s", static_cast<const char*>(m_ScanDirectoryPath), m_ScanFileInfo.fname);
+
+		// Sorted once the scan is complete
+		char Name[MaxSoundFontNameLength];
+		bOutOfMemory = CheckCachedSoundFont(*m_pScanIndex, SoundFontPath, m_ScanFileInfo, Name) && !InsertSoundFont(m_nSoundFonts, SoundFontPath, Name);
 	}
 
+	if (bOutOfMemory || f_findnext(&m_ScanDirectory, &m_ScanFileInfo) != FR_OK || !*m_ScanFileInfo.fname)
+		EndScanDirectory(true);
+
+	return true;
+}
+
+bool CSoundFontManager::FinishScan()
+{
+	CancelScan();
+
 	if (m_nSoundFonts > 0)
 	{
 		// Sort into lexicographical order
-		Utility::QSort(m_SoundFontList, SoundFontListComparator, 0, m_nSoundFonts - 1);
+		Utility::HeapSort(m_pRecords, m_nSoundFonts, [this](const TSoundFontRecord& RecordA, const TSoundFontRecord& RecordB) {
+			return strcasecmp(GetString(RecordA.nPathOffset), GetString(RecordB.nPathOffset)) < 0;
+		});
 
 		LOGNOTE("%d SoundFonts found:", m_nSoundFonts);
 		for (size_t i = 0; i < m_nSoundFonts; ++i)
-			LOGNOTE("%d: %s (%s)", i, static_cast<const char*>(m_SoundFontList[i].Path), static_cast<const char*>(m_SoundFontList[i].Name));
+			LOGNOTE("%d: %s (%s)", i, GetString(m_pRecords[i].nPathOffset), GetString(m_pRecords[i].nNameOffset));
 
 		return true;
 	}
@@ -109,10 +174,43 @@ bool CSoundFontManager::ScanSoundFonts()
 	return false;
 }
 
+void CSoundFontManager::CancelScan()
+{
+	// Results from a partly-scanned directory aren't saved
+	if (m_pScanIndex)
+		EndScanDirectory(false);
+
+	m_nScanDisk = Utility::ArraySize(Disks);
+}
+
+void CSoundFontManager::EndScanDirectory(bool bSaveIndex)
+{
+	CFileSystemLockGuard Lock;
+
+	f_closedir(&m_ScanDirectory);
+
+	if (bSaveIndex && m_pScanIndex->IsChanged())
+		m_pScanIndex->Save(m_ScanIndexPath);
+
+	delete m_pScanIndex;
+	m_pScanIndex = nullptr;
+}
+
+void CSoundFontManager::Swap(CSoundFontManager& Other)
+{
+	Utility::Swap(m_pRecords, Other.m_pRecords);
+	Utility::Swap(m_nSoundFonts, Other.m_nSoundFonts);
+	Utility::Swap(m_nRecordCapacity, Other.m_nRecordCapacity);
+	Utility::Swap(m_pStrings, Other.m_pStrings);
+	Utility::Swap(m_nStringsSize, Other.m_nStringsSize);
+	Utility::Swap(m_nStringsCapacity, Other.m_nStringsCapacity);
+	Utility::Swap(m_nReleasedStringsSize, Other.m_nReleasedStringsSize);
+}
+
 const char* CSoundFontManager::GetSoundFontPath(size_t nIndex) const
 {
 	// Return the path if in-range
-	return nIndex < m_nSoundFonts ? static_cast<const char*>(m_SoundFontList[nIndex].Path) : nullptr;
+	return nIndex < m_nSoundFonts ? GetString(m_pRecords[nIndex].nPathOffset) : nullptr;
 }
 
 const char* CSoundFontManager::GetSoundFontName(size_t nIndex) const
@@ -121,11 +219,8 @@ const char* CSoundFontManager::GetSoundFontName(size_t nIndex) const
 	if (nIndex >= m_nSoundFonts)
 		return nullptr;
 
-	// If name empty, return path
-	if (m_SoundFontList[nIndex].Name.GetLength() == 0)
-		return static_cast<const char*>(m_SoundFontList[nIndex].Path);
-
-	return static_cast<const char*>(m_SoundFontList[nIndex].Name);
+	// Refers to the path if the name was empty
+	return GetString(m_pRecords[nIndex].nNameOffset);
 }
 
 TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
@@ -148,6 +243,8 @@ TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
 	else
 		strcat(PathBuffer, ".cfg");
 
+	CFileSystemLockGuard Lock;
+
 	FIL File;
 	if (f_open(&File, PathBuffer, FA_READ) != FR_OK)
 		return FXProfile;
@@ -177,10 +274,315 @@ TFXProfile CSoundFontManager::GetSoundFontFXProfile(size_t nIndex) const
 
 const char* CSoundFontManager::GetFirstValidSoundFontPath() const
 {
-	return m_nSoundFonts > 0 ? static_cast<const char*>(m_SoundFontList[0].Path) : nullptr;
+	return m_nSoundFonts > 0 ? GetString(m_pRecords[0].nPathOffset) : nullptr;
+}
+
+bool CSoundFontManager::FindSoundFont(const char* pPath, size_t& nOutIndex) const
+{
+	const size_t nIndex = GetLowerBound(pPath);
+	if (nIndex == m_nSoundFonts || strcasecmp(GetString(m_pRecords[nIndex].nPathOffset), pPath) != 0)
+		return false;
+
+	nOutIndex = nIndex;
+	return true;
+}
+
+bool CSoundFontManager::CheckSoundFontFits(size_t nIndex) const
+{
+	const char* pPath = GetSoundFontPath(nIndex);
+	FILINFO FileInfo;
+	CFileSystemLock::Acquire();
+	const bool bFound = pPath && f_stat(pPath, &FileInfo) == FR_OK;
+	CFileSystemLock::Release();
+	if (!bFound)
+		return true;
+
+	CZoneAllocator::TStats Stats;
+	CZoneAllocator::Get()->GetStats(Stats);
+
+	// Sample data makes up almost all of a SoundFont and is loaded into a single block
+	const size_t nSize = FileInfo.fsize;
+	if (nSize <= Stats.nLargestFreeBlock)
+		return true;
+
+	// Everything belonging to FluidSynth, including SoundFonts kept loaded after a switch
+	size_t nReclaimableSize = 0;
+	for (size_t i = TZoneTag::FluidSynth; i <= TZoneTag::FluidSynthSoundFontLast; ++i)
+		nReclaimableSize += Stats.Tags[i].nUsedSize;
+
+	if (nSize > Stats.nFreeSize + nReclaimableSize)
+	{
+		LOGWARN("\"%s\" needs at least %d KB, but only %d KB could be made available", pPath, nSize / KILOBYTE, (Stats.nFreeSize + nReclaimableSize) / KILOBYTE);
+		return false;
+	}
+
+	if (nSize > Stats.nFreeSize)
+		LOGWARN("\"%s\" needs at least %d KB, but only %d KB is free; the current SoundFont will be unloaded first", pPath, nSize / KILOBYTE, Stats.nFreeSize / KILOBYTE);
+	else
+		LOGWARN("\"%s\" needs at least %d KB, but the heap is %d%% fragmented (largest free block %d KB); the current SoundFont will be unloaded first", pPath, nSize / KILOBYTE, Stats.nFragmentation, Stats.nLargestFreeBlock / KILOBYTE);
+
+	return true;
+}
+
+bool CSoundFontManager::AddSoundFont(const char* pPath, size_t& nOutIndex)
+{
+	// Rebuild the path in the same form as a full scan so that sorting and lookups agree
+	for (auto pDisk : Disks)
+	{
+		const char* pFileName = Utility::GetFileNameInDirectory(pPath, pDisk, SoundFontDirectory);
+		if (!pFileName)
+			continue;
+
+		CString SoundFontPath;
+		SoundFontPath.Format("%s:%s/%s", pDisk, SoundFontDirectory, pFileName);
+
+		char Name[MaxSoundFontNameLength];
+		if (!CheckSoundFont(SoundFontPath, pFileName, Name))
+			return false;
+
+		// Find the sorted position, replacing any existing entry for the same file
+		const size_t nIndex = GetLowerBound(SoundFontPath);
+		if (nIndex < m_nSoundFonts && strcasecmp(GetString(m_pRecords[nIndex].nPathOffset), SoundFontPath) == 0)
+		{
+			TSoundFontRecord Record;
+			if (SetStrings(Record, SoundFontPath, Name))
+			{
+				ReleaseStrings(m_pRecords[nIndex]);
+				m_pRecords[nIndex] = Record;
+			}
+			return false;
+		}
+
+		if (!InsertSoundFont(nIndex, SoundFontPath, Name))
+			return false;
+
+		LOGNOTE("SoundFont added at %d: %s (%s)", nIndex, GetString(m_pRecords[nIndex].nPathOffset), GetString(m_pRecords[nIndex].nNameOffset));
+		nOutIndex = nIndex;
+		return true;
+	}
+
+	return false;
+}
+
+bool CSoundFontManager::RemoveSoundFont(const char* pPath, size_t& nOutIndex)
+{
+	for (auto pDisk : Disks)
+	{
+		const char* pFileName = Utility::GetFileNameInDirectory(pPath, pDisk, SoundFontDirectory);
+		if (!pFileName)
+			continue;
+
+		CString SoundFontPath;
+		SoundFontPath.Format("%s:%s/%s", pDisk, SoundFontDirectory, pFileName);
+
+		size_t nIndex;
+		if (!FindSoundFont(SoundFontPath, nIndex))
+			continue;
+
+		LOGNOTE("SoundFont removed from %d: %s", nIndex, static_cast<const char*>(SoundFontPath));
+
+		ReleaseStrings(m_pRecords[nIndex]);
+		memmove(m_pRecords + nIndex, m_pRecords + nIndex + 1, (m_nSoundFonts - nIndex - 1) * sizeof(*m_pRecords));
+		--m_nSoundFonts;
+
+		// Reclaim the space once most of it is unused
+		if (m_nReleasedStringsSize > m_nStringsSize / 2)
+			CompactStrings();
+
+		nOutIndex = nIndex;
+		return true;
+	}
+
+	return false;
+}
+
+size_t CSoundFontManager::GetLowerBound(const char* pPath) const
+{
+	size_t nLow = 0;
+	size_t nHigh = m_nSoundFonts;
+
+	while (nLow < nHigh)
+	{
+		const size_t nMiddle = nLow + (nHigh - nLow) / 2;
+		if (strcasecmp(GetString(m_pRecords[nMiddle].nPathOffset), pPath) < 0)
+			nLow = nMiddle + 1;
+		else
+			nHigh = nMiddle;
+	}
+
+	return nLow;
+}
+
+bool CSoundFontManager::InsertSoundFont(size_t nIndex, const char* pPath, const char* pName)
+{
+	if (m_nSoundFonts == m_nRecordCapacity)
+	{
+		const size_t nNewCapacity = Utility::Max(m_nRecordCapacity * 2, InitialRecordCapacity);
+		TSoundFontRecord* pNewRecords = new TSoundFontRecord[nNewCapacity];
+		if (!pNewRecords)
+		{
+			LOGERR("Out of memory for SoundFont list; only %d SoundFonts will be available", m_nSoundFonts);
+			return false;
+		}
+
+		if (m_nSoundFonts)
+			memcpy(pNewRecords, m_pRecords, m_nSoundFonts * sizeof(*m_pRecords));
+
+		delete[] m_pRecords;
+		m_pRecords = pNewRecords;
+		m_nRecordCapacity = nNewCapacity;
+	}
+
+	TSoundFontRecord Record;
+	if (!SetStrings(Record, pPath, pName))
+		return false;
+
+	memmove(m_pRecords + nIndex + 1, m_pRecords + nIndex, (m_nSoundFonts - nIndex) * sizeof(*m_pRecords));
+	m_pRecords[nIndex] = Record;
+	++m_nSoundFonts;
+
+	return true;
+}
+
+bool CSoundFontManager::SetStrings(TSoundFontRecord& Record, const char* pPath, const char* pName)
+{
+	if (!AddString(pPath, Record.nPathOffset))
+		return false;
+
+	// An empty name refers to the path
+	if (!*pName)
+		Record.nNameOffset = Record.nPathOffset;
+	else if (!AddString(pName, Record.nNameOffset))
+	{
+		m_nReleasedStringsSize += strlen(pPath) + 1;
+		return false;
+	}
+
+	return true;
 }
 
-void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileName)
+bool CSoundFontManager::AddString(const char* pString, u32& nOutOffset)
+{
+	const size_t nLength = strlen(pString) + 1;
+
+	if (m_nStringsSize + nLength > m_nStringsCapacity)
+	{
+		size_t nNewCapacity = Utility::Max(m_nStringsCapacity * 2, InitialStringsCapacity);
+		while (nNewCapacity < m_nStringsSize + nLength)
+			nNewCapacity *= 2;
+
+		char* pNewStrings = new char[nNewCapacity];
+		if (!pNewStrings)
+		{
+			LOGERR("Out of memory for SoundFont list; only %d SoundFonts will be available", m_nSoundFonts);
+			return false;
+		}
+
+		if (m_nStringsSize)
+			memcpy(pNewStrings, m_pStrings, m_nStringsSize);
+
+		delete[] m_pStrings;
+		m_pStrings = pNewStrings;
+		m_nStringsCapacity = nNewCapacity;
+	}
+
+	memcpy(m_pStrings + m_nStringsSize, pString, nLength);
+	nOutOffset = m_nStringsSize;
+	m_nStringsSize += nLength;
+
+	return true;
+}
+
+void CSoundFontManager::ReleaseStrings(const TSoundFontRecord& Record)
+{
+	m_nReleasedStringsSize += strlen(GetString(Record.nPathOffset)) + 1;
+	if (Record.nNameOffset != Record.nPathOffset)
+		m_nReleasedStringsSize += strlen(GetString(Record.nNameOffset)) + 1;
+}
+
+void CSoundFontManager::CompactStrings()
+{
+	const size_t nCapacity = Utility::Max(m_nStringsSize - m_nReleasedStringsSize, InitialStringsCapacity);
+	char* pStrings = new char[nCapacity];
+	if (!pStrings)
+		return;
+
+	size_t nSize = 0;
+	for (size_t i = 0; i < m_nSoundFonts; ++i)
+	{
+		TSoundFontRecord& Record = m_pRecords[i];
+		const bool bHasName = Record.nNameOffset != Record.nPathOffset;
+
+		const char* pPath = GetString(Record.nPathOffset);
+		size_t nLength = strlen(pPath) + 1;
+		memcpy(pStrings + nSize, pPath, nLength);
+		Record.nPathOffset = nSize;
+		nSize += nLength;
+
+		if (bHasName)
+		{
+			const char* pName = GetString(Record.nNameOffset);
+			nLength = strlen(pName) + 1;
+			memcpy(pStrings + nSize, pName, nLength);
+			Record.nNameOffset = nSize;
+			nSize += nLength;
+		}
+		else
+			Record.nNameOffset = Record.nPathOffset;
+	}
+
+	delete[] m_pStrings;
+	m_pStrings = pStrings;
+	m_nStringsSize = nSize;
+	m_nStringsCapacity = nCapacity;
+	m_nReleasedStringsSize = 0;
+}
+
+// Writes the SoundFont's name (or file name if it has none) to pOutName, which must hold MaxSoundFontNameLength characters
+bool CSoundFontManager::CheckCachedSoundFont(CFileIndex& Index, const char* pFullPath, const FILINFO& FileInfo, char* pOutName)
+{
+	// Cached data is a validity flag followed by the SoundFont name
+	size_t nCachedSize;
+	const u8* pCached = Index.Find(FileInfo, nCachedSize);
+
+	if (pCached && nCachedSize > 0)
+	{
+		if (pCached[0])
+		{
+			if (nCachedSize > 1)
+			{
+				const size_t nNameLength = Utility::Min(nCachedSize - 1, MaxSoundFontNameLength - 1);
+				memcpy(pOutName, pCached + 1, nNameLength);
+				pOutName[nNameLength] = '\0';
+			}
+			else
+			{
+				strncpy(pOutName, FileInfo.fname, MaxSoundFontNameLength - 1);
+				pOutName[MaxSoundFontNameLength - 1] = '\0';
+			}
+		}
+
+		Index.Add(FileInfo, pCached, nCachedSize);
+		return pCached[0];
+	}
+
+	u8 Data[1 + MaxSoundFontNameLength];
+	const bool bValid = CheckSoundFont(pFullPath, FileInfo.fname, pOutName);
+	size_t nDataSize = 1;
+
+	Data[0] = bValid;
+	if (bValid && strcmp(pOutName, FileInfo.fname) != 0)
+	{
+		const size_t nNameLength = strlen(pOutName);
+		memcpy(Data + 1, pOutName, nNameLength);
+		nDataSize += nNameLength;
+	}
+
+	Index.Add(FileInfo, Data, nDataSize);
+	return bValid;
+}
+
+bool CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileName, char* pOutName)
 {
 	FIL File;
 	UINT nBytesRead;
@@ -192,22 +594,24 @@ void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileN
 	// Init with null terminator
 	Name[0] = '\0';
 
+	CFileSystemLockGuard Lock;
+
 	// Try to open file
 	if (f_open(&File, pFullPath, FA_READ) != FR_OK)
-		return;
+		return false;
 
 #define CHECK_CHUNK_ID(EXPECTED_CHUNK_ID)                                                                \
 	if (f_read(&File, &Chunk, sizeof(Chunk), &nBytesRead) != FR_OK || Chunk.FourCC != EXPECTED_CHUNK_ID) \
 	{                                                                                                    \
 		f_close(&File);                                                                                  \
-		return;                                                                                          \
+		return false;                                                                                    \
 	}
 
 #define CHECK_FORM_ID(EXPECTED_FORM_ID)                                                                \
 	if (f_read(&File, &nFourCC, sizeof(nFourCC), &nBytesRead) != FR_OK || nFourCC != EXPECTED_FORM_ID) \
 	{                                                                                                  \
 		f_close(&File);                                                                                \
-		return;                                                                                        \
+		return false;                                                                                  \
 	}
 
 	CHECK_CHUNK_ID(FourCCRIFF);
@@ -245,19 +649,11 @@ void CSoundFontManager::CheckSoundFont(const char* pFullPath, const char* pFileN
 	// Clean up
 	f_close(&File);
 
-	TSoundFontListEntry& Entry = m_SoundFontList[m_nSoundFonts++];
-	Entry.Path = pFullPath;
-
 	// If we got a name, use it, otherwise fall back on filename
-	if (Name[0] != '\0')
-		Entry.Name = Name;
-	else
-		Entry.Name = pFileName;
-}
+	strncpy(pOutName, Name[0] != '\0' ? Name : pFileName, MaxSoundFontNameLength - 1);
+	pOutName[MaxSoundFontNameLength - 1] = '\0';
 
-inline bool CSoundFontManager::SoundFontListComparator(const TSoundFontListEntry& EntryA, const TSoundFontListEntry& EntryB)
-{
-	return strcasecmp(EntryA.Path, EntryB.Path) < 0;
+	return true;
 }
 
 int CSoundFontManager::INIHandler(void* pUser, const char* pSection, const char* pName, const char* pValue)
@@ -0,0 +1,161 @@
+//
+// soundoutput.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/util.h>
+
+#include "audioconvert.h"
+#include "soundoutput.h"
+#include "utility.h"
+
+CSoundOutputRing::CSoundOutputRing()
+	: m_pBuffer(nullptr),
+	  m_nBufferMask(0),
+	  m_nSizeFrames(0),
+	  m_nInPtr(0),
+	  m_nOutPtr(0)
+{
+}
+
+CSoundOutputRing::~CSoundOutputRing()
+{
+	delete[] m_pBuffer;
+}
+
+bool CSoundOutputRing::Allocate(size_t nFrames)
+{
+	// One slot is always kept empty to tell a full ring from an empty one
+	size_t nBufferSize = 2;
+	while (nBufferSize <= nFrames * 2)
+		nBufferSize *= 2;
+
+	m_pBuffer = new s32[nBufferSize];
+	if (!m_pBuffer)
+		return false;
+
+	m_nBufferMask = nBufferSize - 1;
+	m_nSizeFrames = nFrames;
+	return true;
+}
+
+size_t CSoundOutputRing::GetFramesAvail() const
+{
+	return ((m_nInPtr.load(std::memory_order_acquire) - m_nOutPtr.load(std::memory_order_acquire)) & m_nBufferMask) / 2;
+}
+
+size_t CSoundOutputRing::Write(const float* pSamples, size_t nFrames, bool bReversedStereo)
+{
+	const size_t nInPtr = m_nInPtr.load(std::memory_order_relaxed);
+	const size_t nUsed = (nInPtr - m_nOutPtr.load(std::memory_order_acquire)) & m_nBufferMask;
+
+	nFrames = Utility::Min(nFrames, (m_nBufferMask - nUsed) / 2);
+	if (nFrames == 0)
+		return 0;
+
+	// The ring holds a power of 2 samples, so it only ever wraps between frames
+	const size_t nFirstSpan = Utility::Min(nFrames, (m_nBufferMask + 1 - nInPtr) / 2);
+	AudioConvert::FloatToS24(pSamples, m_pBuffer + nInPtr, nFirstSpan, bReversedStereo);
+	if (nFrames > nFirstSpan)
+		AudioConvert::FloatToS24(pSamples + nFirstSpan * 2, m_pBuffer, nFrames - nFirstSpan, bReversedStereo);
+
+	m_nInPtr.store((nInPtr + nFrames * 2) & m_nBufferMask, std::memory_order_release);
+	return nFrames;
+}
+
+size_t CSoundOutputRing::Read(s32* pBuffer, size_t nSamples)
+{
+	const size_t nOutPtr = m_nOutPtr.load(std::memory_order_relaxed);
+	const size_t nCount = Utility::Min(nSamples, (m_nInPtr.load(std::memory_order_acquire) - nOutPtr) & m_nBufferMask);
+
+	if (nCount == 0)
+		return 0;
+
+	const size_t nFirstSpan = Utility::Min(nCount, m_nBufferMask + 1 - nOutPtr);
+	memcpy(pBuffer, m_pBuffer + nOutPtr, nFirstSpan * sizeof(s32));
+	if (nCount > nFirstSpan)
+		memcpy(pBuffer + nFirstSpan, m_pBuffer, (nCount - nFirstSpan) * sizeof(s32));
+
+	m_nOutPtr.store((nOutPtr + nCount) & m_nBufferMask, std::memory_order_release);
+	return nCount;
+}
+
+CPWMSoundOutput::CPWMSoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize)
+	: CPWMSoundBaseDevice(pInterrupt, nSampleRate, nChunkSize),
+	  m_Ring(Ring),
+	  m_nRangeMin(GetRangeMin()),
+	  m_nRange(GetRangeMax() - GetRangeMin())
+{
+}
+
+unsigned CPWMSoundOutput::GetChunk(u32* pBuffer, unsigned nChunkSize)
+{
+	s32* const pSamples = reinterpret_cast<s32*>(pBuffer);
+	const size_t nRead = m_Ring.Read(pSamples, nChunkSize);
+	memset(pSamples + nRead, 0, (nChunkSize - nRead) * sizeof(s32));
+
+	// Scale signed 24-bit samples to the PWM range; silence is the midpoint
+	for (unsigned int i = 0; i < nChunkSize; ++i)
+		pBuffer[i] = m_nRangeMin + (static_cast<u64>(pSamples[i] + (1 << 23)) * m_nRange >> 24);
+
+	return nChunkSize;
+}
+
+CHDMISoundOutput::CHDMISoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize)
+	: CHDMISoundBaseDevice(pInterrupt, nSampleRate, nChunkSize),
+	  m_Ring(Ring),
+	  m_nFrame(0)
+{
+}
+
+unsigned CHDMISoundOutput::GetChunk(u32* pBuffer, unsigned nChunkSize)
+{
+	s32* const pSamples = reinterpret_cast<s32*>(pBuffer);
+	const size_t nRead = m_Ring.Read(pSamples, nChunkSize);
+	memset(pSamples + nRead, 0, (nChunkSize - nRead) * sizeof(s32));
+
+	// Both subframes of a frame share its position in the block
+	for (unsigned int i = 0; i < nChunkSize; i += 2)
+	{
+		pBuffer[i] = ConvertIEC958Sample(pSamples[i], m_nFrame);
+		pBuffer[i + 1] = ConvertIEC958Sample(pSamples[i + 1], m_nFrame);
+
+		if (++m_nFrame == IEC958_FRAMES_PER_BLOCK)
+			m_nFrame = 0;
+	}
+
+	return nChunkSize;
+}
+
+CI2SSoundOutput::CI2SSoundOutput(CSoundOutputRing& Ring, CInterruptSystem* pInterrupt, unsigned int nSampleRate, unsigned int nChunkSize, bool bSlave, CI2CMaster* pI2CMaster)
+	: CI2SSoundBaseDevice(pInterrupt, nSampleRate, nChunkSize, bSlave, pI2CMaster),
+	  m_Ring(Ring)
+{
+}
+
+unsigned CI2SSoundOutput::GetChunk(u32* pBuffer, unsigned nChunkSize)
+{
+	// The hardware takes signed 24-bit samples in 32-bit words as they are
+	s32* const pSamples = reinterpret_cast<s32*>(pBuffer);
+	const size_t nRead = m_Ring.Read(pSamples, nChunkSize);
+	memset(pSamples + nRead, 0, (nChunkSize - nRead) * sizeof(s32));
+
+	return nChunkSize;
+}
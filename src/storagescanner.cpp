@@ -0,0 +1,109 @@
+//
+// storagescanner.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+
+#include "filesystemlock.h"
+#include "storagescanner.h"
+
+LOGMODULE("storagescanner");
+
+constexpr unsigned int PollPeriodMillis = 100;
+
+CStorageScanner::CStorageScanner(FATFS* pFileSystem, const char* pDrive)
+	: CTask(TASK_STACK_SIZE),
+	  m_pFileSystem(pFileSystem),
+	  m_pDrive(pDrive),
+	  m_State(TState::Idle),
+	  m_pROMManager(nullptr)
+{
+}
+
+void CStorageScanner::Mount(CROMManager* pROMManager)
+{
+	m_SoundFontList.CancelScan();
+	m_pROMManager = pROMManager;
+	m_State = TState::Mounting;
+}
+
+void CStorageScanner::Unmount(bool bRescan)
+{
+	// The scan task is yielding, so no directory on the disk is being read
+	m_SoundFontList.CancelScan();
+	CFileSystemLock::Acquire();
+	f_unmount(m_pDrive);
+	CFileSystemLock::Release();
+
+	// ROMs are kept in memory once loaded, so only SoundFonts need rescanning
+	m_pROMManager = nullptr;
+	m_State = bRescan ? TState::ScanningROMs : TState::Idle;
+}
+
+void CStorageScanner::Run()
+{
+	CScheduler* const pScheduler = CScheduler::Get();
+
+	while (true)
+	{
+		switch (m_State)
+		{
+			case TState::Idle:
+			case TState::Complete:
+				pScheduler->MsSleep(PollPeriodMillis);
+				continue;
+
+			case TState::Mounting:
+			{
+				CFileSystemLockGuard Lock;
+				if (f_mount(m_pFileSystem, m_pDrive, 1) != FR_OK)
+				{
+					LOGERR("Failed to mount USB mass storage device");
+					m_State = TState::Idle;
+					break;
+				}
+
+				m_State = TState::ScanningROMs;
+				break;
+			}
+
+			case TState::ScanningROMs:
+				// ROMs that were identified by a previous scan only need to be looked up in the index
+				if (m_pROMManager)
+					m_pROMManager->ScanROMs();
+
+				m_SoundFontList.BeginScan();
+				m_State = TState::ScanningSoundFonts;
+				break;
+
+			case TState::ScanningSoundFonts:
+				if (!m_SoundFontList.ContinueScan())
+				{
+					m_SoundFontList.FinishScan();
+					m_State = TState::Complete;
+				}
+				break;
+		}
+
+		pScheduler->Yield();
+	}
+}
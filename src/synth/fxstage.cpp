@@ -0,0 +1,204 @@
+//
+// fxstage.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include "synth/fxstage.h"
+
+LOGMODULE("fxstage");
+
+CFXStage::CFXStage()
+	: m_nWaitTimeoutMicros(0),
+
+	  m_ParameterLock(TASK_LEVEL),
+	  m_Parameters{},
+	  m_PendingParameters{},
+	  m_bParametersPending(false),
+
+	  m_nFlushRequest(0),
+	  m_nFlushDone(0),
+
+	  m_SendRing{},
+	  m_nSendWritten(0),
+	  m_nSendRead(0),
+
+	  // Start with one latency period of silence so that the FX core can run a block behind
+	  m_ReturnRing{},
+	  m_nReturnWritten(LatencyFrames),
+	  m_nReturnRead(0)
+{
+}
+
+bool CFXStage::Initialize(unsigned int nSampleRate)
+{
+	if (!nSampleRate)
+	{
+		LOGERR("Invalid sample rate");
+		return false;
+	}
+
+	m_nWaitTimeoutMicros = LatencyFrames / 2 * 1000000 / nSampleRate;
+
+	m_Reverb.Initialize(nSampleRate);
+	m_Chorus.Initialize(nSampleRate);
+
+	LOGNOTE("Reverb and chorus offloaded with %d frames of latency", static_cast<unsigned int>(LatencyFrames));
+	return true;
+}
+
+void CFXStage::SetParameters(const TFXParameters& Parameters)
+{
+	m_ParameterLock.Acquire();
+	m_PendingParameters = Parameters;
+	m_ParameterLock.Release();
+
+	m_bParametersPending.store(true, std::memory_order_release);
+}
+
+void CFXStage::Process(const float* pReverbSend, const float* pChorusSend, float* pOutBuffer, size_t nFrames)
+{
+	// Leave the output dry until the FX core has caught up with a flush
+	if (m_nFlushDone.load(std::memory_order_acquire) != m_nFlushRequest.load(std::memory_order_relaxed))
+		return;
+
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+	while (nFrames)
+	{
+		// Never ask for more wet frames than the FX core can have produced from what we've sent
+		const size_t nChunkFrames = nFrames < LatencyFrames ? nFrames : LatencyFrames;
+
+		const size_t nSendWritten = m_nSendWritten.load(std::memory_order_relaxed);
+		while (nSendWritten + nChunkFrames - m_nSendRead.load(std::memory_order_acquire) > RingFrames)
+		{
+			if (CTimer::GetClockTicks() - nStartTicks >= m_nWaitTimeoutMicros)
+			{
+				Reset();
+				return;
+			}
+		}
+
+		for (size_t i = 0; i < nChunkFrames; ++i)
+		{
+			const size_t nIndex = ((nSendWritten + i) & RingMask) * 2;
+			m_SendRing[nIndex] = pReverbSend[i];
+			m_SendRing[nIndex + 1] = pChorusSend[i];
+		}
+
+		m_nSendWritten.store(nSendWritten + nChunkFrames, std::memory_order_release);
+
+		const size_t nReturnRead = m_nReturnRead.load(std::memory_order_relaxed);
+		while (m_nReturnWritten.load(std::memory_order_acquire) - nReturnRead < nChunkFrames)
+		{
+			// The rings are out of step now, so start again from a flush
+			if (CTimer::GetClockTicks() - nStartTicks >= m_nWaitTimeoutMicros)
+			{
+				Reset();
+				return;
+			}
+		}
+
+		for (size_t i = 0; i < nChunkFrames; ++i)
+		{
+			const size_t nIndex = ((nReturnRead + i) & RingMask) * 2;
+			pOutBuffer[i * 2] += m_ReturnRing[nIndex];
+			pOutBuffer[i * 2 + 1] += m_ReturnRing[nIndex + 1];
+		}
+
+		m_nReturnRead.store(nReturnRead + nChunkFrames, std::memory_order_release);
+
+		pReverbSend += nChunkFrames;
+		pChorusSend += nChunkFrames;
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+bool CFXStage::Run()
+{
+	if (m_bParametersPending.exchange(false, std::memory_order_acquire))
+	{
+		m_ParameterLock.Acquire();
+		m_Parameters = m_PendingParameters;
+		m_ParameterLock.Release();
+
+		m_Reverb.SetParameters(m_Parameters.nReverbRoomSize, m_Parameters.nReverbDamping, m_Parameters.nReverbWidth, m_Parameters.nReverbLevel);
+		m_Chorus.SetParameters(m_Parameters.nChorusVoices, m_Parameters.nChorusLevel, m_Parameters.nChorusSpeed, m_Parameters.nChorusDepth, m_Parameters.nChorusType);
+	}
+
+	// The audio core doesn't touch the rings until the flush is acknowledged
+	const unsigned int nFlushRequest = m_nFlushRequest.load(std::memory_order_acquire);
+	if (nFlushRequest != m_nFlushDone.load(std::memory_order_relaxed))
+	{
+		m_Reverb.Reset();
+		m_Chorus.Reset();
+
+		// Drop unprocessed sends, and restart the return one latency period of silence ahead as at startup
+		const size_t nReturnRead = m_nReturnRead.load(std::memory_order_acquire);
+		memset(m_ReturnRing, 0, sizeof(m_ReturnRing));
+		m_nSendRead.store(m_nSendWritten.load(std::memory_order_acquire), std::memory_order_relaxed);
+		m_nReturnWritten.store(nReturnRead + LatencyFrames, std::memory_order_relaxed);
+
+		m_nFlushDone.store(nFlushRequest, std::memory_order_release);
+	}
+
+	const size_t nStartSendRead = m_nSendRead.load(std::memory_order_relaxed);
+	size_t nSendRead = nStartSendRead;
+	size_t nReturnWritten = m_nReturnWritten.load(std::memory_order_relaxed);
+
+	while (m_nSendWritten.load(std::memory_order_acquire) - nSendRead >= BlockFrames &&
+	       nReturnWritten + BlockFrames - m_nReturnRead.load(std::memory_order_acquire) <= RingFrames)
+	{
+		float ReverbIn[BlockFrames], ChorusIn[BlockFrames];
+		float LeftOut[BlockFrames] = { 0 }, RightOut[BlockFrames] = { 0 };
+
+		for (size_t i = 0; i < BlockFrames; ++i)
+		{
+			const size_t nIndex = ((nSendRead + i) & RingMask) * 2;
+			ReverbIn[i] = m_SendRing[nIndex];
+			ChorusIn[i] = m_SendRing[nIndex + 1];
+		}
+
+		nSendRead += BlockFrames;
+		m_nSendRead.store(nSendRead, std::memory_order_release);
+
+		if (m_Parameters.bReverbActive)
+			m_Reverb.ProcessMix(ReverbIn, LeftOut, RightOut, BlockFrames);
+
+		if (m_Parameters.bChorusActive)
+			m_Chorus.ProcessMix(ChorusIn, LeftOut, RightOut, BlockFrames);
+
+		for (size_t i = 0; i < BlockFrames; ++i)
+		{
+			const size_t nIndex = ((nReturnWritten + i) & RingMask) * 2;
+			m_ReturnRing[nIndex] = LeftOut[i];
+			m_ReturnRing[nIndex + 1] = RightOut[i];
+		}
+
+		nReturnWritten += BlockFrames;
+		m_nReturnWritten.store(nReturnWritten, std::memory_order_release);
+	}
+
+	return nSendRead != nStartSendRead;
+}
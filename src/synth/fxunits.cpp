@@ -0,0 +1,289 @@
+//
+// fxunits.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/util.h>
+
+#include <cmath>
+
+#include "synth/fxunits.h"
+#include "utility.h"
+
+namespace
+{
+	// Freeverb's tuning, in samples at 44.1kHz; the right channel's delay lines are slightly longer to decorrelate it
+	constexpr unsigned int ReverbTuningSampleRate = 44100;
+	constexpr size_t CombTunings[] = { 1116, 1188, 1277, 1356, 1422, 1491, 1557, 1617 };
+	constexpr size_t AllpassTunings[] = { 556, 441, 341, 225 };
+	constexpr size_t StereoSpread = 23;
+
+	constexpr float ReverbInputGain = 0.015f;
+	constexpr float ReverbWetScale = 3.0f;
+	constexpr float RoomSizeScale = 0.28f;
+	constexpr float RoomSizeOffset = 0.7f;
+	constexpr float DampingScale = 0.4f;
+	constexpr float AllpassFeedback = 0.5f;
+}
+
+CReverbUnit::CReverbUnit()
+	: m_pBuffer(nullptr),
+	  m_nBufferSize(0),
+	  m_Combs{},
+	  m_CombFilterStores{},
+	  m_Allpasses{},
+
+	  m_nFeedback(0.0f),
+	  m_nDamping1(0.0f),
+	  m_nDamping2(1.0f),
+	  m_nWet1(0.0f),
+	  m_nWet2(0.0f)
+{
+}
+
+CReverbUnit::~CReverbUnit()
+{
+	delete[] m_pBuffer;
+}
+
+void CReverbUnit::Initialize(unsigned int nSampleRate)
+{
+	const float nScale = static_cast<float>(nSampleRate) / ReverbTuningSampleRate;
+
+	size_t nSizes[2][CombCount + AllpassCount];
+	m_nBufferSize = 0;
+	for (size_t nSide = 0; nSide < 2; ++nSide)
+	{
+		for (size_t i = 0; i < CombCount + AllpassCount; ++i)
+		{
+			const size_t nTuning = i < CombCount ? CombTunings[i] : AllpassTunings[i - CombCount];
+			nSizes[nSide][i] = Utility::Max(static_cast<size_t>((nTuning + nSide * StereoSpread) * nScale), static_cast<size_t>(1));
+			m_nBufferSize += nSizes[nSide][i];
+		}
+	}
+
+	m_pBuffer = new float[m_nBufferSize];
+
+	float* pBuffer = m_pBuffer;
+	for (size_t nSide = 0; nSide < 2; ++nSide)
+	{
+		for (size_t i = 0; i < CombCount + AllpassCount; ++i)
+		{
+			TDelayLine& DelayLine = i < CombCount ? m_Combs[nSide][i] : m_Allpasses[nSide][i - CombCount];
+			DelayLine.pBuffer = pBuffer;
+			DelayLine.nSize = nSizes[nSide][i];
+			pBuffer += DelayLine.nSize;
+		}
+	}
+
+	Reset();
+}
+
+void CReverbUnit::SetParameters(float nRoomSize, float nDamping, float nWidth, float nLevel)
+{
+	m_nFeedback = Utility::Clamp(nRoomSize, 0.0f, 1.0f) * RoomSizeScale + RoomSizeOffset;
+	m_nDamping1 = Utility::Clamp(nDamping, 0.0f, 1.0f) * DampingScale;
+	m_nDamping2 = 1.0f - m_nDamping1;
+
+	const float nWet = Utility::Clamp(nLevel, 0.0f, 1.0f) * ReverbWetScale;
+	nWidth = Utility::Clamp(nWidth, 0.0f, 1.0f);
+	m_nWet1 = nWet * (nWidth / 2.0f + 0.5f);
+	m_nWet2 = nWet * ((1.0f - nWidth) / 2.0f);
+}
+
+void CReverbUnit::Reset()
+{
+	if (m_pBuffer)
+		memset(m_pBuffer, 0, m_nBufferSize * sizeof(float));
+
+	for (size_t nSide = 0; nSide < 2; ++nSide)
+	{
+		for (size_t i = 0; i < CombCount; ++i)
+		{
+			m_Combs[nSide][i].nIndex = 0;
+			m_CombFilterStores[nSide][i] = 0.0f;
+		}
+
+		for (TDelayLine& Allpass : m_Allpasses[nSide])
+			Allpass.nIndex = 0;
+	}
+}
+
+void CReverbUnit::ProcessMix(const float* pIn, float* pLeftOut, float* pRightOut, size_t nFrames)
+{
+	for (size_t n = 0; n < nFrames; ++n)
+	{
+		const float nInput = pIn[n] * ReverbInputGain;
+		float Outputs[2];
+
+		for (size_t nSide = 0; nSide < 2; ++nSide)
+		{
+			// Parallel low-pass feedback comb filters
+			float nOutput = 0.0f;
+			for (size_t i = 0; i < CombCount; ++i)
+			{
+				TDelayLine& Comb = m_Combs[nSide][i];
+				float& nFilterStore = m_CombFilterStores[nSide][i];
+
+				const float nDelayed = Comb.pBuffer[Comb.nIndex];
+				nFilterStore = nDelayed * m_nDamping2 + nFilterStore * m_nDamping1;
+				Comb.pBuffer[Comb.nIndex] = nInput + nFilterStore * m_nFeedback;
+				if (++Comb.nIndex == Comb.nSize)
+					Comb.nIndex = 0;
+
+				nOutput += nDelayed;
+			}
+
+			// Series allpass filters
+			for (TDelayLine& Allpass : m_Allpasses[nSide])
+			{
+				const float nDelayed = Allpass.pBuffer[Allpass.nIndex];
+				Allpass.pBuffer[Allpass.nIndex] = nOutput + nDelayed * AllpassFeedback;
+				if (++Allpass.nIndex == Allpass.nSize)
+					Allpass.nIndex = 0;
+
+				nOutput = nDelayed - nOutput;
+			}
+
+			Outputs[nSide] = nOutput;
+		}
+
+		pLeftOut[n] += Outputs[0] * m_nWet1 + Outputs[1] * m_nWet2;
+		pRightOut[n] += Outputs[1] * m_nWet1 + Outputs[0] * m_nWet2;
+	}
+}
+
+CChorusUnit::CChorusUnit()
+	: m_nSampleRate(0),
+
+	  m_pBuffer(nullptr),
+	  m_nBufferMask(0),
+	  m_nWriteIndex(0),
+
+	  m_nVoices(0),
+	  m_nLeftGain(0.0f),
+	  m_nRightGain(0.0f),
+	  m_nMinDelay(0.0f),
+	  m_nDepth(0.0f),
+	  m_bTriangle(false),
+
+	  m_nPhase(0.0f),
+	  m_nPhaseIncrement(0.0f)
+{
+}
+
+CChorusUnit::~CChorusUnit()
+{
+	delete[] m_pBuffer;
+}
+
+void CChorusUnit::Initialize(unsigned int nSampleRate)
+{
+	m_nSampleRate = nSampleRate;
+	m_nMinDelay = MinDelayMillis * nSampleRate / 1000.0f;
+
+	// Room for the longest delay plus the interpolation tap
+	const size_t nMaxDelay = static_cast<size_t>((MinDelayMillis + MaxDepthMillis) * nSampleRate / 1000.0f) + 2;
+	size_t nSize = 1;
+	while (nSize < nMaxDelay)
+		nSize <<= 1;
+
+	m_pBuffer = new float[nSize];
+
+	m_nBufferMask = nSize - 1;
+	Reset();
+}
+
+void CChorusUnit::SetParameters(int nVoices, float nLevel, float nSpeed, float nDepth, int nType)
+{
+	m_nVoices = Utility::Clamp(nVoices, 0, MaxVoices);
+
+	// Normalised so that the level doesn't depend on the number of voices mixed into each side; a single voice goes to both
+	const int nLeftVoices = m_nVoices == 1 ? 1 : (m_nVoices + 1) / 2;
+	const int nRightVoices = m_nVoices == 1 ? 1 : m_nVoices / 2;
+	m_nLeftGain = nLeftVoices ? nLevel / nLeftVoices : 0.0f;
+	m_nRightGain = nRightVoices ? nLevel / nRightVoices : 0.0f;
+
+	m_nDepth = Utility::Clamp(nDepth, 0.0f, MaxDepthMillis) * m_nSampleRate / 1000.0f;
+	m_nPhaseIncrement = Utility::Max(nSpeed, 0.0f) / m_nSampleRate;
+
+	// FLUID_CHORUS_MOD_TRIANGLE; anything else is FLUID_CHORUS_MOD_SINE
+	m_bTriangle = nType == 1;
+}
+
+void CChorusUnit::Reset()
+{
+	if (m_pBuffer)
+		memset(m_pBuffer, 0, (m_nBufferMask + 1) * sizeof(float));
+
+	m_nWriteIndex = 0;
+	m_nPhase = 0.0f;
+}
+
+void CChorusUnit::ProcessMix(const float* pIn, float* pLeftOut, float* pRightOut, size_t nFrames)
+{
+	if (!m_nVoices)
+		return;
+
+	const float nVoiceSpacing = 1.0f / m_nVoices;
+
+	for (size_t n = 0; n < nFrames; ++n)
+	{
+		m_pBuffer[m_nWriteIndex] = pIn[n];
+
+		float nLeft = 0.0f, nRight = 0.0f;
+		float nVoicePhase = m_nPhase;
+		for (int nVoice = 0; nVoice < m_nVoices; ++nVoice)
+		{
+			// Bipolar LFO, swept between the minimum delay and the minimum delay plus the depth
+			const float nLFO = m_bTriangle ? 4.0f * fabsf(nVoicePhase - 0.5f) - 1.0f : sinf(2.0f * static_cast<float>(M_PI) * nVoicePhase);
+			const float nDelay = m_nMinDelay + m_nDepth * 0.5f * (1.0f + nLFO);
+
+			// Linearly interpolated read behind the write position
+			const size_t nWholeDelay = static_cast<size_t>(nDelay);
+			const float nFraction = nDelay - nWholeDelay;
+			const float nSample1 = m_pBuffer[(m_nWriteIndex - nWholeDelay) & m_nBufferMask];
+			const float nSample2 = m_pBuffer[(m_nWriteIndex - nWholeDelay - 1) & m_nBufferMask];
+			const float nOutput = nSample1 + (nSample2 - nSample1) * nFraction;
+
+			if (m_nVoices == 1)
+			{
+				nLeft += nOutput;
+				nRight += nOutput;
+			}
+			else if (nVoice & 1)
+				nRight += nOutput;
+			else
+				nLeft += nOutput;
+
+			nVoicePhase += nVoiceSpacing;
+			if (nVoicePhase >= 1.0f)
+				nVoicePhase -= 1.0f;
+		}
+
+		pLeftOut[n] += nLeft * m_nLeftGain;
+		pRightOut[n] += nRight * m_nRightGain;
+
+		m_nWriteIndex = (m_nWriteIndex + 1) & m_nBufferMask;
+		m_nPhase += m_nPhaseIncrement;
+		if (m_nPhase >= 1.0f)
+			m_nPhase -= 1.0f;
+	}
+}
@@ -21,11 +21,15 @@
 //
 
 #include <circle/logger.h>
+#include <circle/machineinfo.h>
 #include <circle/timer.h>
 
+#include <cstring>
+
 #include "config.h"
 #include "lcd/ui.h"
 #include "synth/mt32synth.h"
+#include "tracer.h"
 #include "utility.h"
 
 LOGMODULE("mt32synth");
@@ -40,6 +44,9 @@ constexpr u32 MemoryAddressMasterVolume     = 0x40016;
 const u8 CMT32Synth::StandardMIDIChannelsSysEx[] = { 0x10, 0x00, 0x0D, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
 const u8 CMT32Synth::AlternateMIDIChannelsSysEx[] = { 0x10, 0x00, 0x0D, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09 };
 
+// SysEx command for resetting the synth to its power-on state (no SysEx framing, just 3-byte address and a data byte)
+const u8 ResetSysEx[] = { 0x7F, 0x00, 0x00, 0x00 };
+
 CMT32Synth::CMT32Synth(unsigned nSampleRate, float nGain, float nReverbGain, TResamplerQuality ResamplerQuality)
 	: CSynthBase(nSampleRate),
 
@@ -49,23 +56,50 @@ CMT32Synth::CMT32Synth(unsigned nSampleRate, float nGain, float nReverbGain, TRe
 	  m_nReverbGain(nReverbGain),
 
 	  m_ResamplerQuality(ResamplerQuality),
+	  m_bAutoResamplerQuality(ResamplerQuality == TResamplerQuality::Auto),
 	  m_pSampleRateConverter(nullptr),
 
 	  m_CurrentROMSet(TMT32ROMSet::Any),
 	  m_pControlROMImage(nullptr),
 	  m_pPCMROMImage(nullptr),
 
+	  m_WarmInstances{},
+
+	  m_bBackgroundLoading(false),
+	  m_SwitchState(TSwitchState::Idle),
+	  m_PendingInstance{},
+
+	  m_ExtraInstances{},
+	  m_nExtraInstances(0),
+
+	  m_bRenderWorkerEnabled(false),
+	  m_nRenderWorkerFrames(0),
+	  m_nRenderWorkerRequest(0),
+	  m_nRenderWorkerDone(0),
+	  m_ExtraBuffer{},
+	  m_ExtraMixBuffer{},
+
+	  m_nActivePartials(0),
+	  m_nMaxPartials(0),
+	  m_PartialStates{},
+
 	  m_LCDTextBuffer{'\0'}
 {
 }
 
 CMT32Synth::~CMT32Synth()
 {
+	if (m_pSampleRateConverter)
+		delete m_pSampleRateConverter;
+
 	if (m_pSynth)
 		delete m_pSynth;
 
-	if (m_pSampleRateConverter)
-		delete m_pSampleRateConverter;
+	DeleteWarmInstances();
+	DeleteSynthInstance(m_PendingInstance);
+
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		DeleteSynthInstance(m_ExtraInstances[i].Instance);
 }
 
 bool CMT32Synth::Initialize()
@@ -78,51 +112,321 @@ bool CMT32Synth::Initialize()
 	if (!m_ROMManager.HaveROMSet(InitialROMSet))
 		InitialROMSet = TMT32ROMSet::Any;
 
-	if (!m_ROMManager.GetROMSet(InitialROMSet, m_CurrentROMSet, m_pControlROMImage, m_pPCMROMImage))
+	TSynthInstance Instance{};
+	if (!m_ROMManager.GetROMSet(InitialROMSet, Instance.ROMSet, Instance.pControlROMImage, Instance.pPCMROMImage))
 		return false;
 
-	m_pSynth = new MT32Emu::Synth(this);
+	// Pick a resampler quality by measuring how long the new instance takes to render
+	if (m_bAutoResamplerQuality)
+		m_ResamplerQuality = TResamplerQuality::None;
 
-	if (!m_pSynth->open(*m_pControlROMImage, *m_pPCMROMImage))
+	if (!CreateSynthInstance(Instance))
 		return false;
 
-	m_pSynth->setOutputGain(m_nGain);
-	m_pSynth->setReverbOutputGain(m_nReverbGain);
+	if (m_bAutoResamplerQuality)
+	{
+		m_ResamplerQuality = CalibrateResampler(*Instance.pSynth);
+		Instance.pSampleRateConverter = CreateSampleRateConverter(*Instance.pSynth, m_ResamplerQuality);
+	}
+
+	SwapSynthInstance(Instance);
+	CreateExtraInstances(CConfig::Get()->MT32EmuExtraInstances);
+
+	return true;
+}
 
-	if (m_ResamplerQuality != TResamplerQuality::None)
+void CMT32Synth::CreateExtraInstances(const char* pDefinitions)
+{
+	// Comma-separated list of <ROM set>[:<MIDI channels>[:<channel offset>]]
+	char Buffer[128];
+	strncpy(Buffer, pDefinitions, sizeof(Buffer) - 1);
+	Buffer[sizeof(Buffer) - 1] = '\0';
+
+	char* pSavePtr;
+	for (char* pEntry = strtok_r(Buffer, " ,", &pSavePtr); pEntry; pEntry = strtok_r(nullptr, " ,", &pSavePtr))
 	{
-		auto quality = MT32Emu::SamplerateConversionQuality_GOOD;
-		switch (m_ResamplerQuality)
+		if (m_nExtraInstances == MaxExtraInstances)
 		{
-			case TResamplerQuality::Fastest:
-				quality = MT32Emu::SamplerateConversionQuality_FASTEST;
-				break;
+			LOGWARN("Too many MT-32 instances; maximum is %d", static_cast<unsigned int>(MaxExtraInstances + 1));
+			break;
+		}
 
-			case TResamplerQuality::Fast:
-				quality = MT32Emu::SamplerateConversionQuality_FAST;
-				break;
+		char* pFieldSavePtr;
+		const char* pROMSet = strtok_r(pEntry, ":", &pFieldSavePtr);
+		const char* pChannels = strtok_r(nullptr, ":", &pFieldSavePtr);
+		const char* pOffset = strtok_r(nullptr, ":", &pFieldSavePtr);
 
-			case TResamplerQuality::Good:
-				quality = MT32Emu::SamplerateConversionQuality_GOOD;
-				break;
+		TMT32ROMSet ROMSet;
+		TMIDIChannels Channels = TMIDIChannels::Standard;
+		int nOffset = 0;
 
-			case TResamplerQuality::Best:
-				quality = MT32Emu::SamplerateConversionQuality_BEST;
-				break;
+		if (!CConfig::ParseOption(pROMSet, &ROMSet) ||
+		    (pChannels && !CConfig::ParseOption(pChannels, &Channels)) ||
+		    (pOffset && !CConfig::ParseOption(pOffset, &nOffset)))
+		{
+			LOGWARN("Invalid MT-32 instance definition \"%s\"", pROMSet);
+			continue;
+		}
 
-			default:
-				break;
+		// The ROM manager hands out the same ROM images to every instance using a ROM set
+		TExtraInstance& Extra = m_ExtraInstances[m_nExtraInstances];
+		if (!m_ROMManager.GetROMSet(ROMSet, Extra.Instance.ROMSet, Extra.Instance.pControlROMImage, Extra.Instance.pPCMROMImage) ||
+		    !CreateSynthInstance(Extra.Instance))
+		{
+			LOGWARN("Couldn't create MT-32 instance with ROM set \"%s\"", pROMSet);
+			Extra = TExtraInstance{};
+			continue;
 		}
 
-		m_pSampleRateConverter = new MT32Emu::SampleRateConverter(*m_pSynth, m_nSampleRate, quality);
+		if (Channels == TMIDIChannels::Alternate)
+			Extra.Instance.pSynth->writeSysex(0x10, AlternateMIDIChannelsSysEx, sizeof(AlternateMIDIChannelsSysEx));
+		Extra.nChannelOffset = nOffset & 0x0F;
+
+		++m_nExtraInstances;
+		LOGNOTE("MT-32 instance %d: ROM set \"%s\", %s MIDI channels, offset %d", static_cast<unsigned int>(m_nExtraInstances + 1), pROMSet, Channels == TMIDIChannels::Standard ? "standard" : "alternate", Extra.nChannelOffset);
+	}
+
+	m_Lock.Acquire();
+	UpdateMaxPartialCount();
+	m_Lock.Release();
+}
+
+bool CMT32Synth::CreateSynthInstance(TSynthInstance& Instance)
+{
+	const CConfig* const pConfig = CConfig::Get();
+
+	auto AnalogOutputMode = MT32Emu::AnalogOutputMode_COARSE;
+	switch (pConfig->MT32EmuAnalogOutputMode)
+	{
+		case TAnalogOutputMode::DigitalOnly:
+			AnalogOutputMode = MT32Emu::AnalogOutputMode_DIGITAL_ONLY;
+			break;
+
+		case TAnalogOutputMode::Coarse:
+			AnalogOutputMode = MT32Emu::AnalogOutputMode_COARSE;
+			break;
+
+		case TAnalogOutputMode::Accurate:
+			AnalogOutputMode = MT32Emu::AnalogOutputMode_ACCURATE;
+			break;
+
+		case TAnalogOutputMode::Oversampled:
+			AnalogOutputMode = MT32Emu::AnalogOutputMode_OVERSAMPLED;
+			break;
+	}
+
+	const MT32Emu::Bit32u nPartials = Utility::Clamp(pConfig->MT32EmuPartials, 8, static_cast<int>(MaxPartials));
+
+	Instance.pSynth = new MT32Emu::Synth(this);
+	Instance.pSynth->selectRendererType(pConfig->MT32EmuRendererType == TRendererType::Float ? MT32Emu::RendererType_FLOAT : MT32Emu::RendererType_BIT16S);
+
+	if (!Instance.pSynth->open(*Instance.pControlROMImage, *Instance.pPCMROMImage, nPartials, AnalogOutputMode))
+	{
+		DeleteSynthInstance(Instance);
+		return false;
 	}
 
+	Instance.pSynth->setOutputGain(m_nGain);
+	Instance.pSynth->setReverbOutputGain(m_nReverbGain);
+	Instance.pSampleRateConverter = CreateSampleRateConverter(*Instance.pSynth, m_ResamplerQuality);
+
 	return true;
 }
 
+MT32Emu::SampleRateConverter* CMT32Synth::CreateSampleRateConverter(MT32Emu::Synth& Synth, TResamplerQuality Quality) const
+{
+	if (Quality == TResamplerQuality::None)
+		return nullptr;
+
+	auto quality = MT32Emu::SamplerateConversionQuality_GOOD;
+	switch (Quality)
+	{
+		case TResamplerQuality::Fastest:
+			quality = MT32Emu::SamplerateConversionQuality_FASTEST;
+			break;
+
+		case TResamplerQuality::Fast:
+			quality = MT32Emu::SamplerateConversionQuality_FAST;
+			break;
+
+		case TResamplerQuality::Good:
+			quality = MT32Emu::SamplerateConversionQuality_GOOD;
+			break;
+
+		case TResamplerQuality::Best:
+			quality = MT32Emu::SamplerateConversionQuality_BEST;
+			break;
+
+		default:
+			break;
+	}
+
+	return new MT32Emu::SampleRateConverter(Synth, m_nSampleRate, quality);
+}
+
+CMT32Synth::TResamplerQuality CMT32Synth::CalibrateResampler(MT32Emu::Synth& Synth) const
+{
+	static const char* const QualityNames[] = { "none", "fastest", "fast", "good", "best" };
+	const unsigned int nHeadroom = Utility::Clamp(CConfig::Get()->MT32EmuResamplerHeadroom, 0, 99);
+
+	float Buffer[CalibrationChunkFrames * 2];
+	TResamplerQuality Quality = TResamplerQuality::Fastest;
+
+	for (int i = static_cast<int>(TResamplerQuality::Best); i >= static_cast<int>(TResamplerQuality::Fastest); --i)
+	{
+		// Stress pattern: a dense chord on every melodic part (standard channel assignment) to use up all partials;
+		// restarted from a reset for every candidate so that each one renders the same attack and decay
+		Synth.writeSysex(0x10, ResetSysEx, sizeof(ResetSysEx));
+		for (u8 nChannel = 1; nChannel <= 8; ++nChannel)
+		{
+			for (u8 nNote = 48; nNote < 72; nNote += 3)
+				Synth.playMsg(0x7F0090 | (nNote << 8) | nChannel);
+		}
+
+		const TResamplerQuality Candidate = static_cast<TResamplerQuality>(i);
+		MT32Emu::SampleRateConverter* const pConverter = CreateSampleRateConverter(Synth, Candidate);
+
+		const unsigned int nStartTicks = CTimer::GetClockTicks();
+		for (size_t nChunk = 0; nChunk < CalibrationChunks; ++nChunk)
+			pConverter->getOutputSamples(Buffer, CalibrationChunkFrames);
+		const unsigned int nTicks = CTimer::GetClockTicks() - nStartTicks;
+
+		delete pConverter;
+
+		const unsigned int nLoad = static_cast<u64>(nTicks) * m_nSampleRate * 100 / (static_cast<u64>(CalibrationChunks * CalibrationChunkFrames) * 1000000);
+		LOGNOTE("Resampler calibration: %s quality uses %d%% of render budget", QualityNames[i], nLoad);
+
+		if (nLoad + nHeadroom <= 100)
+		{
+			Quality = Candidate;
+			break;
+		}
+	}
+
+	// Silence the stress pattern
+	Synth.writeSysex(0x10, ResetSysEx, sizeof(ResetSysEx));
+
+	LOGNOTE("Selected %s resampler quality on %s", QualityNames[static_cast<size_t>(Quality)], CMachineInfo::Get()->GetMachineName());
+	return Quality;
+}
+
+void CMT32Synth::OnThrottleDetected()
+{
+	if (!m_bAutoResamplerQuality || m_ResamplerQuality <= TResamplerQuality::Fastest)
+		return;
+
+	m_ResamplerQuality = static_cast<TResamplerQuality>(static_cast<int>(m_ResamplerQuality) - 1);
+	MT32Emu::SampleRateConverter* pConverter = CreateSampleRateConverter(*m_pSynth, m_ResamplerQuality);
+
+	MT32Emu::SampleRateConverter* ExtraConverters[MaxExtraInstances];
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		ExtraConverters[i] = CreateSampleRateConverter(*m_ExtraInstances[i].Instance.pSynth, m_ResamplerQuality);
+
+	m_Lock.Acquire();
+	MT32Emu::SampleRateConverter* const pOldConverter = m_pSampleRateConverter;
+	m_pSampleRateConverter = pConverter;
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		Utility::Swap(m_ExtraInstances[i].Instance.pSampleRateConverter, ExtraConverters[i]);
+	m_Lock.Release();
+
+	delete pOldConverter;
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		delete ExtraConverters[i];
+
+	// The warm instances still use the old quality
+	DeleteWarmInstances();
+
+	LOGWARN("Resampler quality reduced due to CPU throttling");
+}
+
+void CMT32Synth::DeleteSynthInstance(TSynthInstance& Instance)
+{
+	// The sample rate converter references the synth, so it must go first
+	if (Instance.pSampleRateConverter)
+		delete Instance.pSampleRateConverter;
+
+	if (Instance.pSynth)
+		delete Instance.pSynth;
+
+	Instance = TSynthInstance{};
+}
+
+void CMT32Synth::DeleteWarmInstances()
+{
+	for (TWarmInstance& Warm : m_WarmInstances)
+		DeleteSynthInstance(Warm.Instance);
+}
+
+void CMT32Synth::SwapSynthInstance(TSynthInstance& Instance)
+{
+	// Carry settings over from the current instance
+	if (m_pSynth)
+		Instance.pSynth->setReversedStereoEnabled(m_pSynth->isReversedStereoEnabled());
+
+	// The gain may have changed since a warm instance was opened
+	Instance.pSynth->setOutputGain(m_nGain);
+	Instance.pSynth->setReverbOutputGain(m_nReverbGain);
+
+	m_Lock.Acquire();
+
+	TSynthInstance OldInstance{ m_pSynth, m_pSampleRateConverter, m_CurrentROMSet, m_pControlROMImage, m_pPCMROMImage };
+
+	m_pSynth               = Instance.pSynth;
+	m_pSampleRateConverter = Instance.pSampleRateConverter;
+	m_CurrentROMSet        = Instance.ROMSet;
+	m_pControlROMImage     = Instance.pControlROMImage;
+	m_pPCMROMImage         = Instance.pPCMROMImage;
+
+	UpdateMaxPartialCount();
+	m_Lock.Release();
+
+	Instance = OldInstance;
+}
+
+void CMT32Synth::ActivateSynthInstance(TSynthInstance& Instance)
+{
+	// Return the instance to its power-on state in case it has been used before
+	Instance.pSynth->writeSysex(0x10, ResetSysEx, sizeof(ResetSysEx));
+
+	SwapSynthInstance(Instance);
+
+	// Keep the previous instance open, discarding anything it still had queued
+	Instance.pSynth->flushMIDIQueue();
+	const unsigned int nTicks = CTimer::GetClockTicks();
+	TWarmInstance* pWarm = nullptr;
+	for (TWarmInstance& Warm : m_WarmInstances)
+	{
+		// An activated warm instance's slot now holds the previous instance
+		if (&Instance == &Warm.Instance)
+		{
+			pWarm = &Warm;
+			break;
+		}
+
+		// Otherwise use a free slot, or the least recently used one
+		if (!pWarm || (pWarm->Instance.pSynth && (!Warm.Instance.pSynth || nTicks - Warm.nLastUsed > nTicks - pWarm->nLastUsed)))
+			pWarm = &Warm;
+	}
+
+	if (&Instance != &pWarm->Instance)
+	{
+		DeleteSynthInstance(pWarm->Instance);
+		pWarm->Instance = Instance;
+		Instance = TSynthInstance{};
+	}
+
+	pWarm->nLastUsed = nTicks;
+
+	if (CConfig::Get()->MT32EmuROMSetKeepWarm <= 0)
+		DeleteWarmInstances();
+}
+
 void CMT32Synth::HandleMIDIShortMessage(u32 nMessage)
 {
+	CTracer::Event(TTraceEvent::SynthShortMessage, nMessage);
 	m_pSynth->playMsg(nMessage);
+	if (m_nExtraInstances)
+		PlayExtraMIDIEvent(TMIDIEvent{ 0, nMessage, nullptr }, 0);
 
 	// Update MIDI monitor
 	CSynthBase::HandleMIDIShortMessage(nMessage);
@@ -130,32 +434,186 @@ void CMT32Synth::HandleMIDIShortMessage(u32 nMessage)
 
 void CMT32Synth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
 {
+	CTracer::Event(TTraceEvent::SynthSysExMessage, nSize);
 	m_pSynth->playSysex(pData, nSize);
+	if (m_nExtraInstances)
+		PlayExtraMIDIEvent(TMIDIEvent{ 0, static_cast<u32>(nSize), pData }, 0);
+}
+
+// Called with m_Lock held
+void CMT32Synth::PlayExtraMIDIEvent(const TMIDIEvent& Event, size_t nOffset)
+{
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+	{
+		const TExtraInstance& Extra = m_ExtraInstances[i];
+		MT32Emu::Synth& Synth = *Extra.Instance.pSynth;
+		const MT32Emu::Bit32u nTimestamp = GetSynthTimestamp(Synth, Extra.Instance.pSampleRateConverter, nOffset);
+
+		// Every instance responds to SysEx
+		if (Event.pSysExData)
+		{
+			Synth.playSysex(Event.pSysExData, Event.nMessage, nTimestamp);
+			continue;
+		}
+
+		// Shift channel messages onto the instance's own channel assignment; channels below the offset aren't
+		// meant for this instance. System messages are passed through unchanged.
+		u32 nMessage = Event.nMessage;
+		if ((nMessage & 0xF0) < 0xF0)
+		{
+			const u8 nChannel = nMessage & 0x0F;
+			if (nChannel < Extra.nChannelOffset)
+				continue;
+
+			nMessage = (nMessage & ~0x0F) | (nChannel - Extra.nChannelOffset);
+		}
+
+		Synth.playMsg(nMessage, nTimestamp);
+	}
+}
+
+MT32Emu::Bit32u CMT32Synth::GetSynthTimestamp(MT32Emu::Synth& Synth, const MT32Emu::SampleRateConverter* pConverter, size_t nOffset)
+{
+	MT32Emu::Bit32u nTimestamp = Synth.getInternalRenderedSampleCount();
+
+	// Convert to internal sample rate
+	if (pConverter)
+		nTimestamp += static_cast<MT32Emu::Bit32u>(pConverter->convertOutputToSynthTimestamp(nOffset));
+	else
+		nTimestamp += nOffset;
+
+	return nTimestamp;
+}
+
+bool CMT32Synth::IsActive()
+{
+	if (m_pSynth->isActive())
+		return true;
+
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+	{
+		if (m_ExtraInstances[i].Instance.pSynth->isActive())
+			return true;
+	}
+
+	return false;
+}
+
+unsigned int CMT32Synth::GetActiveVoiceCount() const
+{
+	return m_nActivePartials.load(std::memory_order_relaxed);
+}
+
+unsigned int CMT32Synth::GetMaxVoiceCount() const
+{
+	return m_nMaxPartials.load(std::memory_order_relaxed);
+}
+
+// Called with m_Lock held
+unsigned int CMT32Synth::GetActivePartialCount(const MT32Emu::Synth& Synth)
+{
+	// Partials are the MT-32's equivalent of voices
+	const MT32Emu::Bit32u nPartials = Utility::Min(Synth.getPartialCount(), static_cast<MT32Emu::Bit32u>(MaxPartials));
+	Synth.getPartialStates(m_PartialStates);
+
+	unsigned int nActive = 0;
+	for (MT32Emu::Bit32u i = 0; i < nPartials; ++i)
+	{
+		if (m_PartialStates[i] != MT32Emu::PartialState_INACTIVE)
+			++nActive;
+	}
+
+	return nActive;
+}
+
+// Called with m_Lock held
+void CMT32Synth::UpdateActivePartialCount()
+{
+	unsigned int nActive = GetActivePartialCount(*m_pSynth);
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		nActive += GetActivePartialCount(*m_ExtraInstances[i].Instance.pSynth);
+
+	m_nActivePartials.store(nActive, std::memory_order_relaxed);
+}
+
+// Called with m_Lock held
+void CMT32Synth::UpdateMaxPartialCount()
+{
+	// Every instance is opened with the same partial count
+	m_nMaxPartials.store(m_pSynth->getPartialCount() * (1 + m_nExtraInstances), std::memory_order_relaxed);
 }
 
 void CMT32Synth::AllSoundOff()
 {
+	m_Lock.Acquire();
+
+	// Apply pending events first so that none are played afterwards
+	ProcessMIDIEventQueue();
+
 	// Stop all sound immediately; mt32emu treats CC 0x7C like "All Sound Off", ignoring pedal
 	for (uint8_t i = 0; i < 8; ++i)
+	{
 		m_pSynth->playMsgOnPart(i, 0x0B, 0x7C, 0);
+		for (size_t j = 0; j < m_nExtraInstances; ++j)
+			m_ExtraInstances[j].Instance.pSynth->playMsgOnPart(i, 0x0B, 0x7C, 0);
+	}
+
+	m_Lock.Release();
 
 	// Reset MIDI monitor
 	CSynthBase::AllSoundOff();
 }
 
+void CMT32Synth::ProcessStandbyMIDIEvents()
+{
+	m_Lock.Acquire();
+	ProcessMIDIEventQueue();
+
+	// mt32emu normally applies queued messages as it renders
+	m_pSynth->flushMIDIQueue();
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		m_ExtraInstances[i].Instance.pSynth->flushMIDIQueue();
+	m_Lock.Release();
+}
+
 void CMT32Synth::SetMasterVolume(u8 nVolume)
 {
 	const u8 SetVolumeSysEx[] = { 0x10, 0x00, 0x16, nVolume };
 	m_pSynth->writeSysex(0x10, SetVolumeSysEx, sizeof(SetVolumeSysEx));
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		m_ExtraInstances[i].Instance.pSynth->writeSysex(0x10, SetVolumeSysEx, sizeof(SetVolumeSysEx));
 }
 
 size_t CMT32Synth::Render(s16* pOutBuffer, size_t nFrames)
 {
 	m_Lock.Acquire();
-	if (m_pSampleRateConverter)
-		m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
+	if (m_bSampleAccurateMIDI)
+		ScheduleMIDIEvents(nFrames);
 	else
-		m_pSynth->render(pOutBuffer, nFrames);
+		ProcessMIDIEventQueue();
+
+	if (!m_nExtraInstances)
+	{
+		if (m_pSampleRateConverter)
+			m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
+		else
+			m_pSynth->render(pOutBuffer, nFrames);
+	}
+	else
+	{
+		// Mix in float, then convert
+		for (size_t nOffset = 0; nOffset < nFrames; nOffset += ExtraInstanceChunkSize)
+		{
+			const size_t nChunkFrames = Utility::Min(nFrames - nOffset, ExtraInstanceChunkSize);
+			float Buffer[ExtraInstanceChunkSize * 2];
+			MixExtraInstances(Buffer, nChunkFrames);
+
+			for (size_t i = 0; i < nChunkFrames * 2; ++i)
+				pOutBuffer[nOffset * 2 + i] = Utility::Clamp(Buffer[i], -1.0f, 1.0f) * 32767.0f;
+		}
+	}
+
+	UpdateActivePartialCount();
 	m_Lock.Release();
 
 	return nFrames;
@@ -163,16 +621,128 @@ size_t CMT32Synth::Render(s16* pOutBuffer, size_t nFrames)
 
 size_t CMT32Synth::Render(float* pOutBuffer, size_t nFrames)
 {
+	CTracer::CScope TraceScope(TTraceEvent::SynthRender, nFrames);
 	m_Lock.Acquire();
-	if (m_pSampleRateConverter)
-		m_pSampleRateConverter->getOutputSamples(pOutBuffer, nFrames);
+	if (m_bSampleAccurateMIDI)
+		ScheduleMIDIEvents(nFrames);
+	else
+		ProcessMIDIEventQueue();
+
+	if (m_nExtraInstances)
+		MixExtraInstances(pOutBuffer, nFrames);
 	else
-		m_pSynth->render(pOutBuffer, nFrames);
+		RenderSynthInstance(*m_pSynth, m_pSampleRateConverter, pOutBuffer, nFrames);
+
+	UpdateActivePartialCount();
 	m_Lock.Release();
 
 	return nFrames;
 }
 
+void CMT32Synth::RenderSynthInstance(MT32Emu::Synth& Synth, MT32Emu::SampleRateConverter* pConverter, float* pOutBuffer, size_t nFrames)
+{
+	if (pConverter)
+		pConverter->getOutputSamples(pOutBuffer, nFrames);
+	else
+		Synth.render(pOutBuffer, nFrames);
+}
+
+// Called with m_Lock held; renders the main instance plus the additional instances
+void CMT32Synth::MixExtraInstances(float* pOutBuffer, size_t nFrames)
+{
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, ExtraInstanceChunkSize);
+
+		if (m_bRenderWorkerEnabled)
+		{
+			m_nRenderWorkerFrames = nChunkFrames;
+			m_nRenderWorkerRequest.store(m_nRenderWorkerRequest.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		RenderSynthInstance(*m_pSynth, m_pSampleRateConverter, pOutBuffer, nChunkFrames);
+
+		if (m_bRenderWorkerEnabled)
+		{
+			const unsigned int nRequest = m_nRenderWorkerRequest.load(std::memory_order_relaxed);
+			while (m_nRenderWorkerDone.load(std::memory_order_acquire) != nRequest)
+				;
+		}
+		else
+			RenderExtraInstances(m_ExtraBuffer, nChunkFrames);
+
+		for (size_t i = 0; i < nChunkFrames * 2; ++i)
+			pOutBuffer[i] += m_ExtraBuffer[i];
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CMT32Synth::RenderExtraInstances(float* pOutBuffer, size_t nFrames)
+{
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+	{
+		const TSynthInstance& Instance = m_ExtraInstances[i].Instance;
+		float* const pBuffer = i == 0 ? pOutBuffer : m_ExtraMixBuffer;
+		RenderSynthInstance(*Instance.pSynth, Instance.pSampleRateConverter, pBuffer, nFrames);
+
+		if (i > 0)
+		{
+			for (size_t j = 0; j < nFrames * 2; ++j)
+				pOutBuffer[j] += m_ExtraMixBuffer[j];
+		}
+	}
+}
+
+bool CMT32Synth::RenderWorker()
+{
+	const unsigned int nRequest = m_nRenderWorkerRequest.load(std::memory_order_acquire);
+	if (nRequest == m_nRenderWorkerDone.load(std::memory_order_relaxed))
+		return false;
+
+	// The audio core holds m_Lock and waits for us, so the extra instances can't be modified while rendering
+	RenderExtraInstances(m_ExtraBuffer, m_nRenderWorkerFrames);
+	m_nRenderWorkerDone.store(nRequest, std::memory_order_release);
+	return true;
+}
+
+void CMT32Synth::ScheduleMIDIEvents(size_t nFrames)
+{
+	// Events stay queued until there is a block to place them in
+	if (nFrames == 0)
+		return;
+
+	const unsigned int nBlockStartTicks = GetBlockStartTicks(nFrames);
+	TMIDIEvent Event;
+	TMIDIEventQueue* pQueue;
+
+	// mt32emu has its own timestamped queue, so everything due by the end of this block can be handed over in one go;
+	// its queue is in order too, so later events stay with us rather than queue up behind them
+	while ((pQueue = PeekMIDIEvent(Event)))
+	{
+		const size_t nOffset = GetEventFrameOffset(Event.nTimestamp, nBlockStartTicks);
+		if (nOffset > nFrames)
+			break;
+
+		pQueue->Dequeue(Event);
+		const MT32Emu::Bit32u nTimestamp = GetSynthTimestamp(*m_pSynth, m_pSampleRateConverter, nOffset);
+
+		if (Event.pSysExData)
+			m_pSynth->playSysex(Event.pSysExData, Event.nMessage, nTimestamp);
+		else
+		{
+			m_pSynth->playMsg(Event.nMessage, nTimestamp);
+
+			// Update MIDI monitor
+			CSynthBase::HandleMIDIShortMessage(Event.nMessage);
+		}
+
+		if (m_nExtraInstances)
+			PlayExtraMIDIEvent(Event, nOffset);
+	}
+}
+
 void CMT32Synth::ReportStatus() const
 {
 	if (m_pUI)
@@ -216,18 +786,55 @@ void CMT32Synth::UpdateLCD(CLCD& LCD, unsigned int nTicks)
 	LCD.Print(m_LCDTextBuffer, 0, nStatusRow, true, false);
 }
 
+void CMT32Synth::SetReversedStereo(bool bEnabled)
+{
+	m_pSynth->setReversedStereoEnabled(bEnabled);
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		m_ExtraInstances[i].Instance.pSynth->setReversedStereoEnabled(bEnabled);
+}
+
+void CMT32Synth::SetGain(float nGain, float nReverbGain)
+{
+	m_nGain = nGain;
+	m_nReverbGain = nReverbGain;
+
+	m_Lock.Acquire();
+
+	m_pSynth->setOutputGain(m_nGain);
+	m_pSynth->setReverbOutputGain(m_nReverbGain);
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+	{
+		m_ExtraInstances[i].Instance.pSynth->setOutputGain(m_nGain);
+		m_ExtraInstances[i].Instance.pSynth->setReverbOutputGain(m_nReverbGain);
+	}
+
+	m_Lock.Release();
+}
+
 void CMT32Synth::SetMIDIChannels(TMIDIChannels Channels)
 {
-	if (Channels == TMIDIChannels::Standard)
-		m_pSynth->writeSysex(0x10, StandardMIDIChannelsSysEx, sizeof(StandardMIDIChannelsSysEx));
-	else
-		m_pSynth->writeSysex(0x10, AlternateMIDIChannelsSysEx, sizeof(AlternateMIDIChannelsSysEx));
+	const bool bStandard = Channels == TMIDIChannels::Standard;
+	const u8* const pSysEx = bStandard ? StandardMIDIChannelsSysEx : AlternateMIDIChannelsSysEx;
+	const size_t nSize = bStandard ? sizeof(StandardMIDIChannelsSysEx) : sizeof(AlternateMIDIChannelsSysEx);
+
+	m_Lock.Acquire();
+
+	m_pSynth->writeSysex(0x10, pSysEx, nSize);
+	for (size_t i = 0; i < m_nExtraInstances; ++i)
+		m_ExtraInstances[i].Instance.pSynth->writeSysex(0x10, pSysEx, nSize);
+
+	m_Lock.Release();
 }
 
 bool CMT32Synth::SwitchROMSet(TMT32ROMSet ROMSet)
 {
-	const MT32Emu::ROMImage* pControlROMImage;
-	const MT32Emu::ROMImage* pPCMROMImage;
+	// A background switch is still in progress
+	if (m_SwitchState.load(std::memory_order_acquire) != TSwitchState::Idle)
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("ROM switch busy!");
+		return false;
+	}
 
 	// Is this ROM set already active?
 	if (ROMSet == m_CurrentROMSet)
@@ -238,24 +845,78 @@ bool CMT32Synth::SwitchROMSet(TMT32ROMSet ROMSet)
 	}
 
 	// Get ROM set if available
-	if (!m_ROMManager.GetROMSet(ROMSet, m_CurrentROMSet, pControlROMImage, pPCMROMImage))
+	TSynthInstance Instance{};
+	if (!m_ROMManager.GetROMSet(ROMSet, Instance.ROMSet, Instance.pControlROMImage, Instance.pPCMROMImage))
 	{
 		if (m_pUI)
 			m_pUI->ShowSystemMessage("ROM set not avail!");
 		return false;
 	}
 
-	// Reopen synth with new ROMs
-	m_Lock.Acquire();
-	m_pSynth->close();
-	assert(m_pSynth->open(*pControlROMImage, *pPCMROMImage));
-	m_pSynth->setOutputGain(m_nGain);
-	m_pSynth->setReverbOutputGain(m_nReverbGain);
-	m_Lock.Release();
+	// Switching back to a previous ROM set is instant while its instance is still open
+	for (TWarmInstance& Warm : m_WarmInstances)
+	{
+		if (Warm.Instance.pSynth && Warm.Instance.ROMSet == Instance.ROMSet)
+		{
+			ActivateSynthInstance(Warm.Instance);
+			return true;
+		}
+	}
+
+	// Hand over to the background loader; the current ROM set keeps playing until the switch completes
+	if (m_bBackgroundLoading)
+	{
+		m_PendingInstance = Instance;
+		m_SwitchState.store(TSwitchState::Requested, std::memory_order_release);
+		return false;
+	}
+
+	// Open a new instance with the new ROMs while the current one keeps playing
+	if (!CreateSynthInstance(Instance))
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("ROM switch failed!");
+		return false;
+	}
+
+	ActivateSynthInstance(Instance);
 
-	m_pControlROMImage = pControlROMImage;
-	m_pPCMROMImage     = pPCMROMImage;
+	return true;
+}
+
+void CMT32Synth::RunBackgroundLoader()
+{
+	if (m_SwitchState.load(std::memory_order_acquire) != TSwitchState::Requested)
+		return;
+
+	const bool bResult = CreateSynthInstance(m_PendingInstance);
+	m_SwitchState.store(bResult ? TSwitchState::Succeeded : TSwitchState::Failed, std::memory_order_release);
+}
+
+bool CMT32Synth::UpdateROMSetSwitch()
+{
+	// Close previous instances once they have been unused for long enough
+	const unsigned int nKeepWarmTicks = CConfig::Get()->MT32EmuROMSetKeepWarm * 1000000;
+	for (TWarmInstance& Warm : m_WarmInstances)
+	{
+		if (Warm.Instance.pSynth && (CTimer::GetClockTicks() - Warm.nLastUsed) >= nKeepWarmTicks)
+			DeleteSynthInstance(Warm.Instance);
+	}
+
+	const TSwitchState State = m_SwitchState.load(std::memory_order_acquire);
+	if (State == TSwitchState::Idle || State == TSwitchState::Requested)
+		return false;
+
+	m_SwitchState.store(TSwitchState::Idle, std::memory_order_release);
+
+	if (State == TSwitchState::Failed)
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("ROM switch failed!");
+		return false;
+	}
 
+	ActivateSynthInstance(m_PendingInstance);
 	return true;
 }
 
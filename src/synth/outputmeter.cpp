@@ -0,0 +1,154 @@
+//
+// outputmeter.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <cmath>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define OUTPUTMETER_NEON
+#endif
+
+#include "synth/outputmeter.h"
+#include "utility.h"
+
+COutputMeter::COutputMeter(unsigned int nSampleRate, size_t nChannels)
+	: m_nSampleRate(nSampleRate),
+	  m_nChannels(Utility::Min(nChannels, MaxChannels)),
+
+	  m_MeanSquares{},
+	  m_Peaks{},
+
+	  m_nSequence(0),
+	  m_RMSSnapshot{},
+	  m_PeakSnapshot{}
+{
+}
+
+void COutputMeter::Process(const float* const* ppBuffers, size_t nFrames)
+{
+	if (!nFrames)
+		return;
+
+	// Per-block smoothing factors
+	const float nBlockMillis = nFrames * 1000.0f / m_nSampleRate;
+	const float nRMSFactor = Utility::Min(nBlockMillis / RMSTimeMillis, 1.0f);
+	const float nPeakFalloff = Utility::Max(1.0f - nBlockMillis / PeakFalloffTimeMillis, 0.0f);
+
+	for (size_t nChannel = 0; nChannel < m_nChannels; ++nChannel)
+	{
+		float nLeftPeak, nLeftSumOfSquares, nRightPeak, nRightSumOfSquares;
+		MeasureBuffer(ppBuffers[nChannel * 2], nFrames, nLeftPeak, nLeftSumOfSquares);
+		MeasureBuffer(ppBuffers[nChannel * 2 + 1], nFrames, nRightPeak, nRightSumOfSquares);
+
+		const float nMeanSquare = (nLeftSumOfSquares + nRightSumOfSquares) / (nFrames * 2);
+		m_MeanSquares[nChannel] += (nMeanSquare - m_MeanSquares[nChannel]) * nRMSFactor;
+		m_Peaks[nChannel] = Utility::Max(Utility::Max(nLeftPeak, nRightPeak), m_Peaks[nChannel] * nPeakFalloff);
+	}
+
+	// Publish; readers retry if the sequence number changes while they copy
+	const unsigned int nSequence = m_nSequence.load(std::memory_order_relaxed);
+	m_nSequence.store(nSequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (size_t nChannel = 0; nChannel < m_nChannels; ++nChannel)
+	{
+		m_RMSSnapshot[nChannel].store(m_MeanSquares[nChannel], std::memory_order_relaxed);
+		m_PeakSnapshot[nChannel].store(m_Peaks[nChannel], std::memory_order_relaxed);
+	}
+
+	m_nSequence.store(nSequence + 2, std::memory_order_release);
+}
+
+void COutputMeter::GetLevels(float* pOutRMSLevels, float* pOutPeakLevels) const
+{
+	unsigned int nSequence;
+
+	do
+	{
+		nSequence = m_nSequence.load(std::memory_order_acquire);
+		if (nSequence & 1)
+			continue;
+
+		for (size_t nChannel = 0; nChannel < m_nChannels; ++nChannel)
+		{
+			pOutRMSLevels[nChannel] = m_RMSSnapshot[nChannel].load(std::memory_order_relaxed);
+			pOutPeakLevels[nChannel] = m_PeakSnapshot[nChannel].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((nSequence & 1) || m_nSequence.load(std::memory_order_relaxed) != nSequence);
+
+	// Convert outside of the loop to keep the window for a retry short
+	for (size_t nChannel = 0; nChannel < m_nChannels; ++nChannel)
+	{
+		pOutRMSLevels[nChannel] = ToMeterScale(sqrtf(pOutRMSLevels[nChannel]));
+		pOutPeakLevels[nChannel] = ToMeterScale(pOutPeakLevels[nChannel]);
+	}
+}
+
+void COutputMeter::MeasureBuffer(const float* pBuffer, size_t nFrames, float& nOutPeak, float& nOutSumOfSquares)
+{
+	float nPeak = 0.0f;
+	float nSumOfSquares = 0.0f;
+
+#ifdef OUTPUTMETER_NEON
+	// 4 frames per iteration
+	const size_t nVectorFrames = nFrames & ~3;
+	float32x4_t Peak = vdupq_n_f32(0.0f);
+	float32x4_t SumOfSquares = vdupq_n_f32(0.0f);
+
+	for (size_t i = 0; i < nVectorFrames; i += 4)
+	{
+		const float32x4_t Samples = vld1q_f32(pBuffer + i);
+		Peak = vmaxq_f32(Peak, vabsq_f32(Samples));
+		SumOfSquares = vmlaq_f32(SumOfSquares, Samples, Samples);
+	}
+
+	// Pairwise reductions are available on both AArch32 and AArch64
+	const float32x2_t PeakPair = vpmax_f32(vget_low_f32(Peak), vget_high_f32(Peak));
+	const float32x2_t SumPair = vpadd_f32(vget_low_f32(SumOfSquares), vget_high_f32(SumOfSquares));
+	nPeak = vget_lane_f32(vpmax_f32(PeakPair, PeakPair), 0);
+	nSumOfSquares = vget_lane_f32(vpadd_f32(SumPair, SumPair), 0);
+	pBuffer += nVectorFrames;
+	nFrames -= nVectorFrames;
+#endif
+
+	for (size_t i = 0; i < nFrames; ++i)
+	{
+		nPeak = Utility::Max(nPeak, fabsf(pBuffer[i]));
+		nSumOfSquares += pBuffer[i] * pBuffer[i];
+	}
+
+	nOutPeak = nPeak;
+	nOutSumOfSquares = nSumOfSquares;
+}
+
+float COutputMeter::ToMeterScale(float nLevel)
+{
+	constexpr float nMinLevel = 0.00398f;	// -48dB
+
+	if (nLevel <= nMinLevel)
+		return 0.0f;
+
+	return Utility::Clamp(1.0f + 20.0f * log10f(nLevel) / MeterRangeDecibels, 0.0f, 1.0f);
+}
@@ -0,0 +1,191 @@
+//
+// polyphaseresampler.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/util.h>
+
+#include <cmath>
+
+#include "synth/polyphaseresampler.h"
+
+LOGMODULE("resampler");
+
+namespace
+{
+	constexpr unsigned int GCD(unsigned int nA, unsigned int nB)
+	{
+		return nB ? GCD(nB, nA % nB) : nA;
+	}
+
+	// Fraction of the lower Nyquist frequency to pass; trades a little top-end for stopband attenuation
+	constexpr float PassbandFraction = 0.9f;
+
+	// Kaiser window shape parameter (~80dB stopband)
+	constexpr float KaiserBeta = 8.0f;
+
+	// Zeroth-order modified Bessel function of the first kind
+	float BesselI0(float nX)
+	{
+		float nSum = 1.0f;
+		float nTerm = 1.0f;
+		for (int k = 1; k < 32; ++k)
+		{
+			const float nFactor = nX / (2.0f * k);
+			nTerm *= nFactor * nFactor;
+			nSum += nTerm;
+		}
+
+		return nSum;
+	}
+
+#ifdef POLYPHASERESAMPLER_NEON
+	inline float HorizontalAdd(float32x4_t Vector)
+	{
+		const float32x2_t Sum = vadd_f32(vget_low_f32(Vector), vget_high_f32(Vector));
+		return vget_lane_f32(vpadd_f32(Sum, Sum), 0);
+	}
+#endif
+}
+
+CPolyphaseResampler::CPolyphaseResampler()
+	: m_nInterpolation(1),
+	  m_nDecimation(1),
+	  m_pCoefficients(nullptr),
+	  m_pLeft(nullptr),
+	  m_pRight(nullptr),
+	  m_pInputBuffer(nullptr),
+	  m_nCurrentIndex(0),
+	  m_nFilledFrames(0),
+	  m_nPhase(0)
+{
+}
+
+CPolyphaseResampler::~CPolyphaseResampler()
+{
+	delete[] m_pCoefficients;
+	delete[] m_pLeft;
+	delete[] m_pRight;
+	delete[] m_pInputBuffer;
+}
+
+bool CPolyphaseResampler::Initialize(unsigned int nInputRate, unsigned int nOutputRate)
+{
+	const unsigned int nGCD = GCD(nInputRate, nOutputRate);
+	m_nInterpolation = nOutputRate / nGCD;
+	m_nDecimation = nInputRate / nGCD;
+
+	if (m_nInterpolation > MaxPhases)
+	{
+		LOGERR("Unsupported resampling ratio %d:%d", nInputRate, nOutputRate);
+		return false;
+	}
+
+	// Prototype low-pass filter at the upsampled rate, cut off below the lower of the two Nyquist frequencies
+	const size_t nLength = m_nInterpolation * TapsPerPhase;
+	const float nCutoff = 0.5f * PassbandFraction * (nInputRate < nOutputRate ? nInputRate : nOutputRate) / (static_cast<float>(nInputRate) * m_nInterpolation);
+	const float nCenter = (nLength - 1) / 2.0f;
+	const float nWindowScale = 1.0f / BesselI0(KaiserBeta);
+
+	m_pCoefficients = new float[nLength];
+	for (size_t n = 0; n < nLength; ++n)
+	{
+		const float nX = n - nCenter;
+		const float nSinc = nX == 0.0f ? 2.0f * nCutoff : sinf(2.0f * M_PI * nCutoff * nX) / (M_PI * nX);
+		const float nRatio = nX / nCenter;
+		const float nWindow = BesselI0(KaiserBeta * sqrtf(1.0f - nRatio * nRatio)) * nWindowScale;
+
+		// Phase p, tap k of the prototype h[p + kL] is stored at [p][TapsPerPhase - 1 - k]; gain of L makes up for zero-stuffing
+		const size_t nPhase = n % m_nInterpolation;
+		const size_t nTap = n / m_nInterpolation;
+		m_pCoefficients[nPhase * TapsPerPhase + TapsPerPhase - 1 - nTap] = nSinc * nWindow * m_nInterpolation;
+	}
+
+	// Worst case input frames per chunk, plus history
+	const size_t nMaxInputFrames = MaxChunkFrames * m_nDecimation / m_nInterpolation + 2;
+	const size_t nHistorySize = TapsPerPhase + nMaxInputFrames;
+
+	m_pLeft = new float[nHistorySize];
+	m_pRight = new float[nHistorySize];
+	m_pInputBuffer = new float[nMaxInputFrames * 2];
+
+	// Start with a silent history
+	memset(m_pLeft, 0, nHistorySize * sizeof(float));
+	memset(m_pRight, 0, nHistorySize * sizeof(float));
+	m_nCurrentIndex = TapsPerPhase - 1;
+	m_nFilledFrames = TapsPerPhase - 1;
+	m_nPhase = 0;
+
+	LOGNOTE("Resampling %dHz to %dHz (%d:%d)", nInputRate, nOutputRate, m_nInterpolation, m_nDecimation);
+	return true;
+}
+
+void CPolyphaseResampler::FilterChunk(float* pOutBuffer, size_t nFrames)
+{
+	size_t nIndex = m_nCurrentIndex;
+	size_t nPhase = m_nPhase;
+
+	for (size_t i = 0; i < nFrames; ++i)
+	{
+		const float* const pCoefficients = m_pCoefficients + nPhase * TapsPerPhase;
+		const float* const pLeft = m_pLeft + nIndex - (TapsPerPhase - 1);
+		const float* const pRight = m_pRight + nIndex - (TapsPerPhase - 1);
+
+#ifdef POLYPHASERESAMPLER_NEON
+		float32x4_t LeftSum = vdupq_n_f32(0.0f);
+		float32x4_t RightSum = vdupq_n_f32(0.0f);
+		for (size_t nTap = 0; nTap < TapsPerPhase; nTap += 4)
+		{
+			const float32x4_t Coefficients = vld1q_f32(pCoefficients + nTap);
+			LeftSum = vmlaq_f32(LeftSum, Coefficients, vld1q_f32(pLeft + nTap));
+			RightSum = vmlaq_f32(RightSum, Coefficients, vld1q_f32(pRight + nTap));
+		}
+
+		pOutBuffer[i * 2] = HorizontalAdd(LeftSum);
+		pOutBuffer[i * 2 + 1] = HorizontalAdd(RightSum);
+#else
+		float nLeftSum = 0.0f;
+		float nRightSum = 0.0f;
+		for (size_t nTap = 0; nTap < TapsPerPhase; ++nTap)
+		{
+			nLeftSum += pCoefficients[nTap] * pLeft[nTap];
+			nRightSum += pCoefficients[nTap] * pRight[nTap];
+		}
+
+		pOutBuffer[i * 2] = nLeftSum;
+		pOutBuffer[i * 2 + 1] = nRightSum;
+#endif
+
+		nPhase += m_nDecimation;
+		nIndex += nPhase / m_nInterpolation;
+		nPhase %= m_nInterpolation;
+	}
+
+	// Discard input that no longer contributes, keeping a full filter's worth of history
+	const size_t nDiscard = nIndex - (TapsPerPhase - 1);
+	const size_t nRemaining = m_nFilledFrames - nDiscard;
+	memmove(m_pLeft, m_pLeft + nDiscard, nRemaining * sizeof(float));
+	memmove(m_pRight, m_pRight + nDiscard, nRemaining * sizeof(float));
+
+	m_nCurrentIndex = TapsPerPhase - 1;
+	m_nFilledFrames = nRemaining;
+	m_nPhase = nPhase;
+}
@@ -0,0 +1,440 @@
+//
+// soundfontcache.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <circle/logger.h>
+#include <circle/sysconfig.h>
+#include <circle/util.h>
+
+#include "filesystemlock.h"
+#include "synth/soundfontcache.h"
+#include "utility.h"
+
+LOGMODULE("soundfontcache");
+
+constexpr u32 FourCC(const char pFourCC[4])
+{
+	return pFourCC[3] << 24 | pFourCC[2] << 16 | pFourCC[1] << 8 | pFourCC[0];
+}
+
+constexpr u32 FourCCLIST = FourCC("LIST");
+constexpr u32 FourCCRIFF = FourCC("RIFF");
+constexpr u32 FourCCSDTA = FourCC("sdta");
+constexpr u32 FourCCSFBK = FourCC("sfbk");
+
+constexpr char CacheFileExtension[] = ".cache";
+
+struct TChunkHeader
+{
+	u32 nFourCC;
+	u32 nSize;
+	u32 nType;
+}
+PACKED;
+
+CSoundFontCache::CSoundFontCache()
+	: m_bValid(false),
+	  m_bFromCacheFile(false),
+
+	  m_Path{},
+	  m_nFileSize(0),
+	  m_nFileDate(0),
+	  m_nFileTime(0),
+
+	  m_pData(nullptr),
+	  m_pRegions(nullptr),
+	  m_nRegions(0),
+	  m_nDataSize(0)
+{
+}
+
+CSoundFontCache::~CSoundFontCache()
+{
+	Clear();
+}
+
+bool CSoundFontCache::Load(const char* pSoundFontPath, TZoneTag Tag, bool bUseCacheFile)
+{
+	Clear();
+
+	// Leave room for the extension
+	if (strlen(pSoundFontPath) > MaxPathLength - sizeof(CacheFileExtension) + 1)
+		return false;
+
+	FILINFO FileInfo;
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_stat(pSoundFontPath, &FileInfo);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK || FileInfo.fsize > 0xFFFFFFFF)
+		return false;
+
+	strcpy(m_Path, pSoundFontPath);
+	m_nFileSize = FileInfo.fsize;
+	m_nFileDate = FileInfo.fdate;
+	m_nFileTime = FileInfo.ftime;
+
+	m_bFromCacheFile = bUseCacheFile && LoadCacheFile(Tag);
+	if (!m_bFromCacheFile && !LoadSoundFont(Tag))
+	{
+		Clear();
+		return false;
+	}
+
+	m_bValid.store(true, std::memory_order_release);
+	return true;
+}
+
+bool CSoundFontCache::Save() const
+{
+	if (!IsValid())
+		return false;
+
+	char CachePath[MaxPathLength + 1];
+	GetCacheFilePath(CachePath);
+
+	FIL File;
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_open(&File, CachePath, FA_WRITE | FA_CREATE_ALWAYS);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK)
+	{
+		LOGWARN("Couldn't create %s", CachePath);
+		return false;
+	}
+
+	const size_t nSize = m_nRegions * sizeof(TRegion) + m_nDataSize;
+
+	THeader Header;
+	Header.nMagic = Magic;
+	Header.nVersion = Version;
+	Header.nFileSize = m_nFileSize;
+	Header.nFileDate = m_nFileDate;
+	Header.nFileTime = m_nFileTime;
+	Header.nRegions = m_nRegions;
+	Header.nDataSize = m_nDataSize;
+	Header.nChecksum = Checksum(m_pData, nSize);
+
+	bool bResult = WriteFile(File, &Header, sizeof(Header)) && WriteFile(File, m_pData, nSize);
+
+	CFileSystemLockGuard Lock;
+	if (f_close(&File) != FR_OK)
+		bResult = false;
+
+	// Don't leave a truncated cache behind
+	if (!bResult)
+	{
+		LOGWARN("Couldn't write %s", CachePath);
+		f_unlink(CachePath);
+	}
+
+	return bResult;
+}
+
+void CSoundFontCache::Clear()
+{
+	m_bValid.store(false, std::memory_order_release);
+
+	if (m_pData)
+		CZoneAllocator::Get()->Free(m_pData);
+
+	m_bFromCacheFile = false;
+	m_Path[0] = '\0';
+	m_pData = nullptr;
+	m_pRegions = nullptr;
+	m_nRegions = 0;
+	m_nDataSize = 0;
+}
+
+bool CSoundFontCache::Matches(const char* pPath) const
+{
+	return IsValid() && strcmp(m_Path, pPath) == 0;
+}
+
+const u8* CSoundFontCache::Find(FSIZE_t nOffset, size_t& nOutSize) const
+{
+	const u8* pData = reinterpret_cast<const u8*>(m_pRegions + m_nRegions);
+
+	for (size_t i = 0; i < m_nRegions; ++i)
+	{
+		const TRegion& Region = m_pRegions[i];
+		if (nOffset >= Region.nOffset && nOffset < Region.nOffset + Region.nSize)
+		{
+			const size_t nRegionOffset = nOffset - Region.nOffset;
+			nOutSize = Region.nSize - nRegionOffset;
+			return pData + nRegionOffset;
+		}
+
+		pData += Region.nSize;
+	}
+
+	return nullptr;
+}
+
+bool CSoundFontCache::LoadCacheFile(TZoneTag Tag)
+{
+	char CachePath[MaxPathLength + 1];
+	GetCacheFilePath(CachePath);
+
+	FIL File;
+	CFileSystemLock::Acquire();
+	const FRESULT Result = f_open(&File, CachePath, FA_READ);
+	CFileSystemLock::Release();
+
+	if (Result != FR_OK)
+		return false;
+
+	THeader Header;
+	const FSIZE_t nCacheFileSize = f_size(&File);
+	bool bValid = ReadFile(File, &Header, sizeof(Header)) &&
+		      Header.nMagic == Magic && Header.nVersion == Version && Header.nRegions <= MaxRegions &&
+		      Header.nDataSize <= MaxCacheSize && sizeof(Header) + Header.nRegions * sizeof(TRegion) + Header.nDataSize == nCacheFileSize;
+
+	// The SoundFont has been changed since the cache was saved
+	if (bValid && (Header.nFileSize != m_nFileSize || Header.nFileDate != m_nFileDate || Header.nFileTime != m_nFileTime))
+	{
+		LOGNOTE("%s is out of date", CachePath);
+		bValid = false;
+	}
+
+	// Region table and data in one read
+	const size_t nSize = Header.nRegions * sizeof(TRegion) + Header.nDataSize;
+	if (bValid && Allocate(Header.nRegions, Header.nDataSize, Tag))
+		bValid = ReadFile(File, m_pData, nSize) && Checksum(m_pData, nSize) == Header.nChecksum;
+	else
+		bValid = false;
+
+	CFileSystemLock::Acquire();
+	f_close(&File);
+	CFileSystemLock::Release();
+
+	// Ensure all regions lie within the SoundFont and add up to the data
+	size_t nTotalSize = 0;
+	for (size_t i = 0; bValid && i < m_nRegions; ++i)
+	{
+		const TRegion& Region = m_pRegions[i];
+		bValid = Region.nOffset <= m_nFileSize && Region.nSize <= m_nFileSize - Region.nOffset;
+		nTotalSize += Region.nSize;
+	}
+
+	if (!bValid || nTotalSize != m_nDataSize)
+	{
+		if (m_pData)
+		{
+			LOGWARN("Ignoring invalid cache %s", CachePath);
+			CZoneAllocator::Get()->Free(m_pData);
+			m_pData = nullptr;
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+bool CSoundFontCache::LoadSoundFont(TZoneTag Tag)
+{
+	FIL File;
+	TRegion Regions[MaxRegions];
+	size_t nRegions;
+	size_t nDataSize = 0;
+	bool bResult;
+
+	{
+		CFileSystemLockGuard Lock;
+		if (f_open(&File, m_Path, FA_READ) != FR_OK)
+			return false;
+
+		bResult = FindRegions(File, Regions, nRegions);
+	}
+
+	for (size_t i = 0; bResult && i < nRegions; ++i)
+		nDataSize += Regions[i].nSize;
+
+	// Not worth keeping in memory; FluidSynth will read the file as usual
+	if (bResult && nDataSize > MaxCacheSize)
+	{
+		LOGWARN("SoundFont structure too large to cache (%d KB)", nDataSize / KILOBYTE);
+		bResult = false;
+	}
+
+	if (bResult && Allocate(nRegions, nDataSize, Tag))
+	{
+		memcpy(m_pRegions, Regions, nRegions * sizeof(TRegion));
+
+		u8* pData = reinterpret_cast<u8*>(m_pRegions + m_nRegions);
+		for (size_t i = 0; bResult && i < nRegions; ++i)
+		{
+			CFileSystemLock::Acquire();
+			bResult = f_lseek(&File, Regions[i].nOffset) == FR_OK;
+			CFileSystemLock::Release();
+
+			bResult = bResult && ReadFile(File, pData, Regions[i].nSize);
+			pData += Regions[i].nSize;
+		}
+	}
+	else
+		bResult = false;
+
+	CFileSystemLock::Acquire();
+	f_close(&File);
+	CFileSystemLock::Release();
+
+	return bResult;
+}
+
+bool CSoundFontCache::Allocate(size_t nRegions, size_t nDataSize, TZoneTag Tag)
+{
+	// Accounted to the SoundFont it belongs to
+	m_pData = static_cast<u8*>(CZoneAllocator::Get()->Alloc(nRegions * sizeof(TRegion) + nDataSize, Tag));
+	if (!m_pData)
+		return false;
+
+	m_pRegions = reinterpret_cast<TRegion*>(m_pData);
+	m_nRegions = nRegions;
+	m_nDataSize = nDataSize;
+
+	return true;
+}
+
+void CSoundFontCache::GetCacheFilePath(char* pOutPath) const
+{
+	strcpy(pOutPath, m_Path);
+	strcat(pOutPath, CacheFileExtension);
+}
+
+// Splits the file into the regions either side of the sample data (the payloads of the sdta list's sub-chunks)
+bool CSoundFontCache::FindRegions(FIL& File, TRegion* pOutRegions, size_t& nOutRegions)
+{
+	const FSIZE_t nFileSize = f_size(&File);
+	TChunkHeader Chunk;
+	UINT nRead;
+
+	if (f_read(&File, &Chunk, sizeof(Chunk), &nRead) != FR_OK || nRead != sizeof(Chunk) || Chunk.nFourCC != FourCCRIFF || Chunk.nType != FourCCSFBK)
+		return false;
+
+	const FSIZE_t nRIFFEnd = Utility::Min(static_cast<u64>(Chunk.nSize) + 8, static_cast<u64>(nFileSize));
+	FSIZE_t nOffset = sizeof(Chunk);
+	FSIZE_t nRegionStart = 0;
+	nOutRegions = 0;
+
+	while (nOffset + sizeof(Chunk) <= nRIFFEnd)
+	{
+		if (f_lseek(&File, nOffset) != FR_OK || f_read(&File, &Chunk, sizeof(Chunk), &nRead) != FR_OK || nRead != sizeof(Chunk))
+			return false;
+
+		const u32 nChunkSize = Chunk.nSize;
+		const FSIZE_t nChunkEnd = Utility::Min(static_cast<u64>(nOffset) + 8 + nChunkSize, static_cast<u64>(nRIFFEnd));
+
+		if (Chunk.nFourCC == FourCCLIST && Chunk.nType == FourCCSDTA)
+		{
+			// Sub-chunk headers are cached, their payloads aren't
+			FSIZE_t nSubChunkOffset = nOffset + sizeof(Chunk);
+			while (nSubChunkOffset + 8 <= nChunkEnd)
+			{
+				if (f_lseek(&File, nSubChunkOffset) != FR_OK || f_read(&File, &Chunk, 8, &nRead) != FR_OK || nRead != 8)
+					return false;
+
+				const FSIZE_t nPayloadOffset = nSubChunkOffset + 8;
+				const FSIZE_t nPayloadEnd = Utility::Min(static_cast<u64>(nPayloadOffset) + Chunk.nSize, static_cast<u64>(nChunkEnd));
+
+				if (nPayloadOffset > nRegionStart)
+				{
+					if (nOutRegions == MaxRegions - 1)
+						return false;
+
+					pOutRegions[nOutRegions++] = { static_cast<u32>(nRegionStart), static_cast<u32>(nPayloadOffset - nRegionStart) };
+				}
+
+				nRegionStart = nPayloadEnd;
+				nSubChunkOffset = nPayloadEnd + (Chunk.nSize & 1);
+			}
+		}
+
+		nOffset = nChunkEnd + (nChunkSize & 1);
+	}
+
+	if (nFileSize > nRegionStart)
+		pOutRegions[nOutRegions++] = { static_cast<u32>(nRegionStart), static_cast<u32>(nFileSize - nRegionStart) };
+
+	return true;
+}
+
+bool CSoundFontCache::ReadFile(FIL& File, void* pData, size_t nSize)
+{
+	u8* pOut = static_cast<u8*>(pData);
+
+	while (nSize > 0)
+	{
+		const UINT nBytes = Utility::Min(nSize, MaxTransferSize);
+		UINT nRead;
+
+		CFileSystemLock::Acquire();
+		const bool bResult = f_read(&File, pOut, nBytes, &nRead) == FR_OK && nRead == nBytes;
+		CFileSystemLock::Release();
+
+		if (!bResult)
+			return false;
+
+		pOut += nBytes;
+		nSize -= nBytes;
+	}
+
+	return true;
+}
+
+bool CSoundFontCache::WriteFile(FIL& File, const void* pData, size_t nSize)
+{
+	const u8* pIn = static_cast<const u8*>(pData);
+
+	while (nSize > 0)
+	{
+		const UINT nBytes = Utility::Min(nSize, MaxTransferSize);
+		UINT nWritten;
+
+		CFileSystemLock::Acquire();
+		const bool bResult = f_write(&File, pIn, nBytes, &nWritten) == FR_OK && nWritten == nBytes;
+		CFileSystemLock::Release();
+
+		if (!bResult)
+			return false;
+
+		pIn += nBytes;
+		nSize -= nBytes;
+	}
+
+	return true;
+}
+
+u32 CSoundFontCache::Checksum(const u8* pData, size_t nSize)
+{
+	// FNV-1a
+	u32 nHash = 2166136261u;
+	for (size_t i = 0; i < nSize; ++i)
+	{
+		nHash ^= pData[i];
+		nHash *= 16777619u;
+	}
+
+	return nHash;
+}
@@ -22,31 +22,92 @@
 
 #include <fatfs/ff.h>
 #include <circle/logger.h>
+#include <circle/multicore.h>
+#include <circle/sysconfig.h>
 #include <circle/timer.h>
+#include <circle/util.h>
 
 #include "config.h"
+#include "filesystemlock.h"
 #include "lcd/ui.h"
+#include "midiparser.h"
 #include "synth/gmsysex.h"
 #include "synth/rolandsysex.h"
+#include "synth/soundfontcache.h"
 #include "synth/soundfontsynth.h"
 #include "synth/yamahasysex.h"
+#include "tracer.h"
 #include "utility.h"
 #include "zoneallocator.h"
 
 LOGMODULE("soundfontsynth");
 const char SoundFontPath[] = "soundfonts";
 
+// Allocations made by FluidSynth on this core are sample data being loaded on demand; the sample cache budget is measured against them
+volatile int nSampleLoadCore = -1;
+
+// Allocations made by FluidSynth on this core belong to the SoundFont being loaded
+volatile int nSoundFontLoadCore = -1;
+volatile u32 nSoundFontLoadTag = TZoneTag::FluidSynth;
+
+// FluidSynth's percussion bank
+constexpr int DrumBank = 128;
+
+// GM presets kept loaded for as long as the SoundFont is, as nearly every MIDI file uses them
+constexpr int DefaultPresets[][2] = { { 0, 0 }, { DrumBank, 0 } };
+
+// When samples are loaded on demand, unused presets are unloaded if free memory falls below this
+constexpr size_t SampleCacheHeadroom = 8 * MEGABYTE;
+
+// Structure of each loaded SoundFont, indexed by its zone tag; FluidSynth parses it again every time it opens the file
+static CSoundFontCache SoundFontCaches[TZoneTag::FluidSynthSoundFontLast - TZoneTag::FluidSynthSoundFont + 1];
+
+// A SoundFont opened by FluidSynth; the SF2 parser makes many small reads, which are served from the SoundFont's cache if
+// it has one, or otherwise from a large read-ahead buffer
+struct TSoundFontFile
+{
+	static constexpr size_t ReadAheadSize = 128 * 1024;
+	static constexpr size_t SectorSize = 512;
+
+	// Large reads are split so that the file system lock is never held for long
+	static constexpr size_t MaxDirectReadSize = 256 * 1024;
+
+	FIL File;
+#if FF_USE_FASTSEEK
+	DWORD LinkMap[64];
+#endif
+
+	FSIZE_t nPosition;
+	const CSoundFontCache* pCache;
+	u8* pBuffer;
+	FSIZE_t nBufferOffset;
+	size_t nBufferSize;
+};
+
+static TZoneTag GetFluidSynthTag()
+{
+	const int nCore = CMultiCoreSupport::ThisCore();
+
+	if (nCore == nSampleLoadCore)
+		return TZoneTag::FluidSynthSamples;
+
+	if (nCore == nSoundFontLoadCore)
+		return static_cast<TZoneTag>(nSoundFontLoadTag);
+
+	return TZoneTag::FluidSynth;
+}
+
 extern "C"
 {
 	// Replacements for fluid_sys.c functions
 	void* fluid_alloc(size_t len)
 	{
-		return CZoneAllocator::Get()->Alloc(len, TZoneTag::FluidSynth);
+		return CZoneAllocator::Get()->Alloc(len, GetFluidSynthTag());
 	}
 
 	void* fluid_realloc(void* ptr, size_t len)
 	{
-		return CZoneAllocator::Get()->Realloc(ptr, len, TZoneTag::FluidSynth);
+		return CZoneAllocator::Get()->Realloc(ptr, len, GetFluidSynthTag());
 	}
 
 	void fluid_free(void* ptr)
@@ -56,6 +117,7 @@ extern "C"
 
 	FILE* fluid_file_open(const char* path, const char** errMsg)
 	{
+		CFileSystemLockGuard Lock;
 		FILE* pFile = fopen(path, "rb");
 
 		if (!pFile && errMsg)
@@ -71,11 +133,39 @@ extern "C"
 	// These were found to be much faster than FluidSynth's default approach of going through libc
 	void* default_fopen(const char* path)
 	{
-		FIL* pFile = new FIL;
-		if (f_open(pFile, path, FA_READ) != FR_OK)
+		TSoundFontFile* pFile = new TSoundFontFile;
+		if (!pFile)
+			return nullptr;
+
+		CFileSystemLockGuard Lock;
+		pFile->pBuffer = new u8[TSoundFontFile::ReadAheadSize];
+		if (!pFile->pBuffer || f_open(&pFile->File, path, FA_READ) != FR_OK)
 		{
+			delete[] pFile->pBuffer;
 			delete pFile;
-			pFile = nullptr;
+			return nullptr;
+		}
+
+#if FF_USE_FASTSEEK
+		// Map the file's cluster chain so that seeks don't have to follow it through the FAT
+		pFile->File.cltbl = pFile->LinkMap;
+		pFile->LinkMap[0] = Utility::ArraySize(pFile->LinkMap);
+		if (f_lseek(&pFile->File, CREATE_LINKMAP) != FR_OK)
+			pFile->File.cltbl = nullptr;
+#endif
+
+		pFile->nPosition = 0;
+		pFile->pCache = nullptr;
+		pFile->nBufferOffset = 0;
+		pFile->nBufferSize = 0;
+
+		for (const CSoundFontCache& Cache : SoundFontCaches)
+		{
+			if (Cache.Matches(path))
+			{
+				pFile->pCache = &Cache;
+				break;
+			}
 		}
 
 		return pFile;
@@ -83,10 +173,15 @@ extern "C"
 
 	int default_fclose(void* handle)
 	{
-		FIL* pFile = static_cast<FIL*>(handle);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(handle);
+
+		CFileSystemLock::Acquire();
+		const bool bClosed = f_close(&pFile->File) == FR_OK;
+		CFileSystemLock::Release();
 
-		if (f_close(pFile) == FR_OK)
+		if (bClosed)
 		{
+			delete[] pFile->pBuffer;
 			delete pFile;
 			return FLUID_OK;
 		}
@@ -96,36 +191,108 @@ extern "C"
 
 	fluid_long_long_t default_ftell(void* handle)
 	{
-		FIL* pFile = static_cast<FIL*>(handle);
-		return f_tell(pFile);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(handle);
+		return pFile->nPosition;
 	}
 
 	int safe_fread(void* buf, fluid_long_long_t count, void* fd)
 	{
-		FIL* pFile = static_cast<FIL*>(fd);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(fd);
+		u8* pOut = static_cast<u8*>(buf);
 		UINT nRead;
-		return f_read(pFile, buf, count, &nRead) == FR_OK ? FLUID_OK : FLUID_FAILED;
+
+		while (count > 0)
+		{
+			// Copy whatever is cached
+			size_t nCachedSize;
+			const u8* pCached = pFile->pCache ? pFile->pCache->Find(pFile->nPosition, nCachedSize) : nullptr;
+			if (pCached)
+			{
+				const size_t nBytes = Utility::Min(static_cast<size_t>(count), nCachedSize);
+				memcpy(pOut, pCached, nBytes);
+
+				pOut += nBytes;
+				pFile->nPosition += nBytes;
+				count -= nBytes;
+				continue;
+			}
+
+			// Copy whatever is already buffered
+			if (pFile->nPosition >= pFile->nBufferOffset && pFile->nPosition < pFile->nBufferOffset + pFile->nBufferSize)
+			{
+				const size_t nOffset = pFile->nPosition - pFile->nBufferOffset;
+				const size_t nBytes = Utility::Min(static_cast<size_t>(count), pFile->nBufferSize - nOffset);
+				memcpy(pOut, pFile->pBuffer + nOffset, nBytes);
+
+				pOut += nBytes;
+				pFile->nPosition += nBytes;
+				count -= nBytes;
+				continue;
+			}
+
+			// Large reads (i.e. sample data) go straight into their destination
+			if (count >= static_cast<fluid_long_long_t>(TSoundFontFile::ReadAheadSize))
+			{
+				const UINT nBytes = Utility::Min(static_cast<size_t>(count), TSoundFontFile::MaxDirectReadSize);
+
+				CFileSystemLock::Acquire();
+				const bool bResult = f_lseek(&pFile->File, pFile->nPosition) == FR_OK && f_read(&pFile->File, pOut, nBytes, &nRead) == FR_OK && nRead == nBytes;
+				CFileSystemLock::Release();
+
+				if (!bResult)
+					return FLUID_FAILED;
+
+				pOut += nBytes;
+				pFile->nPosition += nBytes;
+				count -= nBytes;
+				continue;
+			}
+
+			// Refill the buffer from a sector-aligned offset, so that FatFs can read whole sectors directly into it
+			pFile->nBufferOffset = pFile->nPosition & ~static_cast<FSIZE_t>(TSoundFontFile::SectorSize - 1);
+			pFile->nBufferSize = 0;
+
+			CFileSystemLock::Acquire();
+			const bool bResult = f_lseek(&pFile->File, pFile->nBufferOffset) == FR_OK && f_read(&pFile->File, pFile->pBuffer, TSoundFontFile::ReadAheadSize, &nRead) == FR_OK;
+			CFileSystemLock::Release();
+
+			if (!bResult)
+				return FLUID_FAILED;
+
+			pFile->nBufferSize = nRead;
+
+			// End of file
+			if (pFile->nPosition >= pFile->nBufferOffset + pFile->nBufferSize)
+				return FLUID_FAILED;
+		}
+
+		return FLUID_OK;
 	}
 
 	int safe_fseek(void* fd, fluid_long_long_t ofs, int whence)
 	{
-		FIL* pFile = static_cast<FIL*>(fd);
+		TSoundFontFile* pFile = static_cast<TSoundFontFile*>(fd);
 
 		switch (whence)
 		{
 		case SEEK_CUR:
-			ofs += f_tell(pFile);
+			ofs += pFile->nPosition;
 			break;
 
 		case SEEK_END:
-			ofs += f_size(pFile);
+			ofs += f_size(&pFile->File);
 			break;
 
 		default:
 			break;
 		}
 
-		return f_lseek(pFile, ofs) == FR_OK ? FLUID_OK : FLUID_FAILED;
+		// The file pointer is only moved when the buffer is next refilled
+		if (ofs < 0 || static_cast<FSIZE_t>(ofs) > f_size(&pFile->File))
+			return FLUID_FAILED;
+
+		pFile->nPosition = ofs;
+		return FLUID_OK;
 	}
 }
 
@@ -135,11 +302,69 @@ CSoundFontSynth::CSoundFontSynth(unsigned nSampleRate)
 	  m_pSettings(nullptr),
 	  m_pSynth(nullptr),
 
+	  m_pResampler(nullptr),
+	  m_ResamplerBuffer{},
+
+	  m_bRenderWorkerEnabled(false),
+	  m_pWorkerSynth(nullptr),
+	  m_nRenderWorkerFrames(0),
+	  m_nRenderWorkerRequest(0),
+	  m_nRenderWorkerDone(0),
+	  m_RenderWorkerBuffer{},
+
+	  m_nChannelBufferCount(0),
+	  m_pChannelBuffers(nullptr),
+	  m_ChannelBufferPointers{},
+
+	  m_pFXStage(nullptr),
+	  m_FXSendBuffers{},
+
+	  m_pOutputMeter(nullptr),
+	  m_MeterFXBuffers{},
+
 	  m_nVolume(100),
 	  m_nInitialGain(0.2f),
 
+	  m_nActiveVoices(0),
+
+	  m_bPolyphonyGovernor(false),
+	  m_nMinPolyphony(0),
+	  m_nMaxPolyphony(0),
+	  m_nPolyphonyLimit(0),
+	  m_nRenderLoad(0),
+	  m_nGovernorHoldFrames(0),
+	  m_nGovernorSlackFrames(0),
+	  m_bThrottleDetected(false),
+
+	  m_nSampleCacheBudget(0),
+	  m_CachedPresets{},
+	  m_nCachedPresets(0),
+	  m_nPresetUseCounter(0),
+	  m_SampleCacheStats{},
+	  m_PendingPrograms{},
+	  m_PresetLoadState(TPresetLoadState::Idle),
+	  m_RequestedPreset{},
+
+	  m_nWarmSoundFontBudget(0),
+	  m_WarmSoundFonts{},
+	  m_nWarmSoundFonts(0),
+	  m_nSoundFontUseCounter(0),
+	  m_nSoundFontTag(TZoneTag::FluidSynthSoundFont),
+	  m_bCurrentSoundFontUnloaded(false),
+	  m_bSaveSoundFontCache(false),
+
+	  m_PendingSysEx{},
+	  m_nPendingSysEx(0),
+
+	  m_nMIDIChannels(16),
+
 	  m_nPercussionMask(1 << 9),
-	  m_nCurrentSoundFontIndex(0)
+	  m_nCurrentSoundFontIndex(0),
+
+	  m_bSwitchBlocked(false),
+	  m_bBackgroundLoading(false),
+	  m_SwitchState(TSwitchState::Idle),
+	  m_nPendingSoundFontIndex(0)
 {
 }
 
@@ -148,8 +373,26 @@ CSoundFontSynth::~CSoundFontSynth()
 	if (m_pSynth)
 		delete_fluid_synth(m_pSynth);
 
+	if (m_pWorkerSynth)
+		delete_fluid_synth(m_pWorkerSynth);
+
+	for (size_t i = 0; i < m_nWarmSoundFonts; ++i)
+		DeleteSynths(m_WarmSoundFonts[i].pSynth, m_WarmSoundFonts[i].pWorkerSynth);
+
 	if (m_pSettings)
 		delete_fluid_settings(m_pSettings);
+
+	if (m_pResampler)
+		delete m_pResampler;
+
+	if (m_pFXStage)
+		delete m_pFXStage;
+
+	if (m_pOutputMeter)
+		delete m_pOutputMeter;
+
+	if (m_pChannelBuffers)
+		delete[] m_pChannelBuffers;
 }
 
 void CSoundFontSynth::FluidSynthLogCallback(int nLevel, const char* pMessage, void* pUser)
@@ -195,102 +438,204 @@ bool CSoundFontSynth::Initialize()
 		return false;
 	}
 
+	// Optionally run FluidSynth at a lower rate and upsample its output
+	unsigned int nInternalSampleRate = m_nSampleRate;
+	if (pConfig->FluidSynthInternalSampleRate > 0 && static_cast<unsigned int>(pConfig->FluidSynthInternalSampleRate) != m_nSampleRate)
+	{
+		m_pResampler = new CPolyphaseResampler();
+		if (m_pResampler->Initialize(pConfig->FluidSynthInternalSampleRate, m_nSampleRate))
+			nInternalSampleRate = pConfig->FluidSynthInternalSampleRate;
+		else
+		{
+			delete m_pResampler;
+			m_pResampler = nullptr;
+		}
+	}
+
 	// Set device ID to match the default Roland Sound Canvas ID so that it recognises some GS SysEx messages
 	fluid_settings_setint(m_pSettings, "synth.device-id", static_cast<int>(TDeviceID::SoundCanvasDefault));
-	fluid_settings_setnum(m_pSettings, "synth.sample-rate", static_cast<double>(m_nSampleRate));
+	fluid_settings_setnum(m_pSettings, "synth.sample-rate", static_cast<double>(nInternalSampleRate));
 	fluid_settings_setint(m_pSettings, "synth.threadsafe-api", false);
 
+	m_nMIDIChannels = pConfig->MIDIUSBPorts >= 2 ? 16 * CMIDIParser::MaxChannelBanks : 16;
+	fluid_settings_setint(m_pSettings, "synth.midi-channels", m_nMIDIChannels);
+
+	// Only load the samples used by selected presets
+	m_nSampleCacheBudget = static_cast<size_t>(Utility::Max(pConfig->FluidSynthSampleCache, 0)) * MEGABYTE;
+	if (m_nSampleCacheBudget)
+		fluid_settings_setint(m_pSettings, "synth.dynamic-sample-loading", true);
+
+	m_nWarmSoundFontBudget = static_cast<size_t>(Utility::Max(pConfig->FluidSynthSoundFontKeepWarm, 0)) * MEGABYTE;
+	m_bSaveSoundFontCache = pConfig->FluidSynthSoundFontCache;
+
+	// Core 3 renders this entire synth in layered mode
+	m_bRenderWorkerEnabled = pConfig->FluidSynthMultiCore && !pConfig->SystemLayeredSynths;
+
+	if (pConfig->FluidSynthFXOffload && !m_bRenderWorkerEnabled && !pConfig->SystemLayeredSynths)
+	{
+		m_pFXStage = new CFXStage();
+		if (!m_pFXStage->Initialize(nInternalSampleRate))
+		{
+			delete m_pFXStage;
+			m_pFXStage = nullptr;
+		}
+	}
+
+	// Each MIDI channel gets its own output (audio group) so that its level can be measured or its effect sends derived; not possible with the
+	// channels split between two synths. Only the FX stage needs parts 17-32 kept apart from parts 1-16.
+	const bool bOutputMeter = pConfig->FluidSynthOutputMeters && !m_bRenderWorkerEnabled;
+	if (m_pFXStage || bOutputMeter)
+	{
+		const size_t nAudioGroups = m_pFXStage ? m_nMIDIChannels : COutputMeter::MaxChannels;
+		fluid_settings_setint(m_pSettings, "synth.audio-channels", nAudioGroups);
+		fluid_settings_setint(m_pSettings, "synth.audio-groups", nAudioGroups);
+
+		m_nChannelBufferCount = nAudioGroups * 2;
+		m_pChannelBuffers = new float[m_nChannelBufferCount * ChannelChunkSize];
+		for (size_t i = 0; i < m_nChannelBufferCount; ++i)
+			m_ChannelBufferPointers[i] = m_pChannelBuffers + i * ChannelChunkSize;
+	}
+
+	if (bOutputMeter)
+		m_pOutputMeter = new COutputMeter(nInternalSampleRate, COutputMeter::MaxChannels);
+
+	m_bPolyphonyGovernor = pConfig->FluidSynthPolyphonyGovernor;
+	m_nMaxPolyphony = pConfig->FluidSynthPolyphony;
+	m_nMinPolyphony = Utility::Min(pConfig->FluidSynthMinPolyphony, m_nMaxPolyphony);
+	m_nPolyphonyLimit = m_nMaxPolyphony;
+
 	return Reinitialize(pSoundFontPath, &FXProfile);
 }
 
+// Called from Render() via the MIDI event queue with m_Lock held
 void CSoundFontSynth::HandleMIDIShortMessage(u32 nMessage)
 {
+	CTracer::Event(TTraceEvent::SynthShortMessage, nMessage);
+
+	// Parameter changes received earlier must take effect first
+	ApplyPendingSysEx();
+
 	const u8 nStatus  = nMessage & 0xFF;
-	const u8 nChannel = nMessage & 0x0F;
+	const u8 nChannel = (nMessage & 0x0F) + CMIDIParser::GetChannelBank(nMessage) * 16;
 	const u8 nData1   = (nMessage >> 8) & 0xFF;
 	const u8 nData2   = (nMessage >> 16) & 0xFF;
 
 	// Handle system real-time messages
 	if (nStatus == 0xFF)
 	{
-		m_Lock.Acquire();
 		fluid_synth_system_reset(m_pSynth);
-		m_Lock.Release();
+		if (m_pWorkerSynth)
+			fluid_synth_system_reset(m_pWorkerSynth);
+		if (m_pFXStage)
+			m_pFXStage->Reset();
 		return;
 	}
 
-	m_Lock.Acquire();
+	// Beyond the parts this synth was created with
+	if (nChannel >= m_nMIDIChannels)
+		return;
+
+	fluid_synth_t* const pSynth = GetChannelSynth(nChannel);
 
 	// Handle channel messages
 	switch (nStatus & 0xF0)
 	{
 		// Note off
 		case 0x80:
-			fluid_synth_noteoff(m_pSynth, nChannel, nData1);
+			fluid_synth_noteoff(pSynth, nChannel, nData1);
 			break;
 
 		// Note on
 		case 0x90:
-			fluid_synth_noteon(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_noteon(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Polyphonic key pressure/aftertouch
 		case 0xA0:
-			fluid_synth_key_pressure(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_key_pressure(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Control change
 		case 0xB0:
-			fluid_synth_cc(m_pSynth, nChannel, nData1, nData2);
+			fluid_synth_cc(pSynth, nChannel, nData1, nData2);
 			break;
 
 		// Program change
 		case 0xC0:
-			fluid_synth_program_change(m_pSynth, nChannel, nData1);
+			if (m_nSampleCacheBudget)
+				SelectProgram(pSynth, nChannel, nData1);
+			else
+				fluid_synth_program_change(pSynth, nChannel, nData1);
 			break;
 
 		// Channel pressure/aftertouch
 		case 0xD0:
-			fluid_synth_channel_pressure(m_pSynth, nChannel, nData1);
+			fluid_synth_channel_pressure(pSynth, nChannel, nData1);
 			break;
 
 		// Pitch bend
 		case 0xE0:
-			fluid_synth_pitch_bend(m_pSynth, nChannel, (nData2 << 7) | nData1);
+			fluid_synth_pitch_bend(pSynth, nChannel, (nData2 << 7) | nData1);
 			break;
 	}
 
-	m_Lock.Release();
-
-	// Update MIDI monitor
-	CSynthBase::HandleMIDIShortMessage(nMessage);
+	// Update MIDI monitor; parts 17-32 are shown with parts 1-16
+	CSynthBase::HandleMIDIShortMessage(CMIDIParser::StripChannelBank(nMessage));
 }
 
+// Called from Render() via the MIDI event queue with m_Lock held
 void CSoundFontSynth::HandleMIDISysExMessage(const u8* pData, size_t nSize)
 {
-	// Return early if it wasn't a GM Mode On/Off message and was consumed as a text/display dots message
+	CTracer::Event(TTraceEvent::SynthSysExMessage, nSize);
+
+	// Return early if it wasn't a GM Mode On/Off message and was consumed as a text/display dots message,
+	// or deferred as a parameter change
 	if (!ParseGMSysEx(pData, nSize) && (ParseRolandSysEx(pData, nSize) || ParseYamahaSysEx(pData, nSize)))
 		return;
 
-	// No special handling; forward to FluidSynth SysEx parser, excluding leading 0xF0 and trailing 0xF7
-	m_Lock.Acquire();
+	// No special handling; forward to FluidSynth after any parameter changes received earlier
+	ApplyPendingSysEx();
+	ForwardSysEx(pData, nSize);
+}
+
+void CSoundFontSynth::ForwardSysEx(const u8* pData, size_t nSize)
+{
+	// Forward to FluidSynth SysEx parser, excluding leading 0xF0 and trailing 0xF7
 	fluid_synth_sysex(m_pSynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
-	m_Lock.Release();
+	if (m_pWorkerSynth)
+		fluid_synth_sysex(m_pWorkerSynth, reinterpret_cast<const char*>(pData + 1), nSize - 2, nullptr, nullptr, nullptr, false);
 }
 
-bool CSoundFontSynth::IsActive()
+bool CSoundFontSynth::CanHandleMIDIEvent(const TMIDIEvent& Event) const
 {
-	m_Lock.Acquire();
-	int nVoices = fluid_synth_get_active_voice_count(m_pSynth);
-	m_Lock.Release();
+	// Resets and SysEx messages may select presets, so they wait until core 0 has finished loading samples into the synths
+	if (m_PresetLoadState.load(std::memory_order_acquire) != TPresetLoadState::Requested)
+		return true;
+
+	return !Event.pSysExData && (Event.nMessage & 0xFF) != 0xFF;
+}
+
+void CSoundFontSynth::OnMIDIEventsProcessed()
+{
+	ApplyPendingSysEx();
+	UpdatePresetLoad();
+}
 
-	return nVoices > 0;
+bool CSoundFontSynth::IsActive()
+{
+	// Updated by the audio core after each block
+	return m_nActiveVoices > 0;
 }
 
 void CSoundFontSynth::AllSoundOff()
 {
 	m_Lock.Acquire();
+
+	// Apply pending events first so that none are played afterwards
+	ProcessMIDIEventQueue();
 	fluid_synth_all_sounds_off(m_pSynth, -1);
+	if (m_pWorkerSynth)
+		fluid_synth_all_sounds_off(m_pWorkerSynth, -1);
 	m_Lock.Release();
 
 	// Reset MIDI monitor
@@ -302,13 +647,33 @@ void CSoundFontSynth::SetMasterVolume(u8 nVolume)
 	m_nVolume = nVolume;
 	m_Lock.Acquire();
 	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
+	if (m_pWorkerSynth)
+		fluid_synth_set_gain(m_pWorkerSynth, m_nVolume / 100.0f * m_nInitialGain);
 	m_Lock.Release();
 }
 
 size_t CSoundFontSynth::Render(float* pOutBuffer, size_t nFrames)
 {
+	CTracer::CScope TraceScope(TTraceEvent::SynthRender, nFrames);
 	m_Lock.Acquire();
-	assert(fluid_synth_write_float(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+	// Hand over samples loaded since the last block before any new events are played
+	UpdatePresetLoad();
+
+	// FluidSynth renders internally in blocks of 64 frames, which limits the precision of sub-block rendering
+	if (m_bSampleAccurateMIDI)
+		RenderSampleAccurate(nFrames, [&](size_t nOffset, size_t nCount)
+		{
+			RenderOutputFrames(pOutBuffer + nOffset * 2, nCount);
+		});
+	else
+	{
+		ProcessMIDIEventQueue();
+		RenderOutputFrames(pOutBuffer, nFrames);
+	}
+
+	UpdateRenderStats(nFrames, CTimer::GetClockTicks() - nStartTicks);
 	m_Lock.Release();
 	return nFrames;
 }
@@ -316,27 +681,65 @@ size_t CSoundFontSynth::Render(float* pOutBuffer, size_t nFrames)
 size_t CSoundFontSynth::Render(s16* pOutBuffer, size_t nFrames)
 {
 	m_Lock.Acquire();
-	assert(fluid_synth_write_s16(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+	const unsigned int nStartTicks = CTimer::GetClockTicks();
+
+	// Hand over samples loaded since the last block before any new events are played
+	UpdatePresetLoad();
+
+	if (m_bSampleAccurateMIDI)
+		RenderSampleAccurate(nFrames, [&](size_t nOffset, size_t nCount)
+		{
+			RenderOutputFrames(pOutBuffer + nOffset * 2, nCount);
+		});
+	else
+	{
+		ProcessMIDIEventQueue();
+		RenderOutputFrames(pOutBuffer, nFrames);
+	}
+
+	UpdateRenderStats(nFrames, CTimer::GetClockTicks() - nStartTicks);
 	m_Lock.Release();
 	return nFrames;
 }
 
 void CSoundFontSynth::ReportStatus() const
 {
-	if (m_pUI)
-		m_pUI->ShowSystemMessage(m_SoundFontManager.GetSoundFontName(m_nCurrentSoundFontIndex));
+	const char* pName = m_SoundFontManager.GetSoundFontName(m_nCurrentSoundFontIndex);
+	if (m_pUI && pName)
+		m_pUI->ShowSystemMessage(pName);
 }
 
 void CSoundFontSynth::UpdateLCD(CLCD& LCD, unsigned int nTicks)
 {
 	const u8 nBarHeight = LCD.Height();
 	float ChannelLevels[16], PeakLevels[16];
-	m_MIDIMonitor.GetChannelLevels(nTicks, ChannelLevels, PeakLevels, m_nPercussionMask);
+
+	if (m_pOutputMeter)
+	{
+		// RMS level for the bars, signal peaks for the peak markers
+		float OutputPeaks[16];
+		m_pOutputMeter->GetLevels(ChannelLevels, OutputPeaks);
+		m_MIDIMonitor.UpdatePeakLevels(nTicks, OutputPeaks, PeakLevels);
+	}
+	else
+		m_MIDIMonitor.GetChannelLevels(nTicks, ChannelLevels, PeakLevels, m_nPercussionMask);
+
 	CUserInterface::DrawChannelLevels(LCD, nBarHeight, ChannelLevels, PeakLevels, 16, true);
 }
 
 bool CSoundFontSynth::SwitchSoundFont(size_t nIndex)
 {
+	CTracer::CScope TraceScope(TTraceEvent::SoundFontSwitch, nIndex);
+	m_bSwitchBlocked = false;
+
+	// A background switch is still in progress
+	if (m_SwitchState.load(std::memory_order_acquire) != TSwitchState::Idle)
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("SF switch busy!");
+		return false;
+	}
+
 	// Is this SoundFont already active?
 	if (m_nCurrentSoundFontIndex == nIndex)
 	{
@@ -354,14 +757,118 @@ bool CSoundFontSynth::SwitchSoundFont(size_t nIndex)
 		return false;
 	}
 
+	TFXProfile FXProfile = m_SoundFontManager.GetSoundFontFXProfile(nIndex);
+
+	// Switching back to a SoundFont that is still loaded is instant
+	if (ActivateWarmSoundFont(pSoundFontPath, &FXProfile))
+		return FinishSoundFontSwitch(nIndex, true);
+
+	// Don't unload the current SoundFont for one that can't possibly fit; samples loaded on demand needn't fit all at once
+	if (!m_nSampleCacheBudget && !m_SoundFontManager.CheckSoundFontFits(nIndex))
+	{
+		if (m_pUI)
+			m_pUI->ShowSystemMessage("SF too large!");
+		return false;
+	}
+
 	if (m_pUI)
 		m_pUI->ShowSystemMessage("Loading SoundFont", true);
 
-	TFXProfile FXProfile = m_SoundFontManager.GetSoundFontFXProfile(nIndex);
+	// Hand over to the background loader; the current SoundFont keeps playing until the switch completes
+	if (m_bBackgroundLoading)
+	{
+		m_nPendingSoundFontIndex = nIndex;
+		m_PendingSoundFontPath = pSoundFontPath;
+		m_PendingFXProfile = FXProfile;
+		m_SwitchState.store(TSwitchState::Requested, std::memory_order_release);
+		return false;
+	}
+
+	m_bSwitchBlocked = true;
+	return FinishSoundFontSwitch(nIndex, Reinitialize(pSoundFontPath, &FXProfile));
+}
+
+void CSoundFontSynth::OnSoundFontFileChanged(const char* pPath, bool bRemoved)
+{
+	// Callers must wait for any background switch to finish, as it holds an index into the list
+	size_t nIndex;
+
+	// A replaced file is removed and re-checked, as its name or validity may have changed
+	bool bHaveCurrent = m_nCurrentSoundFontIndex < m_SoundFontManager.GetSoundFontCount();
+	if (m_SoundFontManager.RemoveSoundFont(pPath, nIndex) && bHaveCurrent)
+	{
+		if (nIndex < m_nCurrentSoundFontIndex)
+			--m_nCurrentSoundFontIndex;
 
-	// We can't use fluid_synth_sfunload() as we don't support the lazy SoundFont unload timer, so trash the entire synth and create a new one
-	if (!Reinitialize(pSoundFontPath, &FXProfile))
+		// The loaded SoundFont stays in memory, but no longer matches the list; allow it to be selected again
+		else if (nIndex == m_nCurrentSoundFontIndex)
+			m_nCurrentSoundFontIndex = CSoundFontManager::InvalidIndex;
+	}
+
+	// A SoundFont kept warm that was replaced or removed is out of date
+	EvictUnlistedWarmSoundFonts();
+
+	if (bRemoved)
+		return;
+
+	bHaveCurrent = m_nCurrentSoundFontIndex < m_SoundFontManager.GetSoundFontCount();
+	if (m_SoundFontManager.AddSoundFont(pPath, nIndex) && bHaveCurrent && nIndex <= m_nCurrentSoundFontIndex)
+		++m_nCurrentSoundFontIndex;
+}
+
+void CSoundFontSynth::ReplaceSoundFontList(CSoundFontManager& NewList)
+{
+	// Callers must wait for any background switch to finish, as it holds an index into the list
+	const char* const pCurrentPath = m_SoundFontManager.GetSoundFontPath(m_nCurrentSoundFontIndex);
+	size_t nIndex = CSoundFontManager::InvalidIndex;
+	if (pCurrentPath)
+		NewList.FindSoundFont(pCurrentPath, nIndex);
+
+	// The loaded SoundFont stays in memory if it's no longer listed; allow it to be selected again
+	m_SoundFontManager.Swap(NewList);
+	m_nCurrentSoundFontIndex = nIndex;
+
+	EvictUnlistedWarmSoundFonts();
+}
+
+void CSoundFontSynth::EvictUnlistedWarmSoundFonts()
+{
+	for (size_t i = m_nWarmSoundFonts; i-- > 0;)
+	{
+		size_t nIndex;
+		if (!m_SoundFontManager.FindSoundFont(m_WarmSoundFonts[i].Path, nIndex))
+			EvictWarmSoundFont(i);
+	}
+}
+
+void CSoundFontSynth::RunBackgroundLoader()
+{
+	// The SD card isn't locked for the whole load; the file callbacks lock it for each access, so core 0 can keep using it
+	if (m_SwitchState.load(std::memory_order_acquire) != TSwitchState::Requested)
+		return;
+
+	const bool bResult = Reinitialize(m_PendingSoundFontPath, &m_PendingFXProfile);
+	m_SwitchState.store(bResult ? TSwitchState::Succeeded : TSwitchState::Failed, std::memory_order_release);
+}
+
+bool CSoundFontSynth::UpdateSoundFontSwitch()
+{
+	const TSwitchState State = m_SwitchState.load(std::memory_order_acquire);
+	if (State != TSwitchState::Succeeded && State != TSwitchState::Failed)
+		return false;
+
+	m_SwitchState.store(TSwitchState::Idle, std::memory_order_release);
+	return FinishSoundFontSwitch(m_nPendingSoundFontIndex, State == TSwitchState::Succeeded);
+}
+
+bool CSoundFontSynth::FinishSoundFontSwitch(size_t nIndex, bool bSuccess)
+{
+	if (!bSuccess)
 	{
+		// Nothing is loaded now, so any SoundFont can be selected again
+		if (m_bCurrentSoundFontUnloaded)
+			m_nCurrentSoundFontIndex = CSoundFontManager::InvalidIndex;
+
 		if (m_pUI)
 			m_pUI->ShowSystemMessage("SF switch failed!");
 
@@ -379,115 +886,1056 @@ bool CSoundFontSynth::SwitchSoundFont(size_t nIndex)
 
 bool CSoundFontSynth::Reinitialize(const char* pSoundFontPath, const TFXProfile* pFXProfile)
 {
-	const CConfig* const pConfig = CConfig::Get();
+	const float nInitialGain = pFXProfile->nGain.ValueOr(CConfig::Get()->FluidSynthDefaultGain);
+	const unsigned int nLoadStart = CTimer::GetClockTicks();
 
-	m_Lock.Acquire();
+	fluid_synth_t* pSynth = nullptr;
+	fluid_synth_t* pWorkerSynth = nullptr;
+	m_bCurrentSoundFontUnloaded = false;
 
-	if (m_pSynth)
-		delete_fluid_synth(m_pSynth);
+	// Everything allocated on this core until the load has finished belongs to the new SoundFont
+	const u32 nTag = GetFreeSoundFontTag();
+	nSoundFontLoadTag = nTag;
+	nSoundFontLoadCore = CMultiCoreSupport::ThisCore();
 
-	m_pSynth = new_fluid_synth(m_pSettings);
+	// We can't use fluid_synth_sfunload() as we don't support the lazy SoundFont unload timer, so build an entirely new synth
+	// and load the SoundFont into it while the current synth keeps playing
+	bool bResult = CreateSynths(pFXProfile, nInitialGain, pSynth, pWorkerSynth) && LoadSoundFont(pSoundFontPath, pSynth, pWorkerSynth);
 
-	if (!m_pSynth)
+	if (!bResult && m_nWarmSoundFonts)
 	{
-		m_Lock.Release();
-		LOGERR("Failed to create synth");
-		return false;
+		// Make room by unloading the SoundFonts kept warm first
+		LOGWARN("Unloading previous SoundFonts and retrying");
+		FreeSynths(pSynth, pWorkerSynth, nTag);
+		while (m_nWarmSoundFonts)
+			EvictWarmSoundFont(m_nWarmSoundFonts - 1);
+
+		bResult = CreateSynths(pFXProfile, nInitialGain, pSynth, pWorkerSynth) && LoadSoundFont(pSoundFontPath, pSynth, pWorkerSynth);
 	}
 
-	fluid_synth_set_polyphony(m_pSynth, pConfig->FluidSynthPolyphony);
+	if (bResult)
+	{
+		// Swap at a block boundary; the old synth is only kept warm or freed afterwards
+		SwapSynths(pSynth, pWorkerSynth, nInitialGain, pFXProfile);
+		KeepSoundFontWarm(pSynth, pWorkerSynth, m_nSoundFontTag, m_SoundFontManager.GetSoundFontPath(m_nCurrentSoundFontIndex));
+		m_nSoundFontTag = nTag;
+	}
+	else if (m_pSynth)
+	{
+		// There may not be enough memory for two SoundFonts at once; unload the current one and try again
+		LOGWARN("Unloading current SoundFont and retrying");
+		FreeSynths(pSynth, pWorkerSynth, nTag);
+
+		// Stand-in synths without a SoundFont, which the audio core renders (silently) instead while the new synths are built;
+		// nothing is ever loaded into a published synth. They are small and belong to no SoundFont.
+		nSoundFontLoadCore = -1;
+		fluid_synth_t* pEmptySynth = nullptr;
+		fluid_synth_t* pEmptyWorkerSynth = nullptr;
+		const bool bHaveEmptySynths = CreateSynths(pFXProfile, nInitialGain, pEmptySynth, pEmptyWorkerSynth);
+		nSoundFontLoadCore = CMultiCoreSupport::ThisCore();
+
+		if (bHaveEmptySynths)
+		{
+			SwapSynths(pEmptySynth, pEmptyWorkerSynth, nInitialGain, pFXProfile);
+			FreeSynths(pEmptySynth, pEmptyWorkerSynth, m_nSoundFontTag);
+			m_nSoundFontTag = nTag;
+			m_bCurrentSoundFontUnloaded = true;
+
+			bResult = CreateSynths(pFXProfile, nInitialGain, pSynth, pWorkerSynth) && LoadSoundFont(pSoundFontPath, pSynth, pWorkerSynth);
+			if (bResult)
+			{
+				// The stand-ins come back from the swap
+				SwapSynths(pSynth, pWorkerSynth, nInitialGain, pFXProfile);
+				DeleteSynths(pSynth, pWorkerSynth);
+			}
+			else
+				FreeSynths(pSynth, pWorkerSynth, nTag);
+		}
+	}
+	else
+		FreeSynths(pSynth, pWorkerSynth, nTag);
 
-	m_nInitialGain = pFXProfile->nGain.ValueOr(pConfig->FluidSynthDefaultGain);
-	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
+	nSoundFontLoadCore = -1;
 
-	// Use values from effects profile if set, otherwise use defaults
-	fluid_synth_reverb_on(m_pSynth, -1, pFXProfile->bReverbActive.ValueOr(pConfig->FluidSynthDefaultReverbActive));
-	fluid_synth_set_reverb_group_damp(m_pSynth, -1, pFXProfile->nReverbDamping.ValueOr(pConfig->FluidSynthDefaultReverbDamping));
-	fluid_synth_set_reverb_group_level(m_pSynth, -1, pFXProfile->nReverbLevel.ValueOr(pConfig->FluidSynthDefaultReverbLevel));
-	fluid_synth_set_reverb_group_roomsize(m_pSynth, -1, pFXProfile->nReverbRoomSize.ValueOr(pConfig->FluidSynthDefaultReverbRoomSize));
-	fluid_synth_set_reverb_group_width(m_pSynth, -1, pFXProfile->nReverbWidth.ValueOr(pConfig->FluidSynthDefaultReverbWidth));
-
-	fluid_synth_chorus_on(m_pSynth, -1, pFXProfile->bChorusActive.ValueOr(pConfig->FluidSynthDefaultChorusActive));
-	fluid_synth_set_chorus_group_depth(m_pSynth, -1, pFXProfile->nChorusDepth.ValueOr(pConfig->FluidSynthDefaultChorusDepth));
-	fluid_synth_set_chorus_group_level(m_pSynth, -1, pFXProfile->nChorusLevel.ValueOr(pConfig->FluidSynthDefaultChorusLevel));
-	fluid_synth_set_chorus_group_nr(m_pSynth, -1, pFXProfile->nChorusVoices.ValueOr(pConfig->FluidSynthDefaultChorusVoices));
-	fluid_synth_set_chorus_group_speed(m_pSynth, -1, pFXProfile->nChorusSpeed.ValueOr(pConfig->FluidSynthDefaultChorusSpeed));
+	if (!bResult)
+		return false;
 
-#ifndef NDEBUG
-	DumpFXSettings();
-#endif
+	const float nLoadTime = (CTimer::GetClockTicks() - nLoadStart) / 1000000.0f;
+	LOGNOTE("\"%s\" loaded in %0.2f seconds", pSoundFontPath, nLoadTime);
 
-	ResetMIDIMonitor();
+	return true;
+}
 
-	m_Lock.Release();
+bool CSoundFontSynth::CreateSynths(const TFXProfile* pFXProfile, float nInitialGain, fluid_synth_t*& pOutSynth, fluid_synth_t*& pOutWorkerSynth) const
+{
+	pOutSynth = CreateSynth(pFXProfile, nInitialGain);
+	pOutWorkerSynth = pOutSynth && m_bRenderWorkerEnabled ? CreateSynth(pFXProfile, nInitialGain) : nullptr;
 
-	const unsigned int nLoadStart = CTimer::GetClockTicks();
+	if (!pOutSynth || (m_bRenderWorkerEnabled && !pOutWorkerSynth))
+	{
+		LOGERR("Failed to create synth");
+		DeleteSynths(pOutSynth, pOutWorkerSynth);
+		return false;
+	}
+
+	return true;
+}
 
-	if (fluid_synth_sfload(m_pSynth, pSoundFontPath, true) == FLUID_FAILED)
+bool CSoundFontSynth::LoadSoundFont(const char* pSoundFontPath, fluid_synth_t* pSynth, fluid_synth_t* pWorkerSynth) const
+{
+	// Read everything but the sample data up front, so that FluidSynth parses the SoundFont from memory; it's slower without, but not fatal
+	const TZoneTag Tag = static_cast<TZoneTag>(nSoundFontLoadTag);
+	CSoundFontCache& Cache = SoundFontCaches[Tag - TZoneTag::FluidSynthSoundFont];
+	Cache.Load(pSoundFontPath, Tag, m_bSaveSoundFontCache);
+
+	// The worker synth shares sample data with the main synth via FluidSynth's sample cache
+	const int nSoundFontID = fluid_synth_sfload(pSynth, pSoundFontPath, true);
+	const int nWorkerSoundFontID = pWorkerSynth ? fluid_synth_sfload(pWorkerSynth, pSoundFontPath, true) : 0;
+	if (nSoundFontID == FLUID_FAILED || nWorkerSoundFontID == FLUID_FAILED)
 	{
 		LOGERR("Failed to load SoundFont");
+		CZoneAllocator::Get()->DumpStats();
 		return false;
 	}
 
-	const float nLoadTime = (CTimer::GetClockTicks() - nLoadStart) / 1000000.0f;
-	LOGNOTE("\"%s\" loaded in %0.2f seconds", pSoundFontPath, nLoadTime);
+	// Load the piano and standard drum kit now, while we're still on the loading core, and never unload them
+	if (m_nSampleCacheBudget)
+	{
+		for (const auto& Preset : DefaultPresets)
+		{
+			fluid_synth_pin_preset(pSynth, nSoundFontID, Preset[0], Preset[1]);
+			if (pWorkerSynth)
+				fluid_synth_pin_preset(pWorkerSynth, nWorkerSoundFontID, Preset[0], Preset[1]);
+		}
+	}
+
+	// Only saved once FluidSynth has accepted the SoundFont
+	if (m_bSaveSoundFontCache && Cache.NeedsSaving())
+		Cache.Save();
 
 	return true;
 }
 
-void CSoundFontSynth::ResetMIDIMonitor()
+void CSoundFontSynth::SwapSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, float nInitialGain, const TFXProfile* pFXProfile)
 {
-	m_MIDIMonitor.AllNotesOff();
-	m_MIDIMonitor.ResetControllers(false);
-	m_nPercussionMask = 1 << 9;
-}
+	m_Lock.Acquire();
+
+	fluid_synth_t* const pOldSynth = m_pSynth;
+	fluid_synth_t* const pOldWorkerSynth = m_pWorkerSynth;
+	m_pSynth = pSynth;
+	m_pWorkerSynth = pWorkerSynth;
+	pSynth = pOldSynth;
+	pWorkerSynth = pOldWorkerSynth;
+
+	// Volume and polyphony limit may have changed since the synth was created
+	m_nInitialGain = nInitialGain;
+	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
+	if (m_pWorkerSynth)
+		fluid_synth_set_gain(m_pWorkerSynth, m_nVolume / 100.0f * m_nInitialGain);
+	SetPolyphonyLimit(m_nPolyphonyLimit);
+
+	// Pinned presets belong to the old synths, which are about to be kept warm or deleted, as do program changes waiting for a load.
+	// Core 0 never loads samples while a switch is in progress, and is the only other core that swaps synths.
+	while (m_nCachedPresets)
+		RemoveCachedPreset(m_nCachedPresets - 1);
+	for (TPendingProgram& Pending : m_PendingPrograms)
+		Pending.bPending = false;
+	m_PresetLoadState.store(TPresetLoadState::Idle, std::memory_order_relaxed);
+
+	if (m_pFXStage)
+		UpdateFXStage(pFXProfile);
 
 #ifndef NDEBUG
-void CSoundFontSynth::DumpFXSettings() const
-{
-	double nGain, nReverbDamping, nReverbLevel, nReverbRoomSize, nReverbWidth, nChorusDepth, nChorusLevel, nChorusSpeed;
-	int nChorusVoices;
+	DumpFXSettings();
+#endif
 
-	nGain = fluid_synth_get_gain(m_pSynth);
+	ResetMIDIMonitor();
 
-	assert(fluid_synth_get_reverb_group_damp(m_pSynth, -1, &nReverbDamping) == FLUID_OK);
-	assert(fluid_synth_get_reverb_group_level(m_pSynth, -1, &nReverbLevel) == FLUID_OK);
-	assert(fluid_synth_get_reverb_group_roomsize(m_pSynth, -1, &nReverbRoomSize) == FLUID_OK);
-	assert(fluid_synth_get_reverb_group_width(m_pSynth, -1, &nReverbWidth) == FLUID_OK);
+	m_Lock.Release();
+}
 
-	assert(fluid_synth_get_chorus_group_depth(m_pSynth, -1, &nChorusDepth) == FLUID_OK);
-	assert(fluid_synth_get_chorus_group_level(m_pSynth, -1, &nChorusLevel) == FLUID_OK);
-	assert(fluid_synth_get_chorus_group_nr(m_pSynth, -1, &nChorusVoices) == FLUID_OK);
-	assert(fluid_synth_get_chorus_group_speed(m_pSynth, -1, &nChorusSpeed) == FLUID_OK);
+void CSoundFontSynth::DeleteSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth)
+{
+	if (pSynth)
+		delete_fluid_synth(pSynth);
 
-	LOGNOTE("Gain: %.2f", nGain);
+	if (pWorkerSynth)
+		delete_fluid_synth(pWorkerSynth);
 
-	LOGNOTE("Reverb: %.2f, %.2f, %.2f, %.2f",
-		nReverbDamping,
-		nReverbLevel,
-		nReverbRoomSize,
-		nReverbWidth
-	);
+	pSynth = nullptr;
+	pWorkerSynth = nullptr;
+}
 
-	LOGNOTE("Chorus: %.2f, %.2f, %d, %.2f",
-		nChorusDepth,
-		nChorusLevel,
-		nChorusVoices,
-		nChorusSpeed
-	);
+// Deletes synths and checks that their SoundFont's memory was released.
+// FluidSynth's sample cache is shared between all synths, so blocks left under the tag may still be referenced and mustn't be freed with FreeTag().
+void CSoundFontSynth::FreeSynths(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, u32 nTag)
+{
+	DeleteSynths(pSynth, pWorkerSynth);
+	SoundFontCaches[nTag - TZoneTag::FluidSynthSoundFont].Clear();
+
+	CZoneAllocator::TStats Stats;
+	CZoneAllocator::Get()->GetStats(Stats);
+
+	const CZoneAllocator::TTagStats& TagStats = Stats.Tags[nTag];
+	if (TagStats.nAllocCount)
+		LOGWARN("%d KB allocated for an unloaded SoundFont is still in use", TagStats.nUsedSize / KILOBYTE);
 }
-#endif
 
-bool CSoundFontSynth::ParseGMSysEx(const u8* pData, size_t nSize)
+u32 CSoundFontSynth::GetFreeSoundFontTag() const
 {
-	// Must be at least size of header plus Start/End of Exclusive bytes
-	if (nSize < sizeof(TGMSysExHeader) + 2)
-		return false;
+	CZoneAllocator::TStats Stats;
+	CZoneAllocator::Get()->GetStats(Stats);
 
-	const auto& Header = reinterpret_cast<const TGMSysExHeader&>(pData[1]);
+	// Prefer a tag with nothing left over from a previous SoundFont, so that the new SoundFont's size can be measured
+	u32 nFreeTag = TZoneTag::FluidSynth;
+	for (u32 nTag = TZoneTag::FluidSynthSoundFont; nTag <= TZoneTag::FluidSynthSoundFontLast; ++nTag)
+	{
+		bool bUsed = nTag == m_nSoundFontTag;
+		for (size_t i = 0; i < m_nWarmSoundFonts && !bUsed; ++i)
+			bUsed = nTag == m_WarmSoundFonts[i].nTag;
 
-	if (Header.ManufacturerID == TManufacturerID::UniversalNonRealTime &&
-	    Header.DeviceID == TDeviceID::AllCall &&
+		if (!bUsed && (nFreeTag == TZoneTag::FluidSynth || Stats.Tags[nTag].nUsedSize < Stats.Tags[nFreeTag].nUsedSize))
+			nFreeTag = nTag;
+	}
+
+	// There is always one more tag than the current, pending and warm SoundFonts
+	assert(nFreeTag != TZoneTag::FluidSynth);
+	return nFreeTag;
+}
+
+bool CSoundFontSynth::ActivateWarmSoundFont(const char* pSoundFontPath, const TFXProfile* pFXProfile)
+{
+	size_t nIndex = 0;
+	while (nIndex < m_nWarmSoundFonts && strcmp(m_WarmSoundFonts[nIndex].Path, pSoundFontPath) != 0)
+		++nIndex;
+
+	if (nIndex == m_nWarmSoundFonts)
+		return false;
+
+	TWarmSoundFont& WarmSoundFont = m_WarmSoundFonts[nIndex];
+	fluid_synth_t* pSynth = WarmSoundFont.pSynth;
+	fluid_synth_t* pWorkerSynth = WarmSoundFont.pWorkerSynth;
+	const u32 nTag = WarmSoundFont.nTag;
+
+	// Hand the synths over before the entry is reused for the current SoundFont
+	WarmSoundFont.pSynth = nullptr;
+	WarmSoundFont.pWorkerSynth = nullptr;
+	WarmSoundFont.nTag = TZoneTag::FluidSynth;
+	EvictWarmSoundFont(nIndex);
+
+	// Start from the same state as a freshly-loaded SoundFont; the synths aren't being rendered yet
+	fluid_synth_system_reset(pSynth);
+	if (pWorkerSynth)
+		fluid_synth_system_reset(pWorkerSynth);
+
+	const float nInitialGain = pFXProfile->nGain.ValueOr(CConfig::Get()->FluidSynthDefaultGain);
+	SwapSynths(pSynth, pWorkerSynth, nInitialGain, pFXProfile);
+	KeepSoundFontWarm(pSynth, pWorkerSynth, m_nSoundFontTag, m_SoundFontManager.GetSoundFontPath(m_nCurrentSoundFontIndex));
+	m_nSoundFontTag = nTag;
+
+	return true;
+}
+
+// Keeps the previous SoundFont's synths loaded if they fit within the budget, otherwise frees them
+void CSoundFontSynth::KeepSoundFontWarm(fluid_synth_t*& pSynth, fluid_synth_t*& pWorkerSynth, u32 nTag, const char* pSoundFontPath)
+{
+	if (!pSynth)
+		return;
+
+	size_t nSize = 0;
+	if (m_nWarmSoundFontBudget && pSoundFontPath)
+	{
+		CZoneAllocator::TStats Stats;
+		CZoneAllocator::Get()->GetStats(Stats);
+		nSize = Stats.Tags[nTag].nUsedSize;
+	}
+
+	if (!nSize || nSize > m_nWarmSoundFontBudget)
+	{
+		FreeSynths(pSynth, pWorkerSynth, nTag);
+		return;
+	}
+
+	// Make room by unloading the least recently used SoundFonts
+	size_t nTotalSize = nSize;
+	for (size_t i = 0; i < m_nWarmSoundFonts; ++i)
+		nTotalSize += m_WarmSoundFonts[i].nSize;
+
+	while (m_nWarmSoundFonts && (m_nWarmSoundFonts == MaxWarmSoundFonts || nTotalSize > m_nWarmSoundFontBudget))
+	{
+		size_t nOldest = 0;
+		for (size_t i = 1; i < m_nWarmSoundFonts; ++i)
+		{
+			if (m_nSoundFontUseCounter - m_WarmSoundFonts[i].nLastUsed > m_nSoundFontUseCounter - m_WarmSoundFonts[nOldest].nLastUsed)
+				nOldest = i;
+		}
+
+		nTotalSize -= m_WarmSoundFonts[nOldest].nSize;
+		EvictWarmSoundFont(nOldest);
+	}
+
+	TWarmSoundFont& WarmSoundFont = m_WarmSoundFonts[m_nWarmSoundFonts++];
+	WarmSoundFont.Path = pSoundFontPath;
+	WarmSoundFont.pSynth = pSynth;
+	WarmSoundFont.pWorkerSynth = pWorkerSynth;
+	WarmSoundFont.nTag = nTag;
+	WarmSoundFont.nSize = nSize;
+	WarmSoundFont.nLastUsed = ++m_nSoundFontUseCounter;
+
+	LOGNOTE("Keeping \"%s\" loaded (%d KB)", pSoundFontPath, nSize / KILOBYTE);
+
+	pSynth = nullptr;
+	pWorkerSynth = nullptr;
+}
+
+void CSoundFontSynth::EvictWarmSoundFont(size_t nIndex)
+{
+	TWarmSoundFont& WarmSoundFont = m_WarmSoundFonts[nIndex];
+	if (WarmSoundFont.pSynth)
+		FreeSynths(WarmSoundFont.pSynth, WarmSoundFont.pWorkerSynth, WarmSoundFont.nTag);
+
+	const size_t nLast = --m_nWarmSoundFonts;
+	if (nIndex != nLast)
+		m_WarmSoundFonts[nIndex] = m_WarmSoundFonts[nLast];
+	m_WarmSoundFonts[nLast] = TWarmSoundFont();
+}
+
+fluid_synth_t* CSoundFontSynth::CreateSynth(const TFXProfile* pFXProfile, float nInitialGain) const
+{
+	const CConfig* const pConfig = CConfig::Get();
+
+	fluid_synth_t* const pSynth = new_fluid_synth(m_pSettings);
+	if (!pSynth)
+		return nullptr;
+
+	fluid_synth_set_polyphony(pSynth, pConfig->FluidSynthPolyphony);
+	fluid_synth_set_gain(pSynth, m_nVolume / 100.0f * nInitialGain);
+	ApplyFXProfile(pSynth, pFXProfile);
+
+	return pSynth;
+}
+
+void CSoundFontSynth::ApplyFXProfile(fluid_synth_t* pSynth, const TFXProfile* pFXProfile) const
+{
+	const CConfig* const pConfig = CConfig::Get();
+
+	// Use values from effects profile if set, otherwise use defaults
+	fluid_synth_reverb_on(pSynth, -1, pFXProfile->bReverbActive.ValueOr(pConfig->FluidSynthDefaultReverbActive));
+	fluid_synth_set_reverb_group_damp(pSynth, -1, pFXProfile->nReverbDamping.ValueOr(pConfig->FluidSynthDefaultReverbDamping));
+	fluid_synth_set_reverb_group_level(pSynth, -1, pFXProfile->nReverbLevel.ValueOr(pConfig->FluidSynthDefaultReverbLevel));
+	fluid_synth_set_reverb_group_roomsize(pSynth, -1, pFXProfile->nReverbRoomSize.ValueOr(pConfig->FluidSynthDefaultReverbRoomSize));
+	fluid_synth_set_reverb_group_width(pSynth, -1, pFXProfile->nReverbWidth.ValueOr(pConfig->FluidSynthDefaultReverbWidth));
+
+	fluid_synth_chorus_on(pSynth, -1, pFXProfile->bChorusActive.ValueOr(pConfig->FluidSynthDefaultChorusActive));
+	fluid_synth_set_chorus_group_depth(pSynth, -1, pFXProfile->nChorusDepth.ValueOr(pConfig->FluidSynthDefaultChorusDepth));
+	fluid_synth_set_chorus_group_level(pSynth, -1, pFXProfile->nChorusLevel.ValueOr(pConfig->FluidSynthDefaultChorusLevel));
+	fluid_synth_set_chorus_group_nr(pSynth, -1, pFXProfile->nChorusVoices.ValueOr(pConfig->FluidSynthDefaultChorusVoices));
+	fluid_synth_set_chorus_group_speed(pSynth, -1, pFXProfile->nChorusSpeed.ValueOr(pConfig->FluidSynthDefaultChorusSpeed));
+
+	// The effects stage processes the send buses instead
+	if (m_pFXStage)
+	{
+		fluid_synth_reverb_on(pSynth, -1, false);
+		fluid_synth_chorus_on(pSynth, -1, false);
+	}
+}
+
+void CSoundFontSynth::ApplyConfigChanges(bool bEffects)
+{
+	const CConfig* const pConfig = CConfig::Get();
+	const TFXProfile FXProfile = m_SoundFontManager.GetSoundFontFXProfile(m_nCurrentSoundFontIndex);
+
+	m_Lock.Acquire();
+
+	// The polyphony governor works back down from the new limit if it needs to
+	m_nMaxPolyphony = pConfig->FluidSynthPolyphony;
+	m_nMinPolyphony = Utility::Min(pConfig->FluidSynthMinPolyphony, m_nMaxPolyphony);
+	SetPolyphonyLimit(m_nMaxPolyphony);
+
+	m_nInitialGain = FXProfile.nGain.ValueOr(pConfig->FluidSynthDefaultGain);
+	fluid_synth_set_gain(m_pSynth, m_nVolume / 100.0f * m_nInitialGain);
+	if (m_pWorkerSynth)
+		fluid_synth_set_gain(m_pWorkerSynth, m_nVolume / 100.0f * m_nInitialGain);
+
+	if (bEffects)
+	{
+		ApplyFXProfile(m_pSynth, &FXProfile);
+		if (m_pWorkerSynth)
+			ApplyFXProfile(m_pWorkerSynth, &FXProfile);
+
+		if (m_pFXStage)
+			UpdateFXStage(&FXProfile);
+	}
+
+	m_Lock.Release();
+}
+
+// Must be called with m_Lock held
+void CSoundFontSynth::UpdateFXStage(const TFXProfile* pFXProfile)
+{
+	const CConfig* const pConfig = CConfig::Get();
+	TFXParameters Parameters;
+	double nRoomSize, nDamping, nWidth, nReverbLevel, nChorusLevel, nSpeed, nDepth;
+
+	// Read back from the synth, which has already applied the effects profile and clamped the values to its limits
+	fluid_synth_get_reverb_group_roomsize(m_pSynth, -1, &nRoomSize);
+	fluid_synth_get_reverb_group_damp(m_pSynth, -1, &nDamping);
+	fluid_synth_get_reverb_group_width(m_pSynth, -1, &nWidth);
+	fluid_synth_get_reverb_group_level(m_pSynth, -1, &nReverbLevel);
+	fluid_synth_get_chorus_group_nr(m_pSynth, -1, &Parameters.nChorusVoices);
+	fluid_synth_get_chorus_group_level(m_pSynth, -1, &nChorusLevel);
+	fluid_synth_get_chorus_group_speed(m_pSynth, -1, &nSpeed);
+	fluid_synth_get_chorus_group_depth(m_pSynth, -1, &nDepth);
+	fluid_synth_get_chorus_group_type(m_pSynth, -1, &Parameters.nChorusType);
+
+	Parameters.bReverbActive = pFXProfile->bReverbActive.ValueOr(pConfig->FluidSynthDefaultReverbActive);
+	Parameters.nReverbRoomSize = nRoomSize;
+	Parameters.nReverbDamping = nDamping;
+	Parameters.nReverbWidth = nWidth;
+	Parameters.nReverbLevel = nReverbLevel;
+
+	Parameters.bChorusActive = pFXProfile->bChorusActive.ValueOr(pConfig->FluidSynthDefaultChorusActive);
+	Parameters.nChorusLevel = nChorusLevel;
+	Parameters.nChorusSpeed = nSpeed;
+	Parameters.nChorusDepth = nDepth;
+
+	m_pFXStage->SetParameters(Parameters);
+	m_pFXStage->Reset();
+}
+
+fluid_synth_t* CSoundFontSynth::GetChannelSynth(u8 nChannel) const
+{
+	// Odd channels (including the GM percussion channel) are rendered by the worker synth
+	return m_pWorkerSynth && (nChannel & 1) ? m_pWorkerSynth : m_pSynth;
+}
+
+void CSoundFontSynth::RenderOutputFrames(float* pOutBuffer, size_t nFrames)
+{
+	if (!m_pResampler)
+	{
+		RenderFrames(pOutBuffer, nFrames);
+		return;
+	}
+
+	m_pResampler->Process(pOutBuffer, nFrames, [&](float* pInBuffer, size_t nInFrames)
+	{
+		RenderFrames(pInBuffer, nInFrames);
+	});
+}
+
+void CSoundFontSynth::RenderOutputFrames(s16* pOutBuffer, size_t nFrames)
+{
+	if (!m_pResampler && !m_pFXStage && !m_pOutputMeter)
+	{
+		RenderFrames(pOutBuffer, nFrames);
+		return;
+	}
+
+	// Render in float, then convert
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, ResamplerChunkSize);
+		RenderOutputFrames(m_ResamplerBuffer, nChunkFrames);
+
+		for (size_t i = 0; i < nChunkFrames * 2; ++i)
+			pOutBuffer[i] = Utility::Clamp(m_ResamplerBuffer[i], -1.0f, 1.0f) * 32767.0f;
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CSoundFontSynth::RenderFrames(float* pOutBuffer, size_t nFrames)
+{
+	if (m_pFXStage)
+	{
+		RenderFXStageFrames(pOutBuffer, nFrames);
+		return;
+	}
+
+	if (m_pOutputMeter)
+	{
+		RenderMeteredFrames(pOutBuffer, nFrames);
+		return;
+	}
+
+	if (!m_pWorkerSynth)
+	{
+		assert(fluid_synth_write_float(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+		return;
+	}
+
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, RenderWorkerChunkSize);
+
+		StartRenderWorker(nChunkFrames);
+		assert(fluid_synth_write_float(m_pSynth, nChunkFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+		WaitForRenderWorker();
+
+		for (size_t i = 0; i < nChunkFrames * 2; ++i)
+			pOutBuffer[i] += m_RenderWorkerBuffer[i];
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CSoundFontSynth::RenderFrames(s16* pOutBuffer, size_t nFrames)
+{
+	if (!m_pWorkerSynth)
+	{
+		assert(fluid_synth_write_s16(m_pSynth, nFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+		return;
+	}
+
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, RenderWorkerChunkSize);
+
+		StartRenderWorker(nChunkFrames);
+		assert(fluid_synth_write_s16(m_pSynth, nChunkFrames, pOutBuffer, 0, 2, pOutBuffer, 1, 2) == FLUID_OK);
+		WaitForRenderWorker();
+
+		for (size_t i = 0; i < nChunkFrames * 2; ++i)
+		{
+			const s32 nSample = pOutBuffer[i] + static_cast<s32>(m_RenderWorkerBuffer[i] * 32767.0f);
+			pOutBuffer[i] = Utility::Clamp(nSample, -32768, 32767);
+		}
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CSoundFontSynth::RenderFXStageFrames(float* pOutBuffer, size_t nFrames)
+{
+	while (nFrames)
+	{
+		// FluidSynth's own effects are disabled, so there is nothing to return from them
+		const size_t nChunkFrames = Utility::Min(nFrames, ChannelChunkSize);
+		RenderChannelFrames(pOutBuffer, nChunkFrames, nullptr);
+		m_pFXStage->Process(m_FXSendBuffers[0], m_FXSendBuffers[1], pOutBuffer, nChunkFrames);
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+void CSoundFontSynth::RenderMeteredFrames(float* pOutBuffer, size_t nFrames)
+{
+	float* FXBuffers[] = { m_MeterFXBuffers[0], m_MeterFXBuffers[1], m_MeterFXBuffers[2], m_MeterFXBuffers[3] };
+
+	while (nFrames)
+	{
+		const size_t nChunkFrames = Utility::Min(nFrames, ChannelChunkSize);
+		RenderChannelFrames(pOutBuffer, nChunkFrames, FXBuffers);
+
+		// Add the reverb and chorus returns
+		for (size_t i = 0; i < nChunkFrames; ++i)
+		{
+			pOutBuffer[i * 2] += FXBuffers[0][i] + FXBuffers[2][i];
+			pOutBuffer[i * 2 + 1] += FXBuffers[1][i] + FXBuffers[3][i];
+		}
+
+		pOutBuffer += nChunkFrames * 2;
+		nFrames -= nChunkFrames;
+	}
+}
+
+// Renders the dry output of each MIDI channel separately, derives the effect sends and measures it where enabled, and mixes it down into
+// pOutBuffer; ppFXBuffers receives FluidSynth's reverb left/right and chorus left/right returns, if not null
+void CSoundFontSynth::RenderChannelFrames(float* pOutBuffer, size_t nFrames, float** ppFXBuffers)
+{
+	assert(nFrames <= ChannelChunkSize);
+
+	// fluid_synth_process() mixes into the buffers
+	for (size_t i = 0; i < m_nChannelBufferCount; ++i)
+		memset(m_ChannelBufferPointers[i], 0, nFrames * sizeof(float));
+	if (ppFXBuffers)
+	{
+		for (size_t i = 0; i < 4; ++i)
+			memset(ppFXBuffers[i], 0, nFrames * sizeof(float));
+	}
+
+	assert(fluid_synth_process(m_pSynth, nFrames, ppFXBuffers ? 4 : 0, ppFXBuffers, m_nChannelBufferCount, m_ChannelBufferPointers) == FLUID_OK);
+
+	if (m_pFXStage)
+		MixFXSends(nFrames);
+
+	size_t nMixBufferCount = m_nChannelBufferCount;
+	if (m_pOutputMeter)
+	{
+		// Parts 17-32 share the meters of parts 1-16
+		for (size_t nBuffer = MeterBufferCount; nBuffer < m_nChannelBufferCount; ++nBuffer)
+		{
+			const float* pSource = m_ChannelBufferPointers[nBuffer];
+			float* pDest = m_ChannelBufferPointers[nBuffer - MeterBufferCount];
+
+			for (size_t i = 0; i < nFrames; ++i)
+				pDest[i] += pSource[i];
+		}
+
+		nMixBufferCount = Utility::Min(m_nChannelBufferCount, MeterBufferCount);
+		m_pOutputMeter->Process(m_ChannelBufferPointers, nFrames);
+	}
+
+	for (size_t i = 0; i < nFrames; ++i)
+	{
+		pOutBuffer[i * 2] = m_ChannelBufferPointers[0][i];
+		pOutBuffer[i * 2 + 1] = m_ChannelBufferPointers[1][i];
+	}
+
+	for (size_t nBuffer = 2; nBuffer < nMixBufferCount; nBuffer += 2)
+	{
+		const float* pLeft = m_ChannelBufferPointers[nBuffer];
+		const float* pRight = m_ChannelBufferPointers[nBuffer + 1];
+
+		for (size_t i = 0; i < nFrames; ++i)
+		{
+			pOutBuffer[i * 2] += pLeft[i];
+			pOutBuffer[i * 2 + 1] += pRight[i];
+		}
+	}
+}
+
+// FluidSynth has no public access to its effect send buses, so they are built the way its default modulators feed them: each channel's
+// dry output scaled by its reverb (CC 91) and chorus (CC 93) send level. The effects units take a mono send.
+void CSoundFontSynth::MixFXSends(size_t nFrames)
+{
+	// The default modulators send at most 20% of each voice; the dry output is panned with an equal-power law, so its mono sum
+	// is louder than the voice by sqrt(2) at the centre
+	constexpr float SendScale = 0.2f / 127.0f / 1.41421356f;
+
+	float* const pReverbSend = m_FXSendBuffers[0];
+	float* const pChorusSend = m_FXSendBuffers[1];
+	memset(pReverbSend, 0, nFrames * sizeof(float));
+	memset(pChorusSend, 0, nFrames * sizeof(float));
+
+	for (size_t nBuffer = 0; nBuffer < m_nChannelBufferCount; nBuffer += 2)
+	{
+		const int nChannel = nBuffer / 2;
+		int nReverbSend = 0, nChorusSend = 0;
+		fluid_synth_get_cc(m_pSynth, nChannel, 91, &nReverbSend);
+		fluid_synth_get_cc(m_pSynth, nChannel, 93, &nChorusSend);
+
+		if (!nReverbSend && !nChorusSend)
+			continue;
+
+		const float nReverbGain = nReverbSend * SendScale;
+		const float nChorusGain = nChorusSend * SendScale;
+		const float* pLeft = m_ChannelBufferPointers[nBuffer];
+		const float* pRight = m_ChannelBufferPointers[nBuffer + 1];
+
+		for (size_t i = 0; i < nFrames; ++i)
+		{
+			const float nMono = pLeft[i] + pRight[i];
+			pReverbSend[i] += nMono * nReverbGain;
+			pChorusSend[i] += nMono * nChorusGain;
+		}
+	}
+}
+
+void CSoundFontSynth::StartRenderWorker(size_t nFrames)
+{
+	m_nRenderWorkerFrames = nFrames;
+	m_nRenderWorkerRequest.store(m_nRenderWorkerRequest.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void CSoundFontSynth::WaitForRenderWorker() const
+{
+	const unsigned int nRequest = m_nRenderWorkerRequest.load(std::memory_order_relaxed);
+	while (m_nRenderWorkerDone.load(std::memory_order_acquire) != nRequest)
+		;
+}
+
+bool CSoundFontSynth::RenderWorker()
+{
+	if (m_pFXStage)
+		return m_pFXStage->Run();
+
+	const unsigned int nRequest = m_nRenderWorkerRequest.load(std::memory_order_acquire);
+	if (nRequest == m_nRenderWorkerDone.load(std::memory_order_relaxed))
+		return false;
+
+	// The audio core holds m_Lock and waits for us, so the worker synth can't be modified while rendering
+	assert(fluid_synth_write_float(m_pWorkerSynth, m_nRenderWorkerFrames, m_RenderWorkerBuffer, 0, 2, m_RenderWorkerBuffer, 1, 2) == FLUID_OK);
+	m_nRenderWorkerDone.store(nRequest, std::memory_order_release);
+	return true;
+}
+
+// Called from Render() with m_Lock held
+void CSoundFontSynth::UpdateRenderStats(size_t nFrames, unsigned int nRenderTicks)
+{
+	int nActiveVoices = fluid_synth_get_active_voice_count(m_pSynth);
+	if (m_pWorkerSynth)
+		nActiveVoices += fluid_synth_get_active_voice_count(m_pWorkerSynth);
+	m_nActiveVoices = nActiveVoices;
+
+	if (m_bPolyphonyGovernor)
+		UpdatePolyphonyGovernor(nFrames, nRenderTicks, nActiveVoices);
+}
+
+void CSoundFontSynth::UpdatePolyphonyGovernor(size_t nFrames, unsigned int nRenderTicks, int nActiveVoices)
+{
+	if (nFrames == 0)
+		return;
+
+	// Render time as a percentage of the block's playback time, smoothed over recent blocks
+	const unsigned int nLoad = static_cast<u64>(nRenderTicks) * m_nSampleRate * 100 / (static_cast<u64>(nFrames) * 1000000);
+	m_nRenderLoad = (m_nRenderLoad * 7 + nLoad) / 8;
+
+	// A throttled CPU will render slower from now on, so don't wait for the load to rise
+	const bool bThrottled = m_bThrottleDetected.exchange(false, std::memory_order_relaxed);
+
+	m_nGovernorHoldFrames = m_nGovernorHoldFrames > nFrames ? m_nGovernorHoldFrames - nFrames : 0;
+
+	if (bThrottled || m_nRenderLoad >= GovernorHighLoadPercent || nLoad >= 100)
+	{
+		m_nGovernorSlackFrames = 0;
+
+		// Give the previous reduction time to take effect before reducing again
+		if (!bThrottled && m_nGovernorHoldFrames)
+			return;
+
+		// Cap polyphony at the voices currently sounding, minus a few. FluidSynth kills the voices above the new limit, and
+		// any further notes steal the lowest-priority (quietest) voices rather than adding to the load.
+		const int nLimit = Utility::Max(Utility::Min(static_cast<int>(m_nPolyphonyLimit), nActiveVoices) * 7 / 8, m_nMinPolyphony);
+		if (nLimit < m_nPolyphonyLimit)
+			SetPolyphonyLimit(nLimit);
+
+		m_nGovernorHoldFrames = m_nSampleRate / 20;
+		return;
+	}
+
+	if (m_nRenderLoad >= GovernorLowLoadPercent || m_nPolyphonyLimit >= m_nMaxPolyphony)
+	{
+		m_nGovernorSlackFrames = 0;
+		return;
+	}
+
+	// Restore polyphony gradually once there has been headroom for a while
+	m_nGovernorSlackFrames += nFrames;
+	if (m_nGovernorSlackFrames >= m_nSampleRate / 2)
+	{
+		m_nGovernorSlackFrames = 0;
+		SetPolyphonyLimit(Utility::Min(m_nPolyphonyLimit + Utility::Max(m_nPolyphonyLimit / 8, 1), m_nMaxPolyphony));
+	}
+}
+
+// Must be called with m_Lock held
+void CSoundFontSynth::SetPolyphonyLimit(int nPolyphony)
+{
+	m_nPolyphonyLimit = nPolyphony;
+	fluid_synth_set_polyphony(m_pSynth, nPolyphony);
+	if (m_pWorkerSynth)
+		fluid_synth_set_polyphony(m_pWorkerSynth, nPolyphony);
+}
+
+bool CSoundFontSynth::GetSampleCacheStats(TSampleCacheStats& OutStats) const
+{
+	if (!m_nSampleCacheBudget)
+		return false;
+
+	OutStats = m_SampleCacheStats;
+	OutStats.nResidentPresets = m_nCachedPresets;
+	OutStats.nSampleSize = CZoneAllocator::Get()->GetTagUsedSize(TZoneTag::FluidSynthSamples);
+	return true;
+}
+
+void CSoundFontSynth::ResetSampleCacheStats()
+{
+	m_SampleCacheStats.nHits = 0;
+	m_SampleCacheStats.nMisses = 0;
+	m_SampleCacheStats.nEvictions = 0;
+}
+
+// Called from Render() via the MIDI event queue with m_Lock held.
+// Loading samples takes far longer than a block, so a preset that isn't loaded yet is requested from core 0 at the next block
+// boundary; until it has been loaded, the channel keeps playing its current preset.
+void CSoundFontSynth::SelectProgram(fluid_synth_t* pSynth, u8 nChannel, u8 nProgram)
+{
+	int nSoundFontID, nBank, nCurrentProgram;
+	if (fluid_synth_get_program(pSynth, nChannel, &nSoundFontID, &nBank, &nCurrentProgram) != FLUID_OK)
+		return;
+
+	// Replaces any earlier program change still waiting for its samples
+	m_PendingPrograms[nChannel] = { true, nBank, nProgram };
+
+	// Presets can't be selected while core 0 is loading samples into the synths
+	TPreset Preset;
+	if (m_PresetLoadState.load(std::memory_order_acquire) != TPresetLoadState::Requested && ApplyPendingProgram(nChannel, Preset))
+		++m_SampleCacheStats.nHits;
+	else
+		++m_SampleCacheStats.nMisses;
+}
+
+// Called with m_Lock held while core 0 isn't loading samples. Applies a held-back program change if its preset's samples
+// are loaded; otherwise returns false with the preset that needs loading.
+bool CSoundFontSynth::ApplyPendingProgram(u8 nChannel, TPreset& OutPreset)
+{
+	TPendingProgram& Pending = m_PendingPrograms[nChannel];
+	fluid_synth_t* const pSynth = GetChannelSynth(nChannel);
+
+	// If the SoundFont has neither the preset nor a fallback for it, FluidSynth has nothing to load
+	const bool bFound = ResolvePreset(pSynth, Pending.nBank, Pending.nProgram, OutPreset);
+	if (bFound && !IsPresetResident(OutPreset))
+		return false;
+
+	// Use the bank that was selected when the program change was received
+	int nSoundFontID, nBank, nProgram;
+	fluid_synth_get_program(pSynth, nChannel, &nSoundFontID, &nBank, &nProgram);
+	if (nBank != Pending.nBank)
+		fluid_synth_bank_select(pSynth, nChannel, Pending.nBank);
+
+	fluid_synth_program_change(pSynth, nChannel, Pending.nProgram);
+
+	if (nBank != Pending.nBank)
+		fluid_synth_bank_select(pSynth, nChannel, nBank);
+
+	Pending.bPending = false;
+
+	const size_t nIndex = bFound ? FindCachedPreset(OutPreset) : m_nCachedPresets;
+	if (nIndex < m_nCachedPresets)
+		m_CachedPresets[nIndex].nLastUsed = ++m_nPresetUseCounter;
+
+	return true;
+}
+
+// Called with m_Lock held at block boundaries; hands samples loaded by core 0 over to the channels waiting for them,
+// and requests the next preset that is missing
+void CSoundFontSynth::UpdatePresetLoad()
+{
+	if (!m_nSampleCacheBudget)
+		return;
+
+	const TPresetLoadState State = m_PresetLoadState.load(std::memory_order_acquire);
+	if (State == TPresetLoadState::Requested)
+		return;
+
+	bool bRequest = false;
+	for (u8 nChannel = 0; nChannel < m_nMIDIChannels; ++nChannel)
+	{
+		TPendingProgram& Pending = m_PendingPrograms[nChannel];
+		TPreset Preset;
+		if (!Pending.bPending || ApplyPendingProgram(nChannel, Preset))
+			continue;
+
+		// Selecting a preset that couldn't be loaded would try to load it here; keep the current preset instead
+		if (State == TPresetLoadState::Failed && Preset == m_RequestedPreset)
+		{
+			Pending.bPending = false;
+			continue;
+		}
+
+		if (!bRequest)
+		{
+			m_RequestedPreset = Preset;
+			bRequest = true;
+		}
+	}
+
+	if (bRequest)
+		m_PresetLoadState.store(TPresetLoadState::Requested, std::memory_order_release);
+	else if (State != TPresetLoadState::Idle)
+		m_PresetLoadState.store(TPresetLoadState::Idle, std::memory_order_relaxed);
+}
+
+void CSoundFontSynth::LoadRequestedPreset()
+{
+	if (m_PresetLoadState.load(std::memory_order_acquire) != TPresetLoadState::Requested)
+		return;
+
+	// The synths may be swapped by a switch in progress, which discards the request
+	if (IsSwitchingSoundFont())
+		return;
+
+	// Until the load is handed back, the audio core neither selects presets nor touches the cached presets.
+	// Pinning loads the samples, and the file callbacks take the file system lock for each access.
+	const TPreset Preset = m_RequestedPreset;
+	nSampleLoadCore = CMultiCoreSupport::ThisCore();
+	const bool bLoaded = fluid_synth_pin_preset(Preset.pSynth, Preset.nSoundFontID, Preset.nBank, Preset.nProgram) == FLUID_OK;
+	nSampleLoadCore = -1;
+
+	if (bLoaded)
+		AddCachedPreset(Preset);
+
+	m_PresetLoadState.store(bLoaded ? TPresetLoadState::Loaded : TPresetLoadState::Failed, std::memory_order_release);
+}
+
+// Mirrors the fallbacks FluidSynth uses when a program change selects a preset that the SoundFont doesn't have
+bool CSoundFontSynth::ResolvePreset(fluid_synth_t* pSynth, int nBank, int nProgram, TPreset& OutPreset) const
+{
+	// Each synth has a single SoundFont
+	fluid_sfont_t* const pSoundFont = fluid_synth_get_sfont(pSynth, 0);
+	if (!pSoundFont)
+		return false;
+
+	if (!fluid_sfont_get_preset(pSoundFont, nBank, nProgram))
+	{
+		// Drum kits fall back to the standard kit, and melodic presets to bank 0 and then the piano
+		if (nBank == DrumBank)
+			nProgram = 0;
+		else
+		{
+			nBank = 0;
+			if (!fluid_sfont_get_preset(pSoundFont, nBank, nProgram))
+				nProgram = 0;
+		}
+
+		if (!fluid_sfont_get_preset(pSoundFont, nBank, nProgram))
+			return false;
+	}
+
+	OutPreset = { pSynth, fluid_sfont_get_id(pSoundFont), nBank, nProgram };
+	return true;
+}
+
+// Selecting a preset whose samples are all loaded doesn't touch the SD card
+bool CSoundFontSynth::IsPresetResident(const TPreset& Preset) const
+{
+	for (const auto& DefaultPreset : DefaultPresets)
+	{
+		if (Preset.nBank == DefaultPreset[0] && Preset.nProgram == DefaultPreset[1])
+			return true;
+	}
+
+	return FindCachedPreset(Preset) < m_nCachedPresets || IsPresetSelected(Preset);
+}
+
+size_t CSoundFontSynth::FindCachedPreset(const TPreset& Preset) const
+{
+	for (size_t i = 0; i < m_nCachedPresets; ++i)
+	{
+		if (m_CachedPresets[i] == Preset)
+			return i;
+	}
+
+	return m_nCachedPresets;
+}
+
+// Called on core 0 while the audio core waits for the load to be handed back
+void CSoundFontSynth::AddCachedPreset(const TPreset& Preset)
+{
+	// Make room by dropping the least recently used preset
+	if (m_nCachedPresets == MaxCachedPresets)
+	{
+		size_t nOldest = 0;
+		for (size_t i = 1; i < m_nCachedPresets; ++i)
+		{
+			if (m_nPresetUseCounter - m_CachedPresets[i].nLastUsed > m_nPresetUseCounter - m_CachedPresets[nOldest].nLastUsed)
+				nOldest = i;
+		}
+
+		RemoveCachedPreset(nOldest);
+	}
+
+	TCachedPreset& CachedPreset = m_CachedPresets[m_nCachedPresets++];
+	static_cast<TPreset&>(CachedPreset) = Preset;
+	CachedPreset.nLastUsed = ++m_nPresetUseCounter;
+	EvictCachedPresets();
+}
+
+bool CSoundFontSynth::IsPresetSelected(const TPreset& Preset) const
+{
+	int nSoundFontID, nBank, nProgram;
+	for (u8 nChannel = 0; nChannel < m_nMIDIChannels; ++nChannel)
+	{
+		if (fluid_synth_get_program(Preset.pSynth, nChannel, &nSoundFontID, &nBank, &nProgram) == FLUID_OK &&
+		    nSoundFontID == Preset.nSoundFontID && nBank == Preset.nBank && nProgram == Preset.nProgram)
+			return true;
+	}
+
+	return false;
+}
+
+// Called on core 0 while the audio core waits for the load to be handed back
+void CSoundFontSynth::EvictCachedPresets()
+{
+	CZoneAllocator* const pAllocator = CZoneAllocator::Get();
+
+	// Also make room when the heap is nearly full, even if the budget hasn't been reached
+	while (pAllocator->GetTagUsedSize(TZoneTag::FluidSynthSamples) > m_nSampleCacheBudget || pAllocator->GetUsedSize() + SampleCacheHeadroom > pAllocator->GetHeapSize())
+	{
+		// Find the least recently used preset that isn't selected on a channel, as unpinning it would free nothing,
+		// and isn't the one just loaded for channels that are still waiting for it
+		size_t nOldest = m_nCachedPresets;
+		for (size_t i = 0; i < m_nCachedPresets; ++i)
+		{
+			const TCachedPreset& Preset = m_CachedPresets[i];
+			if ((nOldest == m_nCachedPresets || m_nPresetUseCounter - Preset.nLastUsed > m_nPresetUseCounter - m_CachedPresets[nOldest].nLastUsed) &&
+			    !(Preset == m_RequestedPreset) && !IsPresetSelected(Preset))
+				nOldest = i;
+		}
+
+		if (nOldest == m_nCachedPresets)
+			break;
+
+		RemoveCachedPreset(nOldest);
+		++m_SampleCacheStats.nEvictions;
+	}
+}
+
+void CSoundFontSynth::RemoveCachedPreset(size_t nIndex)
+{
+	const TCachedPreset& Preset = m_CachedPresets[nIndex];
+	fluid_synth_unpin_preset(Preset.pSynth, Preset.nSoundFontID, Preset.nBank, Preset.nProgram);
+	m_CachedPresets[nIndex] = m_CachedPresets[--m_nCachedPresets];
+}
+
+void CSoundFontSynth::ResetMIDIMonitor()
+{
+	m_MIDIMonitor.AllNotesOff();
+	m_MIDIMonitor.ResetControllers(false);
+	m_nPercussionMask = 1 << 9;
+}
+
+#ifndef NDEBUG
+void CSoundFontSynth::DumpFXSettings() const
+{
+	double nGain, nReverbDamping, nReverbLevel, nReverbRoomSize, nReverbWidth, nChorusDepth, nChorusLevel, nChorusSpeed;
+	int nChorusVoices;
+
+	nGain = fluid_synth_get_gain(m_pSynth);
+
+	assert(fluid_synth_get_reverb_group_damp(m_pSynth, -1, &nReverbDamping) == FLUID_OK);
+	assert(fluid_synth_get_reverb_group_level(m_pSynth, -1, &nReverbLevel) == FLUID_OK);
+	assert(fluid_synth_get_reverb_group_roomsize(m_pSynth, -1, &nReverbRoomSize) == FLUID_OK);
+	assert(fluid_synth_get_reverb_group_width(m_pSynth, -1, &nReverbWidth) == FLUID_OK);
+
+	assert(fluid_synth_get_chorus_group_depth(m_pSynth, -1, &nChorusDepth) == FLUID_OK);
+	assert(fluid_synth_get_chorus_group_level(m_pSynth, -1, &nChorusLevel) == FLUID_OK);
+	assert(fluid_synth_get_chorus_group_nr(m_pSynth, -1, &nChorusVoices) == FLUID_OK);
+	assert(fluid_synth_get_chorus_group_speed(m_pSynth, -1, &nChorusSpeed) == FLUID_OK);
+
+	LOGNOTE("Gain: %.2f", nGain);
+
+	LOGNOTE("Reverb: %.2f, %.2f, %.2f, %.2f",
+		nReverbDamping,
+		nReverbLevel,
+		nReverbRoomSize,
+		nReverbWidth
+	);
+
+	LOGNOTE("Chorus: %.2f, %.2f, %d, %.2f",
+		nChorusDepth,
+		nChorusLevel,
+		nChorusVoices,
+		nChorusSpeed
+	);
+}
+#endif
+
+bool CSoundFontSynth::ParseGMSysEx(const u8* pData, size_t nSize)
+{
+	// Must be at least size of header plus Start/End of Exclusive bytes
+	if (nSize < sizeof(TGMSysExHeader) + 2)
+		return false;
+
+	const auto& Header = reinterpret_cast<const TGMSysExHeader&>(pData[1]);
+
+	if (Header.ManufacturerID == TManufacturerID::UniversalNonRealTime &&
+	    Header.DeviceID == TDeviceID::AllCall &&
 	    Header.SubID1 == TUniversalSubID::GeneralMIDI)
 	{
 		// GM Mode On/Off
@@ -537,9 +1985,6 @@ bool CSoundFontSynth::ParseRolandSysEx(const u8* pData, size_t nSize)
 			const u8 nChannel = Header.Address[1] & 0x0F;
 			const u8 nMode    = *pRolandData ? 1 : 0;
 			m_nPercussionMask ^= (-nMode ^ m_nPercussionMask) & (1 << nChannel);
-
-			// Don't consume; forward to FluidSynth
-			return false;
 		}
 	}
 	else if (Header.ModelID == TRolandModelID::SC55)
@@ -562,6 +2007,13 @@ bool CSoundFontSynth::ParseRolandSysEx(const u8* pData, size_t nSize)
 		}
 	}
 
+	// Defer other GS parameter changes until the block boundary; keyed by the header up to and including the address.
+	// Resets are never deferred, as changes pending before them must not be applied after them.
+	const u32 nAddress = nAddressHiMed | nAddressLo;
+	if (Header.ModelID == TRolandModelID::GS && Header.CommandID == TRolandCommandID::DT1 &&
+	    nAddress != TRolandAddress::GSReset && nAddress != TRolandAddress::SystemModeSet)
+		return DeferSysEx(pData, nSize, sizeof(TRolandSysExHeader) + 1);
+
 	return false;
 }
 
@@ -606,7 +2058,56 @@ bool CSoundFontSynth::ParseYamahaSysEx(const u8* pData, size_t nSize)
 			// Consume
 			return true;
 		}
+
+		// Defer other XG parameter changes (device number 1n) until the block boundary, except for resets, which are
+		// forwarded straight after the changes pending before them
+		const u32 nAddress = nAddressHiMed | nAddressLo;
+		const bool bReset = nAddress == TYamahaAddress::XGSystemOn || nAddress == TYamahaAddress::XGAllParameterReset || nAddress == TYamahaAddress::XGDrumSetupReset;
+		if ((Header.DeviceID & 0xF0) == 0x10 && !bReset)
+			return DeferSysEx(pData, nSize, sizeof(TYamahaSysExHeader) + 1);
 	}
 
 	return false;
 }
+
+// Returns false if the message is too large to be deferred and should be forwarded immediately
+bool CSoundFontSynth::DeferSysEx(const u8* pData, size_t nSize, size_t nKeySize)
+{
+	if (nSize > MaxPendingSysExSize)
+	{
+		ApplyPendingSysEx();
+		return false;
+	}
+
+	// Last write wins, and moves to the end; writes to other addresses made since the replaced one may overlap it
+	// (e.g. a bulk write covering the same parameter), so they must still be applied before it
+	for (size_t i = 0; i < m_nPendingSysEx; ++i)
+	{
+		const TPendingSysEx& Pending = m_PendingSysEx[i];
+		if (Pending.nSize == nSize && Pending.nKeySize == nKeySize && memcmp(Pending.Data, pData, nKeySize) == 0)
+		{
+			memmove(&m_PendingSysEx[i], &m_PendingSysEx[i + 1], (m_nPendingSysEx - i - 1) * sizeof(TPendingSysEx));
+			--m_nPendingSysEx;
+			break;
+		}
+	}
+
+	if (m_nPendingSysEx == MaxPendingSysEx)
+		ApplyPendingSysEx();
+
+	TPendingSysEx& Pending = m_PendingSysEx[m_nPendingSysEx++];
+	memcpy(Pending.Data, pData, nSize);
+	Pending.nSize = nSize;
+	Pending.nKeySize = nKeySize;
+
+	return true;
+}
+
+// Called with m_Lock held
+void CSoundFontSynth::ApplyPendingSysEx()
+{
+	for (size_t i = 0; i < m_nPendingSysEx; ++i)
+		ForwardSysEx(m_PendingSysEx[i].Data, m_PendingSysEx[i].nSize);
+
+	m_nPendingSysEx = 0;
+}
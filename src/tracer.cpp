@@ -0,0 +1,132 @@
+//
+// tracer.cpp
+//
+// mt32-pi - A baremetal MIDI synthesizer for Raspberry Pi
+// Copyright (C) 2020-2023 Dale Whinham <daleyo@gmail.com>
+//
+// This file is part of mt32-pi.
+//
+// mt32-pi is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// mt32-pi is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// mt32-pi. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <fatfs/ff.h>
+
+#include "filesystemlock.h"
+#include "tracer.h"
+#include "utility.h"
+
+LOGMODULE("tracer");
+
+#define TRACE_EVENT_NAME(VALUE, NAME, PHASE) NAME,
+#define TRACE_EVENT_PHASE(VALUE, NAME, PHASE) PHASE,
+
+static const char* const EventNames[] = { ENUM_TRACEEVENT(TRACE_EVENT_NAME) };
+static const char EventPhases[] = { ENUM_TRACEEVENT(TRACE_EVENT_PHASE) };
+
+// Trace file layout (little-endian):
+//   THeader
+//   per event type: phase (1 byte), name length (1 byte), name
+//   per core: write index (4 bytes), then RecordsPerCore records; the oldest record is at (write index % RecordsPerCore)
+struct THeader
+{
+	char Magic[4];
+	u16 nVersion;
+	u16 nCores;
+	u32 nRecordsPerCore;
+	u32 nRecordSize;
+	u32 nTimestampHz;
+	u32 nEventTypes;
+}
+PACKED;
+
+constexpr u16 TraceVersion = 1;
+
+bool CTracer::s_bEnabled = false;
+std::atomic<bool> CTracer::s_bFrozen(false);
+std::atomic<bool> CTracer::s_bDumpPending(false);
+std::atomic<bool> CTracer::s_bResumeAfterDump(false);
+CTracer::TCoreBuffer CTracer::s_Buffers[CORES];
+
+void CTracer::Freeze()
+{
+	// Only the first underrun since recording resumed is kept
+	if (!s_bFrozen.exchange(true, std::memory_order_relaxed))
+		s_bDumpPending.store(true, std::memory_order_release);
+}
+
+void CTracer::RequestDump()
+{
+	s_bResumeAfterDump.store(true, std::memory_order_relaxed);
+	s_bFrozen.store(true, std::memory_order_relaxed);
+	s_bDumpPending.store(true, std::memory_order_release);
+}
+
+void CTracer::Resume()
+{
+	s_bFrozen.store(false, std::memory_order_relaxed);
+}
+
+bool CTracer::Dump(const char* pPath)
+{
+	if (!s_bDumpPending.load(std::memory_order_acquire))
+		return false;
+
+	// A core may still be completing an event that it began before the freeze; at worst that one record is torn
+	CFileSystemLock::Acquire();
+
+	FIL File;
+	bool bResult = f_open(&File, pPath, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK;
+	if (bResult)
+	{
+		UINT nWritten;
+		auto WriteData = [&](const void* pData, size_t nSize)
+		{
+			bResult = bResult && f_write(&File, pData, nSize, &nWritten) == FR_OK && nWritten == nSize;
+		};
+
+		const THeader Header = { { 'M', 'T', 'T', 'R' }, TraceVersion, CORES, RecordsPerCore, sizeof(TRecord), GetTimestampRate(), Utility::ArraySize(EventNames) };
+		WriteData(&Header, sizeof(Header));
+
+		for (size_t i = 0; i < Utility::ArraySize(EventNames); ++i)
+		{
+			const u8 EventType[2] = { static_cast<u8>(EventPhases[i]), static_cast<u8>(strlen(EventNames[i])) };
+			WriteData(EventType, sizeof(EventType));
+			WriteData(EventNames[i], EventType[1]);
+		}
+
+		for (const TCoreBuffer& Buffer : s_Buffers)
+		{
+			WriteData(&Buffer.nWriteIndex, sizeof(Buffer.nWriteIndex));
+			WriteData(Buffer.Records, sizeof(Buffer.Records));
+		}
+
+		if (f_close(&File) != FR_OK)
+			bResult = false;
+	}
+
+	CFileSystemLock::Release();
+
+	if (bResult)
+		LOGNOTE("Trace saved to %s", pPath);
+	else
+		LOGWARN("Couldn't write trace to %s", pPath);
+
+	s_bDumpPending.store(false, std::memory_order_relaxed);
+	if (s_bResumeAfterDump.exchange(false, std::memory_order_relaxed))
+		Resume();
+
+	return bResult;
+}
@@ -34,13 +34,16 @@ LOGMODULE("zoneallocator");
 
 constexpr size_t MallocHeapSize = 32 * MEGABYTE;
 
+// Smallest region carved from the heap for an arena; larger blocks get a chunk of their own
+constexpr size_t ArenaChunkSize = MEGABYTE;
+
 CZoneAllocator* CZoneAllocator::s_pThis = nullptr;
 
 CZoneAllocator::CZoneAllocator()
 	: m_pHeap(nullptr),
 	  m_nHeapSize(0),
-	  m_pCurrentBlock(nullptr),
-	  m_nAllocCount(0)
+	  m_nUsedSize(0),
+	  m_nPeakSize(0)
 {
 	assert(s_pThis == nullptr);
 	s_pThis = this;
@@ -105,58 +108,308 @@ bool CZoneAllocator::Initialize()
 
 void* CZoneAllocator::Alloc(size_t nSize, TZoneTag Tag)
 {
-	if (!nSize)
-		return nullptr;
+	TArena& Arena = GetArena(Tag);
 
-	if (Tag == TZoneTag::Free)
-	{
-		LOGERR("Zone allocation failed: tag value of 0 was used");
-		return nullptr;
-	}
+	Arena.Lock.Acquire();
+	void* pPtr = UnlockedAlloc(Arena, nSize, Tag);
+	Arena.Lock.Release();
+	return pPtr;
+}
 
-	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
-	nSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
+void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
+{
+	// If passed a null pointer, perform a new allocation
+	if (!pPtr)
+		return Alloc(nSize, Tag);
 
-	TBlock* pNextBlock      = m_pCurrentBlock;
-	TBlock* pCandidateBlock = m_pCurrentBlock;
-	TBlock* pStartBlock     = m_pCurrentBlock->pPrevious;
+	TBlock* pBlock = reinterpret_cast<TBlock*>(pPtr) - 1;
+	TArena& Arena  = GetArena(pBlock->Tag);
 
-	do
+	// Blocks can't change arena in-place; allocate a new block with the new tag and move contents
+	if (nSize && Tag != TZoneTag::Free && pBlock->Tag != TZoneTag::Free && &GetArena(Tag) != &Arena)
 	{
-		// We've been through the whole linked list and couldn't find a free block
-		if (pNextBlock == pStartBlock)
+		const size_t nSrcSize = pBlock->nSize - sizeof(TBlock) - sizeof(BlockMagic);
+		void* pDest           = Alloc(nSize, Tag);
+
+		if (!pDest)
 		{
-			LOGERR("Zone allocation failed: couldn't allocate %d bytes", nSize);
+			LOGERR("Zone reallocation failed");
 			return nullptr;
 		}
 
-		// This block is in use; look at the next one
-		if (pNextBlock->Tag != TZoneTag::Free)
-			pCandidateBlock = pNextBlock->pNext;
+		memcpy(pDest, pPtr, Utility::Min(nSrcSize, nSize));
+		Free(pPtr);
+
+#ifdef ZONE_ALLOCATOR_TRACE
+		LOGDBG("Moved block at %p to the arena for tag %x", pPtr, Tag);
+#endif
 
-		pNextBlock = pNextBlock->pNext;
-	} while (pCandidateBlock->Tag || pCandidateBlock->nSize < nSize);
+		return pDest;
+	}
 
-	// Create a new block for any remaining free space
-	const size_t nRemaining = pCandidateBlock->nSize - nSize;
-	if (nRemaining > MinFragmentSize)
+	Arena.Lock.Acquire();
+	pPtr = UnlockedRealloc(Arena, pPtr, nSize, Tag);
+	Arena.Lock.Release();
+	return pPtr;
+}
+
+void CZoneAllocator::Free(void* pPtr)
+{
+	if (!pPtr)
+		return;
+
+	TArena& Arena = GetArena((reinterpret_cast<TBlock*>(pPtr) - 1)->Tag);
+
+	Arena.Lock.Acquire();
+	UnlockedFree(Arena, pPtr);
+	Arena.Lock.Release();
+}
+
+size_t CZoneAllocator::GetBlockSize(size_t nSize)
+{
+	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
+	nSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
+
+	// Must be able to hold the free list links once freed
+	return Utility::Max(nSize, MinBlockSize);
+}
+
+size_t CZoneAllocator::GetBin(size_t nBlockSize)
+{
+	if (nBlockSize <= SmallBinMaxSize)
+		return nBlockSize / 16 - 1;
+
+	// Index of most significant bit; 10 for sizes just above SmallBinMaxSize
+	const size_t nLog2 = sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(nBlockSize);
+	return Utility::Min(SmallBinCount + nLog2 - 10, BinCount - 1);
+}
+
+// Must be called with the arena's lock held
+void CZoneAllocator::AddUsage(TArena& Arena, size_t nBlockSize)
+{
+	TTagStats& Stats = Arena.Stats;
+	Stats.nUsedSize += nBlockSize;
+	Stats.nPeakSize = Utility::Max(Stats.nPeakSize, Stats.nUsedSize);
+	++Stats.nAllocCount;
+}
+
+// Must be called with the arena's lock held
+void CZoneAllocator::RemoveUsage(TArena& Arena, size_t nBlockSize)
+{
+	TTagStats& Stats = Arena.Stats;
+	Stats.nUsedSize -= nBlockSize;
+	--Stats.nAllocCount;
+}
+
+CZoneAllocator::TBlock* CZoneAllocator::FindFreeBlock(const TArena& Arena, size_t nBlockSize)
+{
+	size_t nBin = GetBin(nBlockSize);
+
+	// Any block in a small size class is big enough; larger size classes hold a range of sizes, so search the list
+	for (TBlock* pBlock = Arena.pFreeLists[nBin]; pBlock; pBlock = GetFreeLinks(pBlock).pNextFree)
 	{
-		TBlock* pNewBlock    = reinterpret_cast<TBlock*>(reinterpret_cast<u8*>(pCandidateBlock) + nSize);
-		pNewBlock->nSize     = nRemaining;
-		pNewBlock->pNext     = pCandidateBlock->pNext;
-		pNewBlock->pPrevious = pCandidateBlock;
-		pNewBlock->Tag       = TZoneTag::Free;
-		pNewBlock->nMagic    = BlockMagic;
+		if (pBlock->nSize >= nBlockSize)
+			return pBlock;
+	}
+
+	// Any block in a larger size class is big enough
+	for (++nBin; nBin < BinCount; nBin = (nBin + 64) & ~63)
+	{
+		const u64 nMask = Arena.nBinMask[nBin / 64] & (~0ull << (nBin % 64));
+		if (nMask)
+			return Arena.pFreeLists[(nBin & ~63) + __builtin_ctzll(nMask)];
+	}
+
+	return nullptr;
+}
+
+void CZoneAllocator::InsertFreeBlock(TArena& Arena, TBlock* pBlock)
+{
+	const size_t nBin = GetBin(pBlock->nSize);
+	TFreeLinks& Links = GetFreeLinks(pBlock);
+
+	Links.pNextFree     = Arena.pFreeLists[nBin];
+	Links.pPreviousFree = nullptr;
+	if (Links.pNextFree)
+		GetFreeLinks(Links.pNextFree).pPreviousFree = pBlock;
+
+	Arena.pFreeLists[nBin] = pBlock;
+	Arena.nBinMask[nBin / 64] |= 1ull << (nBin % 64);
+	++Arena.nFreeBlocks;
+}
+
+void CZoneAllocator::RemoveFreeBlock(TArena& Arena, TBlock* pBlock)
+{
+	const size_t nBin = GetBin(pBlock->nSize);
+	TFreeLinks& Links = GetFreeLinks(pBlock);
+
+	if (Links.pPreviousFree)
+		GetFreeLinks(Links.pPreviousFree).pNextFree = Links.pNextFree;
+	else
+		Arena.pFreeLists[nBin] = Links.pNextFree;
+
+	if (Links.pNextFree)
+		GetFreeLinks(Links.pNextFree).pPreviousFree = Links.pPreviousFree;
+
+	if (!Arena.pFreeLists[nBin])
+		Arena.nBinMask[nBin / 64] &= ~(1ull << (nBin % 64));
+	--Arena.nFreeBlocks;
+}
+
+// Trims a block to the given size, returning any remaining space to the free lists
+void CZoneAllocator::SplitBlock(TArena& Arena, TBlock* pBlock, size_t nBlockSize)
+{
+	const size_t nRemaining = pBlock->nSize - nBlockSize;
+	if (nRemaining < MinBlockSize)
+		return;
+
+	TBlock* pNewBlock    = reinterpret_cast<TBlock*>(reinterpret_cast<u8*>(pBlock) + nBlockSize);
+	pNewBlock->nSize     = nRemaining;
+	pNewBlock->pNext     = pBlock->pNext;
+	pNewBlock->pPrevious = pBlock;
+	pNewBlock->Tag       = TZoneTag::Free;
+	pNewBlock->nMagic    = BlockMagic;
 #if AARCH == 32
-		memset(pNewBlock->Padding, 0xEB, Utility::ArraySize(pNewBlock->Padding));
+	memset(pNewBlock->Padding, 0xEB, Utility::ArraySize(pNewBlock->Padding));
 #endif
-		// Set the next block's previous to look at the new block
+	// Set the next block's previous to look at the new block
+	pNewBlock->pNext->pPrevious = pNewBlock;
+
+	pBlock->nSize = nBlockSize;
+	pBlock->pNext = pNewBlock;
+
+	// Join with next block if next block is also free
+	TBlock* pAdjacentBlock = pNewBlock->pNext;
+	if (pAdjacentBlock->Tag == TZoneTag::Free)
+	{
+		RemoveFreeBlock(Arena, pAdjacentBlock);
+		pNewBlock->nSize += pAdjacentBlock->nSize;
+		pNewBlock->pNext            = pAdjacentBlock->pNext;
 		pNewBlock->pNext->pPrevious = pNewBlock;
+	}
+
+	InsertFreeBlock(Arena, pNewBlock);
+}
+
+// Carves a chunk for the arena out of the heap, returning its free block; must be called with the arena's lock held
+CZoneAllocator::TBlock* CZoneAllocator::AddChunk(TArena& Arena, size_t nBlockSize, TZoneTag Tag)
+{
+	const size_t nChunkSize = GetBlockSize(sizeof(TChunk) + Utility::Max(nBlockSize, ArenaChunkSize));
+
+	m_Heap.Lock.Acquire();
+
+	TBlock* pChunkBlock = FindFreeBlock(m_Heap, nChunkSize);
+	if (pChunkBlock)
+	{
+		RemoveFreeBlock(m_Heap, pChunkBlock);
+		SplitBlock(m_Heap, pChunkBlock, nChunkSize);
+		pChunkBlock->Tag         = Tag;
+		pChunkBlock->nMagic      = BlockMagic;
+		GetEndMagic(pChunkBlock) = BlockMagic;
+
+		m_nUsedSize += pChunkBlock->nSize;
+		m_nPeakSize = Utility::Max(m_nPeakSize, m_nUsedSize);
+	}
+
+	m_Heap.Lock.Release();
+
+	if (!pChunkBlock)
+		return nullptr;
+
+	// The chunk may be larger than requested if the remainder was too small to split off
+	TChunk* pChunk      = reinterpret_cast<TChunk*>(pChunkBlock + 1);
+	TBlock* pSentinel   = &pChunk->Sentinel;
+	TBlock* pFirstBlock = reinterpret_cast<TBlock*>(pChunk + 1);
+
+	pSentinel->nSize     = 0;
+	pSentinel->pNext     = pFirstBlock;
+	pSentinel->pPrevious = pFirstBlock;
+	pSentinel->Tag       = TZoneTag::Uncategorized;
+	pSentinel->nMagic    = 0;
+#if AARCH == 32
+	memset(pSentinel->Padding, 0xEB, Utility::ArraySize(pSentinel->Padding));
+#endif
+
+	pFirstBlock->nSize     = (pChunkBlock->nSize - sizeof(TBlock) - sizeof(TChunk) - sizeof(BlockMagic)) & ~0xF;
+	pFirstBlock->pNext     = pSentinel;
+	pFirstBlock->pPrevious = pSentinel;
+	pFirstBlock->Tag       = TZoneTag::Free;
+	pFirstBlock->nMagic    = BlockMagic;
+#if AARCH == 32
+	memset(pFirstBlock->Padding, 0xEB, Utility::ArraySize(pFirstBlock->Padding));
+#endif
+
+	pChunk->pNext     = Arena.pChunks;
+	pChunk->pPrevious = nullptr;
+	if (pChunk->pNext)
+		pChunk->pNext->pPrevious = pChunk;
+	Arena.pChunks = pChunk;
+
+	InsertFreeBlock(Arena, pFirstBlock);
+
+#ifdef ZONE_ALLOCATOR_TRACE
+	LOGDBG("Added a %d byte chunk at %p for tag %x", pChunkBlock->nSize, pChunk, Tag);
+#endif
+
+	return pFirstBlock;
+}
+
+// Returns an empty chunk to the heap; must be called with the arena's lock held
+void CZoneAllocator::ReleaseChunk(TArena& Arena, TChunk* pChunk)
+{
+	RemoveFreeBlock(Arena, pChunk->Sentinel.pNext);
+
+	if (pChunk->pPrevious)
+		pChunk->pPrevious->pNext = pChunk->pNext;
+	else
+		Arena.pChunks = pChunk->pNext;
+
+	if (pChunk->pNext)
+		pChunk->pNext->pPrevious = pChunk->pPrevious;
+
+	m_Heap.Lock.Acquire();
+	m_nUsedSize -= GetChunkBlock(pChunk)->nSize;
+	FreeBlock(m_Heap, GetChunkBlock(pChunk));
+	m_Heap.Lock.Release();
+
+#ifdef ZONE_ALLOCATOR_TRACE
+	LOGDBG("Released chunk at %p", pChunk);
+#endif
+}
+
+void CZoneAllocator::ResetArena(TArena& Arena)
+{
+	memset(Arena.pFreeLists, 0, sizeof(Arena.pFreeLists));
+	memset(Arena.nBinMask, 0, sizeof(Arena.nBinMask));
+	Arena.nFreeBlocks = 0;
+	Arena.pChunks     = nullptr;
+}
+
+void* CZoneAllocator::UnlockedAlloc(TArena& Arena, size_t nSize, TZoneTag Tag)
+{
+	if (!nSize)
+		return nullptr;
+
+	if (Tag == TZoneTag::Free)
+	{
+		LOGERR("Zone allocation failed: tag value of 0 was used");
+		return nullptr;
+	}
+
+	nSize = GetBlockSize(nSize);
 
-		pCandidateBlock->nSize = nSize;
-		pCandidateBlock->pNext = pNewBlock;
+	// Only take space from the heap when the tag's chunks are full
+	TBlock* pCandidateBlock = FindFreeBlock(Arena, nSize);
+	if (!pCandidateBlock && !(pCandidateBlock = AddChunk(Arena, nSize, Tag)))
+	{
+		LOGERR("Zone allocation failed: couldn't allocate %d bytes", nSize);
+		return nullptr;
 	}
 
+	// Create a new block for any remaining free space
+	RemoveFreeBlock(Arena, pCandidateBlock);
+	SplitBlock(Arena, pCandidateBlock, nSize);
+
 	// Mark block used
 	pCandidateBlock->Tag    = Tag;
 	pCandidateBlock->nMagic = BlockMagic;
@@ -164,31 +417,23 @@ void* CZoneAllocator::Alloc(size_t nSize, TZoneTag Tag)
 	// Mark end of memory with magic number
 	GetEndMagic(pCandidateBlock) = BlockMagic;
 
-	// Next allocation will start looking at this block
-	m_pCurrentBlock = pCandidateBlock->pNext;
-
 #ifdef ZONE_ALLOCATOR_TRACE
 	LOGDBG("Allocated %d bytes for tag %x", nSize, Tag);
 #endif
 
-	// Increment alloc counter
-	++m_nAllocCount;
+	AddUsage(Arena, pCandidateBlock->nSize);
 
 	return pCandidateBlock + 1;
 }
 
-void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
+void* CZoneAllocator::UnlockedRealloc(TArena& Arena, void* pPtr, size_t nSize, TZoneTag Tag)
 {
-	// If passed a null pointer, perform a new allocation
-	if (!pPtr)
-		return Alloc(nSize, Tag);
-
 	if (!nSize)
 		return nullptr;
 
-	// Account for size of block header and magic number at end of zone (for corruption detection), padded to 16 bytes
-	const size_t nNewSize = (nSize + sizeof(TBlock) + sizeof(BlockMagic) + 0xF) & ~0xF;
+	const size_t nNewSize = GetBlockSize(nSize);
 	TBlock* pBlock        = reinterpret_cast<TBlock*>(pPtr) - 1;
+	const size_t nOldSize = pBlock->nSize;
 
 	if (Tag == TZoneTag::Free)
 	{
@@ -203,32 +448,22 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 	}
 
 	// Expand block
-	if (nNewSize > pBlock->nSize)
+	if (nNewSize > nOldSize)
 	{
-		const size_t nSizeDiff = nNewSize - pBlock->nSize;
+		TBlock* pAdjacentBlock = pBlock->pNext;
 
 		// Expand in-place if next block is free and large enough
-		if (pBlock->pNext->Tag == TZoneTag::Free && pBlock->pNext->nSize >= nSizeDiff)
+		if (pAdjacentBlock->Tag == TZoneTag::Free && nOldSize + pAdjacentBlock->nSize >= nNewSize)
 		{
-			TBlock* pNewBlock = reinterpret_cast<TBlock*>(reinterpret_cast<u8*>(pBlock) + nNewSize);
-
-			pNewBlock->nSize            = pBlock->pNext->nSize - nSizeDiff;
-			pNewBlock->pNext            = pBlock->pNext->pNext;
-			pNewBlock->pNext->pPrevious = pNewBlock;
-			pNewBlock->pPrevious        = pBlock;
-			pNewBlock->Tag              = TZoneTag::Free;
-			pNewBlock->nMagic           = BlockMagic;
-#if AARCH == 32
-			memset(pNewBlock->Padding, 0xEB, Utility::ArraySize(pNewBlock->Padding));
-#endif
-			GetEndMagic(pNewBlock) = BlockMagic;
+			RemoveUsage(Arena, nOldSize);
+			RemoveFreeBlock(Arena, pAdjacentBlock);
+			pBlock->nSize += pAdjacentBlock->nSize;
+			pBlock->pNext            = pAdjacentBlock->pNext;
+			pBlock->pNext->pPrevious = pBlock;
 
-			// Next allocations search from this new merged free block
-			if (pBlock->pNext == m_pCurrentBlock)
-				m_pCurrentBlock = pNewBlock;
+			SplitBlock(Arena, pBlock, nNewSize);
+			AddUsage(Arena, pBlock->nSize);
 
-			pBlock->nSize       = nNewSize;
-			pBlock->pNext       = pNewBlock;
 			pBlock->Tag         = Tag;
 			GetEndMagic(pBlock) = BlockMagic;
 
@@ -242,8 +477,8 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 		// Allocate a new block and move contents
 		else
 		{
-			const size_t nSrcSize = pBlock->nSize - sizeof(TBlock) - sizeof(BlockMagic);
-			void* pDest           = Alloc(nSize, Tag);
+			const size_t nSrcSize = nOldSize - sizeof(TBlock) - sizeof(BlockMagic);
+			void* pDest           = UnlockedAlloc(Arena, nSize, Tag);
 
 			if (!pDest)
 			{
@@ -252,7 +487,7 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 			}
 
 			memcpy(pDest, pPtr, nSrcSize);
-			Free(pPtr);
+			UnlockedFree(Arena, pPtr);
 
 #ifdef ZONE_ALLOCATOR_TRACE
 			LOGDBG("Expanded block at %p by allocating new block", pPtr);
@@ -262,65 +497,27 @@ void* CZoneAllocator::Realloc(void* pPtr, size_t nSize, TZoneTag Tag)
 		}
 	}
 
-	// Shrink in-place
-	if (nNewSize < pBlock->nSize)
+	// Shrink in-place; the freed space is merged with the next block if it is also free
+	RemoveUsage(Arena, nOldSize);
+	if (nNewSize < nOldSize)
 	{
-		const size_t nRemain = pBlock->nSize - nNewSize;
-		if (nRemain > MinFragmentSize)
-		{
-			TBlock* pNewBlock = reinterpret_cast<TBlock*>(reinterpret_cast<u8*>(pBlock) + nNewSize);
+		SplitBlock(Arena, pBlock, nNewSize);
 
-			if (pBlock->pNext->Tag == TZoneTag::Free)
-			{
-				// Merge free space with next block if it is also free
-				*pNewBlock = *pBlock->pNext;
-				pNewBlock->nSize += nRemain;
-#ifdef ZONE_ALLOCATOR_TRACE
-				LOGDBG("Shrunk block at %p in-place; adjacent free space expanded", pPtr);
-#endif
-			}
-			else
-			{
-				// Create a new block for any remaining free space
-				pNewBlock->nSize     = nRemain;
-				pNewBlock->pNext     = pBlock->pNext;
-				pNewBlock->pPrevious = pBlock;
-				pNewBlock->Tag       = TZoneTag::Free;
-				pNewBlock->nMagic    = BlockMagic;
-#if AARCH == 32
-				memset(pNewBlock->Padding, 0xEB, Utility::ArraySize(pNewBlock->Padding));
-#endif
-				GetEndMagic(pNewBlock) = BlockMagic;
 #ifdef ZONE_ALLOCATOR_TRACE
-				LOGDBG("Shrunk block at %p in-place; new free block inserted after", pPtr);
+		LOGDBG("Shrunk block at %p in-place", pPtr);
 #endif
-			}
-
-			// Next allocations search from this new merged free block
-			if (pBlock->pNext == m_pCurrentBlock)
-				m_pCurrentBlock = pNewBlock;
-
-			// Set the next block's previous to look at the new block
-			pNewBlock->pNext->pPrevious = pNewBlock;
-
-			pBlock->pNext = pNewBlock;
-		}
-
-		pBlock->nSize = nNewSize;
-		pBlock->Tag   = Tag;
-
-		// Mark end of memory with magic number
-		GetEndMagic(pBlock) = BlockMagic;
-
-		return pBlock + 1;
 	}
 
-	// Size is the same, just update tag
+	AddUsage(Arena, pBlock->nSize);
 	pBlock->Tag = Tag;
+
+	// Mark end of memory with magic number
+	GetEndMagic(pBlock) = BlockMagic;
+
 	return pPtr;
 }
 
-void CZoneAllocator::Free(void* pPtr)
+void CZoneAllocator::UnlockedFree(TArena& Arena, void* pPtr)
 {
 	if (!pPtr)
 		return;
@@ -339,6 +536,17 @@ void CZoneAllocator::Free(void* pPtr)
 		return;
 	}
 
+	RemoveUsage(Arena, pBlock->nSize);
+	pBlock = FreeBlock(Arena, pBlock);
+
+	// Give the chunk back to the heap once its only block is free; the sentinel is the first member of the chunk
+	if (pBlock->pPrevious == pBlock->pNext)
+		ReleaseChunk(Arena, reinterpret_cast<TChunk*>(pBlock->pPrevious));
+}
+
+// Returns the free block that the given block was merged into
+CZoneAllocator::TBlock* CZoneAllocator::FreeBlock(TArena& Arena, TBlock* pBlock)
+{
 	// Mark this block as free
 	pBlock->Tag = TZoneTag::Free;
 
@@ -346,14 +554,12 @@ void CZoneAllocator::Free(void* pPtr)
 	TBlock* pAdjacentBlock = pBlock->pPrevious;
 	if (pAdjacentBlock->Tag == TZoneTag::Free)
 	{
+		RemoveFreeBlock(Arena, pAdjacentBlock);
 		pAdjacentBlock->nSize += pBlock->nSize;
 		pAdjacentBlock->pNext            = pBlock->pNext;
 		pAdjacentBlock->pNext->pPrevious = pAdjacentBlock;
-		// Next allocations search from this new merged free block
-		if (pBlock == m_pCurrentBlock)
-			m_pCurrentBlock = pAdjacentBlock;
 #ifdef ZONE_ALLOCATOR_TRACE
-		LOGDBG("Merged freed block at %p with previous block at %p", pPtr, pAdjacentBlock);
+		LOGDBG("Merged freed block at %p with previous block at %p", pBlock + 1, pAdjacentBlock);
 #endif
 		pBlock = pAdjacentBlock;
 	}
@@ -362,18 +568,18 @@ void CZoneAllocator::Free(void* pPtr)
 	pAdjacentBlock = pBlock->pNext;
 	if (pAdjacentBlock->Tag == TZoneTag::Free)
 	{
+		RemoveFreeBlock(Arena, pAdjacentBlock);
 		pBlock->nSize += pAdjacentBlock->nSize;
 		pBlock->pNext            = pAdjacentBlock->pNext;
 		pBlock->pNext->pPrevious = pBlock;
-		if (pAdjacentBlock == m_pCurrentBlock)
-			m_pCurrentBlock = pBlock;
 #ifdef ZONE_ALLOCATOR_TRACE
-		LOGDBG("Merged freed block at %p with next block at %p", pPtr, pAdjacentBlock);
+		LOGDBG("Merged freed block at %p with next block at %p", pBlock, pAdjacentBlock);
 #endif
 	}
 
-	// Decrement allocation counter
-	--m_nAllocCount;
+	InsertFreeBlock(Arena, pBlock);
+
+	return pBlock;
 }
 
 void CZoneAllocator::Clear()
@@ -400,48 +606,171 @@ void CZoneAllocator::Clear()
 	memset(pFirstBlock->Padding, 0xEB, Utility::ArraySize(pFirstBlock->Padding));
 #endif
 
-	m_pCurrentBlock = pFirstBlock;
+	ResetArena(m_Heap);
+	InsertFreeBlock(m_Heap, pFirstBlock);
+
+	for (TArena& Arena : m_Arenas)
+	{
+		ResetArena(Arena);
+		memset(&Arena.Stats, 0, sizeof(Arena.Stats));
+	}
+
+	m_nUsedSize = 0;
+	m_nPeakSize = 0;
 }
 
-void CZoneAllocator::FreeTag(u32 Tag)
+// Tags without an arena of their own share the uncategorized arena, and are freed along with it
+void CZoneAllocator::FreeTag(u32 nTag)
 {
-	if (Tag == TZoneTag::Free)
+	if (nTag == TZoneTag::Free || nTag >= TagCount)
 	{
 		LOGERR("Attempted to free an invalid tag");
 		return;
 	}
 
-	TBlock* pBlock = m_MainBlock.pNext;
-	TBlock* pNextBlock;
+	TArena& Arena = m_Arenas[nTag];
 
-	do
+	Arena.Lock.Acquire();
+
+	m_Heap.Lock.Acquire();
+	for (TChunk* pChunk = Arena.pChunks; pChunk;)
 	{
-		// Grab the next block before freeing this one
-		pNextBlock = pBlock->pNext;
-		if (pBlock->Tag == Tag)
-			Free(reinterpret_cast<u8*>(pBlock) + sizeof(TBlock));
-		pBlock = pNextBlock;
-	} while (pBlock != &m_MainBlock);
+		TChunk* pNextChunk = pChunk->pNext;
+		m_nUsedSize -= GetChunkBlock(pChunk)->nSize;
+		FreeBlock(m_Heap, GetChunkBlock(pChunk));
+		pChunk = pNextChunk;
+	}
+	m_Heap.Lock.Release();
+
+	Arena.Stats.nUsedSize   = 0;
+	Arena.Stats.nAllocCount = 0;
+	ResetArena(Arena);
+
+	Arena.Lock.Release();
 }
 
 void CZoneAllocator::Dump() const
 {
 	LOGNOTE("Allocation diagnostics:");
+	DumpBlocks(&m_MainBlock, "");
+}
 
-	TBlock* pBlock = m_MainBlock.pNext;
+// Every block in use in the heap is a chunk, whose own blocks are listed beneath it
+void CZoneAllocator::DumpBlocks(const TBlock* pSentinel, const char* pIndent) const
+{
+	TBlock* pBlock = pSentinel->pNext;
 
 	do
 	{
-		LOGNOTE("Block address %p (%s):", pBlock, pBlock->Tag ? "IN-USE" : "FREE");
+		LOGNOTE("%sBlock address %p (%s):", pIndent, pBlock, pBlock->Tag ? "IN-USE" : "FREE");
 
 		// If the block is free, it doesn't need a valid tail magic
 		const bool bMagicOK = (pBlock->nMagic == BlockMagic) && (!pBlock->Tag || GetEndMagic(pBlock) == BlockMagic);
 		if (!bMagicOK)
 			LOGWARN("WARNING: This memory block is probably corrupt!");
 
-		LOGNOTE("\tSize:  %d bytes", pBlock->nSize);
-		LOGNOTE("\tTag:   0x%x", pBlock->Tag);
-		LOGNOTE("\tMagic: %s", bMagicOK ? "OK" : "BAD");
+		LOGNOTE("%s\tSize:  %d bytes", pIndent, pBlock->nSize);
+		LOGNOTE("%s\tTag:   0x%x", pIndent, pBlock->Tag);
+		LOGNOTE("%s\tMagic: %s", pIndent, bMagicOK ? "OK" : "BAD");
+
+		if (pSentinel == &m_MainBlock && pBlock->Tag && bMagicOK)
+			DumpBlocks(&reinterpret_cast<const TChunk*>(pBlock + 1)->Sentinel, "\t");
+
 		pBlock = pBlock->pNext;
-	} while (pBlock != &m_MainBlock);
+	} while (pBlock != pSentinel);
+}
+
+// Must be called with the arena's lock held
+size_t CZoneAllocator::GetLargestFreeBlock(const TArena& Arena)
+{
+	// The largest free block is in the highest non-empty size class
+	for (size_t i = Utility::ArraySize(Arena.nBinMask); i-- > 0;)
+	{
+		if (!Arena.nBinMask[i])
+			continue;
+
+		const size_t nBin = i * 64 + 63 - __builtin_clzll(Arena.nBinMask[i]);
+		size_t nLargestSize = 0;
+		for (TBlock* pBlock = Arena.pFreeLists[nBin]; pBlock; pBlock = GetFreeLinks(pBlock).pNextFree)
+			nLargestSize = Utility::Max(nLargestSize, pBlock->nSize);
+
+		return nLargestSize;
+	}
+
+	return 0;
+}
+
+void CZoneAllocator::GetStats(TStats& OutStats)
+{
+	// Space left in a tag's chunks only serves that tag, so the largest free block is taken from the heap
+	m_Heap.Lock.Acquire();
+	OutStats.nHeapSize         = m_nHeapSize;
+	OutStats.nUsedSize         = m_nUsedSize;
+	OutStats.nPeakSize         = m_nPeakSize;
+	OutStats.nFreeSize         = m_nHeapSize - m_nUsedSize;
+	OutStats.nFreeBlocks       = m_Heap.nFreeBlocks;
+	OutStats.nLargestFreeBlock = GetLargestFreeBlock(m_Heap);
+	m_Heap.Lock.Release();
+
+	memset(OutStats.Tags, 0, sizeof(OutStats.Tags));
+	for (size_t i = TZoneTag::Uncategorized; i < TagCount; ++i)
+	{
+		TArena& Arena = m_Arenas[i];
+
+		Arena.Lock.Acquire();
+		OutStats.Tags[i] = Arena.Stats;
+		OutStats.nFreeBlocks += Arena.nFreeBlocks;
+		Arena.Lock.Release();
+	}
+
+	const size_t nFreeSize = OutStats.nFreeSize;
+	OutStats.nFragmentation = nFreeSize ? static_cast<u64>(nFreeSize - OutStats.nLargestFreeBlock) * 100 / nFreeSize : 0;
+}
+
+// Sum of the arenas' counts; may be slightly out of date if other cores are allocating
+size_t CZoneAllocator::GetAllocCount() const
+{
+	size_t nAllocCount = 0;
+	for (const TArena& Arena : m_Arenas)
+		nAllocCount += Arena.Stats.nAllocCount;
+
+	return nAllocCount;
+}
+
+void CZoneAllocator::ResetPeaks()
+{
+	m_Heap.Lock.Acquire();
+	m_nPeakSize = m_nUsedSize;
+	m_Heap.Lock.Release();
+
+	for (TArena& Arena : m_Arenas)
+	{
+		Arena.Lock.Acquire();
+		Arena.Stats.nPeakSize = Arena.Stats.nUsedSize;
+		Arena.Lock.Release();
+	}
+}
+
+void CZoneAllocator::DumpStats()
+{
+	TStats Stats;
+	GetStats(Stats);
+
+	LOGNOTE("Heap: %d/%d KB used (peak %d KB), %d KB free in %d blocks, largest %d KB, %d%% fragmented",
+		Stats.nUsedSize / KILOBYTE, Stats.nHeapSize / KILOBYTE, Stats.nPeakSize / KILOBYTE, Stats.nFreeSize / KILOBYTE,
+		Stats.nFreeBlocks, Stats.nLargestFreeBlock / KILOBYTE, Stats.nFragmentation);
+
+	for (size_t i = TZoneTag::Uncategorized; i < TagCount; ++i)
+	{
+		const TTagStats& TagStats = Stats.Tags[i];
+		LOGNOTE("%s: %d KB in %d blocks (peak %d KB)", GetTagName(i), TagStats.nUsedSize / KILOBYTE, TagStats.nAllocCount, TagStats.nPeakSize / KILOBYTE);
+	}
+}
+
+const char* CZoneAllocator::GetTagName(u32 nTag)
+{
+	static const char* const TagNames[] = { "Free", "Uncategorized", "FluidSynth", "FluidSynth samples", "SoundFont 1", "SoundFont 2", "SoundFont 3", "SoundFont 4" };
+	static_assert(Utility::ArraySize(TagNames) == TagCount, "Every tag must be named");
+
+	return nTag < TagCount ? TagNames[nTag] : "Unknown";
 }